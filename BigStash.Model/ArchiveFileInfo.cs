@@ -66,6 +66,14 @@ namespace BigStash.Model
         [JsonProperty("uploadid")]
         public string UploadId { get; set; }
 
+        /// <summary>
+        /// Part size chosen when the multipart upload was initiated.
+        /// A resumed upload must use the same part size. 0 for uploads
+        /// initiated before the part size was stored, which used 5 MB parts.
+        /// </summary>
+        [JsonProperty("part_size")]
+        public long PartSize { get; set; }
+
         /// <summary>
         /// Serialize ArchiveFileInfo to JSON string
         /// </summary>
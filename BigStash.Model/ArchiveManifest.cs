@@ -10,6 +10,7 @@ namespace BigStash.Model
     public class ArchiveManifest
     {
         private IList<FileManifest> _files = new List<FileManifest>();
+        private IList<PackManifest> _packs = new List<PackManifest>();
 
         /// <summary>
         /// Archive ID.
@@ -33,6 +34,21 @@ namespace BigStash.Model
             set { this._files = value; }
         }
 
+        /// <summary>
+        /// Pack objects holding the small files, if any were packed.
+        /// </summary>
+        [JsonProperty("packs")]
+        public IList<PackManifest> Packs
+        {
+            get { return this._packs; }
+            set { this._packs = value; }
+        }
+
+        public bool ShouldSerializePacks()
+        {
+            return this._packs != null && this._packs.Count > 0;
+        }
+
         /// <summary>
         /// Serialize ArchiveFileInfo to JSON string
         /// </summary>
@@ -39,6 +39,65 @@ namespace BigStash.Model
         [JsonProperty("md5")]
         public string MD5 { get; set; }
 
+        /// <summary>
+        /// Key of the pack object holding the file, null when the file
+        /// was uploaded as an object of its own.
+        /// </summary>
+        [JsonProperty("pack_key", NullValueHandling = NullValueHandling.Ignore)]
+        public string PackKey { get; set; }
+
+        /// <summary>
+        /// Offset of the file in its pack object.
+        /// </summary>
+        [JsonProperty("pack_offset", NullValueHandling = NullValueHandling.Ignore)]
+        public long? PackOffset { get; set; }
+
+        /// <summary>
+        /// Key of the file with the same content that was uploaded
+        /// in this one's place, null when the file was uploaded.
+        /// </summary>
+        [JsonProperty("duplicate_of", NullValueHandling = NullValueHandling.Ignore)]
+        public string DuplicateOf { get; set; }
+
+        /// <summary>
+        /// How the object stores the file ("gzip", "zstd"), null when
+        /// as it is. Size is then the size of the object.
+        /// </summary>
+        [JsonProperty("codec", NullValueHandling = NullValueHandling.Ignore)]
+        public string Codec { get; set; }
+
+        /// <summary>
+        /// File size on disk when the object is compressed.
+        /// </summary>
+        [JsonProperty("original_size", NullValueHandling = NullValueHandling.Ignore)]
+        public long? OriginalSize { get; set; }
+
+        /// <summary>
+        /// How the object's parts are encrypted ("aes-256-gcm"), null
+        /// when they are not. Every part is followed by its 16 byte tag.
+        /// </summary>
+        [JsonProperty("encryption", NullValueHandling = NullValueHandling.Ignore)]
+        public string Encryption { get; set; }
+
+        /// <summary>
+        /// ID of the key the parts are encrypted with.
+        /// </summary>
+        [JsonProperty("key_id", NullValueHandling = NullValueHandling.Ignore)]
+        public string KeyId { get; set; }
+
+        /// <summary>
+        /// The file's nonce in hex. Part n is encrypted under the nonce
+        /// with n xored into its last four bytes.
+        /// </summary>
+        [JsonProperty("nonce", NullValueHandling = NullValueHandling.Ignore)]
+        public string Nonce { get; set; }
+
+        /// <summary>
+        /// Bytes each encrypted part holds before its tag.
+        /// </summary>
+        [JsonProperty("part_size", NullValueHandling = NullValueHandling.Ignore)]
+        public long? PartSize { get; set; }
+
         /// <summary>
         /// Serialize FileManifest to JSON string
         /// </summary>
@@ -0,0 +1,36 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Threading.Tasks;
+using Newtonsoft.Json;
+
+namespace BigStash.Model
+{
+    public class PackManifest
+    {
+        /// <summary>
+        /// Key name for the S3 Object holding the packed files.
+        /// </summary>
+        [JsonProperty("key_name")]
+        public string KeyName { get; set; }
+
+        /// <summary>
+        /// Pack size, the sum of the packed file sizes.
+        /// </summary>
+        [JsonProperty("size")]
+        public long Size { get; set; }
+
+        /// <summary>
+        /// Pack Hash.
+        /// </summary>
+        [JsonProperty("md5")]
+        public string MD5 { get; set; }
+
+        /// <summary>
+        /// Number of files in the pack.
+        /// </summary>
+        [JsonProperty("file_count")]
+        public int FileCount { get; set; }
+    }
+}
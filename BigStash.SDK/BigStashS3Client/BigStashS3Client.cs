@@ -23,6 +23,10 @@ namespace BigStash.SDK
         private static readonly ILog _log = LogManager.GetLogger(typeof(BigStashS3Client));
 
         protected static readonly long PART_SIZE = 5 * 1024 * 1024;
+        protected static readonly long MAX_PART_SIZE = 5L * 1024 * 1024 * 1024;
+        protected static readonly int MAX_PARTS = 10000;
+        protected static readonly long PART_SIZE_GRANULARITY = 1024 * 1024;
+        public static readonly long MAX_OBJECT_SIZE = 5L * 1024 * 1024 * 1024 * 1024;
         protected static readonly int MAX_PARALLEL_ALLOWED = Environment.ProcessorCount - 1;
 
         private static AmazonS3Config _s3Config;
@@ -398,6 +402,21 @@ namespace BigStash.SDK
             }
         }
 
+        /// <summary>
+        /// Calculate the part size of a new multipart upload. Files up to
+        /// 5 MB * 10000 keep 5 MB parts, larger ones get the smallest part size
+        /// (in whole MB) that fits them in 10000 parts.
+        /// </summary>
+        /// <param name="fileSize"></param>
+        /// <returns></returns>
+        public static long CalculatePartSize(long fileSize)
+        {
+            long partSize = (fileSize + MAX_PARTS - 1) / MAX_PARTS;
+            partSize = (partSize + PART_SIZE_GRANULARITY - 1) / PART_SIZE_GRANULARITY * PART_SIZE_GRANULARITY;
+
+            return Math.Min(Math.Max(partSize, PART_SIZE), MAX_PART_SIZE);
+        }
+
         /// <summary>
         /// Create UploadPartRequest objects for a multipart upload.
         /// </summary>
@@ -412,16 +431,23 @@ namespace BigStash.SDK
             List<PartDetail> uploadedParts, Dictionary<int, long> partsProgress)
         {
             long filePosition = 0;
-            long partSize = PART_SIZE; // 5 MB
+            // uploads initiated before the part size was stored used 5 MB parts.
+            long partSize = (fileInfo.PartSize > 0) ? fileInfo.PartSize : PART_SIZE;
             Queue<UploadPartRequest> partRequests = new Queue<UploadPartRequest>();
 
             if (fileInfo.Size < partSize)
                 partSize = fileInfo.Size;
 
+            // index the uploaded parts by part number once, instead of searching
+            // the list for every part.
+            var uploadedPartsByNumber = new Dictionary<int, PartDetail>(uploadedParts.Count);
+            foreach (var part in uploadedParts)
+                uploadedPartsByNumber[part.PartNumber] = part;
+
             for (int i = 1; filePosition < fileInfo.Size; i++)
             {
-                var uploadedPart = uploadedParts.Where(x => x.PartNumber == i).FirstOrDefault();
-                if (uploadedPart != null) // uploadedParts.Select(x => x.PartNumber).Contains(i))
+                PartDetail uploadedPart;
+                if (uploadedPartsByNumber.TryGetValue(i, out uploadedPart))
                 {
                     // for each already uploaded part, add total part size as transferred bytes.
                     partsProgress.Add(i, uploadedPart.Size); 
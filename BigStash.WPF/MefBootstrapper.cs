@@ -25,6 +25,8 @@ namespace BigStash.WPF
 
         private CompositionContainer container;
 
+        private SelectionChannelListener selectionChannelListener;
+
         public MefBootstrapper()
         {
             Initialize();
@@ -159,6 +161,9 @@ namespace BigStash.WPF
                     Properties.Settings.Default.Save();
                 }
 
+                // Listen for selections the Explorer extension sends.
+                this.StartSelectionChannelListener();
+
                 // Catch with args and forward a message with them
                 if (e.Args.Length > 0)
                 {
@@ -176,6 +181,12 @@ namespace BigStash.WPF
             {
                 _log.Info("Exiting application.");
 
+                if (this.selectionChannelListener != null)
+                {
+                    this.selectionChannelListener.Dispose();
+                    this.selectionChannelListener = null;
+                }
+
                 // make sure to save one final time the application wide settings.
                 Properties.Settings.Default.Save();
 
@@ -242,6 +253,23 @@ namespace BigStash.WPF
             eventAggregator.PublishOnUIThread(startUpArgsMessage);
         }
 
+        private void StartSelectionChannelListener()
+        {
+            this.selectionChannelListener = new SelectionChannelListener(paths =>
+            {
+                var eventAggregator = IoC.Get<IEventAggregator>();
+                var selectionReceivedMessage = IoC.Get<ISelectionReceivedMessage>();
+                selectionReceivedMessage.Paths = paths;
+                eventAggregator.PublishOnUIThread(selectionReceivedMessage);
+            });
+
+            // The extension falls back to the selection file when nobody listens.
+            if (!this.selectionChannelListener.Start())
+            {
+                this.selectionChannelListener = null;
+            }
+        }
+
         private void CreateLocalApplicationDataDirectory()
         {
             // if LOCALAPPDATA\Deepfreeze.io doesn't exist, create it.
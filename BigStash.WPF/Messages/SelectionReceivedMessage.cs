@@ -0,0 +1,15 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Threading.Tasks;
+using System.ComponentModel.Composition;
+
+namespace BigStash.WPF.Messages
+{
+    [Export(typeof(ISelectionReceivedMessage))]
+    public class SelectionReceivedMessage : ISelectionReceivedMessage
+    {
+        public IList<string> Paths { get; set; }
+    }
+}
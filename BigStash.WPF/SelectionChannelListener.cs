@@ -0,0 +1,288 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.IO.Pipes;
+using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace BigStash.WPF
+{
+    /// <summary>
+    /// Receives the selections the Explorer extension streams over the selection
+    /// channel (the named pipe BigStashCore's CSelectionSender writes to), so a
+    /// selection reaches the running instance without a selection file or a
+    /// second process.
+    /// </summary>
+    public class SelectionChannelListener : IDisposable
+    {
+        private static readonly log4net.ILog _log = log4net.LogManager.GetLogger(typeof(SelectionChannelListener));
+
+        // The wire format of BigStashCore\SelectionChannel.cpp.
+        private const uint FrameHello = 1;
+        private const uint FramePaths = 2;
+        private const uint FrameEnd = 3;
+        private const uint FrameAck = 4;
+        private const uint SelectionMagic = 0x4c535342;
+        private const uint SelectionVersion = 1;
+        private const int MaxFrame = 1024 * 1024;
+        private const int PipeBufferSize = 64 * 1024;
+
+        // How long a sender that stopped sending (or reading the acknowledgement)
+        // may hold the pipe, as RECEIVE_TIMEOUT_MS in SelectionChannel.cpp.
+        private const int ReceiveTimeoutMs = 30000;
+
+        // The BsStatus codes the acknowledgement carries.
+        private const uint StatusOk = 0;
+        private const uint StatusCorrupt = 7;
+        private const uint StatusNotSupported = 8;
+
+        private readonly Action<IList<string>> _onSelection;
+        private readonly string _pipeName;
+        private NamedPipeServerStream _pipe;
+        private Thread _thread;
+        private volatile bool _stopping;
+
+        public SelectionChannelListener(Action<IList<string>> onSelection)
+        {
+            this._onSelection = onSelection;
+            this._pipeName = GetDefaultPipeName();
+        }
+
+        /// <summary>
+        /// The pipe of the current user and session, named as DefaultSelectionChannel does.
+        /// </summary>
+        /// <returns>string</returns>
+        public static string GetDefaultPipeName()
+        {
+            return "BigStash-Selection-" + Process.GetCurrentProcess().SessionId + "-" + Environment.UserName;
+        }
+
+        /// <summary>
+        /// Takes the pipe and starts listening on a background thread.
+        /// Returns false when another process holds the pipe.
+        /// </summary>
+        /// <returns>bool</returns>
+        public bool Start()
+        {
+            try
+            {
+                this._pipe = new NamedPipeServerStream(this._pipeName, PipeDirection.InOut, 1,
+                    PipeTransmissionMode.Byte, PipeOptions.Asynchronous, PipeBufferSize, PipeBufferSize);
+            }
+            catch (Exception e)
+            {
+                _log.Warn("Could not listen for selections on \"" + this._pipeName + "\", " + e.GetType().ToString() + " with message \"" + e.Message + "\".");
+                return false;
+            }
+
+            this._thread = new Thread(this.Listen);
+            this._thread.IsBackground = true;
+            this._thread.Name = "SelectionChannelListener";
+            this._thread.Start();
+
+            _log.Info("Listening for selections on \"" + this._pipeName + "\".");
+            return true;
+        }
+
+        public void Dispose()
+        {
+            if (this._thread == null)
+            {
+                return;
+            }
+
+            this._stopping = true;
+
+            // Wake the listener when it waits for a connection.
+            try
+            {
+                using (var client = new NamedPipeClientStream(".", this._pipeName, PipeDirection.InOut))
+                {
+                    client.Connect(100);
+                }
+            }
+            catch (Exception)
+            {
+                // Busy with a selection or already gone; the join below is bounded anyway.
+            }
+
+            this._thread.Join(1000);
+            this._thread = null;
+            this._pipe.Dispose();
+        }
+
+        private void Listen()
+        {
+            while (!this._stopping)
+            {
+                try
+                {
+                    this._pipe.WaitForConnection();
+
+                    if (!this._stopping)
+                    {
+                        this.Receive();
+                    }
+                }
+                catch (Exception e)
+                {
+                    if (this._stopping)
+                    {
+                        return;
+                    }
+
+                    _log.Warn("Receiving a selection threw " + e.GetType().ToString() + " with message \"" + e.Message + "\".");
+                }
+
+                try
+                {
+                    this._pipe.Disconnect();
+                }
+                catch (Exception)
+                {
+                    // The pipe was never connected or is being disposed. Disconnecting
+                    // also cancels a read that timed out.
+                }
+            }
+        }
+
+        /// <summary>
+        /// Reads one selection: a HELLO frame, PATHS frames and the END frame with the
+        /// path count. The paths are handed over once they all arrived, and the sender
+        /// is acknowledged after that. Every read, and the acknowledgement, waits at
+        /// most ReceiveTimeoutMs.
+        /// </summary>
+        private void Receive()
+        {
+            var paths = new List<string>();
+            var status = StatusOk;
+            uint type;
+
+            var payload = this.ReadFrame(out type);
+            if (type != FrameHello || payload.Length != 12 || BitConverter.ToUInt32(payload, 0) != SelectionMagic)
+            {
+                status = StatusCorrupt;
+            }
+            else if (BitConverter.ToUInt32(payload, 4) != SelectionVersion || BitConverter.ToUInt32(payload, 8) != sizeof(char))
+            {
+                status = StatusNotSupported;
+            }
+
+            while (status == StatusOk)
+            {
+                payload = this.ReadFrame(out type);
+
+                if (type == FramePaths)
+                {
+                    if (!DecodePaths(payload, paths))
+                    {
+                        status = StatusCorrupt;
+                    }
+                }
+                else if (type == FrameEnd && payload.Length == 8 && BitConverter.ToUInt64(payload, 0) == (ulong)paths.Count)
+                {
+                    break;
+                }
+                else
+                {
+                    status = StatusCorrupt;
+                }
+            }
+
+            if (status == StatusOk)
+            {
+                _log.Debug("Received a selection of " + paths.Count + " paths.");
+                this._onSelection(paths);
+            }
+            else
+            {
+                _log.Warn("Dropped a malformed selection, status " + status + ".");
+            }
+
+            var ack = new byte[20];
+            Buffer.BlockCopy(BitConverter.GetBytes(FrameAck), 0, ack, 0, 4);
+            Buffer.BlockCopy(BitConverter.GetBytes((uint)12), 0, ack, 4, 4);
+            Buffer.BlockCopy(BitConverter.GetBytes((ulong)paths.Count), 0, ack, 8, 8);
+            Buffer.BlockCopy(BitConverter.GetBytes(status), 0, ack, 16, 4);
+            this._pipe.Write(ack, 0, ack.Length);
+
+            if (!Task.Run(() => this._pipe.WaitForPipeDrain()).Wait(ReceiveTimeoutMs))
+            {
+                throw new TimeoutException("The sender did not read the acknowledgement.");
+            }
+        }
+
+        private byte[] ReadFrame(out uint type)
+        {
+            var header = this.ReadExactly(8);
+            type = BitConverter.ToUInt32(header, 0);
+            var length = BitConverter.ToUInt32(header, 4);
+
+            if (length > MaxFrame)
+            {
+                throw new InvalidDataException("Selection frame of " + length + " bytes.");
+            }
+
+            return this.ReadExactly((int)length);
+        }
+
+        /// <summary>
+        /// Reads count bytes, each read bounded by ReceiveTimeoutMs, so a sender that
+        /// stops sending cannot hold the pipe.
+        /// </summary>
+        private byte[] ReadExactly(int count)
+        {
+            var data = new byte[count];
+            var offset = 0;
+
+            while (offset < count)
+            {
+                var read = this._pipe.ReadAsync(data, offset, count - offset);
+                if (!read.Wait(ReceiveTimeoutMs))
+                {
+                    throw new TimeoutException("The sender stopped sending.");
+                }
+
+                if (read.Result == 0)
+                {
+                    throw new EndOfStreamException();
+                }
+
+                offset += read.Result;
+            }
+
+            return data;
+        }
+
+        /// <summary>
+        /// Paths come as a character count and the UTF-16 characters.
+        /// </summary>
+        private static bool DecodePaths(byte[] payload, List<string> paths)
+        {
+            var offset = 0;
+
+            while (offset < payload.Length)
+            {
+                if (payload.Length - offset < 4)
+                {
+                    return false;
+                }
+
+                var length = BitConverter.ToUInt32(payload, offset);
+                offset += 4;
+
+                if (length > (payload.Length - offset) / sizeof(char))
+                {
+                    return false;
+                }
+
+                paths.Add(Encoding.Unicode.GetString(payload, offset, (int)length * sizeof(char)));
+                offset += (int)length * sizeof(char);
+            }
+
+            return true;
+        }
+    }
+}
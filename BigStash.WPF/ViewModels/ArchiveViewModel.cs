@@ -29,8 +29,7 @@ namespace BigStash.WPF
         private static readonly log4net.ILog _log = log4net.LogManager.GetLogger(typeof(ArchiveViewModel));
         private readonly IEventAggregator _eventAggregator;
         private readonly IBigStashClient _deepfreezeClient;
-        private static readonly long PART_SIZE = 5 * 1024 * 1024; // in bytes.
-        private static readonly long MAX_ALLOWED_FILE_SIZE = PART_SIZE * 10000; // max parts is 10000, so max size is part size * 10000.
+        private static readonly long MAX_ALLOWED_FILE_SIZE = BigStashS3Client.MAX_OBJECT_SIZE; // the part size grows with the file, up to the 5 TB S3 object limit.
 
         private bool _isReset = true;
         private bool _hasChosenFiles = false;
@@ -21,7 +21,8 @@ namespace BigStash.WPF
 {
     [Export(typeof(IShell))]
     public class ShellViewModel : Conductor<Screen>.Collection.AllActive, IShell, IHandle<ILoginSuccessMessage>, IHandle<ILogoutMessage>,
-        IHandle<INotificationMessage>, IHandleWithTask<IStartUpArgsMessage>, IHandle<IRestartNeededMessage>, IHandleWithTask<IRestartAppMessage>
+        IHandle<INotificationMessage>, IHandleWithTask<IStartUpArgsMessage>, IHandleWithTask<ISelectionReceivedMessage>, IHandle<IRestartNeededMessage>,
+        IHandleWithTask<IRestartAppMessage>
     {
         #region fields
 
@@ -398,6 +399,23 @@ namespace BigStash.WPF
             }
         }
 
+        /// <summary>
+        /// Handle SelectionReceivedMessage
+        /// </summary>
+        /// <param name="message"></param>
+        public async Task Handle(ISelectionReceivedMessage message)
+        {
+            if (message != null && message.Paths != null && message.Paths.Count > 0)
+            {
+                _log.Debug("Got a selection of " + message.Paths.Count + " paths from the Explorer extension.");
+
+                _shellWindow.WindowState = WindowState.Normal;
+                _shellWindow.ShowInTaskbar = true;
+
+                await this.CreateArchiveAsync(message.Paths).ConfigureAwait(false);
+            }
+        }
+
         /// <summary>
         /// Handle RestartAppMessage
         /// </summary>
@@ -981,15 +999,20 @@ namespace BigStash.WPF
                     }
                 }
 
-                while(this.ArchiveVM == null || !this.ArchiveVM.IsActive)
-                {
-                    await Task.Delay(500).ConfigureAwait(false);
-                }
+                await this.CreateArchiveAsync(paths).ConfigureAwait(false);
+            }
+        }
 
-                var createArchiveMessage = IoC.Get<ICreateArchiveMessage>();
-                createArchiveMessage.Paths = paths.AsEnumerable();
-                await this._eventAggregator.PublishOnUIThreadAsync(createArchiveMessage);
+        private async Task CreateArchiveAsync(IList<string> paths)
+        {
+            while(this.ArchiveVM == null || !this.ArchiveVM.IsActive)
+            {
+                await Task.Delay(500).ConfigureAwait(false);
             }
+
+            var createArchiveMessage = IoC.Get<ICreateArchiveMessage>();
+            createArchiveMessage.Paths = paths.AsEnumerable();
+            await this._eventAggregator.PublishOnUIThreadAsync(createArchiveMessage);
         }
 
         private void UpdateTrayIconToolTipWithCurrentStatus()
@@ -716,6 +716,7 @@ namespace BigStash.WPF
                         await this._s3Client.InitiateMultipartUploadAsync(this._s3Info.Bucket, info.KeyName, token).ConfigureAwait(false);
 
                     info.UploadId = initResponse.UploadId;
+                    info.PartSize = BigStashS3Client.CalculatePartSize(info.Size);
 
                     await this.SaveLocalUpload();
                 }
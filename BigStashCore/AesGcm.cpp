@@ -0,0 +1,779 @@
+// AesGcm.cpp : Implementation of CAesGcm and the portable, AES-NI and VAES
+// kernels.
+
+#include "AesGcm.h"
+#include "CpuFeatures.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#if defined(BS_ARCH_X86)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		const uint8_t SBOX[256] =
+		{
+			0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+			0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+			0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+			0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+			0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+			0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+			0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+			0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+			0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+			0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+			0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+			0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+			0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+			0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+			0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+			0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+		};
+
+		// The reduction of the four bits shifted out of a GHASH table step.
+		const uint64_t LAST4[16] =
+		{
+			0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+			0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+		};
+
+		inline uint8_t Xtime(uint8_t x)
+		{
+			return (uint8_t)((x << 1) ^ ((x >> 7) * 0x1b));
+		}
+
+		inline uint64_t LoadBigEndian64(const uint8_t* p)
+		{
+			uint64_t value = 0;
+			for (int i = 0; i < 8; ++i)
+				value = (value << 8) | p[i];
+			return value;
+		}
+
+		inline void StoreBigEndian64(uint8_t* p, uint64_t value)
+		{
+			for (int i = 7; i >= 0; --i, value >>= 8)
+				p[i] = (uint8_t)value;
+		}
+
+		inline void StoreBigEndian32(uint8_t* p, uint32_t value)
+		{
+			p[0] = (uint8_t)(value >> 24);
+			p[1] = (uint8_t)(value >> 16);
+			p[2] = (uint8_t)(value >> 8);
+			p[3] = (uint8_t)value;
+		}
+
+		// J0 with its counter set: nonce || counter, big-endian.
+		inline void CounterBlock(const uint8_t nonce[GCM_NONCE_SIZE], uint32_t counter, uint8_t block[AES_BLOCK_SIZE])
+		{
+			memcpy(block, nonce, GCM_NONCE_SIZE);
+			StoreBigEndian32(block + GCM_NONCE_SIZE, counter);
+		}
+
+		// The last GHASH block: the bit lengths of the AAD and the ciphertext.
+		inline void LengthBlock(size_t aadLength, size_t length, uint8_t block[AES_BLOCK_SIZE])
+		{
+			StoreBigEndian64(block, (uint64_t)aadLength * 8);
+			StoreBigEndian64(block + 8, (uint64_t)length * 8);
+		}
+
+		void ExpandKey(const uint8_t key[AES256_KEY_SIZE], uint8_t roundKeys[AES256_ROUNDS + 1][AES_BLOCK_SIZE])
+		{
+			uint8_t* words = &roundKeys[0][0];
+			memcpy(words, key, AES256_KEY_SIZE);
+
+			uint8_t rcon = 1;
+			for (size_t i = 8; i < 4 * (AES256_ROUNDS + 1); ++i)
+			{
+				uint8_t t[4];
+				memcpy(t, words + 4 * (i - 1), 4);
+				if (i % 8 == 0)
+				{
+					uint8_t first = t[0];
+					t[0] = SBOX[t[1]] ^ rcon;
+					t[1] = SBOX[t[2]];
+					t[2] = SBOX[t[3]];
+					t[3] = SBOX[first];
+					rcon = Xtime(rcon);
+				}
+				else if (i % 8 == 4)
+				{
+					for (int j = 0; j < 4; ++j)
+						t[j] = SBOX[t[j]];
+				}
+
+				for (int j = 0; j < 4; ++j)
+					words[4 * i + j] = words[4 * (i - 8) + j] ^ t[j];
+			}
+		}
+
+		// FIPS-197 rounds on the column-major state.
+		void EncryptBlockPortable(const GcmKey& key, const uint8_t in[AES_BLOCK_SIZE], uint8_t out[AES_BLOCK_SIZE])
+		{
+			uint8_t state[AES_BLOCK_SIZE];
+			for (size_t i = 0; i < AES_BLOCK_SIZE; ++i)
+				state[i] = in[i] ^ key.roundKeys[0][i];
+
+			for (size_t round = 1; round <= AES256_ROUNDS; ++round)
+			{
+				// SubBytes and ShiftRows.
+				uint8_t t[AES_BLOCK_SIZE];
+				for (int column = 0; column < 4; ++column)
+				{
+					for (int row = 0; row < 4; ++row)
+						t[row + 4 * column] = SBOX[state[row + 4 * ((column + row) % 4)]];
+				}
+
+				if (round != AES256_ROUNDS)
+				{
+					for (int column = 0; column < 4; ++column)
+					{
+						uint8_t* c = t + 4 * column;
+						uint8_t a0 = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+						uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+						c[0] = a0 ^ all ^ Xtime(a0 ^ a1);
+						c[1] = a1 ^ all ^ Xtime(a1 ^ a2);
+						c[2] = a2 ^ all ^ Xtime(a2 ^ a3);
+						c[3] = a3 ^ all ^ Xtime(a3 ^ a0);
+					}
+				}
+
+				for (size_t i = 0; i < AES_BLOCK_SIZE; ++i)
+					state[i] = t[i] ^ key.roundKeys[round][i];
+			}
+
+			memcpy(out, state, AES_BLOCK_SIZE);
+		}
+
+		// Shoup's 4-bit tables: entry i is H times the nibble i, bit
+		// reflected as GCM has it.
+		void BuildTables(const uint8_t h[AES_BLOCK_SIZE], uint64_t tableHigh[16], uint64_t tableLow[16])
+		{
+			uint64_t vh = LoadBigEndian64(h);
+			uint64_t vl = LoadBigEndian64(h + 8);
+
+			tableHigh[0] = 0;
+			tableLow[0] = 0;
+			tableHigh[8] = vh;
+			tableLow[8] = vl;
+
+			for (int i = 4; i > 0; i >>= 1)
+			{
+				uint64_t reduce = (vl & 1) * 0xe100000000000000ULL;
+				vl = (vh << 63) | (vl >> 1);
+				vh = (vh >> 1) ^ reduce;
+				tableHigh[i] = vh;
+				tableLow[i] = vl;
+			}
+
+			for (int i = 2; i <= 8; i *= 2)
+			{
+				for (int j = 1; j < i; ++j)
+				{
+					tableHigh[i + j] = tableHigh[i] ^ tableHigh[j];
+					tableLow[i + j] = tableLow[i] ^ tableLow[j];
+				}
+			}
+		}
+
+		// x = x * H.
+		void MultiplyH(const GcmKey& key, uint8_t x[AES_BLOCK_SIZE])
+		{
+			uint64_t zh = key.tableHigh[x[15] & 0xf];
+			uint64_t zl = key.tableLow[x[15] & 0xf];
+
+			for (int i = 15; i >= 0; --i)
+			{
+				unsigned low = x[i] & 0xf;
+				unsigned high = x[i] >> 4;
+
+				if (i != 15)
+				{
+					unsigned rem = (unsigned)(zl & 0xf);
+					zl = (zh << 60) | (zl >> 4);
+					zh = (zh >> 4) ^ (LAST4[rem] << 48);
+					zh ^= key.tableHigh[low];
+					zl ^= key.tableLow[low];
+				}
+
+				unsigned rem = (unsigned)(zl & 0xf);
+				zl = (zh << 60) | (zl >> 4);
+				zh = (zh >> 4) ^ (LAST4[rem] << 48);
+				zh ^= key.tableHigh[high];
+				zl ^= key.tableLow[high];
+			}
+
+			StoreBigEndian64(x, zh);
+			StoreBigEndian64(x + 8, zl);
+		}
+
+		// Folds data into y, the last block padded with zeros.
+		void GhashPortable(const GcmKey& key, uint8_t y[AES_BLOCK_SIZE], const uint8_t* data, size_t length)
+		{
+			for (size_t offset = 0; offset < length; offset += AES_BLOCK_SIZE)
+			{
+				size_t chunk = std::min(AES_BLOCK_SIZE, length - offset);
+				for (size_t i = 0; i < chunk; ++i)
+					y[i] ^= data[offset + i];
+				MultiplyH(key, y);
+			}
+		}
+
+		typedef void (*GcmKernel)(const GcmKey& key, const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad,
+			size_t aadLength, uint8_t* data, size_t length, bool encrypt, uint8_t tag[GCM_TAG_SIZE]);
+
+		//
+		//   FUNCTION: GcmPortable(...)
+		//
+		//   PURPOSE: Reference kernel: CTR mode a block at a time, then GHASH
+		//            over the ciphertext in a second pass.
+		//
+		void GcmPortable(const GcmKey& key, const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad, size_t aadLength,
+			uint8_t* data, size_t length, bool encrypt, uint8_t tag[GCM_TAG_SIZE])
+		{
+			uint8_t y[AES_BLOCK_SIZE] = { 0 };
+			GhashPortable(key, y, aad, aadLength);
+			if (!encrypt)
+				GhashPortable(key, y, data, length);
+
+			uint8_t counter[AES_BLOCK_SIZE];
+			uint8_t stream[AES_BLOCK_SIZE];
+			uint32_t block = 2;
+			for (size_t offset = 0; offset < length; offset += AES_BLOCK_SIZE, ++block)
+			{
+				CounterBlock(nonce, block, counter);
+				EncryptBlockPortable(key, counter, stream);
+				size_t chunk = std::min(AES_BLOCK_SIZE, length - offset);
+				for (size_t i = 0; i < chunk; ++i)
+					data[offset + i] ^= stream[i];
+			}
+
+			if (encrypt)
+				GhashPortable(key, y, data, length);
+
+			uint8_t lengths[AES_BLOCK_SIZE];
+			LengthBlock(aadLength, length, lengths);
+			GhashPortable(key, y, lengths, AES_BLOCK_SIZE);
+
+			CounterBlock(nonce, 1, counter);
+			EncryptBlockPortable(key, counter, stream);
+			for (size_t i = 0; i < GCM_TAG_SIZE; ++i)
+				tag[i] = y[i] ^ stream[i];
+		}
+
+#if defined(BS_ARCH_X86)
+		// GHASH works on byte-reversed blocks, where the carry-less product
+		// lines up with the bit order GCM uses.
+		BS_TARGET("ssse3")
+		inline __m128i ByteReverse(__m128i x)
+		{
+			return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+		}
+
+		// Adds a * b, unreduced, to the 256-bit product lo : mid : hi.
+		BS_TARGET("pclmul,sse2")
+		inline void ClmulAccumulate(__m128i a, __m128i b, __m128i& lo, __m128i& mid, __m128i& hi)
+		{
+			lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+			hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+			mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x10));
+			mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x01));
+		}
+
+		//
+		//   FUNCTION: GhashReduce(__m128i, __m128i, __m128i)
+		//
+		//   PURPOSE: Shifts a product one bit left (the reflected order
+		//            leaves it one short) and reduces it modulo
+		//            x^128 + x^7 + x^2 + x + 1. Both are linear, so a sum of
+		//            products is reduced once.
+		//
+		BS_TARGET("pclmul,sse2")
+		inline __m128i GhashReduce(__m128i lo, __m128i mid, __m128i hi)
+		{
+			__m128i low = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+			__m128i high = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+			__m128i lowCarry = _mm_srli_epi32(low, 31);
+			__m128i highCarry = _mm_srli_epi32(high, 31);
+			low = _mm_slli_epi32(low, 1);
+			high = _mm_slli_epi32(high, 1);
+			__m128i crossing = _mm_srli_si128(lowCarry, 12);
+			highCarry = _mm_slli_si128(highCarry, 4);
+			lowCarry = _mm_slli_si128(lowCarry, 4);
+			low = _mm_or_si128(low, lowCarry);
+			high = _mm_or_si128(_mm_or_si128(high, highCarry), crossing);
+
+			__m128i a = _mm_slli_epi32(low, 31);
+			__m128i b = _mm_slli_epi32(low, 30);
+			__m128i c = _mm_slli_epi32(low, 25);
+			a = _mm_xor_si128(_mm_xor_si128(a, b), c);
+			b = _mm_srli_si128(a, 4);
+			a = _mm_slli_si128(a, 12);
+			low = _mm_xor_si128(low, a);
+
+			__m128i d = _mm_srli_epi32(low, 1);
+			__m128i e = _mm_srli_epi32(low, 2);
+			__m128i f = _mm_srli_epi32(low, 7);
+			d = _mm_xor_si128(_mm_xor_si128(d, e), _mm_xor_si128(f, b));
+			low = _mm_xor_si128(low, d);
+			return _mm_xor_si128(high, low);
+		}
+
+		BS_TARGET("pclmul,sse2")
+		inline __m128i GhashMultiply(__m128i a, __m128i b)
+		{
+			__m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+			ClmulAccumulate(a, b, lo, mid, hi);
+			return GhashReduce(lo, mid, hi);
+		}
+
+		BS_TARGET("aes,sse2")
+		inline __m128i EncryptBlockNi(const __m128i roundKeys[AES256_ROUNDS + 1], __m128i block)
+		{
+			block = _mm_xor_si128(block, roundKeys[0]);
+			for (size_t round = 1; round < AES256_ROUNDS; ++round)
+				block = _mm_aesenc_si128(block, roundKeys[round]);
+			return _mm_aesenclast_si128(block, roundKeys[AES256_ROUNDS]);
+		}
+
+		// Loads up to a block, padded with zeros.
+		inline __m128i LoadPartial(const uint8_t* data, size_t length)
+		{
+			alignas(16) uint8_t block[AES_BLOCK_SIZE] = { 0 };
+			memcpy(block, data, length);
+			return _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+		}
+
+		BS_TARGET("pclmul,ssse3")
+		__m128i GhashBlocksNi(__m128i y, __m128i h, const uint8_t* data, size_t length)
+		{
+			for (size_t offset = 0; offset < length; offset += AES_BLOCK_SIZE)
+			{
+				__m128i block = LoadPartial(data + offset, std::min(AES_BLOCK_SIZE, length - offset));
+				y = GhashMultiply(_mm_xor_si128(y, ByteReverse(block)), h);
+			}
+			return y;
+		}
+
+		// The state a GCM pass carries between the kernels: the running
+		// GHASH and the next counter block, both byte-reversed.
+		struct GcmState
+		{
+			__m128i y;
+			__m128i counter;
+		};
+
+		BS_TARGET("aes,pclmul,ssse3")
+		void GcmStartNi(const GcmKey& key, const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad,
+			size_t aadLength, GcmState& state)
+		{
+			const __m128i h = _mm_load_si128(reinterpret_cast<const __m128i*>(key.hPowers[0]));
+			state.y = GhashBlocksNi(_mm_setzero_si128(), h, aad, aadLength);
+
+			uint8_t block[AES_BLOCK_SIZE];
+			CounterBlock(nonce, 2, block);
+			state.counter = ByteReverse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(block)));
+		}
+
+		//
+		//   FUNCTION: GcmBlocksNi(...)
+		//
+		//   PURPOSE: CTR and GHASH over data, eight blocks at a time: the
+		//            eight AES pipelines hide the aesenc latency, and the eight
+		//            ciphertext blocks are multiplied by H^8..H^1 and summed
+		//            before a single reduction. The tail goes a block at a
+		//            time.
+		//
+		BS_TARGET("aes,pclmul,ssse3")
+		void GcmBlocksNi(const GcmKey& key, uint8_t* data, size_t length, bool encrypt, GcmState& state)
+		{
+			const size_t BATCH = 8;
+			const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+
+			__m128i roundKeys[AES256_ROUNDS + 1];
+			for (size_t i = 0; i <= AES256_ROUNDS; ++i)
+				roundKeys[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(key.roundKeys[i]));
+			__m128i h[BATCH];
+			for (size_t i = 0; i < BATCH; ++i)
+				h[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(key.hPowers[i]));
+
+			__m128i y = state.y;
+			__m128i counter = state.counter;
+			size_t offset = 0;
+
+			for (; offset + BATCH * AES_BLOCK_SIZE <= length; offset += BATCH * AES_BLOCK_SIZE)
+			{
+				__m128i* blocks = reinterpret_cast<__m128i*>(data + offset);
+				__m128i stream[BATCH];
+				for (size_t i = 0; i < BATCH; ++i)
+				{
+					stream[i] = _mm_xor_si128(ByteReverse(counter), roundKeys[0]);
+					counter = _mm_add_epi32(counter, one);
+				}
+				for (size_t round = 1; round < AES256_ROUNDS; ++round)
+				{
+					for (size_t i = 0; i < BATCH; ++i)
+						stream[i] = _mm_aesenc_si128(stream[i], roundKeys[round]);
+				}
+
+				__m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+				for (size_t i = 0; i < BATCH; ++i)
+				{
+					__m128i in = _mm_loadu_si128(blocks + i);
+					__m128i out = _mm_xor_si128(_mm_aesenclast_si128(stream[i], roundKeys[AES256_ROUNDS]), in);
+					_mm_storeu_si128(blocks + i, out);
+
+					__m128i cipher = ByteReverse(encrypt ? out : in);
+					if (i == 0)
+						cipher = _mm_xor_si128(cipher, y);
+					ClmulAccumulate(cipher, h[BATCH - 1 - i], lo, mid, hi);
+				}
+				y = GhashReduce(lo, mid, hi);
+			}
+
+			for (; offset < length; offset += AES_BLOCK_SIZE)
+			{
+				size_t chunk = std::min(AES_BLOCK_SIZE, length - offset);
+				__m128i stream = EncryptBlockNi(roundKeys, ByteReverse(counter));
+				counter = _mm_add_epi32(counter, one);
+
+				__m128i in = LoadPartial(data + offset, chunk);
+				alignas(16) uint8_t out[AES_BLOCK_SIZE];
+				_mm_store_si128(reinterpret_cast<__m128i*>(out), _mm_xor_si128(in, stream));
+				memcpy(data + offset, out, chunk);
+
+				__m128i cipher = encrypt ? LoadPartial(out, chunk) : in;
+				y = GhashMultiply(_mm_xor_si128(y, ByteReverse(cipher)), h[0]);
+			}
+
+			state.y = y;
+			state.counter = counter;
+		}
+
+		BS_TARGET("aes,pclmul,ssse3")
+		void GcmFinishNi(const GcmKey& key, const uint8_t nonce[GCM_NONCE_SIZE], size_t aadLength, size_t length,
+			const GcmState& state, uint8_t tag[GCM_TAG_SIZE])
+		{
+			__m128i roundKeys[AES256_ROUNDS + 1];
+			for (size_t i = 0; i <= AES256_ROUNDS; ++i)
+				roundKeys[i] = _mm_load_si128(reinterpret_cast<const __m128i*>(key.roundKeys[i]));
+			const __m128i h = _mm_load_si128(reinterpret_cast<const __m128i*>(key.hPowers[0]));
+
+			uint8_t block[AES_BLOCK_SIZE];
+			LengthBlock(aadLength, length, block);
+			__m128i y = GhashBlocksNi(state.y, h, block, AES_BLOCK_SIZE);
+
+			CounterBlock(nonce, 1, block);
+			__m128i mask = EncryptBlockNi(roundKeys, _mm_loadu_si128(reinterpret_cast<const __m128i*>(block)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(tag), _mm_xor_si128(ByteReverse(y), mask));
+		}
+
+		BS_TARGET("aes,pclmul,ssse3")
+		void GcmAesNi(const GcmKey& key, const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad, size_t aadLength,
+			uint8_t* data, size_t length, bool encrypt, uint8_t tag[GCM_TAG_SIZE])
+		{
+			GcmState state;
+			GcmStartNi(key, nonce, aad, aadLength, state);
+			GcmBlocksNi(key, data, length, encrypt, state);
+			GcmFinishNi(key, nonce, aadLength, length, state, tag);
+		}
+
+		//
+		//   FUNCTION: GcmVaes(...)
+		//
+		//   PURPOSE: The AES-NI kernel on 256-bit registers: sixteen counter
+		//            blocks in eight registers go through vaesenc together and
+		//            the sixteen ciphertext blocks are multiplied by
+		//            H^16..H^1 with vpclmulqdq, two per instruction, before
+		//            one reduction. What is left over goes to GcmBlocksNi.
+		//
+		BS_TARGET("vaes,vpclmulqdq,avx2,aes,pclmul,ssse3")
+		void GcmVaes(const GcmKey& key, const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad, size_t aadLength,
+			uint8_t* data, size_t length, bool encrypt, uint8_t tag[GCM_TAG_SIZE])
+		{
+			const size_t BATCH = 8;
+			const size_t BATCH_BYTES = 2 * BATCH * AES_BLOCK_SIZE;
+
+			GcmState state;
+			GcmStartNi(key, nonce, aad, aadLength, state);
+
+			size_t bulk = length - length % BATCH_BYTES;
+			if (bulk != 0)
+			{
+				const __m256i reverse = _mm256_broadcastsi128_si256(
+					_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+				const __m256i two = _mm256_set_epi32(0, 0, 0, 2, 0, 0, 0, 2);
+
+				__m256i roundKeys[AES256_ROUNDS + 1];
+				for (size_t i = 0; i <= AES256_ROUNDS; ++i)
+					roundKeys[i] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(key.roundKeys[i])));
+
+				// register i multiplies blocks 2i and 2i + 1 by H^(16 - 2i)
+				// and H^(15 - 2i).
+				__m256i h[BATCH];
+				for (size_t i = 0; i < BATCH; ++i)
+				{
+					__m128i first = _mm_load_si128(reinterpret_cast<const __m128i*>(key.hPowers[GCM_H_POWERS - 1 - 2 * i]));
+					__m128i second = _mm_load_si128(reinterpret_cast<const __m128i*>(key.hPowers[GCM_H_POWERS - 2 - 2 * i]));
+					h[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+				}
+
+				__m256i counter = _mm256_inserti128_si256(_mm256_castsi128_si256(state.counter),
+					_mm_add_epi32(state.counter, _mm_set_epi32(0, 0, 0, 1)), 1);
+				__m128i y = state.y;
+
+				for (size_t offset = 0; offset < bulk; offset += BATCH_BYTES)
+				{
+					__m256i* blocks = reinterpret_cast<__m256i*>(data + offset);
+					__m256i stream[BATCH];
+					for (size_t i = 0; i < BATCH; ++i)
+					{
+						stream[i] = _mm256_xor_si256(_mm256_shuffle_epi8(counter, reverse), roundKeys[0]);
+						counter = _mm256_add_epi32(counter, two);
+					}
+					for (size_t round = 1; round < AES256_ROUNDS; ++round)
+					{
+						for (size_t i = 0; i < BATCH; ++i)
+							stream[i] = _mm256_aesenc_epi128(stream[i], roundKeys[round]);
+					}
+
+					__m256i lo = _mm256_setzero_si256(), mid = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+					for (size_t i = 0; i < BATCH; ++i)
+					{
+						__m256i in = _mm256_loadu_si256(blocks + i);
+						__m256i out = _mm256_xor_si256(_mm256_aesenclast_epi128(stream[i], roundKeys[AES256_ROUNDS]), in);
+						_mm256_storeu_si256(blocks + i, out);
+
+						__m256i cipher = _mm256_shuffle_epi8(encrypt ? out : in, reverse);
+						if (i == 0)
+							cipher = _mm256_xor_si256(cipher, _mm256_inserti128_si256(_mm256_setzero_si256(), y, 0));
+						lo = _mm256_xor_si256(lo, _mm256_clmulepi64_epi128(cipher, h[i], 0x00));
+						hi = _mm256_xor_si256(hi, _mm256_clmulepi64_epi128(cipher, h[i], 0x11));
+						mid = _mm256_xor_si256(mid, _mm256_clmulepi64_epi128(cipher, h[i], 0x10));
+						mid = _mm256_xor_si256(mid, _mm256_clmulepi64_epi128(cipher, h[i], 0x01));
+					}
+
+					y = GhashReduce(
+						_mm_xor_si128(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1)),
+						_mm_xor_si128(_mm256_castsi256_si128(mid), _mm256_extracti128_si256(mid, 1)),
+						_mm_xor_si128(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1)));
+				}
+
+				state.y = y;
+				state.counter = _mm256_castsi256_si128(counter);
+			}
+
+			GcmBlocksNi(key, data + bulk, length - bulk, encrypt, state);
+			GcmFinishNi(key, nonce, aadLength, length, state, tag);
+		}
+#endif
+
+		GcmKernel KernelFunction(AesKernel kernel)
+		{
+#if defined(BS_ARCH_X86)
+			if (kernel == AES_KERNEL_VAES)
+				return GcmVaes;
+			if (kernel == AES_KERNEL_AESNI)
+				return GcmAesNi;
+#endif
+			(void)kernel;
+			return GcmPortable;
+		}
+	}
+
+	bool AesKernelSupported(AesKernel kernel)
+	{
+		const CpuFeatures& features = GetCpuFeatures();
+		switch (kernel)
+		{
+		case AES_KERNEL_PORTABLE:
+			return true;
+#if defined(BS_ARCH_X86)
+		case AES_KERNEL_AESNI:
+			return features.aesni && features.pclmul && features.ssse3;
+		case AES_KERNEL_VAES:
+			return features.aesni && features.pclmul && features.ssse3 && features.avx2 && features.vaes &&
+				features.vpclmul;
+#endif
+		default:
+			(void)features;
+			return false;
+		}
+	}
+
+	AesKernel AesBestKernel()
+	{
+		static const AesKernel kernel = AesKernelSupported(AES_KERNEL_VAES) ? AES_KERNEL_VAES :
+			AesKernelSupported(AES_KERNEL_AESNI) ? AES_KERNEL_AESNI : AES_KERNEL_PORTABLE;
+		return kernel;
+	}
+
+	const char* AesKernelName(AesKernel kernel)
+	{
+		switch (kernel)
+		{
+		case AES_KERNEL_AESNI:
+			return "aesni";
+		case AES_KERNEL_VAES:
+			return "vaes";
+		default:
+			return "portable";
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CAesGcm methods
+	//
+
+	CAesGcm::CAesGcm()
+		: m_kernel(AES_KERNEL_PORTABLE)
+	{
+		memset(&m_key, 0, sizeof(m_key));
+	}
+
+	CAesGcm::~CAesGcm()
+	{
+		// the compiler may not drop a store through a volatile pointer.
+		volatile uint8_t* key = reinterpret_cast<volatile uint8_t*>(&m_key);
+		for (size_t i = 0; i < sizeof(m_key); ++i)
+			key[i] = 0;
+	}
+
+	//
+	//   FUNCTION: CAesGcm::SetKey(const uint8_t*, AesKernel)
+	//
+	//   PURPOSE: Expands the round keys, derives H = E(K, 0) and its powers,
+	//            which every kernel computes the same way through the
+	//            portable tables.
+	//
+	void CAesGcm::SetKey(const uint8_t key[AES256_KEY_SIZE], AesKernel kernel)
+	{
+		m_kernel = AesKernelSupported(kernel) ? kernel : AesBestKernel();
+		ExpandKey(key, m_key.roundKeys);
+
+		uint8_t h[AES_BLOCK_SIZE] = { 0 };
+		EncryptBlockPortable(m_key, h, h);
+		BuildTables(h, m_key.tableHigh, m_key.tableLow);
+
+		uint8_t power[AES_BLOCK_SIZE];
+		memcpy(power, h, AES_BLOCK_SIZE);
+		for (size_t i = 0; i < GCM_H_POWERS; ++i)
+		{
+			if (i != 0)
+				MultiplyH(m_key, power);
+			for (size_t j = 0; j < AES_BLOCK_SIZE; ++j)
+				m_key.hPowers[i][j] = power[AES_BLOCK_SIZE - 1 - j];
+		}
+	}
+
+	void CAesGcm::Encrypt(const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad, size_t aadLength, uint8_t* data,
+		size_t length, uint8_t tag[GCM_TAG_SIZE]) const
+	{
+		KernelFunction(m_kernel)(m_key, nonce, aad, aadLength, data, length, true, tag);
+	}
+
+	bool CAesGcm::Decrypt(const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad, size_t aadLength, uint8_t* data,
+		size_t length, const uint8_t tag[GCM_TAG_SIZE]) const
+	{
+		uint8_t computed[GCM_TAG_SIZE];
+		KernelFunction(m_kernel)(m_key, nonce, aad, aadLength, data, length, false, computed);
+
+		// in constant time, so a forger learns nothing from the timing.
+		uint8_t difference = 0;
+		for (size_t i = 0; i < GCM_TAG_SIZE; ++i)
+			difference |= computed[i] ^ tag[i];
+		if (difference == 0)
+			return true;
+
+		memset(data, 0, length);
+		return false;
+	}
+
+	//
+	//   FUNCTION: RandomBytes(void*, size_t)
+	//
+	//   PURPOSE: Reads the system random source: BCryptGenRandom on Windows,
+	//            /dev/urandom elsewhere.
+	//
+	BsStatus RandomBytes(void* data, size_t length)
+	{
+#ifdef _WIN32
+		uint8_t* bytes = static_cast<uint8_t*>(data);
+		while (length != 0)
+		{
+			ULONG chunk = (ULONG)std::min<size_t>(length, 1 << 30);
+			if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, bytes, chunk, BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+				return BS_E_IO;
+			bytes += chunk;
+			length -= chunk;
+		}
+		return BS_OK;
+#else
+		int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return StatusFromErrno(errno);
+
+		uint8_t* bytes = static_cast<uint8_t*>(data);
+		BsStatus status = BS_OK;
+		while (length != 0)
+		{
+			ssize_t bytesRead = read(fd, bytes, length);
+			if (bytesRead < 0 && errno == EINTR)
+				continue;
+			if (bytesRead <= 0)
+			{
+				status = bytesRead < 0 ? StatusFromErrno(errno) : BS_E_IO;
+				break;
+			}
+			bytes += bytesRead;
+			length -= (size_t)bytesRead;
+		}
+		close(fd);
+		return status;
+#endif
+	}
+
+	void PartNonce(const uint8_t fileNonce[GCM_NONCE_SIZE], uint32_t partNumber, uint8_t nonce[GCM_NONCE_SIZE])
+	{
+		memcpy(nonce, fileNonce, GCM_NONCE_SIZE);
+		nonce[8] ^= (uint8_t)(partNumber >> 24);
+		nonce[9] ^= (uint8_t)(partNumber >> 16);
+		nonce[10] ^= (uint8_t)(partNumber >> 8);
+		nonce[11] ^= (uint8_t)partNumber;
+	}
+
+	void SealPart(const PartEncryption& encryption, uint32_t partNumber, uint8_t* data, size_t length)
+	{
+		uint8_t nonce[GCM_NONCE_SIZE];
+		PartNonce(encryption.nonce, partNumber, nonce);
+		encryption.cipher->Encrypt(nonce, NULL, 0, data, length, data + length);
+	}
+
+	bool OpenPart(const PartEncryption& encryption, uint32_t partNumber, uint8_t* data, size_t sealedLength,
+		size_t& length)
+	{
+		if (sealedLength < GCM_TAG_SIZE)
+			return false;
+
+		uint8_t nonce[GCM_NONCE_SIZE];
+		PartNonce(encryption.nonce, partNumber, nonce);
+		length = sealedLength - GCM_TAG_SIZE;
+		return encryption.cipher->Decrypt(nonce, NULL, 0, data, length, data + length);
+	}
+}
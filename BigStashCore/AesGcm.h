@@ -0,0 +1,114 @@
+// AesGcm.h : Declaration of CAesGcm, AES-256-GCM with the portable, AES-NI
+// and VAES kernels, and the per-part encryption of uploads.
+
+#pragma once
+
+#include "Platform.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace BigStash
+{
+	const size_t AES_BLOCK_SIZE = 16;
+	const size_t AES256_KEY_SIZE = BS_AES256_KEY_SIZE;
+	const size_t AES256_ROUNDS = 14;
+	const size_t GCM_NONCE_SIZE = BS_GCM_NONCE_SIZE;
+	const size_t GCM_TAG_SIZE = BS_GCM_TAG_SIZE;
+
+	// Powers of H kept for the aggregated GHASH of the hardware kernels.
+	const size_t GCM_H_POWERS = 16;
+
+	enum AesKernel
+	{
+		// Byte-wise AES and table driven GHASH. Its S-box lookups depend on
+		// the key, so it is only there for processors without AES
+		// instructions and for comparisons.
+		AES_KERNEL_PORTABLE,
+
+		// AES-NI and PCLMULQDQ, eight blocks per round.
+		AES_KERNEL_AESNI,
+
+		// VAES and VPCLMULQDQ on 256-bit registers, sixteen blocks per round.
+		AES_KERNEL_VAES
+	};
+
+	// The fastest kernel the processor has.
+	AesKernel AesBestKernel();
+	bool AesKernelSupported(AesKernel kernel);
+	const char* AesKernelName(AesKernel kernel);
+
+	// The expanded key: the AES round keys, H^1..H^16 byte-reversed for the
+	// carry-less kernels and the 4-bit GHASH tables of the portable one.
+	struct GcmKey
+	{
+		alignas(16) uint8_t roundKeys[AES256_ROUNDS + 1][AES_BLOCK_SIZE];
+		alignas(16) uint8_t hPowers[GCM_H_POWERS][AES_BLOCK_SIZE];
+		uint64_t tableHigh[16];
+		uint64_t tableLow[16];
+	};
+
+	// CAesGcm
+	//
+	// AES-256-GCM over buffers in place. The key is expanded once; Encrypt
+	// and Decrypt are const and can run on any number of threads at once.
+	// The hardware kernels encrypt a batch of counter blocks and fold the
+	// ciphertext into GHASH with one reduction per batch, while it is still
+	// in registers, so every byte is touched once.
+	class CAesGcm
+	{
+	public:
+		CAesGcm();
+		~CAesGcm();
+
+		// Picks kernel, or the best one when the processor lacks it.
+		void SetKey(const uint8_t key[AES256_KEY_SIZE], AesKernel kernel = AesBestKernel());
+
+		AesKernel Kernel() const { return m_kernel; }
+
+		// A nonce must never be used twice under one key.
+		void Encrypt(const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad, size_t aadLength, uint8_t* data,
+			size_t length, uint8_t tag[GCM_TAG_SIZE]) const;
+
+		// False when the tag does not match; data is then zeroed rather than
+		// left holding unauthenticated plaintext.
+		bool Decrypt(const uint8_t nonce[GCM_NONCE_SIZE], const uint8_t* aad, size_t aadLength, uint8_t* data,
+			size_t length, const uint8_t tag[GCM_TAG_SIZE]) const;
+
+	private:
+		CAesGcm(const CAesGcm&);
+		CAesGcm& operator=(const CAesGcm&);
+
+		GcmKey m_key;
+		AesKernel m_kernel;
+	};
+
+	// Fills data from the operating system's random source.
+	BsStatus RandomBytes(void* data, size_t length);
+
+	// How the parts of one file are encrypted on their way to S3.
+	struct PartEncryption
+	{
+		PartEncryption() : cipher(NULL), nonce() {}
+
+		// NULL sends the parts as they are.
+		const CAesGcm* cipher;
+
+		// The file's nonce, random; part n is encrypted under PartNonce(n).
+		uint8_t nonce[GCM_NONCE_SIZE];
+	};
+
+	// The nonce of a part: the file's nonce with the part number xored into
+	// its last four bytes, big-endian.
+	void PartNonce(const uint8_t fileNonce[GCM_NONCE_SIZE], uint32_t partNumber, uint8_t nonce[GCM_NONCE_SIZE]);
+
+	// Encrypts a part in place and writes its tag after it: data must have
+	// room for length + GCM_TAG_SIZE bytes. Each part stands on its own, so
+	// parts can be sent, retried and decrypted in any order.
+	void SealPart(const PartEncryption& encryption, uint32_t partNumber, uint8_t* data, size_t length);
+
+	// Decrypts a sealed part of sealedLength bytes (tag included) in place.
+	// False when it was altered, cut short or belongs to another part.
+	bool OpenPart(const PartEncryption& encryption, uint32_t partNumber, uint8_t* data, size_t sealedLength,
+		size_t& length);
+}
@@ -0,0 +1,2608 @@
+// BigStashCore.cpp : Implementation of the C interface.
+
+#include "Platform.h"
+#include "AesGcm.h"
+#include "BinaryLogger.h"
+#include "ChangeIndex.h"
+#include "ContentHasher.h"
+#include "DuplicateFinder.h"
+#include "FileNameValidator.h"
+#include "FileTable.h"
+#include "ManifestWriter.h"
+#include "PackUploader.h"
+#include "PartCompressor.h"
+#include "PartLedger.h"
+#include "PartPlanner.h"
+#include "PartReader.h"
+#include "ProgressRegistry.h"
+#include "ResumeJournal.h"
+#include "S3Client.h"
+#include "SelectionChannel.h"
+#include "SigV4Signer.h"
+#include "TreeScanner.h"
+#include "UploadScheduler.h"
+#include "UploadStore.h"
+#include "UploadTracer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+
+using namespace BigStash;
+
+/////////////////////////////////////////////////////////////////////////////
+// Tree scanner
+//
+
+//
+//   FUNCTION: BsScanTree(...)
+//
+//   PURPOSE: Runs a CTreeScanner over the roots and hands every batch to the
+//            callback as an array of BsScanRecord.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsScanTree(
+	const BsChar* const* roots, uint32_t rootCount,
+	const BsChar* const* restrictedDirs, uint32_t restrictedCount,
+	uint32_t threadCount, uint32_t batchSize,
+	BsScanBatchCallback callback, void* context,
+	BsScanStats* stats)
+{
+	if (roots == NULL || rootCount == 0 || callback == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		ScanOptions options;
+		options.threadCount = threadCount;
+		if (batchSize != 0)
+			options.batchSize = batchSize;
+
+		for (uint32_t i = 0; i < restrictedCount; ++i)
+		{
+			if (restrictedDirs[i] != NULL)
+				options.restrictedDirs.push_back(restrictedDirs[i]);
+		}
+
+		std::vector<PathString> rootPaths;
+		for (uint32_t i = 0; i < rootCount; ++i)
+		{
+			if (roots[i] == NULL)
+				return BS_E_INVALIDARG;
+			rootPaths.push_back(roots[i]);
+		}
+
+		// Only touched under the scanner's sink lock.
+		std::vector<BsScanRecord> records;
+
+		CTreeScanner scanner(options, [&](const CScanBatch& batch)
+		{
+			records.resize(batch.Count());
+			for (size_t i = 0; i < batch.Count(); ++i)
+			{
+				const ScanEntry& entry = batch.m_entries[i];
+				BsScanRecord& record = records[i];
+				record.path = batch.Path(entry);
+				record.pathLength = entry.pathLength;
+				record.nameOffset = entry.nameOffset;
+				record.keyOffset = entry.keyOffset;
+				record.attributes = entry.attributes;
+				record.flags = entry.flags;
+				record.status = entry.status;
+				record.size = entry.size;
+				record.lastWriteTime = entry.lastWriteTime;
+				record.volume = entry.volume;
+				record.fileId = entry.fileId;
+			}
+
+			callback(records.data(), (uint32_t)records.size(), context);
+		});
+
+		BsStatus status = scanner.Run(rootPaths);
+
+		if (stats != NULL)
+			*stats = scanner.Stats();
+
+		return status;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// File name validation
+//
+
+//
+//   FUNCTION: BsClassifyFiles(...)
+//
+//   PURPOSE: Runs ClassifyFile over a batch of scan records; directories the
+//            scan skipped as restricted are BS_FILE_CATEGORY_RESTRICTED_DIRECTORY.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsClassifyFiles(const BsScanRecord* records, uint32_t count,
+	uint8_t* categories)
+{
+	if ((records == NULL || categories == NULL) && count != 0)
+		return BS_E_INVALIDARG;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const BsScanRecord& record = records[i];
+		if (record.path == NULL || record.nameOffset > record.pathLength)
+			return BS_E_INVALIDARG;
+
+		if ((record.flags & BS_SCAN_SKIPPED_RESTRICTED) != 0)
+			categories[i] = BS_FILE_CATEGORY_RESTRICTED_DIRECTORY;
+		else
+			categories[i] = (uint8_t)ClassifyFile(record.path, record.pathLength, record.nameOffset,
+				record.attributes);
+	}
+	return BS_OK;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// File table
+//
+
+struct BsFileTable
+{
+	CFileTable table;
+};
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableOpen(uint32_t expectedFiles, BsFileTable** table)
+{
+	if (table == NULL)
+		return BS_E_INVALIDARG;
+
+	*table = NULL;
+	try
+	{
+		std::unique_ptr<BsFileTable> result(new BsFileTable);
+		result->table.Reserve(expectedFiles, (size_t)expectedFiles * 16);
+		*table = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+//
+//   FUNCTION: BsFileTableAdd(...)
+//
+//   PURPOSE: Adds the records one by one, so the ones added before a bad
+//            record or a failure stay in the table.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableAdd(BsFileTable* table, const BsScanRecord* records, uint32_t count,
+	uint32_t* files, uint32_t* added)
+{
+	if (table == NULL || (records == NULL && count != 0))
+		return BS_E_INVALIDARG;
+
+	if (added != NULL)
+		*added = 0;
+	try
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const BsScanRecord& record = records[i];
+			if (record.path == NULL)
+				return BS_E_INVALIDARG;
+
+			uint32_t file;
+			bool isNew;
+			BsStatus status = table->table.Add(record.path, record.pathLength, record.keyOffset, record.size,
+				record.lastWriteTime, file, isNew);
+			if (status != BS_OK)
+				return status;
+
+			if (files != NULL)
+				files[i] = file;
+			if (isNew && added != NULL)
+				++*added;
+		}
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableFind(BsFileTable* table, const BsChar* path, uint32_t length,
+	uint32_t* file)
+{
+	if (table == NULL || path == NULL || file == NULL)
+		return BS_E_INVALIDARG;
+
+	*file = table->table.Find(path, length);
+	return *file != FILE_TABLE_NONE ? BS_OK : BS_E_NOTFOUND;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetCount(BsFileTable* table, uint32_t* count, uint64_t* totalSize)
+{
+	if (table == NULL)
+		return BS_E_INVALIDARG;
+
+	if (count != NULL)
+		*count = table->table.Count();
+	if (totalSize != NULL)
+		*totalSize = table->table.TotalSize();
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetFile(BsFileTable* table, uint32_t file, BsFileTableEntry* entry)
+{
+	if (table == NULL || entry == NULL || file >= table->table.Count())
+		return BS_E_INVALIDARG;
+
+	entry->size = table->table.Size(file);
+	entry->lastWriteTime = table->table.LastWriteTime(file);
+	entry->progress = table->table.Progress(file);
+	entry->flags = table->table.Flags(file);
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableSetProgress(BsFileTable* table, uint32_t file, uint64_t bytes)
+{
+	if (table == NULL || file >= table->table.Count())
+		return BS_E_INVALIDARG;
+
+	table->table.SetProgress(file, bytes);
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableSetFlags(BsFileTable* table, uint32_t file, uint8_t flags)
+{
+	if (table == NULL || file >= table->table.Count())
+		return BS_E_INVALIDARG;
+
+	table->table.SetFlags(file, flags);
+	return BS_OK;
+}
+
+namespace
+{
+	BsStatus CopyPath(const PathString& source, BsChar* target, uint32_t capacity, uint32_t* length)
+	{
+		if (length != NULL)
+			*length = (uint32_t)source.size();
+		if (target == NULL || capacity <= source.size())
+			return BS_E_INVALIDARG;
+
+		std::copy(source.begin(), source.end(), target);
+		target[source.size()] = 0;
+		return BS_OK;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetPath(BsFileTable* table, uint32_t file, BsChar* path,
+	uint32_t capacity, uint32_t* length)
+{
+	if (table == NULL || file >= table->table.Count())
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		PathString result;
+		table->table.AppendPath(file, result);
+		return CopyPath(result, path, capacity, length);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetKeyName(BsFileTable* table, uint32_t file, BsChar* key,
+	uint32_t capacity, uint32_t* length)
+{
+	if (table == NULL || file >= table->table.Count())
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		PathString result;
+		table->table.AppendKeyName(file, result);
+		return CopyPath(result, key, capacity, length);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsFileTableClose(BsFileTable* table)
+{
+	delete table;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Change index
+//
+
+struct BsChangeIndex
+{
+	CChangeIndex index;
+};
+
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexOpen(const BsChar* path, uint64_t expectedFiles,
+	BsChangeIndex** index)
+{
+	if (path == NULL || index == NULL)
+		return BS_E_INVALIDARG;
+
+	*index = NULL;
+	try
+	{
+		std::unique_ptr<BsChangeIndex> result(new BsChangeIndex);
+		BsStatus status = result->index.Open(path, expectedFiles);
+		if (status != BS_OK)
+			return status;
+
+		*index = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexBeginRun(BsChangeIndex* index, uint32_t* generation)
+{
+	if (index == NULL)
+		return BS_E_INVALIDARG;
+
+	uint32_t result = index->index.BeginRun();
+	if (generation != NULL)
+		*generation = result;
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexLookup(BsChangeIndex* index, const BsScanRecord* records,
+	uint32_t count, uint8_t* states, BsChangeEntry* entries)
+{
+	if (index == NULL || ((records == NULL || states == NULL) && count != 0))
+		return BS_E_INVALIDARG;
+
+	ChangeRecord stored;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const BsScanRecord& record = records[i];
+		ChangeState state = CHANGE_NEW;
+		if (record.flags == 0)
+			state = index->index.Lookup(record.volume, record.fileId, record.size, record.lastWriteTime, stored);
+
+		states[i] = (uint8_t)state;
+		if (state == CHANGE_UNCHANGED && entries != NULL)
+		{
+			memcpy(entries[i].md5, stored.md5, sizeof(entries[i].md5));
+			entries[i].upload = stored.upload;
+		}
+	}
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexUpdate(BsChangeIndex* index, const BsScanRecord* record,
+	const uint8_t* md5, uint64_t upload)
+{
+	if (index == NULL || record == NULL || md5 == NULL)
+		return BS_E_INVALIDARG;
+
+	return index->index.Update(record->volume, record->fileId, record->size, record->lastWriteTime, md5, upload);
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexPrune(BsChangeIndex* index, uint32_t keepRuns, uint64_t* removed)
+{
+	if (index == NULL)
+		return BS_E_INVALIDARG;
+
+	uint64_t count;
+	BsStatus status = index->index.Prune(keepRuns, count);
+	if (removed != NULL)
+		*removed = count;
+	return status;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexFlush(BsChangeIndex* index)
+{
+	if (index == NULL)
+		return BS_E_INVALIDARG;
+
+	return index->index.Flush();
+}
+
+BIGSTASH_API void BSAPI_CALL BsChangeIndexClose(BsChangeIndex* index)
+{
+	delete index;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Content hashing
+//
+
+namespace
+{
+	void CopyDigest(const ContentDigest& source, BsContentDigest* digest)
+	{
+		digest->size = source.size;
+		digest->partCount = (uint32_t)source.parts.size();
+
+		std::string md5 = source.Md5Hex();
+		std::string etag = source.ETag(true);
+		snprintf(digest->md5Hex, sizeof(digest->md5Hex), "%s", md5.c_str());
+		snprintf(digest->multipartETag, sizeof(digest->multipartETag), "%s", etag.c_str());
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsHashFile(const BsChar* path, uint64_t partSize,
+	BsContentDigest* digest, uint8_t* partMd5s, uint32_t partCapacity)
+{
+	if (path == NULL || digest == NULL || (partMd5s == NULL && partCapacity != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		ContentDigest result;
+		BsStatus status = HashFile(path, partSize, result);
+		if (status != BS_OK)
+			return status;
+
+		CopyDigest(result, digest);
+
+		size_t parts = std::min<size_t>(partCapacity, result.parts.size());
+		for (size_t i = 0; i < parts; ++i)
+			memcpy(partMd5s + i * MD5_DIGEST_SIZE, result.parts[i].md5, MD5_DIGEST_SIZE);
+
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsHashFiles(const BsChar* const* paths, uint32_t count,
+	uint64_t partSize, uint32_t threadCount, BsContentDigest* digests, BsStatus* statuses)
+{
+	if (paths == NULL || digests == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::vector<PathString> pathList;
+		pathList.reserve(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (paths[i] == NULL)
+				return BS_E_INVALIDARG;
+			pathList.push_back(paths[i]);
+		}
+
+		std::vector<ContentDigest> results;
+		std::vector<BsStatus> resultStatuses;
+		HashFiles(pathList, partSize, threadCount, results, resultStatuses);
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (resultStatuses[i] == BS_OK)
+				CopyDigest(results[i], &digests[i]);
+			else
+				memset(&digests[i], 0, sizeof(digests[i]));
+
+			if (statuses != NULL)
+				statuses[i] = resultStatuses[i];
+		}
+
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Duplicate content
+//
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFindDuplicates(const BsChar* const* paths, const uint64_t* sizes,
+	uint32_t count, const BsDuplicateOptions* options, uint32_t* duplicateOf, BsDuplicateStats* stats)
+{
+	if (paths == NULL || sizes == NULL || duplicateOf == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::vector<PathString> pathList;
+		pathList.reserve(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (paths[i] == NULL)
+				return BS_E_INVALIDARG;
+			pathList.push_back(paths[i]);
+		}
+		std::vector<uint64_t> sizeList(sizes, sizes + count);
+
+		DuplicateOptions findOptions;
+		if (options != NULL)
+		{
+			findOptions.threadCount = options->threads;
+			if (options->sampleSize != 0)
+				findOptions.sampleSize = options->sampleSize;
+			if (options->minSize != 0)
+				findOptions.minSize = options->minSize;
+		}
+
+		std::vector<uint32_t> found;
+		DuplicateStats findStats;
+		FindDuplicates(pathList, sizeList, findOptions, found, findStats);
+
+		memcpy(duplicateOf, found.data(), count * sizeof(uint32_t));
+		if (stats != NULL)
+		{
+			stats->candidates = findStats.candidates;
+			stats->hashed = findStats.hashed;
+			stats->duplicates = findStats.duplicates;
+			stats->bytes = findStats.bytes;
+			stats->bytesRead = findStats.bytesRead;
+			stats->bytesSaved = findStats.bytesSaved;
+		}
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Part reader
+//
+
+struct BsPartReader
+{
+	BsPartReader(size_t bufferSize, size_t bufferCount) : pool(bufferSize, bufferCount), reader(pool) {}
+
+	CBufferPool pool;
+	CPartReader reader;
+};
+
+//
+//   FUNCTION: BsPartReaderOpen(...)
+//
+//   PURPOSE: Plans the requested parts and starts a CPartReader over them,
+//            with a private pool of readAhead + 2 buffers: the parts read
+//            ahead plus two in the caller's hands.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsPartReaderOpen(const BsChar* path, uint64_t partSize,
+	const uint32_t* partNumbers, uint32_t partCount, uint32_t readAhead, uint32_t flags,
+	BsPartReader** reader)
+{
+	if (path == NULL || reader == NULL || (partNumbers != NULL && partCount == 0))
+		return BS_E_INVALIDARG;
+
+	*reader = NULL;
+
+	try
+	{
+		CFile file;
+		uint64_t fileSize = 0;
+		BsStatus status = file.Open(path);
+		if (status == BS_OK)
+			status = file.GetSize(fileSize);
+		if (status != BS_OK)
+			return status;
+		file.Close();
+
+		std::vector<PartSpan> all = UniformParts(fileSize, partSize);
+		std::vector<PartSpan> parts;
+		if (partNumbers == NULL)
+			parts.swap(all);
+		else
+		{
+			for (uint32_t i = 0; i < partCount; ++i)
+			{
+				if (partNumbers[i] == 0 || partNumbers[i] > all.size())
+					return BS_E_INVALIDARG;
+				parts.push_back(all[partNumbers[i] - 1]);
+			}
+		}
+
+		PartReaderOptions options;
+		if (readAhead != 0)
+			options.readAhead = readAhead;
+		if (flags & BS_PART_READER_MAPPED)
+			options.mode = PART_READ_MAPPED;
+		else if (flags & BS_PART_READER_DIRECT)
+			options.mode = PART_READ_DIRECT;
+		options.dropCache = (flags & BS_PART_READER_DROP_CACHE) != 0;
+		options.computeMd5 = (flags & BS_PART_READER_MD5) != 0;
+		options.computeSha256 = (flags & BS_PART_READER_SHA256) != 0;
+
+		size_t bufferSize = 0;
+		for (const PartSpan& part : parts)
+			bufferSize = std::max(bufferSize, (size_t)part.length);
+		if (bufferSize > UINT32_MAX)
+			return BS_E_INVALIDARG;
+
+		size_t bufferCount = options.mode == PART_READ_MAPPED ? 0 : options.readAhead + 2;
+		std::unique_ptr<BsPartReader> result(new BsPartReader(std::max<size_t>(bufferSize, 1), bufferCount));
+
+		status = result->reader.Open(path, parts, options);
+		if (status != BS_OK)
+			return status;
+
+		*reader = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsPartReaderNext(BsPartReader* reader, BsPart* part)
+{
+	if (reader == NULL || part == NULL)
+		return BS_E_INVALIDARG;
+
+	memset(part, 0, sizeof(*part));
+
+	PartData* data = NULL;
+	BsStatus status = reader->reader.Next(data);
+	if (status != BS_OK)
+		return status;
+
+	part->partNumber = data->partNumber;
+	part->length = (uint32_t)data->length;
+	part->offset = data->offset;
+	part->data = data->data;
+	memcpy(part->md5, data->md5, MD5_DIGEST_SIZE);
+	memcpy(part->sha256, data->sha256, SHA256_DIGEST_SIZE);
+	part->handle = data;
+	return BS_OK;
+}
+
+BIGSTASH_API void BSAPI_CALL BsPartReaderRelease(BsPartReader* reader, BsPart* part)
+{
+	if (reader == NULL || part == NULL || part->handle == NULL)
+		return;
+
+	reader->reader.Release(static_cast<PartData*>(part->handle));
+	memset(part, 0, sizeof(*part));
+}
+
+BIGSTASH_API void BSAPI_CALL BsPartReaderClose(BsPartReader* reader)
+{
+	delete reader;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Part planning
+//
+
+BIGSTASH_API BsStatus BSAPI_CALL BsPlanParts(uint64_t fileSize, uint64_t throughput, uint32_t connections,
+	BsPartLayout* layout)
+{
+	if (layout == NULL)
+		return BS_E_INVALIDARG;
+
+	PartPlanOptions options;
+	options.throughput = throughput;
+	options.connections = std::max<uint32_t>(connections, 1);
+
+	PartLayout result;
+	BsStatus status = PlanParts(fileSize, options, result);
+	if (status != BS_OK)
+		return status;
+
+	layout->fileSize = result.fileSize;
+	layout->partSize = result.partSize;
+	layout->partCount = result.partCount;
+	return BS_OK;
+}
+
+//
+//   FUNCTION: BsPlanRemainingParts(...)
+//
+//   PURPOSE: Marks the listed parts in a CPartBitmap and writes out the
+//            missing part numbers, in O(parts) overall.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsPlanRemainingParts(uint64_t fileSize, uint64_t partSize,
+	const uint32_t* uploadedParts, const uint64_t* uploadedSizes, uint32_t uploadedCount,
+	uint32_t* remaining, uint32_t remainingCapacity, uint32_t* remainingCount, uint64_t* uploadedBytes)
+{
+	if ((uploadedCount != 0 && (uploadedParts == NULL || uploadedSizes == NULL)) ||
+		(remaining == NULL && remainingCapacity != 0) || remainingCount == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		PartLayout layout;
+		BsStatus status = PartLayout::FromPartSize(fileSize, partSize, layout);
+		if (status != BS_OK)
+			return status;
+
+		CPartBitmap bitmap(layout);
+		for (uint32_t i = 0; i < uploadedCount; ++i)
+		{
+			status = bitmap.MarkCompleted(uploadedParts[i], uploadedSizes[i]);
+			if (status != BS_OK)
+				return status;
+		}
+
+		std::vector<PartSpan> parts;
+		bitmap.RemainingParts(parts);
+
+		*remainingCount = (uint32_t)parts.size();
+		if (uploadedBytes != NULL)
+			*uploadedBytes = bitmap.CompletedBytes();
+
+		size_t copied = std::min<size_t>(remainingCapacity, parts.size());
+		for (size_t i = 0; i < copied; ++i)
+			remaining[i] = parts[i].partNumber;
+
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Client-side encryption
+//
+
+BIGSTASH_API BsStatus BSAPI_CALL BsRandomBytes(uint8_t* data, uint32_t length)
+{
+	if (data == NULL && length != 0)
+		return BS_E_INVALIDARG;
+
+	return RandomBytes(data, length);
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsDecryptPart(const uint8_t* key, const uint8_t* nonce, uint32_t partNumber,
+	uint8_t* data, uint64_t length, uint64_t* plainLength)
+{
+	if (key == NULL || nonce == NULL || (data == NULL && length != 0) || length > SIZE_MAX)
+		return BS_E_INVALIDARG;
+
+	CAesGcm cipher;
+	cipher.SetKey(key);
+	PartEncryption encryption;
+	encryption.cipher = &cipher;
+	memcpy(encryption.nonce, nonce, GCM_NONCE_SIZE);
+
+	size_t decrypted = 0;
+	if (!OpenPart(encryption, partNumber, data, (size_t)length, decrypted))
+		return BS_E_CORRUPT;
+
+	if (plainLength != NULL)
+		*plainLength = decrypted;
+	return BS_OK;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// S3 multipart upload
+//
+
+struct BsS3Client
+{
+	explicit BsS3Client(const S3ClientOptions& options) : client(options), signPayload(false) {}
+
+	// declared first: the client's signer hook points at it.
+	std::unique_ptr<CSigV4Signer> signer;
+	CS3Client client;
+	bool signPayload;
+};
+
+namespace
+{
+	// Copies a string out with its terminator; BS_E_INVALIDARG when it does
+	// not fit.
+	BsStatus CopyString(const std::string& value, char* buffer, uint32_t capacity)
+	{
+		if (buffer == NULL || value.size() >= capacity)
+			return BS_E_INVALIDARG;
+
+		memcpy(buffer, value.c_str(), value.size() + 1);
+		return BS_OK;
+	}
+
+	void CopyPart(const S3Part& part, BsS3Part* result)
+	{
+		memset(result, 0, sizeof(*result));
+		result->partNumber = part.partNumber;
+		result->size = part.size;
+		strncpy(result->etag, part.etag.c_str(), sizeof(result->etag) - 1);
+		result->hasMd5 = part.hasMd5 ? 1 : 0;
+		if (part.hasMd5)
+			memcpy(result->md5, part.md5, sizeof(result->md5));
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3Open(const BsS3Options* options, BsS3Client** client)
+{
+	if (options == NULL || options->host == NULL || client == NULL)
+		return BS_E_INVALIDARG;
+
+	*client = NULL;
+
+	try
+	{
+		S3ClientOptions clientOptions;
+		clientOptions.host = options->host;
+		if (options->port != 0)
+			clientOptions.port = options->port;
+		clientOptions.virtualHostedStyle = options->virtualHostedStyle != 0;
+		if (options->connections != 0)
+			clientOptions.connections = options->connections;
+		clientOptions.window = options->window;
+		if (options->maxAttempts != 0)
+			clientOptions.maxAttempts = options->maxAttempts;
+		if (options->scheduled != 0)
+			clientOptions.scheduler = &CUploadScheduler::Process();
+		clientOptions.bandwidthLimit = options->bandwidthLimit;
+		if (options->hedgeFactor != 0)
+			clientOptions.hedging.factor = std::max(options->hedgeFactor, 0.0);
+		if (options->maxHedges != 0)
+			clientOptions.hedging.maxInFlight = options->maxHedges;
+		clientOptions.logger = &CBinaryLogger::Process();
+
+		std::unique_ptr<CSigV4Signer> signer;
+		if (options->accessKeyId != NULL)
+		{
+			if (options->secretAccessKey == NULL || options->region == NULL ||
+				options->payloadSigning > BS_S3_PAYLOAD_STREAMING)
+				return BS_E_INVALIDARG;
+
+			SigV4Credentials credentials;
+			credentials.accessKeyId = options->accessKeyId;
+			credentials.secretAccessKey = options->secretAccessKey;
+			if (options->sessionToken != NULL)
+				credentials.sessionToken = options->sessionToken;
+
+			SigV4PayloadMode mode = SIGV4_PAYLOAD_SIGNED;
+			if (options->payloadSigning == BS_S3_PAYLOAD_UNSIGNED)
+				mode = SIGV4_PAYLOAD_UNSIGNED;
+			else if (options->payloadSigning == BS_S3_PAYLOAD_STREAMING)
+				mode = SIGV4_PAYLOAD_STREAMING;
+
+			signer.reset(new CSigV4Signer(credentials, options->region, "s3", mode));
+			CSigV4Signer* signerPointer = signer.get();
+			clientOptions.signer = [signerPointer](HttpRequest& request)
+			{
+				signerPointer->Sign(request);
+			};
+		}
+
+		std::unique_ptr<BsS3Client> result(new BsS3Client(clientOptions));
+		result->signPayload = signer && options->payloadSigning != BS_S3_PAYLOAD_UNSIGNED;
+		result->signer = std::move(signer);
+		BsStatus status = result->client.Start();
+		if (status != BS_OK)
+			return status;
+
+		*client = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3InitiateMultipartUpload(BsS3Client* client, const char* bucket, const char* key,
+	char* uploadId, uint32_t uploadIdCapacity)
+{
+	if (client == NULL || bucket == NULL || key == NULL || uploadId == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::string result;
+		BsStatus status = client->client.InitiateMultipartUpload(bucket, key, result);
+		if (status != BS_OK)
+			return status;
+
+		return CopyString(result, uploadId, uploadIdCapacity);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+namespace
+{
+	//
+	//   FUNCTION: UploadFileParts(...)
+	//
+	//   PURPOSE: Reads the selected parts through a CPartReader whose pool
+	//            holds a buffer for every part in flight plus the read-ahead,
+	//            encrypting them when asked, and streams them to S3 with
+	//            CS3Client::UploadParts.
+	//
+	BsStatus UploadFileParts(BsS3Client* client, const char* bucket, const char* key, const char* uploadId,
+		const BsChar* path, uint64_t partSize, const uint32_t* partNumbers, uint32_t partCount, uint32_t readerFlags,
+		const PartEncryption& encryption, BsS3PartCallback callback, void* context)
+	{
+		CFile file;
+		uint64_t fileSize = 0;
+		BsStatus status = file.Open(path);
+		if (status == BS_OK)
+			status = file.GetSize(fileSize);
+		if (status != BS_OK)
+			return status;
+		file.Close();
+
+		std::vector<PartSpan> all = UniformParts(fileSize, partSize);
+		std::vector<PartSpan> parts;
+		if (partNumbers == NULL)
+			parts.swap(all);
+		else
+		{
+			for (uint32_t i = 0; i < partCount; ++i)
+			{
+				if (partNumbers[i] == 0 || partNumbers[i] > all.size())
+					return BS_E_INVALIDARG;
+				parts.push_back(all[partNumbers[i] - 1]);
+			}
+		}
+
+		PartReaderOptions options;
+		if (readerFlags & BS_PART_READER_MAPPED)
+			options.mode = PART_READ_MAPPED;
+		else if (readerFlags & BS_PART_READER_DIRECT)
+			options.mode = PART_READ_DIRECT;
+		options.dropCache = (readerFlags & BS_PART_READER_DROP_CACHE) != 0;
+		options.computeMd5 = (readerFlags & BS_PART_READER_MD5) != 0;
+		options.computeSha256 = (readerFlags & BS_PART_READER_SHA256) != 0 || client->signPayload;
+		options.encryption = encryption;
+
+		size_t bufferSize = 0;
+		for (const PartSpan& part : parts)
+			bufferSize = std::max(bufferSize, (size_t)part.length);
+		if (encryption.cipher != NULL)
+			bufferSize += GCM_TAG_SIZE;
+		if (bufferSize > UINT32_MAX)
+			return BS_E_INVALIDARG;
+
+		const S3ClientOptions& clientOptions = client->client.Options();
+		size_t window = clientOptions.window != 0 ? clientOptions.window : clientOptions.connections;
+		size_t bufferCount = options.mode == PART_READ_MAPPED ? 0 : options.readAhead + window;
+		CBufferPool pool(std::max<size_t>(bufferSize, 1), bufferCount);
+		CPartReader reader(pool);
+
+		// NULL unless BsTraceEnable turned tracing on.
+		std::shared_ptr<CUploadTrace> trace = CUploadTracer::Process().BeginUpload(key);
+		options.trace = trace.get();
+
+		status = reader.Open(path, parts, options);
+		if (status != BS_OK)
+		{
+			CUploadTracer::Process().EndUpload(trace);
+			return status;
+		}
+
+		S3PartCallback onPart;
+		if (callback != NULL)
+		{
+			onPart = [callback, context](const S3Part& part)
+			{
+				BsS3Part result;
+				CopyPart(part, &result);
+				callback(&result, context);
+			};
+		}
+
+		std::vector<S3Part> uploaded;
+		status = client->client.UploadParts(bucket, key, uploadId, reader, uploaded, onPart, NULL, trace.get());
+		reader.Close();
+		CUploadTracer::Process().EndUpload(trace);
+		return status;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadFile(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsChar* path, uint64_t partSize, const uint32_t* partNumbers, uint32_t partCount,
+	uint32_t readerFlags, BsS3PartCallback callback, void* context)
+{
+	if (client == NULL || bucket == NULL || key == NULL || uploadId == NULL || path == NULL ||
+		(partNumbers != NULL && partCount == 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		return UploadFileParts(client, bucket, key, uploadId, path, partSize, partNumbers, partCount, readerFlags,
+			PartEncryption(), callback, context);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadFileEncrypted(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsChar* path, uint64_t partSize, const uint32_t* partNumbers, uint32_t partCount,
+	uint32_t readerFlags, const BsEncryptOptions* encryption, BsS3PartCallback callback, void* context)
+{
+	if (client == NULL || bucket == NULL || key == NULL || uploadId == NULL || path == NULL ||
+		(partNumbers != NULL && partCount == 0) || encryption == NULL || encryption->key == NULL ||
+		(readerFlags & BS_PART_READER_MAPPED) != 0)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		CAesGcm cipher;
+		cipher.SetKey(encryption->key);
+		PartEncryption partEncryption;
+		partEncryption.cipher = &cipher;
+		memcpy(partEncryption.nonce, encryption->nonce, GCM_NONCE_SIZE);
+
+		return UploadFileParts(client, bucket, key, uploadId, path, partSize, partNumbers, partCount, readerFlags,
+			partEncryption, callback, context);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+//
+//   FUNCTION: BsS3UploadFileCompressed(...)
+//
+//   PURPOSE: Reads the file in 1 MB pieces through a CPartReader, which also
+//            hashes the content for the manifest, and uploads the parts of
+//            a CPartCompressor over it. The output pool holds a part for
+//            every request in flight plus two being filled.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadFileCompressed(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsChar* path, uint64_t partSize, const BsCompressOptions* options,
+	BsS3PartCallback callback, void* context, BsCompressedUpload* result)
+{
+	const size_t INPUT_SIZE = 1024 * 1024;
+
+	if (client == NULL || bucket == NULL || key == NULL || uploadId == NULL || path == NULL ||
+		partSize == 0 || partSize % 64 != 0 || partSize > UINT32_MAX)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		// S3 takes a part under the minimum only as the last one, as with
+		// PartLayout::FromPartSize; the compressor enforces it since the
+		// stored size, and so the part count, is not known up front.
+		PartCompressorOptions compressorOptions;
+		compressorOptions.partSize = partSize;
+		compressorOptions.minPartSize = S3_MIN_PART_SIZE;
+		compressorOptions.computeSha256 = client->signPayload;
+		if (options != NULL)
+		{
+			if (options->codec == BS_CODEC_GZIP)
+				compressorOptions.compression.format = COMPRESSION_GZIP;
+			else if (options->codec == BS_CODEC_ZSTD)
+				compressorOptions.compression.format = COMPRESSION_ZSTD;
+			else if (options->codec != BS_CODEC_NONE)
+				return BS_E_INVALIDARG;
+
+			// 0 keeps the stage's fast default for the codec picked, not
+			// the block compressor's.
+			if (options->level != 0)
+				compressorOptions.compression.level = options->level;
+			else
+				compressorOptions.compression.level = compressorOptions.compression.format == COMPRESSION_ZSTD ? 3 : 1;
+			compressorOptions.compression.threads = options->threads;
+			if (options->sniffBytes != 0)
+				compressorOptions.sniffBytes = options->sniffBytes;
+			if (options->maxEntropy != 0)
+				compressorOptions.maxEntropy = options->maxEntropy;
+			if (options->always != 0)
+				compressorOptions.sniffBytes = 0;
+			if (options->encryption != NULL && options->encryption->key == NULL)
+				return BS_E_INVALIDARG;
+		}
+		if (!CBlockCompressor::IsSupported(compressorOptions.compression.format))
+			return BS_E_NOTSUPPORTED;
+
+		CFile file;
+		uint64_t fileSize = 0;
+		BsStatus status = file.Open(path);
+		if (status == BS_OK)
+			status = file.GetSize(fileSize);
+		if (status != BS_OK)
+			return status;
+		file.Close();
+
+		PartReaderOptions readerOptions;
+		CBufferPool inputPool(INPUT_SIZE, readerOptions.readAhead + 1);
+		CPartReader input(inputPool);
+		status = input.Open(path, UniformParts(fileSize, INPUT_SIZE), readerOptions);
+		if (status != BS_OK)
+			return status;
+
+		CAesGcm cipher;
+		if (options != NULL && options->encryption != NULL)
+		{
+			cipher.SetKey(options->encryption->key);
+			compressorOptions.encryption.cipher = &cipher;
+			memcpy(compressorOptions.encryption.nonce, options->encryption->nonce, GCM_NONCE_SIZE);
+		}
+
+		const S3ClientOptions& clientOptions = client->client.Options();
+		size_t window = clientOptions.window != 0 ? clientOptions.window : clientOptions.connections;
+		size_t tagSize = compressorOptions.encryption.cipher != NULL ? GCM_TAG_SIZE : 0;
+		CBufferPool outputPool((size_t)partSize + tagSize, window + 2);
+		CPartCompressor compressor(outputPool);
+		status = compressor.Open(input, compressorOptions);
+		if (status != BS_OK)
+			return status;
+
+		S3PartCallback onPart;
+		if (callback != NULL)
+		{
+			onPart = [callback, context](const S3Part& part)
+			{
+				BsS3Part uploaded;
+				CopyPart(part, &uploaded);
+				callback(&uploaded, context);
+			};
+		}
+
+		// the parts are the compressor's, so only their network side is timed.
+		std::shared_ptr<CUploadTrace> trace = CUploadTracer::Process().BeginUpload(key);
+		std::vector<S3Part> uploaded;
+		status = client->client.UploadParts(bucket, key, uploadId, compressor, uploaded, onPart, NULL, trace.get());
+		CUploadTracer::Process().EndUpload(trace);
+		compressor.Close();
+
+		ContentDigest digest;
+		if (status == BS_OK && !input.GetContentDigest(digest))
+			status = BS_E_IO;
+		input.Close();
+
+		if (status == BS_OK && result != NULL)
+		{
+			result->codec = compressor.Codec();
+			result->originalSize = compressor.RawBytes();
+			result->storedSize = compressor.StoredBytes() + uploaded.size() * tagSize;
+			result->entropy = compressor.Sniff().entropy;
+			std::string md5 = digest.Md5Hex();
+			memcpy(result->md5Hex, md5.c_str(), md5.size() + 1);
+		}
+		return status;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3ListParts(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, BsS3Part* parts, uint32_t capacity, uint32_t* count)
+{
+	if (client == NULL || bucket == NULL || key == NULL || uploadId == NULL || count == NULL ||
+		(parts == NULL && capacity != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::vector<S3Part> listed;
+		BsStatus status = client->client.ListParts(bucket, key, uploadId, listed);
+		if (status != BS_OK)
+			return status;
+
+		*count = (uint32_t)listed.size();
+		size_t copied = std::min<size_t>(capacity, listed.size());
+		for (size_t i = 0; i < copied; ++i)
+			CopyPart(listed[i], &parts[i]);
+
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3CompleteMultipartUpload(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsS3Part* parts, uint32_t partCount, char* etag, uint32_t etagCapacity)
+{
+	if (client == NULL || bucket == NULL || key == NULL || uploadId == NULL || parts == NULL || partCount == 0)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::vector<S3Part> completed(partCount);
+		for (uint32_t i = 0; i < partCount; ++i)
+		{
+			completed[i].partNumber = parts[i].partNumber;
+			completed[i].size = parts[i].size;
+			completed[i].etag.assign(parts[i].etag, strnlen(parts[i].etag, sizeof(parts[i].etag)));
+		}
+
+		std::string result;
+		BsStatus status = client->client.CompleteMultipartUpload(bucket, key, uploadId, completed, result);
+		if (status != BS_OK || etag == NULL)
+			return status;
+
+		return CopyString(result, etag, etagCapacity);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3AbortMultipartUpload(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId)
+{
+	if (client == NULL || bucket == NULL || key == NULL || uploadId == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		return client->client.AbortMultipartUpload(bucket, key, uploadId);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3LastError(BsS3Client* client, char* code, uint32_t capacity)
+{
+	if (client == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		return CopyString(client->client.LastError(), code, capacity);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsS3Close(BsS3Client* client)
+{
+	delete client;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload progress
+//
+
+struct BsProgress
+{
+	explicit BsProgress(uint32_t fileCount) : registry(fileCount) {}
+
+	CProgressRegistry registry;
+	std::unique_ptr<CProgressPublisher> publisher;
+};
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressOpen(uint32_t fileCount, BsProgress** progress)
+{
+	if (progress == NULL)
+		return BS_E_INVALIDARG;
+
+	*progress = NULL;
+	try
+	{
+		*progress = new BsProgress(fileCount);
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressAdd(BsProgress* progress, uint32_t file, int64_t delta)
+{
+	if (progress == NULL || file >= progress->registry.FileCount())
+		return BS_E_INVALIDARG;
+
+	progress->registry.Add(file, delta);
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressSet(BsProgress* progress, uint32_t file, uint64_t bytes)
+{
+	if (progress == NULL || file >= progress->registry.FileCount())
+		return BS_E_INVALIDARG;
+
+	progress->registry.Set(file, bytes);
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressComplete(BsProgress* progress, uint32_t file)
+{
+	if (progress == NULL || file >= progress->registry.FileCount())
+		return BS_E_INVALIDARG;
+
+	progress->registry.Complete(file);
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressGetFile(BsProgress* progress, uint32_t file, uint64_t* bytes)
+{
+	if (progress == NULL || bytes == NULL || file >= progress->registry.FileCount())
+		return BS_E_INVALIDARG;
+
+	*bytes = progress->registry.File(file);
+	return BS_OK;
+}
+
+namespace
+{
+	void CopySnapshot(const ProgressSnapshot& snapshot, BsProgressSnapshot* result)
+	{
+		result->bytes = snapshot.bytes;
+		result->completedFiles = snapshot.completedFiles;
+		result->fileCount = snapshot.fileCount;
+		result->seconds = snapshot.seconds;
+		result->bytesPerSecond = snapshot.bytesPerSecond;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressGetSnapshot(BsProgress* progress, BsProgressSnapshot* snapshot)
+{
+	if (progress == NULL || snapshot == NULL)
+		return BS_E_INVALIDARG;
+
+	ProgressSnapshot current;
+	progress->registry.Snapshot(current);
+	CopySnapshot(current, snapshot);
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressPublish(BsProgress* progress, uint32_t intervalMs,
+	BsProgressCallback callback, void* context)
+{
+	if (progress == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		progress->publisher.reset();
+		if (callback == NULL)
+			return BS_OK;
+
+		progress->publisher.reset(new CProgressPublisher(progress->registry, intervalMs,
+			[callback, context](const ProgressSnapshot& snapshot)
+			{
+				BsProgressSnapshot result;
+				CopySnapshot(snapshot, &result);
+				callback(&result, context);
+			}));
+		progress->publisher->Start();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsProgressClose(BsProgress* progress)
+{
+	delete progress;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Small-file packs
+//
+
+//
+//   FUNCTION: BsS3UploadPacks(...)
+//
+//   PURPOSE: Plans the packs with PlanPacks, uploads them with a
+//            CPackUploader and copies the entries and the serialized index
+//            out.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadPacks(BsS3Client* client, const char* bucket,
+	const BsPackFile* files, uint32_t count, const BsPackOptions* options, BsPackEntry* entries,
+	uint8_t* index, uint32_t indexCapacity, uint32_t* indexSize, BsPackCallback callback, void* context)
+{
+	if (client == NULL || bucket == NULL || (files == NULL && count != 0) || (entries == NULL && count != 0) ||
+		(index == NULL && indexCapacity != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		PackOptions packOptions;
+		if (options != NULL)
+		{
+			if (options->smallFileLimit != 0)
+				packOptions.smallFileLimit = options->smallFileLimit;
+			if (options->packSize != 0)
+				packOptions.packSize = options->packSize;
+			if (options->workers != 0)
+				packOptions.workers = options->workers;
+			if (options->keyPrefix != NULL)
+				packOptions.keyPrefix = options->keyPrefix;
+		}
+		if (packOptions.packSize > S3_MAX_PART_SIZE)
+			return BS_E_INVALIDARG;
+
+		std::vector<PackInput> inputs(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (files[i].path == NULL || files[i].key == NULL)
+				return BS_E_INVALIDARG;
+			inputs[i].path = files[i].path;
+			inputs[i].key = files[i].key;
+			inputs[i].size = files[i].size;
+		}
+
+		CPackIndex packIndex;
+		std::vector<size_t> unpacked;
+		PlanPacks(inputs, packOptions, packIndex, unpacked);
+
+		PackCallback onPack;
+		if (callback != NULL)
+		{
+			onPack = [callback, context, &packIndex](const PackObject& pack)
+			{
+				BsPackObject result;
+				memset(&result, 0, sizeof(result));
+				result.number = (uint32_t)(&pack - packIndex.packs.data());
+				result.size = pack.size;
+				result.fileCount = pack.entryCount;
+				memcpy(result.md5, pack.md5, sizeof(result.md5));
+				strncpy(result.key, pack.key.c_str(), sizeof(result.key) - 1);
+				strncpy(result.etag, pack.etag.c_str(), sizeof(result.etag) - 1);
+				callback(&result, context);
+			};
+		}
+
+		CPackUploader uploader(client->client, packOptions);
+		BsStatus status = uploader.Upload(bucket, inputs, packIndex, onPack);
+		if (status != BS_OK)
+			return status;
+
+		for (size_t source : unpacked)
+		{
+			memset(&entries[source], 0, sizeof(entries[source]));
+			entries[source].pack = BS_PACK_NONE;
+		}
+		for (const PackEntry& entry : packIndex.entries)
+		{
+			BsPackEntry& result = entries[entry.source];
+			result.pack = entry.pack;
+			result.offset = entry.offset;
+			result.length = entry.length;
+			memcpy(result.md5, entry.md5, sizeof(result.md5));
+		}
+
+		std::vector<uint8_t> serialized;
+		packIndex.Serialize(serialized);
+		if (serialized.size() > UINT32_MAX)
+			return BS_E_OUTOFMEMORY;
+		if (indexSize != NULL)
+			*indexSize = (uint32_t)serialized.size();
+		if (index == NULL)
+			return BS_OK;
+		if (serialized.size() > indexCapacity)
+			return BS_E_INVALIDARG;
+
+		memcpy(index, serialized.data(), serialized.size());
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload scheduler
+//
+
+BIGSTASH_API BsStatus BSAPI_CALL BsSchedulerConfigure(const BsSchedulerOptions* options)
+{
+	if (options == NULL || options->latencyTolerance < 0 ||
+		(options->maxConcurrency != 0 && options->maxConcurrency < options->minConcurrency))
+		return BS_E_INVALIDARG;
+
+	SchedulerOptions schedulerOptions;
+	if (options->minConcurrency != 0)
+		schedulerOptions.minConcurrency = options->minConcurrency;
+	if (options->maxConcurrency != 0)
+		schedulerOptions.maxConcurrency = options->maxConcurrency;
+	if (options->latencyTolerance != 0)
+		schedulerOptions.latencyTolerance = options->latencyTolerance;
+	schedulerOptions.bandwidthLimit = options->bandwidthLimit;
+	schedulerOptions.uploadBandwidthLimit = options->uploadBandwidthLimit;
+
+	CUploadScheduler::Process().Configure(schedulerOptions);
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsSchedulerGetStats(BsSchedulerStats* stats)
+{
+	if (stats == NULL)
+		return BS_E_INVALIDARG;
+
+	SchedulerStats current = CUploadScheduler::Process().Stats();
+	stats->limit = current.limit;
+	stats->inFlight = current.inFlight;
+	stats->waiting = current.waiting;
+	stats->uploads = current.uploads;
+	stats->startup = current.startup ? 1 : 0;
+	stats->lastDecision = (uint32_t)current.lastDecision;
+	stats->requests = current.requests;
+	stats->failures = current.failures;
+	stats->bytes = current.bytes;
+	stats->rounds = current.rounds;
+	stats->increases = current.increases;
+	stats->decreases = current.decreases;
+	stats->requestSeconds = current.requestSeconds;
+	stats->maxDeliveryRate = current.maxDeliveryRate;
+	stats->minRtt = current.minRtt;
+	stats->bdpRequests = current.bdpRequests;
+	stats->slotWaitSeconds = current.slotWaitSeconds;
+	stats->throttleSeconds = current.throttleSeconds;
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsSchedulerGetDecisions(BsSchedulerDecision* decisions, uint32_t capacity,
+	uint32_t* count)
+{
+	if ((decisions == NULL && capacity != 0) || count == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::vector<SchedulerDecisionRecord> records = CUploadScheduler::Process().Decisions();
+		size_t first = records.size() > capacity ? records.size() - capacity : 0;
+		for (size_t i = first; i < records.size(); ++i)
+		{
+			BsSchedulerDecision& result = decisions[i - first];
+			result.time = records[i].time;
+			result.decision = (uint32_t)records[i].decision;
+			result.oldLimit = records[i].oldLimit;
+			result.newLimit = records[i].newLimit;
+			result.deliveryRate = records[i].deliveryRate;
+			result.meanRtt = records[i].meanRtt;
+			result.minRtt = records[i].minRtt;
+		}
+
+		*count = (uint32_t)(records.size() - first);
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload tracing
+//
+
+namespace
+{
+	double Seconds(int64_t nanoseconds)
+	{
+		return (double)nanoseconds / 1e9;
+	}
+
+	void CopyUploadStats(const TraceUploadStats& stats, BsTraceUploadStats* result)
+	{
+		memset(result, 0, sizeof(*result));
+		result->upload = stats.upload;
+		result->finished = stats.finished ? 1 : 0;
+		strncpy(result->name, stats.name.c_str(), sizeof(result->name) - 1);
+		result->partsRead = stats.partsRead;
+		result->partsSent = stats.partsSent;
+		result->bytesRead = stats.bytesRead;
+		result->bytesSent = stats.bytesSent;
+		result->retries = stats.retries;
+		result->failures = stats.failures;
+		result->hedges = stats.hedges;
+		result->hedgesWon = stats.hedgesWon;
+		result->seconds = stats.seconds;
+		result->bytesPerSecond = stats.bytesPerSecond;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceEnable(const BsTraceOptions* options)
+{
+	try
+	{
+		TraceOptions traceOptions;
+		if (options != NULL && options->eventCapacity != 0)
+			traceOptions.eventCapacity = options->eventCapacity;
+		if (options != NULL && options->keepUploads != 0)
+			traceOptions.keepUploads = options->keepUploads;
+
+		CUploadTracer::Process().Enable(traceOptions);
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceDisable()
+{
+	CUploadTracer::Process().Disable();
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceGetStats(uint32_t upload, BsTraceUploadStats* stats,
+	BsTraceStageStats* stages, uint32_t stageCount)
+{
+	if (stats == NULL || (stages == NULL && stageCount != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		TraceUploadStats current;
+		if (!CUploadTracer::Process().GetStats(upload, current))
+			return BS_E_NOTFOUND;
+
+		CopyUploadStats(current, stats);
+		for (uint32_t i = 0; i < stageCount && i < TRACE_STAGE_COUNT; ++i)
+		{
+			const TraceStageStats& stage = current.stages[i];
+			BsTraceStageStats& result = stages[i];
+			result.count = stage.count;
+			result.totalSeconds = Seconds(stage.total);
+			result.minSeconds = Seconds(stage.min);
+			result.meanSeconds = stage.mean / 1e9;
+			result.p50Seconds = Seconds(stage.p50);
+			result.p90Seconds = Seconds(stage.p90);
+			result.p99Seconds = Seconds(stage.p99);
+			result.p999Seconds = Seconds(stage.p999);
+			result.maxSeconds = Seconds(stage.max);
+		}
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceGetUploads(BsTraceUploadStats* uploads, uint32_t capacity, uint32_t* count)
+{
+	if ((uploads == NULL && capacity != 0) || count == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::vector<TraceUploadStats> current = CUploadTracer::Process().Uploads();
+		size_t first = current.size() > capacity ? current.size() - capacity : 0;
+		for (size_t i = first; i < current.size(); ++i)
+			CopyUploadStats(current[i], &uploads[i - first]);
+
+		*count = (uint32_t)(current.size() - first);
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceWrite(const BsChar* path)
+{
+	if (path == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		return CUploadTracer::Process().WriteTrace(path);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload log
+//
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogOpen(const BsChar* path, const BsLogOptions* options)
+{
+	try
+	{
+		LogOptions logOptions;
+		if (options != NULL)
+		{
+			if (options->level > BS_LOG_ERROR)
+				return BS_E_INVALIDARG;
+			if (options->ringRecords != 0)
+				logOptions.ringRecords = options->ringRecords;
+			if (options->flushIntervalMs != 0)
+				logOptions.flushIntervalMs = options->flushIntervalMs;
+			if (options->level != 0)
+				logOptions.level = (LogLevel)options->level;
+			logOptions.maxPerSecond = options->maxPerSecond;
+		}
+
+		return CBinaryLogger::Process().Open(path, logOptions);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogClose()
+{
+	CBinaryLogger::Process().Close();
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogRegisterFormat(uint32_t level, const char* text, uint32_t* format)
+{
+	if (text == NULL || format == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		*format = CBinaryLogger::Process().RegisterFormat((LogLevel)level, text);
+		return *format != 0 ? BS_OK : BS_E_INVALIDARG;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogIntern(const char* text, uint32_t* id)
+{
+	if (text == NULL || id == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		*id = CBinaryLogger::Process().Intern(text);
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsLogWrite(uint32_t format, const uint64_t* args, uint32_t count)
+{
+	if (args == NULL)
+		count = 0;
+	CBinaryLogger::Process().Write(format, args, count);
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogFlush()
+{
+	CBinaryLogger::Process().Flush();
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogGetStats(BsLogStats* stats)
+{
+	if (stats == NULL)
+		return BS_E_INVALIDARG;
+
+	LogStats current = CBinaryLogger::Process().Stats();
+	stats->written = current.written;
+	stats->dropped = current.dropped;
+	stats->rateLimited = current.rateLimited;
+	stats->bytesWritten = current.bytesWritten;
+	stats->writeStatus = current.writeStatus;
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogDecode(const BsChar* path, const BsChar* textPath, uint64_t* records)
+{
+	if (path == NULL || textPath == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		CFile text;
+		BsStatus status = text.Open(textPath, FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE);
+		if (status != BS_OK)
+			return status;
+
+		// written in 1 MB pieces, so a large log is not held as text.
+		std::string pending;
+		uint64_t offset = 0;
+		BsStatus writeStatus = BS_OK;
+		auto write = [&]()
+		{
+			if (writeStatus == BS_OK && !pending.empty())
+			{
+				writeStatus = text.WriteAt(offset, pending.data(), pending.size());
+				offset += pending.size();
+			}
+			pending.clear();
+		};
+
+		status = DecodeLog(path, [&](const std::string& line)
+		{
+			pending += line;
+			pending += '\n';
+			if (pending.size() >= 1024 * 1024)
+				write();
+		}, records);
+		write();
+		return status != BS_OK ? status : writeStatus;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Resume journal
+//
+
+struct BsJournal
+{
+	CResumeJournal journal;
+	std::unique_ptr<CPartLedger> ledger;
+};
+
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalOpen(const BsChar* path, const BsJournalOptions* options,
+	BsJournal** journal)
+{
+	if (path == NULL || journal == NULL)
+		return BS_E_INVALIDARG;
+
+	*journal = NULL;
+	try
+	{
+		JournalOptions journalOptions;
+		LedgerOptions ledgerOptions;
+		if (options != NULL)
+		{
+			if (options->commitIntervalMs != 0)
+				journalOptions.commitIntervalMs = options->commitIntervalMs;
+			if (options->compactBytes != 0)
+				journalOptions.compactBytes = options->compactBytes;
+			journalOptions.sync = (options->flags & BS_JOURNAL_NO_SYNC) == 0;
+			ledgerOptions.verifyEvery = options->verifyEvery;
+			ledgerOptions.partOverhead = options->partOverhead;
+			ledgerOptions.etagsAreMd5 = (options->flags & BS_JOURNAL_OPAQUE_ETAGS) == 0;
+		}
+
+		std::unique_ptr<BsJournal> result(new BsJournal);
+		BsStatus status = result->journal.Open(path, journalOptions);
+		if (status != BS_OK)
+			return status;
+		result->ledger.reset(new CPartLedger(result->journal, ledgerOptions));
+
+		*journal = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalAppend(BsJournal* journal, const BsJournalRecord* record,
+	uint64_t* sequence)
+{
+	if (journal == NULL || record == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		JournalRecord current;
+		current.type = (JournalRecordType)record->type;
+		current.file = record->file;
+		current.partNumber = record->partNumber;
+		current.size = record->size;
+		if (record->text != NULL)
+			current.text = record->text;
+		current.hasMd5 = record->md5 != NULL;
+		if (record->md5 != NULL)
+			memcpy(current.md5, record->md5, MD5_DIGEST_SIZE);
+		return journal->journal.Append(current, sequence);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalSync(BsJournal* journal, uint64_t sequence)
+{
+	if (journal == NULL)
+		return BS_E_INVALIDARG;
+
+	return journal->journal.Sync(sequence);
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalGetFileCount(BsJournal* journal, uint32_t* count)
+{
+	if (journal == NULL || count == NULL)
+		return BS_E_INVALIDARG;
+
+	*count = journal->journal.FileCount();
+	return BS_OK;
+}
+
+//
+//   FUNCTION: BsJournalGetFile(...)
+//
+//   PURPOSE: Copies a file's journal state and its completed parts out;
+//            the upload ID, MD5 and ETags are cut to the field sizes.
+//
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalGetFile(BsJournal* journal, uint32_t file, BsJournalFile* state,
+	BsS3Part* parts, uint32_t capacity)
+{
+	if (journal == NULL || state == NULL || (parts == NULL && capacity != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		JournalFileState current;
+		if (!journal->journal.GetFile(file, current))
+			return BS_E_INVALIDARG;
+
+		memset(state, 0, sizeof(*state));
+		state->started = current.started ? 1 : 0;
+		state->completed = current.completed ? 1 : 0;
+		state->partSize = current.partSize;
+		state->size = current.size;
+		state->partCount = (uint32_t)current.parts.size();
+		strncpy(state->uploadId, current.uploadId.c_str(), sizeof(state->uploadId) - 1);
+		strncpy(state->md5, current.md5.c_str(), sizeof(state->md5) - 1);
+
+		uint32_t copied = std::min(capacity, state->partCount);
+		for (uint32_t i = 0; i < copied; ++i)
+			CopyPart(current.parts[i], &parts[i]);
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalResume(BsJournal* journal, BsS3Client* client, const char* bucket,
+	const char* key, uint32_t file, uint64_t fileSize, BsLedgerPlan* plan, uint32_t* remaining, uint32_t capacity)
+{
+	if (journal == NULL || client == NULL || bucket == NULL || key == NULL || plan == NULL ||
+		(remaining == NULL && capacity != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		LedgerResume resume;
+		BsStatus status = journal->ledger->Resume(client->client, bucket, key, file, fileSize, resume);
+		if (status != BS_OK)
+			return status;
+
+		memset(plan, 0, sizeof(*plan));
+		plan->source = (uint32_t)resume.source;
+		plan->partSize = resume.layout.partSize;
+		plan->partCount = resume.layout.partCount;
+		plan->uploadedCount = (uint32_t)resume.parts.size();
+		plan->uploadedBytes = resume.uploadedBytes;
+		plan->remainingCount = (uint32_t)resume.remaining.size();
+		strncpy(plan->uploadId, resume.uploadId.c_str(), sizeof(plan->uploadId) - 1);
+
+		uint32_t copied = std::min(capacity, plan->remainingCount);
+		for (uint32_t i = 0; i < copied; ++i)
+			remaining[i] = resume.remaining[i].partNumber;
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalComplete(BsJournal* journal, BsS3Client* client, const char* bucket,
+	const char* key, uint32_t file, uint64_t fileSize, const char* md5Hex, char* etag, uint32_t etagCapacity)
+{
+	if (journal == NULL || client == NULL || bucket == NULL || key == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		std::string result;
+		BsStatus status = journal->ledger->Complete(client->client, bucket, key, file, fileSize,
+			md5Hex != NULL ? md5Hex : "", result);
+		if (status != BS_OK)
+			return status;
+		return etag != NULL ? CopyString(result, etag, etagCapacity) : BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsJournalClose(BsJournal* journal)
+{
+	delete journal;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload state store
+//
+
+struct BsUploadStore
+{
+	CUploadStore store;
+};
+
+struct BsUploadTable
+{
+	CUploadTable table;
+
+	// What the strings handed out point into.
+	std::vector<StoredFile> files;
+	std::vector<StoredPack> packs;
+};
+
+namespace
+{
+	const char* NullIfEmpty(const std::string& text)
+	{
+		return text.empty() ? NULL : text.c_str();
+	}
+
+	std::string StringOrEmpty(const char* text)
+	{
+		return text != NULL ? std::string(text) : std::string();
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreOpen(const BsChar* path, BsUploadStore** store)
+{
+	if (path == NULL || store == NULL)
+		return BS_E_INVALIDARG;
+
+	*store = NULL;
+	try
+	{
+		std::unique_ptr<BsUploadStore> result(new BsUploadStore);
+		BsStatus status = result->store.Open(path);
+		if (status != BS_OK)
+			return status;
+
+		*store = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreGetCount(BsUploadStore* store, uint32_t* count)
+{
+	if (store == NULL || count == NULL)
+		return BS_E_INVALIDARG;
+
+	*count = (uint32_t)store->store.Count();
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreGetSummary(BsUploadStore* store, uint32_t index,
+	BsUploadSummary* summary)
+{
+	if (store == NULL || summary == NULL || index >= store->store.Count())
+		return BS_E_INVALIDARG;
+
+	const UploadSummary& current = store->store.GetSummary(index);
+	memset(summary, 0, sizeof(*summary));
+	summary->name = current.name.c_str();
+	summary->url = current.url.c_str();
+	summary->status = current.status.c_str();
+	summary->progress = current.progress;
+	summary->flags = (current.userPaused ? BS_UPLOAD_USER_PAUSED : 0) |
+		(current.manifestUploaded ? BS_UPLOAD_MANIFEST_UPLOADED : 0);
+	summary->fileCount = current.fileCount;
+	summary->packCount = (uint32_t)current.packCount;
+	summary->totalSize = current.totalSize;
+	summary->uploadedFiles = current.uploadedFiles;
+	summary->uploadedBytes = current.uploadedBytes;
+	return BS_OK;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreFind(BsUploadStore* store, const char* name, uint32_t* index)
+{
+	if (store == NULL || name == NULL || index == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		size_t found = store->store.Find(name);
+		if (found == SIZE_MAX)
+			return BS_E_NOTFOUND;
+
+		*index = (uint32_t)found;
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreOpenTable(BsUploadStore* store, uint32_t index,
+	BsUploadTable** table)
+{
+	if (store == NULL || table == NULL)
+		return BS_E_INVALIDARG;
+
+	*table = NULL;
+	try
+	{
+		std::unique_ptr<BsUploadTable> result(new BsUploadTable);
+		BsStatus status = store->store.OpenTable(index, result->table);
+		if (status != BS_OK)
+			return status;
+
+		*table = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadTableRead(BsUploadTable* table, uint64_t first, uint32_t count,
+	BsStoredFile* files)
+{
+	if (table == NULL || (files == NULL && count != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		table->files.clear();
+		BsStatus status = table->table.Read(first, count, table->files);
+		if (status != BS_OK)
+			return status;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const StoredFile& file = table->files[i];
+			BsStoredFile& result = files[i];
+			memset(&result, 0, sizeof(result));
+			result.fileName = NullIfEmpty(file.fileName);
+			result.keyName = NullIfEmpty(file.keyName);
+			result.filePath = NullIfEmpty(file.filePath);
+			result.size = file.size;
+			result.lastModified = file.lastModified;
+			result.progress = file.progress;
+			result.md5 = NullIfEmpty(file.md5);
+			result.uploadId = NullIfEmpty(file.uploadId);
+			result.partSize = file.partSize;
+			result.packKey = NullIfEmpty(file.packKey);
+			result.packOffset = file.packOffset;
+			result.duplicateOf = NullIfEmpty(file.duplicateOf);
+			result.codec = NullIfEmpty(file.codec);
+			result.storedSize = file.storedSize;
+			result.keyId = NullIfEmpty(file.keyId);
+			result.nonce = NullIfEmpty(file.nonce);
+			result.flags = (file.uploaded ? BS_STORED_FILE_UPLOADED : 0) |
+				(file.hasPackOffset ? BS_STORED_FILE_PACKED : 0) | (file.hasStoredSize ? BS_STORED_FILE_STORED_SIZE : 0);
+		}
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadTableGetPacks(BsUploadTable* table, BsStoredPack* packs,
+	uint32_t capacity, uint32_t* count)
+{
+	if (table == NULL || (packs == NULL && capacity != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		BsStatus status = table->table.Packs(table->packs);
+		if (status != BS_OK)
+			return status;
+
+		if (count != NULL)
+			*count = (uint32_t)table->packs.size();
+
+		uint32_t copied = std::min(capacity, (uint32_t)table->packs.size());
+		for (uint32_t i = 0; i < copied; ++i)
+		{
+			packs[i].keyName = NullIfEmpty(table->packs[i].keyName);
+			packs[i].size = table->packs[i].size;
+			packs[i].md5 = NullIfEmpty(table->packs[i].md5);
+			packs[i].fileCount = table->packs[i].fileCount;
+		}
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsUploadTableClose(BsUploadTable* table)
+{
+	delete table;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStorePut(BsUploadStore* store, const BsStoredUpload* upload)
+{
+	if (store == NULL || upload == NULL || upload->name == NULL || (upload->files == NULL && upload->fileCount != 0) ||
+		(upload->packs == NULL && upload->packCount != 0))
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		StoredUpload current;
+		current.name = upload->name;
+		current.url = StringOrEmpty(upload->url);
+		current.status = StringOrEmpty(upload->status);
+		current.progress = upload->progress;
+		current.userPaused = (upload->flags & BS_UPLOAD_USER_PAUSED) != 0;
+		current.manifestUploaded = (upload->flags & BS_UPLOAD_MANIFEST_UPLOADED) != 0;
+
+		current.files.resize((size_t)upload->fileCount);
+		for (size_t i = 0; i < current.files.size(); ++i)
+		{
+			const BsStoredFile& source = upload->files[i];
+			StoredFile& file = current.files[i];
+			file.fileName = StringOrEmpty(source.fileName);
+			file.keyName = StringOrEmpty(source.keyName);
+			file.filePath = StringOrEmpty(source.filePath);
+			file.size = source.size;
+			file.lastModified = source.lastModified;
+			file.progress = source.progress;
+			file.md5 = StringOrEmpty(source.md5);
+			file.uploaded = (source.flags & BS_STORED_FILE_UPLOADED) != 0;
+			file.uploadId = StringOrEmpty(source.uploadId);
+			file.partSize = source.partSize;
+			file.packKey = StringOrEmpty(source.packKey);
+			file.hasPackOffset = (source.flags & BS_STORED_FILE_PACKED) != 0;
+			file.packOffset = file.hasPackOffset ? source.packOffset : 0;
+			file.duplicateOf = StringOrEmpty(source.duplicateOf);
+			file.codec = StringOrEmpty(source.codec);
+			file.hasStoredSize = (source.flags & BS_STORED_FILE_STORED_SIZE) != 0;
+			file.storedSize = file.hasStoredSize ? source.storedSize : 0;
+			file.keyId = StringOrEmpty(source.keyId);
+			file.nonce = StringOrEmpty(source.nonce);
+		}
+
+		current.packs.resize(upload->packCount);
+		for (uint32_t i = 0; i < upload->packCount; ++i)
+		{
+			current.packs[i].keyName = StringOrEmpty(upload->packs[i].keyName);
+			current.packs[i].size = upload->packs[i].size;
+			current.packs[i].md5 = StringOrEmpty(upload->packs[i].md5);
+			current.packs[i].fileCount = upload->packs[i].fileCount;
+		}
+
+		return store->store.Put(current);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreSetState(BsUploadStore* store, uint32_t index, const char* status,
+	uint64_t progress, uint32_t flags)
+{
+	if (store == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		return store->store.SetState(index, StringOrEmpty(status), progress, (flags & BS_UPLOAD_USER_PAUSED) != 0,
+			(flags & BS_UPLOAD_MANIFEST_UPLOADED) != 0);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreRemove(BsUploadStore* store, uint32_t index)
+{
+	if (store == NULL)
+		return BS_E_INVALIDARG;
+
+	return store->store.Remove(index);
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreCommit(BsUploadStore* store)
+{
+	if (store == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		return store->store.Commit();
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreCompact(BsUploadStore* store)
+{
+	if (store == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		return store->store.Compact();
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreMigrate(BsUploadStore* store, const BsChar* directory,
+	const BsChar* suffix, BsStoreMigration* stats)
+{
+	if (store == NULL || directory == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+#ifdef _WIN32
+		const BsChar* defaultSuffix = L".djf";
+#else
+		const BsChar* defaultSuffix = ".djf";
+#endif
+		MigrationStats migration;
+		BsStatus status = MigrateLocalUploads(directory, suffix != NULL ? suffix : defaultSuffix, store->store,
+			migration);
+		if (stats != NULL)
+		{
+			stats->imported = migration.imported;
+			stats->fromBackup = migration.fromBackup;
+			stats->skipped = migration.skipped;
+			stats->failed = migration.failed;
+		}
+		return status;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsUploadStoreClose(BsUploadStore* store)
+{
+	delete store;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Archive manifest
+//
+
+struct BsManifestWriter
+{
+	CManifestWriter writer;
+};
+
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestOpen(const BsChar* path, const char* archiveId, int32_t userId,
+	const BsManifestOptions* options, BsManifestWriter** writer)
+{
+	if (path == NULL || archiveId == NULL || writer == NULL)
+		return BS_E_INVALIDARG;
+
+	*writer = NULL;
+	try
+	{
+		ManifestOptions manifestOptions;
+		if (options != NULL)
+		{
+			if (options->compression != BS_MANIFEST_GZIP && options->compression != BS_MANIFEST_ZSTD)
+				return BS_E_INVALIDARG;
+			manifestOptions.compression.format = options->compression == BS_MANIFEST_ZSTD ? COMPRESSION_ZSTD : COMPRESSION_GZIP;
+			manifestOptions.compression.level = options->level;
+			manifestOptions.compression.threads = options->threads;
+			if (options->blockSize != 0)
+				manifestOptions.compression.blockSize = options->blockSize;
+			manifestOptions.directories = (options->flags & BS_MANIFEST_DIRECTORIES) != 0;
+		}
+
+		std::unique_ptr<BsManifestWriter> result(new BsManifestWriter);
+		BsStatus status = result->writer.Open(path, archiveId, userId, manifestOptions);
+		if (status != BS_OK)
+			return status;
+
+		*writer = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestAddFile(BsManifestWriter* writer, const BsManifestFile* file)
+{
+	if (writer == NULL || file == NULL || file->keyName == NULL || file->filePath == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		ManifestFile current;
+		current.keyName = file->keyName;
+		current.filePath = file->filePath;
+		current.size = file->size;
+		current.lastModified = file->lastModified;
+		current.md5 = file->md5;
+		current.packKey = file->packKey;
+		current.packOffset = file->packOffset;
+		current.duplicateOf = file->duplicateOf;
+		current.codec = file->codec;
+		current.originalSize = file->originalSize;
+		current.encryption = file->encryption;
+		current.keyId = file->keyId;
+		current.nonce = file->nonce;
+		current.partSize = file->partSize;
+		return writer->writer.AddFile(current);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestAddPack(BsManifestWriter* writer, const BsManifestPack* pack)
+{
+	if (writer == NULL || pack == NULL || pack->keyName == NULL || pack->md5 == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		ManifestPack current;
+		current.keyName = pack->keyName;
+		current.size = pack->size;
+		current.md5 = pack->md5;
+		current.fileCount = pack->fileCount;
+		return writer->writer.AddPack(current);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestFinish(BsManifestWriter* writer, uint64_t* rawBytes,
+	uint64_t* compressedBytes)
+{
+	if (writer == NULL)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		BsStatus status = writer->writer.Finish();
+		if (rawBytes != NULL)
+			*rawBytes = writer->writer.RawBytes();
+		if (compressedBytes != NULL)
+			*compressedBytes = writer->writer.CompressedBytes();
+		return status;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsManifestClose(BsManifestWriter* writer)
+{
+	delete writer;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Selection channel
+//
+
+struct BsSelectionServer
+{
+	CSelectionServer server;
+};
+
+BIGSTASH_API BsStatus BSAPI_CALL BsSelectionGetDefaultChannel(BsChar* name, uint32_t capacity, uint32_t* length)
+{
+	try
+	{
+		PathString channel = DefaultSelectionChannel();
+		if (length != NULL)
+			*length = (uint32_t)channel.size();
+		if (name == NULL || capacity <= channel.size())
+			return BS_E_INVALIDARG;
+
+		std::copy(channel.begin(), channel.end(), name);
+		name[channel.size()] = 0;
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsSelectionListen(const BsChar* channel, BsSelectionCallback callback,
+	void* context, BsSelectionServer** server)
+{
+	if (callback == NULL || server == NULL)
+		return BS_E_INVALIDARG;
+
+	*server = NULL;
+	try
+	{
+		std::unique_ptr<BsSelectionServer> result(new BsSelectionServer);
+		std::vector<const BsChar*> pointers;
+		BsStatus status = result->server.Start(channel != NULL ? PathString(channel) : DefaultSelectionChannel(),
+			[callback, context, pointers](uint64_t selection, SelectionEvent event,
+				const std::vector<PathString>& paths) mutable
+			{
+				pointers.resize(paths.size());
+				for (size_t i = 0; i < paths.size(); ++i)
+					pointers[i] = paths[i].c_str();
+				callback(selection, (uint32_t)event, pointers.empty() ? NULL : &pointers[0], (uint32_t)paths.size(),
+					context);
+			});
+		if (status != BS_OK)
+			return status;
+
+		*server = result.release();
+		return BS_OK;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
+
+BIGSTASH_API void BSAPI_CALL BsSelectionStop(BsSelectionServer* server)
+{
+	delete server;
+}
+
+BIGSTASH_API BsStatus BSAPI_CALL BsSelectionSend(const BsChar* channel, const BsChar* const* paths, uint32_t count,
+	uint32_t timeoutMs)
+{
+	if (paths == NULL && count != 0)
+		return BS_E_INVALIDARG;
+
+	try
+	{
+		CSelectionSender sender;
+		BsStatus status = sender.Connect(channel != NULL ? PathString(channel) : DefaultSelectionChannel(), timeoutMs);
+		for (uint32_t i = 0; status == BS_OK && i < count; ++i)
+		{
+			if (paths[i] == NULL)
+				return BS_E_INVALIDARG;
+			status = sender.Add(paths[i], std::char_traits<BsChar>::length(paths[i]));
+		}
+		return status == BS_OK ? sender.Finish() : status;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return BS_E_OUTOFMEMORY;
+	}
+}
@@ -0,0 +1,1214 @@
+// BigStashCore.h : C interface of the BigStashCore native library.
+//
+// Everything exported here is plain C so it can be consumed through P/Invoke
+// from BigStash.WPF and BigStash.SDK. On Windows strings are UTF-16
+// (CharSet.Unicode), on the other platforms they are UTF-8.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#define BSAPI_CALL __stdcall
+#if defined(BIGSTASHCORE_EXPORTS)
+#define BSAPI_EXPORT __declspec(dllexport)
+#else
+#define BSAPI_EXPORT
+#endif
+#else
+#define BSAPI_CALL
+#define BSAPI_EXPORT __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+#define BIGSTASH_API extern "C" BSAPI_EXPORT
+#else
+#define BIGSTASH_API BSAPI_EXPORT
+#endif
+
+#ifdef _WIN32
+typedef wchar_t BsChar;
+#else
+typedef char BsChar;
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+// Status codes returned by every BigStashCore function.
+//
+
+typedef enum BsStatus
+{
+	BS_OK = 0,
+	BS_E_INVALIDARG = 1,
+	BS_E_OUTOFMEMORY = 2,
+	BS_E_IO = 3,
+	BS_E_NOTFOUND = 4,
+	BS_E_ACCESSDENIED = 5,
+	BS_E_CANCELLED = 6,
+	BS_E_CORRUPT = 7,
+	BS_E_NOTSUPPORTED = 8,
+	BS_E_NOMOREITEMS = 9      // an enumeration has no more items; not a failure
+} BsStatus;
+
+/////////////////////////////////////////////////////////////////////////////
+// File attributes. The values are the Windows FILE_ATTRIBUTE_* values so the
+// managed side can cast them straight to System.IO.FileAttributes. The POSIX
+// backends map their mode bits onto the same values.
+//
+
+#define BS_FILE_ATTRIBUTE_READONLY       0x00000001
+#define BS_FILE_ATTRIBUTE_HIDDEN         0x00000002
+#define BS_FILE_ATTRIBUTE_SYSTEM         0x00000004
+#define BS_FILE_ATTRIBUTE_DIRECTORY      0x00000010
+#define BS_FILE_ATTRIBUTE_ARCHIVE        0x00000020
+#define BS_FILE_ATTRIBUTE_NORMAL         0x00000080
+#define BS_FILE_ATTRIBUTE_TEMPORARY      0x00000100
+#define BS_FILE_ATTRIBUTE_REPARSE_POINT  0x00000400
+#define BS_FILE_ATTRIBUTE_OFFLINE        0x00001000
+
+/////////////////////////////////////////////////////////////////////////////
+// Tree scanner (TreeScanner.h)
+//
+
+// Record flags.
+#define BS_SCAN_SKIPPED_REPARSE_POINT    0x00000001  // junction or symlink, not descended into
+#define BS_SCAN_SKIPPED_RESTRICTED       0x00000002  // directory in the restricted list
+#define BS_SCAN_SKIPPED_UNREADABLE       0x00000004  // directory that could not be listed
+#define BS_SCAN_SKIPPED_INACCESSIBLE     0x00000008  // root that is gone or could not be read, see status
+
+// One scanned file, shaped after BigStash.Model.ArchiveFileInfo.
+// FileName is path + nameOffset, KeyName is path + keyOffset with the
+// separators replaced by '/'.
+typedef struct BsScanRecord
+{
+	const BsChar* path;
+	uint32_t pathLength;
+	uint32_t nameOffset;
+	uint32_t keyOffset;
+	uint32_t attributes;
+	uint32_t flags;
+	BsStatus status;          // why an inaccessible root was skipped, BS_OK otherwise
+	uint64_t size;
+	int64_t lastWriteTime;    // FILETIME ticks, UTC
+	uint64_t volume;          // volume serial number (st_dev), 0 for skipped records
+	uint64_t fileId;          // file ID (inode), 0 for skipped records
+} BsScanRecord;
+
+typedef struct BsScanStats
+{
+	uint64_t files;
+	uint64_t directories;
+	uint64_t bytes;
+	uint64_t skipped;
+	uint64_t errors;
+	uint64_t steals;
+	double seconds;
+} BsScanStats;
+
+// Receives the scanned files in batches. Calls are serialized, but they are
+// made from the scanner's worker threads. The records are only valid for the
+// duration of the call.
+typedef void (BSAPI_CALL *BsScanBatchCallback)(const BsScanRecord* records, uint32_t count, void* context);
+
+// Scans the given roots (files or directories) with threadCount workers
+// (0 picks the processor count). Directories listed in restrictedDirs are not
+// descended into and are reported with BS_SCAN_SKIPPED_RESTRICTED. A root
+// that cannot be read is reported with BS_SCAN_SKIPPED_INACCESSIBLE and its
+// status, and the other roots are still scanned.
+BIGSTASH_API BsStatus BSAPI_CALL BsScanTree(
+	const BsChar* const* roots, uint32_t rootCount,
+	const BsChar* const* restrictedDirs, uint32_t restrictedCount,
+	uint32_t threadCount, uint32_t batchSize,
+	BsScanBatchCallback callback, void* context,
+	BsScanStats* stats);
+
+/////////////////////////////////////////////////////////////////////////////
+// File name validation (FileNameValidator.h)
+//
+// The categories are the BigStash.Model.Enumerations.FileCategory values.
+//
+
+#define BS_FILE_CATEGORY_NORMAL                          0
+#define BS_FILE_CATEGORY_INVALID_CHARACTER_IN_NAME       1
+#define BS_FILE_CATEGORY_METADATA_FILE                   2  // junction point or shortcut
+#define BS_FILE_CATEGORY_TEMPORARY_FILE                  3
+#define BS_FILE_CATEGORY_TRAILING_PERIODS_OR_WHITESPACE  4
+#define BS_FILE_CATEGORY_IGNORED_SYSTEM_FILE             5  // desktop.ini, Thumbs.db, .DS_Store, ...
+#define BS_FILE_CATEGORY_FILE_NAME_TOO_LONG              6  // path over 260 UTF-16 units
+#define BS_FILE_CATEGORY_UNSYNCED_ONLINE_FILE            7
+#define BS_FILE_CATEGORY_RESTRICTED_DIRECTORY            8
+
+// Classifies count scanned files, as BsScanTree hands them over, by the
+// BigStash API's file name restrictions and the attributes the scan found,
+// writing one BS_FILE_CATEGORY_* per record to categories. Nothing is looked
+// up on disk.
+BIGSTASH_API BsStatus BSAPI_CALL BsClassifyFiles(const BsScanRecord* records, uint32_t count,
+	uint8_t* categories);
+
+/////////////////////////////////////////////////////////////////////////////
+// File table (FileTable.h)
+//
+// The files of an archive kept as columns under a tree of directory names,
+// with a path index that finds duplicates in constant time. Paths compare
+// Ordinal-IgnoreCase on Windows and exactly elsewhere. Files are numbered
+// from 0 in the order they were added.
+//
+
+typedef struct BsFileTable BsFileTable;
+
+typedef struct BsFileTableEntry
+{
+	uint64_t size;
+	int64_t lastWriteTime;    // FILETIME ticks, UTC
+	uint64_t progress;
+	uint8_t flags;
+} BsFileTableEntry;
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableOpen(uint32_t expectedFiles, BsFileTable** table);
+
+// Adds count scanned files, skipping the ones already in the table. files
+// (may be NULL) receives each record's file, new or not, and added (may be
+// NULL) the number of new files.
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableAdd(BsFileTable* table, const BsScanRecord* records, uint32_t count,
+	uint32_t* files, uint32_t* added);
+
+// BS_E_NOTFOUND when the path is not in the table.
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableFind(BsFileTable* table, const BsChar* path, uint32_t length,
+	uint32_t* file);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetCount(BsFileTable* table, uint32_t* count, uint64_t* totalSize);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetFile(BsFileTable* table, uint32_t file, BsFileTableEntry* entry);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableSetProgress(BsFileTable* table, uint32_t file, uint64_t bytes);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableSetFlags(BsFileTable* table, uint32_t file, uint8_t flags);
+
+// Write the file's full path, or its key name ('/' separated), NUL
+// terminated. BS_E_INVALIDARG when capacity is too small; length (may be
+// NULL) receives the length without the NUL either way.
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetPath(BsFileTable* table, uint32_t file, BsChar* path,
+	uint32_t capacity, uint32_t* length);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsFileTableGetKeyName(BsFileTable* table, uint32_t file, BsChar* key,
+	uint32_t capacity, uint32_t* length);
+
+BIGSTASH_API void BSAPI_CALL BsFileTableClose(BsFileTable* table);
+
+/////////////////////////////////////////////////////////////////////////////
+// Change index (ChangeIndex.h)
+//
+// The content hashes of the files stashed before, keyed by volume and file
+// ID, in a memory mapped file, so stashing a folder again only reads and
+// hashes the files whose size or last write time changed.
+//
+
+typedef struct BsChangeIndex BsChangeIndex;
+
+// File states.
+#define BS_CHANGE_NEW                    0  // not in the index
+#define BS_CHANGE_MODIFIED               1  // size or last write time differ
+#define BS_CHANGE_UNCHANGED              2  // the stored hash still holds
+
+typedef struct BsChangeEntry
+{
+	uint8_t md5[16];
+	uint64_t upload;          // what BsChangeIndexUpdate was given
+} BsChangeEntry;
+
+// Opens the index at path, creating it sized for expectedFiles when it does
+// not exist. BS_E_CORRUPT when the file is not a change index; deleting it
+// just costs a full hash on the next run.
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexOpen(const BsChar* path, uint64_t expectedFiles,
+	BsChangeIndex** index);
+
+// Starts a run; the files looked up or updated afterwards count as seen in
+// it.
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexBeginRun(BsChangeIndex* index, uint32_t* generation);
+
+// Looks up count scanned files, writing one BS_CHANGE_* per record to
+// states, and for the unchanged ones the stored entry to entries (may be
+// NULL). Skipped records are new.
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexLookup(BsChangeIndex* index, const BsScanRecord* records,
+	uint32_t count, uint8_t* states, BsChangeEntry* entries);
+
+// Records the content of a scanned file once it was hashed.
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexUpdate(BsChangeIndex* index, const BsScanRecord* record,
+	const uint8_t* md5, uint64_t upload);
+
+// Drops the files none of the last keepRuns runs saw.
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexPrune(BsChangeIndex* index, uint32_t keepRuns, uint64_t* removed);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsChangeIndexFlush(BsChangeIndex* index);
+
+// Flushes and closes the index.
+BIGSTASH_API void BSAPI_CALL BsChangeIndexClose(BsChangeIndex* index);
+
+/////////////////////////////////////////////////////////////////////////////
+// Content hashing (ContentHasher.h)
+//
+
+typedef struct BsContentDigest
+{
+	uint64_t size;
+	uint32_t partCount;
+	char md5Hex[33];          // whole-file MD5, lowercase hex
+	char multipartETag[48];   // hex(md5 of the part MD5s) + "-" + partCount
+} BsContentDigest;
+
+// Hashes a file's content in one pass. The part MD5s (16 bytes each) are
+// copied to partMd5s up to partCapacity parts; digest->partCount is the
+// number of parts the file has. partSize must be a multiple of 64.
+BIGSTASH_API BsStatus BSAPI_CALL BsHashFile(const BsChar* path, uint64_t partSize,
+	BsContentDigest* digest, uint8_t* partMd5s, uint32_t partCapacity);
+
+// Hashes many files at once on threadCount workers (0 picks the processor
+// count), using the multi-buffer kernel for the small ones. statuses may be
+// NULL.
+BIGSTASH_API BsStatus BSAPI_CALL BsHashFiles(const BsChar* const* paths, uint32_t count,
+	uint64_t partSize, uint32_t threadCount, BsContentDigest* digests, BsStatus* statuses);
+
+/////////////////////////////////////////////////////////////////////////////
+// Duplicate content (DuplicateFinder.h)
+//
+// Finds the files of an archive with the same content, so each content is
+// uploaded once and the copies are recorded as references to it in the
+// manifest. Files are bucketed by size and sampled at head and tail before
+// any is read whole.
+//
+
+// duplicateOf value of a file to upload.
+#define BS_NO_DUPLICATE                  0xFFFFFFFF
+
+typedef struct BsDuplicateOptions
+{
+	uint32_t threads;             // 0 picks the processor count
+	uint32_t sampleSize;          // bytes hashed at head and tail, 0 picks 64 KB
+	uint64_t minSize;             // smaller files are left alone, 0 picks 1 (skips empty files)
+} BsDuplicateOptions;
+
+typedef struct BsDuplicateStats
+{
+	uint64_t candidates;          // files sharing their size with another
+	uint64_t hashed;              // files read whole after their samples matched
+	uint64_t duplicates;
+	uint64_t bytes;               // size of all the files
+	uint64_t bytesRead;
+	uint64_t bytesSaved;          // size of the duplicates
+} BsDuplicateStats;
+
+// duplicateOf receives count indices: the first file with the same content,
+// or BS_NO_DUPLICATE. sizes are the scanned sizes. options and stats may be
+// NULL.
+BIGSTASH_API BsStatus BSAPI_CALL BsFindDuplicates(const BsChar* const* paths, const uint64_t* sizes,
+	uint32_t count, const BsDuplicateOptions* options, uint32_t* duplicateOf, BsDuplicateStats* stats);
+
+/////////////////////////////////////////////////////////////////////////////
+// Part reader (PartReader.h)
+//
+
+// Reader flags.
+#define BS_PART_READER_DIRECT            0x00000001  // unbuffered reads, nothing left in the page cache
+#define BS_PART_READER_MAPPED            0x00000002  // parts are mapped views of the file, no copy
+#define BS_PART_READER_DROP_CACHE        0x00000004  // drop a part's pages once it is released
+#define BS_PART_READER_MD5               0x00000008  // compute the part MD5s
+#define BS_PART_READER_SHA256            0x00000010  // compute the part SHA-256s (SigV4 payload hashes)
+
+typedef struct BsPartReader BsPartReader;
+
+// One part ready to be sent. data stays valid until BsPartReaderRelease.
+typedef struct BsPart
+{
+	uint32_t partNumber;
+	uint32_t length;
+	uint64_t offset;
+	const uint8_t* data;
+	uint8_t md5[16];          // with BS_PART_READER_MD5
+	uint8_t sha256[32];       // with BS_PART_READER_SHA256
+	void* handle;             // owned by the reader
+} BsPart;
+
+// Opens a reader over the parts of a file split into partSize bytes.
+// partNumbers selects the (1-based) parts to read, in that order; NULL reads
+// every part. Up to readAhead parts (0 picks 4) are read ahead of the caller.
+BIGSTASH_API BsStatus BSAPI_CALL BsPartReaderOpen(const BsChar* path, uint64_t partSize,
+	const uint32_t* partNumbers, uint32_t partCount, uint32_t readAhead, uint32_t flags,
+	BsPartReader** reader);
+
+// Waits for the next part. Returns BS_E_NOMOREITEMS after the last one.
+BIGSTASH_API BsStatus BSAPI_CALL BsPartReaderNext(BsPartReader* reader, BsPart* part);
+
+BIGSTASH_API void BSAPI_CALL BsPartReaderRelease(BsPartReader* reader, BsPart* part);
+
+// Stops the reader. Every part handed out must have been released.
+BIGSTASH_API void BSAPI_CALL BsPartReaderClose(BsPartReader* reader);
+
+/////////////////////////////////////////////////////////////////////////////
+// Part planning (PartPlanner.h)
+//
+
+typedef struct BsPartLayout
+{
+	uint64_t fileSize;
+	uint64_t partSize;
+	uint32_t partCount;
+} BsPartLayout;
+
+// Chooses the part size of a new multipart upload from the file size and the
+// measured throughput in bytes per second (0 when unknown) shared by
+// connections parallel uploads. The part size must be stored with the upload
+// so a resume uses the same layout. Files over 5 TB get BS_E_NOTSUPPORTED.
+BIGSTASH_API BsStatus BSAPI_CALL BsPlanParts(uint64_t fileSize, uint64_t throughput, uint32_t connections,
+	BsPartLayout* layout);
+
+// Plans the rest of a resumed upload of fileSize bytes with the persisted
+// partSize. uploadedParts / uploadedSizes are the parts ListParts returned.
+// The part numbers still to upload are written to remaining (capacity
+// layout.partCount is always enough), their count to remainingCount and the
+// bytes already uploaded to uploadedBytes. Returns BS_E_CORRUPT when a listed
+// part does not match the layout.
+BIGSTASH_API BsStatus BSAPI_CALL BsPlanRemainingParts(uint64_t fileSize, uint64_t partSize,
+	const uint32_t* uploadedParts, const uint64_t* uploadedSizes, uint32_t uploadedCount,
+	uint32_t* remaining, uint32_t remainingCapacity, uint32_t* remainingCount, uint64_t* uploadedBytes);
+
+/////////////////////////////////////////////////////////////////////////////
+// Client-side encryption (AesGcm.h)
+//
+// Parts are encrypted with AES-256-GCM as they are read, in the buffer they
+// were read into, each on its own under a nonce made of the file's nonce and
+// its part number, and stored followed by their tag. Parts can thus be sent
+// in parallel, retried, resumed and decrypted in any order. The key never
+// leaves the caller: the manifest records its ID, the file's nonce and the
+// part size.
+//
+
+#define BS_AES256_KEY_SIZE               32
+#define BS_GCM_NONCE_SIZE                12
+#define BS_GCM_TAG_SIZE                  16  // stored after every encrypted part
+
+typedef struct BsEncryptOptions
+{
+	const uint8_t* key;                 // BS_AES256_KEY_SIZE bytes
+	uint8_t nonce[BS_GCM_NONCE_SIZE];   // the file's, from BsRandomBytes; never reused under a key
+} BsEncryptOptions;
+
+// Fills data from the operating system's random source, for keys and nonces.
+BIGSTASH_API BsStatus BSAPI_CALL BsRandomBytes(uint8_t* data, uint32_t length);
+
+// Decrypts one part of an encrypted object in place. length covers the tag;
+// plainLength receives the part's size. Returns BS_E_CORRUPT, with data
+// zeroed, when the part was altered or is not the partNumber of the file
+// with that nonce.
+BIGSTASH_API BsStatus BSAPI_CALL BsDecryptPart(const uint8_t* key, const uint8_t* nonce, uint32_t partNumber,
+	uint8_t* data, uint64_t length, uint64_t* plainLength);
+
+/////////////////////////////////////////////////////////////////////////////
+// S3 multipart upload (S3Client.h)
+//
+// Strings are UTF-8. Requests are signed with Signature Version 4 when an
+// access key is given, and sent unsigned otherwise.
+//
+
+typedef struct BsS3Client BsS3Client;
+
+// How part bodies are covered by the signature. The signed modes hash each
+// part once; BsS3UploadFile has the part reader do it while reading.
+#define BS_S3_PAYLOAD_SIGNED             0  // x-amz-content-sha256 of the whole part
+#define BS_S3_PAYLOAD_UNSIGNED           1  // UNSIGNED-PAYLOAD, Content-MD5 only
+#define BS_S3_PAYLOAD_STREAMING          2  // aws-chunked with chained chunk signatures
+
+typedef struct BsS3Options
+{
+	const char* host;
+	uint16_t port;
+	uint32_t virtualHostedStyle;  // bucket.host/key instead of host/bucket/key
+	uint32_t connections;         // persistent connections, 0 picks 8
+	uint32_t window;              // parts in flight, 0 uses one per connection
+	uint32_t maxAttempts;         // tries per request, 0 picks 3
+
+	// Credentials (S3Info.AccessKey, SecretKey and SessionToken) and the
+	// bucket region; accessKeyId NULL leaves requests unsigned.
+	const char* accessKeyId;
+	const char* secretAccessKey;
+	const char* sessionToken;     // NULL unless the credentials are temporary
+	const char* region;
+	uint32_t payloadSigning;      // BS_S3_PAYLOAD_*
+
+	// Nonzero sends every part through the process scheduler (see
+	// BsSchedulerConfigure); window then caps one file's share.
+	uint32_t scheduled;
+	uint64_t bandwidthLimit;      // bytes per second per file, 0 takes the scheduler's default
+
+	// A part still out after hedgeFactor times the 95th percentile of the
+	// recent parts of its size is sent again; the first answer wins.
+	double hedgeFactor;           // 0 picks 3, negative never sends a part twice
+	uint32_t maxHedges;           // parts sent twice at once per file, 0 picks 2
+} BsS3Options;
+
+typedef struct BsS3Part
+{
+	uint32_t partNumber;
+	uint64_t size;
+	char etag[72];                // quoted, as S3 returned it
+	uint32_t hasMd5;              // nonzero when md5 is set: parts the part reader hashed
+	uint8_t md5[16];              // of the body as sent
+} BsS3Part;
+
+// Called for every part S3 accepted, on the thread that called
+// BsS3UploadFile.
+typedef void (BSAPI_CALL *BsS3PartCallback)(const BsS3Part* part, void* context);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3Open(const BsS3Options* options, BsS3Client** client);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3InitiateMultipartUpload(BsS3Client* client, const char* bucket, const char* key,
+	char* uploadId, uint32_t uploadIdCapacity);
+
+// Uploads the parts of a file split into partSize bytes. partNumbers selects
+// the (1-based) parts, NULL uploads every part. readerFlags are the
+// BS_PART_READER_* flags; with BS_PART_READER_MD5 every part carries a
+// Content-MD5 that S3 verifies. BS_PART_READER_SHA256 is implied by the
+// signed payload modes. Stops at the first part that fails every attempt.
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadFile(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsChar* path, uint64_t partSize, const uint32_t* partNumbers, uint32_t partCount,
+	uint32_t readerFlags, BsS3PartCallback callback, void* context);
+
+// BsS3UploadFile with every part encrypted (see BsEncryptOptions), each sent
+// BS_GCM_TAG_SIZE bytes longer than its share of the file. A resume must use
+// the same key, nonce and part size, and take the tag off the sizes ListParts
+// reports before BsPlanRemainingParts, so keep the nonce with the upload's
+// state. Resume only a file whose size and modification time are those it
+// had when the upload started: a changed file's parts would be other content
+// under the same nonce, which breaks GCM, so abort the upload and start a new
+// one under a new nonce. BS_PART_READER_MAPPED is refused: the parts are
+// encrypted in place.
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadFileEncrypted(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsChar* path, uint64_t partSize, const uint32_t* partNumbers, uint32_t partCount,
+	uint32_t readerFlags, const BsEncryptOptions* encryption, BsS3PartCallback callback, void* context);
+
+// Content codecs: how an object stores its file.
+#define BS_CODEC_NONE                    0  // as it is
+#define BS_CODEC_GZIP                    1
+#define BS_CODEC_ZSTD                    2  // BS_E_NOTSUPPORTED unless built with zstd
+
+typedef struct BsCompressOptions
+{
+	uint32_t codec;               // BS_CODEC_GZIP or BS_CODEC_ZSTD, BS_CODEC_NONE picks zstd when built with it
+	int32_t level;                // 0 picks 1 (gzip) or 3 (zstd), as options == NULL does
+	uint32_t threads;             // compressing threads, 0 picks the processor count
+	uint32_t sniffBytes;          // bytes sniffed before deciding, 0 picks 256 KB
+	double maxEntropy;            // bits per byte above which the file is sent as it is, 0 picks 7.5
+	uint32_t always;              // nonzero compresses without sniffing
+	const BsEncryptOptions* encryption;  // encrypts the stored parts, NULL sends them as they are
+} BsCompressOptions;
+
+typedef struct BsCompressedUpload
+{
+	uint32_t codec;               // what the object holds, BS_CODEC_NONE when the file did not look compressible
+	uint64_t originalSize;
+	uint64_t storedSize;          // the object's size
+	double entropy;               // of the sniffed bytes, bits per byte
+	char md5Hex[33];              // MD5 of the file's content, for the manifest
+} BsCompressedUpload;
+
+// Uploads a whole file compressed: the parts are read, sniffed, compressed on
+// every core and cut into parts of partSize bytes (the last one shorter) as
+// they are sent, each with a Content-MD5; with options->encryption every part
+// is then encrypted and grows by its tag. result receives what the manifest
+// records. A resumed upload starts over. options may be NULL. A partSize
+// under 5 MB only works when the stored content fits in one part; the
+// upload fails with BS_E_INVALIDARG as soon as it needs a second.
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadFileCompressed(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsChar* path, uint64_t partSize, const BsCompressOptions* options,
+	BsS3PartCallback callback, void* context, BsCompressedUpload* result);
+
+// Writes up to capacity of the uploaded parts to parts and their total
+// number to count.
+BIGSTASH_API BsStatus BSAPI_CALL BsS3ListParts(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, BsS3Part* parts, uint32_t capacity, uint32_t* count);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3CompleteMultipartUpload(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId, const BsS3Part* parts, uint32_t partCount, char* etag, uint32_t etagCapacity);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsS3AbortMultipartUpload(BsS3Client* client, const char* bucket, const char* key,
+	const char* uploadId);
+
+// The S3 error code (e.g. NoSuchUpload) of the last failed request.
+BIGSTASH_API BsStatus BSAPI_CALL BsS3LastError(BsS3Client* client, char* code, uint32_t capacity);
+
+// Waits for the requests in flight and closes the connections.
+BIGSTASH_API void BSAPI_CALL BsS3Close(BsS3Client* client);
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload progress (ProgressRegistry.h)
+//
+// Per-file progress counters written from any thread without locks, with
+// constant time totals and a publisher that hands snapshots to the UI at a
+// fixed interval.
+//
+
+typedef struct BsProgress BsProgress;
+
+typedef struct BsProgressSnapshot
+{
+	uint64_t bytes;
+	uint64_t completedFiles;
+	uint32_t fileCount;
+	double seconds;               // since the publisher started
+	double bytesPerSecond;        // smoothed over about a second; 0 from BsProgressGetSnapshot
+} BsProgressSnapshot;
+
+// Called on the publisher's thread.
+typedef void (BSAPI_CALL *BsProgressCallback)(const BsProgressSnapshot* snapshot, void* context);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressOpen(uint32_t fileCount, BsProgress** progress);
+
+// Adds bytes to a file (0-based); negative takes a failed part's bytes back.
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressAdd(BsProgress* progress, uint32_t file, int64_t delta);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressSet(BsProgress* progress, uint32_t file, uint64_t bytes);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressComplete(BsProgress* progress, uint32_t file);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressGetFile(BsProgress* progress, uint32_t file, uint64_t* bytes);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressGetSnapshot(BsProgress* progress, BsProgressSnapshot* snapshot);
+
+// Calls back every intervalMs while the progress moves, replacing a
+// publisher started before; callback NULL stops publishing.
+BIGSTASH_API BsStatus BSAPI_CALL BsProgressPublish(BsProgress* progress, uint32_t intervalMs,
+	BsProgressCallback callback, void* context);
+
+// Stops the publisher (after its last snapshot) and frees the counters.
+BIGSTASH_API void BSAPI_CALL BsProgressClose(BsProgress* progress);
+
+/////////////////////////////////////////////////////////////////////////////
+// Small-file packs (PackIndex.h, PackUploader.h)
+//
+// Files up to a size limit are streamed into pack objects of up to packSize
+// bytes instead of one object each; the serialized pack index (key, pack,
+// offset, length and MD5 of every packed file) goes with the manifest.
+//
+
+// BsPackEntry.pack of a file that was left out of the packs.
+#define BS_PACK_NONE                     0xFFFFFFFFu
+
+typedef struct BsPackFile
+{
+	const BsChar* path;
+	const char* key;              // object key the file would have on its own (UTF-8)
+	uint64_t size;                // as scanned; a file that changed fails the upload
+} BsPackFile;
+
+typedef struct BsPackOptions
+{
+	uint64_t smallFileLimit;      // largest file packed, 0 picks 64 KB
+	uint64_t packSize;            // 0 picks 16 MB
+	uint32_t workers;             // packs read and uploaded at once, 0 picks 4
+	const char* keyPrefix;        // pack n is keyPrefix + "packs/%06u.pack", NULL for none
+} BsPackOptions;
+
+typedef struct BsPackEntry
+{
+	uint32_t pack;                // BS_PACK_NONE when the file needs its own object
+	uint64_t offset;
+	uint64_t length;
+	uint8_t md5[16];
+} BsPackEntry;
+
+typedef struct BsPackObject
+{
+	uint32_t number;
+	uint64_t size;
+	uint32_t fileCount;
+	uint8_t md5[16];
+	char key[1024];
+	char etag[72];                // quoted, as S3 returned it
+} BsPackObject;
+
+// Called for every pack S3 accepted; calls are serialized.
+typedef void (BSAPI_CALL *BsPackCallback)(const BsPackObject* pack, void* context);
+
+// Packs and uploads the small ones of files and writes where each file went
+// to entries (count of them, in the order of files). The serialized pack
+// index is written to index when it fits in indexCapacity; indexSize
+// receives its size either way. Stops at the first pack that fails.
+BIGSTASH_API BsStatus BSAPI_CALL BsS3UploadPacks(BsS3Client* client, const char* bucket,
+	const BsPackFile* files, uint32_t count, const BsPackOptions* options, BsPackEntry* entries,
+	uint8_t* index, uint32_t indexCapacity, uint32_t* indexSize, BsPackCallback callback, void* context);
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload scheduler (UploadScheduler.h)
+//
+// One scheduler per process owns the upload slots of every scheduled
+// BsS3Client: how many part uploads are in flight across all files, moved
+// by the measured throughput and request times, and the bandwidth caps.
+//
+
+// Why the limit last moved.
+#define BS_SCHEDULER_HOLD                0
+#define BS_SCHEDULER_STARTUP_GROW        1  // doubled: throughput still growing
+#define BS_SCHEDULER_INCREASE            2  // one more slot: no congestion signal
+#define BS_SCHEDULER_DECREASE_LATENCY    3  // request times inflated, throughput flat
+#define BS_SCHEDULER_DECREASE_FAILURE    4  // a request failed or timed out
+#define BS_SCHEDULER_DECREASE_BDP        5  // above twice the bandwidth-delay product
+#define BS_SCHEDULER_PROBE_RTT           6  // one round at the minimum to remeasure the round trip
+#define BS_SCHEDULER_PROBE_RTT_DONE      7
+
+typedef struct BsSchedulerOptions
+{
+	uint32_t minConcurrency;       // 0 picks 1
+	uint32_t maxConcurrency;       // 0 picks 64
+	double latencyTolerance;       // request time growth allowed over the minimum, 0 picks 1.0 (twice)
+	uint64_t bandwidthLimit;       // bytes per second over every file, 0 is no cap
+	uint64_t uploadBandwidthLimit; // default per file cap, 0 is no cap
+} BsSchedulerOptions;
+
+typedef struct BsSchedulerStats
+{
+	uint32_t limit;               // requests allowed in flight
+	uint32_t inFlight;
+	uint32_t waiting;             // requests waiting for a slot or the caps
+	uint32_t uploads;             // files uploading
+	uint32_t startup;
+	uint32_t lastDecision;        // BS_SCHEDULER_*
+	uint64_t requests;
+	uint64_t failures;
+	uint64_t bytes;
+	uint64_t rounds;
+	uint64_t increases;
+	uint64_t decreases;
+	double requestSeconds;        // total time of the requests that succeeded
+	double maxDeliveryRate;       // bytes per second
+	double minRtt;                // seconds
+	double bdpRequests;           // bandwidth-delay product in requests
+	double slotWaitSeconds;
+	double throttleSeconds;
+} BsSchedulerStats;
+
+typedef struct BsSchedulerDecision
+{
+	double time;                  // seconds since the scheduler started
+	uint32_t decision;            // BS_SCHEDULER_*
+	uint32_t oldLimit;
+	uint32_t newLimit;
+	double deliveryRate;          // bytes per second over the round
+	double meanRtt;               // mean request seconds over the round
+	double minRtt;
+} BsSchedulerDecision;
+
+// Sets the bounds and the caps; takes effect for requests in flight too.
+BIGSTASH_API BsStatus BSAPI_CALL BsSchedulerConfigure(const BsSchedulerOptions* options);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsSchedulerGetStats(BsSchedulerStats* stats);
+
+// Writes the latest (up to capacity) decisions, oldest first, and their
+// number to count. The scheduler keeps the last 256.
+BIGSTASH_API BsStatus BSAPI_CALL BsSchedulerGetDecisions(BsSchedulerDecision* decisions, uint32_t capacity,
+	uint32_t* count);
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload tracing (UploadTracer.h)
+//
+// Times every stage of every part the BsS3UploadFile calls send, into
+// latency histograms and throughput counters per file and over all files,
+// and keeps the latest stages for a trace file that Perfetto and
+// chrome://tracing open. Nothing is timed until BsTraceEnable.
+//
+
+// Stages, in the order of BsTraceGetStats' stages.
+#define BS_TRACE_FILE                    0  // a file, from the first read to the last part accepted
+#define BS_TRACE_PART                    1  // a part, from its read to S3 accepting it
+#define BS_TRACE_BUFFER_WAIT             2  // the reader waiting for a free buffer
+#define BS_TRACE_READ                    3
+#define BS_TRACE_HASH                    4  // MD5 and SHA-256
+#define BS_TRACE_ENCRYPT                 5
+#define BS_TRACE_QUEUED                  6  // read, waiting for the uploader
+#define BS_TRACE_SLOT_WAIT               7  // the scheduler's slots and caps
+#define BS_TRACE_SIGN                    8
+#define BS_TRACE_CONNECTION_WAIT         9  // every connection busy
+#define BS_TRACE_CONNECT                 10
+#define BS_TRACE_SEND                    11
+#define BS_TRACE_SERVER_WAIT             12 // request sent to the first byte of the response
+#define BS_TRACE_RECEIVE                 13
+#define BS_TRACE_RETRY_DELAY             14
+#define BS_TRACE_STAGES                  15
+
+typedef struct BsTraceOptions
+{
+	uint32_t eventCapacity;       // latest stages kept for BsTraceWrite, 0 picks 65536
+	uint32_t keepUploads;         // finished files whose stats are kept, 0 picks 64
+} BsTraceOptions;
+
+typedef struct BsTraceStageStats
+{
+	uint64_t count;
+	double totalSeconds;
+	double minSeconds;
+	double meanSeconds;
+	double p50Seconds;            // percentiles to within 3%
+	double p90Seconds;
+	double p99Seconds;
+	double p999Seconds;
+	double maxSeconds;
+} BsTraceStageStats;
+
+typedef struct BsTraceUploadStats
+{
+	uint32_t upload;              // 0 for every file together
+	uint32_t finished;
+	char name[256];               // the object key, UTF-8, cut short
+	uint64_t partsRead;
+	uint64_t partsSent;
+	uint64_t bytesRead;
+	uint64_t bytesSent;
+	uint64_t retries;
+	uint64_t failures;            // parts that failed every attempt
+	uint64_t hedges;              // late parts sent again on another connection
+	uint64_t hedgesWon;           // of which the second request answered first
+	double seconds;               // since the file started, until it finished
+	double bytesPerSecond;        // bytesSent over seconds
+} BsTraceUploadStats;
+
+// Starts timing the files uploaded from now on, clearing what was recorded
+// before. options may be NULL.
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceEnable(const BsTraceOptions* options);
+
+// Stops timing new files; what was recorded stays readable.
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceDisable(void);
+
+// The live stats of a file (upload 0: every file together) and of up to
+// stageCount stages. BS_E_NOTFOUND when the file is no longer kept.
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceGetStats(uint32_t upload, BsTraceUploadStats* stats,
+	BsTraceStageStats* stages, uint32_t stageCount);
+
+// Writes the stats of the files uploading and the kept finished ones, the
+// latest up to capacity, oldest first, and their number to count.
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceGetUploads(BsTraceUploadStats* uploads, uint32_t capacity, uint32_t* count);
+
+// Writes the kept stages to path as a Chrome JSON trace, each part on its
+// own track.
+BIGSTASH_API BsStatus BSAPI_CALL BsTraceWrite(const BsChar* path);
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload log (BinaryLogger.h)
+//
+// A log cheap enough for every part of every upload. A record is a format
+// ID and up to six 64-bit arguments, copied into a ring of the logging
+// thread; a background thread appends the records to a binary file and
+// nothing is formatted until BsLogDecode turns the file into text. A
+// caller never waits: when its ring is full the record is dropped, and a
+// format logged more than maxPerSecond times a second is rate limited; the
+// log says how many went missing. The S3 clients log every part's outcome
+// and retries once BsLogOpen was called.
+//
+// Format texts hold {u} (unsigned), {i} (signed), {x} (hex), {f} (the bits
+// of a double), {s} (a BsStatus) and {t} (a BsLogIntern number)
+// placeholders, one per argument.
+//
+
+#define BS_LOG_DEBUG                     1
+#define BS_LOG_INFO                      2
+#define BS_LOG_WARNING                   3
+#define BS_LOG_ERROR                     4
+
+typedef struct BsLogOptions
+{
+	uint32_t ringRecords;         // per logging thread, 0 picks 4096
+	uint32_t flushIntervalMs;     // 0 picks 50
+	uint32_t level;               // BS_LOG_*, 0 picks BS_LOG_INFO
+	uint32_t maxPerSecond;        // records of one format a second, 0 for no limit
+} BsLogOptions;
+
+typedef struct BsLogStats
+{
+	uint64_t written;
+	uint64_t dropped;             // a ring was full
+	uint64_t rateLimited;
+	uint64_t bytesWritten;
+	BsStatus writeStatus;         // the error that stopped writing the file
+} BsLogStats;
+
+// Starts a new log at path (replacing the file). options may be NULL.
+BIGSTASH_API BsStatus BSAPI_CALL BsLogOpen(const BsChar* path, const BsLogOptions* options);
+
+// Writes what was logged and closes the file.
+BIGSTASH_API BsStatus BSAPI_CALL BsLogClose(void);
+
+// Registers a format text (UTF-8) at a BS_LOG_* level. BS_E_INVALIDARG for
+// an unknown placeholder, more than six or a full table (1,024 formats).
+BIGSTASH_API BsStatus BSAPI_CALL BsLogRegisterFormat(uint32_t level, const char* text, uint32_t* format);
+
+// The number a {t} argument takes for text (UTF-8), e.g. an object key.
+// Intern a text once, not per record.
+BIGSTASH_API BsStatus BSAPI_CALL BsLogIntern(const char* text, uint32_t* id);
+
+// Logs a record; does nothing while the log is closed.
+BIGSTASH_API void BSAPI_CALL BsLogWrite(uint32_t format, const uint64_t* args, uint32_t count);
+
+// Waits until everything logged so far is in the file.
+BIGSTASH_API BsStatus BSAPI_CALL BsLogFlush(void);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsLogGetStats(BsLogStats* stats);
+
+// Writes the log at path as text to textPath, a line per record, and the
+// number of records to records (may be NULL). Stops at a record torn by a
+// crash. BS_E_CORRUPT when path is not a log.
+BIGSTASH_API BsStatus BSAPI_CALL BsLogDecode(const BsChar* path, const BsChar* textPath, uint64_t* records);
+
+/////////////////////////////////////////////////////////////////////////////
+// Resume journal (ResumeJournal.h)
+//
+// The resume state of an upload as an append-only log of per-file and
+// per-part changes, flushed in batches and compacted into a snapshot in the
+// background, instead of the whole state rewritten after every file.
+//
+// The parts recorded as S3 accepts them are a ledger: BsJournalResume and
+// BsJournalComplete work from it without listing the parts, and list them
+// only to check it (see verifyEvery) or when S3 or the ledger disagree.
+//
+
+typedef struct BsJournal BsJournal;
+
+// Record types.
+#define BS_JOURNAL_FILE_STARTED          1  // size: part size, text: upload ID
+#define BS_JOURNAL_PART_COMPLETED        2  // partNumber, size, text: ETag
+#define BS_JOURNAL_FILE_COMPLETED        3  // size: file size, text: MD5 (hex)
+#define BS_JOURNAL_FILE_RESET            4
+
+// Journal flags.
+#define BS_JOURNAL_NO_SYNC               0x00000001  // a machine crash may lose the last batches
+#define BS_JOURNAL_OPAQUE_ETAGS          0x00000002  // part ETags are not MD5s (SSE-KMS); digests go unchecked
+
+typedef struct BsJournalOptions
+{
+	uint32_t commitIntervalMs;    // how long a batch waits for more records, 0 picks 2
+	uint64_t compactBytes;        // log size that triggers a snapshot, 0 picks 32 MB
+	uint32_t flags;               // BS_JOURNAL_*
+	uint32_t verifyEvery;         // every n-th BsJournalResume lists the parts anyway, 0 never does
+	uint32_t partOverhead;        // bytes a stored part adds to its share of the file: BS_GCM_TAG_SIZE when encrypted
+} BsJournalOptions;
+
+typedef struct BsJournalRecord
+{
+	uint32_t type;                // BS_JOURNAL_*
+	uint32_t file;                // 0-based index of the file in the archive
+	uint32_t partNumber;
+	uint64_t size;
+	const char* text;             // UTF-8, NULL for none
+	const uint8_t* md5;           // BS_JOURNAL_PART_COMPLETED: MD5 of the part's body (16 bytes), NULL for none
+} BsJournalRecord;
+
+typedef struct BsJournalFile
+{
+	uint32_t started;
+	uint32_t completed;
+	uint64_t partSize;
+	uint64_t size;
+	uint32_t partCount;           // parts completed, BsJournalGetFile copies up to capacity
+	char uploadId[1024];
+	char md5[33];
+} BsJournalFile;
+
+// Opens (or creates) the journal at path, replaying what it holds. The files
+// are path.snap and path.<n>.log.
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalOpen(const BsChar* path, const BsJournalOptions* options,
+	BsJournal** journal);
+
+// Queues a record; sequence (may be NULL) receives its number for
+// BsJournalSync.
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalAppend(BsJournal* journal, const BsJournalRecord* record,
+	uint64_t* sequence);
+
+// Waits until the record with this sequence (0: every record appended so
+// far) is on the disk.
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalSync(BsJournal* journal, uint64_t sequence);
+
+// The number of files the records mention (the highest index plus one).
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalGetFileCount(BsJournal* journal, uint32_t* count);
+
+// The state of a file and up to capacity of its parts, in part order.
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalGetFile(BsJournal* journal, uint32_t file, BsJournalFile* state,
+	BsS3Part* parts, uint32_t capacity);
+
+// Where BsJournalResume's plan came from.
+#define BS_LEDGER_LOCAL                  0  // the journal alone, no request
+#define BS_LEDGER_VERIFIED               1  // the parts were listed and agreed
+#define BS_LEDGER_REPAIRED               2  // the journal was corrected to the listed parts
+
+typedef struct BsLedgerPlan
+{
+	uint32_t source;              // BS_LEDGER_*
+	uint64_t partSize;
+	uint32_t partCount;           // of the whole file
+	uint32_t uploadedCount;
+	uint64_t uploadedBytes;
+	uint32_t remainingCount;      // BsJournalResume copies up to capacity
+	char uploadId[1024];
+} BsLedgerPlan;
+
+// Plans the rest of an interrupted upload of a file of fileSize bytes from
+// its recorded parts: the part numbers still to upload go to remaining.
+// The parts are listed first only when the records do not fit the file or
+// the resume is a sampled one. BS_E_NOTFOUND when the file has no upload in
+// progress, or S3 no longer knows it (the file is then reset).
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalResume(BsJournal* journal, BsS3Client* client, const char* bucket,
+	const char* key, uint32_t file, uint64_t fileSize, BsLedgerPlan* plan, uint32_t* remaining, uint32_t capacity);
+
+// Completes the file's upload with its recorded parts, checks the object's
+// ETag against their digests and records the file as completed with md5Hex
+// (may be NULL). When S3 refuses the parts they are listed and Complete is
+// tried once more; BS_E_INVALIDARG when parts are then missing, which the
+// next BsJournalResume plans.
+BIGSTASH_API BsStatus BSAPI_CALL BsJournalComplete(BsJournal* journal, BsS3Client* client, const char* bucket,
+	const char* key, uint32_t file, uint64_t fileSize, const char* md5Hex, char* etag, uint32_t etagCapacity);
+
+// Writes what is queued and closes the journal.
+BIGSTASH_API void BSAPI_CALL BsJournalClose(BsJournal* journal);
+
+/////////////////////////////////////////////////////////////////////////////
+// Upload state store (UploadStore.h)
+//
+// The local uploads in one mapped file: an index of upload summaries that
+// is all startup reads, and per upload a file table read when the upload
+// is opened, instead of a LocalUpload JSON file per upload deserialized
+// whole. BsUploadStoreMigrate imports the JSON files. Strings are UTF-8;
+// NULL and empty are the same. Not thread-safe.
+//
+
+typedef struct BsUploadStore BsUploadStore;
+typedef struct BsUploadTable BsUploadTable;
+
+// Upload flags.
+#define BS_UPLOAD_USER_PAUSED            0x00000001
+#define BS_UPLOAD_MANIFEST_UPLOADED      0x00000002
+
+// Stored file flags.
+#define BS_STORED_FILE_UPLOADED          0x00000001
+#define BS_STORED_FILE_PACKED            0x00000002  // packOffset is set
+#define BS_STORED_FILE_STORED_SIZE       0x00000004  // storedSize is set
+
+// Shaped after BigStash.Model.ArchiveFileInfo.
+typedef struct BsStoredFile
+{
+	const char* fileName;
+	const char* keyName;
+	const char* filePath;
+	uint64_t size;
+	int64_t lastModified;         // UTC FILETIME ticks
+	uint64_t progress;
+	const char* md5;
+	const char* uploadId;
+	uint64_t partSize;
+	const char* packKey;
+	uint64_t packOffset;
+	const char* duplicateOf;
+	const char* codec;
+	uint64_t storedSize;          // the compressed object's, once uploaded
+	const char* keyId;
+	const char* nonce;            // hex; resume only the unchanged file under it (BsS3UploadFileEncrypted)
+	uint32_t flags;               // BS_STORED_FILE_*
+} BsStoredFile;
+
+// Shaped after BigStash.Model.PackManifest.
+typedef struct BsStoredPack
+{
+	const char* keyName;
+	uint64_t size;
+	const char* md5;
+	uint64_t fileCount;
+} BsStoredPack;
+
+// Shaped after BigStash.Model.LocalUpload.
+typedef struct BsStoredUpload
+{
+	const char* name;             // the LocalUpload file's name without the extension
+	const char* url;
+	const char* status;
+	uint64_t progress;
+	uint32_t flags;               // BS_UPLOAD_*
+	const BsStoredFile* files;
+	uint64_t fileCount;
+	const BsStoredPack* packs;
+	uint32_t packCount;
+} BsStoredUpload;
+
+typedef struct BsUploadSummary
+{
+	const char* name;             // the strings live until the store next changes
+	const char* url;
+	const char* status;
+	uint64_t progress;
+	uint32_t flags;               // BS_UPLOAD_*
+	uint64_t fileCount;
+	uint32_t packCount;
+	uint64_t totalSize;
+	uint64_t uploadedFiles;
+	uint64_t uploadedBytes;       // the uploaded files and the progress of the others
+} BsUploadSummary;
+
+typedef struct BsStoreMigration
+{
+	uint64_t imported;
+	uint64_t fromBackup;          // read from the .bak, the file itself did not parse
+	uint64_t skipped;             // already in the store
+	uint64_t failed;              // neither the file nor its backup parsed
+} BsStoreMigration;
+
+// Opens (or creates) the store at path. Reads the header and the index only.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreOpen(const BsChar* path, BsUploadStore** store);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreGetCount(BsUploadStore* store, uint32_t* count);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreGetSummary(BsUploadStore* store, uint32_t index,
+	BsUploadSummary* summary);
+
+// The index of the upload of this name; BS_E_NOTFOUND when there is none.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreFind(BsUploadStore* store, const char* name, uint32_t* index);
+
+// Opens the file table of an upload. The table shows the upload as it was
+// when it was opened, whatever the store does after.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreOpenTable(BsUploadStore* store, uint32_t index,
+	BsUploadTable** table);
+
+// Decodes count files from first on; their strings live until the next
+// call on the table.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadTableRead(BsUploadTable* table, uint64_t first, uint32_t count,
+	BsStoredFile* files);
+
+// Copies up to capacity packs; count (may be NULL) receives how many there
+// are. The strings live until the next call on the table.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadTableGetPacks(BsUploadTable* table, BsStoredPack* packs,
+	uint32_t capacity, uint32_t* count);
+
+BIGSTASH_API void BSAPI_CALL BsUploadTableClose(BsUploadTable* table);
+
+// Adds the upload, or replaces the one of the same name, files and all.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStorePut(BsUploadStore* store, const BsStoredUpload* upload);
+
+// Updates the summary of an upload without rewriting its files.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreSetState(BsUploadStore* store, uint32_t index, const char* status,
+	uint64_t progress, uint32_t flags);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreRemove(BsUploadStore* store, uint32_t index);
+
+// Makes the changes durable; until then a crash loses them.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreCommit(BsUploadStore* store);
+
+// Rewrites the store without the tables and indexes replaced since. Close
+// the tables first on Windows.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreCompact(BsUploadStore* store);
+
+// Imports the LocalUpload files (*suffix, NULL picks ".djf") of directory
+// the store does not hold yet, and commits. stats may be NULL.
+BIGSTASH_API BsStatus BSAPI_CALL BsUploadStoreMigrate(BsUploadStore* store, const BsChar* directory,
+	const BsChar* suffix, BsStoreMigration* stats);
+
+// Closes the store; what was not committed is lost.
+BIGSTASH_API void BSAPI_CALL BsUploadStoreClose(BsUploadStore* store);
+
+/////////////////////////////////////////////////////////////////////////////
+// Archive manifest (ManifestWriter.h)
+//
+// Writes the compressed archive manifest as files complete, formatting and
+// compressing on every core, instead of serializing the whole manifest at
+// the end. Strings are UTF-8.
+//
+
+typedef struct BsManifestWriter BsManifestWriter;
+
+// Compression formats.
+#define BS_MANIFEST_GZIP                 0
+#define BS_MANIFEST_ZSTD                 1  // BS_E_NOTSUPPORTED unless built with zstd
+
+// Manifest flags.
+#define BS_MANIFEST_DIRECTORIES          0x00000001  // interned directory table (manifest_version 2)
+
+typedef struct BsManifestOptions
+{
+	uint32_t compression;         // BS_MANIFEST_GZIP or BS_MANIFEST_ZSTD
+	int32_t level;                // 0 picks 6 (gzip) or 3 (zstd)
+	uint32_t threads;             // 0 picks the processor count
+	uint32_t blockSize;           // bytes compressed per task, 0 picks 256 KB
+	uint32_t flags;               // BS_MANIFEST_*
+} BsManifestOptions;
+
+// Shaped after BigStash.Model.FileManifest.
+typedef struct BsManifestFile
+{
+	const char* keyName;
+	const char* filePath;
+	uint64_t size;
+	int64_t lastModified;         // UTC FILETIME ticks
+	const char* md5;              // hex, NULL writes null
+	const char* packKey;          // NULL when not packed
+	uint64_t packOffset;
+	const char* duplicateOf;      // key of the uploaded copy, NULL when uploaded (BsFindDuplicates)
+	const char* codec;            // "gzip" or "zstd" when stored compressed (size is then the object's), or NULL
+	uint64_t originalSize;        // the file's size when codec is set
+	const char* encryption;       // "aes-256-gcm" when the parts are encrypted, or NULL
+	const char* keyId;            // the caller's name for the key, never the key
+	const char* nonce;            // the file's nonce, hex
+	uint64_t partSize;            // bytes of the object in each part before its tag
+} BsManifestFile;
+
+typedef struct BsManifestPack
+{
+	const char* keyName;
+	uint64_t size;
+	const char* md5;
+	uint32_t fileCount;
+} BsManifestPack;
+
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestOpen(const BsChar* path, const char* archiveId, int32_t userId,
+	const BsManifestOptions* options, BsManifestWriter** writer);
+
+// Thread-safe; files are written in the order they are added.
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestAddFile(BsManifestWriter* writer, const BsManifestFile* file);
+
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestAddPack(BsManifestWriter* writer, const BsManifestPack* pack);
+
+// Completes the manifest; rawBytes and compressedBytes may be NULL.
+BIGSTASH_API BsStatus BSAPI_CALL BsManifestFinish(BsManifestWriter* writer, uint64_t* rawBytes,
+	uint64_t* compressedBytes);
+
+// Frees the writer; a manifest that was not finished is left incomplete.
+BIGSTASH_API void BSAPI_CALL BsManifestClose(BsManifestWriter* writer);
+
+/////////////////////////////////////////////////////////////////////////////
+// Selection channel (SelectionChannel.h)
+//
+// Hands an Explorer selection to the running app over a local named pipe (a
+// Unix socket elsewhere), streamed in chunks as it is enumerated, instead of
+// through a selection file and a second process.
+//
+
+typedef struct BsSelectionServer BsSelectionServer;
+
+// Selection events.
+#define BS_SELECTION_PATHS               0  // the next count paths of the selection
+#define BS_SELECTION_COMPLETE            1  // the sender is told once the callback returns
+#define BS_SELECTION_ABORTED             2  // drop the paths of the selection received so far
+
+// Called on the server's thread; the paths only live for the call.
+typedef void (BSAPI_CALL *BsSelectionCallback)(uint64_t selection, uint32_t event, const BsChar* const* paths,
+	uint32_t count, void* context);
+
+// Writes the channel of the current user (and session), NUL terminated, to
+// name. BS_E_INVALIDARG when capacity is too small; length (may be NULL)
+// receives the length without the NUL either way.
+BIGSTASH_API BsStatus BSAPI_CALL BsSelectionGetDefaultChannel(BsChar* name, uint32_t capacity, uint32_t* length);
+
+// Starts receiving selections on channel (NULL picks the default). Returns
+// BS_E_ACCESSDENIED when another server holds the channel.
+BIGSTASH_API BsStatus BSAPI_CALL BsSelectionListen(const BsChar* channel, BsSelectionCallback callback,
+	void* context, BsSelectionServer** server);
+
+// Stops the server; a selection being received is reported as aborted.
+BIGSTASH_API void BSAPI_CALL BsSelectionStop(BsSelectionServer* server);
+
+// Streams the paths to the server on channel (NULL picks the default),
+// waiting up to timeoutMs for one to listen, and returns once it has taken
+// them. Returns BS_E_NOTFOUND when no server listened in time.
+BIGSTASH_API BsStatus BSAPI_CALL BsSelectionSend(const BsChar* channel, const BsChar* const* paths, uint32_t count,
+	uint32_t timeoutMs);
@@ -0,0 +1,881 @@
+// BinaryLogger.cpp : Implementation of CBinaryLogger and DecodeLog
+
+#include "BinaryLogger.h"
+#include "Crc32.h"
+#include "Encoding.h"
+#include "Json.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <unordered_map>
+
+namespace BigStash
+{
+	namespace
+	{
+		const uint8_t LOG_MAGIC[4] = { 'B', 'S', 'B', 'L' };
+		const uint32_t LOG_VERSION = 1;
+
+		// magic, version, the monotonic and the Unix time (ns) of Open,
+		// CRC-32 of the rest.
+		const size_t LOG_HEADER_SIZE = 28;
+
+		// payload length and its CRC-32, then the payload: a kind byte and
+		// what the kind holds.
+		const size_t FRAME_HEADER_SIZE = 8;
+		const uint32_t MAX_PAYLOAD = 512 * 1024;
+
+		enum FrameKind
+		{
+			// varint ID, varint level, the text.
+			FRAME_FORMAT = 1,
+
+			// varint ID, the text.
+			FRAME_TEXT = 2,
+
+			// varint count, then the records, RECORD_SIZE bytes each.
+			FRAME_RECORDS = 3
+		};
+
+		const size_t RECORD_SIZE = 64;
+		const size_t RECORDS_PER_FRAME = 4096;
+
+		// Texts the writer keeps to format lines; records that refer to
+		// older ones show the number.
+		const size_t LINE_TEXTS = 65536;
+
+		// Loggers a thread finds its ring in without the lock.
+		const unsigned RING_CACHE = 4;
+		const size_t MIN_RING_RECORDS = 16;
+
+		// Placeholder letters, in the order of the comment in the header.
+		const char PLACEHOLDERS[] = "uixfst";
+
+		struct BuiltinFormat
+		{
+			LogLevel level;
+			const char* text;
+		};
+
+		// In the order of LogFormatId, from LOG_RECORDS_DROPPED.
+		const BuiltinFormat BUILTIN_FORMATS[LOG_BUILTIN_FORMATS - 1] =
+		{
+			{ LOG_WARNING, "{u} log records dropped, {u} rate limited" },
+			{ LOG_INFO, "{t}: uploading, {u} parts in flight at most" },
+			{ LOG_DEBUG, "{t}: part {u} sent, {u} bytes, {u} attempts" },
+			{ LOG_WARNING, "{t}: part {u} attempt {u} failed ({s}, HTTP {u}), retrying in {u} ms" },
+			{ LOG_ERROR, "{t}: part {u} failed after {u} attempts ({s}, HTTP {u})" },
+			{ LOG_INFO, "{t}: part {u} late after {u} ms (deadline {u} ms), sent again" },
+			{ LOG_INFO, "{t}: {u} parts, {u} bytes in {f} s ({s})" }
+		};
+
+		const char* const STATUS_NAMES[] =
+		{
+			"OK",
+			"INVALIDARG",
+			"OUTOFMEMORY",
+			"IO",
+			"NOTFOUND",
+			"ACCESSDENIED",
+			"CANCELLED",
+			"CORRUPT",
+			"NOTSUPPORTED",
+			"NOMOREITEMS"
+		};
+
+		const char* LevelName(unsigned level)
+		{
+			switch (level)
+			{
+			case LOG_DEBUG:
+				return "DEBUG";
+			case LOG_INFO:
+				return "INFO";
+			case LOG_WARNING:
+				return "WARN";
+			case LOG_ERROR:
+				return "ERROR";
+			default:
+				return "?";
+			}
+		}
+
+		void PutLittleEndian16(uint8_t* data, uint16_t value)
+		{
+			data[0] = (uint8_t)value;
+			data[1] = (uint8_t)(value >> 8);
+		}
+
+		void PutLittleEndian32(uint8_t* data, uint32_t value)
+		{
+			for (int i = 0; i < 4; ++i)
+				data[i] = (uint8_t)(value >> (8 * i));
+		}
+
+		void PutLittleEndian64(uint8_t* data, uint64_t value)
+		{
+			for (int i = 0; i < 8; ++i)
+				data[i] = (uint8_t)(value >> (8 * i));
+		}
+
+		uint16_t GetLittleEndian16(const uint8_t* data)
+		{
+			return (uint16_t)(data[0] | (data[1] << 8));
+		}
+
+		uint32_t GetLittleEndian32(const uint8_t* data)
+		{
+			return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+		}
+
+		uint64_t GetLittleEndian64(const uint8_t* data)
+		{
+			return (uint64_t)GetLittleEndian32(data) | ((uint64_t)GetLittleEndian32(data + 4) << 32);
+		}
+
+		int64_t UnixNanoseconds()
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		// The placeholder letters of text in order; false for an unknown
+		// one or too many.
+		bool ParseFormat(const std::string& text, std::string& types)
+		{
+			types.clear();
+			for (size_t i = 0; i + 2 < text.size(); ++i)
+			{
+				if (text[i] != '{' || text[i + 2] != '}')
+					continue;
+
+				if (text[i + 1] == '\0' || strchr(PLACEHOLDERS, text[i + 1]) == NULL)
+					return false;
+				types += text[i + 1];
+				i += 2;
+			}
+
+			return types.size() <= LOG_MAX_ARGUMENTS;
+		}
+
+		typedef std::function<const std::string*(uint32_t id)> TextLookup;
+
+		// "   12.345678 T3   WARN  text", the time in seconds since Open.
+		void FormatRecord(const LogRecord& record, unsigned level, const std::string& text, int64_t opened,
+			const TextLookup& texts, std::string& line)
+		{
+			char prefix[64];
+			snprintf(prefix, sizeof(prefix), "%12.6f T%-3u %-5s ", (double)(record.time - opened) / 1e9,
+				(unsigned)record.thread, LevelName(level));
+			line = prefix;
+
+			unsigned argument = 0;
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				if (text[i] != '{' || i + 2 >= text.size() || text[i + 2] != '}' || text[i + 1] == '\0' ||
+					strchr(PLACEHOLDERS, text[i + 1]) == NULL)
+				{
+					line += text[i];
+					continue;
+				}
+
+				char type = text[i + 1];
+				i += 2;
+				if (argument >= record.count)
+				{
+					line += '?';
+					continue;
+				}
+
+				uint64_t value = record.args[argument++];
+				char number[32];
+				switch (type)
+				{
+				case 'u':
+					snprintf(number, sizeof(number), "%llu", (unsigned long long)value);
+					break;
+				case 'i':
+					snprintf(number, sizeof(number), "%lld", (long long)value);
+					break;
+				case 'x':
+					snprintf(number, sizeof(number), "0x%llx", (unsigned long long)value);
+					break;
+				case 'f':
+				{
+					double real;
+					memcpy(&real, &value, sizeof(real));
+					snprintf(number, sizeof(number), "%.6g", real);
+					break;
+				}
+				case 's':
+					if (value < sizeof(STATUS_NAMES) / sizeof(STATUS_NAMES[0]))
+						snprintf(number, sizeof(number), "%s", STATUS_NAMES[value]);
+					else
+						snprintf(number, sizeof(number), "status %llu", (unsigned long long)value);
+					break;
+				default:
+				{
+					const std::string* found = texts((uint32_t)value);
+					if (found != NULL)
+					{
+						line += *found;
+						continue;
+					}
+					snprintf(number, sizeof(number), "#%llu", (unsigned long long)value);
+					break;
+				}
+				}
+				line += number;
+			}
+		}
+
+		void PutRecord(uint8_t* data, const LogRecord& record)
+		{
+			PutLittleEndian64(data, (uint64_t)record.time);
+			PutLittleEndian32(data + 8, record.format);
+			PutLittleEndian16(data + 12, record.thread);
+			data[14] = record.count;
+			data[15] = 0;
+			for (unsigned i = 0; i < LOG_MAX_ARGUMENTS; ++i)
+				PutLittleEndian64(data + 16 + 8 * i, record.args[i]);
+		}
+
+		void GetRecord(const uint8_t* data, LogRecord& record)
+		{
+			record.time = (int64_t)GetLittleEndian64(data);
+			record.format = GetLittleEndian32(data + 8);
+			record.thread = GetLittleEndian16(data + 12);
+			record.count = (uint8_t)std::min<unsigned>(data[14], LOG_MAX_ARGUMENTS);
+			record.reserved = 0;
+			for (unsigned i = 0; i < LOG_MAX_ARGUMENTS; ++i)
+				record.args[i] = GetLittleEndian64(data + 16 + 8 * i);
+		}
+
+		size_t BeginFrame(std::vector<uint8_t>& data, FrameKind kind)
+		{
+			size_t frame = data.size();
+			data.resize(frame + FRAME_HEADER_SIZE);
+			data.push_back((uint8_t)kind);
+			return frame;
+		}
+
+		void EndFrame(std::vector<uint8_t>& data, size_t frame)
+		{
+			size_t length = data.size() - frame - FRAME_HEADER_SIZE;
+			PutLittleEndian32(&data[frame], (uint32_t)length);
+			PutLittleEndian32(&data[frame + 4], Crc32(&data[frame + FRAME_HEADER_SIZE], length));
+		}
+
+		void AppendText(std::vector<uint8_t>& data, FrameKind kind, uint32_t id, unsigned level, const std::string& text)
+		{
+			// a text is cut to what fits a frame; nobody logs a megabyte.
+			size_t length = std::min<size_t>(text.size(), MAX_PAYLOAD - 32);
+			size_t frame = BeginFrame(data, kind);
+			AppendVarint(data, id);
+			if (kind == FRAME_FORMAT)
+				AppendVarint(data, level);
+			data.insert(data.end(), text.begin(), text.begin() + (ptrdiff_t)length);
+			EndFrame(data, frame);
+		}
+
+		void AppendRecords(std::vector<uint8_t>& data, const LogRecord* records, size_t count)
+		{
+			size_t frame = BeginFrame(data, FRAME_RECORDS);
+			AppendVarint(data, count);
+			size_t at = data.size();
+			data.resize(at + count * RECORD_SIZE);
+			for (size_t i = 0; i < count; ++i)
+				PutRecord(&data[at + i * RECORD_SIZE], records[i]);
+			EndFrame(data, frame);
+		}
+
+		uint64_t NextInstance()
+		{
+			static std::atomic<uint64_t> next(1);
+			return next.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	struct CBinaryLogger::Format
+	{
+		Format() : level(LOG_INFO), second(0), admitted(0) {}
+
+		// Admits maxPerSecond records in each second of the monotonic clock.
+		bool Admit(int64_t now, uint32_t maxPerSecond)
+		{
+			int64_t current = now / 1000000000;
+			int64_t seen = second.load(std::memory_order_relaxed);
+			if (seen != current && second.compare_exchange_strong(seen, current, std::memory_order_relaxed))
+				admitted.store(0, std::memory_order_relaxed);
+
+			return admitted.fetch_add(1, std::memory_order_relaxed) < maxPerSecond;
+		}
+
+		// Set before the format is published, not changed after.
+		LogLevel level;
+		std::string text;
+
+		std::atomic<int64_t> second;
+		std::atomic<uint32_t> admitted;
+	};
+
+	// One producer, the thread it belongs to, and one consumer, the writer.
+	// head and tail count records since the ring was made; each is on its
+	// own cache line so the two sides do not share one.
+	struct CBinaryLogger::Ring
+	{
+		Ring(size_t capacity, uint16_t number, std::thread::id thread)
+			: records(capacity), mask(capacity - 1), number(number), owner(thread), head(0), tail(0)
+		{
+		}
+
+		std::vector<LogRecord> records;
+		const size_t mask;
+		const uint16_t number;
+		const std::thread::id owner;
+
+		char padding1[64];
+		std::atomic<uint64_t> head;
+		char padding2[64 - sizeof(std::atomic<uint64_t>)];
+		std::atomic<uint64_t> tail;
+		char padding3[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CBinaryLogger methods
+	//
+
+	CBinaryLogger::CBinaryLogger()
+		: m_instance(NextInstance()), m_open(false), m_level(LOG_INFO), m_maxPerSecond(0),
+		m_formats(new Format[LOG_MAX_FORMATS]), m_formatCount(1), m_nextText(1), m_stopping(false),
+		m_flushRequests(0), m_flushesDone(0), m_toFile(false), m_offset(0), m_opened(0), m_writtenFormats(0),
+		m_firstText(1), m_reportedDropped(0), m_reportedRateLimited(0), m_written(0), m_dropped(0),
+		m_rateLimited(0), m_bytesWritten(0), m_writeStatus(BS_OK)
+	{
+		for (const BuiltinFormat& format : BUILTIN_FORMATS)
+			RegisterFormat(format.level, format.text);
+	}
+
+	CBinaryLogger::~CBinaryLogger()
+	{
+		Close();
+	}
+
+	CBinaryLogger& CBinaryLogger::Process()
+	{
+		static CBinaryLogger logger;
+		return logger;
+	}
+
+	BsStatus CBinaryLogger::Open(const PathChar* path, const LogOptions& options, const LogLineCallback& lines)
+	{
+		if (IsOpen() || m_thread.joinable() || options.level < LOG_DEBUG || options.level > LOG_ERROR)
+			return BS_E_INVALIDARG;
+
+		m_opened = MonotonicNanoseconds();
+		m_toFile = path != NULL;
+		m_offset = 0;
+		if (m_toFile)
+		{
+			BsStatus status = m_file.Open(path, FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE);
+			if (status != BS_OK)
+				return status;
+
+			uint8_t header[LOG_HEADER_SIZE];
+			memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+			PutLittleEndian32(header + 4, LOG_VERSION);
+			PutLittleEndian64(header + 8, (uint64_t)m_opened);
+			PutLittleEndian64(header + 16, (uint64_t)UnixNanoseconds());
+			PutLittleEndian32(header + 24, Crc32(header, 24));
+
+			status = m_file.WriteAt(0, header, sizeof(header));
+			if (status != BS_OK)
+			{
+				m_file.Close();
+				return status;
+			}
+			m_offset = LOG_HEADER_SIZE;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_options = options;
+
+			// every thread gets a new ring, of the new size.
+			m_instance.store(NextInstance());
+			for (std::unique_ptr<Ring>& ring : m_rings)
+				m_retired.push_back(std::move(ring));
+			m_rings.clear();
+			m_pendingTexts.clear();
+			m_firstText = m_nextText;
+		}
+
+		m_lines = lines;
+		m_writtenFormats = 0;
+		m_texts.clear();
+		m_reportedDropped = 0;
+		m_reportedRateLimited = 0;
+		m_written.store(0);
+		m_dropped.store(0);
+		m_rateLimited.store(0);
+		m_bytesWritten.store(m_offset);
+		m_writeStatus.store(BS_OK);
+		m_level.store(options.level);
+		m_maxPerSecond.store(options.maxPerSecond);
+
+		m_stopping = false;
+		m_thread = std::thread(&CBinaryLogger::Run, this);
+		m_open.store(true);
+		return BS_OK;
+	}
+
+	void CBinaryLogger::Close()
+	{
+		m_open.store(false);
+		if (!m_thread.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> guard(m_wakeLock);
+			m_stopping = true;
+		}
+		m_wake.notify_one();
+		m_thread.join();
+
+		m_file.Close();
+		m_lines = LogLineCallback();
+	}
+
+	uint32_t CBinaryLogger::RegisterFormat(LogLevel level, const std::string& text)
+	{
+		std::string types;
+		if (level < LOG_DEBUG || level > LOG_ERROR || !ParseFormat(text, types))
+			return 0;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		uint32_t id = m_formatCount.load(std::memory_order_relaxed);
+		if (id >= LOG_MAX_FORMATS)
+			return 0;
+
+		m_formats[id].level = level;
+		m_formats[id].text = text;
+		m_formatCount.store(id + 1, std::memory_order_release);
+		return id;
+	}
+
+	uint32_t CBinaryLogger::Intern(const std::string& text)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		uint32_t id = m_nextText++;
+		if (IsOpen())
+			m_pendingTexts.push_back(std::make_pair(id, text));
+		return id;
+	}
+
+	//
+	//   FUNCTION: CBinaryLogger::Write(uint32_t, const uint64_t*, unsigned)
+	//
+	//   PURPOSE: The hot path: a level check, the rate limit, and one slot
+	//            of the thread's ring, published with a release store of
+	//            its head. Never blocks; a full ring drops the record.
+	//
+	void CBinaryLogger::Write(uint32_t format, const uint64_t* args, unsigned count)
+	{
+		if (!IsOpen() || format == 0 || format >= m_formatCount.load(std::memory_order_acquire))
+			return;
+
+		Format& entry = m_formats[format];
+		if (entry.level < m_level.load(std::memory_order_relaxed))
+			return;
+
+		int64_t now = MonotonicNanoseconds();
+		uint32_t maxPerSecond = m_maxPerSecond.load(std::memory_order_relaxed);
+		if (maxPerSecond != 0 && entry.level < LOG_ERROR && !entry.Admit(now, maxPerSecond))
+		{
+			m_rateLimited.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		Ring* ring = CurrentRing();
+		if (ring == NULL)
+		{
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		uint64_t head = ring->head.load(std::memory_order_relaxed);
+		if (head - ring->tail.load(std::memory_order_acquire) > ring->mask)
+		{
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		count = std::min(count, LOG_MAX_ARGUMENTS);
+		LogRecord& record = ring->records[head & ring->mask];
+		record.time = now;
+		record.format = format;
+		record.thread = ring->number;
+		record.count = (uint8_t)count;
+		record.reserved = 0;
+		for (unsigned i = 0; i < LOG_MAX_ARGUMENTS; ++i)
+			record.args[i] = i < count ? args[i] : 0;
+
+		ring->head.store(head + 1, std::memory_order_release);
+	}
+
+	//
+	//   FUNCTION: CBinaryLogger::CurrentRing()
+	//
+	//   PURPOSE: The calling thread's ring: from a small per-thread cache,
+	//            else found or made under the lock. A thread that ended
+	//            leaves its ring to the next one with its ID. NULL when a
+	//            ring cannot be allocated, or Open changed the rings while
+	//            the caller got here.
+	//
+	CBinaryLogger::Ring* CBinaryLogger::CurrentRing()
+	{
+		struct Cached
+		{
+			uint64_t instance;
+			Ring* ring;
+		};
+
+		static thread_local Cached cache[RING_CACHE] = {};
+		static thread_local unsigned next = 0;
+
+		uint64_t instance = m_instance.load(std::memory_order_relaxed);
+		for (const Cached& cached : cache)
+		{
+			if (cached.instance == instance)
+				return cached.ring;
+		}
+
+		std::thread::id thread = std::this_thread::get_id();
+		Ring* ring = NULL;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			if (m_instance.load(std::memory_order_relaxed) != instance)
+				return NULL;
+
+			for (const std::unique_ptr<Ring>& candidate : m_rings)
+			{
+				if (candidate->owner == thread)
+				{
+					ring = candidate.get();
+					break;
+				}
+			}
+
+			if (ring == NULL)
+			{
+				if (m_rings.size() >= UINT16_MAX)
+					return NULL;
+
+				size_t capacity = MIN_RING_RECORDS;
+				while (capacity < m_options.ringRecords)
+					capacity *= 2;
+
+				try
+				{
+					m_rings.push_back(std::unique_ptr<Ring>(new Ring(capacity, (uint16_t)(m_rings.size() + 1), thread)));
+				}
+				catch (const std::bad_alloc&)
+				{
+					return NULL;
+				}
+				ring = m_rings.back().get();
+			}
+		}
+
+		Cached& slot = cache[next++ % RING_CACHE];
+		slot.instance = instance;
+		slot.ring = ring;
+		return ring;
+	}
+
+	void CBinaryLogger::Flush()
+	{
+		std::unique_lock<std::mutex> guard(m_wakeLock);
+		if (!m_thread.joinable())
+			return;
+
+		uint64_t request = ++m_flushRequests;
+		m_wake.notify_one();
+		while (m_flushesDone < request)
+			m_flushed.wait(guard);
+	}
+
+	LogStats CBinaryLogger::Stats() const
+	{
+		LogStats stats;
+		stats.written = m_written.load();
+		stats.dropped = m_dropped.load();
+		stats.rateLimited = m_rateLimited.load();
+		stats.bytesWritten = m_bytesWritten.load();
+		stats.writeStatus = (BsStatus)m_writeStatus.load();
+		return stats;
+	}
+
+	void CBinaryLogger::Run()
+	{
+		std::unique_lock<std::mutex> guard(m_wakeLock);
+		for (;;)
+		{
+			bool stopping = m_stopping;
+			uint64_t requests = m_flushRequests;
+
+			guard.unlock();
+			Drain();
+			guard.lock();
+
+			m_flushesDone = requests;
+			m_flushed.notify_all();
+			if (stopping)
+				break;
+
+			if (!m_stopping && m_flushRequests == requests)
+				m_wake.wait_for(guard, std::chrono::milliseconds(m_options.flushIntervalMs));
+		}
+	}
+
+	//
+	//   FUNCTION: CBinaryLogger::Drain()
+	//
+	//   PURPOSE: Takes what every ring holds, then the formats and texts
+	//            registered so far: a record is only in a ring after the
+	//            format and text it refers to were registered, so they are
+	//            all in hand and go to the file first. The records are
+	//            merged by time and written in frames of up to 4096; a
+	//            caller preempted between its clock read and its store may
+	//            land in the next drain, a little out of order.
+	//
+	void CBinaryLogger::Drain()
+	{
+		m_batch.clear();
+		m_frames.clear();
+
+		std::vector<Ring*> rings;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			for (const std::unique_ptr<Ring>& ring : m_rings)
+				rings.push_back(ring.get());
+		}
+
+		for (Ring* ring : rings)
+		{
+			uint64_t head = ring->head.load(std::memory_order_acquire);
+			uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			for (; tail != head; ++tail)
+				m_batch.push_back(ring->records[tail & ring->mask]);
+			ring->tail.store(tail, std::memory_order_release);
+		}
+
+		std::vector<std::pair<uint32_t, std::string> > texts;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			texts.swap(m_pendingTexts);
+		}
+
+		uint32_t formats = m_formatCount.load(std::memory_order_acquire);
+		for (uint32_t id = m_writtenFormats; id < formats; ++id)
+		{
+			if (id != 0)
+				AppendText(m_frames, FRAME_FORMAT, id, m_formats[id].level, m_formats[id].text);
+		}
+		m_writtenFormats = formats;
+
+		for (const std::pair<uint32_t, std::string>& text : texts)
+		{
+			AppendText(m_frames, FRAME_TEXT, text.first, 0, text.second);
+			if (m_lines)
+			{
+				if (m_texts.empty())
+					m_firstText = text.first;
+				m_texts.push_back(text.second);
+				if (m_texts.size() > LINE_TEXTS)
+				{
+					m_texts.pop_front();
+					m_firstText++;
+				}
+			}
+		}
+
+		uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+		uint64_t rateLimited = m_rateLimited.load(std::memory_order_relaxed);
+		if (dropped != m_reportedDropped || rateLimited != m_reportedRateLimited)
+		{
+			LogRecord notice = LogRecord();
+			notice.time = MonotonicNanoseconds();
+			notice.format = LOG_RECORDS_DROPPED;
+			notice.count = 2;
+			notice.args[0] = dropped - m_reportedDropped;
+			notice.args[1] = rateLimited - m_reportedRateLimited;
+			m_batch.push_back(notice);
+
+			m_reportedDropped = dropped;
+			m_reportedRateLimited = rateLimited;
+		}
+
+		std::stable_sort(m_batch.begin(), m_batch.end(), [](const LogRecord& left, const LogRecord& right)
+		{
+			return left.time < right.time;
+		});
+
+		for (size_t i = 0; i < m_batch.size(); i += RECORDS_PER_FRAME)
+			AppendRecords(m_frames, &m_batch[i], std::min(RECORDS_PER_FRAME, m_batch.size() - i));
+
+		if (m_toFile && !m_frames.empty() && m_writeStatus.load() == BS_OK)
+		{
+			BsStatus status = m_file.WriteAt(m_offset, m_frames.data(), m_frames.size());
+			if (status == BS_OK)
+			{
+				m_offset += m_frames.size();
+				m_bytesWritten.store(m_offset);
+			}
+			else
+				m_writeStatus.store(status);
+		}
+
+		if (m_lines)
+		{
+			TextLookup lookup = [this](uint32_t id) -> const std::string*
+			{
+				return id >= m_firstText && id - m_firstText < m_texts.size() ? &m_texts[id - m_firstText] : NULL;
+			};
+
+			std::string line;
+			for (const LogRecord& record : m_batch)
+			{
+				const Format& format = m_formats[record.format];
+				FormatRecord(record, format.level, format.text, m_opened, lookup, line);
+				m_lines(line);
+			}
+		}
+
+		m_written.fetch_add(m_batch.size());
+	}
+
+	//
+	//   FUNCTION: DecodeLog(const PathChar*, const LogLineCallback&, uint64_t*)
+	//
+	//   PURPOSE: Reads the file a frame at a time, keeping the formats and
+	//            texts it meets, and formats the records as the writer's
+	//            line callback would.
+	//
+	BsStatus DecodeLog(const PathChar* path, const LogLineCallback& line, uint64_t* records)
+	{
+		if (records != NULL)
+			*records = 0;
+		if (path == NULL || !line)
+			return BS_E_INVALIDARG;
+
+		CFile file;
+		BsStatus status = file.Open(path);
+		if (status != BS_OK)
+			return status;
+
+		uint8_t header[LOG_HEADER_SIZE];
+		size_t bytesRead = 0;
+		status = file.ReadAt(0, header, sizeof(header), bytesRead);
+		if (status != BS_OK)
+			return status;
+		if (bytesRead != sizeof(header) || memcmp(header, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 ||
+			GetLittleEndian32(header + 4) != LOG_VERSION || Crc32(header, 24) != GetLittleEndian32(header + 24))
+			return BS_E_CORRUPT;
+
+		int64_t opened = (int64_t)GetLittleEndian64(header + 8);
+		int64_t openedUnix = (int64_t)GetLittleEndian64(header + 16);
+
+		std::string text = "log opened ";
+		AppendJsonDate(text, UnixTimeToFileTime(openedUnix / 1000000000, openedUnix % 1000000000));
+		text.erase(std::remove(text.begin(), text.end(), '"'), text.end());
+		line(text);
+
+		std::vector<std::pair<unsigned, std::string> > formats;
+		std::unordered_map<uint32_t, std::string> texts;
+		TextLookup lookup = [&texts](uint32_t id) -> const std::string*
+		{
+			auto found = texts.find(id);
+			return found != texts.end() ? &found->second : NULL;
+		};
+
+		std::vector<uint8_t> payload;
+		uint64_t offset = LOG_HEADER_SIZE;
+		uint64_t decoded = 0;
+		for (;;)
+		{
+			uint8_t frame[FRAME_HEADER_SIZE];
+			status = file.ReadAt(offset, frame, sizeof(frame), bytesRead);
+			if (status != BS_OK)
+				return status;
+			if (bytesRead != sizeof(frame))
+				break;
+
+			uint32_t length = GetLittleEndian32(frame);
+			if (length == 0 || length > MAX_PAYLOAD)
+				break;
+
+			payload.resize(length);
+			status = file.ReadAt(offset + FRAME_HEADER_SIZE, payload.data(), length, bytesRead);
+			if (status != BS_OK)
+				return status;
+			if (bytesRead != length || Crc32(payload.data(), length) != GetLittleEndian32(frame + 4))
+				break;
+
+			const uint8_t* data = payload.data() + 1;
+			const uint8_t* end = payload.data() + length;
+			uint64_t id = 0;
+			uint64_t value = 0;
+			bool ok = ReadVarint(data, end, id);
+
+			switch (payload[0])
+			{
+			case FRAME_FORMAT:
+				ok = ok && ReadVarint(data, end, value) && id < LOG_MAX_FORMATS;
+				if (ok)
+				{
+					if (formats.size() <= id)
+						formats.resize((size_t)id + 1);
+					formats[(size_t)id] = std::make_pair((unsigned)value, std::string((const char*)data, end - data));
+				}
+				break;
+			case FRAME_TEXT:
+				ok = ok && id <= UINT32_MAX;
+				if (ok)
+					texts[(uint32_t)id] = std::string((const char*)data, end - data);
+				break;
+			case FRAME_RECORDS:
+				ok = ok && (uint64_t)(end - data) == id * RECORD_SIZE;
+				for (uint64_t i = 0; ok && i < id; ++i)
+				{
+					LogRecord record;
+					GetRecord(data + i * RECORD_SIZE, record);
+
+					std::string formatted;
+					if (record.format < formats.size())
+					{
+						const std::pair<unsigned, std::string>& format = formats[record.format];
+						FormatRecord(record, format.first, format.second, opened, lookup, formatted);
+					}
+					else
+						FormatRecord(record, 0, "unknown format " + std::to_string(record.format), opened, lookup, formatted);
+					line(formatted);
+					decoded++;
+				}
+				break;
+			default:
+				ok = false;
+				break;
+			}
+
+			if (!ok)
+				break;
+			offset += FRAME_HEADER_SIZE + length;
+		}
+
+		if (records != NULL)
+			*records = decoded;
+		return BS_OK;
+	}
+}
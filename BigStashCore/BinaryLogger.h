@@ -0,0 +1,247 @@
+// BinaryLogger.h : Declaration of CBinaryLogger, the upload path's log,
+// and DecodeLog
+
+#pragma once
+
+#include "File.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace BigStash
+{
+	// The values are the BS_LOG_* values.
+	enum LogLevel
+	{
+		LOG_DEBUG = 1,
+		LOG_INFO = 2,
+		LOG_WARNING = 3,
+		LOG_ERROR = 4
+	};
+
+	// The formats the core logs with, registered by every logger in this
+	// order. In the texts, {u} is an unsigned argument, {i} a signed one,
+	// {x} one in hex, {f} a double, {s} a BsStatus and {t} a text from
+	// Intern.
+	enum LogFormatId
+	{
+		LOG_FORMAT_NONE,
+
+		// Written by the logger itself when records were lost.
+		LOG_RECORDS_DROPPED,
+
+		LOG_PARTS_STARTED,
+		LOG_PART_SENT,
+		LOG_PART_RETRY,
+		LOG_PART_FAILED,
+		LOG_PART_HEDGED,
+		LOG_PARTS_FINISHED,
+
+		LOG_BUILTIN_FORMATS
+	};
+
+	const unsigned LOG_MAX_ARGUMENTS = 6;
+	const uint32_t LOG_MAX_FORMATS = 1024;
+
+	// A record as the rings and the file hold it: 64 bytes, one cache line.
+	struct LogRecord
+	{
+		int64_t time;
+		uint32_t format;
+		uint16_t thread;
+		uint8_t count;
+		uint8_t reserved;
+		uint64_t args[LOG_MAX_ARGUMENTS];
+	};
+
+	// Integers and enums as they are, sign extended; doubles as their bits.
+	template <typename T>
+	inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint64_t>::type
+		LogArgument(T value)
+	{
+		return (uint64_t)value;
+	}
+
+	inline uint64_t LogArgument(double value)
+	{
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	struct LogOptions
+	{
+		LogOptions() : ringRecords(4096), flushIntervalMs(50), level(LOG_INFO), maxPerSecond(1000) {}
+
+		// Records each logging thread can have waiting for the writer,
+		// rounded up to a power of two.
+		size_t ringRecords;
+
+		// How often the writer drains the rings.
+		unsigned flushIntervalMs;
+
+		// Records of formats below it are not kept.
+		LogLevel level;
+
+		// Records of one format per second, 0 for no limit. Errors are
+		// never limited.
+		uint32_t maxPerSecond;
+	};
+
+	struct LogStats
+	{
+		uint64_t written;
+
+		// The ring was full.
+		uint64_t dropped;
+		uint64_t rateLimited;
+
+		uint64_t bytesWritten;
+
+		// The error that stopped writing the file, if any.
+		BsStatus writeStatus;
+	};
+
+	// A formatted record, without the line break; on the writer's thread
+	// or DecodeLog's caller's.
+	typedef std::function<void(const std::string& line)> LogLineCallback;
+
+	// CBinaryLogger
+	//
+	// A log the upload hot path can afford. Log copies the format ID and up
+	// to six 64-bit arguments into a ring of the calling thread: no lock, no
+	// allocation and no formatting. A writer thread drains the rings every
+	// flushIntervalMs and appends the records to a binary file, framed with
+	// their length and a CRC-32 like the resume journal; they are turned
+	// into text only by DecodeLog, or by the writer when a line callback was
+	// given. A caller never waits: a full ring drops the record and a
+	// format over maxPerSecond is rate limited, and the writer logs how many
+	// went missing. Strings go through Intern, once, and records refer to
+	// them by number. Process() is the instance the C API and the S3 client
+	// use, closed until BsLogOpen; a closed logger drops everything after
+	// one relaxed load.
+	class CBinaryLogger
+	{
+	public:
+		CBinaryLogger();
+		~CBinaryLogger();
+
+		static CBinaryLogger& Process();
+
+		// path may be NULL to keep no file and only pass lines on.
+		BsStatus Open(const PathChar* path, const LogOptions& options,
+			const LogLineCallback& lines = LogLineCallback());
+
+		// Writes what was logged so far and stops the writer.
+		void Close();
+
+		bool IsOpen() const { return m_open.load(std::memory_order_relaxed); }
+		bool Enabled(LogLevel level) const
+		{
+			return IsOpen() && level >= m_level.load(std::memory_order_relaxed);
+		}
+
+		// The new format's ID, 0 when the table is full or the text has an
+		// unknown {} placeholder or more than six. Formats stay registered
+		// across Open and Close.
+		uint32_t RegisterFormat(LogLevel level, const std::string& text);
+
+		// The number a {t} argument takes for text. Each call adds one, so
+		// intern a name once, e.g. per upload, not per record.
+		uint32_t Intern(const std::string& text);
+
+		template <typename... Args>
+		void Log(uint32_t format, Args... args)
+		{
+			static_assert(sizeof...(Args) <= LOG_MAX_ARGUMENTS, "too many log arguments");
+			if (!IsOpen())
+				return;
+
+			const uint64_t values[sizeof...(Args) + 1] = { LogArgument(args)..., 0 };
+			Write(format, values, sizeof...(Args));
+		}
+
+		void Write(uint32_t format, const uint64_t* args, unsigned count);
+
+		// Waits until the writer has written everything logged before.
+		void Flush();
+
+		LogStats Stats() const;
+
+	private:
+		CBinaryLogger(const CBinaryLogger&);
+		CBinaryLogger& operator=(const CBinaryLogger&);
+
+		struct Format;
+		struct Ring;
+
+		Ring* CurrentRing();
+		void Run();
+		void Drain();
+
+		// Tells the threads' ring caches apart loggers that reuse an address,
+		// and each Open from the one before.
+		std::atomic<uint64_t> m_instance;
+
+		std::atomic<bool> m_open;
+		std::atomic<int> m_level;
+		std::atomic<uint32_t> m_maxPerSecond;
+		LogOptions m_options;
+		LogLineCallback m_lines;
+
+		std::unique_ptr<Format[]> m_formats;
+		std::atomic<uint32_t> m_formatCount;
+
+		// Guards the rings, the formats' registration and the texts.
+		mutable std::mutex m_lock;
+		std::vector<std::unique_ptr<Ring> > m_rings;
+
+		// The rings of earlier Opens, which a caller that raced with Close
+		// may still hold.
+		std::vector<std::unique_ptr<Ring> > m_retired;
+		std::vector<std::pair<uint32_t, std::string> > m_pendingTexts;
+		uint32_t m_nextText;
+
+		std::thread m_thread;
+		std::mutex m_wakeLock;
+		std::condition_variable m_wake;
+		std::condition_variable m_flushed;
+		bool m_stopping;
+		uint64_t m_flushRequests;
+		uint64_t m_flushesDone;
+
+		// writer thread only, between Open and Close.
+		CFile m_file;
+		bool m_toFile;
+		uint64_t m_offset;
+		int64_t m_opened;
+		uint32_t m_writtenFormats;
+		std::deque<std::string> m_texts;
+		uint32_t m_firstText;
+		uint64_t m_reportedDropped;
+		uint64_t m_reportedRateLimited;
+		std::vector<LogRecord> m_batch;
+		std::vector<uint8_t> m_frames;
+
+		std::atomic<uint64_t> m_written;
+		std::atomic<uint64_t> m_dropped;
+		std::atomic<uint64_t> m_rateLimited;
+		std::atomic<uint64_t> m_bytesWritten;
+		std::atomic<int> m_writeStatus;
+	};
+
+	// Reads a log file CBinaryLogger wrote and passes every record on as a
+	// line, in order, after a first line with the time the log was opened.
+	// Stops at a record torn by a crash, with BS_OK. BS_E_CORRUPT when the
+	// file is not a log. records (may be NULL) receives the records read.
+	BsStatus DecodeLog(const PathChar* path, const LogLineCallback& line, uint64_t* records = NULL);
+}
@@ -0,0 +1,431 @@
+// BlockCompressor.cpp : Implementation of CBlockCompressor
+
+#include "BlockCompressor.h"
+#include "Crc32.h"
+
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+#ifdef BIGSTASH_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		// The deflate window; a block can refer this far back into the one
+		// before it.
+		const size_t DICTIONARY_SIZE = 32 * 1024;
+
+		const size_t MIN_BLOCK_SIZE = 64 * 1024;
+
+		// Blocks queued or in flight per worker before Write waits.
+		const size_t BLOCKS_PER_WORKER = 2;
+
+		// ID1, ID2, CM (deflate), FLG, MTIME (none), XFL, OS (unknown).
+		const uint8_t GZIP_HEADER[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+
+		void PutLittleEndian32(uint8_t* data, uint32_t value)
+		{
+			for (int i = 0; i < 4; ++i)
+				data[i] = (uint8_t)(value >> (8 * i));
+		}
+	}
+
+	struct CBlockCompressor::Block
+	{
+		Block() : sequence(0), crc(0), last(false), done(false), status(BS_OK) {}
+
+		uint64_t sequence;
+		std::vector<uint8_t> raw;
+		std::vector<uint8_t> dictionary;
+		std::vector<uint8_t> compressed;
+		uint32_t crc;
+		bool last;
+		bool done;
+		BsStatus status;
+	};
+
+	namespace
+	{
+		//
+		//   FUNCTION: DeflateBlock(z_stream&, ...)
+		//
+		//   PURPOSE: Compresses raw as a raw deflate stream primed with
+		//            dictionary, ended with a sync flush (the last block with
+		//            the final block bit instead).
+		//
+		BsStatus DeflateBlock(z_stream& stream, const std::vector<uint8_t>& raw, const std::vector<uint8_t>& dictionary,
+			bool last, std::vector<uint8_t>& compressed)
+		{
+			if (deflateReset(&stream) != Z_OK)
+				return BS_E_IO;
+			if (!dictionary.empty() && deflateSetDictionary(&stream, dictionary.data(), (uInt)dictionary.size()) != Z_OK)
+				return BS_E_IO;
+
+			// the bound is for Z_FINISH; a sync flush adds an empty stored block.
+			compressed.resize(deflateBound(&stream, (uLong)raw.size()) + 16);
+			stream.next_in = const_cast<Bytef*>(raw.data());
+			stream.avail_in = (uInt)raw.size();
+
+			int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+			size_t produced = 0;
+			for (;;)
+			{
+				stream.next_out = compressed.data() + produced;
+				stream.avail_out = (uInt)(compressed.size() - produced);
+				int result = deflate(&stream, flush);
+				produced = compressed.size() - stream.avail_out;
+
+				if (result == Z_STREAM_END || (result == Z_OK && flush == Z_SYNC_FLUSH && stream.avail_out != 0))
+					break;
+				if (result != Z_OK && result != Z_BUF_ERROR)
+					return BS_E_IO;
+				compressed.resize(compressed.size() * 2);
+			}
+
+			compressed.resize(produced);
+			return BS_OK;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CBlockCompressor methods
+	//
+
+	CBlockCompressor::CBlockCompressor()
+		: m_offset(0), m_rawBytes(0), m_sequence(0), m_crc(0), m_stopping(false), m_finished(false), m_error(BS_OK)
+	{
+	}
+
+	CBlockCompressor::~CBlockCompressor()
+	{
+		Stop();
+	}
+
+	bool CBlockCompressor::IsSupported(CompressionFormat format)
+	{
+		if (format == COMPRESSION_GZIP)
+			return true;
+#ifdef BIGSTASH_HAVE_ZSTD
+		if (format == COMPRESSION_ZSTD)
+			return true;
+#endif
+		return false;
+	}
+
+	BsStatus CBlockCompressor::Open(const PathString& path, const CompressorOptions& options)
+	{
+		if (m_current)
+			return BS_E_INVALIDARG;
+		if (!IsSupported(options.format))
+			return options.format == COMPRESSION_ZSTD ? BS_E_NOTSUPPORTED : BS_E_INVALIDARG;
+
+		BsStatus status = m_file.Open(path.c_str(), FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE);
+		if (status != BS_OK)
+			return status;
+
+		m_sink = CompressedSink();
+		status = Start(options);
+		if (status != BS_OK)
+			m_file.Close();
+		return status;
+	}
+
+	BsStatus CBlockCompressor::Open(const CompressedSink& sink, const CompressorOptions& options)
+	{
+		if (m_current || !sink)
+			return BS_E_INVALIDARG;
+		if (!IsSupported(options.format))
+			return options.format == COMPRESSION_ZSTD ? BS_E_NOTSUPPORTED : BS_E_INVALIDARG;
+
+		m_sink = sink;
+		return Start(options);
+	}
+
+	BsStatus CBlockCompressor::Start(const CompressorOptions& options)
+	{
+		m_options = options;
+		if (m_options.level == 0)
+			m_options.level = m_options.format == COMPRESSION_GZIP ? 6 : 3;
+		if (m_options.threads == 0)
+			m_options.threads = std::max(1u, std::thread::hardware_concurrency());
+		m_options.blockSize = std::max(m_options.blockSize, MIN_BLOCK_SIZE);
+
+		m_offset = 0;
+		m_rawBytes = 0;
+		m_sequence = 0;
+		m_crc = 0;
+		m_tail.clear();
+		m_stopping = false;
+		m_finished = false;
+		m_error = BS_OK;
+
+		if (m_options.format == COMPRESSION_GZIP)
+		{
+			BsStatus status = Emit(GZIP_HEADER, sizeof(GZIP_HEADER));
+			if (status != BS_OK)
+				return status;
+		}
+
+		m_current.reset(new Block);
+		m_current->raw.reserve(m_options.blockSize);
+
+		for (unsigned i = 0; i < m_options.threads; ++i)
+			m_workers.push_back(std::thread(&CBlockCompressor::WorkerLoop, this));
+		m_output = std::thread(&CBlockCompressor::OutputLoop, this);
+		return BS_OK;
+	}
+
+	BsStatus CBlockCompressor::Emit(const uint8_t* data, size_t length)
+	{
+		BsStatus status = m_sink ? m_sink(data, length) : m_file.WriteAt(m_offset, data, length);
+		m_offset += length;
+		return status;
+	}
+
+	BsStatus CBlockCompressor::Write(const void* data, size_t length)
+	{
+		if (!m_current)
+			return BS_E_INVALIDARG;
+
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		while (length != 0)
+		{
+			std::vector<uint8_t>& raw = m_current->raw;
+			size_t chunk = std::min(length, m_options.blockSize - raw.size());
+			raw.insert(raw.end(), bytes, bytes + chunk);
+			bytes += chunk;
+			length -= chunk;
+
+			if (raw.size() == m_options.blockSize)
+			{
+				BsStatus status = Submit(false);
+				if (status != BS_OK)
+					return status;
+			}
+		}
+		return BS_OK;
+	}
+
+	//
+	//   FUNCTION: CBlockCompressor::Submit(bool)
+	//
+	//   PURPOSE: Queues the current block for the workers, with the tail of
+	//            the data before it as its dictionary, once fewer than
+	//            BLOCKS_PER_WORKER blocks per worker are ahead of it.
+	//
+	BsStatus CBlockCompressor::Submit(bool last)
+	{
+		std::unique_ptr<Block> block(std::move(m_current));
+		block->sequence = m_sequence++;
+		block->last = last;
+		m_rawBytes += block->raw.size();
+
+		if (m_options.format == COMPRESSION_GZIP)
+		{
+			const std::vector<uint8_t>& raw = block->raw;
+			block->dictionary = m_tail;
+			if (raw.size() >= DICTIONARY_SIZE)
+				m_tail.assign(raw.end() - DICTIONARY_SIZE, raw.end());
+			else
+			{
+				m_tail.insert(m_tail.end(), raw.begin(), raw.end());
+				if (m_tail.size() > DICTIONARY_SIZE)
+					m_tail.erase(m_tail.begin(), m_tail.end() - DICTIONARY_SIZE);
+			}
+		}
+
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_spaceWake.wait(guard, [this]()
+			{
+				return m_order.size() < m_options.threads * BLOCKS_PER_WORKER || m_error != BS_OK;
+			});
+			if (m_error != BS_OK)
+				return m_error;
+
+			m_jobs.push_back(block.get());
+			m_order.push_back(std::move(block));
+		}
+		m_workWake.notify_one();
+
+		if (!last)
+		{
+			m_current.reset(new Block);
+			m_current->raw.reserve(m_options.blockSize);
+		}
+		return BS_OK;
+	}
+
+	void CBlockCompressor::WorkerLoop()
+	{
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		bool deflateReady = false;
+#ifdef BIGSTASH_HAVE_ZSTD
+		ZSTD_CCtx* context = NULL;
+#endif
+
+		BsStatus setup = BS_OK;
+		if (m_options.format == COMPRESSION_GZIP)
+		{
+			deflateReady = deflateInit2(&stream, m_options.level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+			if (!deflateReady)
+				setup = BS_E_OUTOFMEMORY;
+		}
+#ifdef BIGSTASH_HAVE_ZSTD
+		else
+		{
+			context = ZSTD_createCCtx();
+			if (context == NULL || ZSTD_isError(ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, m_options.level)) ||
+				ZSTD_isError(ZSTD_CCtx_setParameter(context, ZSTD_c_checksumFlag, 1)))
+				setup = BS_E_OUTOFMEMORY;
+		}
+#endif
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (;;)
+		{
+			m_workWake.wait(guard, [this]() { return !m_jobs.empty() || m_stopping; });
+			if (m_jobs.empty())
+				break;
+
+			Block* block = m_jobs.front();
+			m_jobs.pop_front();
+			guard.unlock();
+
+			BsStatus status = setup;
+			if (status == BS_OK)
+			{
+				try
+				{
+					block->crc = Crc32(block->raw.data(), block->raw.size());
+					if (m_options.format == COMPRESSION_GZIP)
+						status = DeflateBlock(stream, block->raw, block->dictionary, block->last, block->compressed);
+#ifdef BIGSTASH_HAVE_ZSTD
+					else
+					{
+						block->compressed.resize(ZSTD_compressBound(block->raw.size()));
+						size_t size = ZSTD_compress2(context, block->compressed.data(), block->compressed.size(),
+							block->raw.data(), block->raw.size());
+						if (ZSTD_isError(size))
+							status = BS_E_IO;
+						else
+							block->compressed.resize(size);
+					}
+#endif
+				}
+				catch (const std::bad_alloc&)
+				{
+					status = BS_E_OUTOFMEMORY;
+				}
+			}
+
+			// the output thread only needs the compressed bytes.
+			std::vector<uint8_t>().swap(block->dictionary);
+
+			guard.lock();
+			block->status = status;
+			block->done = true;
+			m_outputWake.notify_one();
+		}
+		guard.unlock();
+
+		if (deflateReady)
+			deflateEnd(&stream);
+#ifdef BIGSTASH_HAVE_ZSTD
+		ZSTD_freeCCtx(context);
+#endif
+	}
+
+	//
+	//   FUNCTION: CBlockCompressor::OutputLoop()
+	//
+	//   PURPOSE: Writes the blocks in sequence as they come done and folds
+	//            their CRCs together. After a failure it only drops blocks,
+	//            so the producer and the workers never wait on it.
+	//
+	void CBlockCompressor::OutputLoop()
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (;;)
+		{
+			m_outputWake.wait(guard, [this]()
+			{
+				return (!m_order.empty() && m_order.front()->done) || (m_stopping && m_order.empty());
+			});
+			if (m_order.empty())
+				break;
+
+			std::unique_ptr<Block> block(std::move(m_order.front()));
+			m_order.pop_front();
+			BsStatus status = m_error != BS_OK ? m_error : block->status;
+			guard.unlock();
+
+			if (status == BS_OK)
+			{
+				status = Emit(block->compressed.data(), block->compressed.size());
+				m_crc = Crc32Combine(m_crc, block->crc, block->raw.size());
+			}
+			bool last = block->last;
+			block.reset();
+
+			guard.lock();
+			if (m_error == BS_OK)
+				m_error = status;
+			if (last)
+				m_finished = true;
+			m_spaceWake.notify_all();
+		}
+	}
+
+	BsStatus CBlockCompressor::Finish()
+	{
+		if (!m_current)
+			return BS_E_INVALIDARG;
+
+		BsStatus status = Submit(true);
+		if (status == BS_OK)
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_spaceWake.wait(guard, [this]() { return m_finished || m_error != BS_OK; });
+			status = m_error;
+		}
+		Stop();
+
+		if (status == BS_OK && m_options.format == COMPRESSION_GZIP)
+		{
+			uint8_t trailer[8];
+			PutLittleEndian32(trailer, m_crc);
+			PutLittleEndian32(trailer + 4, (uint32_t)m_rawBytes);
+			status = Emit(trailer, sizeof(trailer));
+		}
+
+		m_file.Close();
+		m_sink = CompressedSink();
+		return status;
+	}
+
+	void CBlockCompressor::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_stopping = true;
+		}
+		m_workWake.notify_all();
+		m_outputWake.notify_all();
+
+		for (std::thread& worker : m_workers)
+			worker.join();
+		m_workers.clear();
+		if (m_output.joinable())
+			m_output.join();
+
+		m_current.reset();
+		m_order.clear();
+		m_jobs.clear();
+	}
+}
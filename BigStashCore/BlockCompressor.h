@@ -0,0 +1,117 @@
+// BlockCompressor.h : Declaration of CBlockCompressor
+
+#pragma once
+
+#include "File.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace BigStash
+{
+	enum CompressionFormat
+	{
+		// One gzip member any gunzip (or GZipStream) reads.
+		COMPRESSION_GZIP = 0,
+
+		// Concatenated zstd frames, one per block. Only when built with
+		// BIGSTASH_HAVE_ZSTD.
+		COMPRESSION_ZSTD = 1
+	};
+
+	struct CompressorOptions
+	{
+		CompressorOptions() : format(COMPRESSION_GZIP), level(0), threads(0), blockSize(256 * 1024) {}
+
+		CompressionFormat format;
+
+		// 0 picks 6 for gzip and 3 for zstd.
+		int level;
+
+		// Compressing threads, 0 picks the processor count.
+		unsigned threads;
+
+		size_t blockSize;
+	};
+
+	// Receives the compressed stream in order: on the output thread, and the
+	// gzip header and trailer on the threads that call Open and Finish.
+	typedef std::function<BsStatus(const uint8_t* data, size_t length)> CompressedSink;
+
+	// CBlockCompressor
+	//
+	// Compresses a stream into a file (or a sink) on every core, the way pigz does: the
+	// input is cut into blocks that workers compress independently, and an
+	// output thread writes them back in order. For gzip every block is a raw
+	// deflate stream primed with the last 32 KB of the block before it as
+	// its dictionary (so the ratio stays within a fraction of a percent of
+	// one stream) and ended on a byte boundary with a sync flush, all under
+	// one gzip header; the per-block CRCs are combined into the trailer's.
+	// Write blocks while the workers are that far behind, so memory stays at
+	// a few blocks per thread whatever the stream length.
+	class CBlockCompressor
+	{
+	public:
+		CBlockCompressor();
+		~CBlockCompressor();
+
+		static bool IsSupported(CompressionFormat format);
+
+		BsStatus Open(const PathString& path, const CompressorOptions& options = CompressorOptions());
+
+		// Hands the compressed stream to sink instead of writing a file.
+		BsStatus Open(const CompressedSink& sink, const CompressorOptions& options = CompressorOptions());
+
+		// Not thread-safe: one producer.
+		BsStatus Write(const void* data, size_t length);
+
+		// Compresses the rest, writes the trailer and closes the file.
+		BsStatus Finish();
+
+		uint64_t RawBytes() const { return m_rawBytes; }
+		uint64_t CompressedBytes() const { return m_offset; }
+		uint64_t Blocks() const { return m_sequence; }
+
+	private:
+		CBlockCompressor(const CBlockCompressor&);
+		CBlockCompressor& operator=(const CBlockCompressor&);
+
+		struct Block;
+
+		BsStatus Start(const CompressorOptions& options);
+		BsStatus Emit(const uint8_t* data, size_t length);
+		BsStatus Submit(bool last);
+		void WorkerLoop();
+		void OutputLoop();
+		void Stop();
+
+		CFile m_file;
+		CompressedSink m_sink;
+		CompressorOptions m_options;
+		uint64_t m_offset;
+		uint64_t m_rawBytes;
+		uint64_t m_sequence;
+		uint32_t m_crc;
+
+		// producer only.
+		std::unique_ptr<Block> m_current;
+		std::vector<uint8_t> m_tail;
+
+		std::mutex m_lock;
+		std::condition_variable m_workWake;
+		std::condition_variable m_outputWake;
+		std::condition_variable m_spaceWake;
+		std::vector<std::thread> m_workers;
+		std::thread m_output;
+		std::deque<Block*> m_jobs;
+		std::deque<std::unique_ptr<Block> > m_order;
+		bool m_stopping;
+		bool m_finished;
+		BsStatus m_error;
+	};
+}
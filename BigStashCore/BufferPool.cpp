@@ -0,0 +1,127 @@
+// BufferPool.cpp : Implementation of CBufferPool
+
+#include "BufferPool.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace BigStash
+{
+	void* AlignedAlloc(size_t size, size_t alignment)
+	{
+#ifdef _WIN32
+		return _aligned_malloc(size, alignment);
+#else
+		void* pointer = NULL;
+		if (posix_memalign(&pointer, alignment, size) != 0)
+			return NULL;
+		return pointer;
+#endif
+	}
+
+	void AlignedFree(void* pointer)
+	{
+#ifdef _WIN32
+		_aligned_free(pointer);
+#else
+		free(pointer);
+#endif
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CBufferPool methods
+	//
+
+	CBufferPool::CBufferPool(size_t bufferSize, size_t count, size_t alignment)
+		: m_bufferSize(bufferSize), m_shutdown(false)
+	{
+		// round the size up so a full buffer can be read unbuffered.
+		m_bufferSize = (bufferSize + alignment - 1) & ~(alignment - 1);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			uint8_t* buffer = static_cast<uint8_t*>(AlignedAlloc(m_bufferSize, alignment));
+			if (buffer == NULL)
+			{
+				for (uint8_t* allocated : m_buffers)
+					AlignedFree(allocated);
+				throw std::bad_alloc();
+			}
+
+			m_buffers.push_back(buffer);
+		}
+
+		m_free = m_buffers;
+	}
+
+	CBufferPool::~CBufferPool()
+	{
+		for (uint8_t* buffer : m_buffers)
+			AlignedFree(buffer);
+	}
+
+	uint8_t* CBufferPool::Acquire(const std::atomic<bool>* cancel)
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		while (!m_shutdown && m_free.empty())
+		{
+			if (cancel == NULL)
+			{
+				m_available.wait(guard);
+				continue;
+			}
+
+			// Release does not know about the caller's cancel flag, so poll it.
+			if (cancel->load())
+				return NULL;
+			m_available.wait_for(guard, std::chrono::milliseconds(10));
+		}
+
+		if (m_shutdown)
+			return NULL;
+
+		uint8_t* buffer = m_free.back();
+		m_free.pop_back();
+		return buffer;
+	}
+
+	uint8_t* CBufferPool::TryAcquire()
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_shutdown || m_free.empty())
+			return NULL;
+
+		uint8_t* buffer = m_free.back();
+		m_free.pop_back();
+		return buffer;
+	}
+
+	void CBufferPool::Release(uint8_t* buffer)
+	{
+		if (buffer == NULL)
+			return;
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_free.push_back(buffer);
+		}
+
+		m_available.notify_one();
+	}
+
+	void CBufferPool::Shutdown()
+	{
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_shutdown = true;
+		}
+
+		m_available.notify_all();
+	}
+}
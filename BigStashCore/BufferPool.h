@@ -0,0 +1,57 @@
+// BufferPool.h : Declaration of CBufferPool
+
+#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace BigStash
+{
+	// Allocates and frees memory aligned to alignment (a power of two).
+	void* AlignedAlloc(size_t size, size_t alignment);
+	void AlignedFree(void* pointer);
+
+	// CBufferPool
+	//
+	// A fixed set of equally sized, aligned buffers. The buffers are
+	// allocated once and recycled, so steady-state uploading does no
+	// allocations, and the alignment satisfies unbuffered (O_DIRECT /
+	// FILE_FLAG_NO_BUFFERING) I/O. The buffer count caps the memory all
+	// readers sharing the pool can hold.
+	class CBufferPool
+	{
+	public:
+		CBufferPool(size_t bufferSize, size_t count, size_t alignment = 4096);
+		~CBufferPool();
+
+		size_t BufferSize() const { return m_bufferSize; }
+		size_t Count() const { return m_buffers.size(); }
+
+		// Waits until a buffer is free. Returns NULL once the pool is shut down
+		// or, for pools shared between readers, when cancel becomes true.
+		uint8_t* Acquire(const std::atomic<bool>* cancel = NULL);
+
+		// Returns NULL instead of waiting.
+		uint8_t* TryAcquire();
+
+		void Release(uint8_t* buffer);
+
+		// Wakes every waiter; Acquire returns NULL from then on.
+		void Shutdown();
+
+	private:
+		CBufferPool(const CBufferPool&);
+		CBufferPool& operator=(const CBufferPool&);
+
+		size_t m_bufferSize;
+		std::vector<uint8_t*> m_buffers;
+		std::vector<uint8_t*> m_free;
+		std::mutex m_lock;
+		std::condition_variable m_available;
+		bool m_shutdown;
+	};
+}
@@ -0,0 +1,472 @@
+// ChangeIndex.cpp : Implementation of CChangeIndex
+
+#include "ChangeIndex.h"
+#include "Crc32.h"
+#include "TreeScanner.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace BigStash
+{
+	// The file starts with this, the records follow.
+	struct CChangeIndex::Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t recordSize;
+		uint64_t capacity;
+		uint32_t checksum;        // CRC-32 of the fields above
+
+		uint32_t generation;
+		uint64_t count;
+
+		// Set while the index is open; found set, the count is not to be
+		// trusted.
+		uint32_t dirty;
+		uint8_t reserved[20];
+	};
+
+	static_assert(sizeof(ChangeRecord) == 64, "a change record is one cache line");
+
+	/////////////////////////////////////////////////////////////////////////////
+	// Some helper methods
+	//
+
+	namespace
+	{
+		const char INDEX_MAGIC[8] = { 'B', 'S', 'C', 'H', 'A', 'N', 'G', 'E' };
+		const uint32_t INDEX_VERSION = 1;
+		const uint64_t MIN_CAPACITY = 1024;
+
+		// Everything before the checksum is checked.
+		const size_t RECORD_CHECKED_BYTES = offsetof(ChangeRecord, checksum);
+
+		uint32_t RecordChecksum(const ChangeRecord& record)
+		{
+			return Crc32(&record, RECORD_CHECKED_BYTES);
+		}
+
+		inline bool IsEmpty(const ChangeRecord& record)
+		{
+			return record.fileId == 0 && record.volume == 0;
+		}
+
+		// File IDs are handed out in sequence, so they are mixed before
+		// their low bits pick the slot.
+		inline uint64_t HashIdentity(uint64_t volume, uint64_t fileId)
+		{
+			uint64_t hash = fileId * 0x9E3779B97F4A7C15ull ^ volume * 0xC2B2AE3D27D4EB4Full;
+			hash ^= hash >> 29;
+			hash *= 0xBF58476D1CE4E5B9ull;
+			hash ^= hash >> 32;
+			return hash;
+		}
+
+		// At most 70% full.
+		inline bool IsOverloaded(uint64_t count, uint64_t capacity)
+		{
+			return count * 10 > capacity * 7;
+		}
+
+		uint64_t CapacityFor(uint64_t files)
+		{
+			uint64_t capacity = MIN_CAPACITY;
+			while (IsOverloaded(files, capacity))
+				capacity *= 2;
+			return capacity;
+		}
+
+		PathString TemporaryPath(const PathString& path)
+		{
+			PathString temporary(path);
+			for (const char* suffix = ".tmp"; *suffix != 0; ++suffix)
+				temporary += (PathChar)*suffix;
+			return temporary;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CChangeIndex methods
+	//
+
+	CChangeIndex::CChangeIndex()
+		:
+#ifdef _WIN32
+		m_mapping(NULL),
+#endif
+		m_view(NULL), m_viewLength(0), m_header(NULL), m_records(NULL), m_mask(0), m_recovered(false)
+	{
+	}
+
+	CChangeIndex::~CChangeIndex()
+	{
+		Close();
+	}
+
+	//
+	//   FUNCTION: CChangeIndex::Open(const PathChar*, uint64_t)
+	//
+	//   PURPOSE: Maps the index, or creates it. Only the header is read; the
+	//            records are paged in as lookups reach them. An index that
+	//            was left open by a crash has its records counted again.
+	//
+	BsStatus CChangeIndex::Open(const PathChar* path, uint64_t expectedFiles)
+	{
+		Close();
+
+		m_path = path;
+		m_recovered = false;
+
+		BsStatus status = FileExists(path) ? Map(path, 0, false) : BS_E_NOTFOUND;
+		if (status == BS_E_NOTFOUND)
+			status = Map(path, CapacityFor(expectedFiles), true);
+		if (status != BS_OK)
+			return status;
+
+		if (m_header->dirty != 0)
+		{
+			uint64_t count = 0;
+			for (uint64_t i = 0; i <= m_mask; ++i)
+			{
+				if (!IsEmpty(m_records[i]))
+					++count;
+			}
+
+			m_header->count = count;
+			m_recovered = true;
+		}
+
+		m_header->dirty = 1;
+		return BS_OK;
+	}
+
+	void CChangeIndex::Close()
+	{
+		if (m_header == NULL)
+			return;
+
+		m_header->dirty = 0;
+		Flush();
+		Unmap();
+		m_file.Close();
+	}
+
+	uint32_t CChangeIndex::BeginRun()
+	{
+		if (m_header == NULL)
+			return 0;
+
+		return ++m_header->generation;
+	}
+
+	ChangeState CChangeIndex::Lookup(uint64_t volume, uint64_t fileId, uint64_t size, int64_t lastWriteTime,
+		ChangeRecord& record)
+	{
+		if (m_header == NULL || fileId == 0)
+			return CHANGE_NEW;
+
+		size_t slot = Probe(volume, fileId);
+		if (slot == SIZE_MAX || IsEmpty(m_records[slot]))
+			return CHANGE_NEW;
+
+		// The file still exists whether or not it changed.
+		ChangeRecord& stored = m_records[slot];
+		stored.generation = m_header->generation;
+
+		if (stored.size != size || stored.lastWriteTime != lastWriteTime || stored.checksum != RecordChecksum(stored))
+			return CHANGE_MODIFIED;
+
+		record = stored;
+		return CHANGE_UNCHANGED;
+	}
+
+	BsStatus CChangeIndex::Update(uint64_t volume, uint64_t fileId, uint64_t size, int64_t lastWriteTime,
+		const uint8_t md5[MD5_DIGEST_SIZE], uint64_t upload)
+	{
+		if (m_header == NULL || fileId == 0 || md5 == NULL)
+			return BS_E_INVALIDARG;
+
+		size_t slot = Probe(volume, fileId);
+		if (slot == SIZE_MAX || (IsEmpty(m_records[slot]) && IsOverloaded(m_header->count + 1, Capacity())))
+		{
+			uint64_t removed;
+			BsStatus status = Rebuild(Capacity() * 2, 0, removed);
+			if (status != BS_OK)
+				return status;
+
+			slot = Probe(volume, fileId);
+		}
+
+		ChangeRecord& record = m_records[slot];
+		if (IsEmpty(record))
+			m_header->count++;
+
+		record.volume = volume;
+		record.fileId = fileId;
+		record.size = size;
+		record.lastWriteTime = lastWriteTime;
+		memcpy(record.md5, md5, MD5_DIGEST_SIZE);
+		record.upload = upload;
+		record.checksum = RecordChecksum(record);
+		record.generation = m_header->generation;
+		return BS_OK;
+	}
+
+	BsStatus CChangeIndex::Prune(uint32_t keepRuns, uint64_t& removed)
+	{
+		removed = 0;
+		if (m_header == NULL || keepRuns == 0)
+			return BS_E_INVALIDARG;
+
+		return Rebuild(Capacity(), keepRuns, removed);
+	}
+
+	BsStatus CChangeIndex::Flush()
+	{
+		if (m_header == NULL)
+			return BS_E_INVALIDARG;
+
+#ifdef _WIN32
+		if (!FlushViewOfFile(m_view, 0))
+			return StatusFromWin32(GetLastError());
+		return m_file.Sync();
+#else
+		if (msync(m_view, m_viewLength, MS_SYNC) != 0)
+			return StatusFromErrno(errno);
+		return BS_OK;
+#endif
+	}
+
+	uint64_t CChangeIndex::Count() const
+	{
+		return m_header != NULL ? m_header->count : 0;
+	}
+
+	uint32_t CChangeIndex::Generation() const
+	{
+		return m_header != NULL ? m_header->generation : 0;
+	}
+
+	//
+	//   FUNCTION: CChangeIndex::Map(const PathChar*, uint64_t, bool)
+	//
+	//   PURPOSE: Maps the whole file for reading and writing. A new index is
+	//            sized for capacity records, which the file system keeps
+	//            sparse until they are written; an existing one is checked
+	//            against its header.
+	//
+	BsStatus CChangeIndex::Map(const PathChar* path, uint64_t capacity, bool create)
+	{
+		static_assert(sizeof(Header) == sizeof(ChangeRecord), "the records stay aligned to cache lines");
+
+		BsStatus status = m_file.Open(path, create ? FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE : FILE_OPEN_WRITE);
+		if (status != BS_OK)
+			return status;
+
+		uint64_t length = sizeof(Header) + capacity * sizeof(ChangeRecord);
+		status = create ? m_file.Truncate(length) : m_file.GetSize(length);
+		if (status == BS_OK && !create && length == 0)
+			status = BS_E_NOTFOUND;
+		else if (status == BS_OK && length < sizeof(Header))
+			status = BS_E_CORRUPT;
+		else if (status == BS_OK && length > SIZE_MAX)
+			status = BS_E_OUTOFMEMORY;
+
+		if (status == BS_OK)
+		{
+#ifdef _WIN32
+			m_mapping = CreateFileMappingW(m_file.Handle(), NULL, PAGE_READWRITE, 0, 0, NULL);
+			if (m_mapping != NULL)
+				m_view = (uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)length);
+			if (m_view == NULL)
+				status = StatusFromWin32(GetLastError());
+#else
+			void* view = mmap(NULL, (size_t)length, PROT_READ | PROT_WRITE, MAP_SHARED, m_file.Handle(), 0);
+			if (view != MAP_FAILED)
+				m_view = (uint8_t*)view;
+			else
+				status = StatusFromErrno(errno);
+#endif
+		}
+
+		if (status != BS_OK)
+		{
+			Unmap();
+			m_file.Close();
+			return status;
+		}
+
+		m_viewLength = (size_t)length;
+		m_header = reinterpret_cast<Header*>(m_view);
+		m_records = reinterpret_cast<ChangeRecord*>(m_view + sizeof(Header));
+
+		if (create)
+		{
+			memcpy(m_header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+			m_header->version = INDEX_VERSION;
+			m_header->recordSize = sizeof(ChangeRecord);
+			m_header->capacity = capacity;
+			m_header->checksum = Crc32(m_header, offsetof(Header, checksum));
+		}
+		else
+		{
+			capacity = m_header->capacity;
+			if (memcmp(m_header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+				m_header->version != INDEX_VERSION || m_header->recordSize != sizeof(ChangeRecord) ||
+				m_header->checksum != Crc32(m_header, offsetof(Header, checksum)) ||
+				capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+				capacity != (length - sizeof(Header)) / sizeof(ChangeRecord) ||
+				length != sizeof(Header) + capacity * sizeof(ChangeRecord))
+			{
+				Unmap();
+				m_file.Close();
+				return BS_E_CORRUPT;
+			}
+		}
+
+		m_mask = capacity - 1;
+		return BS_OK;
+	}
+
+	void CChangeIndex::Unmap()
+	{
+#ifdef _WIN32
+		if (m_view != NULL)
+			UnmapViewOfFile(m_view);
+		if (m_mapping != NULL)
+			CloseHandle(m_mapping);
+		m_mapping = NULL;
+#else
+		if (m_view != NULL)
+			munmap(m_view, m_viewLength);
+#endif
+		m_view = NULL;
+		m_viewLength = 0;
+		m_header = NULL;
+		m_records = NULL;
+		m_mask = 0;
+	}
+
+	//
+	//   FUNCTION: CChangeIndex::Rebuild(uint64_t, uint32_t, uint64_t&)
+	//
+	//   PURPOSE: Rehashes the records into a new index of capacity records,
+	//            keeping the ones seen in the last keepRuns runs (0 keeps
+	//            all) and dropping torn ones. The new index is flushed and
+	//            renamed over this one, so a crash leaves either whole.
+	//
+	BsStatus CChangeIndex::Rebuild(uint64_t capacity, uint32_t keepRuns, uint64_t& removed)
+	{
+		removed = 0;
+
+		uint64_t kept = 0;
+		for (uint64_t i = 0; i <= m_mask; ++i)
+		{
+			const ChangeRecord& record = m_records[i];
+			if (!IsEmpty(record) && record.checksum == RecordChecksum(record) &&
+				(keepRuns == 0 || m_header->generation - record.generation < keepRuns))
+			{
+				++kept;
+			}
+		}
+		while (IsOverloaded(kept, capacity))
+			capacity *= 2;
+
+		PathString temporary = TemporaryPath(m_path);
+		BsStatus status;
+		{
+			CChangeIndex rebuilt;
+			status = rebuilt.Map(temporary.c_str(), capacity, true);
+			if (status != BS_OK)
+				return status;
+
+			for (uint64_t i = 0; i <= m_mask; ++i)
+			{
+				const ChangeRecord& record = m_records[i];
+				if (IsEmpty(record))
+					continue;
+
+				if (record.checksum != RecordChecksum(record) ||
+					(keepRuns != 0 && m_header->generation - record.generation >= keepRuns))
+				{
+					++removed;
+					continue;
+				}
+
+				rebuilt.m_records[rebuilt.Probe(record.volume, record.fileId)] = record;
+			}
+
+			rebuilt.m_header->generation = m_header->generation;
+			rebuilt.m_header->count = kept;
+			rebuilt.m_header->dirty = 0;
+			status = rebuilt.Flush();
+			rebuilt.Unmap();
+			rebuilt.m_file.Close();
+		}
+
+		if (status == BS_OK)
+		{
+			m_header->dirty = 0;
+			Flush();
+			Unmap();
+			m_file.Close();
+
+			status = RenameFile(temporary.c_str(), m_path.c_str());
+			if (status == BS_OK)
+				SyncParentDirectory(m_path.c_str());
+
+			// Maps the old index again when the rename failed.
+			BsStatus mapStatus = Map(m_path.c_str(), 0, false);
+			if (mapStatus != BS_OK)
+				return mapStatus;
+			m_header->dirty = 1;
+		}
+
+		if (status != BS_OK)
+			RemoveFile(temporary.c_str());
+		return status;
+	}
+
+	// The record's slot, or the empty slot where it goes; SIZE_MAX when the
+	// index is full, which only a count lost in a crash allows.
+	size_t CChangeIndex::Probe(uint64_t volume, uint64_t fileId) const
+	{
+		size_t slot = (size_t)(HashIdentity(volume, fileId) & m_mask);
+		for (uint64_t i = 0; i <= m_mask; ++i, slot = (slot + 1) & m_mask)
+		{
+			const ChangeRecord& record = m_records[slot];
+			if (IsEmpty(record) || (record.fileId == fileId && record.volume == volume))
+				return slot;
+		}
+
+		return SIZE_MAX;
+	}
+
+	//
+	//   FUNCTION: LookupChanges(CChangeIndex&, const CScanBatch&, uint8_t*, ChangeRecord*)
+	//
+	//   PURPOSE: The scan sink's pass over a batch: the unchanged files keep
+	//            their stored hash and the rest go to the hasher.
+	//
+	void LookupChanges(CChangeIndex& index, const CScanBatch& batch, uint8_t* states, ChangeRecord* records)
+	{
+		ChangeRecord record;
+		for (size_t i = 0; i < batch.Count(); ++i)
+		{
+			const ScanEntry& entry = batch.m_entries[i];
+			ChangeState state = CHANGE_NEW;
+			if (entry.flags == 0)
+				state = index.Lookup(entry.volume, entry.fileId, entry.size, entry.lastWriteTime, record);
+
+			states[i] = (uint8_t)state;
+			if (state == CHANGE_UNCHANGED && records != NULL)
+				records[i] = record;
+		}
+	}
+}
@@ -0,0 +1,130 @@
+// ChangeIndex.h : Declaration of CChangeIndex, the on-disk record of the
+// content of files stashed before
+
+#pragma once
+
+#include "File.h"
+#include "Md5.h"
+
+namespace BigStash
+{
+	class CScanBatch;
+
+	// A file as the index remembers it. Records are stored as they are, 64
+	// bytes each, in a file mapped into memory.
+	struct ChangeRecord
+	{
+		// Identity: volume serial number and file ID (st_dev and st_ino).
+		uint64_t volume;
+		uint64_t fileId;
+
+		// What the content was hashed at.
+		uint64_t size;
+		int64_t lastWriteTime;    // FILETIME ticks, UTC
+
+		uint8_t md5[MD5_DIGEST_SIZE];
+
+		// The caller's reference to where the content went (an archive,
+		// a pack), 0 for none.
+		uint64_t upload;
+
+		// CRC-32 of the fields above, so a record torn by a crash reads as
+		// changed rather than with another file's hash.
+		uint32_t checksum;
+
+		// The run that last saw the file.
+		uint32_t generation;
+	};
+
+	enum ChangeState
+	{
+		CHANGE_NEW = BS_CHANGE_NEW,
+		CHANGE_MODIFIED = BS_CHANGE_MODIFIED,
+		CHANGE_UNCHANGED = BS_CHANGE_UNCHANGED
+	};
+
+	// CChangeIndex
+	//
+	// Remembers the content hash of every file stashed before, keyed by the
+	// file's identity, so a folder stashed again only has the files whose
+	// size or last write time moved read and hashed. The index is an open
+	// addressing table (linear probing, at most 70% full) in a file that is
+	// mapped whole: opening it reads nothing but the header, whatever its
+	// size, and a lookup touches one or two records. It grows, and drops the
+	// files not seen for a while, by rewriting itself into a temporary file
+	// renamed over the old one. Not synchronized; one writer at a time.
+	class CChangeIndex
+	{
+	public:
+		CChangeIndex();
+		~CChangeIndex();
+
+		// Opens the index at path, creating it sized for expectedFiles when
+		// it does not exist. BS_E_CORRUPT when the file is not an index of
+		// this version.
+		BsStatus Open(const PathChar* path, uint64_t expectedFiles = 0);
+
+		// Flushes the index and unmaps it.
+		void Close();
+
+		bool IsOpen() const { return m_header != NULL; }
+
+		// Starts a run: the files looked up or updated from now on count as
+		// seen in it. Returns the run's generation.
+		uint32_t BeginRun();
+
+		// Compares the file with its record. CHANGE_UNCHANGED when the size
+		// and last write time match, in which case record receives it. A file
+		// without an identity (fileId 0) is always new.
+		ChangeState Lookup(uint64_t volume, uint64_t fileId, uint64_t size, int64_t lastWriteTime,
+			ChangeRecord& record);
+
+		// Records the content of a file that was hashed (and uploaded).
+		// BS_E_INVALIDARG for a file without an identity.
+		BsStatus Update(uint64_t volume, uint64_t fileId, uint64_t size, int64_t lastWriteTime,
+			const uint8_t md5[MD5_DIGEST_SIZE], uint64_t upload);
+
+		// Drops the files no run among the last keepRuns (1 for the current
+		// one only) has seen, e.g. deleted files.
+		BsStatus Prune(uint32_t keepRuns, uint64_t& removed);
+
+		// Writes the changed records and the header to the disk.
+		BsStatus Flush();
+
+		uint64_t Count() const;
+		uint64_t Capacity() const { return m_mask + 1; }
+		uint32_t Generation() const;
+
+		// True when Open found the index was not closed and counted the
+		// records again.
+		bool Recovered() const { return m_recovered; }
+
+	private:
+		struct Header;
+
+		BsStatus Map(const PathChar* path, uint64_t capacity, bool create);
+		void Unmap();
+		BsStatus Rebuild(uint64_t capacity, uint32_t oldestGeneration, uint64_t& removed);
+		size_t Probe(uint64_t volume, uint64_t fileId) const;
+
+		PathString m_path;
+		CFile m_file;
+#ifdef _WIN32
+		HANDLE m_mapping;
+#endif
+		uint8_t* m_view;
+		size_t m_viewLength;
+		Header* m_header;
+		ChangeRecord* m_records;
+		uint64_t m_mask;
+		bool m_recovered;
+
+		CChangeIndex(const CChangeIndex&);
+		CChangeIndex& operator=(const CChangeIndex&);
+	};
+
+	// Looks up every file of a scan batch: states receives a ChangeState per
+	// entry and records (may be NULL) the record of each unchanged one.
+	// Entries the scan skipped are new.
+	void LookupChanges(CChangeIndex& index, const CScanBatch& batch, uint8_t* states, ChangeRecord* records);
+}
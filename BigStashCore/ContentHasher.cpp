@@ -0,0 +1,322 @@
+// ContentHasher.cpp : Implementation of CContentHasher
+
+#include "ContentHasher.h"
+#include "Encoding.h"
+#include "File.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+namespace BigStash
+{
+	namespace
+	{
+		const size_t READ_BUFFER_SIZE = 1024 * 1024;
+
+		// Small files are collected in groups of this size before they are
+		// handed to the multi-buffer kernel together.
+		const size_t SMALL_FILE_GROUP = 64;
+
+		// Pads the final partial block (tailLength < 64) of a message of
+		// totalLength bytes, compresses it into a copy of the state and writes
+		// the digest.
+		void FinishState(Md5State state, const uint8_t* tail, size_t tailLength, uint64_t totalLength,
+			uint8_t digest[MD5_DIGEST_SIZE])
+		{
+			uint8_t block[2 * MD5_BLOCK_SIZE];
+			size_t blocks = tailLength + 1 + 8 > MD5_BLOCK_SIZE ? 2 : 1;
+
+			memset(block, 0, sizeof(block));
+			if (tailLength > 0)
+				memcpy(block, tail, tailLength);
+			block[tailLength] = 0x80;
+
+			uint64_t bits = totalLength * 8;
+			for (int i = 0; i < 8; ++i)
+				block[blocks * MD5_BLOCK_SIZE - 8 + i] = (uint8_t)(bits >> (8 * i));
+
+			Md5Compress(state, block, blocks);
+			memcpy(digest, state.h, MD5_DIGEST_SIZE);
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// ContentDigest methods
+	//
+
+	std::string ContentDigest::Md5Hex() const
+	{
+		return HexEncode(md5, MD5_DIGEST_SIZE);
+	}
+
+	std::string ContentDigest::PartContentMd5(size_t index) const
+	{
+		return Base64Encode(parts[index].md5, MD5_DIGEST_SIZE);
+	}
+
+	std::string ContentDigest::ETag(bool multipart) const
+	{
+		if (!multipart)
+			return Md5Hex();
+
+		CMd5 md5;
+		for (const PartDigest& part : parts)
+			md5.Update(part.md5, MD5_DIGEST_SIZE);
+
+		uint8_t digest[MD5_DIGEST_SIZE];
+		md5.Final(digest);
+
+		return HexEncode(digest, MD5_DIGEST_SIZE) + "-" + std::to_string(parts.size());
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CContentHasher methods
+	//
+
+	CContentHasher::CContentHasher(uint64_t partSize)
+	{
+		// 0 means a single part of any size.
+		if (partSize == 0)
+			partSize = UINT64_MAX;
+
+		m_partSize = partSize - partSize % MD5_BLOCK_SIZE;
+		if (m_partSize == 0)
+			m_partSize = MD5_BLOCK_SIZE;
+
+		Reset();
+	}
+
+	void CContentHasher::Reset()
+	{
+		Md5Reset(m_whole);
+		Md5Reset(m_part);
+		m_length = 0;
+		m_partLength = 0;
+		m_buffered = 0;
+		m_parts.clear();
+	}
+
+	void CContentHasher::Update(const void* data, size_t length)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		m_length += length;
+
+		if (m_buffered > 0)
+		{
+			size_t take = std::min(MD5_BLOCK_SIZE - m_buffered, length);
+			memcpy(m_buffer + m_buffered, bytes, take);
+			m_buffered += take;
+			bytes += take;
+			length -= take;
+
+			if (m_buffered < MD5_BLOCK_SIZE)
+				return;
+
+			CompressBlocks(m_buffer, 1);
+			m_buffered = 0;
+		}
+
+		size_t blocks = length / MD5_BLOCK_SIZE;
+		CompressBlocks(bytes, blocks);
+		bytes += blocks * MD5_BLOCK_SIZE;
+		length -= blocks * MD5_BLOCK_SIZE;
+
+		if (length > 0)
+		{
+			memcpy(m_buffer, bytes, length);
+			m_buffered = length;
+		}
+	}
+
+	//
+	//   FUNCTION: CContentHasher::CompressBlocks(const uint8_t*, size_t)
+	//
+	//   PURPOSE: Runs whole blocks through both states, closing the current
+	//            part whenever a part boundary is reached.
+	//
+	void CContentHasher::CompressBlocks(const uint8_t* blocks, size_t count)
+	{
+		while (count > 0)
+		{
+			uint64_t untilBoundary = (m_partSize - m_partLength) / MD5_BLOCK_SIZE;
+			size_t n = (size_t)std::min<uint64_t>(count, untilBoundary);
+
+			Md5Compress2(m_whole, m_part, blocks, n);
+			m_partLength += (uint64_t)n * MD5_BLOCK_SIZE;
+			blocks += n * MD5_BLOCK_SIZE;
+			count -= n;
+
+			if (m_partLength == m_partSize)
+				FinishPart(NULL, 0);
+		}
+	}
+
+	void CContentHasher::FinishPart(const uint8_t* tail, size_t tailLength)
+	{
+		PartDigest part;
+		FinishState(m_part, tail, tailLength, m_partLength + tailLength, part.md5);
+		m_parts.push_back(part);
+
+		Md5Reset(m_part);
+		m_partLength = 0;
+	}
+
+	void CContentHasher::Finish(ContentDigest& digest)
+	{
+		// An empty file is still one (empty) part.
+		if (m_buffered > 0 || m_partLength > 0 || m_parts.empty())
+			FinishPart(m_buffer, m_buffered);
+
+		FinishState(m_whole, m_buffer, m_buffered, m_length, digest.md5);
+		digest.size = m_length;
+		digest.partSize = m_partSize;
+		digest.parts.swap(m_parts);
+
+		Reset();
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// File hashing
+	//
+
+	namespace
+	{
+		BsStatus HashOpenFile(const CFile& file, CContentHasher& hasher, std::vector<uint8_t>& buffer,
+			ContentDigest& digest)
+		{
+			hasher.Reset();
+
+			for (uint64_t offset = 0;;)
+			{
+				size_t bytesRead;
+				BsStatus status = file.ReadAt(offset, buffer.data(), buffer.size(), bytesRead);
+				if (status != BS_OK)
+					return status;
+
+				hasher.Update(buffer.data(), bytesRead);
+				offset += bytesRead;
+
+				if (bytesRead < buffer.size())
+					break;
+			}
+
+			hasher.Finish(digest);
+			return BS_OK;
+		}
+	}
+
+	BsStatus HashFile(const PathChar* path, uint64_t partSize, ContentDigest& digest)
+	{
+		CFile file;
+		BsStatus status = file.Open(path);
+		if (status != BS_OK)
+			return status;
+
+		CContentHasher hasher(partSize);
+		std::vector<uint8_t> buffer(READ_BUFFER_SIZE);
+		return HashOpenFile(file, hasher, buffer, digest);
+	}
+
+	//
+	//   FUNCTION: HashFiles(...)
+	//
+	//   PURPOSE: Workers take groups of files. Within a group the small files
+	//            (up to the limit and a single part) are read whole and hashed
+	//            together by Md5HashMany, the rest are streamed one by one.
+	//
+	void HashFiles(const std::vector<PathString>& paths, uint64_t partSize, unsigned threadCount,
+		std::vector<ContentDigest>& digests, std::vector<BsStatus>& statuses, uint64_t smallFileLimit)
+	{
+		size_t count = paths.size();
+		digests.assign(count, ContentDigest());
+		statuses.assign(count, BS_OK);
+
+		if (threadCount == 0)
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+		std::atomic<size_t> next(0);
+
+		auto worker = [&]()
+		{
+			CContentHasher hasher(partSize);
+			std::vector<uint8_t> readBuffer(READ_BUFFER_SIZE);
+			std::vector<std::vector<uint8_t> > contents(SMALL_FILE_GROUP);
+			std::vector<size_t> indices;
+			std::vector<const uint8_t*> messages;
+			std::vector<size_t> lengths;
+			uint8_t smallDigests[SMALL_FILE_GROUP][MD5_DIGEST_SIZE];
+
+			for (;;)
+			{
+				size_t first = next.fetch_add(SMALL_FILE_GROUP);
+				if (first >= count)
+					break;
+
+				size_t last = std::min(count, first + SMALL_FILE_GROUP);
+				indices.clear();
+
+				for (size_t i = first; i < last; ++i)
+				{
+					CFile file;
+					uint64_t size = 0;
+					BsStatus status = file.Open(paths[i].c_str());
+					if (status == BS_OK)
+						status = file.GetSize(size);
+
+					// Only a file that fits in one part has its digest as its only
+					// part digest.
+					if (status == BS_OK && (size > smallFileLimit || size > hasher.PartSize()))
+						status = HashOpenFile(file, hasher, readBuffer, digests[i]);
+					else if (status == BS_OK)
+					{
+						std::vector<uint8_t>& content = contents[indices.size()];
+						size_t bytesRead = 0;
+						content.resize((size_t)size);
+						status = file.ReadAt(0, content.data(), content.size(), bytesRead);
+						content.resize(bytesRead);
+
+						if (status == BS_OK)
+							indices.push_back(i);
+					}
+
+					statuses[i] = status;
+				}
+
+				if (indices.empty())
+					continue;
+
+				messages.clear();
+				lengths.clear();
+				for (size_t k = 0; k < indices.size(); ++k)
+				{
+					messages.push_back(contents[k].data());
+					lengths.push_back(contents[k].size());
+				}
+
+				Md5HashMany(messages.data(), lengths.data(), messages.size(), smallDigests);
+
+				// A small file is a single part, so its part digest is its digest.
+				for (size_t k = 0; k < indices.size(); ++k)
+				{
+					ContentDigest& digest = digests[indices[k]];
+					memcpy(digest.md5, smallDigests[k], MD5_DIGEST_SIZE);
+					digest.size = lengths[k];
+					digest.partSize = hasher.PartSize();
+					digest.parts.resize(1);
+					memcpy(digest.parts[0].md5, smallDigests[k], MD5_DIGEST_SIZE);
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (unsigned i = 1; i < threadCount; ++i)
+			threads.push_back(std::thread(worker));
+
+		worker();
+
+		for (std::thread& thread : threads)
+			thread.join();
+	}
+}
@@ -0,0 +1,84 @@
+// ContentHasher.h : Declaration of CContentHasher
+
+#pragma once
+
+#include "Md5.h"
+#include "Platform.h"
+
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	struct PartDigest
+	{
+		uint8_t md5[MD5_DIGEST_SIZE];
+	};
+
+	// Content digests of one file.
+	struct ContentDigest
+	{
+		uint64_t size;
+		uint64_t partSize;
+		uint8_t md5[MD5_DIGEST_SIZE];
+		std::vector<PartDigest> parts;
+
+		// Whole-file MD5 as lowercase hex (ArchiveFileInfo.MD5, FileManifest.MD5).
+		std::string Md5Hex() const;
+
+		// Base64 MD5 of a part, the Content-MD5 header value of its upload.
+		std::string PartContentMd5(size_t index) const;
+
+		// The ETag S3 reports for the object: the plain MD5 for a single PUT,
+		// hex(md5(md5_1 .. md5_n)) + "-n" for a multipart upload.
+		std::string ETag(bool multipart) const;
+	};
+
+	// CContentHasher
+	//
+	// Streaming content hasher. It is fed the file's bytes in order, in
+	// whatever chunks the upload reads them, and keeps the whole-file MD5 and
+	// the current part's MD5 together: both consume the same message blocks
+	// (parts are block aligned) through Md5Compress2.
+	class CContentHasher
+	{
+	public:
+		// partSize must be a multiple of 64 bytes.
+		explicit CContentHasher(uint64_t partSize);
+
+		void Reset();
+		void Update(const void* data, size_t length);
+		void Finish(ContentDigest& digest);
+
+		uint64_t PartSize() const { return m_partSize; }
+
+		// Parts completed so far, for callers that want each part's MD5 as
+		// soon as its last byte was fed.
+		size_t FinishedParts() const { return m_parts.size(); }
+		const PartDigest& FinishedPart(size_t index) const { return m_parts[index]; }
+
+	protected:
+		void CompressBlocks(const uint8_t* blocks, size_t count);
+		void FinishPart(const uint8_t* tail, size_t tailLength);
+
+		uint64_t m_partSize;
+		Md5State m_whole;
+		Md5State m_part;
+		uint64_t m_length;
+		uint64_t m_partLength;      // bytes of the current part compressed so far
+		uint8_t m_buffer[MD5_BLOCK_SIZE];
+		size_t m_buffered;
+		std::vector<PartDigest> m_parts;
+	};
+
+	// Reads and hashes a file in one pass.
+	BsStatus HashFile(const PathChar* path, uint64_t partSize, ContentDigest& digest);
+
+	// Hashes many files across threadCount workers (0 picks the processor
+	// count). Files up to smallFileLimit bytes that fit in one part are read
+	// whole and hashed through the multi-buffer kernel, the others are
+	// streamed through CContentHasher. statuses receives one status per file.
+	void HashFiles(const std::vector<PathString>& paths, uint64_t partSize, unsigned threadCount,
+		std::vector<ContentDigest>& digests, std::vector<BsStatus>& statuses,
+		uint64_t smallFileLimit = 256 * 1024);
+}
@@ -0,0 +1,99 @@
+// CpuFeatures.cpp : Implementation of the CPU feature detection.
+
+#include "CpuFeatures.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(BS_ARCH_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+#if defined(BS_ARCH_X86)
+		void CpuId(unsigned leaf, unsigned subleaf, unsigned regs[4])
+		{
+#if defined(_MSC_VER)
+			__cpuidex(reinterpret_cast<int*>(regs), (int)leaf, (int)subleaf);
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		unsigned long long ReadXcr0()
+		{
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			unsigned eax, edx;
+			__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return ((unsigned long long)edx << 32) | eax;
+#endif
+		}
+#endif
+
+		CpuFeatures Detect()
+		{
+			CpuFeatures features;
+			memset(&features, 0, sizeof(features));
+
+#if defined(BS_ARCH_X86)
+			unsigned regs[4];
+			CpuId(0, 0, regs);
+			unsigned maxLeaf = regs[0];
+
+			CpuId(1, 0, regs);
+			features.sse2 = (regs[3] & (1u << 26)) != 0;
+			features.ssse3 = (regs[2] & (1u << 9)) != 0;
+			features.sse41 = (regs[2] & (1u << 19)) != 0;
+			features.aesni = (regs[2] & (1u << 25)) != 0;
+			features.pclmul = (regs[2] & (1u << 1)) != 0;
+
+			// The AVX register state must be enabled by the OS as well.
+			bool osxsave = (regs[2] & (1u << 27)) != 0;
+			unsigned long long xcr0 = osxsave ? ReadXcr0() : 0;
+			bool avxState = (xcr0 & 0x6) == 0x6;
+			bool avx512State = (xcr0 & 0xE6) == 0xE6;
+
+			if (maxLeaf >= 7)
+			{
+				CpuId(7, 0, regs);
+				features.avx2 = avxState && (regs[1] & (1u << 5)) != 0;
+				features.sha = (regs[1] & (1u << 29)) != 0;
+				features.avx512 = avx512State && (regs[1] & (1u << 16)) != 0 && (regs[1] & (1u << 30)) != 0;
+				features.vaes = avxState && (regs[2] & (1u << 9)) != 0;
+				features.vpclmul = avxState && (regs[2] & (1u << 10)) != 0;
+			}
+#endif
+
+#if defined(BS_ARCH_ARM64)
+			features.neon = true;
+#endif
+
+			// BIGSTASH_DISABLE_SIMD=1 forces the portable kernels, which is how
+			// the benchmarks measure the fallbacks on capable machines.
+			const char* disable = getenv("BIGSTASH_DISABLE_SIMD");
+			if (disable != NULL && disable[0] == '1')
+			{
+				bool sse2 = features.sse2;
+				memset(&features, 0, sizeof(features));
+				features.sse2 = sse2;
+			}
+
+			return features;
+		}
+	}
+
+	const CpuFeatures& GetCpuFeatures()
+	{
+		static const CpuFeatures features = Detect();
+		return features;
+	}
+}
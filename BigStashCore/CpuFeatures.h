@@ -0,0 +1,43 @@
+// CpuFeatures.h : Runtime detection of the instruction set extensions the
+// hashing and crypto kernels can use.
+
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BS_ARCH_X86 1
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define BS_ARCH_ARM64 1
+#endif
+
+// GCC and Clang only emit instructions for extensions a function is
+// explicitly compiled for; MSVC emits whatever intrinsics are used.
+#if defined(BS_ARCH_X86) && (defined(__GNUC__) || defined(__clang__))
+#define BS_TARGET(extensions) __attribute__((target(extensions)))
+#else
+#define BS_TARGET(extensions)
+#endif
+
+namespace BigStash
+{
+	struct CpuFeatures
+	{
+		bool sse2;
+		bool ssse3;
+		bool sse41;
+		bool avx2;
+		bool sha;
+		bool aesni;
+		bool pclmul;
+		bool vaes;
+		bool vpclmul;
+		bool avx512;
+
+		// Always there on ARM64; false only when BIGSTASH_DISABLE_SIMD is set.
+		bool neon;
+	};
+
+	// Detected once, on first use.
+	const CpuFeatures& GetCpuFeatures();
+}
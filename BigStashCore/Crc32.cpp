@@ -0,0 +1,112 @@
+// Crc32.cpp : Implementation of the CRC-32 checksum.
+
+#include "Crc32.h"
+
+namespace BigStash
+{
+	namespace
+	{
+		// Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero
+		// bytes, so eight input bytes fold in with eight independent lookups
+		// instead of a chain of eight.
+		struct Crc32Tables
+		{
+			uint32_t table[8][256];
+
+			Crc32Tables()
+			{
+				for (uint32_t b = 0; b < 256; ++b)
+				{
+					uint32_t crc = b;
+					for (int bit = 0; bit < 8; ++bit)
+						crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+					table[0][b] = crc;
+				}
+
+				for (uint32_t b = 0; b < 256; ++b)
+				{
+					for (int k = 1; k < 8; ++k)
+						table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+				}
+			}
+		};
+
+		const Crc32Tables g_tables;
+
+		// Multiplies two polynomials modulo the CRC polynomial, both in the
+		// reflected bit order (x^0 in the top bit).
+		uint32_t MultiplyModP(uint32_t a, uint32_t b)
+		{
+			uint32_t product = 0;
+			for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1)
+			{
+				if (a & bit)
+				{
+					product ^= b;
+					if ((a & (bit - 1)) == 0)
+						break;
+				}
+				b = (b >> 1) ^ (0xEDB88320u & (0u - (b & 1)));
+			}
+			return product;
+		}
+
+		// powers[k] is x^(2^k) modulo the CRC polynomial.
+		struct Crc32Powers
+		{
+			uint32_t powers[32];
+
+			Crc32Powers()
+			{
+				uint32_t power = 1u << 30;
+				for (int k = 0; k < 32; ++k)
+				{
+					powers[k] = power;
+					power = MultiplyModP(power, power);
+				}
+			}
+		};
+
+		const Crc32Powers g_powers;
+
+		inline uint32_t LoadLittleEndian32(const uint8_t* data)
+		{
+			return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+		}
+	}
+
+	uint32_t Crc32(const void* data, size_t length, uint32_t crc)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		const uint32_t (*table)[256] = g_tables.table;
+		crc = ~crc;
+
+		while (length >= 8)
+		{
+			uint32_t low = LoadLittleEndian32(bytes) ^ crc;
+			uint32_t high = LoadLittleEndian32(bytes + 4);
+			crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+				table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+			bytes += 8;
+			length -= 8;
+		}
+
+		while (length-- != 0)
+			crc = (crc >> 8) ^ table[0][(crc ^ *bytes++) & 0xFF];
+
+		return ~crc;
+	}
+
+	uint32_t Crc32Combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB)
+	{
+		// appending lengthB bytes multiplies A's CRC by x^(8 lengthB).
+		uint32_t shift = 1u << 31;
+		int k = 3;
+		for (uint64_t n = lengthB; n != 0; n >>= 1, ++k)
+		{
+			if (n & 1)
+				shift = MultiplyModP(g_powers.powers[k & 31], shift);
+		}
+		return MultiplyModP(shift, crcA) ^ crcB;
+	}
+}
@@ -0,0 +1,19 @@
+// Crc32.h : Declaration of the CRC-32 checksum.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace BigStash
+{
+	// CRC-32 (IEEE 802.3, reflected 0xEDB88320), the checksum of zip, gzip
+	// and PNG. Pass the previous result as crc to continue a running
+	// checksum; 0 starts a new one.
+	uint32_t Crc32(const void* data, size_t length, uint32_t crc = 0);
+
+	// The CRC-32 of A followed by B from the CRCs of A and B and the length
+	// of B, in time logarithmic in the length. Lets blocks checksummed on
+	// different threads add up to the checksum of the whole.
+	uint32_t Crc32Combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB);
+}
@@ -0,0 +1,263 @@
+// DuplicateFinder.cpp : Implementation of FindDuplicates
+
+#include "DuplicateFinder.h"
+#include "File.h"
+#include "Sha256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+namespace BigStash
+{
+	namespace
+	{
+		const size_t READ_BUFFER_SIZE = 1024 * 1024;
+
+		struct Candidate
+		{
+			uint64_t size;
+			uint8_t digest[SHA256_DIGEST_SIZE];
+			uint32_t file;
+
+			// The digest covers the whole content.
+			bool whole;
+
+			// The file could not be read as the scan saw it.
+			bool failed;
+		};
+
+		bool SameContent(const Candidate& left, const Candidate& right)
+		{
+			return left.size == right.size && memcmp(left.digest, right.digest, SHA256_DIGEST_SIZE) == 0;
+		}
+
+		// Orders by size, then digest, then file, so the files with the same
+		// content end up next to each other, the first of them first.
+		bool CandidateLess(const Candidate& left, const Candidate& right)
+		{
+			if (left.size != right.size)
+				return left.size < right.size;
+			int order = memcmp(left.digest, right.digest, SHA256_DIGEST_SIZE);
+			if (order != 0)
+				return order < 0;
+			return left.file < right.file;
+		}
+
+		// Hashes length bytes from offset into the hash. False when the file
+		// is shorter than that.
+		bool HashRange(const CFile& file, uint64_t offset, uint64_t length, std::vector<uint8_t>& buffer,
+			CSha256& hash)
+		{
+			while (length > 0)
+			{
+				size_t chunk = (size_t)std::min<uint64_t>(length, buffer.size());
+				size_t bytesRead;
+				if (file.ReadAt(offset, buffer.data(), chunk, bytesRead) != BS_OK || bytesRead != chunk)
+					return false;
+
+				hash.Update(buffer.data(), chunk);
+				offset += chunk;
+				length -= chunk;
+			}
+			return true;
+		}
+
+		//
+		//   FUNCTION: HashCandidate(...)
+		//
+		//   PURPOSE: Hashes the head and the tail of the file (sampleSize
+		//            bytes each), or its whole content when that is all of it
+		//            or when whole is asked for. The size goes in first, so
+		//            a sample never equals the whole digest of another file.
+		//
+		void HashCandidate(const PathString& path, uint32_t sampleSize, bool whole, std::vector<uint8_t>& buffer,
+			Candidate& candidate, uint64_t& bytesRead)
+		{
+			CFile file;
+			uint64_t size = 0;
+			if (file.Open(path.c_str()) != BS_OK || file.GetSize(size) != BS_OK || size != candidate.size)
+			{
+				candidate.failed = true;
+				return;
+			}
+
+			CSha256 hash;
+			uint8_t header[9];
+			for (int i = 0; i < 8; ++i)
+				header[i] = (uint8_t)(size >> (i * 8));
+			candidate.whole = whole || size <= 2 * (uint64_t)sampleSize;
+			header[8] = candidate.whole ? 1 : 0;
+			hash.Update(header, sizeof(header));
+
+			bool read;
+			if (candidate.whole)
+			{
+				read = HashRange(file, 0, size, buffer, hash);
+				bytesRead += size;
+			}
+			else
+			{
+				read = HashRange(file, 0, sampleSize, buffer, hash) &&
+					HashRange(file, size - sampleSize, sampleSize, buffer, hash);
+				bytesRead += 2 * (uint64_t)sampleSize;
+			}
+
+			candidate.failed = !read;
+			hash.Final(candidate.digest);
+		}
+
+		// Runs HashCandidate over the candidates on threadCount workers.
+		uint64_t HashCandidates(const std::vector<PathString>& paths, std::vector<Candidate>& candidates,
+			uint32_t sampleSize, bool whole, unsigned threadCount)
+		{
+			std::atomic<size_t> next(0);
+			std::atomic<uint64_t> totalRead(0);
+
+			auto worker = [&]()
+			{
+				std::vector<uint8_t> buffer;
+				uint64_t bytesRead = 0;
+
+				for (;;)
+				{
+					size_t index = next.fetch_add(1);
+					if (index >= candidates.size())
+						break;
+
+					if (buffer.empty())
+						buffer.resize(READ_BUFFER_SIZE);
+					Candidate& candidate = candidates[index];
+					HashCandidate(paths[candidate.file], sampleSize, whole, buffer, candidate, bytesRead);
+				}
+
+				totalRead += bytesRead;
+			};
+
+			threadCount = (unsigned)std::min<size_t>(threadCount, candidates.size());
+
+			std::vector<std::thread> threads;
+			for (unsigned i = 1; i < threadCount; ++i)
+				threads.push_back(std::thread(worker));
+
+			worker();
+
+			for (std::thread& thread : threads)
+				thread.join();
+
+			return totalRead;
+		}
+	}
+
+	//
+	//   FUNCTION: FindDuplicates(...)
+	//
+	//   PURPOSE: Sorts the files by size and samples the ones whose size is
+	//            shared. Runs of equal samples are duplicates right away when
+	//            the sample was the whole file, and are hashed whole
+	//            otherwise, in a second pass, before they count as such.
+	//
+	void FindDuplicates(const std::vector<PathString>& paths, const std::vector<uint64_t>& sizes,
+		const DuplicateOptions& options, std::vector<uint32_t>& duplicateOf, DuplicateStats& stats)
+	{
+		size_t count = std::min(paths.size(), sizes.size());
+		duplicateOf.assign(count, NO_DUPLICATE);
+		stats = DuplicateStats();
+		stats.files = count;
+
+		unsigned threadCount = options.threadCount;
+		if (threadCount == 0)
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		uint32_t sampleSize = std::max<uint32_t>(options.sampleSize, 1);
+
+		std::vector<Candidate> candidates;
+		candidates.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			stats.bytes += sizes[i];
+			if (sizes[i] < options.minSize)
+				continue;
+
+			Candidate candidate;
+			candidate.size = sizes[i];
+			memset(candidate.digest, 0, sizeof(candidate.digest));
+			candidate.file = (uint32_t)i;
+			candidate.whole = false;
+			candidate.failed = false;
+			candidates.push_back(candidate);
+		}
+
+		// Only the sizes several files share are worth a look.
+		std::sort(candidates.begin(), candidates.end(), CandidateLess);
+		size_t kept = 0;
+		for (size_t first = 0; first < candidates.size();)
+		{
+			size_t last = first + 1;
+			while (last < candidates.size() && candidates[last].size == candidates[first].size)
+				++last;
+			if (last - first > 1)
+			{
+				for (size_t i = first; i < last; ++i)
+					candidates[kept++] = candidates[i];
+			}
+			first = last;
+		}
+		candidates.resize(kept);
+		stats.candidates = candidates.size();
+
+		stats.bytesRead += HashCandidates(paths, candidates, sampleSize, false, threadCount);
+		std::sort(candidates.begin(), candidates.end(), CandidateLess);
+
+		// Records the duplicates among a sorted run of whole digests, and
+		// moves the runs of matching samples to the front to be hashed whole.
+		// Runs only ever move down, so the front can be overwritten in place.
+		size_t sampled = 0;
+		std::vector<Candidate*> run;
+		auto collect = [&](bool wholeOnly)
+		{
+			sampled = 0;
+			for (size_t first = 0; first < candidates.size();)
+			{
+				size_t last = first + 1;
+				while (last < candidates.size() && SameContent(candidates[last], candidates[first]))
+					++last;
+
+				// Files that could not be read take no part.
+				run.clear();
+				for (size_t i = first; i < last; ++i)
+				{
+					if (!candidates[i].failed)
+						run.push_back(&candidates[i]);
+				}
+
+				if (run.size() > 1 && (wholeOnly || run[0]->whole))
+				{
+					for (size_t i = 1; i < run.size(); ++i)
+					{
+						duplicateOf[run[i]->file] = run[0]->file;
+						++stats.duplicates;
+						stats.bytesSaved += run[i]->size;
+					}
+				}
+				else if (run.size() > 1)
+				{
+					for (size_t i = 0; i < run.size(); ++i)
+						candidates[sampled++] = *run[i];
+				}
+
+				first = last;
+			}
+		};
+
+		collect(false);
+		candidates.resize(sampled);
+		stats.hashed = candidates.size();
+		if (candidates.empty())
+			return;
+
+		stats.bytesRead += HashCandidates(paths, candidates, sampleSize, true, threadCount);
+		std::sort(candidates.begin(), candidates.end(), CandidateLess);
+		collect(true);
+	}
+}
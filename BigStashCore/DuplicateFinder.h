@@ -0,0 +1,63 @@
+// DuplicateFinder.h : Declaration of FindDuplicates, the duplicate content
+// detection of an archive's files
+
+#pragma once
+
+#include "Platform.h"
+
+#include <vector>
+
+namespace BigStash
+{
+	// duplicateOf value of a file whose content is uploaded.
+	const uint32_t NO_DUPLICATE = BS_NO_DUPLICATE;
+
+	struct DuplicateOptions
+	{
+		DuplicateOptions() : threadCount(0), sampleSize(64 * 1024), minSize(1) {}
+
+		// 0 picks the processor count.
+		unsigned threadCount;
+
+		// Bytes hashed from the head and from the tail of a file before its
+		// whole content is. Files up to twice as big are read whole at once.
+		uint32_t sampleSize;
+
+		// Smaller files are left alone (by default the empty ones, which
+		// cost nothing to upload).
+		uint64_t minSize;
+	};
+
+	struct DuplicateStats
+	{
+		DuplicateStats() : files(0), candidates(0), hashed(0), duplicates(0), bytes(0), bytesRead(0), bytesSaved(0) {}
+
+		uint64_t files;
+
+		// Files that share their size with another and were sampled.
+		uint64_t candidates;
+
+		// Files whose samples matched another's and were read whole.
+		uint64_t hashed;
+
+		uint64_t duplicates;
+
+		// Sizes of all the files, of what was read and of the duplicates.
+		uint64_t bytes;
+		uint64_t bytesRead;
+		uint64_t bytesSaved;
+	};
+
+	// Finds the files of an archive with the same content, reading as little
+	// as it can: files are bucketed by size, the files of a size shared by
+	// several are told apart by a hash of their head and tail, and only the
+	// files whose samples match are hashed whole. Contents are compared by
+	// SHA-256, not by the MD5 the upload computes, so two files made to
+	// collide cannot pass for each other. duplicateOf receives, for
+	// each file, the index of the first file with the same content (the one
+	// to upload, the others are recorded as references to it) or
+	// NO_DUPLICATE. sizes are the sizes the scan saw; a file that cannot be
+	// read, or no longer has that size, is left to the upload to report.
+	void FindDuplicates(const std::vector<PathString>& paths, const std::vector<uint64_t>& sizes,
+		const DuplicateOptions& options, std::vector<uint32_t>& duplicateOf, DuplicateStats& stats);
+}
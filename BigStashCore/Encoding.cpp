@@ -0,0 +1,148 @@
+// Encoding.cpp : Implementation of the hex, Base64 and varint helpers.
+
+#include "Encoding.h"
+
+namespace BigStash
+{
+	std::string HexEncode(const uint8_t* data, size_t length)
+	{
+		static const char digits[] = "0123456789abcdef";
+
+		std::string result(length * 2, '\0');
+		for (size_t i = 0; i < length; ++i)
+		{
+			result[2 * i] = digits[data[i] >> 4];
+			result[2 * i + 1] = digits[data[i] & 0x0f];
+		}
+
+		return result;
+	}
+
+	std::string Base64Encode(const uint8_t* data, size_t length)
+	{
+		static const char alphabet[] =
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+		std::string result;
+		result.reserve((length + 2) / 3 * 4);
+
+		size_t i = 0;
+		for (; i + 3 <= length; i += 3)
+		{
+			uint32_t triple = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+			result += alphabet[(triple >> 18) & 0x3f];
+			result += alphabet[(triple >> 12) & 0x3f];
+			result += alphabet[(triple >> 6) & 0x3f];
+			result += alphabet[triple & 0x3f];
+		}
+
+		if (i < length)
+		{
+			uint32_t triple = (uint32_t)data[i] << 16;
+			if (i + 1 < length)
+				triple |= (uint32_t)data[i + 1] << 8;
+
+			result += alphabet[(triple >> 18) & 0x3f];
+			result += alphabet[(triple >> 12) & 0x3f];
+			result += (i + 1 < length) ? alphabet[(triple >> 6) & 0x3f] : '=';
+			result += '=';
+		}
+
+		return result;
+	}
+
+	bool Base64Decode(const std::string& text, std::string& data)
+	{
+		data.clear();
+		if (text.size() % 4 != 0)
+			return false;
+
+		uint32_t accumulator = 0;
+		int bits = 0;
+		size_t padding = 0;
+
+		for (size_t i = 0; i < text.size(); ++i)
+		{
+			char c = text[i];
+			int value;
+			if (c >= 'A' && c <= 'Z')
+				value = c - 'A';
+			else if (c >= 'a' && c <= 'z')
+				value = c - 'a' + 26;
+			else if (c >= '0' && c <= '9')
+				value = c - '0' + 52;
+			else if (c == '+')
+				value = 62;
+			else if (c == '/')
+				value = 63;
+			else if (c == '=' && i >= text.size() - 2)
+			{
+				padding++;
+				continue;
+			}
+			else
+				return false;
+
+			if (padding > 0)
+				return false;
+
+			accumulator = (accumulator << 6) | (uint32_t)value;
+			bits += 6;
+			if (bits >= 8)
+			{
+				bits -= 8;
+				data += (char)((accumulator >> bits) & 0xff);
+			}
+		}
+
+		return true;
+	}
+
+	std::string UriEncode(const std::string& value, bool keepSlash)
+	{
+		static const char digits[] = "0123456789ABCDEF";
+
+		std::string result;
+		result.reserve(value.size() + value.size() / 2);
+
+		for (unsigned char c : value)
+		{
+			bool unreserved = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+				c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && keepSlash);
+
+			if (unreserved)
+				result += (char)c;
+			else
+			{
+				result += '%';
+				result += digits[c >> 4];
+				result += digits[c & 0x0f];
+			}
+		}
+
+		return result;
+	}
+
+	void AppendVarint(std::vector<uint8_t>& data, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			data.push_back((uint8_t)(value | 0x80));
+			value >>= 7;
+		}
+		data.push_back((uint8_t)value);
+	}
+
+	bool ReadVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value)
+	{
+		value = 0;
+		for (unsigned shift = 0; shift < 64 && data != end; shift += 7)
+		{
+			uint8_t byte = *data++;
+			value |= (uint64_t)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+}
@@ -0,0 +1,33 @@
+// Encoding.h : Hex, Base64 and varint encoding helpers.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// Lowercase hex, the format Utilities.GetMD5Hash produces.
+	std::string HexEncode(const uint8_t* data, size_t length);
+
+	// Standard Base64 with padding, as used by the Content-MD5 header.
+	std::string Base64Encode(const uint8_t* data, size_t length);
+
+	// Decodes padded standard Base64; false on malformed input.
+	bool Base64Decode(const std::string& text, std::string& data);
+
+	// RFC 3986 percent-encoding of everything but the unreserved characters,
+	// as S3 object keys and query values need it. Slashes are kept when
+	// encoding a path.
+	std::string UriEncode(const std::string& value, bool keepSlash);
+
+	// LEB128: seven bits per byte, low groups first, the high bit set on
+	// every byte but the last.
+	void AppendVarint(std::vector<uint8_t>& data, uint64_t value);
+
+	// Reads a varint at data and advances it; false when it runs past end
+	// or over ten bytes.
+	bool ReadVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value);
+}
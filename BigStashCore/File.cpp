@@ -0,0 +1,309 @@
+// File.cpp : Implementation of CFile
+
+#include "File.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace BigStash
+{
+#ifdef _WIN32
+	CFile::CFile() : m_handle(INVALID_HANDLE_VALUE), m_direct(false)
+	{
+	}
+#else
+	CFile::CFile() : m_fd(-1), m_direct(false)
+	{
+	}
+#endif
+
+	CFile::~CFile()
+	{
+		Close();
+	}
+
+	BsStatus CFile::Open(const PathChar* path, unsigned flags)
+	{
+		Close();
+
+		m_direct = (flags & FILE_OPEN_DIRECT) != 0;
+
+#ifdef _WIN32
+		bool write = (flags & FILE_OPEN_WRITE) != 0;
+		DWORD attributes = FILE_ATTRIBUTE_NORMAL | (write ? 0 : FILE_FLAG_SEQUENTIAL_SCAN);
+		if (m_direct)
+			attributes |= FILE_FLAG_NO_BUFFERING;
+
+		DWORD access = write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+		DWORD disposition = !write ? OPEN_EXISTING : (flags & FILE_OPEN_TRUNCATE) ? CREATE_ALWAYS : OPEN_ALWAYS;
+		m_handle = CreateFileW(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, disposition, attributes, NULL);
+		if (m_handle == INVALID_HANDLE_VALUE)
+			return StatusFromWin32(GetLastError());
+#else
+		int openFlags = O_CLOEXEC;
+		if (flags & FILE_OPEN_WRITE)
+			openFlags |= O_RDWR | O_CREAT | ((flags & FILE_OPEN_TRUNCATE) ? O_TRUNC : 0);
+		else
+			openFlags |= O_RDONLY;
+#ifdef O_DIRECT
+		if (m_direct)
+		{
+			m_fd = open(path, openFlags | O_DIRECT, 0644);
+
+			// tmpfs and some network file systems refuse O_DIRECT.
+			if (m_fd >= 0 || errno != EINVAL)
+				return m_fd >= 0 ? BS_OK : StatusFromErrno(errno);
+		}
+#endif
+		m_direct = false;
+		m_fd = open(path, openFlags, 0644);
+		if (m_fd < 0)
+			return StatusFromErrno(errno);
+#endif
+
+		return BS_OK;
+	}
+
+	void CFile::Close()
+	{
+#ifdef _WIN32
+		if (m_handle != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_handle);
+			m_handle = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (m_fd >= 0)
+		{
+			close(m_fd);
+			m_fd = -1;
+		}
+#endif
+	}
+
+	bool CFile::IsOpen() const
+	{
+#ifdef _WIN32
+		return m_handle != INVALID_HANDLE_VALUE;
+#else
+		return m_fd >= 0;
+#endif
+	}
+
+	BsStatus CFile::GetSize(uint64_t& size) const
+	{
+#ifdef _WIN32
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(m_handle, &fileSize))
+			return StatusFromWin32(GetLastError());
+		size = (uint64_t)fileSize.QuadPart;
+#else
+		struct stat st;
+		if (fstat(m_fd, &st) != 0)
+			return StatusFromErrno(errno);
+		size = (uint64_t)st.st_size;
+#endif
+
+		return BS_OK;
+	}
+
+	BsStatus CFile::ReadAt(uint64_t offset, void* buffer, size_t length, size_t& bytesRead) const
+	{
+		char* destination = static_cast<char*>(buffer);
+		bytesRead = 0;
+
+		while (bytesRead < length)
+		{
+#ifdef _WIN32
+			OVERLAPPED overlapped = { 0 };
+			uint64_t position = offset + bytesRead;
+			overlapped.Offset = (DWORD)position;
+			overlapped.OffsetHigh = (DWORD)(position >> 32);
+
+			DWORD chunk = (DWORD)std::min<size_t>(length - bytesRead, 0x40000000);
+			DWORD read = 0;
+			if (!ReadFile(m_handle, destination + bytesRead, chunk, &read, &overlapped))
+			{
+				DWORD error = GetLastError();
+				if (error == ERROR_HANDLE_EOF)
+					break;
+				return StatusFromWin32(error);
+			}
+#else
+			ssize_t read = pread(m_fd, destination + bytesRead, length - bytesRead, (off_t)(offset + bytesRead));
+			if (read < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return StatusFromErrno(errno);
+			}
+#endif
+
+			if (read == 0)
+				break;
+
+			bytesRead += (size_t)read;
+
+			// an unbuffered read only comes up short at the end of the file,
+			// and the unaligned retry would fail.
+			if (m_direct && bytesRead < length && (bytesRead % FILE_DIRECT_ALIGNMENT) != 0)
+				break;
+		}
+
+		return BS_OK;
+	}
+
+	BsStatus CFile::WriteAt(uint64_t offset, const void* data, size_t length)
+	{
+		const char* source = static_cast<const char*>(data);
+		size_t written = 0;
+
+		while (written < length)
+		{
+#ifdef _WIN32
+			OVERLAPPED overlapped = { 0 };
+			uint64_t position = offset + written;
+			overlapped.Offset = (DWORD)position;
+			overlapped.OffsetHigh = (DWORD)(position >> 32);
+
+			DWORD chunk = (DWORD)std::min<size_t>(length - written, 0x40000000);
+			DWORD wrote = 0;
+			if (!WriteFile(m_handle, source + written, chunk, &wrote, &overlapped))
+				return StatusFromWin32(GetLastError());
+#else
+			ssize_t wrote = pwrite(m_fd, source + written, length - written, (off_t)(offset + written));
+			if (wrote < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return StatusFromErrno(errno);
+			}
+#endif
+
+			if (wrote == 0)
+				return BS_E_IO;
+			written += (size_t)wrote;
+		}
+
+		return BS_OK;
+	}
+
+	BsStatus CFile::Truncate(uint64_t size)
+	{
+#ifdef _WIN32
+		FILE_END_OF_FILE_INFO info;
+		info.EndOfFile.QuadPart = (LONGLONG)size;
+		if (!SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &info, sizeof(info)))
+			return StatusFromWin32(GetLastError());
+#else
+		if (ftruncate(m_fd, (off_t)size) != 0)
+			return StatusFromErrno(errno);
+#endif
+
+		return BS_OK;
+	}
+
+	BsStatus CFile::Sync()
+	{
+#ifdef _WIN32
+		if (!FlushFileBuffers(m_handle))
+			return StatusFromWin32(GetLastError());
+#elif defined(__APPLE__)
+		// fsync only reaches the drive's cache on macOS.
+		if (fcntl(m_fd, F_FULLFSYNC) != 0 && fsync(m_fd) != 0)
+			return StatusFromErrno(errno);
+#else
+		if (fdatasync(m_fd) != 0)
+			return StatusFromErrno(errno);
+#endif
+
+		return BS_OK;
+	}
+
+	void CFile::AdviseWillNeed(uint64_t offset, uint64_t length) const
+	{
+#if defined(POSIX_FADV_WILLNEED)
+		posix_fadvise(m_fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+#else
+		(void)offset;
+		(void)length;
+#endif
+	}
+
+	void CFile::AdviseDontNeed(uint64_t offset, uint64_t length) const
+	{
+#if defined(POSIX_FADV_DONTNEED)
+		posix_fadvise(m_fd, (off_t)offset, (off_t)length, POSIX_FADV_DONTNEED);
+#else
+		(void)offset;
+		(void)length;
+#endif
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// File system helpers
+	//
+
+	BsStatus RenameFile(const PathChar* from, const PathChar* to)
+	{
+#ifdef _WIN32
+		if (!MoveFileExW(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+			return StatusFromWin32(GetLastError());
+#else
+		if (rename(from, to) != 0)
+			return StatusFromErrno(errno);
+#endif
+
+		return BS_OK;
+	}
+
+	BsStatus RemoveFile(const PathChar* path)
+	{
+#ifdef _WIN32
+		if (!DeleteFileW(path) && GetLastError() != ERROR_FILE_NOT_FOUND)
+			return StatusFromWin32(GetLastError());
+#else
+		if (unlink(path) != 0 && errno != ENOENT)
+			return StatusFromErrno(errno);
+#endif
+
+		return BS_OK;
+	}
+
+	bool FileExists(const PathChar* path)
+	{
+#ifdef _WIN32
+		return GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES;
+#else
+		struct stat st;
+		return stat(path, &st) == 0;
+#endif
+	}
+
+	BsStatus SyncParentDirectory(const PathChar* path)
+	{
+#ifdef _WIN32
+		(void)path;
+		return BS_OK;
+#else
+		PathString directory(path);
+		size_t slash = directory.rfind(PATH_SEPARATOR);
+		directory = slash == PathString::npos ? PathString(".") : slash == 0 ? PathString("/") : directory.substr(0, slash);
+
+		int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return StatusFromErrno(errno);
+
+		BsStatus status = fsync(fd) == 0 ? BS_OK : StatusFromErrno(errno);
+		close(fd);
+		return status;
+#endif
+	}
+}
@@ -0,0 +1,93 @@
+// File.h : Declaration of CFile, a thin portable file handle.
+
+#pragma once
+
+#include "Platform.h"
+
+namespace BigStash
+{
+	enum FileOpenFlags
+	{
+		FILE_OPEN_DEFAULT = 0,
+
+		// Bypass the page cache (O_DIRECT / FILE_FLAG_NO_BUFFERING). Offsets,
+		// lengths and buffers must then be aligned to FILE_DIRECT_ALIGNMENT.
+		// File systems that refuse it silently get a buffered handle; check
+		// IsDirect().
+		FILE_OPEN_DIRECT = 0x1,
+
+		// Read and write, creating the file when it does not exist.
+		FILE_OPEN_WRITE = 0x2,
+
+		// With FILE_OPEN_WRITE, empties an existing file.
+		FILE_OPEN_TRUNCATE = 0x4
+	};
+
+	const size_t FILE_DIRECT_ALIGNMENT = 4096;
+
+	// CFile
+	//
+	// Positional reads (and writes) on a file handle (ReadFile with an
+	// OVERLAPPED offset on Windows, pread elsewhere), so one handle can serve
+	// several threads.
+	class CFile
+	{
+	public:
+		CFile();
+		~CFile();
+
+		BsStatus Open(const PathChar* path, unsigned flags = FILE_OPEN_DEFAULT);
+		void Close();
+
+		bool IsOpen() const;
+		bool IsDirect() const { return m_direct; }
+
+		BsStatus GetSize(uint64_t& size) const;
+
+		// Reads until length bytes were read or the end of the file was
+		// reached; bytesRead tells which.
+		BsStatus ReadAt(uint64_t offset, void* buffer, size_t length, size_t& bytesRead) const;
+
+		// Needs FILE_OPEN_WRITE. Writes all of data or fails.
+		BsStatus WriteAt(uint64_t offset, const void* data, size_t length);
+		BsStatus Truncate(uint64_t size);
+
+		// Flushes the file's data to the disk (fdatasync / FlushFileBuffers).
+		BsStatus Sync();
+
+		// Page cache hints. They are no-ops where the platform has no
+		// equivalent (Windows relies on FILE_FLAG_SEQUENTIAL_SCAN instead).
+		void AdviseWillNeed(uint64_t offset, uint64_t length) const;
+		void AdviseDontNeed(uint64_t offset, uint64_t length) const;
+
+#ifdef _WIN32
+		HANDLE Handle() const { return m_handle; }
+#else
+		int Handle() const { return m_fd; }
+#endif
+
+	private:
+		CFile(const CFile&);
+		CFile& operator=(const CFile&);
+
+#ifdef _WIN32
+		HANDLE m_handle;
+#else
+		int m_fd;
+#endif
+		bool m_direct;
+	};
+
+	// Replaces to with from in one step, as far as the file system allows:
+	// a reader sees either file whole.
+	BsStatus RenameFile(const PathChar* from, const PathChar* to);
+
+	// BS_OK when the file was already gone.
+	BsStatus RemoveFile(const PathChar* path);
+
+	bool FileExists(const PathChar* path);
+
+	// Makes the renames and creations in the directory of path durable; a
+	// no-op on Windows, where MoveFileEx with MOVEFILE_WRITE_THROUGH does it.
+	BsStatus SyncParentDirectory(const PathChar* path);
+}
@@ -0,0 +1,615 @@
+// FileNameValidator.cpp : Implementation of the file name classification
+
+#include "FileNameValidator.h"
+#include "CpuFeatures.h"
+#include "TreeScanner.h"
+#include "Utf.h"
+
+#if defined(BS_ARCH_X86)
+#include <immintrin.h>
+#elif defined(BS_ARCH_ARM64)
+#include <arm_neon.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		/////////////////////////////////////////////////////////////////////////////
+		// Character tables
+		//
+
+		// The characters Path.GetInvalidFileNameChars returns on Windows.
+		constexpr bool IsInvalidNameChar(unsigned c)
+		{
+			return c < 0x20 || c == '"' || c == '*' || c == '/' || c == ':' || c == '<' || c == '>' ||
+				c == '?' || c == '\\' || c == '|';
+		}
+
+		struct AsciiTable
+		{
+			bool invalid[128];
+		};
+
+		constexpr AsciiTable MakeAsciiTable()
+		{
+			AsciiTable table = {};
+			for (unsigned c = 0; c < 128; ++c)
+				table.invalid[c] = IsInvalidNameChar(c);
+			return table;
+		}
+
+		constexpr AsciiTable g_ascii = MakeAsciiTable();
+
+		// The pshufb (tbl on ARM64) form of the same set: a byte is invalid
+		// when high[byte >> 4] & low[byte & 15] is not zero. High nibbles
+		// with the same set of invalid low nibbles share a bit, so it works
+		// as long as there are no more than eight such sets.
+		struct NibbleTables
+		{
+			uint8_t high[16];
+			uint8_t low[16];
+			unsigned sets;
+		};
+
+		constexpr NibbleTables MakeNibbleTables()
+		{
+			NibbleTables tables = {};
+			uint16_t sets[8] = {};
+			for (unsigned high = 0; high < 8; ++high)
+			{
+				uint16_t set = 0;
+				for (unsigned low = 0; low < 16; ++low)
+				{
+					if (IsInvalidNameChar(high << 4 | low))
+						set |= (uint16_t)(1 << low);
+				}
+				if (set == 0)
+					continue;
+
+				unsigned bit = 0;
+				while (bit < tables.sets && sets[bit] != set)
+					++bit;
+				if (bit == tables.sets)
+				{
+					if (bit == 8)
+					{
+						tables.sets = 9;
+						return tables;
+					}
+					sets[tables.sets++] = set;
+				}
+
+				tables.high[high] = (uint8_t)(1 << bit);
+				for (unsigned low = 0; low < 16; ++low)
+				{
+					if (set & (1 << low))
+						tables.low[low] |= (uint8_t)(1 << bit);
+				}
+			}
+			return tables;
+		}
+
+		constexpr NibbleTables g_nibbles = MakeNibbleTables();
+		static_assert(g_nibbles.sets <= 8, "the invalid name characters do not fit the nibble tables");
+
+		constexpr bool NibbleTablesMatch()
+		{
+			for (unsigned c = 0; c < 256; ++c)
+			{
+				bool invalid = (g_nibbles.high[c >> 4] & g_nibbles.low[c & 15]) != 0;
+				if (invalid != (c < 128 && g_ascii.invalid[c]))
+					return false;
+			}
+			return true;
+		}
+
+		static_assert(NibbleTablesMatch(), "the nibble tables do not match the invalid name characters");
+
+		/////////////////////////////////////////////////////////////////////////////
+		// Ignored system files
+		//
+
+		struct SystemFile
+		{
+			const char* name;
+			size_t length;
+		};
+
+		// Lowercase, as Utilities.systemFilesToExlude lists them.
+		constexpr SystemFile g_systemFiles[] =
+		{
+			{ "desktop.ini", 11 },
+			{ "thumbs.db", 9 },
+			{ ".ds_store", 9 },
+			{ "icon\r", 5 },
+			{ ".dropbox", 8 },
+			{ ".dropbox.attr", 13 },
+		};
+
+		constexpr size_t SYSTEM_FILE_COUNT = sizeof(g_systemFiles) / sizeof(g_systemFiles[0]);
+		constexpr unsigned SYSTEM_FILE_SLOT_BITS = 3;
+
+		constexpr size_t MinSystemFileLength()
+		{
+			size_t length = g_systemFiles[0].length;
+			for (size_t i = 1; i < SYSTEM_FILE_COUNT; ++i)
+				length = g_systemFiles[i].length < length ? g_systemFiles[i].length : length;
+			return length;
+		}
+
+		constexpr size_t MaxSystemFileLength()
+		{
+			size_t length = g_systemFiles[0].length;
+			for (size_t i = 1; i < SYSTEM_FILE_COUNT; ++i)
+				length = g_systemFiles[i].length > length ? g_systemFiles[i].length : length;
+			return length;
+		}
+
+		// Hashes the length and the first and last (lowercased) characters.
+		constexpr unsigned SystemFileSlot(size_t length, uint32_t first, uint32_t last, uint32_t seed)
+		{
+			return (((uint32_t)length << 16 | first << 8 | last) * seed) >> (32 - SYSTEM_FILE_SLOT_BITS);
+		}
+
+		// The first multiplier that gives every name a slot of its own.
+		constexpr uint32_t FindSystemFileSeed()
+		{
+			for (uint32_t seed = 0x9E3779B1u; seed != 0x9E3779B1u + 2 * 65536; seed += 2)
+			{
+				unsigned used = 0;
+				bool clash = false;
+				for (size_t i = 0; i < SYSTEM_FILE_COUNT && !clash; ++i)
+				{
+					const SystemFile& file = g_systemFiles[i];
+					unsigned slot = SystemFileSlot(file.length, (uint8_t)file.name[0],
+						(uint8_t)file.name[file.length - 1], seed);
+					clash = (used & (1u << slot)) != 0;
+					used |= 1u << slot;
+				}
+				if (!clash)
+					return seed;
+			}
+			return 0;
+		}
+
+		constexpr uint32_t g_systemFileSeed = FindSystemFileSeed();
+		static_assert(g_systemFileSeed != 0, "no perfect hash for the ignored system file names");
+
+		// The index of the name in each slot, plus one; 0 for an empty slot.
+		struct SystemFileSlots
+		{
+			uint8_t index[1 << SYSTEM_FILE_SLOT_BITS];
+		};
+
+		constexpr SystemFileSlots MakeSystemFileSlots()
+		{
+			SystemFileSlots slots = {};
+			for (size_t i = 0; i < SYSTEM_FILE_COUNT; ++i)
+			{
+				const SystemFile& file = g_systemFiles[i];
+				slots.index[SystemFileSlot(file.length, (uint8_t)file.name[0], (uint8_t)file.name[file.length - 1],
+					g_systemFileSeed)] = (uint8_t)(i + 1);
+			}
+			return slots;
+		}
+
+		constexpr SystemFileSlots g_systemFileSlots = MakeSystemFileSlots();
+
+		// String.ToLower for the characters that can lower to one in the
+		// list: ASCII, and on UTF-16 also the Kelvin sign and the capital I
+		// with dot, which lower to 'k' and 'i'.
+		inline uint32_t Fold(char c)
+		{
+			uint32_t unit = (uint8_t)c;
+			return unit - 'A' < 26 ? unit + 32 : unit;
+		}
+
+		inline uint32_t Fold(uint16_t c)
+		{
+			if (c - (uint32_t)'A' < 26)
+				return c + 32u;
+			if (c == 0x212A)
+				return 'k';
+			if (c == 0x0130)
+				return 'i';
+			return c;
+		}
+
+		template <typename Char>
+		bool IsIgnoredSystemFileT(const Char* name, size_t length)
+		{
+			if (length < MinSystemFileLength() || length > MaxSystemFileLength())
+				return false;
+
+			unsigned slot = SystemFileSlot(length, Fold(name[0]), Fold(name[length - 1]), g_systemFileSeed);
+			unsigned index = g_systemFileSlots.index[slot];
+			if (index == 0 || g_systemFiles[index - 1].length != length)
+				return false;
+
+			const char* expected = g_systemFiles[index - 1].name;
+			for (size_t i = 0; i < length; ++i)
+			{
+				if (Fold(name[i]) != (uint8_t)expected[i])
+					return false;
+			}
+			return true;
+		}
+
+		/////////////////////////////////////////////////////////////////////////////
+		// Name scanning kernels
+		//
+
+		// A character Windows does not allow in names.
+		const unsigned SCAN_INVALID = 1;
+
+		// Something the scan leaves to a closer look: a non-ASCII byte in
+		// UTF-8, a surrogate, U+FFFE or U+FFFF in UTF-16.
+		const unsigned SCAN_CHECK = 2;
+
+		typedef unsigned (*ScanUtf8Function)(const uint8_t* name, size_t length);
+		typedef unsigned (*ScanUtf16Function)(const uint16_t* name, size_t length);
+
+		unsigned ScanUtf8Portable(const uint8_t* name, size_t length)
+		{
+			unsigned flags = 0;
+			for (size_t i = 0; i < length; ++i)
+			{
+				uint8_t c = name[i];
+				if (c >= 0x80)
+					flags = SCAN_CHECK;
+				else if (g_ascii.invalid[c])
+					return SCAN_INVALID;
+			}
+			return flags;
+		}
+
+		unsigned ScanUtf16Portable(const uint16_t* name, size_t length)
+		{
+			unsigned flags = 0;
+			for (size_t i = 0; i < length; ++i)
+			{
+				uint16_t c = name[i];
+				if (c < 0x80)
+				{
+					if (g_ascii.invalid[c])
+						return SCAN_INVALID;
+				}
+				else if ((c & 0xF800) == 0xD800 || c >= 0xFFFE)
+					flags = SCAN_CHECK;
+			}
+			return flags;
+		}
+
+		// The SIMD kernels read the aligned 16-byte blocks that hold the
+		// name and mask off what is around it. An aligned load never crosses
+		// a page, so this cannot fault, and no name is too short for them.
+
+#if defined(BS_ARCH_X86)
+
+		BS_TARGET("ssse3")
+		inline __m128i InvalidBytes(__m128i bytes)
+		{
+			const __m128i nibble = _mm_set1_epi8(0x0F);
+			__m128i high = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(g_nibbles.high)),
+				_mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+			__m128i low = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(g_nibbles.low)),
+				_mm_and_si128(bytes, nibble));
+			return _mm_cmpeq_epi8(_mm_and_si128(high, low), _mm_setzero_si128());
+		}
+
+		BS_TARGET("ssse3")
+		unsigned ScanUtf8Ssse3(const uint8_t* name, size_t length)
+		{
+			uintptr_t start = reinterpret_cast<uintptr_t>(name);
+			uintptr_t end = start + length;
+			unsigned flags = 0;
+			for (uintptr_t block = start & ~(uintptr_t)15; block < end; block += 16)
+			{
+				__m128i bytes = _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+				unsigned keep = 0xFFFF;
+				if (block < start)
+					keep &= 0xFFFF << (start - block);
+				if (end - block < 16)
+					keep &= 0xFFFF >> (16 - (end - block));
+
+				unsigned invalid = ~(unsigned)_mm_movemask_epi8(InvalidBytes(bytes));
+				if ((invalid & keep) != 0)
+					return SCAN_INVALID;
+				if (((unsigned)_mm_movemask_epi8(bytes) & keep) != 0)
+					flags = SCAN_CHECK;
+			}
+			return flags;
+		}
+
+		BS_TARGET("ssse3")
+		unsigned ScanUtf16Ssse3(const uint16_t* name, size_t length)
+		{
+			uintptr_t start = reinterpret_cast<uintptr_t>(name);
+			if ((start & 1) != 0)
+				return ScanUtf16Portable(name, length);
+
+			uintptr_t end = start + length * sizeof(uint16_t);
+			unsigned flags = 0;
+			for (uintptr_t block = start & ~(uintptr_t)15; block < end; block += 16)
+			{
+				__m128i units = _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+				unsigned keep = 0xFF;
+				if (block < start)
+					keep &= 0xFF << ((start - block) / 2);
+				if (end - block < 16)
+					keep &= 0xFF >> ((16 - (end - block)) / 2);
+
+				// Units above U+00FF become a byte with the top bit set,
+				// which is never invalid.
+				__m128i latin = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short)0xFF00)),
+					_mm_setzero_si128());
+				__m128i bytes = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x00FF)),
+					_mm_andnot_si128(latin, _mm_set1_epi16(0x0080)));
+				bytes = _mm_packus_epi16(bytes, bytes);
+
+				unsigned invalid = ~(unsigned)_mm_movemask_epi8(InvalidBytes(bytes));
+				if ((invalid & keep) != 0)
+					return SCAN_INVALID;
+
+				__m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short)0xF800)),
+					_mm_set1_epi16((short)0xD800));
+				__m128i nonCharacter = _mm_cmpeq_epi16(_mm_or_si128(units, _mm_set1_epi16(1)),
+					_mm_set1_epi16((short)0xFFFF));
+				__m128i check = _mm_or_si128(surrogate, nonCharacter);
+				if (((unsigned)_mm_movemask_epi8(_mm_packs_epi16(check, check)) & keep) != 0)
+					flags = SCAN_CHECK;
+			}
+			return flags;
+		}
+
+#elif defined(BS_ARCH_ARM64)
+
+		const uint8_t g_lanes[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+		unsigned ScanUtf8Neon(const uint8_t* name, size_t length)
+		{
+			const uint8x16_t high = vld1q_u8(g_nibbles.high);
+			const uint8x16_t low = vld1q_u8(g_nibbles.low);
+			const uint8x16_t lanes = vld1q_u8(g_lanes);
+			uintptr_t start = reinterpret_cast<uintptr_t>(name);
+			uintptr_t end = start + length;
+			unsigned flags = 0;
+			for (uintptr_t block = start & ~(uintptr_t)15; block < end; block += 16)
+			{
+				uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t*>(block));
+				uint8_t first = (uint8_t)(block < start ? start - block : 0);
+				uint8_t last = (uint8_t)(end - block < 16 ? end - block : 16);
+				uint8x16_t keep = vandq_u8(vcgeq_u8(lanes, vdupq_n_u8(first)), vcltq_u8(lanes, vdupq_n_u8(last)));
+
+				uint8x16_t invalid = vandq_u8(vqtbl1q_u8(high, vshrq_n_u8(bytes, 4)),
+					vqtbl1q_u8(low, vandq_u8(bytes, vdupq_n_u8(0x0F))));
+				if (vmaxvq_u8(vandq_u8(invalid, keep)) != 0)
+					return SCAN_INVALID;
+				if (vmaxvq_u8(vandq_u8(bytes, keep)) >= 0x80)
+					flags = SCAN_CHECK;
+			}
+			return flags;
+		}
+
+		unsigned ScanUtf16Neon(const uint16_t* name, size_t length)
+		{
+			uintptr_t start = reinterpret_cast<uintptr_t>(name);
+			if ((start & 1) != 0)
+				return ScanUtf16Portable(name, length);
+
+			const uint8x16_t high = vld1q_u8(g_nibbles.high);
+			const uint8x16_t low = vld1q_u8(g_nibbles.low);
+			const uint16x8_t lanes = vmovl_u8(vld1_u8(g_lanes));
+			uintptr_t end = start + length * sizeof(uint16_t);
+			unsigned flags = 0;
+			for (uintptr_t block = start & ~(uintptr_t)15; block < end; block += 16)
+			{
+				uint16x8_t units = vld1q_u16(reinterpret_cast<const uint16_t*>(block));
+				uint16_t first = (uint16_t)(block < start ? (start - block) / 2 : 0);
+				uint16_t last = (uint16_t)(end - block < 16 ? (end - block) / 2 : 8);
+				uint16x8_t keep = vandq_u16(vcgeq_u16(lanes, vdupq_n_u16(first)), vcltq_u16(lanes, vdupq_n_u16(last)));
+
+				// Units above U+00FF become a byte with the top bit set,
+				// which is never invalid.
+				uint16x8_t latin = vceqq_u16(vandq_u16(units, vdupq_n_u16(0xFF00)), vdupq_n_u16(0));
+				uint8x8_t bytes = vmovn_u16(vorrq_u16(vandq_u16(units, vdupq_n_u16(0x00FF)),
+					vandq_u16(vmvnq_u16(latin), vdupq_n_u16(0x0080))));
+				uint8x8_t invalid = vand_u8(vqtbl1_u8(high, vshr_n_u8(bytes, 4)),
+					vqtbl1_u8(low, vand_u8(bytes, vdup_n_u8(0x0F))));
+				if (vmaxv_u8(vand_u8(invalid, vmovn_u16(keep))) != 0)
+					return SCAN_INVALID;
+
+				uint16x8_t surrogate = vceqq_u16(vandq_u16(units, vdupq_n_u16(0xF800)), vdupq_n_u16(0xD800));
+				uint16x8_t nonCharacter = vceqq_u16(vorrq_u16(units, vdupq_n_u16(1)), vdupq_n_u16(0xFFFF));
+				if (vmaxvq_u16(vandq_u16(vorrq_u16(surrogate, nonCharacter), keep)) != 0)
+					flags = SCAN_CHECK;
+			}
+			return flags;
+		}
+
+#endif
+
+		struct Kernels
+		{
+			ScanUtf8Function scanUtf8;
+			ScanUtf16Function scanUtf16;
+			const char* name;
+		};
+
+		Kernels SelectKernels()
+		{
+			Kernels kernels = { ScanUtf8Portable, ScanUtf16Portable, "portable" };
+
+#if defined(BS_ARCH_X86)
+			if (GetCpuFeatures().ssse3)
+			{
+				kernels.scanUtf8 = ScanUtf8Ssse3;
+				kernels.scanUtf16 = ScanUtf16Ssse3;
+				kernels.name = "ssse3";
+			}
+#elif defined(BS_ARCH_ARM64)
+			if (GetCpuFeatures().neon)
+			{
+				kernels.scanUtf8 = ScanUtf8Neon;
+				kernels.scanUtf16 = ScanUtf16Neon;
+				kernels.name = "neon";
+			}
+#endif
+			return kernels;
+		}
+
+		const Kernels& GetKernels()
+		{
+			static const Kernels kernels = SelectKernels();
+			return kernels;
+		}
+
+		/////////////////////////////////////////////////////////////////////////////
+		// Classification
+		//
+
+		// Only characters the scan could not settle get here: UTF-8 must be
+		// well-formed and, like UTF-16, hold no surrogates (pairs aside) and
+		// no U+FFFE or U+FFFF, which are not XML characters.
+		bool HasXmlCharacters(const char* name, size_t length)
+		{
+			if (Utf8ToUtf16Length(name, length) == UTF_INVALID)
+				return false;
+
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(name);
+			for (size_t i = 0; i + 2 < length; ++i)
+			{
+				if (bytes[i] == 0xEF && bytes[i + 1] == 0xBF && (bytes[i + 2] & 0xFE) == 0xBE)
+					return false;
+			}
+			return true;
+		}
+
+		bool HasXmlCharacters(const uint16_t* name, size_t length)
+		{
+			for (size_t i = 0; i < length; ++i)
+			{
+				uint16_t c = name[i];
+				if (c >= 0xFFFE)
+					return false;
+				if ((c & 0xF800) != 0xD800)
+					continue;
+				if (c >= 0xDC00 || i + 1 == length || (name[i + 1] & 0xFC00) != 0xDC00)
+					return false;
+				++i;
+			}
+			return true;
+		}
+
+		inline bool HasValidCharacters(const char* name, size_t length)
+		{
+			unsigned flags = GetKernels().scanUtf8(reinterpret_cast<const uint8_t*>(name), length);
+			return flags == 0 || (flags == SCAN_CHECK && HasXmlCharacters(name, length));
+		}
+
+		inline bool HasValidCharacters(const uint16_t* name, size_t length)
+		{
+			unsigned flags = GetKernels().scanUtf16(name, length);
+			return flags == 0 || (flags == SCAN_CHECK && HasXmlCharacters(name, length));
+		}
+
+		// path.Count() in the managed code: UTF-16 units.
+		inline size_t ApiLength(const char* path, size_t length)
+		{
+			if (length <= MAX_API_PATH_LENGTH)
+				return length;
+
+			size_t units = Utf8ToUtf16Length(path, length);
+			return units == UTF_INVALID ? length : units;
+		}
+
+		inline size_t ApiLength(const uint16_t*, size_t length)
+		{
+			return length;
+		}
+
+		template <typename Char>
+		inline bool EndsWithTmp(const Char* name, size_t length)
+		{
+			return length >= 4 && name[length - 4] == '.' && Fold(name[length - 3]) == 't' &&
+				Fold(name[length - 2]) == 'm' && Fold(name[length - 1]) == 'p';
+		}
+
+		template <typename Char>
+		FileCategory ClassifyFileT(const Char* path, size_t pathLength, size_t nameOffset, uint32_t attributes)
+		{
+			if (ApiLength(path, pathLength) > MAX_API_PATH_LENGTH)
+				return FILE_CATEGORY_FILE_NAME_TOO_LONG;
+
+			const Char* name = path + nameOffset;
+			size_t length = pathLength - nameOffset;
+
+			if (IsIgnoredSystemFileT(name, length))
+				return FILE_CATEGORY_IGNORED_SYSTEM_FILE;
+
+			if (length != 0 && (name[length - 1] == ' ' || name[length - 1] == '.'))
+				return FILE_CATEGORY_TRAILING_PERIODS_OR_WHITESPACE;
+
+			// Names used for temporary files. Such a file might not be an
+			// actual temporary file, but it is excluded nonetheless.
+			if (length >= 2 && ((name[0] == '~' && name[1] == '$') || (name[0] == '.' && name[1] == '~')))
+				return FILE_CATEGORY_TEMPORARY_FILE;
+			if (length >= 5 && name[0] == '~' && EndsWithTmp(name, length))
+				return FILE_CATEGORY_TEMPORARY_FILE;
+
+			// An empty name matched no XML character in the managed check.
+			if (length == 0 || !HasValidCharacters(name, length))
+				return FILE_CATEGORY_INVALID_CHARACTER_IN_NAME;
+
+			if ((attributes & BS_FILE_ATTRIBUTE_TEMPORARY) != 0)
+				return FILE_CATEGORY_TEMPORARY_FILE;
+			if ((attributes & BS_FILE_ATTRIBUTE_OFFLINE) != 0)
+				return FILE_CATEGORY_UNSYNCED_ONLINE_FILE;
+
+			// Junction points and shortcuts.
+			if ((attributes & BS_FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+				return FILE_CATEGORY_METADATA_FILE;
+
+			return FILE_CATEGORY_NORMAL;
+		}
+	}
+
+	FileCategory ClassifyFile(const char* path, size_t pathLength, size_t nameOffset, uint32_t attributes)
+	{
+		return ClassifyFileT(path, pathLength, nameOffset, attributes);
+	}
+
+	FileCategory ClassifyFile(const uint16_t* path, size_t pathLength, size_t nameOffset, uint32_t attributes)
+	{
+		return ClassifyFileT(path, pathLength, nameOffset, attributes);
+	}
+
+	void ClassifyFiles(const CScanBatch& batch, uint8_t* categories)
+	{
+		for (size_t i = 0; i < batch.Count(); ++i)
+		{
+			const ScanEntry& entry = batch.m_entries[i];
+			if ((entry.flags & BS_SCAN_SKIPPED_RESTRICTED) != 0)
+				categories[i] = FILE_CATEGORY_RESTRICTED_DIRECTORY;
+			else
+				categories[i] = (uint8_t)ClassifyFile(batch.Path(entry), entry.pathLength, entry.nameOffset,
+					entry.attributes);
+		}
+	}
+
+	bool IsIgnoredSystemFile(const char* name, size_t length)
+	{
+		return IsIgnoredSystemFileT(name, length);
+	}
+
+	bool IsIgnoredSystemFile(const uint16_t* name, size_t length)
+	{
+		return IsIgnoredSystemFileT(name, length);
+	}
+
+	const char* FileNameScanKernel()
+	{
+		return GetKernels().name;
+	}
+}
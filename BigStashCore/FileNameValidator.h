@@ -0,0 +1,57 @@
+// FileNameValidator.h : Batch classification of scanned files by the
+// BigStash API's file name restrictions
+
+#pragma once
+
+#include "Platform.h"
+
+namespace BigStash
+{
+	class CScanBatch;
+
+	// The BigStash.Model.Enumerations.FileCategory values.
+	enum FileCategory
+	{
+		FILE_CATEGORY_NORMAL = BS_FILE_CATEGORY_NORMAL,
+		FILE_CATEGORY_INVALID_CHARACTER_IN_NAME = BS_FILE_CATEGORY_INVALID_CHARACTER_IN_NAME,
+		FILE_CATEGORY_METADATA_FILE = BS_FILE_CATEGORY_METADATA_FILE,
+		FILE_CATEGORY_TEMPORARY_FILE = BS_FILE_CATEGORY_TEMPORARY_FILE,
+		FILE_CATEGORY_TRAILING_PERIODS_OR_WHITESPACE = BS_FILE_CATEGORY_TRAILING_PERIODS_OR_WHITESPACE,
+		FILE_CATEGORY_IGNORED_SYSTEM_FILE = BS_FILE_CATEGORY_IGNORED_SYSTEM_FILE,
+		FILE_CATEGORY_FILE_NAME_TOO_LONG = BS_FILE_CATEGORY_FILE_NAME_TOO_LONG,
+		FILE_CATEGORY_UNSYNCED_ONLINE_FILE = BS_FILE_CATEGORY_UNSYNCED_ONLINE_FILE,
+		FILE_CATEGORY_RESTRICTED_DIRECTORY = BS_FILE_CATEGORY_RESTRICTED_DIRECTORY
+	};
+
+	// Longest path, in UTF-16 units, the API accepts.
+	const size_t MAX_API_PATH_LENGTH = 260;
+
+	// Classifies a file as Utilities.CheckFileApiRestrictions does, in the
+	// same order: path length, ignored system files (compared lowercased),
+	// trailing period or space, temporary file name patterns, characters
+	// Windows does not allow in names or that are not XML characters, and
+	// then the temporary, offline and reparse point attributes. The name
+	// starts at nameOffset; attributes are BS_FILE_ATTRIBUTE_* as the scan
+	// found them, so nothing is looked up on disk.
+	FileCategory ClassifyFile(const char* path, size_t pathLength, size_t nameOffset, uint32_t attributes);
+	FileCategory ClassifyFile(const uint16_t* path, size_t pathLength, size_t nameOffset, uint32_t attributes);
+#ifdef _WIN32
+	inline FileCategory ClassifyFile(const wchar_t* path, size_t pathLength, size_t nameOffset, uint32_t attributes)
+	{
+		return ClassifyFile(reinterpret_cast<const uint16_t*>(path), pathLength, nameOffset, attributes);
+	}
+#endif
+
+	// Classifies every entry of a scan batch into categories (one per
+	// entry). Directories the scan skipped as restricted are
+	// FILE_CATEGORY_RESTRICTED_DIRECTORY.
+	void ClassifyFiles(const CScanBatch& batch, uint8_t* categories);
+
+	// True for the names of the files Windows, macOS and Dropbox leave in
+	// folders (desktop.ini, Thumbs.db, .DS_Store, ...), in any case.
+	bool IsIgnoredSystemFile(const char* name, size_t length);
+	bool IsIgnoredSystemFile(const uint16_t* name, size_t length);
+
+	// "ssse3", "neon" or "portable".
+	const char* FileNameScanKernel();
+}
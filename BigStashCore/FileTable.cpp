@@ -0,0 +1,463 @@
+// FileTable.cpp : Implementation of CNameIndex and CFileTable
+
+#include "FileTable.h"
+#include "TreeScanner.h"
+#include "Utf.h"
+
+#include <cstring>
+#include <type_traits>
+
+namespace BigStash
+{
+	/////////////////////////////////////////////////////////////////////////////
+	// Some helper methods
+	//
+
+	namespace
+	{
+		const size_t MIN_INDEX_CAPACITY = 16;
+		const size_t MAX_NAME_LENGTH = 0xFFFF;
+
+		inline bool IsSeparator(PathChar c)
+		{
+#ifdef _WIN32
+			return c == L'\\' || c == L'/';
+#else
+			return c == '/';
+#endif
+		}
+
+		// FNV-1a over the name, folded when the table ignores case, seeded
+		// with the parent, and mixed so the low bits the index uses depend on
+		// every unit.
+		uint32_t HashName(uint32_t parent, const PathChar* name, size_t length, bool fold)
+		{
+			uint32_t hash = (2166136261u ^ parent) * 16777619u;
+			if (fold)
+			{
+				for (size_t i = 0; i < length; )
+					hash = (hash ^ NextPathChar(name, i, length, true)) * 16777619u;
+			}
+			else
+			{
+				for (size_t i = 0; i < length; ++i)
+					hash = (hash ^ (uint32_t)(std::make_unsigned<PathChar>::type)name[i]) * 16777619u;
+			}
+
+			hash ^= hash >> 16;
+			hash *= 0x85EBCA6Bu;
+			hash ^= hash >> 13;
+			return hash;
+		}
+
+		// Where the name starts: after the last separator.
+		size_t NameOffset(const PathChar* path, size_t length)
+		{
+			for (size_t i = length; i > 0; --i)
+			{
+				if (IsSeparator(path[i - 1]))
+					return i;
+			}
+
+			return 0;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CNameIndex methods
+	//
+
+	CNameIndex::CNameIndex()
+		: m_count(0)
+	{
+		Resize(MIN_INDEX_CAPACITY);
+	}
+
+	void CNameIndex::Reserve(size_t count)
+	{
+		size_t capacity = m_slots.size();
+		while (count * 4 > capacity * 3)
+			capacity *= 2;
+
+		if (capacity != m_slots.size())
+			Resize(capacity);
+	}
+
+	void CNameIndex::Clear()
+	{
+		std::vector<Slot>().swap(m_slots);
+		m_count = 0;
+		Resize(MIN_INDEX_CAPACITY);
+	}
+
+	//
+	//   FUNCTION: CNameIndex::Probe(uint32_t, Equals)
+	//
+	//   PURPOSE: Linear probing from the hash's home slot. The index is never
+	//            more than three quarters full, so there is always an empty
+	//            slot to stop at.
+	//
+	template <class Equals>
+	size_t CNameIndex::Probe(uint32_t hash, Equals equals) const
+	{
+		size_t mask = m_slots.size() - 1;
+		for (size_t slot = hash & mask; ; slot = (slot + 1) & mask)
+		{
+			const Slot& candidate = m_slots[slot];
+			if (candidate.row == FILE_TABLE_NONE)
+				return slot;
+			if (candidate.hash == hash && equals(candidate.row))
+				return slot;
+		}
+	}
+
+	void CNameIndex::Insert(size_t slot, uint32_t hash, uint32_t row)
+	{
+		m_slots[slot].hash = hash;
+		m_slots[slot].row = row;
+
+		if (++m_count * 4 > m_slots.size() * 3)
+			Resize(m_slots.size() * 2);
+	}
+
+	void CNameIndex::Resize(size_t capacity)
+	{
+		std::vector<Slot> slots(capacity);
+		for (size_t i = 0; i < capacity; ++i)
+			slots[i].row = FILE_TABLE_NONE;
+
+		size_t mask = capacity - 1;
+		for (size_t i = 0; i < m_slots.size(); ++i)
+		{
+			if (m_slots[i].row == FILE_TABLE_NONE)
+				continue;
+
+			size_t slot = m_slots[i].hash & mask;
+			while (slots[slot].row != FILE_TABLE_NONE)
+				slot = (slot + 1) & mask;
+			slots[slot] = m_slots[i];
+		}
+
+		m_slots.swap(slots);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CFileTable methods
+	//
+
+	CFileTable::CFileTable(bool ignoreCase)
+		: m_ignoreCase(ignoreCase), m_totalSize(0), m_lastDirectory(FILE_TABLE_NONE)
+	{
+	}
+
+	void CFileTable::Reserve(size_t files, size_t nameUnits)
+	{
+		m_names.reserve(m_names.size() + nameUnits);
+
+		size_t count = m_sizes.size() + files;
+		m_fileDirectories.reserve(count);
+		m_nameOffsets.reserve(count);
+		m_nameLengths.reserve(count);
+		m_keyDepths.reserve(count);
+		m_sizes.reserve(count);
+		m_lastWriteTimes.reserve(count);
+		m_progress.reserve(count);
+		m_flags.reserve(count);
+		m_fileIndex.Reserve(count);
+	}
+
+	void CFileTable::Clear()
+	{
+		m_names.clear();
+		m_directories.clear();
+		m_directoryIndex.Clear();
+
+		m_fileDirectories.clear();
+		m_nameOffsets.clear();
+		m_nameLengths.clear();
+		m_keyDepths.clear();
+		m_sizes.clear();
+		m_lastWriteTimes.clear();
+		m_progress.clear();
+		m_flags.clear();
+		m_fileIndex.Clear();
+
+		m_totalSize = 0;
+		m_lastDirectoryPath.clear();
+		m_lastDirectory = FILE_TABLE_NONE;
+	}
+
+	//
+	//   FUNCTION: CFileTable::Add(const PathChar*, size_t, size_t, uint64_t, int64_t, uint32_t&, bool&)
+	//
+	//   PURPOSE: Interns the file's directory, then looks the name up under
+	//            it and appends a row only when it is not there yet. The key
+	//            name is kept as the number of directories it spans.
+	//
+	BsStatus CFileTable::Add(const PathChar* path, size_t length, size_t keyOffset, uint64_t size,
+		int64_t lastWriteTime, uint32_t& file, bool& added)
+	{
+		file = FILE_TABLE_NONE;
+		added = false;
+
+		size_t nameOffset = NameOffset(path, length);
+		size_t nameLength = length - nameOffset;
+		if (nameLength == 0 || nameLength > MAX_NAME_LENGTH || keyOffset > nameOffset)
+			return BS_E_INVALIDARG;
+
+		size_t keyDepth = 0;
+		for (size_t i = keyOffset; i < nameOffset; ++i)
+		{
+			if (IsSeparator(path[i]))
+				++keyDepth;
+		}
+		if (keyDepth > 0xFFFF)
+			return BS_E_INVALIDARG;
+
+		uint32_t directory = FILE_TABLE_NONE;
+		if (nameOffset != 0)
+		{
+			directory = FindDirectory(path, nameOffset - 1, true);
+			if (directory == FILE_TABLE_NONE)
+				return BS_E_OUTOFMEMORY;
+		}
+
+		const PathChar* name = path + nameOffset;
+		uint32_t hash = HashName(directory, name, nameLength, m_ignoreCase);
+		size_t slot = m_fileIndex.Probe(hash, [&](uint32_t row)
+		{
+			return m_fileDirectories[row] == directory &&
+				NameEquals(m_nameOffsets[row], m_nameLengths[row], name, nameLength);
+		});
+
+		file = m_fileIndex.Row(slot);
+		if (file != FILE_TABLE_NONE)
+			return BS_OK;
+
+		if (m_sizes.size() >= FILE_TABLE_NONE - 1)
+			return BS_E_OUTOFMEMORY;
+
+		uint32_t offset = InternName(name, nameLength);
+		if (offset == FILE_TABLE_NONE)
+			return BS_E_OUTOFMEMORY;
+
+		file = (uint32_t)m_sizes.size();
+		m_fileDirectories.push_back(directory);
+		m_nameOffsets.push_back(offset);
+		m_nameLengths.push_back((uint16_t)nameLength);
+		m_keyDepths.push_back((uint16_t)keyDepth);
+		m_sizes.push_back(size);
+		m_lastWriteTimes.push_back(lastWriteTime);
+		m_progress.push_back(0);
+		m_flags.push_back(0);
+		m_fileIndex.Insert(slot, hash, file);
+
+		m_totalSize += size;
+		added = true;
+		return BS_OK;
+	}
+
+	BsStatus CFileTable::Add(const CScanBatch& batch, uint32_t* files, size_t& added)
+	{
+		added = 0;
+		for (size_t i = 0; i < batch.Count(); ++i)
+		{
+			const ScanEntry& entry = batch.m_entries[i];
+
+			uint32_t file;
+			bool isNew;
+			BsStatus status = Add(batch.Path(entry), entry.pathLength, entry.keyOffset, entry.size,
+				entry.lastWriteTime, file, isNew);
+			if (status != BS_OK)
+				return status;
+
+			if (files != NULL)
+				files[i] = file;
+			if (isNew)
+				++added;
+		}
+
+		return BS_OK;
+	}
+
+	uint32_t CFileTable::Find(const PathChar* path, size_t length) const
+	{
+		size_t nameOffset = NameOffset(path, length);
+		size_t nameLength = length - nameOffset;
+		if (nameLength == 0)
+			return FILE_TABLE_NONE;
+
+		uint32_t directory = FILE_TABLE_NONE;
+		if (nameOffset != 0)
+		{
+			directory = FindDirectory(path, nameOffset - 1);
+			if (directory == FILE_TABLE_NONE)
+				return FILE_TABLE_NONE;
+		}
+
+		const PathChar* name = path + nameOffset;
+		size_t slot = m_fileIndex.Probe(HashName(directory, name, nameLength, m_ignoreCase), [&](uint32_t row)
+		{
+			return m_fileDirectories[row] == directory &&
+				NameEquals(m_nameOffsets[row], m_nameLengths[row], name, nameLength);
+		});
+
+		return m_fileIndex.Row(slot);
+	}
+
+	void CFileTable::AppendPath(uint32_t file, PathString& path) const
+	{
+		AppendDirectories(m_fileDirectories[file], ~0u, PATH_SEPARATOR, path);
+		path.append(&m_names[m_nameOffsets[file]], m_nameLengths[file]);
+	}
+
+	void CFileTable::AppendKeyName(uint32_t file, PathString& key) const
+	{
+		AppendDirectories(m_fileDirectories[file], m_keyDepths[file], '/', key);
+		key.append(&m_names[m_nameOffsets[file]], m_nameLengths[file]);
+	}
+
+	size_t CFileTable::MemoryUsage() const
+	{
+		return m_names.capacity() * sizeof(PathChar) +
+			m_directories.capacity() * sizeof(Directory) +
+			m_directoryIndex.MemoryUsage() +
+			m_fileDirectories.capacity() * sizeof(uint32_t) +
+			m_nameOffsets.capacity() * sizeof(uint32_t) +
+			m_nameLengths.capacity() * sizeof(uint16_t) +
+			m_keyDepths.capacity() * sizeof(uint16_t) +
+			m_sizes.capacity() * sizeof(uint64_t) +
+			m_lastWriteTimes.capacity() * sizeof(int64_t) +
+			m_progress.capacity() * sizeof(uint64_t) +
+			m_flags.capacity() * sizeof(uint8_t) +
+			m_fileIndex.MemoryUsage() +
+			m_lastDirectoryPath.capacity() * sizeof(PathChar);
+	}
+
+	// FILE_TABLE_NONE once the arena is past 32-bit offsets.
+	uint32_t CFileTable::InternName(const PathChar* name, size_t length)
+	{
+		size_t offset = m_names.size();
+		if (offset + length >= FILE_TABLE_NONE)
+			return FILE_TABLE_NONE;
+
+		m_names.insert(m_names.end(), name, name + length);
+		return (uint32_t)offset;
+	}
+
+	//
+	//   FUNCTION: CFileTable::FindDirectory(const PathChar*, size_t, bool)
+	//
+	//   PURPOSE: Walks the directory path from its root, a (parent, name)
+	//            lookup per component, creating the nodes that are missing.
+	//            Components are split at every separator, so a root is the
+	//            part before the first one ("C:", or "" for "/" and UNC
+	//            paths) and joining the names back gives the path.
+	//
+	uint32_t CFileTable::FindDirectory(const PathChar* path, size_t length, bool create)
+	{
+		if (m_lastDirectory != FILE_TABLE_NONE && length == m_lastDirectoryPath.size() &&
+			std::char_traits<PathChar>::compare(path, m_lastDirectoryPath.data(), length) == 0)
+		{
+			return m_lastDirectory;
+		}
+
+		uint32_t parent = FILE_TABLE_NONE;
+		for (size_t start = 0, i = 0; i <= length; ++i)
+		{
+			if (i != length && !IsSeparator(path[i]))
+				continue;
+
+			const PathChar* name = path + start;
+			size_t nameLength = i - start;
+			start = i + 1;
+
+			uint32_t hash = HashName(parent, name, nameLength, m_ignoreCase);
+			size_t slot = m_directoryIndex.Probe(hash, [&](uint32_t row)
+			{
+				const Directory& directory = m_directories[row];
+				return directory.parent == parent &&
+					NameEquals(directory.nameOffset, directory.nameLength, name, nameLength);
+			});
+
+			uint32_t row = m_directoryIndex.Row(slot);
+			if (row == FILE_TABLE_NONE)
+			{
+				if (!create)
+					return FILE_TABLE_NONE;
+
+				uint32_t offset = InternName(name, nameLength);
+				if (offset == FILE_TABLE_NONE || m_directories.size() >= FILE_TABLE_NONE - 1)
+					return FILE_TABLE_NONE;
+
+				Directory directory = { parent, offset, (uint32_t)nameLength };
+				row = (uint32_t)m_directories.size();
+				m_directories.push_back(directory);
+				m_directoryIndex.Insert(slot, hash, row);
+			}
+
+			parent = row;
+		}
+
+		if (create)
+		{
+			m_lastDirectoryPath.assign(path, length);
+			m_lastDirectory = parent;
+		}
+		return parent;
+	}
+
+	uint32_t CFileTable::FindDirectory(const PathChar* path, size_t length) const
+	{
+		return const_cast<CFileTable*>(this)->FindDirectory(path, length, false);
+	}
+
+	//
+	//   FUNCTION: CFileTable::AppendDirectories(uint32_t, unsigned, PathChar, PathString&)
+	//
+	//   PURPOSE: Appends the names of the depth directories ending at
+	//            directory (all of them up to the root for ~0), each followed
+	//            by separator. The lengths are summed first so the names can
+	//            be copied in place from the deepest one back.
+	//
+	void CFileTable::AppendDirectories(uint32_t directory, unsigned depth, PathChar separator, PathString& path) const
+	{
+		size_t length = 0;
+		unsigned count = 0;
+		for (uint32_t node = directory; node != FILE_TABLE_NONE && count < depth; node = m_directories[node].parent)
+		{
+			length += m_directories[node].nameLength + 1;
+			++count;
+		}
+
+		size_t end = path.size() + length;
+		path.resize(end);
+		for (uint32_t node = directory; count > 0; node = m_directories[node].parent, --count)
+		{
+			const Directory& current = m_directories[node];
+			path[--end] = separator;
+			end -= current.nameLength;
+			if (current.nameLength != 0)
+				memcpy(&path[end], &m_names[current.nameOffset], current.nameLength * sizeof(PathChar));
+		}
+	}
+
+	bool CFileTable::NameEquals(uint32_t offset, size_t nameLength, const PathChar* name, size_t length) const
+	{
+		if (nameLength != length)
+			return false;
+
+		const PathChar* stored = m_names.data() + offset;
+		if (!m_ignoreCase)
+			return length == 0 || memcmp(stored, name, length * sizeof(PathChar)) == 0;
+
+		// Characters that fold equal have the same length, so the two names
+		// stay in step as long as they match.
+		for (size_t i = 0, j = 0; i < length; )
+		{
+			if (NextPathChar(stored, i, length, true) != NextPathChar(name, j, length, true))
+				return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,167 @@
+// FileTable.h : Declaration of CFileTable, the files of an archive kept as
+// columns with a case-insensitive path index
+
+#pragma once
+
+#include "Platform.h"
+
+#include <vector>
+
+namespace BigStash
+{
+	class CScanBatch;
+
+	// No file, or no directory (the parent of a root).
+	const uint32_t FILE_TABLE_NONE = 0xFFFFFFFF;
+
+	// CNameIndex
+	//
+	// Open addressing index of (directory, name) pairs to table rows. The
+	// slots keep each row's hash so growing never refolds a name, and so
+	// most mismatches are rejected without touching the row.
+	class CNameIndex
+	{
+	public:
+		CNameIndex();
+
+		void Reserve(size_t count);
+		void Clear();
+
+		// The slot holding the row equals accepts among those of hash, or
+		// the empty slot to insert it at.
+		template <class Equals>
+		size_t Probe(uint32_t hash, Equals equals) const;
+
+		// FILE_TABLE_NONE for an empty slot.
+		uint32_t Row(size_t slot) const { return m_slots[slot].row; }
+
+		// Fills the empty slot Probe returned; may grow the index.
+		void Insert(size_t slot, uint32_t hash, uint32_t row);
+
+		size_t MemoryUsage() const { return m_slots.capacity() * sizeof(Slot); }
+
+	private:
+		struct Slot
+		{
+			uint32_t hash;
+			uint32_t row;
+		};
+
+		void Resize(size_t capacity);
+
+		std::vector<Slot> m_slots;
+		size_t m_count;
+	};
+
+	// CFileTable
+	//
+	// The files of an archive as columns (directory, name, size, last write
+	// time, progress, flags) rather than an object with three strings each.
+	// Directories are a tree of nodes that keep only their own name, and all
+	// names live in one arena, so a path is stored once however many files
+	// share it; full paths and key names are put together on demand. Files
+	// and directories are indexed by (parent, name), which makes adding a
+	// file and finding a duplicate constant time. Names compare with
+	// FoldCase when the table ignores case, which by default it does where
+	// the scanner does (on Windows), and exactly otherwise.
+	class CFileTable
+	{
+	public:
+		explicit CFileTable(bool ignoreCase = PATH_IGNORE_CASE);
+
+		void Reserve(size_t files, size_t nameUnits);
+		void Clear();
+
+		// Adds the file at path. Its key name is the part of the path from
+		// keyOffset on (right after a separator, as RootKeyOffset returns),
+		// with '/' separators. file receives the new row, or the row of the
+		// same path added before, in which case added is false and the row
+		// is left as it was. BS_E_INVALIDARG for a path without a name, or a
+		// name over 65535 units; BS_E_OUTOFMEMORY once the names outgrow
+		// 32-bit offsets.
+		BsStatus Add(const PathChar* path, size_t length, size_t keyOffset, uint64_t size, int64_t lastWriteTime,
+			uint32_t& file, bool& added);
+
+		// Adds the entries of a scan batch; files (may be NULL) receives a
+		// row per entry, and the number of new rows is returned in added.
+		BsStatus Add(const CScanBatch& batch, uint32_t* files, size_t& added);
+
+		// FILE_TABLE_NONE when the path is not in the table.
+		uint32_t Find(const PathChar* path, size_t length) const;
+
+		uint32_t Count() const { return (uint32_t)m_sizes.size(); }
+		uint32_t DirectoryCount() const { return (uint32_t)m_directories.size(); }
+
+		uint64_t Size(uint32_t file) const { return m_sizes[file]; }
+		int64_t LastWriteTime(uint32_t file) const { return m_lastWriteTimes[file]; }
+
+		// Not synchronized: written by whoever owns the table.
+		uint64_t Progress(uint32_t file) const { return m_progress[file]; }
+		void SetProgress(uint32_t file, uint64_t bytes) { m_progress[file] = bytes; }
+
+		// Left to the caller (e.g. uploaded, packed); 0 for a new file.
+		uint8_t Flags(uint32_t file) const { return m_flags[file]; }
+		void SetFlags(uint32_t file, uint8_t flags) { m_flags[file] = flags; }
+
+		uint64_t TotalSize() const { return m_totalSize; }
+		bool IgnoresCase() const { return m_ignoreCase; }
+
+		// The file name, in the arena (not NUL terminated).
+		const PathChar* Name(uint32_t file, size_t& length) const
+		{
+			length = m_nameLengths[file];
+			return &m_names[m_nameOffsets[file]];
+		}
+
+		// Appends the full path, with native separators.
+		void AppendPath(uint32_t file, PathString& path) const;
+
+		// Appends the key name, with '/' separators.
+		void AppendKeyName(uint32_t file, PathString& key) const;
+
+		// Bytes held by the columns, nodes, arena and indexes.
+		size_t MemoryUsage() const;
+
+	private:
+		struct Directory
+		{
+			uint32_t parent;
+			uint32_t nameOffset;
+			uint32_t nameLength;
+		};
+
+		uint32_t InternName(const PathChar* name, size_t length);
+		uint32_t FindDirectory(const PathChar* path, size_t length, bool create);
+		uint32_t FindDirectory(const PathChar* path, size_t length) const;
+		void AppendDirectories(uint32_t directory, unsigned depth, PathChar separator, PathString& path) const;
+
+		bool NameEquals(uint32_t offset, size_t nameLength, const PathChar* name, size_t length) const;
+
+		bool m_ignoreCase;
+
+		std::vector<PathChar> m_names;
+		std::vector<Directory> m_directories;
+		CNameIndex m_directoryIndex;
+
+		// The columns, a row per file.
+		std::vector<uint32_t> m_fileDirectories;
+		std::vector<uint32_t> m_nameOffsets;
+		std::vector<uint16_t> m_nameLengths;
+		std::vector<uint16_t> m_keyDepths;     // directories the key name starts above the file
+		std::vector<uint64_t> m_sizes;
+		std::vector<int64_t> m_lastWriteTimes;
+		std::vector<uint64_t> m_progress;
+		std::vector<uint8_t> m_flags;
+		CNameIndex m_fileIndex;
+
+		uint64_t m_totalSize;
+
+		// Files come directory by directory, so the last directory looked up
+		// spares walking the tree for most of them.
+		PathString m_lastDirectoryPath;
+		uint32_t m_lastDirectory;
+
+		CFileTable(const CFileTable&);
+		CFileTable& operator=(const CFileTable&);
+	};
+}
@@ -0,0 +1,300 @@
+// Http.cpp : Implementation of the HTTP/1.1 helpers and CHttpResponseParser
+
+#include "Http.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		const size_t MAX_HEAD_LENGTH = 64 * 1024;
+
+		bool EqualsIgnoreCase(const std::string& left, const char* right)
+		{
+			size_t length = strlen(right);
+			if (left.size() != length)
+				return false;
+
+			for (size_t i = 0; i < length; ++i)
+			{
+				if (tolower((unsigned char)left[i]) != tolower((unsigned char)right[i]))
+					return false;
+			}
+
+			return true;
+		}
+
+		std::string Trim(const std::string& value)
+		{
+			size_t begin = value.find_first_not_of(" \t");
+			if (begin == std::string::npos)
+				return std::string();
+			size_t end = value.find_last_not_of(" \t");
+			return value.substr(begin, end - begin + 1);
+		}
+	}
+
+	const std::string* FindHeader(const HttpHeaders& headers, const char* name)
+	{
+		for (const auto& header : headers)
+		{
+			if (EqualsIgnoreCase(header.first, name))
+				return &header.second;
+		}
+
+		return NULL;
+	}
+
+	void HttpRequest::SetBody(const std::string& content)
+	{
+		ownedBody = content;
+		body = reinterpret_cast<const uint8_t*>(ownedBody.data());
+		bodyLength = ownedBody.size();
+	}
+
+	std::string FormatRequestHead(const HttpRequest& request, const std::string& host, bool keepAlive)
+	{
+		std::string head;
+		head.reserve(512);
+		head += request.method;
+		head += ' ';
+		head += request.target;
+		head += " HTTP/1.1\r\n";
+
+		if (FindHeader(request.headers, "Host") == NULL)
+			head += "Host: " + host + "\r\n";
+
+		for (const auto& header : request.headers)
+			head += header.first + ": " + header.second + "\r\n";
+
+		if (request.ContentLength() > 0 || request.method == "PUT" || request.method == "POST")
+			head += "Content-Length: " + std::to_string(request.ContentLength()) + "\r\n";
+
+		if (!keepAlive)
+			head += "Connection: close\r\n";
+
+		head += "\r\n";
+		return head;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CHttpResponseParser methods
+	//
+
+	CHttpResponseParser::CHttpResponseParser()
+	{
+		Reset();
+	}
+
+	void CHttpResponseParser::Reset()
+	{
+		m_response = HttpResponse();
+		m_state = STATE_HEAD;
+		m_line.clear();
+		m_remaining = 0;
+		m_keepAlive = true;
+		m_started = false;
+	}
+
+	CHttpResponseParser::Result CHttpResponseParser::Feed(const char* data, size_t length, size_t& consumed)
+	{
+		consumed = 0;
+		if (length > 0)
+			m_started = true;
+
+		while (consumed < length && m_state != STATE_DONE)
+		{
+			const char* current = data + consumed;
+			size_t available = length - consumed;
+
+			switch (m_state)
+			{
+			case STATE_HEAD:
+			{
+				// the head ends at the first blank line; look for it across
+				// the boundary of the previous chunk too.
+				size_t start = m_line.size() > 3 ? m_line.size() - 3 : 0;
+				m_line.append(current, available);
+				size_t end = m_line.find("\r\n\r\n", start);
+				if (end == std::string::npos)
+				{
+					consumed = length;
+					if (m_line.size() > MAX_HEAD_LENGTH)
+						return PARSE_ERROR;
+					break;
+				}
+
+				size_t headLength = end + 4;
+				consumed += available - (m_line.size() - headLength);
+				m_line.resize(headLength);
+
+				Result result = ParseHead();
+				if (result != PARSE_MORE)
+					return result;
+				break;
+			}
+
+			case STATE_BODY:
+			{
+				size_t take = (size_t)std::min<uint64_t>(available, m_remaining);
+				m_response.body.append(current, take);
+				m_remaining -= take;
+				consumed += take;
+				if (m_remaining == 0)
+					m_state = STATE_DONE;
+				break;
+			}
+
+			case STATE_CHUNK_SIZE:
+			case STATE_CHUNK_DATA_END:
+			case STATE_TRAILER:
+			{
+				const char* newline = static_cast<const char*>(memchr(current, '\n', available));
+				size_t take = newline != NULL ? (size_t)(newline - current) + 1 : available;
+				m_line.append(current, take);
+				consumed += take;
+				if (newline == NULL)
+				{
+					if (m_line.size() > MAX_HEAD_LENGTH)
+						return PARSE_ERROR;
+					break;
+				}
+
+				std::string line = m_line.substr(0, m_line.find_last_not_of("\r\n") + 1);
+				m_line.clear();
+
+				if (m_state == STATE_CHUNK_SIZE)
+				{
+					char* end = NULL;
+					m_remaining = strtoull(line.c_str(), &end, 16);
+					if (end == line.c_str())
+						return PARSE_ERROR;
+					m_state = m_remaining == 0 ? STATE_TRAILER : STATE_CHUNK_DATA;
+				}
+				else if (m_state == STATE_CHUNK_DATA_END)
+				{
+					if (!line.empty())
+						return PARSE_ERROR;
+					m_state = STATE_CHUNK_SIZE;
+				}
+				else if (line.empty())
+					m_state = STATE_DONE;
+				break;
+			}
+
+			case STATE_CHUNK_DATA:
+			{
+				size_t take = (size_t)std::min<uint64_t>(available, m_remaining);
+				m_response.body.append(current, take);
+				m_remaining -= take;
+				consumed += take;
+				if (m_remaining == 0)
+					m_state = STATE_CHUNK_DATA_END;
+				break;
+			}
+
+			case STATE_UNTIL_EOF:
+				m_response.body.append(current, available);
+				consumed = length;
+				break;
+
+			case STATE_DONE:
+				break;
+			}
+		}
+
+		return m_state == STATE_DONE ? PARSE_DONE : PARSE_MORE;
+	}
+
+	CHttpResponseParser::Result CHttpResponseParser::FinishAtEof()
+	{
+		if (m_state == STATE_UNTIL_EOF)
+		{
+			m_state = STATE_DONE;
+			return PARSE_DONE;
+		}
+
+		return m_state == STATE_DONE ? PARSE_DONE : PARSE_ERROR;
+	}
+
+	//
+	//   FUNCTION: CHttpResponseParser::ParseHead()
+	//
+	//   PURPOSE: Parses the status line and headers in m_line and picks the
+	//            body framing.
+	//
+	CHttpResponseParser::Result CHttpResponseParser::ParseHead()
+	{
+		std::string head;
+		head.swap(m_line);
+
+		size_t lineEnd = head.find("\r\n");
+		std::string statusLine = head.substr(0, lineEnd);
+		if (statusLine.compare(0, 5, "HTTP/") != 0)
+			return PARSE_ERROR;
+
+		size_t space = statusLine.find(' ');
+		if (space == std::string::npos)
+			return PARSE_ERROR;
+
+		m_response.status = atoi(statusLine.c_str() + space + 1);
+		if (m_response.status < 100)
+			return PARSE_ERROR;
+
+		bool http10 = statusLine.compare(0, 8, "HTTP/1.0") == 0;
+
+		size_t position = lineEnd + 2;
+		while (position < head.size())
+		{
+			size_t end = head.find("\r\n", position);
+			if (end == position || end == std::string::npos)
+				break;
+
+			size_t colon = head.find(':', position);
+			if (colon == std::string::npos || colon > end)
+				return PARSE_ERROR;
+
+			m_response.headers.push_back(std::make_pair(head.substr(position, colon - position),
+				Trim(head.substr(colon + 1, end - colon - 1))));
+			position = end + 2;
+		}
+
+		// an interim 100 Continue is followed by the real response.
+		if (m_response.status < 200)
+		{
+			m_response = HttpResponse();
+			m_state = STATE_HEAD;
+			return PARSE_MORE;
+		}
+
+		const std::string* connection = m_response.Header("Connection");
+		if (connection != NULL)
+			m_keepAlive = !EqualsIgnoreCase(*connection, "close");
+		else
+			m_keepAlive = !http10;
+
+		const std::string* encoding = m_response.Header("Transfer-Encoding");
+		const std::string* contentLength = m_response.Header("Content-Length");
+
+		if (m_response.status == 204 || m_response.status == 304)
+			m_state = STATE_DONE;
+		else if (encoding != NULL && EqualsIgnoreCase(*encoding, "chunked"))
+			m_state = STATE_CHUNK_SIZE;
+		else if (contentLength != NULL)
+		{
+			m_remaining = strtoull(contentLength->c_str(), NULL, 10);
+			m_state = m_remaining == 0 ? STATE_DONE : STATE_BODY;
+		}
+		else
+		{
+			m_state = STATE_UNTIL_EOF;
+			m_keepAlive = false;
+		}
+
+		return m_state == STATE_DONE ? PARSE_DONE : PARSE_MORE;
+	}
+}
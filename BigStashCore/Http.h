@@ -0,0 +1,147 @@
+// Http.h : HTTP/1.1 request and response types and CHttpResponseParser
+
+#pragma once
+
+#include "Platform.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace BigStash
+{
+	typedef std::vector<std::pair<std::string, std::string> > HttpHeaders;
+
+	// Case-insensitive lookup; NULL when the header is missing.
+	const std::string* FindHeader(const HttpHeaders& headers, const char* name);
+
+	struct HttpRequest
+	{
+		HttpRequest() : body(NULL), bodyLength(0), bodySha256(NULL) {}
+
+		// Points body at ownedBody, for bodies the request builds itself.
+		void SetBody(const std::string& content);
+
+		std::string method;
+
+		// Origin-form request target: the encoded path and query.
+		std::string target;
+
+		// Host, Content-Length and Connection are added when the request is
+		// sent; everything else (signing included) goes here.
+		HttpHeaders headers;
+
+		// Not owned: part bodies are sent straight from the part reader's
+		// buffers and must outlive the request.
+		const uint8_t* body;
+		size_t bodyLength;
+
+		std::string ownedBody;
+
+		// SHA-256 of the body when its producer already computed it, so a
+		// signer does not hash the body a second time. Not owned.
+		const uint8_t* bodySha256;
+
+		// Framing sent around the body (aws-chunked), counted in
+		// Content-Length.
+		std::string bodyPrefix;
+		std::string bodySuffix;
+
+		uint64_t ContentLength() const { return bodyPrefix.size() + bodyLength + bodySuffix.size(); }
+	};
+
+	// When an exchange went through each step, in MonotonicNanoseconds();
+	// 0 for the steps it did not get to.
+	struct HttpTiming
+	{
+		HttpTiming() : queued(0), assigned(0), connected(0), sent(0), firstByte(0), done(0), newConnection(false) {}
+
+		// Submitted, then given a connection.
+		int64_t queued;
+		int64_t assigned;
+
+		// The connection was ready to send: assigned, unless it was opened
+		// for this request.
+		int64_t connected;
+
+		// The last byte of the request went out; 0 when the server answered
+		// before the body was through.
+		int64_t sent;
+
+		int64_t firstByte;
+		int64_t done;
+		bool newConnection;
+	};
+
+	struct HttpResponse
+	{
+		HttpResponse() : status(0) {}
+
+		const std::string* Header(const char* name) const { return FindHeader(headers, name); }
+
+		int status;
+		HttpHeaders headers;
+		std::string body;
+
+		// Filled in by CHttpClient.
+		HttpTiming timing;
+	};
+
+	// Formats the request line and headers, ending with the blank line.
+	std::string FormatRequestHead(const HttpRequest& request, const std::string& host, bool keepAlive);
+
+	// CHttpResponseParser
+	//
+	// Incremental HTTP/1.1 response parser: status line, headers, and a body
+	// framed by Content-Length, chunked encoding or the end of the stream.
+	class CHttpResponseParser
+	{
+	public:
+		enum Result
+		{
+			PARSE_MORE,
+			PARSE_DONE,
+			PARSE_ERROR
+		};
+
+		CHttpResponseParser();
+
+		void Reset();
+
+		// Consumes bytes; consumed tells how many belonged to this response.
+		Result Feed(const char* data, size_t length, size_t& consumed);
+
+		// The stream ended. Completes a body framed by the end of the stream.
+		Result FinishAtEof();
+
+		HttpResponse& Response() { return m_response; }
+
+		// False when the server asked to close, or framed the body by closing.
+		bool KeepAlive() const { return m_keepAlive; }
+
+		// True once any byte of the response arrived.
+		bool Started() const { return m_started; }
+
+	private:
+		enum State
+		{
+			STATE_HEAD,
+			STATE_BODY,
+			STATE_CHUNK_SIZE,
+			STATE_CHUNK_DATA,
+			STATE_CHUNK_DATA_END,
+			STATE_TRAILER,
+			STATE_UNTIL_EOF,
+			STATE_DONE
+		};
+
+		Result ParseHead();
+
+		HttpResponse m_response;
+		State m_state;
+		std::string m_line;
+		uint64_t m_remaining;
+		bool m_keepAlive;
+		bool m_started;
+	};
+}
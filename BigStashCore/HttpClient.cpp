@@ -0,0 +1,637 @@
+// HttpClient.cpp : Implementation of CHttpClient
+
+#include "HttpClient.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		const size_t RECEIVE_BUFFER_SIZE = 256 * 1024;
+
+		// Upper bound of the event loop sleep, so timeouts are noticed.
+		const int POLL_INTERVAL_MS = 1000;
+	}
+
+	CHttpClient::CHttpClient(const HttpClientOptions& options)
+		: m_options(options), m_stopping(false), m_running(false), m_nextId(1),
+		m_receiveBuffer(RECEIVE_BUFFER_SIZE)
+	{
+		if (m_options.maxConnections == 0)
+			m_options.maxConnections = 1;
+
+		m_hostHeader = m_options.host;
+		if (m_options.port != 80)
+			m_hostHeader += ":" + std::to_string(m_options.port);
+
+		memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	CHttpClient::~CHttpClient()
+	{
+		Stop();
+	}
+
+	BsStatus CHttpClient::Start()
+	{
+		if (m_running)
+			return BS_OK;
+
+		BsStatus status = SocketStartup();
+		if (status != BS_OK)
+			return status;
+
+		m_stopping = false;
+		m_running = true;
+		m_thread = std::thread(&CHttpClient::Loop, this);
+		return BS_OK;
+	}
+
+	void CHttpClient::Stop()
+	{
+		if (!m_running)
+			return;
+
+		m_stopping = true;
+		m_poller.Wake();
+		m_thread.join();
+		m_running = false;
+	}
+
+	uint64_t CHttpClient::Submit(HttpRequest* request, const HttpCompletion& completion)
+	{
+		uint64_t id = 0;
+		std::unique_ptr<Exchange> exchange(new Exchange);
+		exchange->request = request;
+		exchange->completion = completion;
+		exchange->retried = false;
+		exchange->timing.queued = MonotonicNanoseconds();
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			if (m_running && !m_stopping)
+			{
+				id = m_nextId++;
+				exchange->id = id;
+				m_submitted.push_back(std::move(exchange));
+				exchange.reset();
+			}
+		}
+
+		if (exchange)
+		{
+			HttpResponse response;
+			completion(BS_E_CANCELLED, response);
+			return 0;
+		}
+
+		m_poller.Wake();
+		return id;
+	}
+
+	void CHttpClient::Cancel(uint64_t exchange)
+	{
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			if (!m_running || m_stopping || exchange == 0)
+				return;
+			m_cancels.push_back(exchange);
+		}
+
+		m_poller.Wake();
+	}
+
+	BsStatus CHttpClient::Execute(HttpRequest& request, HttpResponse& response)
+	{
+		std::mutex lock;
+		std::condition_variable finished;
+		bool done = false;
+		BsStatus result = BS_OK;
+
+		Submit(&request, [&](BsStatus status, HttpResponse& received)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			result = status;
+			response = std::move(received);
+			done = true;
+			finished.notify_one();
+		});
+
+		std::unique_lock<std::mutex> guard(lock);
+		while (!done)
+			finished.wait(guard);
+
+		return result;
+	}
+
+	HttpStats CHttpClient::Stats() const
+	{
+		std::lock_guard<std::mutex> guard(m_statsLock);
+		return m_stats;
+	}
+
+	//
+	//   FUNCTION: CHttpClient::Loop()
+	//
+	//   PURPOSE: The event loop. Picks up submitted requests, hands them to
+	//            idle or new connections and drives the sockets that are
+	//            ready. Cancellations are taken after the submissions, so
+	//            a request cancelled right after Submit is found. Closed
+	//            connections are only freed between rounds, as the events
+	//            of a round may still point to them.
+	//
+	void CHttpClient::Loop()
+	{
+		std::vector<CPoller::Event> events;
+		std::vector<uint64_t> cancels;
+
+		while (!m_stopping)
+		{
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				while (!m_submitted.empty())
+				{
+					m_pending.push_back(std::move(m_submitted.front()));
+					m_submitted.pop_front();
+				}
+				cancels.swap(m_cancels);
+			}
+
+			if (!cancels.empty())
+			{
+				CancelExchanges(cancels);
+				cancels.clear();
+			}
+
+			Dispatch();
+
+			if (m_poller.Wait(events, POLL_INTERVAL_MS) != BS_OK)
+				events.clear();
+
+			for (const CPoller::Event& event : events)
+				HandleEvent(static_cast<Connection*>(event.context), event.events);
+
+			CheckTimeouts();
+
+			for (auto it = m_connections.begin(); it != m_connections.end();)
+			{
+				if ((*it)->socket == INVALID_SOCKET_HANDLE)
+					it = m_connections.erase(it);
+				else
+					++it;
+			}
+		}
+
+		// fail whatever is left.
+		HttpResponse none;
+		for (auto& connection : m_connections)
+		{
+			if (connection->exchange)
+				Complete(std::move(connection->exchange), BS_E_CANCELLED, none);
+			CloseConnection(connection.get());
+		}
+		m_connections.clear();
+		m_idle.clear();
+
+		std::deque<std::unique_ptr<Exchange> > left;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			left.swap(m_submitted);
+			m_cancels.clear();
+		}
+		for (auto& exchange : m_pending)
+			Complete(std::move(exchange), BS_E_CANCELLED, none);
+		for (auto& exchange : left)
+			Complete(std::move(exchange), BS_E_CANCELLED, none);
+		m_pending.clear();
+	}
+
+	void CHttpClient::Dispatch()
+	{
+		while (!m_pending.empty())
+		{
+			Connection* connection = NULL;
+			if (!m_idle.empty())
+			{
+				connection = m_idle.back();
+				m_idle.pop_back();
+				connection->reused = true;
+
+				std::lock_guard<std::mutex> guard(m_statsLock);
+				m_stats.connectionsReused++;
+			}
+			else if (m_connections.size() < m_options.maxConnections)
+			{
+				BsStatus status;
+				connection = OpenConnection(status);
+				if (connection == NULL)
+				{
+					HttpResponse none;
+					std::unique_ptr<Exchange> exchange = std::move(m_pending.front());
+					m_pending.pop_front();
+					Complete(std::move(exchange), status, none);
+					continue;
+				}
+			}
+			else
+				break;
+
+			std::unique_ptr<Exchange> exchange = std::move(m_pending.front());
+			m_pending.pop_front();
+			Assign(connection, std::move(exchange));
+		}
+	}
+
+	//
+	//   FUNCTION: CHttpClient::CancelExchanges(const std::vector<uint64_t>&)
+	//
+	//   PURPOSE: Completes the listed exchanges with BS_E_CANCELLED. One
+	//            still queued just leaves the queue; one on a connection
+	//            takes the connection down with it, as half a request
+	//            cannot be taken back. Exchanges no longer here completed
+	//            already and are skipped. They are matched by id, not by
+	//            request: the caller may have submitted the same or a new
+	//            HttpRequest at that address since.
+	//
+	void CHttpClient::CancelExchanges(const std::vector<uint64_t>& exchanges)
+	{
+		HttpResponse none;
+
+		for (uint64_t id : exchanges)
+		{
+			std::unique_ptr<Exchange> exchange;
+
+			auto queued = std::find_if(m_pending.begin(), m_pending.end(),
+				[id](const std::unique_ptr<Exchange>& pending) { return pending->id == id; });
+			if (queued != m_pending.end())
+			{
+				exchange = std::move(*queued);
+				m_pending.erase(queued);
+			}
+			else
+			{
+				for (auto& connection : m_connections)
+				{
+					if (connection->exchange && connection->exchange->id == id)
+					{
+						exchange = std::move(connection->exchange);
+						CloseConnection(connection.get());
+						break;
+					}
+				}
+			}
+
+			if (!exchange)
+				continue;
+
+			{
+				std::lock_guard<std::mutex> guard(m_statsLock);
+				m_stats.cancelled++;
+			}
+			Complete(std::move(exchange), BS_E_CANCELLED, none);
+		}
+	}
+
+	CHttpClient::Connection* CHttpClient::OpenConnection(BsStatus& status)
+	{
+		SocketHandle socket;
+		status = StartConnect(m_options.host, m_options.port, m_options.socket, socket);
+		if (status != BS_OK)
+			return NULL;
+
+		std::unique_ptr<Connection> connection(new Connection);
+		connection->socket = socket;
+		connection->state = CONNECTION_CONNECTING;
+		connection->interest = POLL_WRITE;
+		connection->reused = false;
+		connection->headSent = 0;
+		connection->bodySent = 0;
+		connection->suffixSent = 0;
+		connection->lastActivity = std::chrono::steady_clock::now();
+
+		status = m_poller.Add(socket, POLL_WRITE, connection.get());
+		if (status != BS_OK)
+		{
+			CloseSocket(socket);
+			return NULL;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_statsLock);
+			m_stats.connectionsOpened++;
+		}
+
+		m_connections.push_back(std::move(connection));
+		return m_connections.back().get();
+	}
+
+	void CHttpClient::Assign(Connection* connection, std::unique_ptr<Exchange> exchange)
+	{
+		// the body framing, if any, rides along with the head.
+		connection->head = FormatRequestHead(*exchange->request, m_hostHeader, m_options.keepAlive) +
+			exchange->request->bodyPrefix;
+		connection->headSent = 0;
+		connection->bodySent = 0;
+		connection->suffixSent = 0;
+		connection->parser.Reset();
+		connection->exchange = std::move(exchange);
+		connection->lastActivity = std::chrono::steady_clock::now();
+
+		// a stale connection's attempt does not count.
+		HttpTiming& timing = connection->exchange->timing;
+		timing.assigned = MonotonicNanoseconds();
+		timing.newConnection = connection->state == CONNECTION_CONNECTING;
+		timing.connected = timing.newConnection ? 0 : timing.assigned;
+		timing.sent = 0;
+		timing.firstByte = 0;
+
+		{
+			std::lock_guard<std::mutex> guard(m_statsLock);
+			m_stats.requests++;
+		}
+
+		// a connected socket almost always takes the head right away.
+		if (connection->state == CONNECTION_IDLE)
+		{
+			connection->state = CONNECTION_SENDING;
+			Send(connection);
+		}
+	}
+
+	void CHttpClient::HandleEvent(Connection* connection, unsigned events)
+	{
+		if (connection->socket == INVALID_SOCKET_HANDLE)
+			return;
+
+		if (connection->state == CONNECTION_CONNECTING)
+		{
+			if ((events & (POLL_WRITE | POLL_ERROR)) == 0)
+				return;
+
+			BsStatus status = FinishConnect(connection->socket);
+			if (status != BS_OK)
+			{
+				Fail(connection, status);
+				return;
+			}
+
+			connection->state = connection->exchange ? CONNECTION_SENDING : CONNECTION_IDLE;
+			if (connection->state == CONNECTION_IDLE)
+			{
+				SetInterest(connection, POLL_READ);
+				m_idle.push_back(connection);
+				return;
+			}
+
+			connection->exchange->timing.connected = MonotonicNanoseconds();
+			Send(connection);
+			return;
+		}
+
+		// the server may answer (with an error) before the body is through.
+		if (events & (POLL_READ | POLL_ERROR))
+		{
+			ReceiveResponse(connection);
+			if (connection->socket == INVALID_SOCKET_HANDLE)
+				return;
+		}
+
+		if ((events & POLL_WRITE) && connection->state == CONNECTION_SENDING)
+			Send(connection);
+	}
+
+	void CHttpClient::Send(Connection* connection)
+	{
+		const HttpRequest& request = *connection->exchange->request;
+		const std::string& suffix = request.bodySuffix;
+		uint64_t sent = 0;
+
+		while (connection->suffixSent < suffix.size() || connection->headSent < connection->head.size() ||
+			connection->bodySent < request.bodyLength)
+		{
+			BsStatus status = BS_OK;
+			ptrdiff_t written;
+			bool bodyDone = connection->headSent == connection->head.size() && connection->bodySent == request.bodyLength;
+
+			if (!bodyDone)
+			{
+				written = SendGather(connection->socket,
+					connection->head.data() + connection->headSent, connection->head.size() - connection->headSent,
+					request.body + connection->bodySent, request.bodyLength - connection->bodySent, status);
+			}
+			else
+			{
+				written = SendGather(connection->socket, suffix.data() + connection->suffixSent,
+					suffix.size() - connection->suffixSent, NULL, 0, status);
+			}
+
+			if (written < 0)
+			{
+				Fail(connection, status);
+				return;
+			}
+
+			if (written == 0)
+			{
+				SetInterest(connection, POLL_READ | POLL_WRITE);
+				break;
+			}
+
+			if (!bodyDone)
+			{
+				size_t headPart = std::min((size_t)written, connection->head.size() - connection->headSent);
+				connection->headSent += headPart;
+				connection->bodySent += (size_t)written - headPart;
+			}
+			else
+				connection->suffixSent += (size_t)written;
+			sent += (uint64_t)written;
+		}
+
+		if (sent > 0)
+		{
+			connection->lastActivity = std::chrono::steady_clock::now();
+			std::lock_guard<std::mutex> guard(m_statsLock);
+			m_stats.bytesSent += sent;
+		}
+
+		if (connection->headSent == connection->head.size() && connection->bodySent == request.bodyLength &&
+			connection->suffixSent == suffix.size())
+		{
+			connection->exchange->timing.sent = MonotonicNanoseconds();
+			connection->state = CONNECTION_RECEIVING;
+			SetInterest(connection, POLL_READ);
+		}
+	}
+
+	void CHttpClient::ReceiveResponse(Connection* connection)
+	{
+		uint64_t received = 0;
+
+		for (;;)
+		{
+			BsStatus status = BS_OK;
+			ptrdiff_t count = Receive(connection->socket, m_receiveBuffer.data(), m_receiveBuffer.size(), status);
+
+			if (count == -1)
+				break;
+
+			if (count == -2)
+			{
+				Fail(connection, status);
+				return;
+			}
+
+			if (count == 0)
+			{
+				// the server closed the connection.
+				if (connection->exchange && connection->parser.FinishAtEof() == CHttpResponseParser::PARSE_DONE)
+					Finish(connection, BS_OK);
+				else
+					Fail(connection, BS_E_IO);
+				return;
+			}
+
+			received += (uint64_t)count;
+			if (!connection->exchange)
+			{
+				// nothing was asked on an idle connection.
+				CloseConnection(connection);
+				return;
+			}
+
+			if (connection->exchange->timing.firstByte == 0)
+				connection->exchange->timing.firstByte = MonotonicNanoseconds();
+
+			size_t consumed = 0;
+			CHttpResponseParser::Result result = connection->parser.Feed(m_receiveBuffer.data(), (size_t)count, consumed);
+			if (result == CHttpResponseParser::PARSE_ERROR)
+			{
+				Fail(connection, BS_E_CORRUPT);
+				return;
+			}
+
+			if (result == CHttpResponseParser::PARSE_DONE)
+			{
+				// trailing bytes mean the stream is out of step.
+				bool clean = consumed == (size_t)count;
+				Finish(connection, BS_OK);
+				if (!clean && connection->socket != INVALID_SOCKET_HANDLE)
+					CloseConnection(connection);
+				break;
+			}
+		}
+
+		if (received > 0)
+		{
+			connection->lastActivity = std::chrono::steady_clock::now();
+			std::lock_guard<std::mutex> guard(m_statsLock);
+			m_stats.bytesReceived += received;
+		}
+	}
+
+	void CHttpClient::SetInterest(Connection* connection, unsigned interest)
+	{
+		if (connection->interest == interest)
+			return;
+
+		connection->interest = interest;
+		m_poller.Modify(connection->socket, interest, connection);
+	}
+
+	//
+	//   FUNCTION: CHttpClient::Finish(Connection*, BsStatus)
+	//
+	//   PURPOSE: Completes the connection's exchange with its response and
+	//            returns the connection to the pool when it can be reused.
+	//
+	void CHttpClient::Finish(Connection* connection, BsStatus status)
+	{
+		bool reusable = m_options.keepAlive && connection->parser.KeepAlive() &&
+			connection->state == CONNECTION_RECEIVING;
+
+		std::unique_ptr<Exchange> exchange = std::move(connection->exchange);
+
+		if (reusable)
+		{
+			connection->state = CONNECTION_IDLE;
+			SetInterest(connection, POLL_READ);
+			m_idle.push_back(connection);
+		}
+		else
+			CloseConnection(connection);
+
+		Complete(std::move(exchange), status, connection->parser.Response());
+	}
+
+	//
+	//   FUNCTION: CHttpClient::Fail(Connection*, BsStatus)
+	//
+	//   PURPOSE: Drops a broken connection. Its request goes back to the
+	//            queue once when the connection was reused and the server
+	//            had not answered: the server closed an idle keep-alive
+	//            connection just as it was picked.
+	//
+	void CHttpClient::Fail(Connection* connection, BsStatus status)
+	{
+		std::unique_ptr<Exchange> exchange = std::move(connection->exchange);
+		bool stale = connection->reused && !connection->parser.Started();
+		CloseConnection(connection);
+
+		if (!exchange)
+			return;
+
+		if (stale && !exchange->retried)
+		{
+			exchange->retried = true;
+			m_pending.push_front(std::move(exchange));
+
+			std::lock_guard<std::mutex> guard(m_statsLock);
+			m_stats.staleRetries++;
+			return;
+		}
+
+		HttpResponse none;
+		Complete(std::move(exchange), status, none);
+	}
+
+	void CHttpClient::CloseConnection(Connection* connection)
+	{
+		if (connection->socket == INVALID_SOCKET_HANDLE)
+			return;
+
+		m_idle.erase(std::remove(m_idle.begin(), m_idle.end(), connection), m_idle.end());
+		m_poller.Remove(connection->socket);
+		CloseSocket(connection->socket);
+		connection->socket = INVALID_SOCKET_HANDLE;
+	}
+
+	void CHttpClient::Complete(std::unique_ptr<Exchange> exchange, BsStatus status, HttpResponse& response)
+	{
+		exchange->timing.done = MonotonicNanoseconds();
+		response.timing = exchange->timing;
+		exchange->completion(status, response);
+	}
+
+	void CHttpClient::CheckTimeouts()
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::chrono::seconds timeout(m_options.timeoutSeconds);
+
+		for (auto& connection : m_connections)
+		{
+			if (connection->socket == INVALID_SOCKET_HANDLE || connection->state == CONNECTION_IDLE)
+				continue;
+
+			if (now - connection->lastActivity > timeout)
+			{
+				if (connection->exchange)
+					connection->exchange->retried = true;
+				Fail(connection.get(), BS_E_IO);
+			}
+		}
+	}
+}
@@ -0,0 +1,166 @@
+// HttpClient.h : Declaration of CHttpClient
+
+#pragma once
+
+#include "Http.h"
+#include "Socket.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace BigStash
+{
+	struct HttpClientOptions
+	{
+		HttpClientOptions() : port(80), maxConnections(8), keepAlive(true), timeoutSeconds(120) {}
+
+		std::string host;
+		uint16_t port;
+
+		// Connections opened to the host at most; requests beyond them wait.
+		unsigned maxConnections;
+
+		// Reuse connections between requests. Off sends Connection: close.
+		bool keepAlive;
+
+		// A request fails when its connection makes no progress this long.
+		unsigned timeoutSeconds;
+
+		SocketOptions socket;
+	};
+
+	struct HttpStats
+	{
+		uint64_t requests;
+		uint64_t connectionsOpened;
+		uint64_t connectionsReused;
+		uint64_t staleRetries;
+		uint64_t cancelled;
+		uint64_t bytesSent;
+		uint64_t bytesReceived;
+	};
+
+	// Runs on the client thread once the request finished or failed. It must
+	// not block; the response may be moved from.
+	typedef std::function<void(BsStatus status, HttpResponse& response)> HttpCompletion;
+
+	// CHttpClient
+	//
+	// HTTP/1.1 client for one host, driven by a single event loop thread over
+	// non-blocking sockets (epoll on Linux). It keeps a pool of persistent
+	// connections, sends request bodies straight from the caller's memory,
+	// and retries a request once on a fresh connection when a reused one
+	// turns out to have been closed by the server. Requests are not
+	// pipelined: S3 does not promise to handle it, so parallelism comes from
+	// the connections.
+	class CHttpClient
+	{
+	public:
+		explicit CHttpClient(const HttpClientOptions& options);
+		~CHttpClient();
+
+		BsStatus Start();
+
+		// Stops the event loop; pending requests complete with BS_E_CANCELLED.
+		void Stop();
+
+		// Queues a request. It (and its body) must stay valid until the
+		// completion runs. Returns the id Cancel takes, never reused; 0 when
+		// the client is stopped and the completion ran already.
+		uint64_t Submit(HttpRequest* request, const HttpCompletion& completion);
+
+		// Gives up on a submitted request: it leaves the queue, or its
+		// connection is closed mid-exchange, and it completes with
+		// BS_E_CANCELLED. Nothing happens when it already completed, even if
+		// its HttpRequest went on to be submitted again; the completion
+		// still runs exactly once.
+		void Cancel(uint64_t exchange);
+
+		// Sends a request and waits for the response. Not for the completion
+		// callbacks, which run on the client thread.
+		BsStatus Execute(HttpRequest& request, HttpResponse& response);
+
+		HttpStats Stats() const;
+		const HttpClientOptions& Options() const { return m_options; }
+
+	private:
+		CHttpClient(const CHttpClient&);
+		CHttpClient& operator=(const CHttpClient&);
+
+		struct Exchange
+		{
+			uint64_t id;
+			HttpRequest* request;
+			HttpCompletion completion;
+			bool retried;
+			HttpTiming timing;
+		};
+
+		enum ConnectionState
+		{
+			CONNECTION_CONNECTING,
+			CONNECTION_IDLE,
+			CONNECTION_SENDING,
+			CONNECTION_RECEIVING
+		};
+
+		struct Connection
+		{
+			SocketHandle socket;
+			ConnectionState state;
+			unsigned interest;
+			bool reused;
+			std::unique_ptr<Exchange> exchange;
+			std::string head;
+			size_t headSent;
+			size_t bodySent;
+			size_t suffixSent;
+			CHttpResponseParser parser;
+			std::chrono::steady_clock::time_point lastActivity;
+		};
+
+		void Loop();
+		void Dispatch();
+		void CancelExchanges(const std::vector<uint64_t>& exchanges);
+		Connection* OpenConnection(BsStatus& status);
+		void Assign(Connection* connection, std::unique_ptr<Exchange> exchange);
+		void HandleEvent(Connection* connection, unsigned events);
+		void Send(Connection* connection);
+		void ReceiveResponse(Connection* connection);
+		void SetInterest(Connection* connection, unsigned interest);
+		void Finish(Connection* connection, BsStatus status);
+		void Fail(Connection* connection, BsStatus status);
+		void CloseConnection(Connection* connection);
+		void Complete(std::unique_ptr<Exchange> exchange, BsStatus status, HttpResponse& response);
+		void CheckTimeouts();
+
+		HttpClientOptions m_options;
+		std::string m_hostHeader;
+		CPoller m_poller;
+		std::thread m_thread;
+		std::atomic<bool> m_stopping;
+		bool m_running;
+
+		// handed over from Submit
+		std::mutex m_lock;
+		std::deque<std::unique_ptr<Exchange> > m_submitted;
+		std::vector<uint64_t> m_cancels;
+		uint64_t m_nextId;
+
+		// owned by the loop thread
+		std::deque<std::unique_ptr<Exchange> > m_pending;
+		std::list<std::unique_ptr<Connection> > m_connections;
+		std::vector<Connection*> m_idle;
+		std::vector<char> m_receiveBuffer;
+
+		mutable std::mutex m_statsLock;
+		HttpStats m_stats;
+	};
+}
@@ -0,0 +1,548 @@
+// Json.cpp : Implementation of the JSON helpers and CJsonReader
+
+#include "Json.h"
+
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		// Ticks from 0001-01-01 (DateTime's epoch) to 1601-01-01 (FILETIME's).
+		const int64_t FILETIME_EPOCH_TICKS = 504911232000000000LL;
+
+		const int64_t TICKS_PER_SECOND = 10000000LL;
+		const int64_t SECONDS_PER_DAY = 86400;
+
+		// Days from 0001-01-01 to 1970-01-01.
+		const int64_t UNIX_EPOCH_DAYS = 719162;
+
+		bool NeedsEscape(unsigned char c)
+		{
+			return c < 0x20 || c == '"' || c == '\\' || c == 0xC2 || c == 0xE2;
+		}
+
+		void AppendDigits(std::string& json, int64_t value, int digits)
+		{
+			char text[20];
+			for (int i = digits - 1; i >= 0; --i)
+			{
+				text[i] = (char)('0' + value % 10);
+				value /= 10;
+			}
+			json.append(text, digits);
+		}
+
+		// Proleptic Gregorian date of a day counted from 1970-01-01.
+		void CivilFromDays(int64_t days, int64_t& year, unsigned& month, unsigned& day)
+		{
+			days += 719468;
+			int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+			unsigned dayOfEra = (unsigned)(days - era * 146097);
+			unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+			unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+			unsigned shiftedMonth = (5 * dayOfYear + 2) / 153;
+
+			day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+			month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+			year = (int64_t)yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+		}
+
+		// Days from 1970-01-01 to a proleptic Gregorian date.
+		int64_t DaysFromCivil(int64_t year, unsigned month, unsigned day)
+		{
+			year -= month <= 2 ? 1 : 0;
+			int64_t era = (year >= 0 ? year : year - 399) / 400;
+			unsigned yearOfEra = (unsigned)(year - era * 400);
+			unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+			unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+			return era * 146097 + (int64_t)dayOfEra - 719468;
+		}
+
+		// Reads count digits at text; false when one is not a digit.
+		bool ReadDigits(const char*& text, const char* end, int count, int64_t& value)
+		{
+			value = 0;
+			for (int i = 0; i < count; ++i, ++text)
+			{
+				if (text == end || *text < '0' || *text > '9')
+					return false;
+				value = value * 10 + (*text - '0');
+			}
+			return true;
+		}
+
+		void AppendUtf8CodePoint(std::string& text, uint32_t codePoint)
+		{
+			if (codePoint < 0x80)
+				text += (char)codePoint;
+			else if (codePoint < 0x800)
+			{
+				text += (char)(0xC0 | (codePoint >> 6));
+				text += (char)(0x80 | (codePoint & 0x3F));
+			}
+			else if (codePoint < 0x10000)
+			{
+				text += (char)(0xE0 | (codePoint >> 12));
+				text += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+				text += (char)(0x80 | (codePoint & 0x3F));
+			}
+			else
+			{
+				text += (char)(0xF0 | (codePoint >> 18));
+				text += (char)(0x80 | ((codePoint >> 12) & 0x3F));
+				text += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+				text += (char)(0x80 | (codePoint & 0x3F));
+			}
+		}
+
+		bool ReadHex4(const char*& text, const char* end, uint32_t& value)
+		{
+			value = 0;
+			for (int i = 0; i < 4; ++i, ++text)
+			{
+				if (text == end)
+					return false;
+				char c = *text;
+				uint32_t digit;
+				if (c >= '0' && c <= '9')
+					digit = (uint32_t)(c - '0');
+				else if (c >= 'a' && c <= 'f')
+					digit = (uint32_t)(c - 'a' + 10);
+				else if (c >= 'A' && c <= 'F')
+					digit = (uint32_t)(c - 'A' + 10);
+				else
+					return false;
+				value = value * 16 + digit;
+			}
+			return true;
+		}
+
+		// Nesting Skip descends into before it calls the document malformed.
+		const int MAX_DEPTH = 256;
+	}
+
+	void AppendJsonString(std::string& json, const char* text, size_t length)
+	{
+		static const char HEX[] = "0123456789abcdef";
+
+		json += '"';
+		size_t start = 0;
+		for (size_t i = 0; i < length; ++i)
+		{
+			unsigned char c = (unsigned char)text[i];
+			if (!NeedsEscape(c))
+				continue;
+
+			// U+0085 is C2 85, U+2028 and U+2029 are E2 80 A8 and E2 80 A9.
+			unsigned codePoint = c;
+			size_t width = 1;
+			if (c == 0xC2)
+			{
+				if (i + 1 >= length || (unsigned char)text[i + 1] != 0x85)
+					continue;
+				codePoint = 0x85;
+				width = 2;
+			}
+			else if (c == 0xE2)
+			{
+				if (i + 2 >= length || (unsigned char)text[i + 1] != 0x80 ||
+					((unsigned char)text[i + 2] != 0xA8 && (unsigned char)text[i + 2] != 0xA9))
+					continue;
+				codePoint = (unsigned char)text[i + 2] == 0xA8 ? 0x2028 : 0x2029;
+				width = 3;
+			}
+
+			json.append(text + start, i - start);
+			switch (codePoint)
+			{
+			case '"': json += "\\\""; break;
+			case '\\': json += "\\\\"; break;
+			case '\b': json += "\\b"; break;
+			case '\f': json += "\\f"; break;
+			case '\n': json += "\\n"; break;
+			case '\r': json += "\\r"; break;
+			case '\t': json += "\\t"; break;
+			default:
+				json += "\\u";
+				json += HEX[(codePoint >> 12) & 0xF];
+				json += HEX[(codePoint >> 8) & 0xF];
+				json += HEX[(codePoint >> 4) & 0xF];
+				json += HEX[codePoint & 0xF];
+				break;
+			}
+			i += width - 1;
+			start = i + 1;
+		}
+		json.append(text + start, length - start);
+		json += '"';
+	}
+
+	void AppendJsonDate(std::string& json, int64_t fileTime)
+	{
+		int64_t ticks = fileTime + FILETIME_EPOCH_TICKS;
+		if (ticks < 0)
+			ticks = 0;
+
+		int64_t seconds = ticks / TICKS_PER_SECOND;
+		int64_t fraction = ticks % TICKS_PER_SECOND;
+		int64_t days = seconds / SECONDS_PER_DAY;
+		int64_t secondOfDay = seconds % SECONDS_PER_DAY;
+
+		int64_t year = 0;
+		unsigned month = 0;
+		unsigned day = 0;
+		CivilFromDays(days - UNIX_EPOCH_DAYS, year, month, day);
+
+		json += '"';
+		AppendDigits(json, year, 4);
+		json += '-';
+		AppendDigits(json, month, 2);
+		json += '-';
+		AppendDigits(json, day, 2);
+		json += 'T';
+		AppendDigits(json, secondOfDay / 3600, 2);
+		json += ':';
+		AppendDigits(json, secondOfDay / 60 % 60, 2);
+		json += ':';
+		AppendDigits(json, secondOfDay % 60, 2);
+
+		if (fraction != 0)
+		{
+			int digits = 7;
+			while (fraction % 10 == 0)
+			{
+				fraction /= 10;
+				--digits;
+			}
+			json += '.';
+			AppendDigits(json, fraction, digits);
+		}
+		json += "Z\"";
+	}
+
+	//
+	//   FUNCTION: ParseJsonDate(const char*, size_t, int64_t&)
+	//
+	//   PURPOSE: Reads yyyy-MM-ddTHH:mm:ss, an optional fraction of up to
+	//            seven digits and an optional Z or +hh:mm / -hh:mm, and
+	//            takes the offset off to get UTC.
+	//
+	bool ParseJsonDate(const char* text, size_t length, int64_t& fileTime)
+	{
+		const char* end = text + length;
+		int64_t year, month, day, hour, minute, second;
+		if (!ReadDigits(text, end, 4, year) || text == end || *text++ != '-' ||
+			!ReadDigits(text, end, 2, month) || text == end || *text++ != '-' ||
+			!ReadDigits(text, end, 2, day) || text == end || *text++ != 'T' ||
+			!ReadDigits(text, end, 2, hour) || text == end || *text++ != ':' ||
+			!ReadDigits(text, end, 2, minute) || text == end || *text++ != ':' ||
+			!ReadDigits(text, end, 2, second))
+			return false;
+		if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59)
+			return false;
+
+		int64_t fraction = 0;
+		if (text != end && *text == '.')
+		{
+			++text;
+			int digits = 0;
+			for (; text != end && *text >= '0' && *text <= '9'; ++text, ++digits)
+			{
+				if (digits < 7)
+					fraction = fraction * 10 + (*text - '0');
+			}
+			if (digits == 0)
+				return false;
+			for (; digits < 7; ++digits)
+				fraction *= 10;
+		}
+
+		int64_t offsetSeconds = 0;
+		if (text != end && *text == 'Z')
+			++text;
+		else if (text != end && (*text == '+' || *text == '-'))
+		{
+			int64_t sign = *text++ == '-' ? -1 : 1;
+			int64_t offsetHours, offsetMinutes;
+			if (!ReadDigits(text, end, 2, offsetHours) || text == end || *text++ != ':' ||
+				!ReadDigits(text, end, 2, offsetMinutes))
+				return false;
+			offsetSeconds = sign * (offsetHours * 3600 + offsetMinutes * 60);
+		}
+		if (text != end)
+			return false;
+
+		int64_t days = DaysFromCivil(year, (unsigned)month, (unsigned)day) + UNIX_EPOCH_DAYS;
+		int64_t seconds = days * SECONDS_PER_DAY + hour * 3600 + minute * 60 + second - offsetSeconds;
+		fileTime = seconds * TICKS_PER_SECOND + fraction - FILETIME_EPOCH_TICKS;
+		return true;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CJsonReader methods
+	//
+
+	CJsonReader::CJsonReader(const char* data, size_t length)
+		: m_position(data), m_end(data + length), m_depth(0), m_failed(false)
+	{
+		if (length >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0)
+			m_position += 3;
+	}
+
+	void CJsonReader::SkipWhitespace()
+	{
+		while (m_position != m_end && (*m_position == ' ' || *m_position == '\t' || *m_position == '\r' || *m_position == '\n'))
+			++m_position;
+	}
+
+	bool CJsonReader::Fail()
+	{
+		m_failed = true;
+		return false;
+	}
+
+	bool CJsonReader::Expect(char c)
+	{
+		SkipWhitespace();
+		if (m_failed || m_position == m_end || *m_position != c)
+			return Fail();
+		++m_position;
+		return true;
+	}
+
+	bool CJsonReader::ReadLiteral(const char* literal)
+	{
+		size_t length = strlen(literal);
+		if ((size_t)(m_end - m_position) < length || memcmp(m_position, literal, length) != 0)
+			return Fail();
+		m_position += length;
+		return true;
+	}
+
+	JsonToken CJsonReader::Peek()
+	{
+		SkipWhitespace();
+		if (m_failed)
+			return JSON_INVALID;
+		if (m_position == m_end)
+			return JSON_END;
+
+		switch (*m_position)
+		{
+		case '{': return JSON_OBJECT;
+		case '[': return JSON_ARRAY;
+		case '"': return JSON_STRING;
+		case 't': return JSON_TRUE;
+		case 'f': return JSON_FALSE;
+		case 'n': return JSON_NULL;
+		default:
+			return *m_position == '-' || (*m_position >= '0' && *m_position <= '9') ? JSON_NUMBER : JSON_INVALID;
+		}
+	}
+
+	bool CJsonReader::BeginObject()
+	{
+		return Expect('{');
+	}
+
+	bool CJsonReader::NextMember(std::string& name)
+	{
+		SkipWhitespace();
+		if (m_failed || m_position == m_end)
+			return Fail();
+		if (*m_position == ',')
+		{
+			++m_position;
+			SkipWhitespace();
+		}
+		if (m_position != m_end && *m_position == '}')
+		{
+			++m_position;
+			return false;
+		}
+		return Peek() == JSON_STRING ? ReadString(name) && Expect(':') : Fail();
+	}
+
+	bool CJsonReader::BeginArray()
+	{
+		return Expect('[');
+	}
+
+	bool CJsonReader::NextElement()
+	{
+		SkipWhitespace();
+		if (m_failed || m_position == m_end)
+			return Fail();
+		if (*m_position == ',')
+		{
+			++m_position;
+			SkipWhitespace();
+		}
+		if (m_position != m_end && *m_position == ']')
+		{
+			++m_position;
+			return false;
+		}
+		return m_position != m_end || Fail();
+	}
+
+	//
+	//   FUNCTION: CJsonReader::ReadString(std::string&)
+	//
+	//   PURPOSE: Copies the runs between escapes as they are and decodes the
+	//            escapes, joining \u surrogate pairs into one code point.
+	//
+	bool CJsonReader::ReadString(std::string& value)
+	{
+		value.clear();
+		JsonToken token = Peek();
+		if (token == JSON_NULL)
+			return ReadLiteral("null");
+		if (token != JSON_STRING)
+			return Fail();
+
+		++m_position;
+		for (;;)
+		{
+			const char* start = m_position;
+			while (m_position != m_end && *m_position != '"' && *m_position != '\\')
+				++m_position;
+			value.append(start, m_position - start);
+			if (m_position == m_end)
+				return Fail();
+			if (*m_position++ == '"')
+				return true;
+
+			if (m_position == m_end)
+				return Fail();
+			char escape = *m_position++;
+			switch (escape)
+			{
+			case '"': value += '"'; break;
+			case '\\': value += '\\'; break;
+			case '/': value += '/'; break;
+			case 'b': value += '\b'; break;
+			case 'f': value += '\f'; break;
+			case 'n': value += '\n'; break;
+			case 'r': value += '\r'; break;
+			case 't': value += '\t'; break;
+			case 'u':
+			{
+				uint32_t codePoint;
+				if (!ReadHex4(m_position, m_end, codePoint))
+					return Fail();
+				if (codePoint >= 0xD800 && codePoint < 0xDC00 && m_end - m_position >= 6 &&
+					m_position[0] == '\\' && m_position[1] == 'u')
+				{
+					const char* low = m_position + 2;
+					uint32_t second;
+					if (ReadHex4(low, m_end, second) && second >= 0xDC00 && second < 0xE000)
+					{
+						codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (second - 0xDC00);
+						m_position = low;
+					}
+				}
+				// a lone surrogate becomes U+FFFD, as the UTF-8 encoder of
+				// .NET writes it.
+				if (codePoint >= 0xD800 && codePoint < 0xE000)
+					codePoint = 0xFFFD;
+				AppendUtf8CodePoint(value, codePoint);
+				break;
+			}
+			default:
+				return Fail();
+			}
+		}
+	}
+
+	bool CJsonReader::ReadInt64(int64_t& value)
+	{
+		value = 0;
+		JsonToken token = Peek();
+		if (token == JSON_NULL)
+			return ReadLiteral("null");
+		if (token != JSON_NUMBER)
+			return Fail();
+
+		bool negative = *m_position == '-';
+		if (negative)
+			++m_position;
+
+		uint64_t magnitude = 0;
+		const char* digits = m_position;
+		for (; m_position != m_end && *m_position >= '0' && *m_position <= '9'; ++m_position)
+		{
+			uint64_t next = magnitude * 10 + (uint64_t)(*m_position - '0');
+			if (next / 10 != magnitude || next > (uint64_t)INT64_MAX + (negative ? 1 : 0))
+				return Fail();
+			magnitude = next;
+		}
+		if (m_position == digits || (m_position != m_end && (*m_position == '.' || *m_position == 'e' || *m_position == 'E')))
+			return Fail();
+
+		value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+		return true;
+	}
+
+	bool CJsonReader::ReadBool(bool& value)
+	{
+		JsonToken token = Peek();
+		value = token == JSON_TRUE;
+		if (token == JSON_TRUE)
+			return ReadLiteral("true");
+		if (token == JSON_FALSE)
+			return ReadLiteral("false");
+		return Fail();
+	}
+
+	bool CJsonReader::Skip()
+	{
+		std::string text;
+		switch (Peek())
+		{
+		case JSON_OBJECT:
+			if (++m_depth > MAX_DEPTH || !BeginObject())
+				return Fail();
+			while (NextMember(text))
+			{
+				if (!Skip())
+					return false;
+			}
+			--m_depth;
+			return !m_failed;
+
+		case JSON_ARRAY:
+			if (++m_depth > MAX_DEPTH || !BeginArray())
+				return Fail();
+			while (NextElement())
+			{
+				if (!Skip())
+					return false;
+			}
+			--m_depth;
+			return !m_failed;
+
+		case JSON_STRING:
+			return ReadString(text);
+
+		case JSON_NUMBER:
+			++m_position;
+			while (m_position != m_end && strchr("0123456789+-.eE", *m_position) != NULL)
+				++m_position;
+			return true;
+
+		case JSON_TRUE:
+			return ReadLiteral("true");
+
+		case JSON_FALSE:
+			return ReadLiteral("false");
+
+		case JSON_NULL:
+			return ReadLiteral("null");
+
+		default:
+			return Fail();
+		}
+	}
+}
@@ -0,0 +1,91 @@
+// Json.h : Minimal JSON helpers: writing the manifests the client produces
+// and reading the files the managed client wrote.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace BigStash
+{
+	// Appends text (UTF-8) as a quoted JSON string, escaped the way Json.NET
+	// escapes by default: quotes, backslashes, control characters and
+	// U+0085, U+2028 and U+2029. Everything else is copied as is.
+	void AppendJsonString(std::string& json, const char* text, size_t length);
+
+	// Appends a UTC time given in FILETIME ticks the way Json.NET writes a
+	// DateTime of kind Utc: "2015-03-01T12:34:56.1234567Z", trailing zero
+	// fractions dropped.
+	void AppendJsonDate(std::string& json, int64_t fileTime);
+
+	// Parses a DateTime the way Json.NET writes one ("2015-03-01T12:34:56",
+	// up to seven fraction digits, then Z, an offset or nothing) into
+	// FILETIME ticks, UTC. A time without a zone is taken as UTC.
+	bool ParseJsonDate(const char* text, size_t length, int64_t& fileTime);
+
+	enum JsonToken
+	{
+		JSON_END,
+		JSON_OBJECT,
+		JSON_ARRAY,
+		JSON_STRING,
+		JSON_NUMBER,
+		JSON_TRUE,
+		JSON_FALSE,
+		JSON_NULL,
+		JSON_INVALID
+	};
+
+	// CJsonReader
+	//
+	// A pull parser over a document in memory, for the JSON files of the
+	// managed client (LocalUpload): the caller walks the members it knows
+	// and skips the rest, and no tree of the document is built. Once a read
+	// fails every later one does, and Failed tells. A leading UTF-8 BOM is
+	// skipped; separators are checked loosely, as the documents are our own.
+	class CJsonReader
+	{
+	public:
+		CJsonReader(const char* data, size_t length);
+
+		// The kind of the next value, without consuming it.
+		JsonToken Peek();
+
+		bool BeginObject();
+
+		// Reads the name of the next member and the colon after it; false,
+		// having consumed the brace, at the end of the object.
+		bool NextMember(std::string& name);
+
+		bool BeginArray();
+
+		// True when another element follows; false, having consumed the
+		// bracket, at the end of the array.
+		bool NextElement();
+
+		// Unescaped UTF-8. Null reads as an empty string.
+		bool ReadString(std::string& value);
+
+		// Integers only. Null reads as 0.
+		bool ReadInt64(int64_t& value);
+
+		bool ReadBool(bool& value);
+
+		// Skips the next value, whatever it holds.
+		bool Skip();
+
+		bool Failed() const { return m_failed; }
+
+	private:
+		void SkipWhitespace();
+		bool Expect(char c);
+		bool Fail();
+		bool ReadLiteral(const char* literal);
+
+		const char* m_position;
+		const char* m_end;
+		int m_depth;
+		bool m_failed;
+	};
+}
@@ -0,0 +1,296 @@
+// ManifestWriter.cpp : Implementation of CManifestWriter
+
+#include "ManifestWriter.h"
+#include "Json.h"
+
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		// Formatted records are handed to the compressor in chunks this big,
+		// so the lock is not taken per record by the compressor too.
+		const size_t FLUSH_BYTES = 64 * 1024;
+
+		const char MANIFEST_VERSION_DIRECTORIES[] = "2";
+
+		void AppendNumber(std::string& json, uint64_t value)
+		{
+			char text[20];
+			int length = 0;
+			do
+			{
+				text[sizeof(text) - 1 - length++] = (char)('0' + value % 10);
+				value /= 10;
+			}
+			while (value != 0);
+			json.append(text + sizeof(text) - length, length);
+		}
+
+		void AppendString(std::string& json, const char* text)
+		{
+			if (text == NULL)
+				json += "null";
+			else
+				AppendJsonString(json, text, strlen(text));
+		}
+
+		// Splits a path after its last separator, either kind, as the
+		// managed side may hand Windows or POSIX paths.
+		size_t NameOffset(const char* path, size_t length)
+		{
+			for (size_t i = length; i > 0; --i)
+			{
+				if (path[i - 1] == '\\' || path[i - 1] == '/')
+					return i;
+			}
+			return 0;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CManifestWriter methods
+	//
+
+	CManifestWriter::CManifestWriter()
+		: m_open(false), m_error(BS_OK), m_files(0)
+	{
+	}
+
+	BsStatus CManifestWriter::Open(const PathString& path, const std::string& archiveId, int32_t userId,
+		const ManifestOptions& options)
+	{
+		if (m_open)
+			return BS_E_INVALIDARG;
+
+		BsStatus status = m_compressor.Open(path, options.compression);
+		if (status != BS_OK)
+			return status;
+
+		m_options = options;
+		m_open = true;
+		m_error = BS_OK;
+		m_files = 0;
+		m_packs.clear();
+		m_directories.clear();
+		m_directoryOrder.clear();
+
+		m_buffer.clear();
+		m_buffer.reserve(FLUSH_BYTES * 2);
+		m_buffer += "{\"archiveid\":";
+		AppendJsonString(m_buffer, archiveId.data(), archiveId.size());
+		m_buffer += ",\"userid\":";
+		if (userId < 0)
+		{
+			m_buffer += '-';
+			AppendNumber(m_buffer, (uint64_t)(-(int64_t)userId));
+		}
+		else
+			AppendNumber(m_buffer, (uint64_t)userId);
+		if (m_options.directories)
+		{
+			m_buffer += ",\"manifest_version\":";
+			m_buffer += MANIFEST_VERSION_DIRECTORIES;
+		}
+		m_buffer += ",\"files\":[";
+		return BS_OK;
+	}
+
+	uint32_t CManifestWriter::InternDirectory(const std::string& key)
+	{
+		auto found = m_directories.find(key);
+		if (found != m_directories.end())
+			return found->second;
+
+		uint32_t index = (uint32_t)m_directoryOrder.size();
+		auto inserted = m_directories.insert(std::make_pair(key, index));
+		m_directoryOrder.push_back(&inserted.first->first);
+		return index;
+	}
+
+	//
+	//   FUNCTION: CManifestWriter::AddFile(const ManifestFile&)
+	//
+	//   PURPOSE: Formats the record outside the lock, then appends it (with
+	//            its directory index, which needs the table) to the buffer.
+	//            The key drops to "key_name" of its own when it does not
+	//            end with the file name.
+	//
+	BsStatus CManifestWriter::AddFile(const ManifestFile& file)
+	{
+		if (file.keyName == NULL || file.filePath == NULL)
+			return BS_E_INVALIDARG;
+
+		static thread_local std::string record;
+		static thread_local std::string directory;
+		record.clear();
+
+		size_t keyLength = strlen(file.keyName);
+		size_t pathLength = strlen(file.filePath);
+		if (m_options.directories)
+		{
+			size_t nameOffset = NameOffset(file.filePath, pathLength);
+			const char* name = file.filePath + nameOffset;
+			size_t nameLength = pathLength - nameOffset;
+
+			size_t keyPrefix = keyLength - nameLength;
+			bool keyHasName = keyLength >= nameLength && memcmp(file.keyName + keyPrefix, name, nameLength) == 0 &&
+				(keyPrefix == 0 || file.keyName[keyPrefix - 1] == '/');
+
+			directory.assign(file.filePath, nameOffset);
+			directory += '\0';
+			if (keyHasName)
+				directory.append(file.keyName, keyPrefix);
+
+			record += "{\"name\":";
+			AppendJsonString(record, name, nameLength);
+			if (!keyHasName)
+			{
+				record += ",\"key_name\":";
+				AppendJsonString(record, file.keyName, keyLength);
+			}
+		}
+		else
+		{
+			record += "{\"key_name\":";
+			AppendJsonString(record, file.keyName, keyLength);
+			record += ",\"file_path\":";
+			AppendJsonString(record, file.filePath, pathLength);
+		}
+
+		record += ",\"size\":";
+		AppendNumber(record, file.size);
+		record += ",\"last_modified\":";
+		AppendJsonDate(record, file.lastModified);
+		record += ",\"md5\":";
+		AppendString(record, file.md5);
+		if (file.packKey != NULL)
+		{
+			record += ",\"pack_key\":";
+			AppendString(record, file.packKey);
+			record += ",\"pack_offset\":";
+			AppendNumber(record, file.packOffset);
+		}
+		if (file.duplicateOf != NULL)
+		{
+			record += ",\"duplicate_of\":";
+			AppendString(record, file.duplicateOf);
+		}
+		if (file.codec != NULL)
+		{
+			record += ",\"codec\":";
+			AppendString(record, file.codec);
+			record += ",\"original_size\":";
+			AppendNumber(record, file.originalSize);
+		}
+		if (file.encryption != NULL)
+		{
+			record += ",\"encryption\":";
+			AppendString(record, file.encryption);
+			record += ",\"key_id\":";
+			AppendString(record, file.keyId);
+			record += ",\"nonce\":";
+			AppendString(record, file.nonce);
+			record += ",\"part_size\":";
+			AppendNumber(record, file.partSize);
+		}
+		if (m_options.directories)
+			record += ",\"dir\":";
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!m_open)
+			return BS_E_INVALIDARG;
+		if (m_error != BS_OK)
+			return m_error;
+
+		if (m_files++ != 0)
+			m_buffer += ',';
+		m_buffer += record;
+		if (m_options.directories)
+			AppendNumber(m_buffer, InternDirectory(directory));
+		m_buffer += '}';
+
+		return m_buffer.size() >= FLUSH_BYTES ? Flush() : BS_OK;
+	}
+
+	BsStatus CManifestWriter::AddPack(const ManifestPack& pack)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!m_open)
+			return BS_E_INVALIDARG;
+
+		m_packs.push_back(pack);
+		return BS_OK;
+	}
+
+	// Called with the lock held.
+	BsStatus CManifestWriter::Flush()
+	{
+		m_error = m_compressor.Write(m_buffer.data(), m_buffer.size());
+		m_buffer.clear();
+		return m_error;
+	}
+
+	//
+	//   FUNCTION: CManifestWriter::Finish()
+	//
+	//   PURPOSE: Closes the files array and writes the packs (left out when
+	//            there are none, as ShouldSerializePacks does) and the
+	//            directory table after it.
+	//
+	BsStatus CManifestWriter::Finish()
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!m_open)
+			return BS_E_INVALIDARG;
+		m_open = false;
+		if (m_error != BS_OK)
+			return m_error;
+
+		m_buffer += ']';
+		if (!m_packs.empty())
+		{
+			m_buffer += ",\"packs\":[";
+			for (size_t i = 0; i < m_packs.size(); ++i)
+			{
+				const ManifestPack& pack = m_packs[i];
+				m_buffer += i == 0 ? "{\"key_name\":" : ",{\"key_name\":";
+				AppendJsonString(m_buffer, pack.keyName.data(), pack.keyName.size());
+				m_buffer += ",\"size\":";
+				AppendNumber(m_buffer, pack.size);
+				m_buffer += ",\"md5\":";
+				AppendJsonString(m_buffer, pack.md5.data(), pack.md5.size());
+				m_buffer += ",\"file_count\":";
+				AppendNumber(m_buffer, pack.fileCount);
+				m_buffer += '}';
+			}
+			m_buffer += ']';
+		}
+
+		if (m_options.directories)
+		{
+			m_buffer += ",\"dirs\":[";
+			for (size_t i = 0; i < m_directoryOrder.size(); ++i)
+			{
+				const std::string& key = *m_directoryOrder[i];
+				size_t separator = key.find('\0');
+				m_buffer += i == 0 ? "{\"path\":" : ",{\"path\":";
+				AppendJsonString(m_buffer, key.data(), separator);
+				m_buffer += ",\"key_prefix\":";
+				AppendJsonString(m_buffer, key.data() + separator + 1, key.size() - separator - 1);
+				m_buffer += '}';
+
+				if (m_buffer.size() >= FLUSH_BYTES && Flush() != BS_OK)
+					return m_error;
+			}
+			m_buffer += ']';
+		}
+		m_buffer += '}';
+
+		if (Flush() != BS_OK)
+			return m_error;
+		m_error = m_compressor.Finish();
+		return m_error;
+	}
+}
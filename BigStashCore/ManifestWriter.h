@@ -0,0 +1,136 @@
+// ManifestWriter.h : Declaration of CManifestWriter, the streaming archive
+// manifest writer
+
+#pragma once
+
+#include "BlockCompressor.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace BigStash
+{
+	// One file of the manifest, shaped after BigStash.Model.FileManifest.
+	// The strings are UTF-8 and only need to live for the call.
+	struct ManifestFile
+	{
+		ManifestFile()
+			: keyName(""), filePath(""), size(0), lastModified(0), md5(NULL), packKey(NULL), packOffset(0),
+			duplicateOf(NULL), codec(NULL), originalSize(0), encryption(NULL), keyId(NULL), nonce(NULL),
+			partSize(0)
+		{
+		}
+
+		const char* keyName;
+		const char* filePath;
+		uint64_t size;
+
+		// UTC, in FILETIME ticks.
+		int64_t lastModified;
+
+		// Hex; NULL writes null.
+		const char* md5;
+
+		// NULL for a file uploaded as an object of its own.
+		const char* packKey;
+		uint64_t packOffset;
+
+		// Key of the file with the same content that was uploaded in this
+		// one's place (see FindDuplicates); NULL when the file was uploaded.
+		const char* duplicateOf;
+
+		// How the object stores the content (CodecName), NULL when as it is.
+		// size is then the object's size and originalSize the file's.
+		const char* codec;
+		uint64_t originalSize;
+
+		// "aes-256-gcm" when every part of the object is encrypted on its
+		// own (see SealPart), NULL otherwise. keyId names the key, nonce is
+		// the file's in hex and partSize what each part held before its
+		// tag, all a restore needs besides the key.
+		const char* encryption;
+		const char* keyId;
+		const char* nonce;
+		uint64_t partSize;
+	};
+
+	// Shaped after BigStash.Model.PackManifest.
+	struct ManifestPack
+	{
+		ManifestPack() : size(0), fileCount(0) {}
+
+		std::string keyName;
+		uint64_t size;
+		std::string md5;
+		uint32_t fileCount;
+	};
+
+	struct ManifestOptions
+	{
+		ManifestOptions() : directories(false) {}
+
+		CompressorOptions compression;
+
+		// Writes every directory once, in a "dirs" table, and files as a name
+		// and the index of their directory (manifest_version 2). Needs a
+		// reader that knows the format; off, the manifest is the
+		// ArchiveManifest JSON the service reads today.
+		bool directories;
+	};
+
+	// CManifestWriter
+	//
+	// Writes the gzipped archive manifest as the files complete instead of
+	// building the whole ArchiveManifest first and serializing it at the end.
+	// Each record is formatted (as compact JSON) on the calling thread and
+	// handed to a CBlockCompressor, so memory stays at a few compression
+	// blocks plus the directory table however many files the archive has,
+	// and the deflating runs on every core. With directories on, the paths
+	// and key prefixes files share are interned and written once.
+	class CManifestWriter
+	{
+	public:
+		CManifestWriter();
+
+		BsStatus Open(const PathString& path, const std::string& archiveId, int32_t userId,
+			const ManifestOptions& options = ManifestOptions());
+
+		// Thread-safe; files appear in the order they were added.
+		BsStatus AddFile(const ManifestFile& file);
+
+		// Packs are written after the files.
+		BsStatus AddPack(const ManifestPack& pack);
+
+		// Closes the JSON and the compressed stream. The manifest is only
+		// complete after it succeeds.
+		BsStatus Finish();
+
+		uint64_t Files() const { return m_files; }
+		uint32_t Directories() const { return (uint32_t)m_directoryOrder.size(); }
+		uint64_t RawBytes() const { return m_compressor.RawBytes(); }
+		uint64_t CompressedBytes() const { return m_compressor.CompressedBytes(); }
+
+	private:
+		CManifestWriter(const CManifestWriter&);
+		CManifestWriter& operator=(const CManifestWriter&);
+
+		uint32_t InternDirectory(const std::string& key);
+		BsStatus Flush();
+
+		ManifestOptions m_options;
+		CBlockCompressor m_compressor;
+
+		std::mutex m_lock;
+		bool m_open;
+		BsStatus m_error;
+		uint64_t m_files;
+		std::string m_buffer;
+		std::vector<ManifestPack> m_packs;
+
+		// directory path and key prefix, separated by a NUL, to index.
+		std::unordered_map<std::string, uint32_t> m_directories;
+		std::vector<const std::string*> m_directoryOrder;
+	};
+}
@@ -0,0 +1,162 @@
+// Md5.cpp : Implementation of CMd5 and the scalar MD5 kernels.
+
+#include "Md5.h"
+#include "Md5Rounds.h"
+
+#include <cstring>
+
+// The kernels load message words with memcpy, which is a little-endian load
+// on every platform BigStash ships on (x86 and ARM).
+
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_ROTL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define MD5_STEP1(f, a, b, c, d, k, t, s) \
+	a##1 += MD5_##f(b##1, c##1, d##1) + x[k] + t; \
+	a##1 = MD5_ROTL(a##1, s) + b##1;
+
+#define MD5_STEP2(f, a, b, c, d, k, t, s) \
+	a##1 += MD5_##f(b##1, c##1, d##1) + x[k] + t; \
+	a##2 += MD5_##f(b##2, c##2, d##2) + x[k] + t; \
+	a##1 = MD5_ROTL(a##1, s) + b##1; \
+	a##2 = MD5_ROTL(a##2, s) + b##2;
+
+namespace BigStash
+{
+	void Md5Reset(Md5State& state)
+	{
+		state.h[0] = 0x67452301;
+		state.h[1] = 0xefcdab89;
+		state.h[2] = 0x98badcfe;
+		state.h[3] = 0x10325476;
+	}
+
+	void Md5Compress(Md5State& state, const uint8_t* blocks, size_t count)
+	{
+		uint32_t x[16];
+
+		for (size_t n = 0; n < count; ++n, blocks += MD5_BLOCK_SIZE)
+		{
+			memcpy(x, blocks, sizeof(x));
+
+			uint32_t a1 = state.h[0], b1 = state.h[1], c1 = state.h[2], d1 = state.h[3];
+
+			MD5_ROUNDS(MD5_STEP1)
+
+			state.h[0] += a1;
+			state.h[1] += b1;
+			state.h[2] += c1;
+			state.h[3] += d1;
+		}
+	}
+
+	void Md5Compress2(Md5State& first, Md5State& second, const uint8_t* blocks, size_t count)
+	{
+		uint32_t x[16];
+
+		for (size_t n = 0; n < count; ++n, blocks += MD5_BLOCK_SIZE)
+		{
+			memcpy(x, blocks, sizeof(x));
+
+			uint32_t a1 = first.h[0], b1 = first.h[1], c1 = first.h[2], d1 = first.h[3];
+			uint32_t a2 = second.h[0], b2 = second.h[1], c2 = second.h[2], d2 = second.h[3];
+
+			MD5_ROUNDS(MD5_STEP2)
+
+			first.h[0] += a1;
+			first.h[1] += b1;
+			first.h[2] += c1;
+			first.h[3] += d1;
+			second.h[0] += a2;
+			second.h[1] += b2;
+			second.h[2] += c2;
+			second.h[3] += d2;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CMd5 methods
+	//
+
+	void CMd5::Reset()
+	{
+		Md5Reset(m_state);
+		m_length = 0;
+		m_buffered = 0;
+	}
+
+	void CMd5::Update(const void* data, size_t length)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		m_length += length;
+
+		if (m_buffered > 0)
+		{
+			size_t take = MD5_BLOCK_SIZE - m_buffered;
+			if (take > length)
+				take = length;
+
+			memcpy(m_buffer + m_buffered, bytes, take);
+			m_buffered += take;
+			bytes += take;
+			length -= take;
+
+			if (m_buffered < MD5_BLOCK_SIZE)
+				return;
+
+			Md5Compress(m_state, m_buffer, 1);
+			m_buffered = 0;
+		}
+
+		size_t blocks = length / MD5_BLOCK_SIZE;
+		if (blocks > 0)
+		{
+			Md5Compress(m_state, bytes, blocks);
+			bytes += blocks * MD5_BLOCK_SIZE;
+			length -= blocks * MD5_BLOCK_SIZE;
+		}
+
+		if (length > 0)
+		{
+			memcpy(m_buffer, bytes, length);
+			m_buffered = length;
+		}
+	}
+
+	//
+	//   FUNCTION: CMd5::Final(uint8_t[16])
+	//
+	//   PURPOSE: Appends the 0x80 terminator, the zero padding and the bit
+	//            length, and writes the digest. The object is reset.
+	//
+	void CMd5::Final(uint8_t digest[MD5_DIGEST_SIZE])
+	{
+		uint64_t bits = m_length * 8;
+
+		m_buffer[m_buffered++] = 0x80;
+		if (m_buffered > MD5_BLOCK_SIZE - 8)
+		{
+			memset(m_buffer + m_buffered, 0, MD5_BLOCK_SIZE - m_buffered);
+			Md5Compress(m_state, m_buffer, 1);
+			m_buffered = 0;
+		}
+
+		memset(m_buffer + m_buffered, 0, MD5_BLOCK_SIZE - 8 - m_buffered);
+		for (int i = 0; i < 8; ++i)
+			m_buffer[MD5_BLOCK_SIZE - 8 + i] = (uint8_t)(bits >> (8 * i));
+		Md5Compress(m_state, m_buffer, 1);
+
+		memcpy(digest, m_state.h, MD5_DIGEST_SIZE);
+		Reset();
+	}
+
+	void CMd5::Hash(const void* data, size_t length, uint8_t digest[MD5_DIGEST_SIZE])
+	{
+		CMd5 md5;
+		md5.Update(data, length);
+		md5.Final(digest);
+	}
+}
@@ -0,0 +1,60 @@
+// Md5.h : Declaration of CMd5 and the MD5 compression kernels.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace BigStash
+{
+	const size_t MD5_BLOCK_SIZE = 64;
+	const size_t MD5_DIGEST_SIZE = 16;
+
+	struct Md5State
+	{
+		uint32_t h[4];
+	};
+
+	// Resets the state to the MD5 initial values.
+	void Md5Reset(Md5State& state);
+
+	// Compresses count 64 byte blocks into the state.
+	void Md5Compress(Md5State& state, const uint8_t* blocks, size_t count);
+
+	// Compresses the same blocks into two independent states. The two
+	// dependency chains are interleaved, so a file's whole digest and its
+	// current part's digest cost little more than one of them alone.
+	void Md5Compress2(Md5State& first, Md5State& second, const uint8_t* blocks, size_t count);
+
+	// Streaming MD5.
+	class CMd5
+	{
+	public:
+		CMd5() { Reset(); }
+
+		void Reset();
+		void Update(const void* data, size_t length);
+		void Final(uint8_t digest[MD5_DIGEST_SIZE]);
+
+		// One-shot helper.
+		static void Hash(const void* data, size_t length, uint8_t digest[MD5_DIGEST_SIZE]);
+
+	protected:
+		friend class CContentHasher;
+
+		Md5State m_state;
+		uint64_t m_length;
+		uint8_t m_buffer[MD5_BLOCK_SIZE];
+		size_t m_buffered;
+	};
+
+	// Hashes count independent messages. On x86 the messages are spread over
+	// the lanes of an AVX2 (8 lanes) or SSE2 (4 lanes) kernel and a lane is
+	// refilled as soon as its message is done, which is what makes hashing
+	// many small files cheap.
+	void Md5HashMany(const uint8_t* const* messages, const size_t* lengths, size_t count,
+		uint8_t (*digests)[MD5_DIGEST_SIZE]);
+
+	// Number of lanes Md5HashMany uses on this machine.
+	unsigned Md5MultiBufferLanes();
+}
@@ -0,0 +1,287 @@
+// Md5MultiBuffer.cpp : Multi-buffer MD5. Each SIMD lane hashes a different
+// message, so N independent messages are hashed in the time one block step
+// of a single message takes, per lane width.
+
+#include "Md5.h"
+#include "Md5Rounds.h"
+#include "CpuFeatures.h"
+
+#include <cstring>
+
+#if defined(BS_ARCH_X86)
+#include <immintrin.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		// state holds a[lanes], b[lanes], c[lanes], d[lanes].
+		typedef void (*Md5LanesKernel)(uint32_t* state, const uint8_t* const* blocks);
+
+		// Loads word k of every lane's block into words[k][lane].
+		inline void TransposeBlocks(uint32_t* words, const uint8_t* const* blocks, unsigned lanes)
+		{
+			for (unsigned lane = 0; lane < lanes; ++lane)
+			{
+				uint32_t block[16];
+				memcpy(block, blocks[lane], sizeof(block));
+
+				for (unsigned k = 0; k < 16; ++k)
+					words[k * lanes + lane] = block[k];
+			}
+		}
+
+#if defined(BS_ARCH_X86)
+
+#define MD5V_F(x, y, z) V_XOR(z, V_AND(x, V_XOR(y, z)))
+#define MD5V_G(x, y, z) V_XOR(y, V_AND(z, V_XOR(x, y)))
+#define MD5V_H(x, y, z) V_XOR(V_XOR(x, y), z)
+#define MD5V_I(x, y, z) V_XOR(y, V_OR(x, V_XOR(z, ones)))
+
+#define MD5V_STEP(f, a, b, c, d, k, t, s) \
+	a = V_ADD(a, V_ADD(V_ADD(MD5V_##f(b, c, d), x[k]), V_SET1((int)t))); \
+	a = V_ADD(V_OR(V_SLLI(a, s), V_SRLI(a, 32 - s)), b);
+
+#define V_XOR _mm_xor_si128
+#define V_AND _mm_and_si128
+#define V_OR _mm_or_si128
+#define V_ADD _mm_add_epi32
+#define V_SET1 _mm_set1_epi32
+#define V_SLLI _mm_slli_epi32
+#define V_SRLI _mm_srli_epi32
+
+		BS_TARGET("sse2")
+		void Md5LanesSse2(uint32_t* state, const uint8_t* const* blocks)
+		{
+			alignas(16) uint32_t words[16 * 4];
+			TransposeBlocks(words, blocks, 4);
+
+			__m128i x[16];
+			for (unsigned k = 0; k < 16; ++k)
+				x[k] = _mm_load_si128(reinterpret_cast<const __m128i*>(words + k * 4));
+
+			const __m128i ones = _mm_set1_epi32(-1);
+			__m128i* s = reinterpret_cast<__m128i*>(state);
+			__m128i a = _mm_load_si128(s), b = _mm_load_si128(s + 1);
+			__m128i c = _mm_load_si128(s + 2), d = _mm_load_si128(s + 3);
+			__m128i a0 = a, b0 = b, c0 = c, d0 = d;
+
+			MD5_ROUNDS(MD5V_STEP)
+
+			_mm_store_si128(s, _mm_add_epi32(a, a0));
+			_mm_store_si128(s + 1, _mm_add_epi32(b, b0));
+			_mm_store_si128(s + 2, _mm_add_epi32(c, c0));
+			_mm_store_si128(s + 3, _mm_add_epi32(d, d0));
+		}
+
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_ADD
+#undef V_SET1
+#undef V_SLLI
+#undef V_SRLI
+
+#define V_XOR _mm256_xor_si256
+#define V_AND _mm256_and_si256
+#define V_OR _mm256_or_si256
+#define V_ADD _mm256_add_epi32
+#define V_SET1 _mm256_set1_epi32
+#define V_SLLI _mm256_slli_epi32
+#define V_SRLI _mm256_srli_epi32
+
+		BS_TARGET("avx2")
+		void Md5LanesAvx2(uint32_t* state, const uint8_t* const* blocks)
+		{
+			alignas(32) uint32_t words[16 * 8];
+			TransposeBlocks(words, blocks, 8);
+
+			__m256i x[16];
+			for (unsigned k = 0; k < 16; ++k)
+				x[k] = _mm256_load_si256(reinterpret_cast<const __m256i*>(words + k * 8));
+
+			const __m256i ones = _mm256_set1_epi32(-1);
+			__m256i* s = reinterpret_cast<__m256i*>(state);
+			__m256i a = _mm256_load_si256(s), b = _mm256_load_si256(s + 1);
+			__m256i c = _mm256_load_si256(s + 2), d = _mm256_load_si256(s + 3);
+			__m256i a0 = a, b0 = b, c0 = c, d0 = d;
+
+			MD5_ROUNDS(MD5V_STEP)
+
+			_mm256_store_si256(s, _mm256_add_epi32(a, a0));
+			_mm256_store_si256(s + 1, _mm256_add_epi32(b, b0));
+			_mm256_store_si256(s + 2, _mm256_add_epi32(c, c0));
+			_mm256_store_si256(s + 3, _mm256_add_epi32(d, d0));
+		}
+
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_ADD
+#undef V_SET1
+#undef V_SLLI
+#undef V_SRLI
+
+#endif
+
+		void SelectKernel(Md5LanesKernel& kernel, unsigned& lanes)
+		{
+			kernel = NULL;
+			lanes = 1;
+
+#if defined(BS_ARCH_X86)
+			const CpuFeatures& features = GetCpuFeatures();
+			if (features.avx2)
+			{
+				kernel = Md5LanesAvx2;
+				lanes = 8;
+			}
+			else if (features.sse2)
+			{
+				kernel = Md5LanesSse2;
+				lanes = 4;
+			}
+#endif
+		}
+
+		struct Lane
+		{
+			size_t index;
+			const uint8_t* data;
+			size_t blocks;
+			uint8_t tail[2 * MD5_BLOCK_SIZE];
+			size_t tailBlocks;
+			size_t tailPosition;
+			bool active;
+		};
+
+		// Prepares a lane for a message: the whole blocks are read in place,
+		// the rest plus the padding go into the lane's tail buffer.
+		void LoadLane(Lane& lane, size_t index, const uint8_t* data, size_t length)
+		{
+			lane.index = index;
+			lane.data = data;
+			lane.blocks = length / MD5_BLOCK_SIZE;
+
+			size_t rest = length - lane.blocks * MD5_BLOCK_SIZE;
+			lane.tailBlocks = rest + 1 + 8 > MD5_BLOCK_SIZE ? 2 : 1;
+			lane.tailPosition = 0;
+			lane.active = true;
+
+			size_t tailSize = lane.tailBlocks * MD5_BLOCK_SIZE;
+			memset(lane.tail, 0, tailSize);
+			if (rest > 0)
+				memcpy(lane.tail, data + lane.blocks * MD5_BLOCK_SIZE, rest);
+			lane.tail[rest] = 0x80;
+
+			uint64_t bits = (uint64_t)length * 8;
+			for (int i = 0; i < 8; ++i)
+				lane.tail[tailSize - 8 + i] = (uint8_t)(bits >> (8 * i));
+		}
+	}
+
+	unsigned Md5MultiBufferLanes()
+	{
+		Md5LanesKernel kernel;
+		unsigned lanes;
+		SelectKernel(kernel, lanes);
+		return lanes;
+	}
+
+	//
+	//   FUNCTION: Md5HashMany(...)
+	//
+	//   PURPOSE: Keeps every lane of the selected kernel busy with its own
+	//            message, refilling a lane with the next message as soon as
+	//            its last (padded) block has been compressed.
+	//
+	void Md5HashMany(const uint8_t* const* messages, const size_t* lengths, size_t count,
+		uint8_t (*digests)[MD5_DIGEST_SIZE])
+	{
+		Md5LanesKernel kernel;
+		unsigned width;
+		SelectKernel(kernel, width);
+
+		if (kernel == NULL)
+		{
+			for (size_t i = 0; i < count; ++i)
+				CMd5::Hash(messages[i], lengths[i], digests[i]);
+			return;
+		}
+
+		static const uint8_t idleBlock[MD5_BLOCK_SIZE] = { 0 };
+		alignas(32) uint32_t state[4 * 8];
+		const uint8_t* blocks[8];
+		Lane lanes[8];
+
+		Md5State initial;
+		Md5Reset(initial);
+
+		size_t next = 0;
+		unsigned active = 0;
+
+		for (unsigned l = 0; l < width; ++l)
+		{
+			lanes[l].active = false;
+			if (next < count)
+			{
+				LoadLane(lanes[l], next, messages[next], lengths[next]);
+				next++;
+				active++;
+			}
+
+			for (unsigned j = 0; j < 4; ++j)
+				state[j * width + l] = initial.h[j];
+		}
+
+		while (active > 0)
+		{
+			for (unsigned l = 0; l < width; ++l)
+			{
+				const Lane& lane = lanes[l];
+				if (!lane.active)
+					blocks[l] = idleBlock;
+				else if (lane.blocks > 0)
+					blocks[l] = lane.data;
+				else
+					blocks[l] = lane.tail + lane.tailPosition * MD5_BLOCK_SIZE;
+			}
+
+			kernel(state, blocks);
+
+			for (unsigned l = 0; l < width; ++l)
+			{
+				Lane& lane = lanes[l];
+				if (!lane.active)
+					continue;
+
+				if (lane.blocks > 0)
+				{
+					lane.data += MD5_BLOCK_SIZE;
+					lane.blocks--;
+					continue;
+				}
+
+				if (++lane.tailPosition < lane.tailBlocks)
+					continue;
+
+				for (unsigned j = 0; j < 4; ++j)
+					memcpy(digests[lane.index] + 4 * j, &state[j * width + l], 4);
+
+				lane.active = false;
+				active--;
+
+				if (next < count)
+				{
+					LoadLane(lane, next, messages[next], lengths[next]);
+					next++;
+					active++;
+
+					for (unsigned j = 0; j < 4; ++j)
+						state[j * width + l] = initial.h[j];
+				}
+			}
+		}
+	}
+}
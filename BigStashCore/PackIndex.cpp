@@ -0,0 +1,255 @@
+// PackIndex.cpp : Implementation of PlanPacks and CPackIndex
+
+#include "PackIndex.h"
+#include "Encoding.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		const uint8_t INDEX_MAGIC[4] = { 'B', 'S', 'P', 'K' };
+		const uint32_t INDEX_VERSION = 1;
+
+		void PutString(std::vector<uint8_t>& data, const std::string& value)
+		{
+			AppendVarint(data, value.size());
+			data.insert(data.end(), value.begin(), value.end());
+		}
+
+		// Reads the serialized index front to back; any overrun sets failed.
+		class CIndexReader
+		{
+		public:
+			CIndexReader(const uint8_t* data, size_t length) : m_data(data), m_end(data + length), m_failed(false) {}
+
+			bool Failed() const { return m_failed; }
+			bool AtEnd() const { return m_data == m_end; }
+
+			uint64_t Varint()
+			{
+				uint64_t value = 0;
+				if (!ReadVarint(m_data, m_end, value))
+				{
+					m_failed = true;
+					return 0;
+				}
+				return value;
+			}
+
+			bool Bytes(void* buffer, size_t length)
+			{
+				if ((size_t)(m_end - m_data) < length)
+				{
+					m_failed = true;
+					return false;
+				}
+				memcpy(buffer, m_data, length);
+				m_data += length;
+				return true;
+			}
+
+			bool String(std::string& value, size_t length)
+			{
+				if ((size_t)(m_end - m_data) < length)
+				{
+					m_failed = true;
+					return false;
+				}
+				value.append((const char*)m_data, length);
+				m_data += length;
+				return true;
+			}
+
+		private:
+			const uint8_t* m_data;
+			const uint8_t* m_end;
+			bool m_failed;
+		};
+	}
+
+	std::string PackKeyName(uint32_t pack)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "packs/%06u.pack", pack);
+		return name;
+	}
+
+	const PackEntry* CPackIndex::Find(const std::string& key) const
+	{
+		for (const PackEntry& entry : entries)
+		{
+			if (entry.key == key)
+				return &entry;
+		}
+		return NULL;
+	}
+
+	//
+	//   FUNCTION: CPackIndex::Serialize(std::vector<uint8_t>&)
+	//
+	//   PURPOSE: "BSPK", version, then every pack (key, size, entry count,
+	//            MD5) and every entry (shared key prefix, key suffix,
+	//            length, MD5), entries in pack order.
+	//
+	void CPackIndex::Serialize(std::vector<uint8_t>& data) const
+	{
+		data.clear();
+		data.insert(data.end(), INDEX_MAGIC, INDEX_MAGIC + sizeof(INDEX_MAGIC));
+		AppendVarint(data, INDEX_VERSION);
+		AppendVarint(data, packs.size());
+		AppendVarint(data, entries.size());
+
+		for (const PackObject& pack : packs)
+		{
+			PutString(data, pack.key);
+			AppendVarint(data, pack.size);
+			AppendVarint(data, pack.entryCount);
+			data.insert(data.end(), pack.md5, pack.md5 + MD5_DIGEST_SIZE);
+		}
+
+		const std::string* previous = NULL;
+		for (const PackEntry& entry : entries)
+		{
+			size_t shared = 0;
+			if (previous != NULL)
+			{
+				size_t limit = std::min(previous->size(), entry.key.size());
+				while (shared < limit && (*previous)[shared] == entry.key[shared])
+					shared++;
+			}
+
+			AppendVarint(data, shared);
+			PutString(data, entry.key.substr(shared));
+			AppendVarint(data, entry.length);
+			data.insert(data.end(), entry.md5, entry.md5 + MD5_DIGEST_SIZE);
+			previous = &entry.key;
+		}
+	}
+
+	BsStatus CPackIndex::Parse(const uint8_t* data, size_t length, CPackIndex& index)
+	{
+		index.packs.clear();
+		index.entries.clear();
+
+		uint8_t magic[sizeof(INDEX_MAGIC)];
+		CIndexReader reader(data, length);
+		if (!reader.Bytes(magic, sizeof(magic)) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+			reader.Varint() != INDEX_VERSION)
+			return BS_E_CORRUPT;
+
+		uint64_t packCount = reader.Varint();
+		uint64_t entryCount = reader.Varint();
+
+		// every pack and entry takes more than 16 bytes; a count beyond that
+		// is corrupt, not a reason to reserve gigabytes.
+		if (reader.Failed() || packCount > length / MD5_DIGEST_SIZE || entryCount > length / MD5_DIGEST_SIZE)
+			return BS_E_CORRUPT;
+
+		index.packs.resize((size_t)packCount);
+		uint64_t entriesInPacks = 0;
+		for (PackObject& pack : index.packs)
+		{
+			uint64_t keyLength = reader.Varint();
+			reader.String(pack.key, (size_t)std::min<uint64_t>(keyLength, length));
+			pack.size = reader.Varint();
+			uint64_t count = reader.Varint();
+			reader.Bytes(pack.md5, MD5_DIGEST_SIZE);
+			if (reader.Failed() || count > entryCount - entriesInPacks)
+				return BS_E_CORRUPT;
+
+			pack.firstEntry = (uint32_t)entriesInPacks;
+			pack.entryCount = (uint32_t)count;
+			entriesInPacks += count;
+		}
+		if (entriesInPacks != entryCount)
+			return BS_E_CORRUPT;
+
+		index.entries.resize((size_t)entryCount);
+		size_t entry = 0;
+		for (uint32_t pack = 0; pack < index.packs.size(); ++pack)
+		{
+			uint64_t offset = 0;
+			for (uint32_t i = 0; i < index.packs[pack].entryCount; ++i, ++entry)
+			{
+				PackEntry& current = index.entries[entry];
+				uint64_t shared = reader.Varint();
+				uint64_t suffix = reader.Varint();
+				if (reader.Failed() || (entry == 0 ? shared != 0 : shared > index.entries[entry - 1].key.size()))
+					return BS_E_CORRUPT;
+
+				if (shared != 0)
+					current.key.assign(index.entries[entry - 1].key, 0, (size_t)shared);
+				reader.String(current.key, (size_t)std::min<uint64_t>(suffix, length));
+				current.length = reader.Varint();
+				reader.Bytes(current.md5, MD5_DIGEST_SIZE);
+				if (reader.Failed() || current.length > index.packs[pack].size - offset)
+					return BS_E_CORRUPT;
+
+				current.pack = pack;
+				current.offset = offset;
+				current.source = 0;
+				offset += current.length;
+			}
+
+			if (offset != index.packs[pack].size)
+				return BS_E_CORRUPT;
+		}
+
+		return reader.AtEnd() ? BS_OK : BS_E_CORRUPT;
+	}
+
+	void PlanPacks(const std::vector<PackInput>& files, const PackOptions& options, CPackIndex& index,
+		std::vector<size_t>& unpacked)
+	{
+		index.packs.clear();
+		index.entries.clear();
+		unpacked.clear();
+
+		std::vector<size_t> small;
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			if (files[i].size <= options.smallFileLimit && files[i].size <= options.packSize)
+				small.push_back(i);
+			else
+				unpacked.push_back(i);
+		}
+
+		std::sort(small.begin(), small.end(), [&files](size_t left, size_t right)
+		{
+			return files[left].key < files[right].key;
+		});
+
+		index.entries.reserve(small.size());
+		for (size_t source : small)
+		{
+			const PackInput& file = files[source];
+			if (index.packs.empty() || index.packs.back().size + file.size > options.packSize)
+			{
+				PackObject pack;
+				pack.key = options.keyPrefix + PackKeyName((uint32_t)index.packs.size());
+				pack.size = 0;
+				pack.firstEntry = (uint32_t)index.entries.size();
+				pack.entryCount = 0;
+				memset(pack.md5, 0, sizeof(pack.md5));
+				index.packs.push_back(pack);
+			}
+
+			PackObject& pack = index.packs.back();
+			PackEntry entry;
+			entry.key = file.key;
+			entry.pack = (uint32_t)(index.packs.size() - 1);
+			entry.offset = pack.size;
+			entry.length = file.size;
+			memset(entry.md5, 0, sizeof(entry.md5));
+			entry.source = source;
+			index.entries.push_back(entry);
+
+			pack.size += file.size;
+			pack.entryCount++;
+		}
+	}
+}
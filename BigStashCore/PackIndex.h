@@ -0,0 +1,98 @@
+// PackIndex.h : Declaration of PlanPacks and CPackIndex, small files packed
+// into larger S3 objects
+
+#pragma once
+
+#include "Md5.h"
+#include "Platform.h"
+
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// Marks a file that is not in a pack.
+	const uint32_t PACK_NONE = 0xFFFFFFFF;
+
+	struct PackOptions
+	{
+		PackOptions() : smallFileLimit(64 * 1024), packSize(16 * 1024 * 1024), workers(4) {}
+
+		// Files up to this size are packed; larger ones keep their own object.
+		uint64_t smallFileLimit;
+
+		// A pack is closed before it grows past this size. One PutObject
+		// each, so at most 5 GB.
+		uint64_t packSize;
+
+		// Packs read and uploaded at once, each holding a packSize buffer.
+		unsigned workers;
+
+		// Pack n is stored as keyPrefix + PackKeyName(n).
+		std::string keyPrefix;
+	};
+
+	struct PackInput
+	{
+		PathString path;
+		std::string key;
+		uint64_t size;
+	};
+
+	// Where one packed file lives. Entries are kept in pack order, and a
+	// file's offset follows from the lengths before it in its pack.
+	struct PackEntry
+	{
+		std::string key;
+		uint32_t pack;
+		uint64_t offset;
+		uint64_t length;
+		uint8_t md5[MD5_DIGEST_SIZE];
+
+		// Index of the file in the PlanPacks input; not serialized.
+		size_t source;
+	};
+
+	struct PackObject
+	{
+		std::string key;
+		uint64_t size;
+		uint32_t firstEntry;
+		uint32_t entryCount;
+		uint8_t md5[MD5_DIGEST_SIZE];
+
+		// As S3 returned it, once uploaded; not serialized.
+		std::string etag;
+	};
+
+	// "packs/000042.pack" for pack 42.
+	std::string PackKeyName(uint32_t pack);
+
+	// CPackIndex
+	//
+	// The packs of an archive and the files in them. The serialized form is
+	// compact enough to keep next to the manifest for hundreds of thousands
+	// of files: keys are front coded against the previous key, lengths are
+	// varints, offsets are implied, and only the MD5s are stored whole.
+	class CPackIndex
+	{
+	public:
+		std::vector<PackObject> packs;
+		std::vector<PackEntry> entries;
+
+		// The pack and offset of a key, NULL when it is not packed. Linear;
+		// for lookups in bulk, sort a copy.
+		const PackEntry* Find(const std::string& key) const;
+
+		void Serialize(std::vector<uint8_t>& data) const;
+
+		// BS_E_CORRUPT on anything malformed or truncated.
+		static BsStatus Parse(const uint8_t* data, size_t length, CPackIndex& index);
+	};
+
+	// Picks the files up to smallFileLimit, orders them by key (files of one
+	// directory end up next to each other) and fills packs of up to packSize
+	// in that order. unpacked receives the indexes of the other files.
+	void PlanPacks(const std::vector<PackInput>& files, const PackOptions& options, CPackIndex& index,
+		std::vector<size_t>& unpacked);
+}
@@ -0,0 +1,160 @@
+// PackUploader.cpp : Implementation of CPackUploader
+
+#include "PackUploader.h"
+#include "BufferPool.h"
+#include "File.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+namespace BigStash
+{
+	CPackUploader::CPackUploader(CS3Client& client, const PackOptions& options)
+		: m_client(client), m_options(options), m_requests(0)
+	{
+		m_options.workers = std::max(1u, m_options.workers);
+	}
+
+	//
+	//   FUNCTION: CPackUploader::BuildPack(...)
+	//
+	//   PURPOSE: Reads the files of one pack into buffer at their offsets and
+	//            hashes every file and the pack.
+	//
+	BsStatus CPackUploader::BuildPack(const std::vector<PackInput>& files, CPackIndex& index, uint32_t pack,
+		uint8_t* buffer)
+	{
+		PackObject& object = index.packs[pack];
+		std::vector<const uint8_t*> messages(object.entryCount);
+		std::vector<size_t> lengths(object.entryCount);
+
+		for (uint32_t i = 0; i < object.entryCount; ++i)
+		{
+			const PackEntry& entry = index.entries[object.firstEntry + i];
+			uint8_t* target = buffer + entry.offset;
+			messages[i] = target;
+			lengths[i] = (size_t)entry.length;
+
+			CFile file;
+			uint64_t size = 0;
+			BsStatus status = file.Open(files[entry.source].path.c_str());
+			if (status == BS_OK)
+				status = file.GetSize(size);
+			if (status != BS_OK)
+				return status;
+			if (size != entry.length)
+				return BS_E_CORRUPT;
+
+			size_t done = 0;
+			while (done < entry.length)
+			{
+				size_t read = 0;
+				status = file.ReadAt(done, target + done, (size_t)entry.length - done, read);
+				if (status != BS_OK)
+					return status;
+				if (read == 0)
+					return BS_E_CORRUPT;
+				done += read;
+			}
+		}
+
+		std::vector<uint8_t> digests((size_t)object.entryCount * MD5_DIGEST_SIZE);
+		Md5HashMany(messages.data(), lengths.data(), object.entryCount, (uint8_t(*)[MD5_DIGEST_SIZE])digests.data());
+		for (uint32_t i = 0; i < object.entryCount; ++i)
+			memcpy(index.entries[object.firstEntry + i].md5, &digests[i * MD5_DIGEST_SIZE], MD5_DIGEST_SIZE);
+
+		CMd5::Hash(buffer, (size_t)object.size, object.md5);
+		return BS_OK;
+	}
+
+	//
+	//   FUNCTION: CPackUploader::Upload(...)
+	//
+	//   PURPOSE: Runs the workers over the packs in order. Each holds one
+	//            pooled buffer of packSize bytes; the first failure stops
+	//            them all.
+	//
+	BsStatus CPackUploader::Upload(const std::string& bucket, const std::vector<PackInput>& files,
+		CPackIndex& index, const PackCallback& onPack, const std::atomic<bool>* cancel)
+	{
+		m_requests = 0;
+		if (index.packs.empty())
+			return BS_OK;
+
+		uint64_t largest = 0;
+		for (const PackObject& pack : index.packs)
+			largest = std::max(largest, pack.size);
+		if (largest > SIZE_MAX)
+			return BS_E_INVALIDARG;
+
+		unsigned workers = (unsigned)std::min<size_t>(m_options.workers, index.packs.size());
+		CBufferPool pool(std::max<size_t>((size_t)largest, 1), workers);
+
+		CUploadScheduler* scheduler = m_client.Options().scheduler;
+		uint32_t upload = scheduler != NULL ? scheduler->RegisterUpload(m_client.Options().bandwidthLimit) : 0;
+
+		std::atomic<uint32_t> next(0);
+		std::mutex lock;
+		BsStatus failure = BS_OK;
+		std::atomic<bool> failed(false);
+
+		auto work = [&]()
+		{
+			uint8_t* buffer = pool.Acquire();
+			for (;;)
+			{
+				uint32_t pack = next++;
+				if (pack >= index.packs.size() || failed)
+					break;
+
+				BsStatus status = cancel != NULL && cancel->load() ? BS_E_CANCELLED : BS_OK;
+				if (status == BS_OK)
+					status = BuildPack(files, index, pack, buffer);
+
+				PackObject& object = index.packs[pack];
+				SchedulerTicket ticket;
+				if (status == BS_OK && scheduler != NULL)
+					status = scheduler->Acquire(upload, object.size, ticket, cancel);
+
+				if (status == BS_OK)
+				{
+					std::string etag;
+					m_requests++;
+					status = m_client.PutObject(bucket, object.key, buffer, (size_t)object.size, object.md5, etag);
+					if (scheduler != NULL)
+						scheduler->Release(ticket, status == BS_OK || status == BS_E_CORRUPT);
+
+					std::lock_guard<std::mutex> guard(lock);
+					if (status == BS_OK)
+					{
+						object.etag = etag;
+						if (onPack)
+							onPack(object);
+					}
+				}
+
+				if (status != BS_OK)
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (failure == BS_OK)
+						failure = status;
+					failed = true;
+				}
+			}
+			pool.Release(buffer);
+		};
+
+		std::vector<std::thread> threads;
+		for (unsigned i = 1; i < workers; ++i)
+			threads.push_back(std::thread(work));
+		work();
+		for (std::thread& thread : threads)
+			thread.join();
+
+		if (scheduler != NULL)
+			scheduler->UnregisterUpload(upload);
+		return failure;
+	}
+}
@@ -0,0 +1,52 @@
+// PackUploader.h : Declaration of CPackUploader
+
+#pragma once
+
+#include "PackIndex.h"
+#include "S3Client.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// Called once a pack is on S3, from the worker that uploaded it; calls
+	// are serialized.
+	typedef std::function<void(const PackObject& pack)> PackCallback;
+
+	// CPackUploader
+	//
+	// Uploads the packs PlanPacks laid out. Each worker takes the next pack,
+	// reads its files into one buffer at their planned offsets, hashes the
+	// files with the multi-buffer MD5 kernel and the pack with a Content-MD5
+	// for S3, and puts the pack as one object; while one worker waits on S3
+	// the others read. A file whose size changed since the scan fails the
+	// upload with BS_E_CORRUPT, as its planned offsets no longer hold. With
+	// a scheduler on the client every pack takes a slot.
+	class CPackUploader
+	{
+	public:
+		CPackUploader(CS3Client& client, const PackOptions& options);
+
+		// Fills in the MD5s of index's entries and packs and the packs'
+		// ETags. files is the PlanPacks input. Stops at the first pack that
+		// fails, or when cancel becomes true.
+		BsStatus Upload(const std::string& bucket, const std::vector<PackInput>& files, CPackIndex& index,
+			const PackCallback& onPack = PackCallback(), const std::atomic<bool>* cancel = NULL);
+
+		// Requests made by the last Upload.
+		uint64_t Requests() const { return m_requests; }
+
+	private:
+		CPackUploader(const CPackUploader&);
+		CPackUploader& operator=(const CPackUploader&);
+
+		BsStatus BuildPack(const std::vector<PackInput>& files, CPackIndex& index, uint32_t pack, uint8_t* buffer);
+
+		CS3Client& m_client;
+		PackOptions m_options;
+		std::atomic<uint64_t> m_requests;
+	};
+}
@@ -0,0 +1,400 @@
+// PartCompressor.cpp : Implementation of CPartCompressor
+
+#include "PartCompressor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		struct Signature
+		{
+			size_t offset;
+			const char* magic;
+			size_t length;
+			const char* format;
+		};
+
+		// Formats that are compressed already. Office documents, jar and apk
+		// files are zip archives.
+		const Signature SIGNATURES[] =
+		{
+			{ 0, "\x1F\x8B", 2, "gzip" },
+			{ 0, "\x28\xB5\x2F\xFD", 4, "zstd" },
+			{ 0, "\xFD" "7zXZ\x00", 6, "xz" },
+			{ 0, "BZh", 3, "bzip2" },
+			{ 0, "\x04\x22\x4D\x18", 4, "lz4" },
+			{ 0, "PK\x03\x04", 4, "zip" },
+			{ 0, "7z\xBC\xAF\x27\x1C", 6, "7z" },
+			{ 0, "Rar!\x1A\x07", 6, "rar" },
+			{ 0, "MSCF", 4, "cab" },
+			{ 0, "\xFF\xD8\xFF", 3, "jpeg" },
+			{ 0, "\x89PNG", 4, "png" },
+			{ 0, "GIF8", 4, "gif" },
+			{ 8, "WEBP", 4, "webp" },
+			{ 4, "ftyp", 4, "mp4" },
+			{ 0, "\x1A\x45\xDF\xA3", 4, "matroska" },
+			{ 0, "ID3", 3, "mp3" },
+			{ 0, "OggS", 4, "ogg" },
+			{ 0, "fLaC", 4, "flac" }
+		};
+
+		const char* KnownFormat(const uint8_t* data, size_t length)
+		{
+			for (const Signature& signature : SIGNATURES)
+			{
+				if (length >= signature.offset + signature.length &&
+					memcmp(data + signature.offset, signature.magic, signature.length) == 0)
+					return signature.format;
+			}
+			return NULL;
+		}
+
+		// Four tables, so runs of the same byte do not wait on one counter.
+		double Entropy(const uint8_t* data, size_t length)
+		{
+			if (length == 0)
+				return 0;
+
+			uint32_t counts[4][256];
+			memset(counts, 0, sizeof(counts));
+			size_t i = 0;
+			for (; i + 4 <= length; i += 4)
+			{
+				++counts[0][data[i]];
+				++counts[1][data[i + 1]];
+				++counts[2][data[i + 2]];
+				++counts[3][data[i + 3]];
+			}
+			for (; i < length; ++i)
+				++counts[0][data[i]];
+
+			double entropy = 0;
+			for (int value = 0; value < 256; ++value)
+			{
+				uint32_t count = counts[0][value] + counts[1][value] + counts[2][value] + counts[3][value];
+				if (count != 0)
+				{
+					double p = (double)count / length;
+					entropy -= p * std::log2(p);
+				}
+			}
+			return entropy;
+		}
+	}
+
+	const char* CodecName(ContentCodec codec)
+	{
+		switch (codec)
+		{
+		case CODEC_GZIP:
+			return "gzip";
+		case CODEC_ZSTD:
+			return "zstd";
+		default:
+			return NULL;
+		}
+	}
+
+	void SniffContent(const uint8_t* data, size_t length, double maxEntropy, SniffResult& result)
+	{
+		result.format = KnownFormat(data, length);
+		result.entropy = Entropy(data, length);
+		result.compressible = result.format == NULL && result.entropy <= maxEntropy;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CPartCompressor methods
+	//
+
+	CPartCompressor::CPartCompressor(CBufferPool& pool)
+		: CPartReader(pool), m_input(NULL), m_codec(CODEC_NONE), m_current(NULL), m_rawBytes(0), m_storedBytes(0)
+	{
+	}
+
+	CPartCompressor::~CPartCompressor()
+	{
+		Close();
+	}
+
+	BsStatus CPartCompressor::Open(CPartReader& input, const PartCompressorOptions& options)
+	{
+		Close();
+
+		size_t tagSize = options.encryption.cipher != NULL ? GCM_TAG_SIZE : 0;
+		if (options.partSize == 0 || options.partSize % MD5_BLOCK_SIZE != 0 ||
+			options.partSize + tagSize > m_pool.BufferSize())
+			return BS_E_INVALIDARG;
+		if (!CBlockCompressor::IsSupported(options.compression.format))
+			return options.compression.format == COMPRESSION_ZSTD ? BS_E_NOTSUPPORTED : BS_E_INVALIDARG;
+
+		m_input = &input;
+		m_compressorOptions = options;
+		m_options = PartReaderOptions();
+		m_options.computeMd5 = options.computeMd5;
+		m_options.computeSha256 = options.computeSha256;
+		m_options.encryption = options.encryption;
+		m_fileSize = input.FileSize();
+
+		m_codec = CODEC_NONE;
+		m_sniff = SniffResult();
+		m_output.clear();
+		m_current = NULL;
+		m_rawBytes = 0;
+		m_storedBytes = 0;
+
+		m_ready.clear();
+		m_cancel = false;
+		m_done = false;
+		m_status = BS_OK;
+		m_haveDigest = false;
+		m_hasher.reset();
+		if (options.computeMd5)
+			m_hasher.reset(new CContentHasher(options.partSize));
+
+		m_thread = std::thread(&CPartCompressor::PumpLoop, this);
+		return BS_OK;
+	}
+
+	void CPartCompressor::Close()
+	{
+		CPartReader::Close();
+
+		if (m_current != NULL)
+		{
+			FreeStorage(*m_current);
+			m_current = NULL;
+		}
+		m_input = NULL;
+	}
+
+	//
+	//   FUNCTION: CPartCompressor::PumpLoop()
+	//
+	//   PURPOSE: Compressor thread. Holds the input back until sniffBytes of
+	//            it (or all of it) are in, decides, and from then on hands
+	//            every input part to the compressor, or straight to the
+	//            output when the content is stored as it is.
+	//
+	void CPartCompressor::PumpLoop()
+	{
+		BsStatus status = BS_OK;
+		bool decided = false;
+		std::vector<uint8_t> pending;
+
+		for (;;)
+		{
+			if (m_cancel)
+			{
+				status = BS_E_CANCELLED;
+				break;
+			}
+
+			PartData* part;
+			status = m_input->Next(part);
+			if (status == BS_E_NOMOREITEMS)
+			{
+				status = BS_OK;
+				break;
+			}
+			if (status != BS_OK)
+				break;
+
+			m_rawBytes += part->length;
+			if (decided)
+				status = Consume(part->data, part->length);
+			else
+			{
+				pending.insert(pending.end(), part->data, part->data + part->length);
+				if (pending.size() >= m_compressorOptions.sniffBytes)
+				{
+					decided = true;
+					status = Decide(pending);
+					if (status == BS_OK)
+						status = Consume(pending.data(), pending.size());
+					std::vector<uint8_t>().swap(pending);
+				}
+			}
+			m_input->Release(part);
+
+			if (status != BS_OK)
+				break;
+		}
+
+		if (status == BS_OK && !decided)
+		{
+			decided = true;
+			status = Decide(pending);
+			if (status == BS_OK)
+				status = Consume(pending.data(), pending.size());
+		}
+
+		// after a failure the output only refuses what is still coming.
+		if (status != BS_OK)
+			m_cancel = true;
+		if (decided && m_codec != CODEC_NONE)
+		{
+			BsStatus finished = m_compressor.Finish();
+			if (status == BS_OK)
+				status = finished;
+		}
+		if (status == BS_OK)
+			status = FinishPart(true);
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_haveDigest = status == BS_OK && m_hasher;
+			m_status = status;
+			m_done = true;
+		}
+		m_readyChanged.notify_all();
+	}
+
+	BsStatus CPartCompressor::Decide(const std::vector<uint8_t>& sample)
+	{
+		// an empty file stays empty rather than becoming a gzip header.
+		size_t length = std::min(sample.size(), m_compressorOptions.sniffBytes);
+		if (sample.empty())
+			m_sniff.compressible = false;
+		else if (length != 0)
+			SniffContent(sample.data(), length, m_compressorOptions.maxEntropy, m_sniff);
+		if (!m_sniff.compressible)
+			return BS_OK;
+
+		m_codec = m_compressorOptions.compression.format == COMPRESSION_ZSTD ? CODEC_ZSTD : CODEC_GZIP;
+		return m_compressor.Open([this](const uint8_t* data, size_t length)
+		{
+			return Deliver(data, length);
+		}, m_compressorOptions.compression);
+	}
+
+	BsStatus CPartCompressor::Consume(const uint8_t* data, size_t length)
+	{
+		if (m_codec == CODEC_NONE)
+			return Deliver(data, length);
+		return m_compressor.Write(data, length);
+	}
+
+	//
+	//   FUNCTION: CPartCompressor::Deliver(const uint8_t*, size_t)
+	//
+	//   PURPOSE: Appends stored bytes to the part being filled, taking a
+	//            buffer from the pool (and waiting for one the uploader gives
+	//            back) when it needs a new part.
+	//
+	BsStatus CPartCompressor::Deliver(const uint8_t* data, size_t length)
+	{
+		while (length != 0)
+		{
+			if (m_cancel)
+				return BS_E_CANCELLED;
+
+			if (m_current == NULL)
+			{
+				BsStatus status = NewPart();
+				if (status != BS_OK)
+					return status;
+			}
+
+			size_t chunk = (size_t)std::min<uint64_t>(length, m_compressorOptions.partSize - m_current->length);
+			memcpy(m_current->buffer + m_current->length, data, chunk);
+			m_current->length += chunk;
+			m_storedBytes += chunk;
+			data += chunk;
+			length -= chunk;
+
+			if (m_current->length == m_compressorOptions.partSize)
+			{
+				BsStatus status = FinishPart(false);
+				if (status != BS_OK)
+					return status;
+			}
+		}
+		return BS_OK;
+	}
+
+	BsStatus CPartCompressor::NewPart()
+	{
+		if (!m_output.empty() && m_compressorOptions.partSize < m_compressorOptions.minPartSize)
+			return BS_E_INVALIDARG;
+
+		uint8_t* buffer = m_pool.Acquire(&m_cancel);
+		if (buffer == NULL)
+			return BS_E_CANCELLED;
+
+		m_output.push_back(PartData());
+		m_current = &m_output.back();
+		memset(m_current, 0, sizeof(PartData));
+		m_current->partNumber = (uint32_t)m_output.size();
+		m_current->offset = m_storedBytes;
+		m_current->buffer = buffer;
+		m_current->data = buffer;
+		return BS_OK;
+	}
+
+	//
+	//   FUNCTION: CPartCompressor::FinishPart(bool)
+	//
+	//   PURPOSE: Hashes (and encrypts) the part being filled and queues it.
+	//            The last part may be short, or empty when the stored
+	//            content is.
+	//
+	BsStatus CPartCompressor::FinishPart(bool last)
+	{
+		if (last && m_current == NULL && !m_output.empty())
+		{
+			if (m_hasher)
+				m_hasher->Finish(m_digest);
+			return BS_OK;
+		}
+
+		if (m_current == NULL)
+		{
+			BsStatus status = NewPart();
+			if (status != BS_OK)
+				return status;
+		}
+
+		PartData& part = *m_current;
+		if (m_hasher)
+		{
+			m_hasher->Update(part.data, part.length);
+			if (last)
+				m_hasher->Finish(m_digest);
+		}
+
+		bool sealed = m_options.encryption.cipher != NULL;
+		if (sealed)
+		{
+			SealPart(m_options.encryption, part.partNumber, part.buffer, part.length);
+			part.length += GCM_TAG_SIZE;
+		}
+
+		if (m_options.computeSha256)
+		{
+			CSha256::Hash(part.data, part.length, part.sha256);
+			part.hasSha256 = true;
+		}
+		if (m_hasher)
+		{
+			if (sealed)
+				CMd5::Hash(part.data, part.length, part.md5);
+			else if (last)
+				memcpy(part.md5, m_digest.parts.back().md5, MD5_DIGEST_SIZE);
+			else
+				memcpy(part.md5, m_hasher->FinishedPart(part.partNumber - 1).md5, MD5_DIGEST_SIZE);
+			part.hasMd5 = true;
+		}
+
+		m_current = NULL;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_ready.push_back(&part);
+		}
+		m_readyChanged.notify_all();
+		return BS_OK;
+	}
+}
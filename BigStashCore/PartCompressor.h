@@ -0,0 +1,135 @@
+// PartCompressor.h : Declaration of CPartCompressor, the compression stage
+// between the part reader and the uploader
+
+#pragma once
+
+#include "BlockCompressor.h"
+#include "PartReader.h"
+
+#include <deque>
+
+namespace BigStash
+{
+	// How a file's content is stored in its object.
+	enum ContentCodec
+	{
+		CODEC_NONE = BS_CODEC_NONE,
+		CODEC_GZIP = BS_CODEC_GZIP,
+		CODEC_ZSTD = BS_CODEC_ZSTD
+	};
+
+	// The manifest's name of the codec ("gzip", "zstd"), NULL for none.
+	const char* CodecName(ContentCodec codec);
+
+	struct SniffResult
+	{
+		SniffResult() : entropy(0), format(NULL), compressible(true) {}
+
+		// Order-0 entropy of the sample, in bits per byte (8 for random).
+		double entropy;
+
+		// The compressed format the sample starts with ("jpeg", "zip"...),
+		// NULL when it is none of them.
+		const char* format;
+
+		bool compressible;
+	};
+
+	// Guesses whether the content the sample starts is worth compressing:
+	// not when it is a compressed format (archives, images, audio, video) or
+	// when its bytes are closer to random than maxEntropy.
+	void SniffContent(const uint8_t* data, size_t length, double maxEntropy, SniffResult& result);
+
+	struct PartCompressorOptions
+	{
+		PartCompressorOptions()
+			: partSize(8 * 1024 * 1024), minPartSize(0), sniffBytes(256 * 1024), maxEntropy(7.5),
+			computeMd5(true), computeSha256(false)
+		{
+			// The fast end of either codec: the stage has to keep up with
+			// the link, and most of the gain is in the first levels.
+			compression.format = CBlockCompressor::IsSupported(COMPRESSION_ZSTD) ? COMPRESSION_ZSTD : COMPRESSION_GZIP;
+			compression.level = compression.format == COMPRESSION_ZSTD ? 3 : 1;
+		}
+
+		CompressorOptions compression;
+
+		// Size of the parts handed out, all but the last. A multiple of 64
+		// bytes, no larger than the pool's buffers.
+		uint64_t partSize;
+
+		// The smallest part allowed before the last one. How many parts the
+		// output takes is only known as it is produced, so with a partSize
+		// under it the output fails with BS_E_INVALIDARG once it needs a
+		// second part.
+		uint64_t minPartSize;
+
+		// Bytes of the file sniffed before deciding to compress it; 0
+		// compresses whatever it is.
+		size_t sniffBytes;
+		double maxEntropy;
+
+		// Digests of the stored parts, as CPartReader computes them.
+		bool computeMd5;
+		bool computeSha256;
+
+		// Encrypts the stored parts, after compression, as CPartReader
+		// does; the pool's buffers then need partSize + GCM_TAG_SIZE bytes.
+		PartEncryption encryption;
+	};
+
+	// CPartCompressor
+	//
+	// Compresses a file on its way to S3. It takes the raw parts of an open
+	// CPartReader, sniffs the first of them, and unless the content looks
+	// incompressible feeds them to a CBlockCompressor (gzip, or zstd when
+	// built with it) whose workers compress on every core. The compressed
+	// stream is cut into parts of partSize bytes in buffers of the pool,
+	// which are handed out the way CPartReader hands out its own, so
+	// CS3Client::UploadParts sends them as they are. Content that is not
+	// worth compressing passes through unchanged. Reading, compressing and
+	// sending all overlap; memory is the pool plus a few blocks per worker.
+	class CPartCompressor : public CPartReader
+	{
+	public:
+		// The pool's buffers hold one part of the output.
+		explicit CPartCompressor(CBufferPool& pool);
+		~CPartCompressor();
+
+		// input must be open on the whole file, in order, and is drained by
+		// the compressor's thread until it is closed.
+		BsStatus Open(CPartReader& input, const PartCompressorOptions& options = PartCompressorOptions());
+
+		void Close();
+
+		// What the content was stored as, once Next has returned a part (or
+		// BS_E_NOMOREITEMS).
+		ContentCodec Codec() const { return m_codec; }
+		const SniffResult& Sniff() const { return m_sniff; }
+
+		// Bytes taken from the input and handed out so far, before the tags
+		// of encrypted parts.
+		uint64_t RawBytes() const { return m_rawBytes; }
+		uint64_t StoredBytes() const { return m_storedBytes; }
+
+	protected:
+		void PumpLoop();
+		BsStatus Decide(const std::vector<uint8_t>& sample);
+		BsStatus Consume(const uint8_t* data, size_t length);
+		BsStatus Deliver(const uint8_t* data, size_t length);
+		BsStatus NewPart();
+		BsStatus FinishPart(bool last);
+
+		CPartReader* m_input;
+		PartCompressorOptions m_compressorOptions;
+		CBlockCompressor m_compressor;
+		ContentCodec m_codec;
+		SniffResult m_sniff;
+
+		// pump and output threads, never both at once.
+		std::deque<PartData> m_output;
+		PartData* m_current;
+		std::atomic<uint64_t> m_rawBytes;
+		std::atomic<uint64_t> m_storedBytes;
+	};
+}
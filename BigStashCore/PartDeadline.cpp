@@ -0,0 +1,119 @@
+// PartDeadline.cpp : Implementation of CPartDeadline and CRetryBackoff
+
+#include "PartDeadline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace BigStash
+{
+	namespace
+	{
+		// Recent attempts the deadline is learned from.
+		const size_t SAMPLE_WINDOW = 128;
+
+		uint64_t SplitMix64(uint64_t& state)
+		{
+			uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+		// Backoffs created in the same nanosecond still draw apart.
+		std::atomic<uint64_t> g_backoffSeed(0);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CPartDeadline methods
+	//
+
+	CPartDeadline::CPartDeadline(const HedgeOptions& options)
+		: m_options(options), m_next(0)
+	{
+		m_options.percentile = std::max(0.0, std::min(m_options.percentile, 100.0));
+		m_options.minSamples = std::max(1u, m_options.minSamples);
+		m_samples.reserve(SAMPLE_WINDOW);
+	}
+
+	void CPartDeadline::Record(uint64_t bytes, int64_t nanoseconds)
+	{
+		Sample sample;
+		sample.bytes = bytes;
+		sample.nanoseconds = nanoseconds;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_samples.size() < SAMPLE_WINDOW)
+			m_samples.push_back(sample);
+		else
+			m_samples[m_next] = sample;
+		m_next = (m_next + 1) % SAMPLE_WINDOW;
+	}
+
+	//
+	//   FUNCTION: CPartDeadline::Deadline(uint64_t)
+	//
+	//   PURPOSE: factor times the percentile of the recent attempts between
+	//            half and twice the size, scaled to the size, and at least
+	//            minDelayMs. Scaling covers the spread within the range; the
+	//            percentile is taken over the times, not the rates, as the
+	//            fixed cost of a request dominates small parts.
+	//
+	int64_t CPartDeadline::Deadline(uint64_t bytes) const
+	{
+		if (!Enabled())
+			return 0;
+
+		std::vector<double> times;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			if (m_samples.size() < m_options.minSamples)
+				return 0;
+
+			times.reserve(m_samples.size());
+			for (const Sample& sample : m_samples)
+			{
+				if (sample.bytes * 2 < bytes || sample.bytes > bytes * 2)
+					continue;
+
+				double scale = sample.bytes != 0 && bytes > sample.bytes ? (double)bytes / sample.bytes : 1.0;
+				times.push_back((double)sample.nanoseconds * scale);
+			}
+		}
+
+		if (times.size() < m_options.minSamples)
+			return 0;
+
+		size_t rank = (size_t)std::ceil(m_options.percentile / 100.0 * times.size());
+		rank = std::min(std::max(rank, (size_t)1), times.size()) - 1;
+		std::nth_element(times.begin(), times.begin() + rank, times.end());
+
+		int64_t deadline = (int64_t)(times[rank] * m_options.factor);
+		return std::max(deadline, (int64_t)m_options.minDelayMs * 1000000);
+	}
+
+	size_t CPartDeadline::Samples() const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_samples.size();
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CRetryBackoff methods
+	//
+
+	CRetryBackoff::CRetryBackoff(unsigned baseMs, unsigned capMs)
+		: m_base(std::max(1u, baseMs)), m_cap(std::max(baseMs, capMs)), m_last(m_base)
+	{
+		m_state = (uint64_t)MonotonicNanoseconds() ^ (g_backoffSeed.fetch_add(1) * 0xD1B54A32D192ED03ull);
+	}
+
+	std::chrono::milliseconds CRetryBackoff::Next()
+	{
+		uint64_t upper = std::max((uint64_t)m_base, (uint64_t)m_last * 3);
+		uint64_t delay = m_base + SplitMix64(m_state) % (upper - m_base + 1);
+		m_last = (unsigned)std::min(delay, (uint64_t)m_cap);
+		return std::chrono::milliseconds(m_last);
+	}
+}
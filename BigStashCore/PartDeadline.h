@@ -0,0 +1,95 @@
+// PartDeadline.h : Declaration of CPartDeadline and CRetryBackoff, when a
+// part upload is late and how long to wait before trying it again
+
+#pragma once
+
+#include "Platform.h"
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace BigStash
+{
+	struct HedgeOptions
+	{
+		HedgeOptions() : factor(3.0), percentile(95.0), minDelayMs(250), minSamples(16), maxInFlight(2) {}
+
+		// A part is late after factor times the percentile of the recent
+		// parts of about its size; 0 turns hedging off.
+		double factor;
+		double percentile;
+
+		// Never sooner than this after the part was sent.
+		unsigned minDelayMs;
+
+		// Parts of about the size that must have been timed first.
+		unsigned minSamples;
+
+		// Duplicates in flight at once for each UploadParts call.
+		unsigned maxInFlight;
+	};
+
+	// CPartDeadline
+	//
+	// The deadline model of part uploads: how long the recent successful
+	// attempts took, from the submit to the response, with their sizes.
+	// Deadline looks only at the samples within a factor of two of the
+	// part's size, so the smaller last part of a file is not held to the
+	// others' times. A part past its deadline is a straggler worth sending
+	// again: slow sockets, a bad S3 front end, a lost packet waiting for a
+	// retransmission. Thread safe; one model serves a client's uploads.
+	class CPartDeadline
+	{
+	public:
+		explicit CPartDeadline(const HedgeOptions& options = HedgeOptions());
+
+		const HedgeOptions& Options() const { return m_options; }
+		bool Enabled() const { return m_options.factor > 0; }
+
+		void Record(uint64_t bytes, int64_t nanoseconds);
+
+		// Nanoseconds after its submit a part of bytes is late; 0 while the
+		// model has too few samples to tell.
+		int64_t Deadline(uint64_t bytes) const;
+
+		size_t Samples() const;
+
+	private:
+		CPartDeadline(const CPartDeadline&);
+		CPartDeadline& operator=(const CPartDeadline&);
+
+		struct Sample
+		{
+			uint64_t bytes;
+			int64_t nanoseconds;
+		};
+
+		HedgeOptions m_options;
+
+		mutable std::mutex m_lock;
+		std::vector<Sample> m_samples;
+		size_t m_next;
+	};
+
+	// CRetryBackoff
+	//
+	// Decorrelated jitter: each pause is drawn between the base and three
+	// times the pause before, and capped. Unlike a doubling schedule the
+	// pauses of parts that failed together (a 503 SlowDown burst) spread out
+	// instead of coming back in step. One per request being retried; not
+	// thread safe.
+	class CRetryBackoff
+	{
+	public:
+		explicit CRetryBackoff(unsigned baseMs = 100, unsigned capMs = 20000);
+
+		std::chrono::milliseconds Next();
+
+	private:
+		unsigned m_base;
+		unsigned m_cap;
+		unsigned m_last;
+		uint64_t m_state;
+	};
+}
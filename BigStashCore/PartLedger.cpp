@@ -0,0 +1,294 @@
+// PartLedger.cpp : Implementation of CPartLedger
+
+#include "PartLedger.h"
+#include "Encoding.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		// The hex digest of an ETag that is a plain MD5 ("...", 32 digits),
+		// lowercased; empty for the ETag of a multipart object or any other.
+		std::string Md5OfETag(const std::string& etag)
+		{
+			size_t start = !etag.empty() && etag[0] == '"' ? 1 : 0;
+			size_t length = etag.size() - 2 * start;
+			if (length != 2 * MD5_DIGEST_SIZE || (start != 0 && etag.back() != '"'))
+				return std::string();
+
+			std::string hex = etag.substr(start, length);
+			for (char& c : hex)
+			{
+				if (c >= 'A' && c <= 'F')
+					c = (char)(c - 'A' + 'a');
+				else if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+					return std::string();
+			}
+			return hex;
+		}
+
+		// False when the part's MD5 is not the one its ETag holds.
+		bool DigestAgrees(const S3Part& part, bool etagsAreMd5)
+		{
+			if (!etagsAreMd5 || !part.hasMd5)
+				return true;
+
+			std::string hex = Md5OfETag(part.etag);
+			return hex.empty() || hex == HexEncode(part.md5, MD5_DIGEST_SIZE);
+		}
+
+		// The recorded parts are the listed ones, with digests that agree.
+		bool SameParts(const std::vector<S3Part>& listed, const std::vector<S3Part>& recorded, bool etagsAreMd5)
+		{
+			if (listed.size() != recorded.size())
+				return false;
+
+			for (size_t i = 0; i < listed.size(); ++i)
+			{
+				if (listed[i].partNumber != recorded[i].partNumber || listed[i].size != recorded[i].size ||
+					listed[i].etag != recorded[i].etag || !DigestAgrees(recorded[i], etagsAreMd5))
+					return false;
+			}
+			return true;
+		}
+
+		// The ETag S3 gives an object completed from these parts: the MD5 of
+		// their digests, and their count. Empty when a part has no digest.
+		std::string MultipartETag(const std::vector<S3Part>& parts)
+		{
+			CMd5 digests;
+			for (const S3Part& part : parts)
+			{
+				if (!part.hasMd5)
+					return std::string();
+				digests.Update(part.md5, MD5_DIGEST_SIZE);
+			}
+
+			uint8_t digest[MD5_DIGEST_SIZE];
+			digests.Final(digest);
+			return HexEncode(digest, MD5_DIGEST_SIZE) + "-" + std::to_string(parts.size());
+		}
+
+		std::string Unquoted(const std::string& etag)
+		{
+			if (etag.size() >= 2 && etag.front() == '"' && etag.back() == '"')
+				return etag.substr(1, etag.size() - 2);
+			return etag;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CPartLedger methods
+	//
+
+	CPartLedger::CPartLedger(CResumeJournal& journal, const LedgerOptions& options)
+		: m_journal(journal), m_options(options), m_resumes(0), m_listings(0), m_repairs(0), m_completes(0),
+		m_completeRetries(0)
+	{
+	}
+
+	BsStatus CPartLedger::StartFile(uint32_t file, uint64_t partSize, const std::string& uploadId, uint64_t* sequence)
+	{
+		JournalRecord record;
+		record.type = JOURNAL_FILE_STARTED;
+		record.file = file;
+		record.size = partSize;
+		record.text = uploadId;
+		return m_journal.Append(record, sequence);
+	}
+
+	BsStatus CPartLedger::RecordPart(uint32_t file, const S3Part& part, uint64_t* sequence)
+	{
+		JournalRecord record;
+		record.type = JOURNAL_PART_COMPLETED;
+		record.file = file;
+		record.partNumber = part.partNumber;
+		record.size = part.size;
+		record.text = part.etag;
+		record.hasMd5 = part.hasMd5;
+		if (part.hasMd5)
+			memcpy(record.md5, part.md5, MD5_DIGEST_SIZE);
+		return m_journal.Append(record, sequence);
+	}
+
+	//
+	//   FUNCTION: CPartLedger::Plan(uint32_t, uint64_t, LedgerResume&)
+	//
+	//   PURPOSE: Marks the recorded parts in a bitmap of the layout the
+	//            recorded part size gives the file, which also checks them,
+	//            and lists what is left. Makes no request.
+	//
+	BsStatus CPartLedger::Plan(uint32_t file, uint64_t fileSize, LedgerResume& resume) const
+	{
+		JournalFileState state;
+		if (!m_journal.GetFile(file, state) || !state.started || state.completed)
+			return BS_E_NOTFOUND;
+
+		resume = LedgerResume();
+		resume.uploadId = state.uploadId;
+		if (PartLayout::FromPartSize(fileSize, state.partSize, resume.layout) != BS_OK)
+			return BS_E_CORRUPT;
+
+		CPartBitmap bitmap(resume.layout);
+		for (const S3Part& part : state.parts)
+		{
+			if (part.size < m_options.partOverhead ||
+				bitmap.MarkCompleted(part.partNumber, part.size - m_options.partOverhead) != BS_OK ||
+				!DigestAgrees(part, m_options.etagsAreMd5))
+				return BS_E_CORRUPT;
+		}
+
+		bitmap.RemainingParts(resume.remaining);
+		resume.uploadedBytes = bitmap.CompletedBytes();
+		resume.parts.swap(state.parts);
+		return BS_OK;
+	}
+
+	BsStatus CPartLedger::Resume(CS3Client& client, const std::string& bucket, const std::string& key, uint32_t file,
+		uint64_t fileSize, LedgerResume& resume)
+	{
+		uint64_t count = ++m_resumes;
+
+		BsStatus status = Plan(file, fileSize, resume);
+		if (status == BS_E_NOTFOUND)
+			return status;
+
+		bool sampled = m_options.verifyEvery != 0 && count % m_options.verifyEvery == 0;
+		if (status == BS_OK && !sampled)
+			return BS_OK;
+
+		return Verify(client, bucket, key, file, fileSize, resume);
+	}
+
+	//
+	//   FUNCTION: CPartLedger::Verify(...)
+	//
+	//   PURPOSE: Compares the journal's parts with the listing. When they
+	//            differ the file is started again under the same upload ID,
+	//            followed by the listed parts, so a replay ends up with the
+	//            listing whatever it read before.
+	//
+	BsStatus CPartLedger::Verify(CS3Client& client, const std::string& bucket, const std::string& key, uint32_t file,
+		uint64_t fileSize, LedgerResume& resume)
+	{
+		JournalFileState state;
+		if (!m_journal.GetFile(file, state) || !state.started || state.completed)
+			return BS_E_NOTFOUND;
+
+		std::vector<S3Part> listed;
+		m_listings++;
+		BsStatus status = client.ListParts(bucket, key, state.uploadId, listed);
+		if (status == BS_E_NOTFOUND)
+		{
+			// aborted, or expired by a lifecycle rule: the file starts over.
+			JournalRecord record;
+			record.type = JOURNAL_FILE_RESET;
+			record.file = file;
+			status = m_journal.Append(record);
+			return status == BS_OK ? BS_E_NOTFOUND : status;
+		}
+		if (status != BS_OK)
+			return status;
+
+		std::sort(listed.begin(), listed.end(), [](const S3Part& left, const S3Part& right)
+		{
+			return left.partNumber < right.partNumber;
+		});
+
+		bool repaired = !SameParts(listed, state.parts, m_options.etagsAreMd5);
+		if (repaired)
+		{
+			m_repairs++;
+			status = StartFile(file, state.partSize, state.uploadId);
+
+			size_t recorded = 0;
+			for (S3Part& part : listed)
+			{
+				while (recorded < state.parts.size() && state.parts[recorded].partNumber < part.partNumber)
+					recorded++;
+				if (recorded < state.parts.size() && state.parts[recorded].partNumber == part.partNumber &&
+					state.parts[recorded].etag == part.etag && state.parts[recorded].size == part.size &&
+					state.parts[recorded].hasMd5 && DigestAgrees(state.parts[recorded], m_options.etagsAreMd5))
+				{
+					memcpy(part.md5, state.parts[recorded].md5, MD5_DIGEST_SIZE);
+					part.hasMd5 = true;
+				}
+
+				if (status == BS_OK)
+					status = RecordPart(file, part);
+			}
+			if (status != BS_OK)
+				return status;
+		}
+
+		status = Plan(file, fileSize, resume);
+		resume.source = repaired ? LEDGER_REPAIRED : LEDGER_VERIFIED;
+		return status;
+	}
+
+	//
+	//   FUNCTION: CPartLedger::Complete(...)
+	//
+	//   PURPOSE: Completes from the journal's parts. A refusal (InvalidPart,
+	//            InvalidPartOrder: a 400) means the journal is ahead of what
+	//            S3 holds; the parts are listed once and, when they still
+	//            cover the file, Complete is tried with the listed ones.
+	//
+	BsStatus CPartLedger::Complete(CS3Client& client, const std::string& bucket, const std::string& key, uint32_t file,
+		uint64_t fileSize, const std::string& md5Hex, std::string& etag)
+	{
+		m_completes++;
+
+		LedgerResume resume;
+		BsStatus status = Plan(file, fileSize, resume);
+		if (status == BS_E_CORRUPT)
+			status = Verify(client, bucket, key, file, fileSize, resume);
+		if (status != BS_OK)
+			return status;
+
+		for (bool verified = resume.source != LEDGER_LOCAL; ; verified = true)
+		{
+			if (!resume.remaining.empty())
+				return BS_E_INVALIDARG;
+
+			status = client.CompleteMultipartUpload(bucket, key, resume.uploadId, resume.parts, etag);
+			if (status != BS_E_INVALIDARG || verified)
+				break;
+
+			m_completeRetries++;
+			status = Verify(client, bucket, key, file, fileSize, resume);
+			if (status != BS_OK)
+				return status;
+		}
+		if (status != BS_OK)
+			return status;
+
+		if (m_options.etagsAreMd5)
+		{
+			std::string expected = MultipartETag(resume.parts);
+			if (!expected.empty() && expected != Unquoted(etag))
+				return BS_E_CORRUPT;
+		}
+
+		JournalRecord record;
+		record.type = JOURNAL_FILE_COMPLETED;
+		record.file = file;
+		record.size = fileSize;
+		record.text = md5Hex;
+		return m_journal.Append(record);
+	}
+
+	LedgerStats CPartLedger::Stats() const
+	{
+		LedgerStats stats;
+		stats.resumes = m_resumes;
+		stats.listings = m_listings;
+		stats.repairs = m_repairs;
+		stats.completes = m_completes;
+		stats.completeRetries = m_completeRetries;
+		return stats;
+	}
+}
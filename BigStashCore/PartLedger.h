@@ -0,0 +1,145 @@
+// PartLedger.h : Declaration of CPartLedger, resuming and completing
+// multipart uploads from the journal instead of ListParts
+
+#pragma once
+
+#include "PartPlanner.h"
+#include "ResumeJournal.h"
+#include "S3Client.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// Where a resume plan came from.
+	enum LedgerSource
+	{
+		// The journal alone; no request was made.
+		LEDGER_LOCAL = 0,
+
+		// The parts were listed and the journal agreed.
+		LEDGER_VERIFIED = 1,
+
+		// The parts were listed and the journal was corrected to them.
+		LEDGER_REPAIRED = 2
+	};
+
+	struct LedgerOptions
+	{
+		LedgerOptions() : verifyEvery(0), partOverhead(0), etagsAreMd5(true) {}
+
+		// Every n-th Resume lists the parts anyway, so a journal that drifted
+		// from S3 without anything showing it is caught on a sample of the
+		// files; 0 lists only when the journal does not add up.
+		unsigned verifyEvery;
+
+		// Bytes a stored part carries over its share of the file: the GCM
+		// tag of encrypted uploads.
+		uint32_t partOverhead;
+
+		// The ETag of a part is the MD5 of its body, as on buckets without
+		// SSE-KMS. The recorded digests are then checked against the ETags,
+		// and Complete checks the object's ETag against them.
+		bool etagsAreMd5;
+	};
+
+	struct LedgerResume
+	{
+		LedgerResume() : uploadedBytes(0), source(LEDGER_LOCAL) {}
+
+		std::string uploadId;
+		PartLayout layout;
+
+		// The parts S3 holds, in part number order.
+		std::vector<S3Part> parts;
+
+		// The parts still to upload, in part number order.
+		std::vector<PartSpan> remaining;
+		uint64_t uploadedBytes;
+		LedgerSource source;
+	};
+
+	struct LedgerStats
+	{
+		uint64_t resumes;
+		uint64_t listings;
+		uint64_t repairs;
+		uint64_t completes;
+		uint64_t completeRetries;
+	};
+
+	// CPartLedger
+	//
+	// The parts of every upload in progress as the journal recorded them
+	// when S3 accepted them: number, size, ETag and the MD5 of the body.
+	// That is all a resume and the final CompleteMultipartUpload need, so
+	// neither lists the parts first, which on a restart with thousands of
+	// unfinished files is thousands of round trips before the first byte
+	// goes out. The listing becomes the check instead: when the journal
+	// contradicts itself, on a sample of the resumes (verifyEvery), and
+	// when S3 refuses the parts Complete names. The journal may lag S3 (a
+	// crash between the part's answer and its record; the part is sent
+	// again) but never lead it, as records are appended only for accepted
+	// parts. Thread safe, as long as a file being verified is not also
+	// being uploaded.
+	class CPartLedger
+	{
+	public:
+		explicit CPartLedger(CResumeJournal& journal, const LedgerOptions& options = LedgerOptions());
+
+		const LedgerOptions& Options() const { return m_options; }
+
+		// Records a new upload of the file, forgetting the parts of any
+		// earlier one.
+		BsStatus StartFile(uint32_t file, uint64_t partSize, const std::string& uploadId, uint64_t* sequence = NULL);
+
+		// Records a part S3 accepted; UploadParts' onPart hands them over.
+		BsStatus RecordPart(uint32_t file, const S3Part& part, uint64_t* sequence = NULL);
+
+		// Plans the rest of the file's upload from the journal alone.
+		// BS_E_NOTFOUND when no upload of it was started or it completed,
+		// BS_E_CORRUPT when the recorded parts do not fit the layout of a
+		// file of fileSize or a part's MD5 contradicts its ETag.
+		BsStatus Plan(uint32_t file, uint64_t fileSize, LedgerResume& resume) const;
+
+		// Plan, falling back to Verify when the journal does not add up or
+		// the resume is one of the sampled ones. BS_E_NOTFOUND, with the
+		// file reset in the journal, when S3 no longer knows the upload.
+		BsStatus Resume(CS3Client& client, const std::string& bucket, const std::string& key, uint32_t file,
+			uint64_t fileSize, LedgerResume& resume);
+
+		// Lists the parts and replaces the journal's with them when they
+		// differ, keeping the MD5 of the parts whose ETag matches; then
+		// plans. The ETags listed are the truth: a part recorded with
+		// another ETag is one S3 no longer holds.
+		BsStatus Verify(CS3Client& client, const std::string& bucket, const std::string& key, uint32_t file,
+			uint64_t fileSize, LedgerResume& resume);
+
+		// Completes the upload with the recorded parts and records the file
+		// (its MD5 as md5Hex) as completed. When S3 refuses the parts, the
+		// ledger is verified and Complete tried once more; BS_E_INVALIDARG
+		// when parts are still missing, which the next Resume plans.
+		// BS_E_CORRUPT when the object's ETag is not the one the recorded
+		// digests make. BS_E_NOTFOUND when S3 does not know the upload,
+		// which includes one completed right before a crash.
+		BsStatus Complete(CS3Client& client, const std::string& bucket, const std::string& key, uint32_t file,
+			uint64_t fileSize, const std::string& md5Hex, std::string& etag);
+
+		LedgerStats Stats() const;
+
+	private:
+		CPartLedger(const CPartLedger&);
+		CPartLedger& operator=(const CPartLedger&);
+
+		CResumeJournal& m_journal;
+		LedgerOptions m_options;
+
+		std::atomic<uint64_t> m_resumes;
+		std::atomic<uint64_t> m_listings;
+		std::atomic<uint64_t> m_repairs;
+		std::atomic<uint64_t> m_completes;
+		std::atomic<uint64_t> m_completeRetries;
+	};
+}
@@ -0,0 +1,152 @@
+// PartPlanner.cpp : Implementation of the part planner and CPartBitmap
+
+#include "PartPlanner.h"
+
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		uint64_t RoundUp(uint64_t value, uint64_t multiple)
+		{
+			return (value + multiple - 1) / multiple * multiple;
+		}
+
+		unsigned LowestSetBit(uint64_t word)
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward64(&index, word);
+			return (unsigned)index;
+#else
+			return (unsigned)__builtin_ctzll(word);
+#endif
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// PartLayout methods
+	//
+
+	BsStatus PartLayout::FromPartSize(uint64_t fileSize, uint64_t partSize, PartLayout& layout)
+	{
+		if (fileSize > S3_MAX_OBJECT_SIZE || partSize == 0 || partSize > S3_MAX_PART_SIZE)
+			return BS_E_INVALIDARG;
+
+		// only the last part may be under the minimum, so a smaller part
+		// size is fine for a file of one part only.
+		uint64_t partCount = fileSize == 0 ? 1 : (fileSize + partSize - 1) / partSize;
+		if (partCount > S3_MAX_PARTS || (partCount > 1 && partSize < S3_MIN_PART_SIZE))
+			return BS_E_INVALIDARG;
+
+		layout.fileSize = fileSize;
+		layout.partSize = partSize;
+		layout.partCount = (uint32_t)partCount;
+		return BS_OK;
+	}
+
+	PartSpan PartLayout::Part(uint32_t partNumber) const
+	{
+		PartSpan span;
+		span.partNumber = partNumber;
+		span.offset = (uint64_t)(partNumber - 1) * partSize;
+		span.length = std::min(partSize, fileSize - span.offset);
+		return span;
+	}
+
+	//
+	//   FUNCTION: PlanParts(uint64_t, const PartPlanOptions&, PartLayout&)
+	//
+	//   PURPOSE: Sizes parts so one takes about targetPartSeconds on one
+	//            connection, bounded below by the 5 MB S3 minimum and by the
+	//            size that fits the file into 10,000 parts, and above by
+	//            5 GB and by the size that still gives every connection a
+	//            part.
+	//
+	BsStatus PlanParts(uint64_t fileSize, const PartPlanOptions& options, PartLayout& layout)
+	{
+		if (fileSize > S3_MAX_OBJECT_SIZE)
+			return BS_E_NOTSUPPORTED;
+
+		uint64_t smallest = std::max(S3_MIN_PART_SIZE,
+			RoundUp((fileSize + S3_MAX_PARTS - 1) / S3_MAX_PARTS, PART_SIZE_GRANULARITY));
+
+		uint64_t partSize = smallest;
+		if (options.throughput != 0 && options.targetPartSeconds > 0)
+		{
+			unsigned connections = std::max(1u, options.connections);
+			double perConnection = (double)options.throughput / connections;
+			uint64_t wanted = (uint64_t)std::min(perConnection * options.targetPartSeconds, (double)S3_MAX_PART_SIZE);
+
+			// a file smaller than connections * wanted would leave connections idle.
+			uint64_t spread = RoundUp((fileSize + connections - 1) / connections, PART_SIZE_GRANULARITY);
+
+			partSize = RoundUp(std::min(wanted, spread), PART_SIZE_GRANULARITY);
+			partSize = std::min(std::max(partSize, smallest), S3_MAX_PART_SIZE);
+		}
+
+		return PartLayout::FromPartSize(fileSize, partSize, layout);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CPartBitmap methods
+	//
+
+	CPartBitmap::CPartBitmap(const PartLayout& layout)
+		: m_layout(layout), m_words((layout.partCount + 63) / 64, 0), m_completedCount(0), m_completedBytes(0)
+	{
+	}
+
+	BsStatus CPartBitmap::MarkCompleted(uint32_t partNumber, uint64_t size)
+	{
+		if (partNumber == 0 || partNumber > m_layout.partCount)
+			return BS_E_CORRUPT;
+
+		if (size != m_layout.Part(partNumber).length)
+			return BS_E_CORRUPT;
+
+		uint32_t index = partNumber - 1;
+		uint64_t bit = 1ull << (index % 64);
+		if (m_words[index / 64] & bit)
+			return BS_OK;
+
+		m_words[index / 64] |= bit;
+		m_completedCount++;
+		m_completedBytes += size;
+		return BS_OK;
+	}
+
+	bool CPartBitmap::IsCompleted(uint32_t partNumber) const
+	{
+		if (partNumber == 0 || partNumber > m_layout.partCount)
+			return false;
+
+		uint32_t index = partNumber - 1;
+		return (m_words[index / 64] >> (index % 64)) & 1;
+	}
+
+	void CPartBitmap::RemainingParts(std::vector<PartSpan>& parts) const
+	{
+		parts.clear();
+		parts.reserve(m_layout.partCount - m_completedCount);
+
+		for (size_t w = 0; w < m_words.size(); ++w)
+		{
+			uint64_t missing = ~m_words[w];
+			if (w == m_words.size() - 1 && m_layout.partCount % 64 != 0)
+				missing &= (1ull << (m_layout.partCount % 64)) - 1;
+
+			while (missing != 0)
+			{
+				unsigned bit = LowestSetBit(missing);
+				missing &= missing - 1;
+				parts.push_back(m_layout.Part((uint32_t)(w * 64 + bit + 1)));
+			}
+		}
+	}
+}
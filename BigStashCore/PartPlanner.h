@@ -0,0 +1,88 @@
+// PartPlanner.h : Declaration of the multipart part planner and CPartBitmap
+
+#pragma once
+
+#include "PartReader.h"
+
+#include <vector>
+
+namespace BigStash
+{
+	// S3 multipart limits.
+	const uint64_t S3_MIN_PART_SIZE = 5ull * 1024 * 1024;
+	const uint64_t S3_MAX_PART_SIZE = 5ull * 1024 * 1024 * 1024;
+	const uint32_t S3_MAX_PARTS = 10000;
+	const uint64_t S3_MAX_OBJECT_SIZE = 5ull * 1024 * 1024 * 1024 * 1024;
+
+	// Part sizes are whole multiples of this, which keeps every part offset
+	// aligned for unbuffered reads and on an MD5 block boundary.
+	const uint64_t PART_SIZE_GRANULARITY = 1024 * 1024;
+
+	struct PartPlanOptions
+	{
+		PartPlanOptions() : throughput(0), connections(1), targetPartSeconds(8) {}
+
+		// Measured upload rate in bytes per second, 0 when unknown.
+		uint64_t throughput;
+
+		// Parts uploaded in parallel, sharing the throughput.
+		unsigned connections;
+
+		// How long one part should take on one connection: long enough to
+		// amortize the request overhead, short enough that a failed part
+		// loses little.
+		double targetPartSeconds;
+	};
+
+	// The split of one file into parts. It is chosen once, when the upload
+	// starts, and must be persisted with the upload: a resumed upload has to
+	// use the same part size as the parts already on S3.
+	struct PartLayout
+	{
+		PartLayout() : fileSize(0), partSize(0), partCount(0) {}
+
+		// Rebuilds a persisted layout; fails when it breaks the S3 limits:
+		// parts over 5 GB, more than 10,000 of them, or parts under 5 MB
+		// when there is more than one.
+		static BsStatus FromPartSize(uint64_t fileSize, uint64_t partSize, PartLayout& layout);
+
+		PartSpan Part(uint32_t partNumber) const;
+
+		uint64_t fileSize;
+		uint64_t partSize;
+		uint32_t partCount;
+	};
+
+	// Picks the part size for a file: the measured throughput decides within
+	// the range the S3 limits leave, and parts never shrink below what fits
+	// the file into 10,000 of them. Files over 5 TB get BS_E_NOTSUPPORTED.
+	BsStatus PlanParts(uint64_t fileSize, const PartPlanOptions& options, PartLayout& layout);
+
+	// CPartBitmap
+	//
+	// The parts of a layout already on S3, one bit per part, so planning the
+	// rest of a resumed upload is linear in the part count.
+	class CPartBitmap
+	{
+	public:
+		explicit CPartBitmap(const PartLayout& layout);
+
+		// Marks a part listed by ListParts. Fails with BS_E_CORRUPT when its
+		// size disagrees with the layout, i.e. the upload was started with a
+		// different part size.
+		BsStatus MarkCompleted(uint32_t partNumber, uint64_t size);
+
+		bool IsCompleted(uint32_t partNumber) const;
+		uint32_t CompletedCount() const { return m_completedCount; }
+		uint64_t CompletedBytes() const { return m_completedBytes; }
+
+		// The parts still to upload, in part number order.
+		void RemainingParts(std::vector<PartSpan>& parts) const;
+
+	private:
+		PartLayout m_layout;
+		std::vector<uint64_t> m_words;
+		uint32_t m_completedCount;
+		uint64_t m_completedBytes;
+	};
+}
@@ -0,0 +1,448 @@
+// PartReader.cpp : Implementation of CPartReader
+
+#include "PartReader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		size_t MappingGranularity()
+		{
+#ifdef _WIN32
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			return info.dwAllocationGranularity;
+#else
+			return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+		}
+
+		size_t AlignUp(size_t value, size_t alignment)
+		{
+			return (value + alignment - 1) / alignment * alignment;
+		}
+
+		// True when the parts are the whole file in order, all of one block
+		// aligned size except the last: then one CContentHasher pass yields
+		// both the part MD5s and the whole-file MD5.
+		bool CoversFile(const std::vector<PartSpan>& parts, uint64_t fileSize)
+		{
+			uint64_t partSize = parts[0].length;
+			if (parts.size() > 1 && (partSize == 0 || partSize % MD5_BLOCK_SIZE != 0))
+				return false;
+
+			uint64_t offset = 0;
+			for (size_t i = 0; i < parts.size(); ++i)
+			{
+				if (parts[i].partNumber != i + 1 || parts[i].offset != offset)
+					return false;
+				if (i + 1 < parts.size() ? parts[i].length != partSize : parts[i].length > partSize)
+					return false;
+				offset += parts[i].length;
+			}
+
+			return offset == fileSize;
+		}
+	}
+
+	std::vector<PartSpan> UniformParts(uint64_t fileSize, uint64_t partSize)
+	{
+		std::vector<PartSpan> parts;
+		if (partSize == 0)
+			partSize = std::max<uint64_t>(fileSize, 1);
+
+		uint64_t offset = 0;
+		do
+		{
+			PartSpan span;
+			span.partNumber = (uint32_t)(parts.size() + 1);
+			span.offset = offset;
+			span.length = std::min(partSize, fileSize - offset);
+			parts.push_back(span);
+			offset += span.length;
+		}
+		while (offset < fileSize);
+
+		return parts;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CPartReader methods
+	//
+
+	CPartReader::CPartReader(CBufferPool& pool)
+		: m_pool(pool),
+#ifdef _WIN32
+		m_mapping(NULL),
+#endif
+		m_fileSize(0), m_cancel(false), m_done(true), m_status(BS_OK), m_haveDigest(false)
+	{
+	}
+
+	CPartReader::~CPartReader()
+	{
+		Close();
+	}
+
+	BsStatus CPartReader::Open(const PathChar* path, const std::vector<PartSpan>& parts, const PartReaderOptions& options)
+	{
+		Close();
+
+		if (path == NULL || parts.empty())
+			return BS_E_INVALIDARG;
+
+		m_options = options;
+		m_options.readAhead = std::max(1u, options.readAhead);
+
+		// parts are encrypted where they were read.
+		bool sealed = options.encryption.cipher != NULL;
+		if (sealed && options.mode == PART_READ_MAPPED)
+			return BS_E_INVALIDARG;
+
+		// unbuffered reads need every part to start on an aligned offset.
+		bool direct = options.mode == PART_READ_DIRECT;
+		for (const PartSpan& part : parts)
+		{
+			if (part.offset % FILE_DIRECT_ALIGNMENT != 0)
+				direct = false;
+
+			size_t needed = direct ? AlignUp((size_t)part.length, FILE_DIRECT_ALIGNMENT) : (size_t)part.length;
+			if (sealed)
+				needed = std::max(needed, (size_t)part.length + GCM_TAG_SIZE);
+			if (options.mode != PART_READ_MAPPED && needed > m_pool.BufferSize())
+				return BS_E_INVALIDARG;
+		}
+
+		BsStatus status = m_file.Open(path, direct ? FILE_OPEN_DIRECT : FILE_OPEN_DEFAULT);
+		if (status == BS_OK)
+			status = m_file.GetSize(m_fileSize);
+		if (status != BS_OK)
+		{
+			m_file.Close();
+			return status;
+		}
+
+#ifdef _WIN32
+		if (m_options.mode == PART_READ_MAPPED && m_fileSize > 0)
+		{
+			m_mapping = CreateFileMappingW(m_file.Handle(), NULL, PAGE_READONLY, 0, 0, NULL);
+			if (m_mapping == NULL)
+			{
+				status = StatusFromWin32(GetLastError());
+				m_file.Close();
+				return status;
+			}
+		}
+#endif
+
+		m_parts = parts;
+		m_partData.assign(parts.size(), PartData());
+		m_ready.clear();
+		m_cancel = false;
+		m_done = false;
+		m_status = BS_OK;
+		m_haveDigest = false;
+
+		m_hasher.reset();
+		if (m_options.computeMd5 && CoversFile(parts, m_fileSize))
+			m_hasher.reset(new CContentHasher(parts.size() > 1 ? parts[0].length : 0));
+
+		m_thread = std::thread(&CPartReader::ReadLoop, this);
+		return BS_OK;
+	}
+
+	BsStatus CPartReader::Next(PartData*& part)
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		while (m_ready.empty() && !m_done)
+			m_readyChanged.wait(guard);
+
+		if (m_ready.empty())
+		{
+			part = NULL;
+			return m_status != BS_OK ? m_status : BS_E_NOMOREITEMS;
+		}
+
+		part = m_ready.front();
+		m_ready.pop_front();
+		guard.unlock();
+
+		// the reader waits for room in the queue.
+		m_readyChanged.notify_all();
+		return BS_OK;
+	}
+
+	void CPartReader::Release(PartData* part)
+	{
+		if (part == NULL)
+			return;
+
+		if (m_options.dropCache && !m_file.IsDirect())
+		{
+			// unmap first: the kernel keeps pages that are still mapped.
+			FreeStorage(*part);
+			m_file.AdviseDontNeed(part->offset, part->length);
+		}
+		else
+			FreeStorage(*part);
+	}
+
+	void CPartReader::Close()
+	{
+		if (m_thread.joinable())
+		{
+			m_cancel = true;
+			m_readyChanged.notify_all();
+			m_thread.join();
+		}
+
+		for (PartData* part : m_ready)
+			FreeStorage(*part);
+		m_ready.clear();
+		m_done = true;
+
+#ifdef _WIN32
+		if (m_mapping != NULL)
+		{
+			CloseHandle(m_mapping);
+			m_mapping = NULL;
+		}
+#endif
+		m_file.Close();
+	}
+
+	bool CPartReader::GetContentDigest(ContentDigest& digest) const
+	{
+		if (!m_haveDigest)
+			return false;
+
+		digest = m_digest;
+		return true;
+	}
+
+	//
+	//   FUNCTION: CPartReader::ReadLoop()
+	//
+	//   PURPOSE: Reader thread. Reads the parts in order, at most readAhead of
+	//            them ahead of the consumer, and stops at the first error.
+	//
+	void CPartReader::ReadLoop()
+	{
+		CUploadTrace* trace = m_options.trace;
+		BsStatus status = BS_OK;
+
+		for (size_t i = 0; i < m_parts.size() && status == BS_OK; ++i)
+		{
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				while (!m_cancel && m_ready.size() >= m_options.readAhead)
+					m_readyChanged.wait(guard);
+			}
+
+			if (m_cancel)
+			{
+				status = BS_E_CANCELLED;
+				break;
+			}
+
+			PartData& part = m_partData[i];
+			memset(&part, 0, sizeof(part));
+			part.partNumber = m_parts[i].partNumber;
+			part.offset = m_parts[i].offset;
+			part.length = (size_t)m_parts[i].length;
+			if (trace != NULL)
+				part.readStart = MonotonicNanoseconds();
+
+			if (m_options.mode != PART_READ_MAPPED)
+			{
+				part.buffer = m_pool.Acquire(&m_cancel);
+				if (part.buffer == NULL)
+				{
+					status = BS_E_CANCELLED;
+					break;
+				}
+
+				if (trace != NULL)
+					trace->Record(TRACE_BUFFER_WAIT, part.partNumber, part.readStart, MonotonicNanoseconds());
+			}
+
+			status = ReadPart(part);
+			if (status != BS_OK)
+			{
+				FreeStorage(part);
+				break;
+			}
+
+			// let the kernel start on the next part while this one is hashed
+			// and sent.
+			if (!m_file.IsDirect() && i + 1 < m_parts.size())
+				m_file.AdviseWillNeed(m_parts[i + 1].offset, m_parts[i + 1].length);
+
+			if (trace != NULL)
+				part.readyTime = MonotonicNanoseconds();
+
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_ready.push_back(&part);
+			}
+			m_readyChanged.notify_all();
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_haveDigest = status == BS_OK && m_hasher;
+			m_status = status;
+			m_done = true;
+		}
+		m_readyChanged.notify_all();
+	}
+
+	//
+	//   FUNCTION: CPartReader::ReadPart(PartData&)
+	//
+	//   PURPOSE: Fills one part, from its pool buffer or as a mapped view, and
+	//            computes its MD5 and SHA-256. With a trace, the read, the
+	//            hashing and the encryption are timed; encrypted parts are
+	//            hashed in two passes, around the encryption.
+	//
+	BsStatus CPartReader::ReadPart(PartData& part)
+	{
+		static const uint8_t empty[1] = { 0 };
+
+		if (part.offset + part.length > m_fileSize)
+			return BS_E_IO;
+
+		CUploadTrace* trace = m_options.trace;
+		int64_t start = trace != NULL ? MonotonicNanoseconds() : 0;
+
+		if (part.length == 0)
+			part.data = part.buffer != NULL ? part.buffer : empty;
+		else if (m_options.mode == PART_READ_MAPPED)
+		{
+			static const size_t granularity = MappingGranularity();
+			uint64_t viewOffset = part.offset - part.offset % granularity;
+			part.viewLength = (size_t)(part.offset - viewOffset) + part.length;
+
+#ifdef _WIN32
+			part.view = MapViewOfFile(m_mapping, FILE_MAP_READ, (DWORD)(viewOffset >> 32), (DWORD)viewOffset,
+				part.viewLength);
+			if (part.view == NULL)
+				return StatusFromWin32(GetLastError());
+#else
+			void* view = mmap(NULL, part.viewLength, PROT_READ, MAP_SHARED, m_file.Handle(), (off_t)viewOffset);
+			if (view == MAP_FAILED)
+				return StatusFromErrno(errno);
+			part.view = view;
+			madvise(view, part.viewLength, MADV_WILLNEED);
+#endif
+			part.data = static_cast<const uint8_t*>(part.view) + (part.offset - viewOffset);
+		}
+		else
+		{
+			size_t length = m_file.IsDirect() ? AlignUp(part.length, FILE_DIRECT_ALIGNMENT) : part.length;
+			size_t bytesRead = 0;
+
+			BsStatus status = m_file.ReadAt(part.offset, part.buffer, length, bytesRead);
+			if (status != BS_OK)
+				return status;
+
+			// the file shrank under us.
+			if (bytesRead < part.length)
+				return BS_E_IO;
+
+			part.data = part.buffer;
+		}
+
+		if (trace != NULL)
+		{
+			int64_t now = MonotonicNanoseconds();
+			trace->Record(TRACE_READ, part.partNumber, start, now, part.length);
+			trace->CountRead(part.length);
+			start = now;
+		}
+
+		// the last part only completes in Finish.
+		bool last = part.partNumber == m_parts.size();
+		if (m_hasher)
+		{
+			m_hasher->Update(part.data, part.length);
+			if (last)
+				m_hasher->Finish(m_digest);
+		}
+
+		bool sealed = m_options.encryption.cipher != NULL;
+		if (sealed)
+		{
+			if (trace != NULL)
+			{
+				int64_t now = MonotonicNanoseconds();
+				if (m_hasher)
+					trace->Record(TRACE_HASH, part.partNumber, start, now, part.length);
+				start = now;
+			}
+
+			SealPart(m_options.encryption, part.partNumber, part.buffer, part.length);
+			part.length += GCM_TAG_SIZE;
+
+			if (trace != NULL)
+			{
+				int64_t now = MonotonicNanoseconds();
+				trace->Record(TRACE_ENCRYPT, part.partNumber, start, now, part.length);
+				start = now;
+			}
+		}
+
+		if (m_options.computeSha256)
+		{
+			CSha256::Hash(part.data, part.length, part.sha256);
+			part.hasSha256 = true;
+		}
+
+		if (m_options.computeMd5)
+		{
+			if (!m_hasher || sealed)
+				CMd5::Hash(part.data, part.length, part.md5);
+			else if (last)
+				memcpy(part.md5, m_digest.parts.back().md5, MD5_DIGEST_SIZE);
+			else
+				memcpy(part.md5, m_hasher->FinishedPart(part.partNumber - 1).md5, MD5_DIGEST_SIZE);
+
+			part.hasMd5 = true;
+		}
+
+		if (trace != NULL && (m_options.computeSha256 || m_options.computeMd5))
+			trace->Record(TRACE_HASH, part.partNumber, start, MonotonicNanoseconds(), part.length);
+		return BS_OK;
+	}
+
+	void CPartReader::FreeStorage(PartData& part)
+	{
+		if (part.buffer != NULL)
+		{
+			m_pool.Release(part.buffer);
+			part.buffer = NULL;
+		}
+
+		if (part.view != NULL)
+		{
+#ifdef _WIN32
+			UnmapViewOfFile(part.view);
+#else
+			munmap(part.view, part.viewLength);
+#endif
+			part.view = NULL;
+		}
+
+		part.data = NULL;
+	}
+}
@@ -0,0 +1,172 @@
+// PartReader.h : Declaration of CPartReader
+
+#pragma once
+
+#include "AesGcm.h"
+#include "BufferPool.h"
+#include "ContentHasher.h"
+#include "File.h"
+#include "Sha256.h"
+#include "UploadTracer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace BigStash
+{
+	// One part of a multipart upload. Part numbers start at 1, as in S3.
+	struct PartSpan
+	{
+		uint32_t partNumber;
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	// Splits a file of fileSize bytes into parts of partSize bytes. An empty
+	// file is a single empty part.
+	std::vector<PartSpan> UniformParts(uint64_t fileSize, uint64_t partSize);
+
+	enum PartReadMode
+	{
+		// pread into a pooled buffer.
+		PART_READ_BUFFERED,
+
+		// Unbuffered reads into a pooled buffer; nothing is left in the page
+		// cache. Falls back to buffered reads where the file system refuses it
+		// or the parts are not aligned.
+		PART_READ_DIRECT,
+
+		// The part is mapped and handed out in place, without any copy.
+		PART_READ_MAPPED
+	};
+
+	struct PartReaderOptions
+	{
+		PartReaderOptions() : mode(PART_READ_BUFFERED), readAhead(4), dropCache(false), computeMd5(true),
+			computeSha256(false), trace(NULL) {}
+
+		PartReadMode mode;
+
+		// Parts read ahead of the consumer.
+		unsigned readAhead;
+
+		// Drops a part's pages from the page cache once it is released, so an
+		// upload does not evict everything else on the machine.
+		bool dropCache;
+
+		// Computes the part MD5s (and the whole-file digest when the parts
+		// cover the file) on the reader thread.
+		bool computeMd5;
+
+		// Computes the part SHA-256s on the reader thread, for SigV4 payload
+		// signing, while the part is still in the cache.
+		bool computeSha256;
+
+		// Encrypts every part in its buffer once it is read and appends its
+		// tag, so the data handed out is GCM_TAG_SIZE bytes longer than the
+		// span. The part digests are of what is sent, the whole-file digest
+		// of the content. Pool buffers need room for the tag, and
+		// PART_READ_MAPPED cannot be used.
+		PartEncryption encryption;
+
+		// Times the buffer wait, read, hash and encrypt stages of every part
+		// when set.
+		CUploadTrace* trace;
+	};
+
+	// A part ready to be sent. data stays valid until the part is released.
+	struct PartData
+	{
+		uint32_t partNumber;
+		uint64_t offset;
+		size_t length;
+		const uint8_t* data;
+		uint8_t md5[MD5_DIGEST_SIZE];
+		bool hasMd5;
+		uint8_t sha256[SHA256_DIGEST_SIZE];
+		bool hasSha256;
+
+		// owned storage: a pool buffer or a mapped view.
+		uint8_t* buffer;
+		void* view;
+		size_t viewLength;
+
+		// When the reader started on the part and when it was ready, for
+		// the trace; 0 when the reader is not traced.
+		int64_t readStart;
+		int64_t readyTime;
+	};
+
+	// CPartReader
+	//
+	// Reads the parts of one file on a background thread, ahead of the
+	// consumer, into buffers from a CBufferPool (or mapped views) and hands
+	// them out in order. The network layer sends straight from PartData::data.
+	class CPartReader
+	{
+	public:
+		// Pool buffers must be at least as large as the largest part, except
+		// in PART_READ_MAPPED mode, which does not use the pool.
+		explicit CPartReader(CBufferPool& pool);
+		~CPartReader();
+
+		BsStatus Open(const PathChar* path, const std::vector<PartSpan>& parts, const PartReaderOptions& options);
+
+		// Waits for the next part. Returns BS_E_NOMOREITEMS after the last one,
+		// or the read error that stopped the reader.
+		BsStatus Next(PartData*& part);
+
+		// Gives the part's storage back.
+		void Release(PartData* part);
+
+		// Stops the reader thread and releases the parts not handed out yet.
+		void Close();
+
+		// The whole-file digest, once Next returned BS_E_NOMOREITEMS, when the
+		// parts are the whole file in order and computeMd5 is set.
+		bool GetContentDigest(ContentDigest& digest) const;
+
+		// Parts the consumer can hold at once before Next blocks for good:
+		// the pool size, or unlimited for mapped views.
+		size_t MaxOutstanding() const
+		{
+			return m_options.mode == PART_READ_MAPPED ? SIZE_MAX : m_pool.Count();
+		}
+
+		bool IsDirect() const { return m_file.IsDirect(); }
+		uint64_t FileSize() const { return m_fileSize; }
+
+	protected:
+		void ReadLoop();
+		BsStatus ReadPart(PartData& part);
+		void FreeStorage(PartData& part);
+
+		CBufferPool& m_pool;
+		CFile m_file;
+#ifdef _WIN32
+		HANDLE m_mapping;
+#endif
+		uint64_t m_fileSize;
+		std::vector<PartSpan> m_parts;
+		std::vector<PartData> m_partData;
+		PartReaderOptions m_options;
+
+		std::thread m_thread;
+		std::mutex m_lock;
+		std::condition_variable m_readyChanged;
+		std::deque<PartData*> m_ready;
+		std::atomic<bool> m_cancel;
+		bool m_done;
+		BsStatus m_status;
+
+		std::unique_ptr<CContentHasher> m_hasher;
+		ContentDigest m_digest;
+		bool m_haveDigest;
+	};
+}
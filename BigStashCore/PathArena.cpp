@@ -0,0 +1,85 @@
+// PathArena.cpp : Implementation of CPathArena
+
+#include "PathArena.h"
+#include "Utf.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace BigStash
+{
+	/////////////////////////////////////////////////////////////////////////////
+	// CPathArena methods
+	//
+
+	CPathArena::CPathArena()
+		: m_offsets(1, 0)
+	{
+	}
+
+	void CPathArena::Reserve(size_t paths, size_t units)
+	{
+		m_offsets.reserve(m_offsets.size() + paths);
+		m_units.reserve(m_units.size() + units);
+	}
+
+	uint16_t* CPathArena::Append(size_t length)
+	{
+		size_t start = m_units.size();
+		m_units.resize(start + length + 1);
+		m_units[start + length] = 0;
+		m_offsets.push_back(m_units.size());
+		return &m_units[start];
+	}
+
+	void CPathArena::Add(const uint16_t* path, size_t length)
+	{
+		uint16_t* units = Append(length);
+		if (length != 0)
+			memcpy(units, path, length * sizeof(uint16_t));
+	}
+
+	void CPathArena::RemoveLast()
+	{
+		if (Empty())
+			return;
+
+		m_offsets.pop_back();
+		m_units.resize(m_offsets.back());
+	}
+
+	void CPathArena::Clear()
+	{
+		m_units.clear();
+		m_offsets.assign(1, 0);
+	}
+
+	void CPathArena::Swap(CPathArena& other)
+	{
+		m_units.swap(other.m_units);
+		m_offsets.swap(other.m_offsets);
+	}
+
+	//
+	//   FUNCTION: CPathArena::AppendUtf8(std::string&, char)
+	//
+	//   PURPOSE: Transcodes the whole buffer, terminators and all, with one
+	//            call and turns the terminators into separators, the last
+	//            one dropped. Paths cannot hold a NUL, so every NUL in the
+	//            output is a terminator.
+	//
+	BsStatus CPathArena::AppendUtf8(std::string& output, char separator) const
+	{
+		if (Empty())
+			return BS_OK;
+
+		size_t start = output.size();
+		BsStatus status = BigStash::AppendUtf8(output, &m_units[0], m_units.size());
+		if (status != BS_OK)
+			return status;
+
+		output.pop_back();
+		std::replace(output.begin() + start, output.end(), '\0', separator);
+		return BS_OK;
+	}
+}
@@ -0,0 +1,55 @@
+// PathArena.h : Declaration of CPathArena, contiguous storage for the UTF-16
+// paths of a shell selection
+
+#pragma once
+
+#include "Platform.h"
+
+#include <vector>
+
+namespace BigStash
+{
+	// CPathArena
+	//
+	// Keeps UTF-16 paths, as the shell hands them, NUL terminated one after
+	// another in one buffer with an offset per path, instead of a heap
+	// string each. Paths can be of any length, so long (\\?\) paths fit.
+	class CPathArena
+	{
+	public:
+		CPathArena();
+
+		void Reserve(size_t paths, size_t units);
+
+		// Room for a path of length units, to be written in place (as
+		// DragQueryFile does); the arena writes the terminating NUL.
+		uint16_t* Append(size_t length);
+		void Add(const uint16_t* path, size_t length);
+
+		// Drops the last path, as when filling it in failed.
+		void RemoveLast();
+
+		void Clear();
+		void Swap(CPathArena& other);
+
+		size_t Count() const { return m_offsets.size() - 1; }
+		bool Empty() const { return Count() == 0; }
+
+		// NUL terminated.
+		const uint16_t* Path(size_t index) const { return &m_units[m_offsets[index]]; }
+		size_t Length(size_t index) const { return m_offsets[index + 1] - m_offsets[index] - 1; }
+
+		// Units held, terminators included.
+		size_t Units() const { return m_units.size(); }
+
+		// Appends every path as UTF-8, separated by separator, transcoding
+		// the arena in one pass. BS_E_CORRUPT on a lone surrogate.
+		BsStatus AppendUtf8(std::string& output, char separator) const;
+
+	private:
+		std::vector<uint16_t> m_units;
+
+		// Where each path starts, and where the next one would.
+		std::vector<size_t> m_offsets;
+	};
+}
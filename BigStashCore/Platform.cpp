@@ -0,0 +1,72 @@
+// Platform.cpp : Implementation of the portability helpers.
+
+#include "Platform.h"
+
+#include <cerrno>
+
+namespace BigStash
+{
+	//
+	//   FUNCTION: StatusFromErrno(int)
+	//
+	//   PURPOSE: Maps an errno value to the closest BsStatus.
+	//
+	BsStatus StatusFromErrno(int error)
+	{
+		switch (error)
+		{
+		case 0:
+			return BS_OK;
+		case ENOENT:
+		case ENOTDIR:
+			return BS_E_NOTFOUND;
+		case EACCES:
+		case EPERM:
+			return BS_E_ACCESSDENIED;
+		case ENOMEM:
+			return BS_E_OUTOFMEMORY;
+		case EINVAL:
+		case ENAMETOOLONG:
+			return BS_E_INVALIDARG;
+		case ENOSYS:
+		case EOPNOTSUPP:
+			return BS_E_NOTSUPPORTED;
+		default:
+			return BS_E_IO;
+		}
+	}
+
+#ifdef _WIN32
+	//
+	//   FUNCTION: StatusFromWin32(DWORD)
+	//
+	//   PURPOSE: Maps a GetLastError() value to the closest BsStatus.
+	//
+	BsStatus StatusFromWin32(DWORD error)
+	{
+		switch (error)
+		{
+		case ERROR_SUCCESS:
+			return BS_OK;
+		case ERROR_FILE_NOT_FOUND:
+		case ERROR_PATH_NOT_FOUND:
+		case ERROR_INVALID_DRIVE:
+			return BS_E_NOTFOUND;
+		case ERROR_ACCESS_DENIED:
+		case ERROR_SHARING_VIOLATION:
+			return BS_E_ACCESSDENIED;
+		case ERROR_NOT_ENOUGH_MEMORY:
+		case ERROR_OUTOFMEMORY:
+			return BS_E_OUTOFMEMORY;
+		case ERROR_INVALID_PARAMETER:
+		case ERROR_INVALID_NAME:
+		case ERROR_FILENAME_EXCED_RANGE:
+			return BS_E_INVALIDARG;
+		case ERROR_NOT_SUPPORTED:
+			return BS_E_NOTSUPPORTED;
+		default:
+			return BS_E_IO;
+		}
+	}
+#endif
+}
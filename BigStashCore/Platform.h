@@ -0,0 +1,67 @@
+// Platform.h : Portability definitions shared by the BigStashCore sources.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "BigStashCore.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+namespace BigStash
+{
+	// Native path characters. Windows paths are kept as UTF-16 so they can be
+	// handed to the W APIs (and to the managed side) without conversion,
+	// everywhere else paths are UTF-8 byte strings.
+	typedef BsChar PathChar;
+	typedef std::basic_string<PathChar> PathString;
+
+#ifdef _WIN32
+	const PathChar PATH_SEPARATOR = L'\\';
+#else
+	const PathChar PATH_SEPARATOR = '/';
+#endif
+
+	// Whether paths of the platform compare ignoring case (with FoldCase):
+	// NTFS names do, the names of the usual Unix file systems do not.
+#ifdef _WIN32
+	const bool PATH_IGNORE_CASE = true;
+#else
+	const bool PATH_IGNORE_CASE = false;
+#endif
+
+	// Difference between the FILETIME epoch (1601-01-01) and the Unix epoch
+	// in 100 nanosecond ticks.
+	const int64_t FILETIME_UNIX_EPOCH_TICKS = 116444736000000000LL;
+
+	// Converts a Unix timestamp (seconds and nanoseconds) to FILETIME ticks,
+	// which is what DateTime.FromFileTimeUtc expects on the managed side.
+	inline int64_t UnixTimeToFileTime(int64_t seconds, int64_t nanoseconds)
+	{
+		return seconds * 10000000LL + nanoseconds / 100 + FILETIME_UNIX_EPOCH_TICKS;
+	}
+
+	// Nanoseconds on the monotonic clock, for timing stages; not a date.
+	inline int64_t MonotonicNanoseconds()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Maps an errno (or a Win32 error code on Windows) to a BsStatus.
+	BsStatus StatusFromErrno(int error);
+#ifdef _WIN32
+	BsStatus StatusFromWin32(DWORD error);
+#endif
+}
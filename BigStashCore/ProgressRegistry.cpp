@@ -0,0 +1,224 @@
+// ProgressRegistry.cpp : Implementation of CProgressRegistry and CProgressPublisher
+
+#include "ProgressRegistry.h"
+#include "BufferPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+namespace BigStash
+{
+	namespace
+	{
+		const size_t CACHE_LINE = 64;
+
+		// The smoothing time of the published rate.
+		const double RATE_SECONDS = 1.0;
+
+		// Threads take the shards round robin, in the order they first write.
+		std::atomic<unsigned> g_nextShard(0);
+	}
+
+	struct CProgressRegistry::Shard
+	{
+		std::atomic<int64_t> bytes;
+		std::atomic<uint64_t> completed;
+		char padding[CACHE_LINE - sizeof(std::atomic<int64_t>) - sizeof(std::atomic<uint64_t>)];
+	};
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CProgressRegistry methods
+	//
+
+	CProgressRegistry::CProgressRegistry(uint32_t fileCount)
+		: m_fileCount(fileCount), m_files(new std::atomic<uint64_t>[fileCount]),
+		m_completed(new std::atomic<bool>[fileCount]), m_shards(NULL)
+	{
+		static_assert(sizeof(Shard) == CACHE_LINE, "a shard must fill one cache line");
+
+		for (uint32_t i = 0; i < fileCount; ++i)
+		{
+			m_files[i].store(0, std::memory_order_relaxed);
+			m_completed[i].store(false, std::memory_order_relaxed);
+		}
+
+		m_shards = static_cast<Shard*>(AlignedAlloc(sizeof(Shard) * PROGRESS_SHARDS, CACHE_LINE));
+		if (m_shards == NULL)
+			throw std::bad_alloc();
+		for (unsigned i = 0; i < PROGRESS_SHARDS; ++i)
+		{
+			new (&m_shards[i]) Shard;
+			m_shards[i].bytes.store(0, std::memory_order_relaxed);
+			m_shards[i].completed.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	CProgressRegistry::~CProgressRegistry()
+	{
+		for (unsigned i = 0; i < PROGRESS_SHARDS; ++i)
+			m_shards[i].~Shard();
+		AlignedFree(m_shards);
+	}
+
+	CProgressRegistry::Shard& CProgressRegistry::CurrentShard()
+	{
+		static thread_local unsigned shard = g_nextShard++ % PROGRESS_SHARDS;
+		return m_shards[shard];
+	}
+
+	void CProgressRegistry::Add(uint32_t file, int64_t delta)
+	{
+		if (file >= m_fileCount)
+			return;
+
+		// unsigned wrap-around takes negative deltas back.
+		m_files[file].fetch_add((uint64_t)delta, std::memory_order_relaxed);
+		CurrentShard().bytes.fetch_add(delta, std::memory_order_relaxed);
+	}
+
+	void CProgressRegistry::Set(uint32_t file, uint64_t bytes)
+	{
+		if (file >= m_fileCount)
+			return;
+
+		uint64_t previous = m_files[file].exchange(bytes, std::memory_order_relaxed);
+		CurrentShard().bytes.fetch_add((int64_t)(bytes - previous), std::memory_order_relaxed);
+	}
+
+	void CProgressRegistry::Complete(uint32_t file)
+	{
+		if (file < m_fileCount && !m_completed[file].exchange(true, std::memory_order_relaxed))
+			CurrentShard().completed.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint64_t CProgressRegistry::File(uint32_t file) const
+	{
+		return file < m_fileCount ? m_files[file].load(std::memory_order_relaxed) : 0;
+	}
+
+	uint64_t CProgressRegistry::Total() const
+	{
+		int64_t total = 0;
+		for (unsigned i = 0; i < PROGRESS_SHARDS; ++i)
+			total += m_shards[i].bytes.load(std::memory_order_relaxed);
+
+		// a shard can be negative (a thread that only took bytes back), the
+		// sum only while another thread's matching update is in flight.
+		return total > 0 ? (uint64_t)total : 0;
+	}
+
+	uint64_t CProgressRegistry::CompletedFiles() const
+	{
+		uint64_t completed = 0;
+		for (unsigned i = 0; i < PROGRESS_SHARDS; ++i)
+			completed += m_shards[i].completed.load(std::memory_order_relaxed);
+		return completed;
+	}
+
+	void CProgressRegistry::Snapshot(ProgressSnapshot& snapshot) const
+	{
+		snapshot.bytes = Total();
+		snapshot.completedFiles = CompletedFiles();
+		snapshot.fileCount = m_fileCount;
+		snapshot.seconds = 0;
+		snapshot.bytesPerSecond = 0;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CProgressPublisher methods
+	//
+
+	CProgressPublisher::CProgressPublisher(const CProgressRegistry& registry, unsigned intervalMs,
+		const ProgressCallback& callback)
+		: m_registry(registry), m_intervalMs(std::max(1u, intervalMs)), m_callback(callback), m_stopping(false),
+		m_lastSeconds(0), m_rate(0), m_any(false), m_published(0)
+	{
+		m_registry.Snapshot(m_last);
+	}
+
+	CProgressPublisher::~CProgressPublisher()
+	{
+		Stop();
+	}
+
+	void CProgressPublisher::Start()
+	{
+		if (m_thread.joinable())
+			return;
+
+		m_stopping = false;
+		m_start = std::chrono::steady_clock::now();
+		m_thread = std::thread(&CProgressPublisher::Run, this);
+	}
+
+	void CProgressPublisher::Stop()
+	{
+		if (!m_thread.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_stopping = true;
+		}
+		m_wake.notify_all();
+		m_thread.join();
+	}
+
+	void CProgressPublisher::Run()
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		auto next = m_start;
+		for (;;)
+		{
+			next += std::chrono::milliseconds(m_intervalMs);
+			bool stopping = m_wake.wait_until(guard, next, [this]() { return m_stopping; });
+
+			guard.unlock();
+			Publish(std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count());
+			guard.lock();
+
+			if (stopping)
+				break;
+
+			// a slow callback skips the ticks it overran instead of bursting.
+			auto now = std::chrono::steady_clock::now();
+			if (next < now)
+				next = now;
+		}
+	}
+
+	//
+	//   FUNCTION: CProgressPublisher::Publish(double)
+	//
+	//   PURPOSE: Takes a snapshot, folds the bytes since the last one into
+	//            the smoothed rate and calls back when the bytes or the
+	//            completed files moved.
+	//
+	void CProgressPublisher::Publish(double seconds)
+	{
+		ProgressSnapshot snapshot;
+		m_registry.Snapshot(snapshot);
+
+		double elapsed = seconds - m_lastSeconds;
+		if (elapsed > 0)
+		{
+			double rate = ((double)snapshot.bytes - (double)m_last.bytes) / elapsed;
+			double weight = 1 - std::exp(-elapsed / RATE_SECONDS);
+			m_rate = std::max(0.0, m_rate + weight * (rate - m_rate));
+		}
+		m_lastSeconds = seconds;
+
+		bool moved = !m_any || snapshot.bytes != m_last.bytes || snapshot.completedFiles != m_last.completedFiles;
+		m_last = snapshot;
+		if (!moved)
+			return;
+
+		m_any = true;
+		snapshot.seconds = seconds;
+		snapshot.bytesPerSecond = m_rate;
+		m_published++;
+		if (m_callback)
+			m_callback(snapshot);
+	}
+}
@@ -0,0 +1,126 @@
+// ProgressRegistry.h : Declaration of CProgressRegistry and CProgressPublisher
+
+#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace BigStash
+{
+	// Shards of the totals; writers pick one per thread.
+	const unsigned PROGRESS_SHARDS = 64;
+
+	struct ProgressSnapshot
+	{
+		uint64_t bytes;
+		uint64_t completedFiles;
+		uint32_t fileCount;
+
+		// Since the publisher started, and the smoothed rate over about the
+		// last second; both 0 for a snapshot taken from the registry.
+		double seconds;
+		double bytesPerSecond;
+	};
+
+	// CProgressRegistry
+	//
+	// Upload progress of every file of an archive, written from every part
+	// in flight and read by the UI. Each file has one atomic counter, and the
+	// totals are kept in cache line sized shards, one per writing thread, so
+	// writers never take a lock or share a line with each other. Snapshots
+	// sum the shards: constant time whatever the file count, where summing
+	// the per-file progress of 100k files on every callback is not. A
+	// snapshot taken while writers run may miss the updates in flight; one
+	// taken after they stopped is exact.
+	class CProgressRegistry
+	{
+	public:
+		explicit CProgressRegistry(uint32_t fileCount);
+		~CProgressRegistry();
+
+		uint32_t FileCount() const { return m_fileCount; }
+
+		// delta is negative when a failed part's bytes are taken back before
+		// the retry.
+		void Add(uint32_t file, int64_t delta);
+
+		// Sets a file's progress outright, e.g. from a resumed upload's
+		// saved state.
+		void Set(uint32_t file, uint64_t bytes);
+
+		// Counts the file as completed once, however often it is called.
+		void Complete(uint32_t file);
+
+		uint64_t File(uint32_t file) const;
+		uint64_t Total() const;
+		uint64_t CompletedFiles() const;
+		void Snapshot(ProgressSnapshot& snapshot) const;
+
+	private:
+		CProgressRegistry(const CProgressRegistry&);
+		CProgressRegistry& operator=(const CProgressRegistry&);
+
+		struct Shard;
+		Shard& CurrentShard();
+
+		uint32_t m_fileCount;
+		std::unique_ptr<std::atomic<uint64_t>[]> m_files;
+		std::unique_ptr<std::atomic<bool>[]> m_completed;
+		Shard* m_shards;
+	};
+
+	// Called on the publisher's thread.
+	typedef std::function<void(const ProgressSnapshot& snapshot)> ProgressCallback;
+
+	// CProgressPublisher
+	//
+	// Hands snapshots of a registry to the UI and the log at a fixed
+	// interval instead of on every update, and only when something moved.
+	// Writers never wait for it; the callback runs on its own thread.
+	class CProgressPublisher
+	{
+	public:
+		CProgressPublisher(const CProgressRegistry& registry, unsigned intervalMs, const ProgressCallback& callback);
+		~CProgressPublisher();
+
+		void Start();
+
+		// Publishes the last snapshot, if it differs from the one before,
+		// and waits for the thread.
+		void Stop();
+
+		uint64_t Published() const { return m_published; }
+
+	private:
+		CProgressPublisher(const CProgressPublisher&);
+		CProgressPublisher& operator=(const CProgressPublisher&);
+
+		void Run();
+		void Publish(double seconds);
+
+		const CProgressRegistry& m_registry;
+		unsigned m_intervalMs;
+		ProgressCallback m_callback;
+		std::chrono::steady_clock::time_point m_start;
+
+		std::mutex m_lock;
+		std::condition_variable m_wake;
+		bool m_stopping;
+		std::thread m_thread;
+
+		// publisher thread only.
+		ProgressSnapshot m_last;
+		double m_lastSeconds;
+		double m_rate;
+		bool m_any;
+
+		std::atomic<uint64_t> m_published;
+	};
+}
@@ -0,0 +1,774 @@
+// ResumeJournal.cpp : Implementation of CResumeJournal
+
+#include "ResumeJournal.h"
+#include "Crc32.h"
+#include "Encoding.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		const uint8_t LOG_MAGIC[4] = { 'B', 'S', 'R', 'J' };
+		const uint8_t SNAPSHOT_MAGIC[4] = { 'B', 'S', 'R', 'S' };
+		const uint32_t JOURNAL_VERSION = 1;
+
+		// magic, version, generation, CRC-32 of the rest.
+		const size_t LOG_HEADER_SIZE = 20;
+
+		// magic, version, generation, records, body length, CRC-32 of the rest.
+		const size_t SNAPSHOT_HEADER_SIZE = 36;
+
+		// payload length and its CRC-32, then the payload.
+		const size_t FRAME_HEADER_SIZE = 8;
+
+		// A record is a few varints and an ETag or upload ID; anything
+		// longer is a torn length field.
+		const uint32_t MAX_PAYLOAD = 64 * 1024;
+
+		// Leaves room in the payload for the varints.
+		const size_t MAX_TEXT = MAX_PAYLOAD - 64;
+
+		// The writer does not wait out the commit interval for a batch
+		// this large.
+		const size_t BATCH_BYTES = 1024 * 1024;
+
+		void PutLittleEndian32(uint8_t* data, uint32_t value)
+		{
+			for (int i = 0; i < 4; ++i)
+				data[i] = (uint8_t)(value >> (8 * i));
+		}
+
+		void PutLittleEndian64(uint8_t* data, uint64_t value)
+		{
+			for (int i = 0; i < 8; ++i)
+				data[i] = (uint8_t)(value >> (8 * i));
+		}
+
+		uint32_t GetLittleEndian32(const uint8_t* data)
+		{
+			return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+		}
+
+		uint64_t GetLittleEndian64(const uint8_t* data)
+		{
+			return (uint64_t)GetLittleEndian32(data) | ((uint64_t)GetLittleEndian32(data + 4) << 32);
+		}
+
+		PathString JournalFilePath(const PathString& base, const std::string& suffix)
+		{
+			PathString path(base);
+			for (char c : suffix)
+				path += (PathChar)c;
+			return path;
+		}
+
+		PathString LogPath(const PathString& base, uint64_t generation)
+		{
+			return JournalFilePath(base, "." + std::to_string(generation) + ".log");
+		}
+
+		void AppendRecord(std::vector<uint8_t>& data, const JournalRecord& record)
+		{
+			size_t frame = data.size();
+			data.resize(frame + FRAME_HEADER_SIZE);
+
+			AppendVarint(data, record.type);
+			AppendVarint(data, record.file);
+			if (record.type == JOURNAL_PART_COMPLETED)
+				AppendVarint(data, record.partNumber);
+			if (record.type != JOURNAL_FILE_RESET)
+			{
+				AppendVarint(data, record.size);
+				AppendVarint(data, record.text.size());
+				data.insert(data.end(), record.text.begin(), record.text.end());
+			}
+			if (record.type == JOURNAL_PART_COMPLETED && record.hasMd5)
+				data.insert(data.end(), record.md5, record.md5 + MD5_DIGEST_SIZE);
+
+			size_t length = data.size() - frame - FRAME_HEADER_SIZE;
+			PutLittleEndian32(&data[frame], (uint32_t)length);
+			PutLittleEndian32(&data[frame + 4], Crc32(&data[frame + FRAME_HEADER_SIZE], length));
+		}
+
+		// Reads the record framed at data; false, leaving data where it was,
+		// when the frame is short, fails its CRC or does not parse.
+		bool ReadRecord(const uint8_t*& data, const uint8_t* end, JournalRecord& record)
+		{
+			if ((size_t)(end - data) < FRAME_HEADER_SIZE)
+				return false;
+
+			uint32_t length = GetLittleEndian32(data);
+			if (length > MAX_PAYLOAD || (size_t)(end - data) - FRAME_HEADER_SIZE < length)
+				return false;
+
+			const uint8_t* payload = data + FRAME_HEADER_SIZE;
+			const uint8_t* payloadEnd = payload + length;
+			if (Crc32(payload, length) != GetLittleEndian32(data + 4))
+				return false;
+
+			uint64_t type = 0;
+			uint64_t file = 0;
+			uint64_t partNumber = 0;
+			uint64_t size = 0;
+			uint64_t textLength = 0;
+			if (!ReadVarint(payload, payloadEnd, type) || !ReadVarint(payload, payloadEnd, file) ||
+				type < JOURNAL_FILE_STARTED || type > JOURNAL_FILE_RESET || file > UINT32_MAX)
+				return false;
+			if (type == JOURNAL_PART_COMPLETED && (!ReadVarint(payload, payloadEnd, partNumber) || partNumber > UINT32_MAX))
+				return false;
+			if (type != JOURNAL_FILE_RESET)
+			{
+				if (!ReadVarint(payload, payloadEnd, size) || !ReadVarint(payload, payloadEnd, textLength) ||
+					textLength > (uint64_t)(payloadEnd - payload))
+					return false;
+				record.text.assign((const char*)payload, (size_t)textLength);
+				payload += textLength;
+			}
+
+			// a part's MD5 trails its ETag; records written before there was
+			// one end with the ETag.
+			record.hasMd5 = type == JOURNAL_PART_COMPLETED && (size_t)(payloadEnd - payload) == MD5_DIGEST_SIZE;
+			if (record.hasMd5)
+			{
+				memcpy(record.md5, payload, MD5_DIGEST_SIZE);
+				payload += MD5_DIGEST_SIZE;
+			}
+			if (payload != payloadEnd)
+				return false;
+
+			record.type = (JournalRecordType)type;
+			record.file = (uint32_t)file;
+			record.partNumber = (uint32_t)partNumber;
+			record.size = size;
+			data = payloadEnd;
+			return true;
+		}
+
+		BsStatus ReadWholeFile(CFile& file, std::vector<uint8_t>& data)
+		{
+			uint64_t size = 0;
+			BsStatus status = file.GetSize(size);
+			if (status != BS_OK)
+				return status;
+			if (size > SIZE_MAX)
+				return BS_E_OUTOFMEMORY;
+
+			data.resize((size_t)size);
+			size_t read = 0;
+			status = file.ReadAt(0, data.data(), data.size(), read);
+			data.resize(read);
+			return status;
+		}
+
+		// The records that rebuild state; its record count goes in the header.
+		void SerializeState(const JournalState& state, uint64_t generation, std::vector<uint8_t>& data)
+		{
+			data.assign(SNAPSHOT_HEADER_SIZE, 0);
+
+			JournalRecord record;
+			for (uint32_t file = 0; file < state.files.size(); ++file)
+			{
+				const JournalFileState& current = state.files[file];
+				record.file = file;
+
+				if (current.started)
+				{
+					record.type = JOURNAL_FILE_STARTED;
+					record.size = current.partSize;
+					record.text = current.uploadId;
+					AppendRecord(data, record);
+				}
+
+				for (const S3Part& part : current.parts)
+				{
+					record.type = JOURNAL_PART_COMPLETED;
+					record.partNumber = part.partNumber;
+					record.size = part.size;
+					record.text = part.etag;
+					record.hasMd5 = part.hasMd5;
+					if (part.hasMd5)
+						memcpy(record.md5, part.md5, MD5_DIGEST_SIZE);
+					AppendRecord(data, record);
+				}
+				record.hasMd5 = false;
+
+				if (current.completed)
+				{
+					record.type = JOURNAL_FILE_COMPLETED;
+					record.size = current.size;
+					record.text = current.md5;
+					AppendRecord(data, record);
+				}
+			}
+
+			memcpy(&data[0], SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+			PutLittleEndian32(&data[4], JOURNAL_VERSION);
+			PutLittleEndian64(&data[8], generation);
+			PutLittleEndian64(&data[16], state.records);
+			PutLittleEndian64(&data[24], data.size() - SNAPSHOT_HEADER_SIZE);
+			PutLittleEndian32(&data[32], Crc32(&data[0], 32));
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// JournalState methods
+	//
+
+	bool JournalFileState::operator==(const JournalFileState& other) const
+	{
+		if (started != other.started || completed != other.completed || partSize != other.partSize ||
+			size != other.size || uploadId != other.uploadId || md5 != other.md5 || parts.size() != other.parts.size())
+			return false;
+
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			if (parts[i].partNumber != other.parts[i].partNumber || parts[i].size != other.parts[i].size ||
+				parts[i].etag != other.parts[i].etag || parts[i].hasMd5 != other.parts[i].hasMd5 ||
+				(parts[i].hasMd5 && memcmp(parts[i].md5, other.parts[i].md5, MD5_DIGEST_SIZE) != 0))
+				return false;
+		}
+		return true;
+	}
+
+	void JournalState::Apply(const JournalRecord& record)
+	{
+		if (record.file >= files.size())
+			files.resize((size_t)record.file + 1);
+
+		JournalFileState& file = files[record.file];
+		switch (record.type)
+		{
+		case JOURNAL_FILE_STARTED:
+			file = JournalFileState();
+			file.started = true;
+			file.partSize = record.size;
+			file.uploadId = record.text;
+			break;
+
+		case JOURNAL_PART_COMPLETED:
+		{
+			S3Part part;
+			part.partNumber = record.partNumber;
+			part.size = record.size;
+			part.etag = record.text;
+			part.hasMd5 = record.hasMd5;
+			if (record.hasMd5)
+				memcpy(part.md5, record.md5, MD5_DIGEST_SIZE);
+
+			// parts mostly complete in order.
+			if (file.parts.empty() || file.parts.back().partNumber < part.partNumber)
+				file.parts.push_back(part);
+			else
+			{
+				auto position = std::lower_bound(file.parts.begin(), file.parts.end(), part,
+					[](const S3Part& left, const S3Part& right) { return left.partNumber < right.partNumber; });
+				if (position != file.parts.end() && position->partNumber == part.partNumber)
+					*position = part;
+				else
+					file.parts.insert(position, part);
+			}
+			break;
+		}
+
+		case JOURNAL_FILE_COMPLETED:
+			file.completed = true;
+			file.size = record.size;
+			file.md5 = record.text;
+			file.uploadId.clear();
+			std::vector<S3Part>().swap(file.parts);
+			break;
+
+		case JOURNAL_FILE_RESET:
+			file = JournalFileState();
+			break;
+		}
+
+		records++;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CResumeJournal methods
+	//
+
+	CResumeJournal::CResumeJournal()
+		: m_logSize(0), m_open(false), m_stopping(false), m_writerDone(false), m_appended(0), m_durable(0), m_syncRequested(false),
+		m_compactRequested(false), m_compacting(false), m_snapshotGeneration(0), m_generation(0), m_error(BS_OK)
+	{
+		memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	CResumeJournal::~CResumeJournal()
+	{
+		Close();
+	}
+
+	//
+	//   FUNCTION: CResumeJournal::Replay(uint64_t&, uint64_t&, bool&)
+	//
+	//   PURPOSE: Loads the snapshot and replays the logs after it into the
+	//            state. generation receives the last log's, validLength the
+	//            bytes of it that hold whole records; validHeader is false
+	//            when there is no last log or its header never made it.
+	//
+	BsStatus CResumeJournal::Replay(uint64_t& generation, uint64_t& validLength, bool& validHeader)
+	{
+		generation = 1;
+		validLength = 0;
+		validHeader = false;
+
+		std::vector<uint8_t> data;
+		CFile file;
+		PathString snapshotPath = JournalFilePath(m_path, ".snap");
+		if (FileExists(snapshotPath.c_str()))
+		{
+			BsStatus status = file.Open(snapshotPath.c_str());
+			if (status == BS_OK)
+				status = ReadWholeFile(file, data);
+			file.Close();
+			if (status != BS_OK)
+				return status;
+
+			// a snapshot is renamed into place whole; a bad one is damage,
+			// not a crash, and the logs it replaced are gone.
+			if (data.size() < SNAPSHOT_HEADER_SIZE || memcmp(&data[0], SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+				GetLittleEndian32(&data[4]) != JOURNAL_VERSION || Crc32(&data[0], 32) != GetLittleEndian32(&data[32]) ||
+				GetLittleEndian64(&data[24]) != data.size() - SNAPSHOT_HEADER_SIZE)
+				return BS_E_CORRUPT;
+
+			generation = GetLittleEndian64(&data[8]);
+			uint64_t records = GetLittleEndian64(&data[16]);
+
+			JournalRecord record;
+			const uint8_t* position = &data[SNAPSHOT_HEADER_SIZE];
+			const uint8_t* end = data.data() + data.size();
+			while (position != end)
+			{
+				if (!ReadRecord(position, end, record))
+					return BS_E_CORRUPT;
+				m_state.Apply(record);
+			}
+			m_state.records = records;
+		}
+
+		for (uint64_t current = generation; ; ++current)
+		{
+			PathString logPath = LogPath(m_path, current);
+			if (!FileExists(logPath.c_str()))
+				break;
+
+			BsStatus status = file.Open(logPath.c_str());
+			if (status == BS_OK)
+				status = ReadWholeFile(file, data);
+			file.Close();
+			if (status != BS_OK)
+				return status;
+
+			generation = current;
+			validLength = 0;
+			validHeader = data.size() >= LOG_HEADER_SIZE && memcmp(&data[0], LOG_MAGIC, sizeof(LOG_MAGIC)) == 0 &&
+				GetLittleEndian32(&data[4]) == JOURNAL_VERSION && GetLittleEndian64(&data[8]) == current &&
+				Crc32(&data[0], 16) == GetLittleEndian32(&data[16]);
+			if (!validHeader)
+			{
+				// a log is created and flushed before the one before it is
+				// left, so only the newest can be missing its header.
+				m_stats.tornTail = !data.empty();
+				break;
+			}
+
+			JournalRecord record;
+			const uint8_t* position = &data[LOG_HEADER_SIZE];
+			const uint8_t* end = data.data() + data.size();
+			while (position != end && ReadRecord(position, end, record))
+			{
+				m_state.Apply(record);
+				m_stats.replayedRecords++;
+			}
+
+			validLength = (uint64_t)(position - data.data());
+			if (position != end)
+			{
+				m_stats.tornTail = true;
+				break;
+			}
+		}
+
+		// logs past a torn one were never acknowledged; they go.
+		for (uint64_t stale = generation + 1; ; ++stale)
+		{
+			PathString logPath = LogPath(m_path, stale);
+			if (!FileExists(logPath.c_str()))
+				break;
+			RemoveFile(logPath.c_str());
+		}
+
+		return BS_OK;
+	}
+
+	BsStatus CResumeJournal::CreateLog(uint64_t generation, CFile& log)
+	{
+		PathString logPath = LogPath(m_path, generation);
+		BsStatus status = log.Open(logPath.c_str(), FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE);
+		if (status != BS_OK)
+			return status;
+
+		uint8_t header[LOG_HEADER_SIZE];
+		memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+		PutLittleEndian32(header + 4, JOURNAL_VERSION);
+		PutLittleEndian64(header + 8, generation);
+		PutLittleEndian32(header + 16, Crc32(header, 16));
+
+		status = log.WriteAt(0, header, sizeof(header));
+		if (status == BS_OK && m_options.sync)
+			status = log.Sync();
+		if (status == BS_OK && m_options.sync)
+			status = SyncParentDirectory(logPath.c_str());
+		return status;
+	}
+
+	//
+	//   FUNCTION: CResumeJournal::Open(const PathString&, const JournalOptions&)
+	//
+	//   PURPOSE: Rebuilds the state, cuts a torn record off the newest log
+	//            and starts the writer and the compactor.
+	//
+	BsStatus CResumeJournal::Open(const PathString& path, const JournalOptions& options)
+	{
+		Close();
+
+		m_path = path;
+		m_options = options;
+		m_state = JournalState();
+		memset(&m_stats, 0, sizeof(m_stats));
+
+		auto start = std::chrono::steady_clock::now();
+		uint64_t generation = 0;
+		uint64_t validLength = 0;
+		bool validHeader = false;
+		BsStatus status = Replay(generation, validLength, validHeader);
+		if (status != BS_OK)
+			return status;
+
+		m_log.reset(new CFile);
+		if (validHeader)
+		{
+			status = m_log->Open(LogPath(m_path, generation).c_str(), FILE_OPEN_WRITE);
+			uint64_t size = 0;
+			if (status == BS_OK)
+				status = m_log->GetSize(size);
+			if (status == BS_OK && size != validLength)
+			{
+				status = m_log->Truncate(validLength);
+				if (status == BS_OK)
+					status = m_log->Sync();
+			}
+		}
+		else
+		{
+			status = CreateLog(generation, *m_log);
+			validLength = LOG_HEADER_SIZE;
+		}
+		if (status != BS_OK)
+		{
+			m_log.reset();
+			return status;
+		}
+
+		RemoveLogsBefore(generation);
+
+		m_logSize = validLength;
+		m_generation = generation;
+		m_appended = 0;
+		m_durable = 0;
+		m_error = BS_OK;
+		m_stopping = false;
+		m_writerDone = false;
+		m_syncRequested = false;
+		m_compactRequested = false;
+		m_compacting = false;
+		m_stats.generation = generation;
+		m_stats.replaySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		m_open = true;
+		m_writer = std::thread(&CResumeJournal::WriterLoop, this);
+		m_compactor = std::thread(&CResumeJournal::CompactorLoop, this);
+		return BS_OK;
+	}
+
+	void CResumeJournal::Close()
+	{
+		if (!m_open)
+			return;
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_stopping = true;
+		}
+		m_writerWake.notify_all();
+		m_writer.join();
+
+		// the compactor finishes a snapshot the writer handed it first.
+		m_compactor.join();
+
+		m_log.reset();
+		m_open = false;
+	}
+
+	BsStatus CResumeJournal::Append(const JournalRecord& record, uint64_t* sequence)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!m_open || m_stopping)
+			return BS_E_INVALIDARG;
+		if (m_error != BS_OK)
+			return m_error;
+		if (record.type < JOURNAL_FILE_STARTED || record.type > JOURNAL_FILE_RESET || record.text.size() > MAX_TEXT)
+			return BS_E_INVALIDARG;
+
+		bool wasEmpty = m_pending.empty();
+		AppendRecord(m_pending, record);
+		m_state.Apply(record);
+		m_appended++;
+		if (sequence != NULL)
+			*sequence = m_appended;
+
+		if (wasEmpty)
+		{
+			m_pendingSince = std::chrono::steady_clock::now();
+			m_writerWake.notify_one();
+		}
+		else if (m_pending.size() >= BATCH_BYTES)
+			m_writerWake.notify_one();
+		return BS_OK;
+	}
+
+	BsStatus CResumeJournal::Sync(uint64_t sequence)
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		if (!m_open)
+			return BS_E_INVALIDARG;
+		if (sequence == 0 || sequence > m_appended)
+			sequence = m_appended;
+
+		if (m_durable < sequence && m_error == BS_OK)
+		{
+			m_syncRequested = true;
+			m_writerWake.notify_one();
+			m_durableChanged.wait(guard, [this, sequence]() { return m_durable >= sequence || m_error != BS_OK; });
+		}
+		return m_durable >= sequence ? BS_OK : m_error;
+	}
+
+	BsStatus CResumeJournal::Compact()
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		if (!m_open)
+			return BS_E_INVALIDARG;
+
+		uint64_t compactions = m_stats.compactions;
+		m_durableChanged.wait(guard, [this]() { return !m_compacting || m_error != BS_OK; });
+		m_compactRequested = true;
+		m_writerWake.notify_one();
+		m_durableChanged.wait(guard, [this, compactions]()
+		{
+			return m_stats.compactions > compactions || m_error != BS_OK;
+		});
+		return m_error;
+	}
+
+	//
+	//   FUNCTION: CResumeJournal::WriterLoop()
+	//
+	//   PURPOSE: Takes everything queued once the first record of a batch
+	//            waited out the commit interval (or at once for Sync, a full
+	//            batch or Close), writes and flushes it, and marks it
+	//            durable. When the log is due for compaction the state is
+	//            serialized with the batch taken, and the batch closes the
+	//            log: the next one goes to a new generation.
+	//
+	void CResumeJournal::WriterLoop()
+	{
+		std::vector<uint8_t> batch;
+		auto interval = std::chrono::milliseconds(m_options.commitIntervalMs);
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (;;)
+		{
+			while (!m_stopping && !m_syncRequested && !m_compactRequested && m_pending.size() < BATCH_BYTES)
+			{
+				if (m_pending.empty())
+					m_writerWake.wait(guard);
+				else if (std::chrono::steady_clock::now() >= m_pendingSince + interval)
+					break;
+				else
+					m_writerWake.wait_until(guard, m_pendingSince + interval);
+			}
+
+			if (m_pending.empty() && !m_compactRequested)
+			{
+				m_syncRequested = false;
+				if (m_stopping)
+					break;
+				continue;
+			}
+
+			batch.clear();
+			batch.swap(m_pending);
+			uint64_t sequence = m_appended;
+			m_syncRequested = false;
+
+			std::vector<uint8_t> snapshot;
+			bool roll = m_error == BS_OK && !m_compacting &&
+				(m_compactRequested || m_logSize + batch.size() >= m_options.compactBytes);
+			if (roll)
+			{
+				SerializeState(m_state, m_generation + 1, snapshot);
+				m_compacting = true;
+			}
+			m_compactRequested = false;
+			bool failed = m_error != BS_OK;
+			guard.unlock();
+
+			BsStatus status = BS_OK;
+			std::unique_ptr<CFile> next;
+			if (!failed)
+			{
+				status = m_log->WriteAt(m_logSize, batch.data(), batch.size());
+				if (status == BS_OK && m_options.sync)
+					status = m_log->Sync();
+				if (status == BS_OK && roll)
+				{
+					next.reset(new CFile);
+					status = CreateLog(m_generation + 1, *next);
+				}
+			}
+
+			guard.lock();
+			if (failed)
+			{
+				// nothing more goes to the log; the records are lost.
+			}
+			else if (status != BS_OK)
+			{
+				m_error = status;
+				m_compacting = false;
+			}
+			else
+			{
+				m_durable = sequence;
+				m_logSize += batch.size();
+				m_stats.batches++;
+				m_stats.bytesWritten += batch.size();
+
+				if (roll)
+				{
+					m_log.swap(next);
+					m_generation++;
+					m_logSize = LOG_HEADER_SIZE;
+					m_stats.generation = m_generation;
+					m_snapshot.swap(snapshot);
+					m_snapshotGeneration = m_generation;
+					m_compactorWake.notify_one();
+				}
+			}
+			m_durableChanged.notify_all();
+
+			// the old log is closed outside the lock.
+			guard.unlock();
+			next.reset();
+			guard.lock();
+		}
+
+		m_writerDone = true;
+		m_compactorWake.notify_all();
+	}
+
+	BsStatus CResumeJournal::WriteSnapshot(const std::vector<uint8_t>& snapshot, uint64_t generation)
+	{
+		PathString snapshotPath = JournalFilePath(m_path, ".snap");
+		PathString temporaryPath = JournalFilePath(m_path, ".snap.tmp");
+
+		CFile file;
+		BsStatus status = file.Open(temporaryPath.c_str(), FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE);
+		if (status == BS_OK)
+			status = file.WriteAt(0, snapshot.data(), snapshot.size());
+		if (status == BS_OK && m_options.sync)
+			status = file.Sync();
+		file.Close();
+
+		if (status == BS_OK)
+			status = RenameFile(temporaryPath.c_str(), snapshotPath.c_str());
+		if (status == BS_OK && m_options.sync)
+			status = SyncParentDirectory(snapshotPath.c_str());
+		if (status == BS_OK)
+			RemoveLogsBefore(generation);
+		return status;
+	}
+
+	void CResumeJournal::RemoveLogsBefore(uint64_t generation)
+	{
+		for (uint64_t stale = generation; stale-- > 1; )
+		{
+			PathString logPath = LogPath(m_path, stale);
+			if (!FileExists(logPath.c_str()))
+				break;
+			RemoveFile(logPath.c_str());
+		}
+	}
+
+	void CResumeJournal::CompactorLoop()
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		for (;;)
+		{
+			// the writer may still hand over a last snapshot while it stops.
+			m_compactorWake.wait(guard, [this]() { return !m_snapshot.empty() || m_writerDone; });
+			if (m_snapshot.empty())
+				break;
+
+			std::vector<uint8_t> snapshot;
+			snapshot.swap(m_snapshot);
+			uint64_t generation = m_snapshotGeneration;
+			guard.unlock();
+
+			BsStatus status = WriteSnapshot(snapshot, generation);
+
+			guard.lock();
+			if (status != BS_OK && m_error == BS_OK)
+				m_error = status;
+			m_compacting = false;
+			m_stats.compactions++;
+			m_durableChanged.notify_all();
+		}
+	}
+
+	uint32_t CResumeJournal::FileCount() const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		return (uint32_t)m_state.files.size();
+	}
+
+	bool CResumeJournal::GetFile(uint32_t file, JournalFileState& state) const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (file >= m_state.files.size())
+			return false;
+		state = m_state.files[file];
+		return true;
+	}
+
+	uint64_t CResumeJournal::Records() const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_state.records;
+	}
+
+	JournalStats CResumeJournal::Stats() const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		JournalStats stats = m_stats;
+		stats.records = m_state.records;
+		return stats;
+	}
+}
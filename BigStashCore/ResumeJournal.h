@@ -0,0 +1,194 @@
+// ResumeJournal.h : Declaration of CResumeJournal, the crash-safe record of
+// upload progress
+
+#pragma once
+
+#include "File.h"
+#include "S3Client.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace BigStash
+{
+	enum JournalRecordType
+	{
+		// A multipart upload was initiated: size is the part size, text the
+		// upload ID. Forgets the file's earlier parts.
+		JOURNAL_FILE_STARTED = 1,
+
+		// S3 accepted a part: partNumber, size, the ETag in text and, when
+		// hasMd5, the MD5 of the body that was sent.
+		JOURNAL_PART_COMPLETED = 2,
+
+		// The file is on S3: size is the file size, text its MD5 (hex).
+		// Drops the parts, which are no longer needed to resume.
+		JOURNAL_FILE_COMPLETED = 3,
+
+		// The file starts over, e.g. after its upload was aborted.
+		JOURNAL_FILE_RESET = 4
+	};
+
+	struct JournalRecord
+	{
+		JournalRecord() : type(JOURNAL_FILE_RESET), file(0), partNumber(0), size(0), hasMd5(false) {}
+
+		JournalRecordType type;
+
+		// Index of the file in the archive.
+		uint32_t file;
+		uint32_t partNumber;
+		uint64_t size;
+		std::string text;
+		uint8_t md5[MD5_DIGEST_SIZE];
+		bool hasMd5;
+	};
+
+	struct JournalFileState
+	{
+		JournalFileState() : started(false), completed(false), partSize(0), size(0) {}
+
+		bool started;
+		bool completed;
+		uint64_t partSize;
+		uint64_t size;
+		std::string uploadId;
+		std::string md5;
+
+		// Sorted by part number.
+		std::vector<S3Part> parts;
+
+		bool operator==(const JournalFileState& other) const;
+	};
+
+	// What the records add up to. Replaying a journal rebuilds it.
+	struct JournalState
+	{
+		JournalState() : records(0) {}
+
+		void Apply(const JournalRecord& record);
+
+		std::vector<JournalFileState> files;
+
+		// Records applied since the journal was created, snapshots included.
+		uint64_t records;
+	};
+
+	struct JournalOptions
+	{
+		JournalOptions() : commitIntervalMs(2), compactBytes(32 * 1024 * 1024), sync(true) {}
+
+		// How long the first record of a batch waits for others to share its
+		// write and flush. Sync does not wait.
+		unsigned commitIntervalMs;
+
+		// The log is compacted into a snapshot once it grows past this.
+		uint64_t compactBytes;
+
+		// Flush every batch to the disk. Off, a crash of the process loses
+		// nothing but a crash of the machine may lose the last batches.
+		bool sync;
+	};
+
+	struct JournalStats
+	{
+		uint64_t records;
+		uint64_t batches;
+		uint64_t bytesWritten;
+		uint64_t compactions;
+		uint64_t generation;
+
+		// What Open found.
+		uint64_t replayedRecords;
+		double replaySeconds;
+		bool tornTail;
+	};
+
+	// CResumeJournal
+	//
+	// The resume state of an upload, kept as an append-only log of per-file
+	// and per-part changes instead of rewriting the whole state after every
+	// file. Records are framed with their length and a CRC-32, so a record
+	// torn by a crash is recognized and replay stops before it. Appends only
+	// queue the record; a writer thread writes and flushes whatever queued up
+	// in one go (group commit), and Sync waits for that. Once the log grows
+	// past compactBytes the writer starts a new log and a compactor thread
+	// writes the state up to that point as a snapshot (to a temporary file,
+	// flushed and renamed over the old one), after which the older logs go.
+	// Open loads the snapshot and replays the logs after it.
+	//
+	// Files next to path: path.snap and path.<generation>.log.
+	class CResumeJournal
+	{
+	public:
+		CResumeJournal();
+		~CResumeJournal();
+
+		BsStatus Open(const PathString& path, const JournalOptions& options = JournalOptions());
+
+		// Writes what is queued and waits for a compaction in progress.
+		void Close();
+
+		// Applies the record to the state and queues it. Fails with the
+		// error of an earlier write, after which the journal takes nothing,
+		// and for an unknown type or a text near 64 KB or over.
+		BsStatus Append(const JournalRecord& record, uint64_t* sequence = NULL);
+
+		// Waits until the record with this sequence (0: every record
+		// appended so far) is on the disk.
+		BsStatus Sync(uint64_t sequence = 0);
+
+		// Starts a new log and snapshots the state now, and waits for it.
+		BsStatus Compact();
+
+		uint32_t FileCount() const;
+		bool GetFile(uint32_t file, JournalFileState& state) const;
+		uint64_t Records() const;
+		JournalStats Stats() const;
+
+	private:
+		CResumeJournal(const CResumeJournal&);
+		CResumeJournal& operator=(const CResumeJournal&);
+
+		BsStatus Replay(uint64_t& generation, uint64_t& validLength, bool& validHeader);
+		BsStatus CreateLog(uint64_t generation, CFile& log);
+		void WriterLoop();
+		void CompactorLoop();
+		BsStatus WriteSnapshot(const std::vector<uint8_t>& snapshot, uint64_t generation);
+		void RemoveLogsBefore(uint64_t generation);
+
+		PathString m_path;
+		JournalOptions m_options;
+		std::unique_ptr<CFile> m_log;
+		uint64_t m_logSize;
+
+		mutable std::mutex m_lock;
+		std::condition_variable m_writerWake;
+		std::condition_variable m_compactorWake;
+		std::condition_variable m_durableChanged;
+		std::thread m_writer;
+		std::thread m_compactor;
+		bool m_open;
+		bool m_stopping;
+		bool m_writerDone;
+
+		JournalState m_state;
+		std::vector<uint8_t> m_pending;
+		std::chrono::steady_clock::time_point m_pendingSince;
+		uint64_t m_appended;
+		uint64_t m_durable;
+		bool m_syncRequested;
+		bool m_compactRequested;
+		bool m_compacting;
+		std::vector<uint8_t> m_snapshot;
+		uint64_t m_snapshotGeneration;
+		uint64_t m_generation;
+		BsStatus m_error;
+		JournalStats m_stats;
+	};
+}
@@ -0,0 +1,714 @@
+// S3Client.cpp : Implementation of CS3Client
+
+#include "S3Client.h"
+#include "Encoding.h"
+#include "Xml.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <thread>
+
+namespace BigStash
+{
+	namespace
+	{
+		bool IsRetriable(BsStatus status)
+		{
+			return status == BS_E_IO;
+		}
+
+		// The network stages of one attempt, from the HTTP client's
+		// timestamps.
+		void TraceExchange(CUploadTrace* trace, uint32_t part, const HttpTiming& timing, uint64_t bytes)
+		{
+			if (timing.assigned == 0)
+				return;
+
+			trace->Record(TRACE_CONNECTION_WAIT, part, timing.queued, timing.assigned);
+			if (timing.connected == 0)
+				return;
+
+			if (timing.newConnection)
+				trace->Record(TRACE_CONNECT, part, timing.assigned, timing.connected);
+
+			// an early answer (an error) cuts the send short.
+			int64_t sent = timing.sent != 0 ? timing.sent : timing.firstByte;
+			if (sent == 0)
+				return;
+
+			trace->Record(TRACE_SEND, part, timing.connected, sent, bytes);
+			if (timing.firstByte == 0)
+				return;
+
+			if (timing.sent != 0)
+				trace->Record(TRACE_SERVER_WAIT, part, timing.sent, timing.firstByte);
+			trace->Record(TRACE_RECEIVE, part, timing.firstByte, timing.done);
+		}
+
+		HttpClientOptions HttpOptionsFor(const S3ClientOptions& options)
+		{
+			HttpClientOptions http;
+			http.host = options.host;
+			http.port = options.port;
+			http.maxConnections = std::max(1u, options.connections);
+			http.socket = options.socket;
+			return http;
+		}
+	}
+
+	CS3Client::CS3Client(const S3ClientOptions& options)
+		: m_options(options), m_http(HttpOptionsFor(options)), m_deadline(options.hedging)
+	{
+		m_options.connections = std::max(1u, m_options.connections);
+		m_options.maxAttempts = std::max(1u, m_options.maxAttempts);
+	}
+
+	CS3Client::~CS3Client()
+	{
+		Stop();
+	}
+
+	BsStatus CS3Client::Start()
+	{
+		return m_http.Start();
+	}
+
+	void CS3Client::Stop()
+	{
+		m_http.Stop();
+	}
+
+	std::string CS3Client::LastError() const
+	{
+		std::lock_guard<std::mutex> guard(m_errorLock);
+		return m_lastError;
+	}
+
+	//
+	//   FUNCTION: CS3Client::PrepareRequest(...)
+	//
+	//   PURPOSE: Fills in the method, the Host header and the path-style or
+	//            virtual-hosted target of a request on bucket/key.
+	//
+	void CS3Client::PrepareRequest(HttpRequest& request, const char* method, const std::string& bucket,
+		const std::string& key, const std::string& query) const
+	{
+		request.method = method;
+
+		// the Host header is set here, as the signature covers it.
+		std::string host = m_options.virtualHostedStyle ? bucket + "." + m_options.host : m_options.host;
+		if (m_options.port != 80)
+			host += ":" + std::to_string(m_options.port);
+		request.headers.push_back(std::make_pair(std::string("Host"), host));
+
+		if (m_options.virtualHostedStyle)
+			request.target = "/" + UriEncode(key, true);
+		else
+			request.target = "/" + UriEncode(bucket, false) + "/" + UriEncode(key, true);
+
+		if (!query.empty())
+			request.target += "?" + query;
+	}
+
+	BsStatus CS3Client::StatusFromResponse(const HttpResponse& response)
+	{
+		// CompleteMultipartUpload can fail after a 200, with an error body.
+		bool errorBody = response.body.find("<Error>") != std::string::npos;
+		if (response.status >= 200 && response.status < 300 && !errorBody)
+			return BS_OK;
+
+		std::string code = XmlElement(response.body, "Code");
+		{
+			std::lock_guard<std::mutex> guard(m_errorLock);
+			m_lastError = code.empty() ? "HTTP " + std::to_string(response.status) : code;
+		}
+
+		if (response.status >= 500 || code == "InternalError" || code == "SlowDown" || code == "RequestTimeout")
+			return BS_E_IO;
+		if (code == "BadDigest" || code == "InvalidDigest")
+			return BS_E_CORRUPT;
+		if (response.status == 403)
+			return BS_E_ACCESSDENIED;
+		if (response.status == 404)
+			return BS_E_NOTFOUND;
+		return BS_E_INVALIDARG;
+	}
+
+	//
+	//   FUNCTION: CS3Client::ExecuteWithRetries(HttpRequest&, HttpResponse&)
+	//
+	//   PURPOSE: Signs and sends a request, again after a pause when it fails
+	//            with a 5xx or a network error. The signature is redone on
+	//            every attempt, as it covers the request time.
+	//
+	BsStatus CS3Client::ExecuteWithRetries(HttpRequest& request, HttpResponse& response)
+	{
+		size_t unsignedHeaders = request.headers.size();
+		BsStatus status = BS_E_IO;
+		CRetryBackoff backoff;
+
+		for (unsigned attempt = 1; attempt <= m_options.maxAttempts; ++attempt)
+		{
+			request.headers.resize(unsignedHeaders);
+			if (m_options.signer)
+				m_options.signer(request);
+
+			status = m_http.Execute(request, response);
+			if (status == BS_OK)
+				status = StatusFromResponse(response);
+
+			if (!IsRetriable(status) || attempt == m_options.maxAttempts)
+				break;
+
+			std::this_thread::sleep_for(backoff.Next());
+		}
+
+		return status;
+	}
+
+	BsStatus CS3Client::InitiateMultipartUpload(const std::string& bucket, const std::string& key, std::string& uploadId)
+	{
+		HttpRequest request;
+		HttpResponse response;
+		PrepareRequest(request, "POST", bucket, key, "uploads");
+
+		BsStatus status = ExecuteWithRetries(request, response);
+		if (status != BS_OK)
+			return status;
+
+		uploadId = XmlElement(response.body, "UploadId");
+		return uploadId.empty() ? BS_E_CORRUPT : BS_OK;
+	}
+
+	BsStatus CS3Client::PutObject(const std::string& bucket, const std::string& key, const uint8_t* data,
+		size_t length, const uint8_t* md5, std::string& etag)
+	{
+		HttpRequest request;
+		HttpResponse response;
+		PrepareRequest(request, "PUT", bucket, key, std::string());
+		request.body = data;
+		request.bodyLength = length;
+		if (md5 != NULL)
+			request.headers.push_back(std::make_pair(std::string("Content-MD5"), Base64Encode(md5, MD5_DIGEST_SIZE)));
+
+		BsStatus status = ExecuteWithRetries(request, response);
+		if (status != BS_OK)
+			return status;
+
+		const std::string* header = response.Header("ETag");
+		if (header == NULL)
+			return BS_E_CORRUPT;
+
+		etag = *header;
+		return BS_OK;
+	}
+
+	BsStatus CS3Client::UploadPart(const std::string& bucket, const std::string& key, const std::string& uploadId,
+		uint32_t partNumber, const uint8_t* data, size_t length, const uint8_t* md5, std::string& etag)
+	{
+		HttpRequest request;
+		HttpResponse response;
+		PrepareRequest(request, "PUT", bucket, key,
+			"partNumber=" + std::to_string(partNumber) + "&uploadId=" + UriEncode(uploadId, false));
+		request.body = data;
+		request.bodyLength = length;
+		if (md5 != NULL)
+			request.headers.push_back(std::make_pair(std::string("Content-MD5"), Base64Encode(md5, MD5_DIGEST_SIZE)));
+
+		BsStatus status = ExecuteWithRetries(request, response);
+		if (status != BS_OK)
+			return status;
+
+		const std::string* header = response.Header("ETag");
+		if (header == NULL)
+			return BS_E_CORRUPT;
+
+		etag = *header;
+		return BS_OK;
+	}
+
+	//
+	//   FUNCTION: CS3Client::UploadParts(...)
+	//
+	//   PURPOSE: Keeps up to window parts in flight. The caller's thread
+	//            pulls parts from the reader and collects the completions
+	//            the event loop hands back; a part is released to the
+	//            reader only once S3 accepted it and none of its requests
+	//            is still out, so retries and hedges send the same buffer.
+	//            A failed part waits out its backoff here, between
+	//            completions, while the other parts keep going. A part
+	//            still out past its deadline gets a second request, which
+	//            takes the first connection to free up; the first to
+	//            succeed wins and the other is cancelled. With a scheduler,
+	//            every send waits for a slot, and the event loop gives the
+	//            slot back as soon as the response is in, with the outcome
+	//            the limit follows: a cancelled straggler counts as a
+	//            failure, like a timeout. The stages are traced on this
+	//            thread, from the timestamps the completion brings back.
+	//
+	BsStatus CS3Client::UploadParts(const std::string& bucket, const std::string& key, const std::string& uploadId,
+		CPartReader& reader, std::vector<S3Part>& uploaded, const S3PartCallback& onPart,
+		const std::atomic<bool>* cancel, CUploadTrace* trace)
+	{
+		struct PartState;
+
+		// One request of a part: the first one or a retry, or a hedge.
+		struct Attempt
+		{
+			PartState* owner;
+			bool hedge;
+			HttpRequest request;
+
+			// what Cancel takes; the request is submitted again on a retry.
+			uint64_t exchange;
+			size_t unsignedHeaders;
+			int64_t submitted;
+			BsStatus status;
+			HttpResponse response;
+			SchedulerTicket ticket;
+		};
+
+		struct PartState
+		{
+			PartData* part;
+			int64_t taken;
+
+			// requests sent as first or retry; hedges are not counted.
+			unsigned attempts;
+			unsigned live;
+			bool accepted;
+			bool hedged;
+			Attempt first;
+			Attempt second;
+
+			// a failed part is sent again at retryAt (0 when not waiting).
+			CRetryBackoff backoff;
+			int64_t failedAt;
+			int64_t retryAt;
+			unsigned httpStatus;
+		};
+
+		std::mutex lock;
+		std::condition_variable completed;
+		std::deque<Attempt*> done;
+
+		CUploadScheduler* scheduler = m_options.scheduler;
+		uint32_t upload = scheduler != NULL ? scheduler->RegisterUpload(m_options.bandwidthLimit) : 0;
+
+		CBinaryLogger* log = m_options.logger != NULL && m_options.logger->IsOpen() ? m_options.logger : NULL;
+		uint32_t name = log != NULL ? log->Intern(key) : 0;
+
+		int64_t fileStart = trace != NULL || log != NULL ? MonotonicNanoseconds() : 0;
+		uint64_t fileBytes = 0;
+		size_t fileParts = 0;
+
+		auto submit = [&](Attempt* attempt) -> BsStatus
+		{
+			uint32_t partNumber = attempt->owner->part->partNumber;
+			if (scheduler != NULL)
+			{
+				int64_t start = trace != NULL ? MonotonicNanoseconds() : 0;
+				BsStatus status = scheduler->Acquire(upload, attempt->request.bodyLength, attempt->ticket, cancel);
+				if (status != BS_OK)
+					return status;
+				if (trace != NULL)
+					trace->Record(TRACE_SLOT_WAIT, partNumber, start, MonotonicNanoseconds());
+			}
+
+			attempt->request.headers.resize(attempt->unsignedHeaders);
+			if (m_options.signer)
+			{
+				int64_t start = trace != NULL ? MonotonicNanoseconds() : 0;
+				m_options.signer(attempt->request);
+				if (trace != NULL)
+					trace->Record(TRACE_SIGN, partNumber, start, MonotonicNanoseconds());
+			}
+
+			attempt->submitted = MonotonicNanoseconds();
+			attempt->owner->live++;
+			attempt->exchange = m_http.Submit(&attempt->request,
+				[&lock, &completed, &done, scheduler, attempt](BsStatus status, HttpResponse& response)
+			{
+				// a 5xx (SlowDown included) or a dropped request is a congestion
+				// signal; a refused part is not, nor a hedge's loser we cancelled.
+				if (scheduler != NULL && status == BS_E_CANCELLED)
+					scheduler->Abandon(attempt->ticket);
+				else if (scheduler != NULL)
+					scheduler->Release(attempt->ticket, status == BS_OK && response.status < 500);
+
+				std::lock_guard<std::mutex> guard(lock);
+				attempt->status = status;
+				attempt->response = std::move(response);
+				done.push_back(attempt);
+				completed.notify_one();
+			});
+			return BS_OK;
+		};
+
+		// every part in flight holds a reader buffer until S3 accepts it.
+		size_t window = m_options.window != 0 ? m_options.window : m_options.connections;
+		window = std::min(window, reader.MaxOutstanding());
+		std::vector<std::unique_ptr<PartState> > parts;
+		unsigned hedges = 0;
+		bool more = true;
+		BsStatus failure = BS_OK;
+
+		auto giveUp = [&](PartState* state, BsStatus status)
+		{
+			if (failure == BS_OK)
+				failure = status;
+			if (trace != NULL)
+				trace->CountFailure();
+			if (log != NULL)
+				log->Log(LOG_PART_FAILED, name, state->part->partNumber, state->attempts, status, state->httpStatus);
+		};
+
+		if (log != NULL)
+			log->Log(LOG_PARTS_STARTED, name, window);
+
+		for (;;)
+		{
+			if (cancel != NULL && failure == BS_OK && cancel->load())
+				failure = BS_E_CANCELLED;
+
+			while (more && failure == BS_OK && parts.size() < window)
+			{
+				PartData* part = NULL;
+				BsStatus status = reader.Next(part);
+				if (status == BS_E_NOMOREITEMS)
+				{
+					more = false;
+					break;
+				}
+				if (status != BS_OK)
+				{
+					failure = status;
+					break;
+				}
+
+				std::unique_ptr<PartState> state(new PartState);
+				state->part = part;
+				state->taken = 0;
+				if (trace != NULL)
+				{
+					state->taken = MonotonicNanoseconds();
+					if (part->readyTime != 0)
+						trace->Record(TRACE_QUEUED, part->partNumber, part->readyTime, state->taken);
+				}
+				state->attempts = 1;
+				state->live = 0;
+				state->accepted = false;
+				state->hedged = false;
+				state->failedAt = 0;
+				state->retryAt = 0;
+				state->httpStatus = 0;
+
+				Attempt& first = state->first;
+				first.owner = state.get();
+				first.hedge = false;
+				first.status = BS_OK;
+				PrepareRequest(first.request, "PUT", bucket, key,
+					"partNumber=" + std::to_string(part->partNumber) + "&uploadId=" + UriEncode(uploadId, false));
+				first.request.body = part->data;
+				first.request.bodyLength = part->length;
+				first.request.bodySha256 = part->hasSha256 ? part->sha256 : NULL;
+				if (part->hasMd5)
+				{
+					first.request.headers.push_back(std::make_pair(std::string("Content-MD5"),
+						Base64Encode(part->md5, MD5_DIGEST_SIZE)));
+				}
+				first.unsignedHeaders = first.request.headers.size();
+
+				status = submit(&first);
+				if (status != BS_OK)
+				{
+					reader.Release(part);
+					failure = status;
+					break;
+				}
+				parts.push_back(std::move(state));
+			}
+
+			// send the retries that are due and the hedges of late parts, and
+			// find out when the next one is.
+			int64_t now = MonotonicNanoseconds();
+			int64_t wake = 0;
+			for (size_t i = 0; i < parts.size();)
+			{
+				PartState* state = parts[i].get();
+				uint32_t partNumber = state->part->partNumber;
+
+				if (state->retryAt != 0 && (now >= state->retryAt || failure != BS_OK))
+				{
+					BsStatus status = failure == BS_OK ? BS_OK : state->first.status;
+					if (failure == BS_OK)
+					{
+						if (trace != NULL)
+						{
+							trace->Record(TRACE_RETRY_DELAY, partNumber, state->failedAt, now);
+							trace->CountRetry();
+						}
+
+						state->retryAt = 0;
+						state->attempts++;
+						status = submit(&state->first);
+					}
+
+					if (status != BS_OK)
+					{
+						giveUp(state, status);
+						reader.Release(state->part);
+						parts.erase(parts.begin() + i);
+						continue;
+					}
+				}
+				else if (state->retryAt != 0)
+					wake = wake == 0 ? state->retryAt : std::min(wake, state->retryAt);
+				else if (m_deadline.Enabled() && failure == BS_OK && !state->accepted && !state->hedged &&
+					state->live == 1 && hedges < m_deadline.Options().maxInFlight)
+				{
+					int64_t deadline = m_deadline.Deadline(state->part->length);
+					int64_t due = state->first.submitted + deadline;
+					if (deadline != 0 && now >= due)
+					{
+						Attempt& second = state->second;
+						second.owner = state;
+						second.hedge = true;
+						second.status = BS_OK;
+						second.request = state->first.request;
+						second.unsignedHeaders = state->first.unsignedHeaders;
+
+						state->hedged = true;
+						BsStatus status = submit(&second);
+						if (status != BS_OK)
+							failure = status;
+						else
+						{
+							hedges++;
+							if (trace != NULL)
+								trace->CountHedge();
+							if (log != NULL)
+							{
+								log->Log(LOG_PART_HEDGED, name, partNumber, (now - state->first.submitted) / 1000000,
+									deadline / 1000000);
+							}
+						}
+					}
+					else if (deadline != 0)
+						wake = wake == 0 ? due : std::min(wake, due);
+				}
+
+				++i;
+			}
+
+			if (parts.empty())
+				break;
+
+			Attempt* attempt = NULL;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				if (wake == 0)
+				{
+					while (done.empty())
+						completed.wait(guard);
+				}
+				else
+				{
+					std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() +
+						std::chrono::nanoseconds(std::max(wake - MonotonicNanoseconds(), (int64_t)0));
+					while (done.empty() && completed.wait_until(guard, until) == std::cv_status::no_timeout)
+					{
+					}
+				}
+
+				if (!done.empty())
+				{
+					attempt = done.front();
+					done.pop_front();
+				}
+			}
+
+			if (attempt == NULL)
+				continue;
+
+			PartState* state = attempt->owner;
+			state->live--;
+			if (attempt->hedge)
+				hedges--;
+
+			BsStatus status = attempt->status == BS_OK ? StatusFromResponse(attempt->response) : attempt->status;
+			const std::string* etag = attempt->response.Header("ETag");
+			if (status == BS_OK && etag == NULL)
+				status = BS_E_CORRUPT;
+			attempt->status = status;
+
+			if (trace != NULL)
+				TraceExchange(trace, state->part->partNumber, attempt->response.timing, attempt->request.ContentLength());
+
+			if (state->accepted)
+			{
+				// the other request of a part that was hedged: cancelled, or
+				// answered second.
+			}
+			else if (status == BS_OK)
+			{
+				state->accepted = true;
+				m_deadline.Record(state->part->length, attempt->response.timing.done - attempt->submitted);
+				if (state->live > 0)
+					m_http.Cancel(attempt->hedge ? state->first.exchange : state->second.exchange);
+				if (attempt->hedge && trace != NULL)
+					trace->CountHedgeWon();
+
+				S3Part part;
+				part.partNumber = state->part->partNumber;
+				part.size = state->part->length;
+				part.etag = *etag;
+				if (state->part->hasMd5)
+				{
+					memcpy(part.md5, state->part->md5, MD5_DIGEST_SIZE);
+					part.hasMd5 = true;
+				}
+				uploaded.push_back(part);
+				if (onPart)
+					onPart(part);
+
+				fileBytes += part.size;
+				fileParts++;
+				if (trace != NULL)
+				{
+					int64_t start = state->part->readStart != 0 ? state->part->readStart : state->taken;
+					trace->Record(TRACE_PART, part.partNumber, start, MonotonicNanoseconds(), part.size);
+					trace->CountSent(part.size);
+				}
+				if (log != NULL)
+					log->Log(LOG_PART_SENT, name, part.partNumber, part.size, state->attempts);
+			}
+			else if (state->live == 0)
+			{
+				state->httpStatus = attempt->response.status;
+				if (IsRetriable(status) && failure == BS_OK && state->attempts < m_options.maxAttempts)
+				{
+					std::chrono::milliseconds delay = state->backoff.Next();
+					state->failedAt = MonotonicNanoseconds();
+					state->retryAt = state->failedAt + std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+					if (log != NULL)
+					{
+						log->Log(LOG_PART_RETRY, name, state->part->partNumber, state->attempts, status,
+							state->httpStatus, delay.count());
+					}
+				}
+				else
+					giveUp(state, status);
+			}
+			// else the part's other request is still out, and decides.
+
+			if (state->live == 0 && state->retryAt == 0)
+			{
+				reader.Release(state->part);
+				parts.erase(std::find_if(parts.begin(), parts.end(),
+					[state](const std::unique_ptr<PartState>& item) { return item.get() == state; }));
+			}
+		}
+
+		if (scheduler != NULL)
+			scheduler->UnregisterUpload(upload);
+		if (trace != NULL)
+			trace->Record(TRACE_FILE, 0, fileStart, MonotonicNanoseconds(), fileBytes);
+		if (log != NULL)
+			log->Log(LOG_PARTS_FINISHED, name, fileParts, fileBytes, (double)(MonotonicNanoseconds() - fileStart) / 1e9, failure);
+		return failure;
+	}
+
+	//
+	//   FUNCTION: CS3Client::ListParts(...)
+	//
+	//   PURPOSE: Lists the parts of an upload, following the 1,000 part pages.
+	//
+	BsStatus CS3Client::ListParts(const std::string& bucket, const std::string& key, const std::string& uploadId,
+		std::vector<S3Part>& parts)
+	{
+		parts.clear();
+		std::string marker;
+
+		for (;;)
+		{
+			std::string query = "uploadId=" + UriEncode(uploadId, false);
+			if (!marker.empty())
+				query = "part-number-marker=" + marker + "&" + query;
+
+			HttpRequest request;
+			HttpResponse response;
+			PrepareRequest(request, "GET", bucket, key, query);
+
+			BsStatus status = ExecuteWithRetries(request, response);
+			if (status != BS_OK)
+				return status;
+
+			for (const std::string& element : XmlElements(response.body, "Part"))
+			{
+				S3Part part;
+				part.partNumber = (uint32_t)strtoul(XmlElement(element, "PartNumber").c_str(), NULL, 10);
+				part.size = strtoull(XmlElement(element, "Size").c_str(), NULL, 10);
+				part.etag = XmlElement(element, "ETag");
+				parts.push_back(part);
+			}
+
+			if (XmlElement(response.body, "IsTruncated") != "true")
+				break;
+
+			std::string next = XmlElement(response.body, "NextPartNumberMarker");
+			if (next.empty() || next == marker)
+				return BS_E_CORRUPT;
+			marker = next;
+		}
+
+		return BS_OK;
+	}
+
+	BsStatus CS3Client::CompleteMultipartUpload(const std::string& bucket, const std::string& key,
+		const std::string& uploadId, const std::vector<S3Part>& parts, std::string& etag)
+	{
+		std::vector<const S3Part*> ordered;
+		ordered.reserve(parts.size());
+		for (const S3Part& part : parts)
+			ordered.push_back(&part);
+		std::sort(ordered.begin(), ordered.end(), [](const S3Part* left, const S3Part* right)
+		{
+			return left->partNumber < right->partNumber;
+		});
+
+		std::string body = "<CompleteMultipartUpload>";
+		for (const S3Part* part : ordered)
+		{
+			body += "<Part><PartNumber>" + std::to_string(part->partNumber) + "</PartNumber><ETag>" +
+				XmlEscape(part->etag) + "</ETag></Part>";
+		}
+		body += "</CompleteMultipartUpload>";
+
+		HttpRequest request;
+		HttpResponse response;
+		PrepareRequest(request, "POST", bucket, key, "uploadId=" + UriEncode(uploadId, false));
+		request.SetBody(body);
+
+		BsStatus status = ExecuteWithRetries(request, response);
+		if (status != BS_OK)
+			return status;
+
+		etag = XmlElement(response.body, "ETag");
+		return BS_OK;
+	}
+
+	BsStatus CS3Client::AbortMultipartUpload(const std::string& bucket, const std::string& key, const std::string& uploadId)
+	{
+		HttpRequest request;
+		HttpResponse response;
+		PrepareRequest(request, "DELETE", bucket, key, "uploadId=" + UriEncode(uploadId, false));
+
+		return ExecuteWithRetries(request, response);
+	}
+}
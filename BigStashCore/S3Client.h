@@ -0,0 +1,156 @@
+// S3Client.h : Declaration of CS3Client, the native S3 multipart engine
+
+#pragma once
+
+#include "BinaryLogger.h"
+#include "HttpClient.h"
+#include "PartDeadline.h"
+#include "PartReader.h"
+#include "UploadScheduler.h"
+#include "UploadTracer.h"
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// Adds the authentication headers to a finished request, right before it
+	// is queued. The body is in place, so payload-signing schemes can hash it
+	// (or use bodySha256, set when the part reader computed it).
+	typedef std::function<void(HttpRequest& request)> S3RequestSigner;
+
+	struct S3ClientOptions
+	{
+		S3ClientOptions()
+			: port(80), virtualHostedStyle(false), connections(8), window(0), maxAttempts(3), scheduler(NULL),
+			bandwidthLimit(0), logger(NULL)
+		{
+		}
+
+		std::string host;
+		uint16_t port;
+
+		// bucket.host/key instead of host/bucket/key.
+		bool virtualHostedStyle;
+
+		// Persistent connections to the endpoint.
+		unsigned connections;
+
+		// Parts in flight at once; 0 uses one per connection.
+		unsigned window;
+
+		// Tries per request before a 5xx or a network error is given up on.
+		// The pauses between them follow CRetryBackoff.
+		unsigned maxAttempts;
+
+		// When UploadParts sends a late part again; factor 0 never does.
+		HedgeOptions hedging;
+
+		// When set, every part upload takes a slot of the scheduler, which
+		// decides how many requests the process has in flight; the window
+		// then only caps this upload's share.
+		CUploadScheduler* scheduler;
+
+		// Bytes per second for each UploadParts call, 0 takes the
+		// scheduler's default. Needs the scheduler.
+		uint64_t bandwidthLimit;
+
+		// When set, UploadParts logs each part's outcome and retries to it.
+		CBinaryLogger* logger;
+
+		SocketOptions socket;
+		S3RequestSigner signer;
+	};
+
+	struct S3Part
+	{
+		S3Part() : partNumber(0), size(0), hasMd5(false) {}
+
+		uint32_t partNumber;
+		uint64_t size;
+		std::string etag;
+
+		// MD5 of the body as sent, when the reader computed it; S3 does not
+		// list it, so only parts this process uploaded carry it.
+		uint8_t md5[MD5_DIGEST_SIZE];
+		bool hasMd5;
+	};
+
+	// Called on the caller's thread for every part S3 accepted.
+	typedef std::function<void(const S3Part& part)> S3PartCallback;
+
+	// CS3Client
+	//
+	// The multipart subset of S3 (initiate, upload part, list parts, complete
+	// and abort) over CHttpClient. UploadParts streams the parts of a
+	// CPartReader with a fixed number of requests in flight, sending every
+	// part straight from the reader's buffer.
+	class CS3Client
+	{
+	public:
+		explicit CS3Client(const S3ClientOptions& options);
+		~CS3Client();
+
+		BsStatus Start();
+		void Stop();
+
+		BsStatus InitiateMultipartUpload(const std::string& bucket, const std::string& key, std::string& uploadId);
+
+		// A whole object in one request. md5 (16 bytes) may be NULL; with it
+		// S3 verifies the body.
+		BsStatus PutObject(const std::string& bucket, const std::string& key, const uint8_t* data, size_t length,
+			const uint8_t* md5, std::string& etag);
+
+		// md5 (16 bytes) may be NULL; with it S3 verifies the body.
+		BsStatus UploadPart(const std::string& bucket, const std::string& key, const std::string& uploadId,
+			uint32_t partNumber, const uint8_t* data, size_t length, const uint8_t* md5, std::string& etag);
+
+		// Uploads every part the reader yields, keeping the window full, and
+		// appends the accepted parts to uploaded. The window is capped at the
+		// buffers of the reader's pool; with a scheduler every request,
+		// retries and hedges included, also waits for a slot. A failed part
+		// is retried after its own backoff while the others go on; a part
+		// past the deadline the client learned from earlier parts is sent
+		// once more, and the first answer wins. Stops at the first part
+		// that fails every attempt, or when cancel becomes true. With a
+		// trace, every part's hand-off, slot wait, signing, connection,
+		// send, server time and retries are timed, and the file as a whole.
+		BsStatus UploadParts(const std::string& bucket, const std::string& key, const std::string& uploadId,
+			CPartReader& reader, std::vector<S3Part>& uploaded, const S3PartCallback& onPart = S3PartCallback(),
+			const std::atomic<bool>* cancel = NULL, CUploadTrace* trace = NULL);
+
+		BsStatus ListParts(const std::string& bucket, const std::string& key, const std::string& uploadId,
+			std::vector<S3Part>& parts);
+
+		// parts may come in any order; the request lists them sorted.
+		BsStatus CompleteMultipartUpload(const std::string& bucket, const std::string& key, const std::string& uploadId,
+			const std::vector<S3Part>& parts, std::string& etag);
+
+		BsStatus AbortMultipartUpload(const std::string& bucket, const std::string& key, const std::string& uploadId);
+
+		// The S3 error code (e.g. NoSuchUpload) of the last failed request.
+		std::string LastError() const;
+
+		HttpStats Stats() const { return m_http.Stats(); }
+		const CPartDeadline& Deadline() const { return m_deadline; }
+		const S3ClientOptions& Options() const { return m_options; }
+
+	private:
+		CS3Client(const CS3Client&);
+		CS3Client& operator=(const CS3Client&);
+
+		void PrepareRequest(HttpRequest& request, const char* method, const std::string& bucket,
+			const std::string& key, const std::string& query) const;
+		BsStatus ExecuteWithRetries(HttpRequest& request, HttpResponse& response);
+		BsStatus StatusFromResponse(const HttpResponse& response);
+
+		S3ClientOptions m_options;
+		CHttpClient m_http;
+		CPartDeadline m_deadline;
+
+		mutable std::mutex m_errorLock;
+		std::string m_lastError;
+	};
+}
@@ -0,0 +1,779 @@
+// SelectionChannel.cpp : Implementation of CSelectionServer and CSelectionSender
+
+#include "SelectionChannel.h"
+
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		const uint32_t FRAME_HELLO = 1;
+		const uint32_t FRAME_PATHS = 2;
+		const uint32_t FRAME_END = 3;
+		const uint32_t FRAME_ACK = 4;
+
+		// Type and payload length.
+		const size_t FRAME_HEADER_SIZE = 8;
+
+		const uint32_t SELECTION_MAGIC = 0x4c535342;	// "BSSL"
+		const uint32_t SELECTION_VERSION = 1;
+		const size_t HELLO_SIZE = 12;
+		const size_t END_SIZE = 8;
+		const size_t ACK_SIZE = 12;
+
+		// Paths are sent in frames of about this much; a longer path goes in a
+		// frame of its own, up to the frame limit.
+		const size_t CHUNK_BYTES = 64 * 1024;
+		const uint32_t MAX_FRAME = 1024 * 1024;
+
+		// How long the server waits on a sender that stopped sending, and the
+		// sender on a busy server or a missing acknowledgement.
+		const unsigned RECEIVE_TIMEOUT_MS = 30000;
+
+		const unsigned CONNECT_RETRY_MS = 20;
+
+#ifdef _WIN32
+		const ChannelHandle NO_CHANNEL = INVALID_HANDLE_VALUE;
+#else
+		const ChannelHandle NO_CHANNEL = -1;
+
+#ifdef MSG_NOSIGNAL
+		const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+		const int SEND_FLAGS = 0;
+#endif
+#endif
+
+		void PutLittleEndian32(uint8_t* data, uint32_t value)
+		{
+			for (int i = 0; i < 4; ++i)
+				data[i] = (uint8_t)(value >> (8 * i));
+		}
+
+		void PutLittleEndian64(uint8_t* data, uint64_t value)
+		{
+			PutLittleEndian32(data, (uint32_t)value);
+			PutLittleEndian32(data + 4, (uint32_t)(value >> 32));
+		}
+
+		uint32_t GetLittleEndian32(const uint8_t* data)
+		{
+			return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+		}
+
+		uint64_t GetLittleEndian64(const uint8_t* data)
+		{
+			return (uint64_t)GetLittleEndian32(data) | ((uint64_t)GetLittleEndian32(data + 4) << 32);
+		}
+
+		void CloseChannel(ChannelHandle channel)
+		{
+#ifdef _WIN32
+			CloseHandle(channel);
+#else
+			close(channel);
+#endif
+		}
+
+		BsStatus WriteAll(ChannelHandle channel, const uint8_t* data, size_t length)
+		{
+			while (length != 0)
+			{
+#ifdef _WIN32
+				DWORD written = 0;
+				DWORD chunk = length > 0x40000000 ? 0x40000000 : (DWORD)length;
+				if (!WriteFile(channel, data, chunk, &written, NULL))
+					return StatusFromWin32(GetLastError());
+#else
+				ssize_t written = send(channel, data, length, SEND_FLAGS);
+				if (written < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					return errno == EPIPE || errno == ECONNRESET ? BS_E_IO : StatusFromErrno(errno);
+				}
+#endif
+				data += written;
+				length -= written;
+			}
+			return BS_OK;
+		}
+
+		// A peer that closes (or stops sending) mid-read is BS_E_IO.
+		BsStatus ReadAll(ChannelHandle channel, uint8_t* data, size_t length)
+		{
+			while (length != 0)
+			{
+#ifdef _WIN32
+				DWORD read = 0;
+				DWORD chunk = length > 0x40000000 ? 0x40000000 : (DWORD)length;
+				if (!ReadFile(channel, data, chunk, &read, NULL))
+					return GetLastError() == ERROR_BROKEN_PIPE ? BS_E_IO : StatusFromWin32(GetLastError());
+#else
+				ssize_t read = recv(channel, data, length, 0);
+				if (read < 0 && errno == EINTR)
+					continue;
+				if (read < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNRESET)
+					return StatusFromErrno(errno);
+#endif
+				if (read <= 0)
+					return BS_E_IO;
+				data += read;
+				length -= read;
+			}
+			return BS_OK;
+		}
+
+		BsStatus ReadFrame(ChannelHandle channel, uint32_t& type, std::vector<uint8_t>& payload)
+		{
+			uint8_t header[FRAME_HEADER_SIZE];
+			BsStatus status = ReadAll(channel, header, sizeof(header));
+			if (status != BS_OK)
+				return status;
+
+			type = GetLittleEndian32(header);
+			uint32_t length = GetLittleEndian32(header + 4);
+			if (length > MAX_FRAME)
+				return BS_E_CORRUPT;
+			payload.resize(length);
+			return length == 0 ? BS_OK : ReadAll(channel, &payload[0], length);
+		}
+
+		BsStatus WriteFrame(ChannelHandle channel, uint32_t type, std::vector<uint8_t>& frame)
+		{
+			PutLittleEndian32(&frame[0], type);
+			PutLittleEndian32(&frame[4], (uint32_t)(frame.size() - FRAME_HEADER_SIZE));
+			return WriteAll(channel, &frame[0], frame.size());
+		}
+
+		// Paths go as a character count and the characters as they are in
+		// memory, so neither side converts anything. The HELLO frame carries
+		// the character size; both ends are little-endian.
+		BsStatus DecodePaths(const std::vector<uint8_t>& payload, std::vector<PathString>& paths)
+		{
+			paths.clear();
+			size_t offset = 0;
+			while (offset < payload.size())
+			{
+				if (payload.size() - offset < 4)
+					return BS_E_CORRUPT;
+				size_t length = GetLittleEndian32(&payload[offset]);
+				offset += 4;
+				if (length > (payload.size() - offset) / sizeof(PathChar))
+					return BS_E_CORRUPT;
+
+				paths.push_back(PathString());
+				PathString& path = paths.back();
+				path.resize(length);
+				if (length != 0)
+					memcpy(&path[0], &payload[offset], length * sizeof(PathChar));
+				offset += length * sizeof(PathChar);
+			}
+			return BS_OK;
+		}
+
+		// Best effort: the sender may be gone.
+		void SendAck(ChannelHandle channel, uint64_t received, BsStatus status)
+		{
+			std::vector<uint8_t> ack(FRAME_HEADER_SIZE + ACK_SIZE);
+			PutLittleEndian64(&ack[FRAME_HEADER_SIZE], received);
+			PutLittleEndian32(&ack[FRAME_HEADER_SIZE + 8], (uint32_t)status);
+			if (WriteFrame(channel, FRAME_ACK, ack) == BS_OK)
+			{
+#ifdef _WIN32
+				// Disconnecting drops what the sender has not read yet.
+				FlushFileBuffers(channel);
+#endif
+			}
+		}
+
+#ifdef _WIN32
+		PathString PipeName(const PathString& channel)
+		{
+			return L"\\\\.\\pipe\\" + channel;
+		}
+
+		bool ProcessUser(HANDLE process, std::vector<uint8_t>& user)
+		{
+			HANDLE token = NULL;
+			if (!OpenProcessToken(process, TOKEN_QUERY, &token))
+				return false;
+
+			DWORD size = 0;
+			GetTokenInformation(token, TokenUser, NULL, 0, &size);
+			user.resize(size);
+			bool result = size != 0 && GetTokenInformation(token, TokenUser, user.data(), size, &size);
+			CloseHandle(token);
+			return result;
+		}
+
+		// Any process of the session can create a pipe of the channel's
+		// name first, so the server has to run as the current user before
+		// it is sent the user's paths.
+		bool ServerIsCurrentUser(HANDLE pipe)
+		{
+			ULONG processId = 0;
+			if (!GetNamedPipeServerProcessId(pipe, &processId))
+				return false;
+
+			HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+			if (process == NULL)
+				return false;
+
+			std::vector<uint8_t> server;
+			std::vector<uint8_t> current;
+			bool same = ProcessUser(process, server) && ProcessUser(GetCurrentProcess(), current) &&
+				EqualSid(((const TOKEN_USER*)server.data())->User.Sid, ((const TOKEN_USER*)current.data())->User.Sid);
+			CloseHandle(process);
+			return same;
+		}
+#else
+		bool SocketAddress(const PathString& channel, sockaddr_un& address)
+		{
+			memset(&address, 0, sizeof(address));
+			address.sun_family = AF_UNIX;
+			if (channel.empty() || channel.size() >= sizeof(address.sun_path))
+				return false;
+			memcpy(address.sun_path, channel.c_str(), channel.size());
+			return true;
+		}
+
+		int OpenSocket()
+		{
+			int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0)
+				return -1;
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+			int on = 1;
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+			return fd;
+		}
+
+		// Connected socket, or -1 with errno set.
+		int ConnectSocket(const sockaddr_un& address)
+		{
+			int fd = OpenSocket();
+			if (fd < 0)
+				return -1;
+			if (connect(fd, (const sockaddr*)&address, sizeof(address)) != 0)
+			{
+				int error = errno;
+				close(fd);
+				errno = error;
+				return -1;
+			}
+			return fd;
+		}
+
+		// Whoever can create the socket's path can listen on it, so the
+		// server has to run as the current user before it is sent the
+		// user's paths.
+		bool ServerIsCurrentUser(int fd)
+		{
+#ifdef SO_PEERCRED
+			ucred credentials;
+			socklen_t length = sizeof(credentials);
+			return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+#else
+			uid_t user = 0;
+			gid_t group = 0;
+			return getpeereid(fd, &user, &group) == 0 && user == getuid();
+#endif
+		}
+
+		// A directory of the current user's that no one else can enter:
+		// created with mode 0700 or, when it exists, checked to be one.
+		bool PrivateDirectory(const std::string& path)
+		{
+			if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+				return false;
+
+			struct stat status;
+			return lstat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode) && status.st_uid == getuid() &&
+				(status.st_mode & 077) == 0;
+		}
+
+		void SetReceiveTimeout(int fd, unsigned milliseconds)
+		{
+			timeval timeout;
+			timeout.tv_sec = milliseconds / 1000;
+			timeout.tv_usec = (milliseconds % 1000) * 1000;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		}
+#endif
+	}
+
+	//
+	//   FUNCTION: DefaultSelectionChannel()
+	//
+	//   PURPOSE: Names the channel after the user (and on Windows the logon
+	//            session), so every user of the machine, and every session of
+	//            one user, gets an app instance of their own. Without a
+	//            runtime directory the socket goes in a private directory
+	//            under /tmp, as anyone could take a name in /tmp itself;
+	//            empty when that directory is someone else's.
+	//
+	PathString DefaultSelectionChannel()
+	{
+#ifdef _WIN32
+		DWORD session = 0;
+		ProcessIdToSessionId(GetCurrentProcessId(), &session);
+
+		wchar_t user[257];
+		DWORD size = sizeof(user) / sizeof(user[0]);
+		if (!GetUserNameW(user, &size))
+			user[0] = L'\0';
+
+		return L"BigStash-Selection-" + std::to_wstring(session) + L"-" + user;
+#else
+		const char* directory = getenv("XDG_RUNTIME_DIR");
+		if (directory != NULL && *directory != '\0')
+			return std::string(directory) + "/bigstash-selection-" + std::to_string(getuid());
+
+		std::string fallback = "/tmp/bigstash-" + std::to_string(getuid());
+		if (!PrivateDirectory(fallback))
+			return std::string();
+		return fallback + "/selection";
+#endif
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CSelectionServer methods
+	//
+
+	CSelectionServer::CSelectionServer()
+		: m_listener(NO_CHANNEL), m_stopping(false), m_running(false), m_selections(0)
+#ifndef _WIN32
+		, m_connection(NO_CHANNEL)
+#endif
+	{
+	}
+
+	CSelectionServer::~CSelectionServer()
+	{
+		Stop();
+	}
+
+	//
+	//   FUNCTION: CSelectionServer::Start(const PathString&, const SelectionCallback&)
+	//
+	//   PURPOSE: Takes the channel and starts the accept thread. The pipe is
+	//            created as the first instance, so a second server (or anyone
+	//            squatting on the name) fails instead of sharing it; a socket
+	//            left behind by a server that died is replaced, a live one is
+	//            not.
+	//
+	BsStatus CSelectionServer::Start(const PathString& channel, const SelectionCallback& callback)
+	{
+		if (m_thread.joinable() || !callback)
+			return BS_E_INVALIDARG;
+
+#ifdef _WIN32
+		HANDLE pipe = CreateNamedPipeW(PipeName(channel).c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1,
+			(DWORD)CHUNK_BYTES, (DWORD)CHUNK_BYTES, 0, NULL);
+		if (pipe == INVALID_HANDLE_VALUE)
+			return StatusFromWin32(GetLastError());
+		m_listener = pipe;
+#else
+		sockaddr_un address;
+		if (!SocketAddress(channel, address))
+			return BS_E_INVALIDARG;
+
+		int fd = OpenSocket();
+		if (fd < 0)
+			return StatusFromErrno(errno);
+		if (bind(fd, (const sockaddr*)&address, sizeof(address)) != 0)
+		{
+			int error = errno;
+			if (error == EADDRINUSE)
+			{
+				int probe = ConnectSocket(address);
+				if (probe >= 0)
+				{
+					close(probe);
+					close(fd);
+					return BS_E_ACCESSDENIED;
+				}
+				unlink(channel.c_str());
+				error = bind(fd, (const sockaddr*)&address, sizeof(address)) == 0 ? 0 : errno;
+			}
+			if (error != 0)
+			{
+				close(fd);
+				return StatusFromErrno(error);
+			}
+		}
+		chmod(channel.c_str(), S_IRUSR | S_IWUSR);
+		if (listen(fd, 16) != 0)
+		{
+			int error = errno;
+			close(fd);
+			unlink(channel.c_str());
+			return StatusFromErrno(error);
+		}
+		m_listener = fd;
+#endif
+
+		m_channel = channel;
+		m_callback = callback;
+		m_stopping = false;
+		m_running = true;
+		try
+		{
+			m_thread = std::thread(&CSelectionServer::AcceptLoop, this);
+		}
+		catch (...)
+		{
+			m_running = false;
+			CloseChannel(m_listener);
+			m_listener = NO_CHANNEL;
+			return BS_E_OUTOFMEMORY;
+		}
+		return BS_OK;
+	}
+
+	//
+	//   FUNCTION: CSelectionServer::Stop()
+	//
+	//   PURPOSE: Wakes the accept thread and waits for it. A selection being
+	//            received is cut short and reported as aborted.
+	//
+	void CSelectionServer::Stop()
+	{
+		if (!m_thread.joinable())
+			return;
+
+		m_stopping = true;
+#ifdef _WIN32
+		// The pipe is synchronous: cancel whatever the thread is blocked on,
+		// again until it notices, as it may be between calls.
+		HANDLE thread = (HANDLE)m_thread.native_handle();
+		while (m_running)
+		{
+			CancelSynchronousIo(thread);
+			Sleep(1);
+		}
+		m_thread.join();
+		CloseHandle(m_listener);
+#else
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			if (m_connection != NO_CHANNEL)
+				shutdown(m_connection, SHUT_RDWR);
+		}
+		shutdown(m_listener, SHUT_RDWR);
+		sockaddr_un address;
+		if (SocketAddress(m_channel, address))
+		{
+			int wake = ConnectSocket(address);
+			if (wake >= 0)
+				close(wake);
+		}
+		m_thread.join();
+		close(m_listener);
+		unlink(m_channel.c_str());
+#endif
+		m_listener = NO_CHANNEL;
+	}
+
+	void CSelectionServer::AcceptLoop()
+	{
+		while (!m_stopping)
+		{
+#ifdef _WIN32
+			if (!ConnectNamedPipe(m_listener, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+			{
+				// ERROR_NO_DATA: the sender came and went before we got to it.
+				DisconnectNamedPipe(m_listener);
+				continue;
+			}
+			if (!m_stopping)
+				Receive(m_listener);
+			DisconnectNamedPipe(m_listener);
+#else
+			int fd = accept(m_listener, NULL, NULL);
+			if (fd < 0)
+			{
+				if (errno != EINTR && errno != ECONNABORTED && !m_stopping)
+					std::this_thread::sleep_for(std::chrono::milliseconds(CONNECT_RETRY_MS));
+				continue;
+			}
+			if (!m_stopping)
+			{
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+				int on = 1;
+				setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+				SetReceiveTimeout(fd, RECEIVE_TIMEOUT_MS);
+				{
+					std::lock_guard<std::mutex> guard(m_lock);
+					m_connection = fd;
+				}
+				if (!m_stopping)
+					Receive(fd);
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_connection = NO_CHANNEL;
+			}
+			close(fd);
+#endif
+		}
+		m_running = false;
+	}
+
+	//
+	//   FUNCTION: CSelectionServer::Receive(ChannelHandle)
+	//
+	//   PURPOSE: Hands each PATHS frame to the callback as it arrives and
+	//            acknowledges the END frame once the count matches. Anything
+	//            else aborts the selection; the sender gets the status in the
+	//            acknowledgement when the channel is still up.
+	//
+	BsStatus CSelectionServer::Receive(ChannelHandle connection)
+	{
+		std::vector<uint8_t> payload;
+		std::vector<PathString> paths;
+		uint32_t type = 0;
+		uint64_t received = 0;
+		bool complete = false;
+
+		BsStatus status = ReadFrame(connection, type, payload);
+		if (status == BS_OK && (type != FRAME_HELLO || payload.size() != HELLO_SIZE ||
+			GetLittleEndian32(&payload[0]) != SELECTION_MAGIC))
+			status = BS_E_CORRUPT;
+		if (status == BS_OK && (GetLittleEndian32(&payload[4]) != SELECTION_VERSION ||
+			GetLittleEndian32(&payload[8]) != sizeof(PathChar)))
+			status = BS_E_NOTSUPPORTED;
+		if (status != BS_OK)
+		{
+			SendAck(connection, 0, status);
+			return status;
+		}
+
+		uint64_t selection = ++m_selections;
+		while (status == BS_OK && !complete)
+		{
+			status = ReadFrame(connection, type, payload);
+			if (status != BS_OK)
+				break;
+
+			if (type == FRAME_PATHS)
+			{
+				status = DecodePaths(payload, paths);
+				if (status == BS_OK)
+				{
+					received += paths.size();
+					m_callback(selection, SELECTION_PATHS, paths);
+				}
+			}
+			else if (type == FRAME_END && payload.size() == END_SIZE && GetLittleEndian64(&payload[0]) == received)
+				complete = true;
+			else
+				status = BS_E_CORRUPT;
+		}
+
+		paths.clear();
+		m_callback(selection, status == BS_OK ? SELECTION_COMPLETE : SELECTION_ABORTED, paths);
+		SendAck(connection, received, status);
+		return status;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CSelectionSender methods
+	//
+
+	CSelectionSender::CSelectionSender()
+		: m_connection(NO_CHANNEL), m_count(0), m_error(BS_OK)
+	{
+	}
+
+	CSelectionSender::~CSelectionSender()
+	{
+		Close();
+	}
+
+	//
+	//   FUNCTION: CSelectionSender::Connect(const PathString&, unsigned)
+	//
+	//   PURPOSE: Connects, retrying while no server listens until timeoutMs
+	//            is up, and sends the HELLO frame.
+	//
+	BsStatus CSelectionSender::Connect(const PathString& channel, unsigned timeoutMs)
+	{
+		if (m_connection != NO_CHANNEL)
+			return BS_E_INVALIDARG;
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+#ifdef _WIN32
+		PathString name = PipeName(channel);
+		for (;;)
+		{
+			HANDLE pipe = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+			if (pipe != INVALID_HANDLE_VALUE)
+			{
+				if (!ServerIsCurrentUser(pipe))
+				{
+					CloseHandle(pipe);
+					return BS_E_ACCESSDENIED;
+				}
+				m_connection = pipe;
+				break;
+			}
+
+			DWORD error = GetLastError();
+			if (error == ERROR_PIPE_BUSY)
+			{
+				if (!WaitNamedPipeW(name.c_str(), RECEIVE_TIMEOUT_MS) && GetLastError() != ERROR_FILE_NOT_FOUND)
+					return BS_E_IO;
+				continue;
+			}
+			if (error != ERROR_FILE_NOT_FOUND)
+				return StatusFromWin32(error);
+			if (std::chrono::steady_clock::now() >= deadline)
+				return BS_E_NOTFOUND;
+			Sleep(CONNECT_RETRY_MS);
+		}
+#else
+		sockaddr_un address;
+		if (!SocketAddress(channel, address))
+			return BS_E_INVALIDARG;
+		for (;;)
+		{
+			int fd = ConnectSocket(address);
+			if (fd >= 0)
+			{
+				if (!ServerIsCurrentUser(fd))
+				{
+					close(fd);
+					return BS_E_ACCESSDENIED;
+				}
+				SetReceiveTimeout(fd, RECEIVE_TIMEOUT_MS);
+				m_connection = fd;
+				break;
+			}
+
+			// ECONNREFUSED is a socket left behind, EAGAIN a full backlog.
+			if (errno != ENOENT && errno != ECONNREFUSED && errno != EAGAIN)
+				return StatusFromErrno(errno);
+			if (std::chrono::steady_clock::now() >= deadline)
+				return BS_E_NOTFOUND;
+			std::this_thread::sleep_for(std::chrono::milliseconds(CONNECT_RETRY_MS));
+		}
+#endif
+
+		m_count = 0;
+		std::vector<uint8_t> hello(FRAME_HEADER_SIZE + HELLO_SIZE);
+		PutLittleEndian32(&hello[FRAME_HEADER_SIZE], SELECTION_MAGIC);
+		PutLittleEndian32(&hello[FRAME_HEADER_SIZE + 4], SELECTION_VERSION);
+		PutLittleEndian32(&hello[FRAME_HEADER_SIZE + 8], (uint32_t)sizeof(PathChar));
+		m_error = WriteFrame(m_connection, FRAME_HELLO, hello);
+
+		m_chunk.reserve(CHUNK_BYTES + FRAME_HEADER_SIZE);
+		m_chunk.assign(FRAME_HEADER_SIZE, 0);
+		return m_error;
+	}
+
+	BsStatus CSelectionSender::Add(const PathChar* path, size_t length)
+	{
+		if (m_connection == NO_CHANNEL || (path == NULL && length != 0))
+			return BS_E_INVALIDARG;
+		if (m_error != BS_OK)
+			return m_error;
+
+		size_t bytes = length * sizeof(PathChar);
+		if (length > MAX_FRAME || bytes + 4 > MAX_FRAME)
+			return BS_E_INVALIDARG;
+
+		if (m_chunk.size() > FRAME_HEADER_SIZE && m_chunk.size() + 4 + bytes > CHUNK_BYTES + FRAME_HEADER_SIZE &&
+			SendFrame(FRAME_PATHS, m_chunk) != BS_OK)
+			return m_error;
+
+		size_t offset = m_chunk.size();
+		m_chunk.resize(offset + 4 + bytes);
+		PutLittleEndian32(&m_chunk[offset], (uint32_t)length);
+		if (bytes != 0)
+			memcpy(&m_chunk[offset + 4], path, bytes);
+		++m_count;
+		return BS_OK;
+	}
+
+	BsStatus CSelectionSender::SendFrame(uint32_t type, std::vector<uint8_t>& frame)
+	{
+		m_error = WriteFrame(m_connection, type, frame);
+		frame.resize(FRAME_HEADER_SIZE);
+		return m_error;
+	}
+
+	//
+	//   FUNCTION: CSelectionSender::Finish()
+	//
+	//   PURPOSE: Sends the last PATHS frame and the END frame, then waits for
+	//            the acknowledgement, which carries the server's status.
+	//
+	BsStatus CSelectionSender::Finish()
+	{
+		if (m_connection == NO_CHANNEL)
+			return BS_E_INVALIDARG;
+
+		if (m_error == BS_OK && m_chunk.size() > FRAME_HEADER_SIZE)
+			SendFrame(FRAME_PATHS, m_chunk);
+		if (m_error == BS_OK)
+		{
+			std::vector<uint8_t> end(FRAME_HEADER_SIZE + END_SIZE);
+			PutLittleEndian64(&end[FRAME_HEADER_SIZE], m_count);
+			SendFrame(FRAME_END, end);
+		}
+		if (m_error == BS_OK)
+		{
+			uint32_t type = 0;
+			std::vector<uint8_t> ack;
+			m_error = ReadFrame(m_connection, type, ack);
+			if (m_error == BS_OK && (type != FRAME_ACK || ack.size() != ACK_SIZE))
+				m_error = BS_E_CORRUPT;
+			if (m_error == BS_OK)
+				m_error = (BsStatus)GetLittleEndian32(&ack[8]);
+			if (m_error == BS_OK && GetLittleEndian64(&ack[0]) != m_count)
+				m_error = BS_E_CORRUPT;
+		}
+
+		BsStatus status = m_error;
+		Close();
+		return status;
+	}
+
+	void CSelectionSender::Close()
+	{
+		if (m_connection != NO_CHANNEL)
+		{
+			CloseChannel(m_connection);
+			m_connection = NO_CHANNEL;
+		}
+		m_chunk.clear();
+		m_error = BS_OK;
+	}
+
+	BsStatus SendSelection(const PathString& channel, const std::vector<PathString>& paths, unsigned timeoutMs)
+	{
+		CSelectionSender sender;
+		BsStatus status = sender.Connect(channel, timeoutMs);
+		for (size_t i = 0; status == BS_OK && i < paths.size(); ++i)
+			status = sender.Add(paths[i]);
+		return status == BS_OK ? sender.Finish() : status;
+	}
+}
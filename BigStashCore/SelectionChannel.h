@@ -0,0 +1,128 @@
+// SelectionChannel.h : Declaration of CSelectionServer and CSelectionSender,
+// the local channel the Explorer extension hands selections over
+
+#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace BigStash
+{
+#ifdef _WIN32
+	typedef HANDLE ChannelHandle;
+#else
+	typedef int ChannelHandle;
+#endif
+
+	enum SelectionEvent
+	{
+		// The next chunk of paths of a selection.
+		SELECTION_PATHS,
+
+		// Every path of the selection arrived. The sender is told once the
+		// callback returns.
+		SELECTION_COMPLETE,
+
+		// The sender went away or sent something malformed; drop the paths
+		// of this selection received so far. A connection that never sent a
+		// valid HELLO is not a selection and is dropped without an event.
+		SELECTION_ABORTED
+	};
+
+	// Called on the server's thread; paths is empty but for SELECTION_PATHS.
+	typedef std::function<void(uint64_t selection, SelectionEvent event, const std::vector<PathString>& paths)>
+		SelectionCallback;
+
+	// The channel of the current user: a named pipe per user and session on
+	// Windows, a socket in the runtime directory elsewhere, or without one in
+	// a private directory under /tmp. Empty when that directory exists and is
+	// not the user's alone.
+	PathString DefaultSelectionChannel();
+
+	// CSelectionServer
+	//
+	// Receives selections on the channel, one sender at a time, on a thread
+	// of its own. The wire format is a HELLO frame (magic, version and the
+	// path character size), PATHS frames of length-prefixed paths, and an
+	// END frame with the path count, which the server acknowledges once the
+	// callback has taken every chunk. Only one server can hold a channel,
+	// so a second instance of the app finds the first one listening.
+	class CSelectionServer
+	{
+	public:
+		CSelectionServer();
+		~CSelectionServer();
+
+		// BS_E_ACCESSDENIED when another server holds the channel.
+		BsStatus Start(const PathString& channel, const SelectionCallback& callback);
+		void Stop();
+
+		uint64_t Selections() const { return m_selections; }
+
+	private:
+		CSelectionServer(const CSelectionServer&);
+		CSelectionServer& operator=(const CSelectionServer&);
+
+		void AcceptLoop();
+		BsStatus Receive(ChannelHandle connection);
+
+		PathString m_channel;
+		SelectionCallback m_callback;
+		ChannelHandle m_listener;
+		std::thread m_thread;
+		std::atomic<bool> m_stopping;
+		std::atomic<bool> m_running;
+		std::atomic<uint64_t> m_selections;
+
+#ifndef _WIN32
+		// The connection being received, for Stop to shut down.
+		std::mutex m_lock;
+		ChannelHandle m_connection;
+#endif
+	};
+
+	// CSelectionSender
+	//
+	// Streams one selection to the server: paths are buffered into 64 KB
+	// PATHS frames and sent as they fill, so the sender never holds more
+	// than a frame and the server starts on the first chunk while the rest
+	// are still being enumerated.
+	class CSelectionSender
+	{
+	public:
+		CSelectionSender();
+		~CSelectionSender();
+
+		// Waits up to timeoutMs for a server to listen; BS_E_NOTFOUND when
+		// none did. A server busy with another selection is waited for.
+		// BS_E_ACCESSDENIED when the server runs as another user.
+		BsStatus Connect(const PathString& channel, unsigned timeoutMs);
+
+		BsStatus Add(const PathChar* path, size_t length);
+		BsStatus Add(const PathString& path) { return Add(path.data(), path.size()); }
+
+		// Sends the rest and waits for the server to acknowledge every path.
+		BsStatus Finish();
+
+		void Close();
+
+	private:
+		CSelectionSender(const CSelectionSender&);
+		CSelectionSender& operator=(const CSelectionSender&);
+
+		BsStatus SendFrame(uint32_t type, std::vector<uint8_t>& frame);
+
+		ChannelHandle m_connection;
+		std::vector<uint8_t> m_chunk;
+		uint64_t m_count;
+		BsStatus m_error;
+	};
+
+	// Connects, sends paths and waits for the acknowledgement.
+	BsStatus SendSelection(const PathString& channel, const std::vector<PathString>& paths, unsigned timeoutMs);
+}
@@ -0,0 +1,306 @@
+// Sha256.cpp : Implementation of CSha256, HMAC-SHA256 and the portable and
+// SHA extension kernels.
+
+#include "Sha256.h"
+#include "CpuFeatures.h"
+
+#include <cstring>
+
+#if defined(BS_ARCH_X86)
+#include <immintrin.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		alignas(16) const uint32_t K[64] =
+		{
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+		inline uint32_t RotateRight(uint32_t x, unsigned n)
+		{
+			return (x >> n) | (x << (32 - n));
+		}
+
+		inline uint32_t LoadBigEndian(const uint8_t* p)
+		{
+			return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+		}
+
+#if defined(BS_ARCH_X86)
+		//
+		//   FUNCTION: Sha256CompressShaNi(Sha256State&, const uint8_t*, size_t)
+		//
+		//   PURPOSE: SHA extension kernel. The state lives as ABEF / CDGH in
+		//            two registers, sha256rnds2 does two rounds per issue and
+		//            sha256msg1 / sha256msg2 extend the message schedule four
+		//            words at a time.
+		//
+		BS_TARGET("sha,sse4.1,ssse3")
+		void Sha256CompressShaNi(Sha256State& state, const uint8_t* blocks, size_t count)
+		{
+			const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+			__m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state.h[0]));
+			__m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state.h[4]));
+			__m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+			__m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+			__m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+			__m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+			for (size_t n = 0; n < count; ++n, blocks += SHA256_BLOCK_SIZE)
+			{
+				__m128i abefSaved = abef;
+				__m128i cdghSaved = cdgh;
+				__m128i w[4];
+
+				for (unsigned g = 0; g < 16; ++g)
+				{
+					if (g < 4)
+					{
+						w[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16 * g)), byteSwap);
+					}
+					else
+					{
+						__m128i t = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+						t = _mm_add_epi32(t, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+						w[g & 3] = _mm_sha256msg2_epu32(t, w[(g + 3) & 3]);
+					}
+
+					__m128i message = _mm_add_epi32(w[g & 3], _mm_load_si128(reinterpret_cast<const __m128i*>(K + 4 * g)));
+					cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+					abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0E));
+				}
+
+				abef = _mm_add_epi32(abef, abefSaved);
+				cdgh = _mm_add_epi32(cdgh, cdghSaved);
+			}
+
+			__m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+			__m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+			dcba = _mm_blend_epi16(feba, dchg, 0xF0);
+			hgfe = _mm_alignr_epi8(dchg, feba, 8);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&state.h[0]), dcba);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&state.h[4]), hgfe);
+		}
+#endif
+
+		typedef void (*Sha256Kernel)(Sha256State& state, const uint8_t* blocks, size_t count);
+
+		Sha256Kernel SelectKernel()
+		{
+#if defined(BS_ARCH_X86)
+			const CpuFeatures& features = GetCpuFeatures();
+			if (features.sha && features.sse41 && features.ssse3)
+				return Sha256CompressShaNi;
+#endif
+			return Sha256CompressPortable;
+		}
+
+		Sha256Kernel Kernel()
+		{
+			static const Sha256Kernel kernel = SelectKernel();
+			return kernel;
+		}
+	}
+
+	void Sha256Reset(Sha256State& state)
+	{
+		state.h[0] = 0x6a09e667;
+		state.h[1] = 0xbb67ae85;
+		state.h[2] = 0x3c6ef372;
+		state.h[3] = 0xa54ff53a;
+		state.h[4] = 0x510e527f;
+		state.h[5] = 0x9b05688c;
+		state.h[6] = 0x1f83d9ab;
+		state.h[7] = 0x5be0cd19;
+	}
+
+	void Sha256CompressPortable(Sha256State& state, const uint8_t* blocks, size_t count)
+	{
+		uint32_t w[64];
+
+		for (size_t n = 0; n < count; ++n, blocks += SHA256_BLOCK_SIZE)
+		{
+			for (unsigned i = 0; i < 16; ++i)
+				w[i] = LoadBigEndian(blocks + 4 * i);
+
+			for (unsigned i = 16; i < 64; ++i)
+			{
+				uint32_t s0 = RotateRight(w[i - 15], 7) ^ RotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				uint32_t s1 = RotateRight(w[i - 2], 17) ^ RotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+
+			uint32_t a = state.h[0], b = state.h[1], c = state.h[2], d = state.h[3];
+			uint32_t e = state.h[4], f = state.h[5], g = state.h[6], h = state.h[7];
+
+			for (unsigned i = 0; i < 64; ++i)
+			{
+				uint32_t s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+				uint32_t choose = g ^ (e & (f ^ g));
+				uint32_t t1 = h + s1 + choose + K[i] + w[i];
+				uint32_t s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+				uint32_t majority = (a & b) | (c & (a | b));
+				uint32_t t2 = s0 + majority;
+
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+
+			state.h[0] += a;
+			state.h[1] += b;
+			state.h[2] += c;
+			state.h[3] += d;
+			state.h[4] += e;
+			state.h[5] += f;
+			state.h[6] += g;
+			state.h[7] += h;
+		}
+	}
+
+	void Sha256Compress(Sha256State& state, const uint8_t* blocks, size_t count)
+	{
+		Kernel()(state, blocks, count);
+	}
+
+	bool Sha256HardwareKernel()
+	{
+		return Kernel() != Sha256CompressPortable;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CSha256 methods
+	//
+
+	void CSha256::Reset()
+	{
+		Sha256Reset(m_state);
+		m_length = 0;
+		m_buffered = 0;
+	}
+
+	void CSha256::Update(const void* data, size_t length)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		m_length += length;
+
+		if (m_buffered > 0)
+		{
+			size_t take = SHA256_BLOCK_SIZE - m_buffered;
+			if (take > length)
+				take = length;
+
+			memcpy(m_buffer + m_buffered, bytes, take);
+			m_buffered += take;
+			bytes += take;
+			length -= take;
+
+			if (m_buffered < SHA256_BLOCK_SIZE)
+				return;
+
+			Sha256Compress(m_state, m_buffer, 1);
+			m_buffered = 0;
+		}
+
+		size_t blocks = length / SHA256_BLOCK_SIZE;
+		if (blocks > 0)
+		{
+			Sha256Compress(m_state, bytes, blocks);
+			bytes += blocks * SHA256_BLOCK_SIZE;
+			length -= blocks * SHA256_BLOCK_SIZE;
+		}
+
+		if (length > 0)
+		{
+			memcpy(m_buffer, bytes, length);
+			m_buffered = length;
+		}
+	}
+
+	//
+	//   FUNCTION: CSha256::Final(uint8_t[32])
+	//
+	//   PURPOSE: Appends the 0x80 terminator, the zero padding and the
+	//            big-endian bit length, and writes the digest. The object is
+	//            reset.
+	//
+	void CSha256::Final(uint8_t digest[SHA256_DIGEST_SIZE])
+	{
+		uint64_t bits = m_length * 8;
+
+		m_buffer[m_buffered++] = 0x80;
+		if (m_buffered > SHA256_BLOCK_SIZE - 8)
+		{
+			memset(m_buffer + m_buffered, 0, SHA256_BLOCK_SIZE - m_buffered);
+			Sha256Compress(m_state, m_buffer, 1);
+			m_buffered = 0;
+		}
+
+		memset(m_buffer + m_buffered, 0, SHA256_BLOCK_SIZE - 8 - m_buffered);
+		for (int i = 0; i < 8; ++i)
+			m_buffer[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(bits >> (8 * i));
+		Sha256Compress(m_state, m_buffer, 1);
+
+		for (int i = 0; i < 8; ++i)
+		{
+			digest[4 * i] = (uint8_t)(m_state.h[i] >> 24);
+			digest[4 * i + 1] = (uint8_t)(m_state.h[i] >> 16);
+			digest[4 * i + 2] = (uint8_t)(m_state.h[i] >> 8);
+			digest[4 * i + 3] = (uint8_t)m_state.h[i];
+		}
+		Reset();
+	}
+
+	void CSha256::Hash(const void* data, size_t length, uint8_t digest[SHA256_DIGEST_SIZE])
+	{
+		CSha256 sha256;
+		sha256.Update(data, length);
+		sha256.Final(digest);
+	}
+
+	void HmacSha256(const void* key, size_t keyLength, const void* data, size_t length,
+		uint8_t mac[SHA256_DIGEST_SIZE])
+	{
+		uint8_t block[SHA256_BLOCK_SIZE];
+		memset(block, 0, sizeof(block));
+
+		if (keyLength > SHA256_BLOCK_SIZE)
+			CSha256::Hash(key, keyLength, block);
+		else
+			memcpy(block, key, keyLength);
+
+		uint8_t pad[SHA256_BLOCK_SIZE];
+		for (size_t i = 0; i < SHA256_BLOCK_SIZE; ++i)
+			pad[i] = block[i] ^ 0x36;
+
+		CSha256 inner;
+		inner.Update(pad, sizeof(pad));
+		inner.Update(data, length);
+		uint8_t innerDigest[SHA256_DIGEST_SIZE];
+		inner.Final(innerDigest);
+
+		for (size_t i = 0; i < SHA256_BLOCK_SIZE; ++i)
+			pad[i] = block[i] ^ 0x5c;
+
+		CSha256 outer;
+		outer.Update(pad, sizeof(pad));
+		outer.Update(innerDigest, sizeof(innerDigest));
+		outer.Final(mac);
+	}
+}
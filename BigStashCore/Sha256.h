@@ -0,0 +1,54 @@
+// Sha256.h : Declaration of CSha256, HMAC-SHA256 and the SHA-256 kernels.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace BigStash
+{
+	const size_t SHA256_BLOCK_SIZE = 64;
+	const size_t SHA256_DIGEST_SIZE = 32;
+
+	struct Sha256State
+	{
+		uint32_t h[8];
+	};
+
+	// Resets the state to the SHA-256 initial values.
+	void Sha256Reset(Sha256State& state);
+
+	// Compresses count 64 byte blocks into the state, with the SHA
+	// extensions when the processor has them.
+	void Sha256Compress(Sha256State& state, const uint8_t* blocks, size_t count);
+
+	// The portable kernel, for comparisons.
+	void Sha256CompressPortable(Sha256State& state, const uint8_t* blocks, size_t count);
+
+	// True when Sha256Compress runs on the SHA extensions.
+	bool Sha256HardwareKernel();
+
+	// Streaming SHA-256.
+	class CSha256
+	{
+	public:
+		CSha256() { Reset(); }
+
+		void Reset();
+		void Update(const void* data, size_t length);
+		void Final(uint8_t digest[SHA256_DIGEST_SIZE]);
+
+		// One-shot helper.
+		static void Hash(const void* data, size_t length, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+	protected:
+		Sha256State m_state;
+		uint64_t m_length;
+		uint8_t m_buffer[SHA256_BLOCK_SIZE];
+		size_t m_buffered;
+	};
+
+	// HMAC-SHA256 of data under key.
+	void HmacSha256(const void* key, size_t keyLength, const void* data, size_t length,
+		uint8_t mac[SHA256_DIGEST_SIZE]);
+}
@@ -0,0 +1,291 @@
+// SigV4Signer.cpp : Implementation of CSigV4Signer
+
+#include "SigV4Signer.h"
+#include "Encoding.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace BigStash
+{
+	const char* const SIGV4_UNSIGNED_PAYLOAD = "UNSIGNED-PAYLOAD";
+	const char* const SIGV4_STREAMING_PAYLOAD = "STREAMING-AWS4-HMAC-SHA256-PAYLOAD";
+
+	namespace
+	{
+		const char* const ALGORITHM = "AWS4-HMAC-SHA256";
+
+		// SHA-256 of the empty string, part of every chunk string to sign.
+		const char* const EMPTY_SHA256 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+		std::string Sha256Hex(const void* data, size_t length)
+		{
+			uint8_t digest[SHA256_DIGEST_SIZE];
+			CSha256::Hash(data, length, digest);
+			return HexEncode(digest, SHA256_DIGEST_SIZE);
+		}
+
+		std::string Lowercase(const std::string& value)
+		{
+			std::string result(value);
+			for (char& c : result)
+				c = (char)tolower((unsigned char)c);
+			return result;
+		}
+
+		std::string Trim(const std::string& value)
+		{
+			size_t begin = value.find_first_not_of(" \t");
+			if (begin == std::string::npos)
+				return std::string();
+			size_t end = value.find_last_not_of(" \t");
+			return value.substr(begin, end - begin + 1);
+		}
+
+		//
+		//   FUNCTION: CanonicalQuery(const std::string&)
+		//
+		//   PURPOSE: Sorts the parameters of an already encoded query string
+		//            and gives every one a value ("uploads" is "uploads=").
+		//
+		std::string CanonicalQuery(const std::string& query)
+		{
+			std::vector<std::pair<std::string, std::string> > parameters;
+			size_t position = 0;
+			while (position < query.size())
+			{
+				size_t end = query.find('&', position);
+				if (end == std::string::npos)
+					end = query.size();
+
+				std::string parameter = query.substr(position, end - position);
+				size_t equals = parameter.find('=');
+				if (!parameter.empty())
+				{
+					if (equals == std::string::npos)
+						parameters.push_back(std::make_pair(parameter, std::string()));
+					else
+						parameters.push_back(std::make_pair(parameter.substr(0, equals), parameter.substr(equals + 1)));
+				}
+				position = end + 1;
+			}
+
+			std::sort(parameters.begin(), parameters.end());
+
+			std::string result;
+			for (const auto& parameter : parameters)
+			{
+				if (!result.empty())
+					result += '&';
+				result += parameter.first + "=" + parameter.second;
+			}
+			return result;
+		}
+	}
+
+	std::string AmzDate(int64_t unixTime)
+	{
+		// days since the epoch to a civil date (proleptic Gregorian).
+		int64_t days = unixTime / 86400;
+		int64_t seconds = unixTime % 86400;
+		if (seconds < 0)
+		{
+			seconds += 86400;
+			days--;
+		}
+
+		days += 719468;
+		int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+		unsigned dayOfEra = (unsigned)(days - era * 146097);
+		unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+		unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+		unsigned monthIndex = (5 * dayOfYear + 2) / 153;
+		unsigned day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+		unsigned month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+		int64_t year = (int64_t)yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+
+		char text[32];
+		snprintf(text, sizeof(text), "%04d%02u%02uT%02d%02d%02dZ", (int)year, month, day,
+			(int)(seconds / 3600), (int)(seconds / 60 % 60), (int)(seconds % 60));
+		return text;
+	}
+
+	CSigV4Signer::CSigV4Signer(const SigV4Credentials& credentials, const std::string& region,
+		const std::string& service, SigV4PayloadMode payloadMode)
+		: m_credentials(credentials), m_region(region), m_service(service), m_payloadMode(payloadMode), m_derivations(0)
+	{
+		memset(m_key, 0, sizeof(m_key));
+	}
+
+	std::string CSigV4Signer::Scope(const std::string& date) const
+	{
+		return date + "/" + m_region + "/" + m_service + "/aws4_request";
+	}
+
+	//
+	//   FUNCTION: CSigV4Signer::SigningKey(const std::string&, uint8_t[32])
+	//
+	//   PURPOSE: HMAC("AWS4" + secret, date) -> region -> service ->
+	//            "aws4_request", computed once per date.
+	//
+	void CSigV4Signer::SigningKey(const std::string& date, uint8_t key[SHA256_DIGEST_SIZE])
+	{
+		std::lock_guard<std::mutex> guard(m_keyLock);
+
+		if (m_keyDate != date)
+		{
+			std::string secret = "AWS4" + m_credentials.secretAccessKey;
+			uint8_t dateKey[SHA256_DIGEST_SIZE];
+			uint8_t regionKey[SHA256_DIGEST_SIZE];
+			uint8_t serviceKey[SHA256_DIGEST_SIZE];
+
+			HmacSha256(secret.data(), secret.size(), date.data(), date.size(), dateKey);
+			HmacSha256(dateKey, sizeof(dateKey), m_region.data(), m_region.size(), regionKey);
+			HmacSha256(regionKey, sizeof(regionKey), m_service.data(), m_service.size(), serviceKey);
+			HmacSha256(serviceKey, sizeof(serviceKey), "aws4_request", 12, m_key);
+
+			m_keyDate = date;
+			m_derivations++;
+		}
+
+		memcpy(key, m_key, SHA256_DIGEST_SIZE);
+	}
+
+	void CSigV4Signer::Sign(HttpRequest& request)
+	{
+		int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		Sign(request, now);
+	}
+
+	void CSigV4Signer::Sign(HttpRequest& request, int64_t unixTime)
+	{
+		request.bodyPrefix.clear();
+		request.bodySuffix.clear();
+
+		if (m_payloadMode == SIGV4_PAYLOAD_UNSIGNED)
+		{
+			Authorize(request, unixTime, SIGV4_UNSIGNED_PAYLOAD);
+			return;
+		}
+
+		uint8_t bodySha256[SHA256_DIGEST_SIZE];
+		if (request.bodySha256 != NULL)
+			memcpy(bodySha256, request.bodySha256, SHA256_DIGEST_SIZE);
+		else
+			CSha256::Hash(request.body, request.bodyLength, bodySha256);
+
+		if (m_payloadMode == SIGV4_PAYLOAD_SIGNED)
+		{
+			Authorize(request, unixTime, HexEncode(bodySha256, SHA256_DIGEST_SIZE));
+			return;
+		}
+
+		// the seed signature covers the headers only; the body is one chunk
+		// signed with the hash the reader computed, then the empty chunk.
+		request.headers.push_back(std::make_pair(std::string("Content-Encoding"), std::string("aws-chunked")));
+		request.headers.push_back(std::make_pair(std::string("x-amz-decoded-content-length"),
+			std::to_string(request.bodyLength)));
+
+		std::string signature = Authorize(request, unixTime, SIGV4_STREAMING_PAYLOAD);
+
+		if (request.bodyLength > 0)
+		{
+			signature = ChunkSignature(unixTime, signature, bodySha256);
+			char size[32];
+			snprintf(size, sizeof(size), "%llx", (unsigned long long)request.bodyLength);
+			request.bodyPrefix = std::string(size) + ";chunk-signature=" + signature + "\r\n";
+			request.bodySuffix = "\r\n";
+		}
+
+		uint8_t emptySha256[SHA256_DIGEST_SIZE];
+		CSha256::Hash("", 0, emptySha256);
+		request.bodySuffix += "0;chunk-signature=" + ChunkSignature(unixTime, signature, emptySha256) + "\r\n\r\n";
+	}
+
+	//
+	//   FUNCTION: CSigV4Signer::Authorize(HttpRequest&, int64_t, const std::string&)
+	//
+	//   PURPOSE: Builds the canonical request over every header the request
+	//            carries, signs its string to sign with the cached key and
+	//            adds the Authorization header.
+	//
+	std::string CSigV4Signer::Authorize(HttpRequest& request, int64_t unixTime, const std::string& payloadHash)
+	{
+		std::string amzDate = AmzDate(unixTime);
+		std::string date = amzDate.substr(0, 8);
+
+		request.headers.push_back(std::make_pair(std::string("x-amz-date"), amzDate));
+		request.headers.push_back(std::make_pair(std::string("x-amz-content-sha256"), payloadHash));
+		if (!m_credentials.sessionToken.empty())
+			request.headers.push_back(std::make_pair(std::string("x-amz-security-token"), m_credentials.sessionToken));
+
+		std::vector<std::pair<std::string, std::string> > headers;
+		headers.reserve(request.headers.size());
+		for (const auto& header : request.headers)
+			headers.push_back(std::make_pair(Lowercase(header.first), Trim(header.second)));
+		std::stable_sort(headers.begin(), headers.end(),
+			[](const std::pair<std::string, std::string>& left, const std::pair<std::string, std::string>& right)
+		{
+			return left.first < right.first;
+		});
+
+		std::string canonicalHeaders;
+		std::string signedHeaders;
+		for (size_t i = 0; i < headers.size(); ++i)
+		{
+			// repeated headers are joined with commas.
+			if (i > 0 && headers[i].first == headers[i - 1].first)
+			{
+				canonicalHeaders.insert(canonicalHeaders.size() - 1, "," + headers[i].second);
+				continue;
+			}
+
+			canonicalHeaders += headers[i].first + ":" + headers[i].second + "\n";
+			if (!signedHeaders.empty())
+				signedHeaders += ';';
+			signedHeaders += headers[i].first;
+		}
+
+		size_t question = request.target.find('?');
+		std::string path = request.target.substr(0, question);
+		std::string query = question == std::string::npos ? std::string() : request.target.substr(question + 1);
+
+		std::string canonicalRequest = request.method + "\n" + path + "\n" + CanonicalQuery(query) + "\n" +
+			canonicalHeaders + "\n" + signedHeaders + "\n" + payloadHash;
+
+		std::string scope = Scope(date);
+		std::string stringToSign = std::string(ALGORITHM) + "\n" + amzDate + "\n" + scope + "\n" +
+			Sha256Hex(canonicalRequest.data(), canonicalRequest.size());
+
+		uint8_t key[SHA256_DIGEST_SIZE];
+		SigningKey(date, key);
+		uint8_t mac[SHA256_DIGEST_SIZE];
+		HmacSha256(key, sizeof(key), stringToSign.data(), stringToSign.size(), mac);
+		std::string signature = HexEncode(mac, SHA256_DIGEST_SIZE);
+
+		request.headers.push_back(std::make_pair(std::string("Authorization"), std::string(ALGORITHM) +
+			" Credential=" + m_credentials.accessKeyId + "/" + scope + ", SignedHeaders=" + signedHeaders +
+			", Signature=" + signature));
+		return signature;
+	}
+
+	std::string CSigV4Signer::ChunkSignature(int64_t unixTime, const std::string& previousSignature,
+		const uint8_t chunkSha256[SHA256_DIGEST_SIZE])
+	{
+		std::string amzDate = AmzDate(unixTime);
+		std::string date = amzDate.substr(0, 8);
+
+		std::string stringToSign = std::string(ALGORITHM) + "-PAYLOAD\n" + amzDate + "\n" + Scope(date) + "\n" +
+			previousSignature + "\n" + EMPTY_SHA256 + "\n" + HexEncode(chunkSha256, SHA256_DIGEST_SIZE);
+
+		uint8_t key[SHA256_DIGEST_SIZE];
+		SigningKey(date, key);
+		uint8_t mac[SHA256_DIGEST_SIZE];
+		HmacSha256(key, sizeof(key), stringToSign.data(), stringToSign.size(), mac);
+		return HexEncode(mac, SHA256_DIGEST_SIZE);
+	}
+}
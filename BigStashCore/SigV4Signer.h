@@ -0,0 +1,93 @@
+// SigV4Signer.h : Declaration of CSigV4Signer, AWS Signature Version 4
+
+#pragma once
+
+#include "Http.h"
+#include "Sha256.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+namespace BigStash
+{
+	// The x-amz-content-sha256 values that are not a hash.
+	extern const char* const SIGV4_UNSIGNED_PAYLOAD;
+	extern const char* const SIGV4_STREAMING_PAYLOAD;
+
+	struct SigV4Credentials
+	{
+		std::string accessKeyId;
+		std::string secretAccessKey;
+
+		// Only for temporary credentials.
+		std::string sessionToken;
+	};
+
+	enum SigV4PayloadMode
+	{
+		// The payload is not part of the signature (UNSIGNED-PAYLOAD).
+		SIGV4_PAYLOAD_UNSIGNED,
+
+		// The SHA-256 of the whole payload is signed.
+		SIGV4_PAYLOAD_SIGNED,
+
+		// aws-chunked: the headers are signed up front (the seed signature)
+		// and every chunk of the body carries a signature chained to it.
+		SIGV4_PAYLOAD_STREAMING
+	};
+
+	// CSigV4Signer
+	//
+	// Signs requests for one set of credentials, region and service. The
+	// signing key is derived from the secret with four HMACs per date; it is
+	// cached and only derived again when the UTC date changes. When the
+	// request carries the payload SHA-256 already (HttpRequest::bodySha256,
+	// computed while the part was read) the body is not hashed again.
+	class CSigV4Signer
+	{
+	public:
+		CSigV4Signer(const SigV4Credentials& credentials, const std::string& region, const std::string& service,
+			SigV4PayloadMode payloadMode);
+
+		// Adds x-amz-date, x-amz-content-sha256, the session token and the
+		// Authorization header, and in streaming mode the aws-chunked framing
+		// of the body (a single signed chunk plus the final empty one). The
+		// request must carry its Host header. Safe to call from any thread.
+		void Sign(HttpRequest& request);
+		void Sign(HttpRequest& request, int64_t unixTime);
+
+		// Adds the date, payload hash and Authorization headers over the
+		// headers the request has, and returns the signature. Sign builds on
+		// it; the framing is up to the caller.
+		std::string Authorize(HttpRequest& request, int64_t unixTime, const std::string& payloadHash);
+
+		// The signature of one aws-chunked chunk, chained to the previous
+		// chunk's (or the seed) signature.
+		std::string ChunkSignature(int64_t unixTime, const std::string& previousSignature,
+			const uint8_t chunkSha256[SHA256_DIGEST_SIZE]);
+
+		// Number of signing keys derived so far.
+		uint64_t KeyDerivations() const { return m_derivations; }
+
+	private:
+		CSigV4Signer(const CSigV4Signer&);
+		CSigV4Signer& operator=(const CSigV4Signer&);
+
+		void SigningKey(const std::string& date, uint8_t key[SHA256_DIGEST_SIZE]);
+		std::string Scope(const std::string& date) const;
+
+		SigV4Credentials m_credentials;
+		std::string m_region;
+		std::string m_service;
+		SigV4PayloadMode m_payloadMode;
+
+		std::mutex m_keyLock;
+		std::string m_keyDate;
+		uint8_t m_key[SHA256_DIGEST_SIZE];
+		std::atomic<uint64_t> m_derivations;
+	};
+
+	// "20130524T000000Z" and "20130524" for a Unix time.
+	std::string AmzDate(int64_t unixTime);
+}
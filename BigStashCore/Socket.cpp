@@ -0,0 +1,499 @@
+// Socket.cpp : Implementation of the socket helpers and CPoller
+
+#include "Socket.h"
+
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		int LastSocketError()
+		{
+#ifdef _WIN32
+			return WSAGetLastError();
+#else
+			return errno;
+#endif
+		}
+
+		bool WouldBlock(int error)
+		{
+#ifdef _WIN32
+			return error == WSAEWOULDBLOCK;
+#else
+			return error == EAGAIN || error == EWOULDBLOCK;
+#endif
+		}
+
+		BsStatus StatusFromSocketError(int error)
+		{
+#ifdef _WIN32
+			return error == WSAEACCES ? BS_E_ACCESSDENIED : BS_E_IO;
+#else
+			return error == EACCES ? BS_E_ACCESSDENIED : BS_E_IO;
+#endif
+		}
+
+#if !defined(__linux__)
+		// A connected pair for waking the poller. Windows has no socketpair,
+		// so it takes a loopback connection.
+		BsStatus CreateWakePair(SocketHandle& readEnd, SocketHandle& writeEnd)
+		{
+#ifdef _WIN32
+			SocketHandle listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (listener == INVALID_SOCKET_HANDLE)
+				return BS_E_IO;
+
+			sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			int length = sizeof(address);
+
+			BsStatus status = BS_E_IO;
+			readEnd = writeEnd = INVALID_SOCKET_HANDLE;
+			if (bind(listener, (sockaddr*)&address, sizeof(address)) == 0 &&
+				getsockname(listener, (sockaddr*)&address, &length) == 0 &&
+				listen(listener, 1) == 0)
+			{
+				writeEnd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+				if (writeEnd != INVALID_SOCKET_HANDLE && connect(writeEnd, (sockaddr*)&address, sizeof(address)) == 0)
+				{
+					readEnd = accept(listener, NULL, NULL);
+					if (readEnd != INVALID_SOCKET_HANDLE)
+						status = BS_OK;
+				}
+			}
+
+			closesocket(listener);
+			if (status != BS_OK && writeEnd != INVALID_SOCKET_HANDLE)
+				closesocket(writeEnd);
+			return status;
+#else
+			int pair[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+				return StatusFromErrno(errno);
+			readEnd = pair[0];
+			writeEnd = pair[1];
+			return BS_OK;
+#endif
+		}
+#endif
+	}
+
+	BsStatus SocketStartup()
+	{
+#ifdef _WIN32
+		static const int result = []()
+		{
+			WSADATA data;
+			return WSAStartup(MAKEWORD(2, 2), &data);
+		}();
+		return result == 0 ? BS_OK : BS_E_IO;
+#else
+		return BS_OK;
+#endif
+	}
+
+	//
+	//   FUNCTION: StartConnect(const std::string&, uint16_t, const SocketOptions&, SocketHandle&)
+	//
+	//   PURPOSE: Resolves the host and starts a non-blocking connect to the
+	//            first address that takes it. The buffer sizes are set before
+	//            connecting so the TCP window scale covers them.
+	//
+	BsStatus StartConnect(const std::string& host, uint16_t port, const SocketOptions& options, SocketHandle& result)
+	{
+		result = INVALID_SOCKET_HANDLE;
+
+		BsStatus status = SocketStartup();
+		if (status != BS_OK)
+			return status;
+
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+
+		addrinfo* addresses = NULL;
+		std::string service = std::to_string(port);
+		if (getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses) != 0)
+			return BS_E_NOTFOUND;
+
+		status = BS_E_IO;
+		for (addrinfo* address = addresses; address != NULL; address = address->ai_next)
+		{
+			SocketHandle handle = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if (handle == INVALID_SOCKET_HANDLE)
+				continue;
+
+			ApplySocketOptions(handle, options);
+			if (SetNonBlocking(handle) != BS_OK)
+			{
+				CloseSocket(handle);
+				continue;
+			}
+
+			int connected = connect(handle, address->ai_addr, (int)address->ai_addrlen);
+			int error = connected == 0 ? 0 : LastSocketError();
+#ifdef _WIN32
+			bool pending = error == WSAEWOULDBLOCK;
+#else
+			bool pending = error == EINPROGRESS;
+#endif
+			if (connected == 0 || pending)
+			{
+				result = handle;
+				status = BS_OK;
+				break;
+			}
+
+			CloseSocket(handle);
+		}
+
+		freeaddrinfo(addresses);
+		return status;
+	}
+
+	BsStatus FinishConnect(SocketHandle socket)
+	{
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0)
+			return StatusFromSocketError(LastSocketError());
+		return error == 0 ? BS_OK : StatusFromSocketError(error);
+	}
+
+	void CloseSocket(SocketHandle socket)
+	{
+		if (socket == INVALID_SOCKET_HANDLE)
+			return;
+#ifdef _WIN32
+		closesocket(socket);
+#else
+		close(socket);
+#endif
+	}
+
+	BsStatus SetNonBlocking(SocketHandle socket)
+	{
+#ifdef _WIN32
+		u_long enable = 1;
+		if (ioctlsocket(socket, FIONBIO, &enable) != 0)
+			return StatusFromSocketError(LastSocketError());
+#else
+		int flags = fcntl(socket, F_GETFL, 0);
+		if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) != 0)
+			return StatusFromErrno(errno);
+#endif
+		return BS_OK;
+	}
+
+	void ApplySocketOptions(SocketHandle socket, const SocketOptions& options)
+	{
+		int enable = 1;
+		if (options.noDelay)
+			setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&enable, sizeof(enable));
+		if (options.keepAlive)
+			setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, (const char*)&enable, sizeof(enable));
+		if (options.sendBufferSize > 0)
+			setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sendBufferSize, sizeof(int));
+		if (options.receiveBufferSize > 0)
+			setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (const char*)&options.receiveBufferSize, sizeof(int));
+#ifdef SO_NOSIGPIPE
+		setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#endif
+	}
+
+	ptrdiff_t SendGather(SocketHandle socket, const void* first, size_t firstLength,
+		const void* second, size_t secondLength, BsStatus& status)
+	{
+#ifdef _WIN32
+		WSABUF buffers[2];
+		buffers[0].buf = (CHAR*)first;
+		buffers[0].len = (ULONG)firstLength;
+		buffers[1].buf = (CHAR*)second;
+		buffers[1].len = (ULONG)secondLength;
+
+		DWORD sent = 0;
+		if (WSASend(socket, buffers, secondLength > 0 ? 2 : 1, &sent, 0, NULL, NULL) != 0)
+		{
+			int error = LastSocketError();
+			if (WouldBlock(error))
+				return 0;
+			status = StatusFromSocketError(error);
+			return -1;
+		}
+		return (ptrdiff_t)sent;
+#else
+		iovec buffers[2];
+		buffers[0].iov_base = const_cast<void*>(first);
+		buffers[0].iov_len = firstLength;
+		buffers[1].iov_base = const_cast<void*>(second);
+		buffers[1].iov_len = secondLength;
+
+		msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = firstLength > 0 ? buffers : buffers + 1;
+		message.msg_iovlen = (firstLength > 0 ? 1 : 0) + (secondLength > 0 ? 1 : 0);
+
+#ifdef MSG_NOSIGNAL
+		const int flags = MSG_NOSIGNAL;
+#else
+		const int flags = 0;
+#endif
+		for (;;)
+		{
+			ssize_t sent = sendmsg(socket, &message, flags);
+			if (sent >= 0)
+				return sent;
+			if (errno == EINTR)
+				continue;
+			if (WouldBlock(errno))
+				return 0;
+			status = StatusFromSocketError(errno);
+			return -1;
+		}
+#endif
+	}
+
+	ptrdiff_t Receive(SocketHandle socket, void* buffer, size_t length, BsStatus& status)
+	{
+		for (;;)
+		{
+			ptrdiff_t received = recv(socket, (char*)buffer, (int)length, 0);
+			if (received >= 0)
+				return received;
+
+			int error = LastSocketError();
+#ifndef _WIN32
+			if (error == EINTR)
+				continue;
+#endif
+			if (WouldBlock(error))
+				return -1;
+			status = StatusFromSocketError(error);
+			return -2;
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CPoller methods
+	//
+
+#if defined(__linux__)
+	namespace
+	{
+		uint32_t ToEpoll(unsigned events)
+		{
+			return ((events & POLL_READ) ? (uint32_t)EPOLLIN : 0) | ((events & POLL_WRITE) ? (uint32_t)EPOLLOUT : 0);
+		}
+	}
+
+	CPoller::CPoller()
+	{
+		m_epoll = epoll_create1(EPOLL_CLOEXEC);
+		m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeFd, &event);
+	}
+
+	CPoller::~CPoller()
+	{
+		close(m_wakeFd);
+		close(m_epoll);
+	}
+
+	BsStatus CPoller::Add(SocketHandle socket, unsigned events, void* context)
+	{
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = ToEpoll(events);
+		event.data.ptr = context;
+		return epoll_ctl(m_epoll, EPOLL_CTL_ADD, socket, &event) == 0 ? BS_OK : StatusFromErrno(errno);
+	}
+
+	BsStatus CPoller::Modify(SocketHandle socket, unsigned events, void* context)
+	{
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = ToEpoll(events);
+		event.data.ptr = context;
+		return epoll_ctl(m_epoll, EPOLL_CTL_MOD, socket, &event) == 0 ? BS_OK : StatusFromErrno(errno);
+	}
+
+	void CPoller::Remove(SocketHandle socket)
+	{
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, socket, NULL);
+	}
+
+	BsStatus CPoller::Wait(std::vector<Event>& events, int timeoutMs)
+	{
+		epoll_event ready[64];
+		events.clear();
+
+		int count = epoll_wait(m_epoll, ready, 64, timeoutMs);
+		if (count < 0)
+			return errno == EINTR ? BS_OK : StatusFromErrno(errno);
+
+		for (int i = 0; i < count; ++i)
+		{
+			if (ready[i].data.ptr == NULL)
+			{
+				uint64_t value;
+				while (read(m_wakeFd, &value, sizeof(value)) > 0)
+					;
+				continue;
+			}
+
+			Event event;
+			event.context = ready[i].data.ptr;
+			event.events = ((ready[i].events & EPOLLIN) ? POLL_READ : 0) |
+				((ready[i].events & EPOLLOUT) ? POLL_WRITE : 0) |
+				((ready[i].events & (EPOLLERR | EPOLLHUP)) ? POLL_ERROR : 0);
+			events.push_back(event);
+		}
+
+		return BS_OK;
+	}
+
+	void CPoller::Wake()
+	{
+		uint64_t value = 1;
+		ssize_t written = write(m_wakeFd, &value, sizeof(value));
+		(void)written;
+	}
+#else
+	CPoller::CPoller() : m_wakeRead(INVALID_SOCKET_HANDLE), m_wakeWrite(INVALID_SOCKET_HANDLE)
+	{
+		if (SocketStartup() == BS_OK && CreateWakePair(m_wakeRead, m_wakeWrite) == BS_OK)
+			SetNonBlocking(m_wakeRead);
+	}
+
+	CPoller::~CPoller()
+	{
+		CloseSocket(m_wakeRead);
+		CloseSocket(m_wakeWrite);
+	}
+
+	BsStatus CPoller::Add(SocketHandle socket, unsigned events, void* context)
+	{
+		Entry entry = { socket, events, context };
+		m_entries.push_back(entry);
+		return BS_OK;
+	}
+
+	BsStatus CPoller::Modify(SocketHandle socket, unsigned events, void* context)
+	{
+		for (Entry& entry : m_entries)
+		{
+			if (entry.socket == socket)
+			{
+				entry.events = events;
+				entry.context = context;
+				return BS_OK;
+			}
+		}
+
+		return BS_E_NOTFOUND;
+	}
+
+	void CPoller::Remove(SocketHandle socket)
+	{
+		for (size_t i = 0; i < m_entries.size(); ++i)
+		{
+			if (m_entries[i].socket == socket)
+			{
+				m_entries[i] = m_entries.back();
+				m_entries.pop_back();
+				return;
+			}
+		}
+	}
+
+	BsStatus CPoller::Wait(std::vector<Event>& events, int timeoutMs)
+	{
+#ifdef _WIN32
+		typedef WSAPOLLFD PollFd;
+#else
+		typedef pollfd PollFd;
+#endif
+		std::vector<PollFd> fds(m_entries.size() + 1);
+		fds[0].fd = m_wakeRead;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		for (size_t i = 0; i < m_entries.size(); ++i)
+		{
+			fds[i + 1].fd = m_entries[i].socket;
+			fds[i + 1].events = (short)(((m_entries[i].events & POLL_READ) ? POLLIN : 0) |
+				((m_entries[i].events & POLL_WRITE) ? POLLOUT : 0));
+			fds[i + 1].revents = 0;
+		}
+
+		events.clear();
+#ifdef _WIN32
+		int count = WSAPoll(fds.data(), (ULONG)fds.size(), timeoutMs);
+#else
+		int count = poll(fds.data(), fds.size(), timeoutMs);
+#endif
+		if (count < 0)
+			return BS_E_IO;
+
+		if (fds[0].revents != 0)
+		{
+			char drain[64];
+			BsStatus ignored;
+			while (Receive(m_wakeRead, drain, sizeof(drain), ignored) > 0)
+				;
+		}
+
+		for (size_t i = 1; i < fds.size(); ++i)
+		{
+			if (fds[i].revents == 0)
+				continue;
+
+			Event event;
+			event.context = m_entries[i - 1].context;
+			event.events = ((fds[i].revents & POLLIN) ? POLL_READ : 0) |
+				((fds[i].revents & POLLOUT) ? POLL_WRITE : 0) |
+				((fds[i].revents & (POLLERR | POLLHUP)) ? POLL_ERROR : 0);
+			events.push_back(event);
+		}
+
+		return BS_OK;
+	}
+
+	void CPoller::Wake()
+	{
+		char byte = 1;
+		BsStatus ignored;
+		SendGather(m_wakeWrite, &byte, 1, NULL, 0, ignored);
+	}
+#endif
+}
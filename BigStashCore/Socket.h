@@ -0,0 +1,110 @@
+// Socket.h : Declaration of the portable socket helpers and CPoller
+
+#pragma once
+
+#include "Platform.h"
+
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+namespace BigStash
+{
+#ifdef _WIN32
+	typedef SOCKET SocketHandle;
+	const SocketHandle INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+#else
+	typedef int SocketHandle;
+	const SocketHandle INVALID_SOCKET_HANDLE = -1;
+#endif
+
+	struct SocketOptions
+	{
+		SocketOptions() : sendBufferSize(4 * 1024 * 1024), receiveBufferSize(1024 * 1024), noDelay(true), keepAlive(true) {}
+
+		// SO_SNDBUF / SO_RCVBUF; 0 leaves the system default. Large send
+		// buffers keep a high bandwidth-delay path full.
+		int sendBufferSize;
+		int receiveBufferSize;
+
+		bool noDelay;
+		bool keepAlive;
+	};
+
+	// WSAStartup on Windows, once; nothing elsewhere.
+	BsStatus SocketStartup();
+
+	// Resolves host and starts a non-blocking connect. The socket becomes
+	// writable once connected; FinishConnect tells whether it worked.
+	BsStatus StartConnect(const std::string& host, uint16_t port, const SocketOptions& options, SocketHandle& socket);
+	BsStatus FinishConnect(SocketHandle socket);
+
+	void CloseSocket(SocketHandle socket);
+	BsStatus SetNonBlocking(SocketHandle socket);
+	void ApplySocketOptions(SocketHandle socket, const SocketOptions& options);
+
+	// Gathered send of up to two buffers. Returns the bytes sent, 0 when the
+	// socket would block, or -1 with status set on an error.
+	ptrdiff_t SendGather(SocketHandle socket, const void* first, size_t firstLength,
+		const void* second, size_t secondLength, BsStatus& status);
+
+	// Returns the bytes received, 0 at the end of the stream, -1 when the
+	// socket would block and -2 on an error (status set).
+	ptrdiff_t Receive(SocketHandle socket, void* buffer, size_t length, BsStatus& status);
+
+	enum PollEvents
+	{
+		POLL_READ = 0x1,
+		POLL_WRITE = 0x2,
+		POLL_ERROR = 0x4
+	};
+
+	// CPoller
+	//
+	// Readiness notification for a set of sockets: epoll on Linux, poll
+	// elsewhere (WSAPoll on Windows). Level triggered.
+	class CPoller
+	{
+	public:
+		struct Event
+		{
+			void* context;
+			unsigned events;
+		};
+
+		CPoller();
+		~CPoller();
+
+		BsStatus Add(SocketHandle socket, unsigned events, void* context);
+		BsStatus Modify(SocketHandle socket, unsigned events, void* context);
+		void Remove(SocketHandle socket);
+
+		// Waits up to timeoutMs (-1 forever) or until Wake is called from
+		// another thread.
+		BsStatus Wait(std::vector<Event>& events, int timeoutMs);
+		void Wake();
+
+	private:
+		CPoller(const CPoller&);
+		CPoller& operator=(const CPoller&);
+
+#if defined(__linux__)
+		int m_epoll;
+		int m_wakeFd;
+#else
+		struct Entry
+		{
+			SocketHandle socket;
+			unsigned events;
+			void* context;
+		};
+
+		std::vector<Entry> m_entries;
+		SocketHandle m_wakeRead;
+		SocketHandle m_wakeWrite;
+#endif
+	};
+}
@@ -0,0 +1,841 @@
+// TreeScanner.cpp : Implementation of CTreeScanner
+
+#include "TreeScanner.h"
+#include "Utf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace BigStash
+{
+	/////////////////////////////////////////////////////////////////////////////
+	// Some helper methods
+	//
+
+	namespace
+	{
+		inline bool IsSeparator(PathChar c)
+		{
+#ifdef _WIN32
+			return c == L'\\' || c == L'/';
+#else
+			return c == '/';
+#endif
+		}
+
+		// The next character of a path, folded as the platform compares paths.
+		inline uint32_t NextChar(const PathString& path, size_t& i)
+		{
+			return NextPathChar(path.data(), i, path.size(), PATH_IGNORE_CASE);
+		}
+
+		inline bool IsDotOrDotDot(const PathChar* name)
+		{
+			return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+		}
+
+#ifdef _WIN32
+		// For the names of a directory query, which are not NUL terminated.
+		inline bool IsDotOrDotDot(const PathChar* name, size_t length)
+		{
+			return (length == 1 && name[0] == '.') || (length == 2 && name[0] == '.' && name[1] == '.');
+		}
+#endif
+
+		bool PathEquals(const PathString& a, const PathString& b)
+		{
+			if (a.size() != b.size())
+				return false;
+
+			for (size_t i = 0, j = 0; i < a.size(); )
+			{
+				if (NextChar(a, i) != NextChar(b, j))
+					return false;
+			}
+
+			return true;
+		}
+
+		// Orders paths so that every descendant directly follows its ancestor,
+		// by treating the separator as the smallest character.
+		bool PathLess(const PathString& a, const PathString& b)
+		{
+			size_t i = 0, j = 0;
+			while (i < a.size() && j < b.size())
+			{
+				uint32_t ca = IsSeparator(a[i]) ? (++i, 1) : NextChar(a, i) + 1;
+				uint32_t cb = IsSeparator(b[j]) ? (++j, 1) : NextChar(b, j) + 1;
+				if (ca != cb)
+					return ca < cb;
+			}
+
+			return j < b.size();
+		}
+
+		// Characters that fold equal have the same length, so a matching
+		// ancestor ends at the same offset in path.
+		bool IsAncestor(const PathString& ancestor, const PathString& path)
+		{
+			if (path.size() <= ancestor.size())
+				return false;
+
+			if (!IsSeparator(path[ancestor.size()]) && !IsSeparator(ancestor.back()))
+				return false;
+
+			for (size_t i = 0, j = 0; i < ancestor.size(); )
+			{
+				if (NextChar(ancestor, i) != NextChar(path, j))
+					return false;
+			}
+
+			return true;
+		}
+
+		// Splits a path into its parent directory and the offset of its name.
+		size_t NameOffset(const PathString& path)
+		{
+			for (size_t i = path.size(); i > 0; --i)
+			{
+				if (IsSeparator(path[i - 1]))
+					return i;
+			}
+
+			return 0;
+		}
+
+#ifdef _WIN32
+		// Prefixes long paths with \\?\ so CreateFile accepts them.
+		PathString ExtendedLengthPath(const PathString& path)
+		{
+			if (path.size() < MAX_PATH - 12 || path.compare(0, 4, L"\\\\?\\") == 0)
+				return path;
+
+			if (path.compare(0, 2, L"\\\\") == 0)
+				return L"\\\\?\\UNC" + path.substr(1);
+
+			return L"\\\\?\\" + path;
+		}
+#else
+		uint32_t AttributesFromStat(const struct stat& st, const char* name)
+		{
+			uint32_t attributes = 0;
+
+			if (S_ISDIR(st.st_mode))
+				attributes |= BS_FILE_ATTRIBUTE_DIRECTORY;
+			if (S_ISLNK(st.st_mode))
+				attributes |= BS_FILE_ATTRIBUTE_REPARSE_POINT;
+			if ((st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0)
+				attributes |= BS_FILE_ATTRIBUTE_READONLY;
+			if (name[0] == '.')
+				attributes |= BS_FILE_ATTRIBUTE_HIDDEN;
+
+			return attributes != 0 ? attributes : BS_FILE_ATTRIBUTE_NORMAL;
+		}
+
+		int64_t LastWriteTimeFromStat(const struct stat& st)
+		{
+#if defined(__APPLE__)
+			return UnixTimeToFileTime(st.st_mtimespec.tv_sec, st.st_mtimespec.tv_nsec);
+#else
+			return UnixTimeToFileTime(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+#endif
+		}
+
+		// Reads the entries of one directory. On Linux the entries come straight
+		// from getdents64 into the worker's buffer, elsewhere from readdir.
+		class CDirectoryReader
+		{
+		public:
+			explicit CDirectoryReader(std::vector<char>& buffer)
+				: m_buffer(buffer), m_fd(-1), m_dir(NULL), m_offset(0), m_length(0), m_failed(false)
+			{
+			}
+
+			~CDirectoryReader()
+			{
+#ifdef __linux__
+				if (m_fd >= 0)
+					close(m_fd);
+#else
+				if (m_dir != NULL)
+					closedir(m_dir);
+				else if (m_fd >= 0)
+					close(m_fd);
+#endif
+			}
+
+			bool Open(const char* path)
+			{
+				m_fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (m_fd < 0)
+					return false;
+
+#ifndef __linux__
+				m_dir = fdopendir(m_fd);
+				if (m_dir == NULL)
+					return false;
+#endif
+				return true;
+			}
+
+			int Fd() const { return m_fd; }
+
+			bool Failed() const { return m_failed; }
+
+			bool Next(const char*& name, unsigned char& type)
+			{
+#ifdef __linux__
+				// struct linux_dirent64, glibc only declares getdents64 since 2.30.
+				struct DirEnt64
+				{
+					uint64_t d_ino;
+					int64_t d_off;
+					unsigned short d_reclen;
+					unsigned char d_type;
+					char d_name[1];
+				};
+
+				if (m_offset >= m_length)
+				{
+					long bytesRead = syscall(SYS_getdents64, m_fd, m_buffer.data(), m_buffer.size());
+					if (bytesRead <= 0)
+					{
+						m_failed = bytesRead < 0;
+						return false;
+					}
+
+					m_offset = 0;
+					m_length = (size_t)bytesRead;
+				}
+
+				const DirEnt64* entry = reinterpret_cast<const DirEnt64*>(m_buffer.data() + m_offset);
+				m_offset += entry->d_reclen;
+				name = entry->d_name;
+				type = entry->d_type;
+				return true;
+#else
+				errno = 0;
+				struct dirent* entry = readdir(m_dir);
+				if (entry == NULL)
+				{
+					m_failed = errno != 0;
+					return false;
+				}
+
+				name = entry->d_name;
+				type = entry->d_type;
+				return true;
+#endif
+			}
+
+		private:
+			std::vector<char>& m_buffer;
+			int m_fd;
+			DIR* m_dir;
+			size_t m_offset;
+			size_t m_length;
+			bool m_failed;
+		};
+#endif
+	}
+
+	//
+	//   FUNCTION: NormalizeRoots(const std::vector<PathString>&)
+	//
+	//   PURPOSE: Strips trailing separators, sorts the roots and drops every
+	//            root that is equal to or nested inside another root.
+	//
+	std::vector<PathString> NormalizeRoots(const std::vector<PathString>& roots)
+	{
+		std::vector<PathString> sorted;
+		sorted.reserve(roots.size());
+
+		for (const PathString& root : roots)
+		{
+			PathString path = root;
+
+			// keep "/" and "C:\" intact.
+			while (path.size() > 1 && IsSeparator(path.back()) &&
+				!(path.size() == 3 && path[1] == ':'))
+			{
+				path.pop_back();
+			}
+
+			if (!path.empty())
+				sorted.push_back(path);
+		}
+
+		std::sort(sorted.begin(), sorted.end(), PathLess);
+
+		std::vector<PathString> result;
+		for (const PathString& path : sorted)
+		{
+			if (!result.empty() &&
+				(PathEquals(result.back(), path) || IsAncestor(result.back(), path)))
+			{
+				continue;
+			}
+
+			result.push_back(path);
+		}
+
+		return result;
+	}
+
+	//
+	//   FUNCTION: RootKeyOffset(const PathString&)
+	//
+	//   PURPOSE: Key names start at the selected root's own name, the same way
+	//            ArchiveViewModel strips the root's parent directory.
+	//
+	uint32_t RootKeyOffset(const PathString& root)
+	{
+		size_t length = root.size();
+		while (length > 0 && IsSeparator(root[length - 1]))
+			--length;
+
+		for (size_t i = length; i > 0; --i)
+		{
+			if (IsSeparator(root[i - 1]))
+				return (uint32_t)i;
+		}
+
+		return 0;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CScanBatch methods
+	//
+
+	//
+	//   FUNCTION: CScanBatch::Add(...)
+	//
+	//   PURPOSE: Packs directory + separator + name (null terminated) into the
+	//            batch's string buffer and appends the entry describing it.
+	//
+	void CScanBatch::Add(const PathString& directory, const PathChar* name, size_t nameLength,
+		uint32_t keyOffset, uint32_t attributes, uint32_t flags, uint64_t size, int64_t lastWriteTime,
+		uint64_t volume, uint64_t fileId)
+	{
+		ScanEntry entry;
+		entry.pathOffset = (uint32_t)m_strings.size();
+		entry.nameOffset = (uint32_t)directory.size();
+		entry.keyOffset = keyOffset;
+		entry.attributes = attributes;
+		entry.flags = flags;
+		entry.status = BS_OK;
+		entry.size = size;
+		entry.lastWriteTime = lastWriteTime;
+		entry.volume = volume;
+		entry.fileId = fileId;
+
+		m_strings.insert(m_strings.end(), directory.begin(), directory.end());
+		if (!directory.empty() && !IsSeparator(directory.back()))
+		{
+			m_strings.push_back(PATH_SEPARATOR);
+			entry.nameOffset++;
+		}
+		m_strings.insert(m_strings.end(), name, name + nameLength);
+		entry.pathLength = (uint32_t)(m_strings.size() - entry.pathOffset);
+		m_strings.push_back(0);
+
+		m_entries.push_back(entry);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CTreeScanner methods
+	//
+
+	CTreeScanner::CTreeScanner(const ScanOptions& options, ScanSink sink)
+		: m_options(options), m_sink(sink), m_pending(0), m_cancel(false)
+	{
+		memset(&m_stats, 0, sizeof(m_stats));
+
+		if (m_options.threadCount == 0)
+			m_options.threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+		if (m_options.batchSize == 0)
+			m_options.batchSize = 1;
+	}
+
+	CTreeScanner::~CTreeScanner()
+	{
+	}
+
+	//
+	//   FUNCTION: CTreeScanner::Run(const std::vector<PathString>&)
+	//
+	//   PURPOSE: Classifies the roots, seeds the worker deques with the root
+	//            directories and runs the workers until every queued
+	//            directory has been scanned.
+	//
+	BsStatus CTreeScanner::Run(const std::vector<PathString>& roots)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		memset(&m_stats, 0, sizeof(m_stats));
+
+		unsigned threadCount = m_options.threadCount;
+		m_workers.clear();
+		for (unsigned i = 0; i < threadCount; ++i)
+		{
+			std::unique_ptr<Worker> worker(new Worker());
+			worker->buffer.resize(64 * 1024);
+			worker->files = worker->directories = worker->bytes = 0;
+			worker->skipped = worker->errors = worker->steals = 0;
+			m_workers.push_back(std::move(worker));
+		}
+
+		m_pending.store(0);
+		m_cancel.store(false);
+
+		std::vector<PathString> normalized = NormalizeRoots(roots);
+		unsigned next = 0;
+
+		for (const PathString& root : normalized)
+		{
+			Worker& worker = *m_workers[0];
+			uint32_t keyOffset = RootKeyOffset(root);
+			uint32_t attributes = 0;
+			BsStatus status = BS_OK;
+
+#ifdef _WIN32
+			WIN32_FILE_ATTRIBUTE_DATA data;
+			if (GetFileAttributesExW(ExtendedLengthPath(root).c_str(), GetFileExInfoStandard, &data))
+				attributes = data.dwFileAttributes;
+			else
+				status = StatusFromWin32(GetLastError());
+#else
+			struct stat st;
+			if (lstat(root.c_str(), &st) == 0)
+				attributes = AttributesFromStat(st, root.c_str() + NameOffset(root));
+			else
+				status = StatusFromErrno(errno);
+#endif
+
+			// One root that is gone or unreadable does not cost the others.
+			if (status != BS_OK)
+			{
+				worker.errors++;
+				EmitSkipped(worker, root, keyOffset, 0, BS_SCAN_SKIPPED_INACCESSIBLE, status);
+			}
+			else if (attributes & BS_FILE_ATTRIBUTE_REPARSE_POINT)
+			{
+				EmitSkipped(worker, root, keyOffset, attributes, BS_SCAN_SKIPPED_REPARSE_POINT);
+			}
+			else if (attributes & BS_FILE_ATTRIBUTE_DIRECTORY)
+			{
+				if (IsRestricted(root))
+				{
+					EmitSkipped(worker, root, keyOffset, attributes, BS_SCAN_SKIPPED_RESTRICTED);
+					continue;
+				}
+
+				DirTask task;
+				task.path = root;
+				task.keyOffset = keyOffset;
+				PushTask(next++ % threadCount, std::move(task));
+			}
+			else
+			{
+				ScanRootFile(worker, root, (uint32_t)NameOffset(root));
+			}
+		}
+
+		std::vector<std::thread> threads;
+		for (unsigned i = 1; i < threadCount; ++i)
+			threads.push_back(std::thread(&CTreeScanner::WorkerLoop, this, i));
+
+		WorkerLoop(0);
+
+		for (std::thread& thread : threads)
+			thread.join();
+
+		for (const std::unique_ptr<Worker>& worker : m_workers)
+		{
+			m_stats.files += worker->files;
+			m_stats.directories += worker->directories;
+			m_stats.bytes += worker->bytes;
+			m_stats.skipped += worker->skipped;
+			m_stats.errors += worker->errors;
+			m_stats.steals += worker->steals;
+		}
+
+		m_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		return m_cancel.load() ? BS_E_CANCELLED : BS_OK;
+	}
+
+	//
+	//   FUNCTION: CTreeScanner::WorkerLoop(unsigned)
+	//
+	//   PURPOSE: Scans directories from the worker's own deque or stolen from
+	//            the others until no directory is left anywhere.
+	//
+	void CTreeScanner::WorkerLoop(unsigned index)
+	{
+		Worker& worker = *m_workers[index];
+		DirTask task;
+		unsigned idleRounds = 0;
+
+		while (!m_cancel.load(std::memory_order_relaxed))
+		{
+			if (PopTask(index, task))
+			{
+				ScanDirectory(worker, index, task);
+				m_pending.fetch_sub(1);
+				idleRounds = 0;
+				continue;
+			}
+
+			// pending only drops to zero once every directory has been scanned,
+			// a worker that is still scanning may push more work.
+			if (m_pending.load() == 0)
+				break;
+
+			if (++idleRounds < 64)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+
+		FlushBatch(worker, true);
+	}
+
+	bool CTreeScanner::PopTask(unsigned index, DirTask& task)
+	{
+		{
+			Worker& own = *m_workers[index];
+			std::lock_guard<std::mutex> guard(own.lock);
+			if (!own.tasks.empty())
+			{
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+
+		size_t count = m_workers.size();
+		for (size_t i = 1; i < count; ++i)
+		{
+			Worker& victim = *m_workers[(index + i) % count];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (!victim.tasks.empty())
+			{
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				m_workers[index]->steals++;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void CTreeScanner::PushTask(unsigned index, DirTask&& task)
+	{
+		m_pending.fetch_add(1);
+
+		Worker& worker = *m_workers[index];
+		std::lock_guard<std::mutex> guard(worker.lock);
+		worker.tasks.push_back(std::move(task));
+	}
+
+	//
+	//   FUNCTION: CTreeScanner::ScanDirectory(Worker&, unsigned, const DirTask&)
+	//
+	//   PURPOSE: Lists one directory. Files go into the worker's batch,
+	//            subdirectories are pushed on the worker's deque and reparse
+	//            points are reported as skipped without being followed.
+	//
+	void CTreeScanner::ScanDirectory(Worker& worker, unsigned index, const DirTask& task)
+	{
+		worker.directories++;
+
+#ifdef _WIN32
+		// FileIdBothDirectoryInfo is the same directory query FindFirstFileEx
+		// makes, with the file IDs the change index keys on.
+		HANDLE hDir = CreateFileW(ExtendedLengthPath(task.path).c_str(), FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+
+		BY_HANDLE_FILE_INFORMATION directoryInfo;
+		if (hDir == INVALID_HANDLE_VALUE || !GetFileInformationByHandle(hDir, &directoryInfo))
+		{
+			if (hDir != INVALID_HANDLE_VALUE)
+				CloseHandle(hDir);
+			worker.errors++;
+			EmitSkipped(worker, task.path, task.keyOffset, BS_FILE_ATTRIBUTE_DIRECTORY, BS_SCAN_SKIPPED_UNREADABLE);
+			return;
+		}
+
+		uint64_t volume = directoryInfo.dwVolumeSerialNumber;
+		FILE_INFO_BY_HANDLE_CLASS infoClass = FileIdBothDirectoryRestartInfo;
+
+		while (GetFileInformationByHandleEx(hDir, infoClass, worker.buffer.data(), (DWORD)worker.buffer.size()))
+		{
+			infoClass = FileIdBothDirectoryInfo;
+
+			size_t offset = 0;
+			for (bool more = true; more; )
+			{
+				const FILE_ID_BOTH_DIR_INFO& data =
+					*reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(worker.buffer.data() + offset);
+				more = data.NextEntryOffset != 0;
+				offset += data.NextEntryOffset;
+
+				const wchar_t* name = data.FileName;
+				size_t nameLength = data.FileNameLength / sizeof(wchar_t);
+				DWORD attributes = data.FileAttributes;
+
+				if (IsDotOrDotDot(name, nameLength))
+					continue;
+
+				if (attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+				{
+					worker.skipped++;
+					worker.batch.Add(task.path, name, nameLength, task.keyOffset, attributes,
+						BS_SCAN_SKIPPED_REPARSE_POINT, 0, 0);
+				}
+				else if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+				{
+					DirTask child;
+					child.path = task.path;
+					if (!IsSeparator(child.path.back()))
+						child.path += PATH_SEPARATOR;
+					child.path.append(name, nameLength);
+					child.keyOffset = task.keyOffset;
+
+					if (IsRestricted(child.path))
+					{
+						worker.skipped++;
+						worker.batch.Add(task.path, name, nameLength, task.keyOffset, attributes,
+							BS_SCAN_SKIPPED_RESTRICTED, 0, 0);
+					}
+					else
+					{
+						PushTask(index, std::move(child));
+					}
+				}
+				else
+				{
+					uint64_t size = (uint64_t)data.EndOfFile.QuadPart;
+					int64_t lastWriteTime = data.LastWriteTime.QuadPart;
+
+					worker.files++;
+					worker.bytes += size;
+					worker.batch.Add(task.path, name, nameLength, task.keyOffset, attributes, 0, size, lastWriteTime,
+						volume, (uint64_t)data.FileId.QuadPart);
+				}
+
+				FlushBatch(worker, false);
+			}
+		}
+
+		if (GetLastError() != ERROR_NO_MORE_FILES)
+			worker.errors++;
+
+		CloseHandle(hDir);
+#else
+		CDirectoryReader reader(worker.buffer);
+		if (!reader.Open(task.path.c_str()))
+		{
+			worker.errors++;
+			EmitSkipped(worker, task.path, task.keyOffset, BS_FILE_ATTRIBUTE_DIRECTORY, BS_SCAN_SKIPPED_UNREADABLE);
+			return;
+		}
+
+		const char* name;
+		unsigned char type;
+
+		while (reader.Next(name, type))
+		{
+			if (IsDotOrDotDot(name))
+				continue;
+
+			size_t nameLength = strlen(name);
+			struct stat st;
+			bool haveStat = false;
+
+			// d_type saves the stat call for directories and symlinks, some
+			// file systems leave it unknown though.
+			if (type == DT_UNKNOWN)
+			{
+				if (fstatat(reader.Fd(), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				{
+					worker.errors++;
+					continue;
+				}
+				haveStat = true;
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK :
+					S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+
+			if (type == DT_LNK)
+			{
+				worker.skipped++;
+				worker.batch.Add(task.path, name, nameLength, task.keyOffset,
+					BS_FILE_ATTRIBUTE_REPARSE_POINT, BS_SCAN_SKIPPED_REPARSE_POINT, 0, 0);
+			}
+			else if (type == DT_DIR)
+			{
+				DirTask child;
+				child.path.reserve(task.path.size() + nameLength + 1);
+				child.path = task.path;
+				if (!IsSeparator(child.path.back()))
+					child.path += PATH_SEPARATOR;
+				child.path.append(name, nameLength);
+				child.keyOffset = task.keyOffset;
+
+				if (IsRestricted(child.path))
+				{
+					worker.skipped++;
+					worker.batch.Add(task.path, name, nameLength, task.keyOffset,
+						BS_FILE_ATTRIBUTE_DIRECTORY, BS_SCAN_SKIPPED_RESTRICTED, 0, 0);
+				}
+				else
+				{
+					PushTask(index, std::move(child));
+				}
+			}
+			else if (type == DT_REG)
+			{
+				// the directory-relative lookup skips the path walk a plain
+				// stat(fullPath) would repeat for every file.
+				if (!haveStat && fstatat(reader.Fd(), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				{
+					worker.errors++;
+					continue;
+				}
+
+				worker.files++;
+				worker.bytes += (uint64_t)st.st_size;
+				worker.batch.Add(task.path, name, nameLength, task.keyOffset,
+					AttributesFromStat(st, name), 0, (uint64_t)st.st_size, LastWriteTimeFromStat(st),
+					(uint64_t)st.st_dev, (uint64_t)st.st_ino);
+			}
+			else
+			{
+				// fifos, sockets and devices are never archived.
+				worker.skipped++;
+			}
+
+			FlushBatch(worker, false);
+		}
+
+		if (reader.Failed())
+			worker.errors++;
+#endif
+	}
+
+	//
+	//   FUNCTION: CTreeScanner::ScanRootFile(Worker&, const PathString&, uint32_t)
+	//
+	//   PURPOSE: Adds an individually selected file. Its key name is just the
+	//            file name.
+	//
+	void CTreeScanner::ScanRootFile(Worker& worker, const PathString& path, uint32_t keyOffset)
+	{
+		size_t nameOffset = NameOffset(path);
+		PathString directory = path.substr(0, nameOffset);
+		const PathChar* name = path.c_str() + nameOffset;
+		size_t nameLength = path.size() - nameOffset;
+
+#ifdef _WIN32
+		// The handle also gives the file ID, which the attribute query does not.
+		HANDLE hFile = CreateFileW(ExtendedLengthPath(path).c_str(), FILE_READ_ATTRIBUTES,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			worker.errors++;
+			return;
+		}
+
+		BY_HANDLE_FILE_INFORMATION data;
+		BOOL found = GetFileInformationByHandle(hFile, &data);
+		CloseHandle(hFile);
+		if (!found)
+		{
+			worker.errors++;
+			return;
+		}
+
+		uint64_t size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		int64_t lastWriteTime = ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+			data.ftLastWriteTime.dwLowDateTime;
+		uint32_t attributes = data.dwFileAttributes;
+		uint64_t volume = data.dwVolumeSerialNumber;
+		uint64_t fileId = ((uint64_t)data.nFileIndexHigh << 32) | data.nFileIndexLow;
+#else
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0)
+		{
+			worker.errors++;
+			return;
+		}
+
+		uint64_t size = (uint64_t)st.st_size;
+		int64_t lastWriteTime = LastWriteTimeFromStat(st);
+		uint32_t attributes = AttributesFromStat(st, name);
+		uint64_t volume = (uint64_t)st.st_dev;
+		uint64_t fileId = (uint64_t)st.st_ino;
+#endif
+
+		worker.files++;
+		worker.bytes += size;
+		worker.batch.Add(directory, name, nameLength, keyOffset, attributes, 0, size, lastWriteTime, volume, fileId);
+		FlushBatch(worker, false);
+	}
+
+	void CTreeScanner::EmitSkipped(Worker& worker, const PathString& path, uint32_t keyOffset,
+		uint32_t attributes, uint32_t flags, BsStatus status)
+	{
+		size_t nameOffset = NameOffset(path);
+		PathString directory = path.substr(0, nameOffset);
+
+		worker.skipped++;
+		worker.batch.Add(directory, path.c_str() + nameOffset, path.size() - nameOffset,
+			std::min(keyOffset, (uint32_t)nameOffset), attributes, flags, 0, 0);
+		worker.batch.m_entries.back().status = status;
+		FlushBatch(worker, false);
+	}
+
+	void CTreeScanner::FlushBatch(Worker& worker, bool force)
+	{
+		if (worker.batch.Count() == 0)
+			return;
+
+		if (!force && worker.batch.Count() < m_options.batchSize)
+			return;
+
+		{
+			std::lock_guard<std::mutex> guard(m_sinkLock);
+			if (m_sink)
+				m_sink(worker.batch);
+		}
+
+		worker.batch.Clear();
+	}
+
+	bool CTreeScanner::IsRestricted(const PathString& path) const
+	{
+		for (const PathString& restricted : m_options.restrictedDirs)
+		{
+			if (PathEquals(restricted, path))
+				return true;
+		}
+
+		return false;
+	}
+}
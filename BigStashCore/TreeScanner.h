@@ -0,0 +1,152 @@
+// TreeScanner.h : Declaration of CTreeScanner
+
+#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace BigStash
+{
+	// A scanned file. The strings live in the owning CScanBatch.
+	struct ScanEntry
+	{
+		uint32_t pathOffset;
+		uint32_t pathLength;
+		uint32_t nameOffset;      // relative to the start of the path
+		uint32_t keyOffset;       // relative to the start of the path
+		uint32_t attributes;      // BS_FILE_ATTRIBUTE_*
+		uint32_t flags;           // BS_SCAN_*
+		BsStatus status;          // BS_OK but for BS_SCAN_SKIPPED_INACCESSIBLE
+		uint64_t size;
+		int64_t lastWriteTime;    // FILETIME ticks, UTC
+
+		// Identity of the file: volume serial number and file ID on Windows,
+		// st_dev and st_ino elsewhere; 0 for skipped entries.
+		uint64_t volume;
+		uint64_t fileId;
+	};
+
+	// A batch of scanned files with their paths packed in one buffer.
+	class CScanBatch
+	{
+	public:
+		void Clear()
+		{
+			m_entries.clear();
+			m_strings.clear();
+		}
+
+		size_t Count() const { return m_entries.size(); }
+
+		const PathChar* Path(const ScanEntry& entry) const
+		{
+			return m_strings.data() + entry.pathOffset;
+		}
+
+		// Appends an entry whose path is directory + separator + name.
+		void Add(const PathString& directory, const PathChar* name, size_t nameLength,
+			uint32_t keyOffset, uint32_t attributes, uint32_t flags, uint64_t size, int64_t lastWriteTime,
+			uint64_t volume = 0, uint64_t fileId = 0);
+
+		std::vector<ScanEntry> m_entries;
+		std::vector<PathChar> m_strings;
+	};
+
+	struct ScanOptions
+	{
+		ScanOptions() : threadCount(0), batchSize(4096) {}
+
+		// Number of workers, 0 picks the processor count.
+		unsigned threadCount;
+
+		// Number of files handed to the sink at once.
+		size_t batchSize;
+
+		// Directories not to descend into (compared case-insensitively on Windows).
+		std::vector<PathString> restrictedDirs;
+	};
+
+	// Receives full batches. Calls are serialized by the scanner.
+	typedef std::function<void(const CScanBatch&)> ScanSink;
+
+	// CTreeScanner
+	//
+	// Multi-threaded, work-stealing directory tree scanner. Every worker owns a
+	// deque of directories; it pushes the subdirectories it finds and pops
+	// them LIFO, idle workers steal the oldest (and usually largest) subtree
+	// from the front of another worker's deque. Reparse points (junctions and
+	// symlinks) are never followed. Sizes, timestamps, attributes and file IDs
+	// come from the enumeration itself (FileIdBothDirectoryInfo on Windows,
+	// getdents64 plus a dirfd-relative fstatat on Linux) instead of per-path
+	// stat calls.
+	class CTreeScanner
+	{
+	public:
+		CTreeScanner(const ScanOptions& options, ScanSink sink);
+		~CTreeScanner();
+
+		// Scans the given roots. A root may be a file or a directory; roots that
+		// are nested in other roots are dropped so every file is seen once and
+		// keeps the key name of the outermost selection. A root that cannot be
+		// read is an inaccessible skipped entry, not a failed scan.
+		BsStatus Run(const std::vector<PathString>& roots);
+
+		// Requests cancellation; Run returns BS_E_CANCELLED.
+		void Cancel() { m_cancel.store(true); }
+
+		const BsScanStats& Stats() const { return m_stats; }
+
+	protected:
+
+		struct DirTask
+		{
+			PathString path;
+			uint32_t keyOffset;
+		};
+
+		struct Worker
+		{
+			std::mutex lock;
+			std::deque<DirTask> tasks;
+			CScanBatch batch;
+			std::vector<char> buffer;
+			uint64_t files;
+			uint64_t directories;
+			uint64_t bytes;
+			uint64_t skipped;
+			uint64_t errors;
+			uint64_t steals;
+		};
+
+		void WorkerLoop(unsigned index);
+		bool PopTask(unsigned index, DirTask& task);
+		void PushTask(unsigned index, DirTask&& task);
+		void ScanDirectory(Worker& worker, unsigned index, const DirTask& task);
+		void ScanRootFile(Worker& worker, const PathString& path, uint32_t keyOffset);
+		void EmitSkipped(Worker& worker, const PathString& path, uint32_t keyOffset, uint32_t attributes, uint32_t flags,
+			BsStatus status = BS_OK);
+		void FlushBatch(Worker& worker, bool force);
+		bool IsRestricted(const PathString& path) const;
+
+		ScanOptions m_options;
+		ScanSink m_sink;
+		std::mutex m_sinkLock;
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		std::atomic<int64_t> m_pending;
+		std::atomic<bool> m_cancel;
+		BsScanStats m_stats;
+	};
+
+	// Sorts the roots and removes the ones nested inside another root.
+	std::vector<PathString> NormalizeRoots(const std::vector<PathString>& roots);
+
+	// Returns the key offset for a selected root: the position right after the
+	// separator that ends the root's parent directory.
+	uint32_t RootKeyOffset(const PathString& root);
+}
@@ -0,0 +1,507 @@
+// UploadScheduler.cpp : Implementation of CUploadScheduler
+
+#include "UploadScheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace BigStash
+{
+	namespace
+	{
+		// Rounds the delivery rate maximum and the minimum request time are
+		// taken over, about ten round trips as in BBR.
+		const size_t RATE_WINDOW_ROUNDS = 10;
+		const uint64_t RTT_WINDOW_ROUNDS = 10;
+
+		// Startup ends after this many rounds without 25% more throughput.
+		const unsigned STARTUP_STALLED_ROUNDS = 3;
+		const double STARTUP_GROWTH = 1.25;
+
+		// A round that delivers this much more than the windowed maximum is
+		// not congested, whatever its request times.
+		const double RATE_GROWTH = 1.10;
+
+		// The limit never exceeds this multiple of the bandwidth-delay
+		// product, plus one request.
+		const double BDP_GAIN = 2.0;
+
+		const size_t DECISION_HISTORY = 256;
+
+		// How long Acquire sleeps at most between looks at cancel.
+		const double ACQUIRE_POLL_SECONDS = 0.05;
+
+		unsigned Clamp(unsigned value, unsigned low, unsigned high)
+		{
+			return std::max(low, std::min(value, high));
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CTokenBucket methods
+
+	CTokenBucket::CTokenBucket(uint64_t rate, uint64_t burst)
+		: m_rate(0), m_burst(0), m_tokens(0), m_updated(0)
+	{
+		SetRate(rate, burst, 0);
+	}
+
+	void CTokenBucket::SetRate(uint64_t rate, uint64_t burst, double now)
+	{
+		Refill(now);
+		m_rate = rate;
+		m_burst = burst != 0 ? (double)burst : rate / 4.0;
+		m_tokens = std::min(m_tokens, m_burst);
+		m_updated = now;
+	}
+
+	void CTokenBucket::Refill(double now)
+	{
+		if (m_rate != 0 && now > m_updated)
+			m_tokens = std::min(m_burst, m_tokens + (now - m_updated) * m_rate);
+		m_updated = std::max(m_updated, now);
+	}
+
+	double CTokenBucket::Delay(double now)
+	{
+		if (m_rate == 0)
+			return 0;
+
+		Refill(now);
+		return m_tokens >= 0 ? 0 : -m_tokens / m_rate;
+	}
+
+	void CTokenBucket::Consume(uint64_t bytes, double now)
+	{
+		if (m_rate == 0)
+			return;
+
+		Refill(now);
+		m_tokens -= (double)bytes;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CConcurrencyController methods
+
+	CConcurrencyController::CConcurrencyController(const SchedulerOptions& options)
+		: m_options(options), m_limit(0), m_startup(true), m_stalledRounds(0), m_startupRate(0),
+		m_probing(false), m_probeRestore(0), m_probeStart(0),
+		m_roundStart(-1), m_roundRequests(0), m_roundFailures(0), m_roundBytes(0), m_roundSeconds(0), m_roundMinRtt(0),
+		m_minRtt(0), m_minRttRound(0), m_meanBytes(0),
+		m_requests(0), m_failures(0), m_bytes(0), m_requestSeconds(0), m_rounds(0), m_increases(0), m_decreases(0),
+		m_lastDecision(SCHEDULER_HOLD)
+	{
+		m_options.minConcurrency = std::max(1u, m_options.minConcurrency);
+		m_options.maxConcurrency = std::max(m_options.minConcurrency, m_options.maxConcurrency);
+		m_limit = Clamp(m_options.initialConcurrency, m_options.minConcurrency, m_options.maxConcurrency);
+	}
+
+	void CConcurrencyController::SetBounds(unsigned minConcurrency, unsigned maxConcurrency)
+	{
+		m_options.minConcurrency = std::max(1u, minConcurrency);
+		m_options.maxConcurrency = std::max(m_options.minConcurrency, maxConcurrency);
+		m_limit = Clamp(m_limit, m_options.minConcurrency, m_options.maxConcurrency);
+		m_probeRestore = Clamp(m_probeRestore, m_options.minConcurrency, m_options.maxConcurrency);
+	}
+
+	void CConcurrencyController::StartRound(double now)
+	{
+		m_roundStart = now;
+		m_roundRequests = 0;
+		m_roundFailures = 0;
+		m_roundBytes = 0;
+		m_roundSeconds = 0;
+		m_roundMinRtt = 0;
+	}
+
+	//
+	//   FUNCTION: CConcurrencyController::OnComplete(double, uint64_t, double, bool)
+	//
+	//   PURPOSE: Adds one finished request to the round. A round closes
+	//            after as many requests as the limit; during ProbeRTT only
+	//            the requests sent after the probe began count, as the
+	//            earlier ones queued behind the old limit.
+	//
+	bool CConcurrencyController::OnComplete(double now, uint64_t bytes, double seconds, bool succeeded)
+	{
+		m_requests++;
+		if (m_roundStart < 0)
+			StartRound(now - seconds);
+
+		if (!succeeded)
+		{
+			m_failures++;
+			m_roundFailures++;
+			m_roundRequests++;
+		}
+		else
+		{
+			m_bytes += bytes;
+			m_requestSeconds += seconds;
+			m_roundBytes += bytes;
+			m_meanBytes = m_meanBytes == 0 ? (double)bytes : m_meanBytes * 0.875 + bytes * 0.125;
+
+			if (!m_probing || now - seconds >= m_probeStart)
+			{
+				m_roundRequests++;
+				m_roundSeconds += seconds;
+				if (m_roundMinRtt == 0 || seconds < m_roundMinRtt)
+					m_roundMinRtt = seconds;
+			}
+		}
+
+		if (m_roundRequests < std::max(1u, m_limit))
+			return false;
+
+		EndRound(now);
+		return true;
+	}
+
+	double CConcurrencyController::MaxRate() const
+	{
+		double rate = 0;
+		for (double sample : m_rates)
+			rate = std::max(rate, sample);
+		return rate;
+	}
+
+	void CConcurrencyController::Decide(double now, SchedulerDecision decision, unsigned limit, double rate,
+		double meanRtt)
+	{
+		limit = Clamp(limit, m_options.minConcurrency, m_options.maxConcurrency);
+		if (decision != SCHEDULER_PROBE_RTT && decision != SCHEDULER_PROBE_RTT_DONE)
+		{
+			if (limit > m_limit)
+				m_increases++;
+			else if (limit < m_limit)
+				m_decreases++;
+			else
+				decision = SCHEDULER_HOLD;
+		}
+
+		SchedulerDecisionRecord record;
+		record.time = now;
+		record.decision = decision;
+		record.oldLimit = m_limit;
+		record.newLimit = limit;
+		record.deliveryRate = rate;
+		record.meanRtt = meanRtt;
+		record.minRtt = m_minRtt;
+
+		if (m_decisions.size() == DECISION_HISTORY)
+			m_decisions.pop_front();
+		m_decisions.push_back(record);
+
+		m_lastDecision = decision;
+		m_limit = limit;
+	}
+
+	//
+	//   FUNCTION: CConcurrencyController::EndRound(double)
+	//
+	//   PURPOSE: Moves the limit on the round's signals, strongest first:
+	//            failures (multiplicative decrease), request times inflated
+	//            past the tolerance while the delivery rate stays put
+	//            (decrease in proportion), then growth (doubling in
+	//            startup, one more slot after it). Twice the
+	//            bandwidth-delay product caps the result.
+	//
+	void CConcurrencyController::EndRound(double now)
+	{
+		m_rounds++;
+		double elapsed = now - m_roundStart;
+		double rate = elapsed > 0 ? m_roundBytes / elapsed : 0;
+		unsigned succeeded = m_roundRequests - m_roundFailures;
+		double meanRtt = succeeded != 0 ? m_roundSeconds / succeeded : 0;
+		double previousMaxRate = MaxRate();
+
+		if (succeeded != 0)
+		{
+			if (m_rates.size() == RATE_WINDOW_ROUNDS)
+				m_rates.pop_front();
+			m_rates.push_back(rate);
+		}
+
+		if (m_probing)
+		{
+			m_probing = false;
+			if (m_roundMinRtt > 0)
+			{
+				m_minRtt = m_roundMinRtt;
+				m_minRttRound = m_rounds;
+			}
+			Decide(now, SCHEDULER_PROBE_RTT_DONE, m_probeRestore, rate, meanRtt);
+			StartRound(now);
+			return;
+		}
+
+		if (m_roundMinRtt > 0 && (m_minRtt == 0 || m_roundMinRtt <= m_minRtt))
+		{
+			m_minRtt = m_roundMinRtt;
+			m_minRttRound = m_rounds;
+		}
+
+		double threshold = m_minRtt * (1 + m_options.latencyTolerance);
+		unsigned limit = m_limit;
+		SchedulerDecision decision = SCHEDULER_HOLD;
+
+		if (m_roundFailures != 0)
+		{
+			m_startup = false;
+			decision = SCHEDULER_DECREASE_FAILURE;
+			limit = (unsigned)(m_limit * m_options.decreaseFactor);
+		}
+		else if (succeeded == 0)
+		{
+			decision = SCHEDULER_HOLD;
+		}
+		else if (meanRtt > threshold && rate < previousMaxRate * RATE_GROWTH)
+		{
+			// as many requests as keep the round trip at the threshold, at
+			// most half of them fewer.
+			m_startup = false;
+			decision = SCHEDULER_DECREASE_LATENCY;
+			limit = (unsigned)(m_limit * threshold / meanRtt);
+			limit = std::max(limit, m_limit / 2);
+			limit = std::min(limit, m_limit - 1);
+		}
+		else if (m_startup)
+		{
+			if (rate >= m_startupRate * STARTUP_GROWTH)
+			{
+				m_startupRate = rate;
+				m_stalledRounds = 0;
+			}
+			else if (++m_stalledRounds >= STARTUP_STALLED_ROUNDS)
+				m_startup = false;
+
+			if (m_startup)
+			{
+				decision = SCHEDULER_STARTUP_GROW;
+				limit = m_limit * 2;
+			}
+		}
+		else
+		{
+			decision = SCHEDULER_INCREASE;
+			limit = m_limit + 1;
+		}
+
+		double maxRate = MaxRate();
+		if (!m_startup && m_minRtt > 0 && maxRate > 0 && m_meanBytes > 0)
+		{
+			unsigned cap = (unsigned)std::ceil(BDP_GAIN * maxRate * m_minRtt / m_meanBytes) + 1;
+			if (limit > cap)
+			{
+				limit = cap;
+				if (limit < m_limit)
+					decision = SCHEDULER_DECREASE_BDP;
+			}
+		}
+
+		Decide(now, decision, limit, rate, meanRtt);
+
+		// the minimum went stale: measure it again at the lowest limit.
+		if (!m_startup && m_rounds - m_minRttRound >= RTT_WINDOW_ROUNDS && m_limit > m_options.minConcurrency)
+		{
+			m_probing = true;
+			m_probeRestore = m_limit;
+			m_probeStart = now;
+			Decide(now, SCHEDULER_PROBE_RTT, m_options.minConcurrency, rate, meanRtt);
+		}
+
+		StartRound(now);
+	}
+
+	void CConcurrencyController::FillStats(SchedulerStats& stats) const
+	{
+		stats.limit = m_limit;
+		stats.startup = m_startup;
+		stats.requests = m_requests;
+		stats.failures = m_failures;
+		stats.bytes = m_bytes;
+		stats.requestSeconds = m_requestSeconds;
+		stats.maxDeliveryRate = MaxRate();
+		stats.minRtt = m_minRtt;
+		stats.bdpRequests = m_meanBytes > 0 ? stats.maxDeliveryRate * m_minRtt / m_meanBytes : 0;
+		stats.rounds = m_rounds;
+		stats.increases = m_increases;
+		stats.decreases = m_decreases;
+		stats.lastDecision = m_lastDecision;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CUploadScheduler methods
+
+	CUploadScheduler::CUploadScheduler(const SchedulerOptions& options)
+		: m_options(options), m_controller(options), m_bucket(options.bandwidthLimit), m_nextUpload(1),
+		m_inFlight(0), m_waiting(0), m_slotWaitSeconds(0), m_throttleSeconds(0),
+		m_epoch(std::chrono::steady_clock::now())
+	{
+	}
+
+	CUploadScheduler& CUploadScheduler::Process()
+	{
+		static CUploadScheduler scheduler;
+		return scheduler;
+	}
+
+	double CUploadScheduler::Now() const
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_epoch).count();
+	}
+
+	void CUploadScheduler::Configure(const SchedulerOptions& options)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		double now = Now();
+
+		m_options = options;
+		m_controller.SetBounds(options.minConcurrency, options.maxConcurrency);
+		m_bucket.SetRate(options.bandwidthLimit, 0, now);
+		m_released.notify_all();
+	}
+
+	uint32_t CUploadScheduler::RegisterUpload(uint64_t bandwidthLimit)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		uint32_t upload = m_nextUpload++;
+		CTokenBucket& bucket = m_uploads[upload];
+		bucket.SetRate(bandwidthLimit != 0 ? bandwidthLimit : m_options.uploadBandwidthLimit, 0, Now());
+		return upload;
+	}
+
+	void CUploadScheduler::UnregisterUpload(uint32_t upload)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_uploads.erase(upload);
+	}
+
+	// Called with the lock held.
+	bool CUploadScheduler::CanStart(uint32_t upload, double now, double& delay)
+	{
+		delay = m_bucket.Delay(now);
+		auto found = m_uploads.find(upload);
+		if (found != m_uploads.end())
+			delay = std::max(delay, found->second.Delay(now));
+
+		return delay == 0 && m_inFlight < m_controller.Limit();
+	}
+
+	// Called with the lock held.
+	void CUploadScheduler::Start(uint32_t upload, uint64_t bytes, double now, SchedulerTicket& ticket)
+	{
+		m_bucket.Consume(bytes, now);
+		auto found = m_uploads.find(upload);
+		if (found != m_uploads.end())
+			found->second.Consume(bytes, now);
+
+		m_inFlight++;
+		ticket.upload = upload;
+		ticket.bytes = bytes;
+		ticket.start = now;
+	}
+
+	bool CUploadScheduler::TryAcquire(uint32_t upload, uint64_t bytes, SchedulerTicket& ticket)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		double now = Now();
+		double delay;
+		if (!CanStart(upload, now, delay))
+			return false;
+
+		Start(upload, bytes, now, ticket);
+		return true;
+	}
+
+	//
+	//   FUNCTION: CUploadScheduler::Acquire(...)
+	//
+	//   PURPOSE: Waits for a free slot and for both buckets to be out of
+	//            debt. Sleeps until the debt is paid or a slot is
+	//            released, and at most ACQUIRE_POLL_SECONDS, for cancel.
+	//
+	BsStatus CUploadScheduler::Acquire(uint32_t upload, uint64_t bytes, SchedulerTicket& ticket,
+		const std::atomic<bool>* cancel)
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		double begin = Now();
+		m_waiting++;
+
+		for (;;)
+		{
+			if (cancel != NULL && cancel->load())
+			{
+				m_waiting--;
+				return BS_E_CANCELLED;
+			}
+
+			double now = Now();
+			double delay;
+			if (CanStart(upload, now, delay))
+			{
+				Start(upload, bytes, now, ticket);
+				break;
+			}
+
+			if (delay > 0)
+				m_throttleSeconds += std::min(delay, ACQUIRE_POLL_SECONDS);
+			double wait = delay > 0 ? std::min(delay, ACQUIRE_POLL_SECONDS) : ACQUIRE_POLL_SECONDS;
+			m_released.wait_for(guard, std::chrono::duration<double>(wait));
+		}
+
+		m_waiting--;
+		m_slotWaitSeconds += ticket.start - begin;
+		return BS_OK;
+	}
+
+	double CUploadScheduler::ThrottleDelay(uint32_t upload)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		double delay;
+		CanStart(upload, Now(), delay);
+		return delay;
+	}
+
+	void CUploadScheduler::Release(const SchedulerTicket& ticket, bool succeeded)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		double now = Now();
+
+		if (m_inFlight > 0)
+			m_inFlight--;
+		m_controller.OnComplete(now, ticket.bytes, now - ticket.start, succeeded);
+		m_released.notify_all();
+	}
+
+	void CUploadScheduler::Abandon(const SchedulerTicket& ticket)
+	{
+		(void)ticket;
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		if (m_inFlight > 0)
+			m_inFlight--;
+		m_released.notify_all();
+	}
+
+	SchedulerStats CUploadScheduler::Stats() const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		SchedulerStats stats;
+		m_controller.FillStats(stats);
+		stats.inFlight = m_inFlight;
+		stats.waiting = m_waiting;
+		stats.uploads = (unsigned)m_uploads.size();
+		stats.slotWaitSeconds = m_slotWaitSeconds;
+		stats.throttleSeconds = m_throttleSeconds;
+		return stats;
+	}
+
+	std::vector<SchedulerDecisionRecord> CUploadScheduler::Decisions() const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		const std::deque<SchedulerDecisionRecord>& decisions = m_controller.Decisions();
+		return std::vector<SchedulerDecisionRecord>(decisions.begin(), decisions.end());
+	}
+}
@@ -0,0 +1,291 @@
+// UploadScheduler.h : Declaration of CUploadScheduler, the process-wide owner
+// of the upload slots
+
+#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace BigStash
+{
+	// CTokenBucket
+	//
+	// A bandwidth cap. Tokens (bytes) accrue at rate up to burst; Consume
+	// takes a whole request at once and may leave the bucket in debt, so a
+	// part larger than the burst still goes through and the next one waits
+	// for the debt to be paid. The rate holds on average, at the
+	// granularity of a part. Not thread safe; CUploadScheduler locks around
+	// it.
+	class CTokenBucket
+	{
+	public:
+		// rate 0 is no cap. burst 0 allows a quarter second of the rate.
+		explicit CTokenBucket(uint64_t rate = 0, uint64_t burst = 0);
+
+		void SetRate(uint64_t rate, uint64_t burst, double now);
+		uint64_t Rate() const { return m_rate; }
+
+		// Seconds until the bucket is out of debt; 0 when a request can go.
+		double Delay(double now);
+		void Consume(uint64_t bytes, double now);
+
+	private:
+		void Refill(double now);
+
+		uint64_t m_rate;
+		double m_burst;
+		double m_tokens;
+		double m_updated;
+	};
+
+	enum SchedulerDecision
+	{
+		SCHEDULER_HOLD,
+
+		// Startup: the limit doubles every round while the delivery rate
+		// grows and the round trip does not.
+		SCHEDULER_STARTUP_GROW,
+
+		// Additive increase, one slot per round without a congestion signal.
+		SCHEDULER_INCREASE,
+
+		// The round trip grew past the tolerance without the delivery rate
+		// following: requests queue on the link. The limit shrinks in
+		// proportion to the inflation.
+		SCHEDULER_DECREASE_LATENCY,
+
+		// A request failed or timed out: multiplicative decrease.
+		SCHEDULER_DECREASE_FAILURE,
+
+		// More requests than twice the bandwidth-delay product allow.
+		SCHEDULER_DECREASE_BDP,
+
+		// The minimum request time is stale: one round at the minimum
+		// concurrency measures it again, then the limit is restored.
+		SCHEDULER_PROBE_RTT,
+		SCHEDULER_PROBE_RTT_DONE
+	};
+
+	struct SchedulerOptions
+	{
+		SchedulerOptions()
+			: minConcurrency(1), maxConcurrency(64), initialConcurrency(4), latencyTolerance(1.5),
+			decreaseFactor(0.7), bandwidthLimit(0), uploadBandwidthLimit(0)
+		{
+		}
+
+		unsigned minConcurrency;
+		unsigned maxConcurrency;
+		unsigned initialConcurrency;
+
+		// How much the mean request time of a round may exceed the minimum
+		// (1.5 is two and a half times the minimum) before the limit backs off.
+		double latencyTolerance;
+
+		// Multiplicative decrease on failures.
+		double decreaseFactor;
+
+		// Bytes per second over every upload, 0 is no cap.
+		uint64_t bandwidthLimit;
+
+		// Default per upload cap for RegisterUpload, 0 is no cap.
+		uint64_t uploadBandwidthLimit;
+	};
+
+	struct SchedulerDecisionRecord
+	{
+		double time;              // seconds since the scheduler started
+		SchedulerDecision decision;
+		unsigned oldLimit;
+		unsigned newLimit;
+		double deliveryRate;      // bytes per second over the round
+		double meanRtt;           // mean request seconds over the round
+		double minRtt;            // the windowed minimum
+	};
+
+	struct SchedulerStats
+	{
+		unsigned limit;
+		unsigned inFlight;
+		unsigned waiting;
+		unsigned uploads;
+		bool startup;
+
+		uint64_t requests;
+		uint64_t failures;
+		uint64_t bytes;
+
+		// Total time of the requests that succeeded.
+		double requestSeconds;
+
+		// The windowed maximum delivery rate (bytes per second), the
+		// windowed minimum request time and their product in requests.
+		double maxDeliveryRate;
+		double minRtt;
+		double bdpRequests;
+
+		uint64_t rounds;
+		uint64_t increases;
+		uint64_t decreases;
+		SchedulerDecision lastDecision;
+
+		// Time requests spent waiting for a slot and for the bandwidth caps.
+		double slotWaitSeconds;
+		double throttleSeconds;
+	};
+
+	// CConcurrencyController
+	//
+	// The AIMD/BBR-style limit on requests in flight, fed with the bytes and
+	// the duration of every finished request. Completions are grouped in
+	// rounds of as many requests as the limit (about one round trip of the
+	// link); at the end of a round the controller compares the round's
+	// delivery rate with the windowed maximum and its mean request time
+	// with the windowed minimum, and moves the limit. Time is passed in, so
+	// a simulated link can drive it. Not thread safe.
+	class CConcurrencyController
+	{
+	public:
+		explicit CConcurrencyController(const SchedulerOptions& options);
+
+		unsigned Limit() const { return m_limit; }
+		void SetBounds(unsigned minConcurrency, unsigned maxConcurrency);
+
+		// Returns true when the sample closed a round.
+		bool OnComplete(double now, uint64_t bytes, double seconds, bool succeeded);
+
+		void FillStats(SchedulerStats& stats) const;
+		const std::deque<SchedulerDecisionRecord>& Decisions() const { return m_decisions; }
+
+	private:
+		void StartRound(double now);
+		void EndRound(double now);
+		void Decide(double now, SchedulerDecision decision, unsigned limit, double rate, double meanRtt);
+		double MaxRate() const;
+
+		SchedulerOptions m_options;
+		unsigned m_limit;
+		bool m_startup;
+		unsigned m_stalledRounds;
+		double m_startupRate;
+
+		// ProbeRTT: the limit to go back to, and when the probe began.
+		bool m_probing;
+		unsigned m_probeRestore;
+		double m_probeStart;
+
+		// the round in progress.
+		double m_roundStart;
+		unsigned m_roundRequests;
+		unsigned m_roundFailures;
+		uint64_t m_roundBytes;
+		double m_roundSeconds;
+		double m_roundMinRtt;
+
+		// the delivery rates of the recent rounds, and the minimum request
+		// time with the round it was seen in.
+		std::deque<double> m_rates;
+		double m_minRtt;
+		uint64_t m_minRttRound;
+		double m_meanBytes;
+
+		uint64_t m_requests;
+		uint64_t m_failures;
+		uint64_t m_bytes;
+		double m_requestSeconds;
+		uint64_t m_rounds;
+		uint64_t m_increases;
+		uint64_t m_decreases;
+		SchedulerDecision m_lastDecision;
+		std::deque<SchedulerDecisionRecord> m_decisions;
+	};
+
+	// A slot held by one request.
+	struct SchedulerTicket
+	{
+		SchedulerTicket() : upload(0), bytes(0), start(0) {}
+
+		uint32_t upload;
+		uint64_t bytes;
+		double start;
+	};
+
+	// CUploadScheduler
+	//
+	// Owns every upload slot of the process. Each upload (a file's parts)
+	// registers and takes a slot per request; the total in flight across
+	// uploads follows the controller's limit, and the global and per upload
+	// token buckets cap the bandwidth. Slots are released with the outcome
+	// of the request, which is what moves the limit. Process() is the
+	// instance the C API and CS3Client share; separate instances are for
+	// benchmarks.
+	class CUploadScheduler
+	{
+	public:
+		explicit CUploadScheduler(const SchedulerOptions& options = SchedulerOptions());
+
+		static CUploadScheduler& Process();
+
+		// Changes the bounds and the caps; the limit is kept within them.
+		void Configure(const SchedulerOptions& options);
+
+		// rate 0 takes the default per upload cap.
+		uint32_t RegisterUpload(uint64_t bandwidthLimit = 0);
+		void UnregisterUpload(uint32_t upload);
+
+		// Takes a slot for a request of bytes when one is free and neither
+		// bucket is in debt.
+		bool TryAcquire(uint32_t upload, uint64_t bytes, SchedulerTicket& ticket);
+
+		// Waits for a slot. BS_E_CANCELLED when cancel becomes true.
+		BsStatus Acquire(uint32_t upload, uint64_t bytes, SchedulerTicket& ticket,
+			const std::atomic<bool>* cancel = NULL);
+
+		// Seconds until TryAcquire may succeed for the upload, as far as the
+		// buckets are concerned; slots free up on Release.
+		double ThrottleDelay(uint32_t upload);
+
+		// Gives the slot back; the request's time is measured from the
+		// acquire. Call it for every acquire, failures included, but the
+		// ones Abandon takes.
+		void Release(const SchedulerTicket& ticket, bool succeeded);
+
+		// Gives the slot back for a request the caller gave up on, such as
+		// the loser of a hedge. Its outcome says nothing about the link, so
+		// the controller does not see it.
+		void Abandon(const SchedulerTicket& ticket);
+
+		SchedulerStats Stats() const;
+
+		// The latest decisions, oldest first.
+		std::vector<SchedulerDecisionRecord> Decisions() const;
+
+	private:
+		CUploadScheduler(const CUploadScheduler&);
+		CUploadScheduler& operator=(const CUploadScheduler&);
+
+		double Now() const;
+		bool CanStart(uint32_t upload, double now, double& delay);
+		void Start(uint32_t upload, uint64_t bytes, double now, SchedulerTicket& ticket);
+
+		mutable std::mutex m_lock;
+		std::condition_variable m_released;
+		SchedulerOptions m_options;
+		CConcurrencyController m_controller;
+		CTokenBucket m_bucket;
+		std::map<uint32_t, CTokenBucket> m_uploads;
+		uint32_t m_nextUpload;
+		unsigned m_inFlight;
+		unsigned m_waiting;
+		double m_slotWaitSeconds;
+		double m_throttleSeconds;
+		const std::chrono::steady_clock::time_point m_epoch;
+	};
+}
@@ -0,0 +1,1156 @@
+// UploadStore.cpp : Implementation of CUploadStore
+
+#include "UploadStore.h"
+#include "Crc32.h"
+#include "Encoding.h"
+#include "Json.h"
+#include "Md5.h"
+#include "Utf.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
+
+namespace BigStash
+{
+	// Two of these start the file, one in each 64-byte slot; the one with
+	// the higher generation that checks out is current.
+	struct CUploadStore::Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t uploadCount;
+		uint64_t generation;
+
+		// Everything past fileLength is an append no Commit got to.
+		uint64_t fileLength;
+		uint64_t indexOffset;
+		uint64_t indexLength;
+		uint64_t liveBytes;
+		uint32_t indexChecksum;
+		uint32_t checksum;        // CRC-32 of the fields above
+	};
+
+	// A read-only view of the store file, shared by the store and the
+	// tables opened on it.
+	struct CUploadTable::Mapping
+	{
+		Mapping()
+			:
+#ifdef _WIN32
+			handle(NULL),
+#endif
+			view(NULL), length(0)
+		{
+		}
+
+		~Mapping()
+		{
+#ifdef _WIN32
+			if (view != NULL)
+				UnmapViewOfFile(view);
+			if (handle != NULL)
+				CloseHandle(handle);
+#else
+			if (view != NULL)
+				munmap((void*)view, length);
+#endif
+		}
+
+#ifdef _WIN32
+		HANDLE handle;
+#endif
+		const uint8_t* view;
+		size_t length;
+	};
+
+	/////////////////////////////////////////////////////////////////////////////
+	// Some helper methods
+	//
+
+	namespace
+	{
+		const char STORE_MAGIC[8] = { 'B', 'S', 'U', 'P', 'L', 'D', 'S', 'T' };
+		const uint32_t STORE_VERSION = 1;
+		const uint32_t TABLE_MAGIC = 0x54555342;    // "BSUT"
+
+		// The header slots come first, the tables and indexes follow.
+		const uint64_t HEADER_SLOTS = 2;
+		const uint64_t DATA_OFFSET = HEADER_SLOTS * 64;
+
+		// Rows between the points a table can be decoded from. Between two,
+		// string columns share their prefix with the row before.
+		const uint64_t RESTART_INTERVAL = 32;
+
+		// Index records are stored as they are, the strings they refer to
+		// follow them.
+		struct IndexRecord
+		{
+			uint64_t tableOffset;
+			uint64_t tableLength;
+			uint64_t fileCount;
+			uint64_t totalSize;
+			uint64_t uploadedFiles;
+			uint64_t uploadedBytes;
+			uint64_t progress;
+			uint32_t tableChecksum;
+			uint32_t packCount;
+			uint32_t flags;
+			uint32_t name;
+			uint32_t nameLength;
+			uint32_t url;
+			uint32_t urlLength;
+			uint32_t status;
+			uint32_t statusLength;
+			uint32_t reserved;
+		};
+
+		static_assert(sizeof(IndexRecord) == 96, "index records are packed");
+
+		const uint32_t UPLOAD_USER_PAUSED = 0x1;
+		const uint32_t UPLOAD_MANIFEST_UPLOADED = 0x2;
+
+		// A table starts with this, its restart offsets (from the first
+		// row) follow, then the rows and the packs.
+		struct TableHeader
+		{
+			uint32_t magic;
+			uint32_t restartCount;
+			uint64_t fileCount;
+			uint64_t rowsLength;
+			uint64_t packsLength;
+		};
+
+		static_assert(sizeof(TableHeader) == 32, "table headers are packed");
+
+		// Row flags.
+		const uint64_t ROW_UPLOADED = 0x1;
+		const uint64_t ROW_PACK_OFFSET = 0x2;
+
+		// The MD5 is lowercase hex and stored as its 16 bytes.
+		const uint64_t ROW_BINARY_MD5 = 0x4;
+		const uint64_t ROW_STORED_SIZE = 0x8;
+
+		PathString AppendSuffix(const PathString& path, const char* suffix)
+		{
+			PathString result(path);
+			for (; *suffix != 0; ++suffix)
+				result += (PathChar)*suffix;
+			return result;
+		}
+
+		bool IsLowerHexMd5(const std::string& text)
+		{
+			if (text.size() != 2 * MD5_DIGEST_SIZE)
+				return false;
+
+			for (char c : text)
+			{
+				if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+					return false;
+			}
+			return true;
+		}
+
+		uint8_t HexDigit(char c)
+		{
+			return (uint8_t)(c <= '9' ? c - '0' : c - 'a' + 10);
+		}
+
+		// The length of value, then its bytes past what it shares with
+		// previous (NULL at a restart).
+		void AppendColumn(std::vector<uint8_t>& data, const std::string& value, const std::string* previous)
+		{
+			size_t shared = 0;
+			if (previous != NULL)
+			{
+				size_t limit = std::min(value.size(), previous->size());
+				while (shared < limit && value[shared] == (*previous)[shared])
+					++shared;
+			}
+
+			AppendVarint(data, shared);
+			AppendVarint(data, value.size() - shared);
+			data.insert(data.end(), value.begin() + shared, value.end());
+		}
+
+		// value holds the previous row's column and receives this one's.
+		bool ReadColumn(const uint8_t*& data, const uint8_t* end, std::string& value)
+		{
+			uint64_t shared = 0;
+			uint64_t length = 0;
+			if (!ReadVarint(data, end, shared) || !ReadVarint(data, end, length) || shared > value.size() ||
+				length > (uint64_t)(end - data))
+				return false;
+
+			value.resize((size_t)shared);
+			value.append((const char*)data, (size_t)length);
+			data += length;
+			return true;
+		}
+
+		void AppendRow(std::vector<uint8_t>& data, const StoredFile& file, const StoredFile* previous)
+		{
+			bool binaryMd5 = IsLowerHexMd5(file.md5);
+			uint64_t flags = (file.uploaded ? ROW_UPLOADED : 0) | (file.hasPackOffset ? ROW_PACK_OFFSET : 0) |
+				(binaryMd5 ? ROW_BINARY_MD5 : 0) | (file.hasStoredSize ? ROW_STORED_SIZE : 0);
+
+			AppendVarint(data, flags);
+			AppendVarint(data, file.size);
+			AppendVarint(data, (uint64_t)file.lastModified);
+			AppendVarint(data, file.progress);
+			AppendVarint(data, file.partSize);
+			if (file.hasPackOffset)
+				AppendVarint(data, file.packOffset);
+			if (file.hasStoredSize)
+				AppendVarint(data, file.storedSize);
+
+			AppendColumn(data, file.fileName, previous != NULL ? &previous->fileName : NULL);
+			AppendColumn(data, file.keyName, previous != NULL ? &previous->keyName : NULL);
+			AppendColumn(data, file.filePath, previous != NULL ? &previous->filePath : NULL);
+			if (binaryMd5)
+			{
+				for (size_t i = 0; i < MD5_DIGEST_SIZE; ++i)
+					data.push_back((uint8_t)(HexDigit(file.md5[2 * i]) << 4 | HexDigit(file.md5[2 * i + 1])));
+			}
+			else
+				AppendColumn(data, file.md5, previous != NULL ? &previous->md5 : NULL);
+			AppendColumn(data, file.uploadId, previous != NULL ? &previous->uploadId : NULL);
+			AppendColumn(data, file.packKey, previous != NULL ? &previous->packKey : NULL);
+			AppendColumn(data, file.duplicateOf, previous != NULL ? &previous->duplicateOf : NULL);
+			AppendColumn(data, file.codec, previous != NULL ? &previous->codec : NULL);
+			AppendColumn(data, file.keyId, previous != NULL ? &previous->keyId : NULL);
+			AppendColumn(data, file.nonce, previous != NULL ? &previous->nonce : NULL);
+		}
+
+		// file holds the previous row, which the columns share prefixes with.
+		bool ReadRow(const uint8_t*& data, const uint8_t* end, StoredFile& file)
+		{
+			uint64_t flags = 0;
+			uint64_t lastModified = 0;
+			if (!ReadVarint(data, end, flags) || !ReadVarint(data, end, file.size) ||
+				!ReadVarint(data, end, lastModified) || !ReadVarint(data, end, file.progress) ||
+				!ReadVarint(data, end, file.partSize))
+				return false;
+
+			file.lastModified = (int64_t)lastModified;
+			file.uploaded = (flags & ROW_UPLOADED) != 0;
+			file.hasPackOffset = (flags & ROW_PACK_OFFSET) != 0;
+			file.packOffset = 0;
+			if (file.hasPackOffset && !ReadVarint(data, end, file.packOffset))
+				return false;
+			file.hasStoredSize = (flags & ROW_STORED_SIZE) != 0;
+			file.storedSize = 0;
+			if (file.hasStoredSize && !ReadVarint(data, end, file.storedSize))
+				return false;
+
+			if (!ReadColumn(data, end, file.fileName) || !ReadColumn(data, end, file.keyName) ||
+				!ReadColumn(data, end, file.filePath))
+				return false;
+			if ((flags & ROW_BINARY_MD5) != 0)
+			{
+				if ((size_t)(end - data) < MD5_DIGEST_SIZE)
+					return false;
+				file.md5 = HexEncode(data, MD5_DIGEST_SIZE);
+				data += MD5_DIGEST_SIZE;
+			}
+			else if (!ReadColumn(data, end, file.md5))
+				return false;
+
+			return ReadColumn(data, end, file.uploadId) && ReadColumn(data, end, file.packKey) &&
+				ReadColumn(data, end, file.duplicateOf) && ReadColumn(data, end, file.codec) &&
+				ReadColumn(data, end, file.keyId) && ReadColumn(data, end, file.nonce);
+		}
+
+		void EncodeTable(const StoredUpload& upload, std::vector<uint8_t>& data)
+		{
+			TableHeader header;
+			header.magic = TABLE_MAGIC;
+			header.fileCount = upload.files.size();
+			header.restartCount = (uint32_t)((header.fileCount + RESTART_INTERVAL - 1) / RESTART_INTERVAL);
+
+			size_t restarts = sizeof(TableHeader);
+			size_t rows = restarts + header.restartCount * sizeof(uint64_t);
+			data.assign(rows, 0);
+
+			for (size_t i = 0; i < upload.files.size(); ++i)
+			{
+				if (i % RESTART_INTERVAL == 0)
+				{
+					uint64_t offset = data.size() - rows;
+					memcpy(&data[restarts + i / RESTART_INTERVAL * sizeof(uint64_t)], &offset, sizeof(offset));
+				}
+				AppendRow(data, upload.files[i], i % RESTART_INTERVAL != 0 ? &upload.files[i - 1] : NULL);
+			}
+			header.rowsLength = data.size() - rows;
+
+			size_t packs = data.size();
+			AppendVarint(data, upload.packs.size());
+			for (const StoredPack& pack : upload.packs)
+			{
+				AppendColumn(data, pack.keyName, NULL);
+				AppendVarint(data, pack.size);
+				AppendColumn(data, pack.md5, NULL);
+				AppendVarint(data, pack.fileCount);
+			}
+			header.packsLength = data.size() - packs;
+
+			memcpy(&data[0], &header, sizeof(header));
+		}
+
+		UploadSummary Summarize(const StoredUpload& upload)
+		{
+			UploadSummary summary;
+			summary.name = upload.name;
+			summary.url = upload.url;
+			summary.status = upload.status;
+			summary.progress = upload.progress;
+			summary.userPaused = upload.userPaused;
+			summary.manifestUploaded = upload.manifestUploaded;
+			summary.fileCount = upload.files.size();
+			summary.packCount = upload.packs.size();
+
+			for (const StoredFile& file : upload.files)
+			{
+				summary.totalSize += file.size;
+				if (file.uploaded)
+				{
+					summary.uploadedFiles++;
+					summary.uploadedBytes += file.size;
+				}
+				else
+					summary.uploadedBytes += std::min(file.progress, file.size);
+			}
+			return summary;
+		}
+
+		void AppendHeapString(std::vector<uint8_t>& heap, const std::string& text, uint32_t& offset, uint32_t& length)
+		{
+			offset = (uint32_t)heap.size();
+			length = (uint32_t)text.size();
+			heap.insert(heap.end(), text.begin(), text.end());
+		}
+
+		bool ReadHeapString(const uint8_t* heap, uint64_t heapLength, uint32_t offset, uint32_t length,
+			std::string& text)
+		{
+			if (offset > heapLength || length > heapLength - offset)
+				return false;
+
+			text.assign((const char*)heap + offset, length);
+			return true;
+		}
+
+		BsStatus ReadWholeFile(const PathChar* path, std::vector<uint8_t>& data)
+		{
+			CFile file;
+			BsStatus status = file.Open(path);
+			uint64_t size = 0;
+			if (status == BS_OK)
+				status = file.GetSize(size);
+			if (status != BS_OK)
+				return status;
+			if (size > SIZE_MAX)
+				return BS_E_OUTOFMEMORY;
+
+			data.resize((size_t)size);
+			size_t read = 0;
+			status = file.ReadAt(0, data.data(), data.size(), read);
+			data.resize(read);
+			return status;
+		}
+
+		// Sizes and offsets; null reads as 0.
+		void ReadNumber(CJsonReader& reader, uint64_t& value)
+		{
+			int64_t number = 0;
+			reader.ReadInt64(number);
+			value = (uint64_t)number;
+		}
+
+		bool ReadFileInfo(CJsonReader& reader, StoredFile& file)
+		{
+			std::string member;
+			std::string text;
+			if (!reader.BeginObject())
+				return false;
+
+			while (reader.NextMember(member))
+			{
+				if (member == "file_name")
+					reader.ReadString(file.fileName);
+				else if (member == "key_name")
+					reader.ReadString(file.keyName);
+				else if (member == "file_path")
+					reader.ReadString(file.filePath);
+				else if (member == "size")
+					ReadNumber(reader, file.size);
+				else if (member == "last_modified")
+				{
+					if (reader.ReadString(text) && !text.empty() &&
+						!ParseJsonDate(text.data(), text.size(), file.lastModified))
+						return false;
+				}
+				else if (member == "md5")
+					reader.ReadString(file.md5);
+				else if (member == "uploaded")
+					reader.ReadBool(file.uploaded);
+				else if (member == "progress")
+					ReadNumber(reader, file.progress);
+				else if (member == "uploadid")
+					reader.ReadString(file.uploadId);
+				else if (member == "part_size")
+					ReadNumber(reader, file.partSize);
+				else if (member == "pack_key")
+					reader.ReadString(file.packKey);
+				else if (member == "pack_offset")
+				{
+					file.hasPackOffset = reader.Peek() != JSON_NULL;
+					ReadNumber(reader, file.packOffset);
+				}
+				else if (member == "duplicate_of")
+					reader.ReadString(file.duplicateOf);
+				else if (member == "codec")
+					reader.ReadString(file.codec);
+				else if (member == "stored_size")
+				{
+					file.hasStoredSize = reader.Peek() != JSON_NULL;
+					ReadNumber(reader, file.storedSize);
+				}
+				else if (member == "key_id")
+					reader.ReadString(file.keyId);
+				else if (member == "nonce")
+					reader.ReadString(file.nonce);
+				else
+					reader.Skip();
+			}
+			return !reader.Failed();
+		}
+
+		bool ReadPack(CJsonReader& reader, StoredPack& pack)
+		{
+			std::string member;
+			if (!reader.BeginObject())
+				return false;
+
+			while (reader.NextMember(member))
+			{
+				if (member == "key_name")
+					reader.ReadString(pack.keyName);
+				else if (member == "size")
+					ReadNumber(reader, pack.size);
+				else if (member == "md5")
+					reader.ReadString(pack.md5);
+				else if (member == "file_count")
+					ReadNumber(reader, pack.fileCount);
+				else
+					reader.Skip();
+			}
+			return !reader.Failed();
+		}
+
+		// The names of the files in directory that end in suffix, sorted.
+		BsStatus ListFiles(const PathString& directory, const PathString& suffix, std::vector<PathString>& names)
+		{
+#ifdef _WIN32
+			WIN32_FIND_DATAW data;
+			HANDLE find = FindFirstFileW((directory + L"\\*" + suffix).c_str(), &data);
+			if (find == INVALID_HANDLE_VALUE)
+			{
+				DWORD error = GetLastError();
+				return error == ERROR_FILE_NOT_FOUND ? BS_OK : StatusFromWin32(error);
+			}
+
+			do
+			{
+				// the pattern also matches longer extensions (*.djf finds
+				// *.djfx), so the suffix is checked again.
+				PathString name(data.cFileName);
+				if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0 && name.size() > suffix.size() &&
+					name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+					names.push_back(name);
+			}
+			while (FindNextFileW(find, &data));
+			FindClose(find);
+#else
+			DIR* dir = opendir(directory.c_str());
+			if (dir == NULL)
+				return StatusFromErrno(errno);
+
+			while (struct dirent* entry = readdir(dir))
+			{
+				PathString name(entry->d_name);
+				if (entry->d_type != DT_DIR && name.size() > suffix.size() &&
+					name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+					names.push_back(name);
+			}
+			closedir(dir);
+#endif
+			std::sort(names.begin(), names.end());
+			return BS_OK;
+		}
+
+		BsStatus UploadName(const PathString& fileName, size_t length, std::string& name)
+		{
+#ifdef _WIN32
+			name.clear();
+			return AppendUtf8(name, (const uint16_t*)fileName.data(), length);
+#else
+			name.assign(fileName, 0, length);
+			return BS_OK;
+#endif
+		}
+	}
+
+	bool StoredFile::operator==(const StoredFile& other) const
+	{
+		return fileName == other.fileName && keyName == other.keyName && filePath == other.filePath &&
+			size == other.size && lastModified == other.lastModified && progress == other.progress &&
+			md5 == other.md5 && uploaded == other.uploaded && uploadId == other.uploadId &&
+			partSize == other.partSize && packKey == other.packKey && hasPackOffset == other.hasPackOffset &&
+			packOffset == other.packOffset && duplicateOf == other.duplicateOf && codec == other.codec &&
+			hasStoredSize == other.hasStoredSize && storedSize == other.storedSize && keyId == other.keyId &&
+			nonce == other.nonce;
+	}
+
+	bool StoredPack::operator==(const StoredPack& other) const
+	{
+		return keyName == other.keyName && size == other.size && md5 == other.md5 && fileCount == other.fileCount;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CUploadTable methods
+	//
+
+	CUploadTable::CUploadTable()
+		: m_restarts(NULL), m_rows(NULL), m_rowsEnd(NULL), m_packs(NULL), m_packsEnd(NULL), m_count(0),
+		m_packCount(0)
+	{
+	}
+
+	BsStatus CUploadTable::Get(uint64_t index, StoredFile& file) const
+	{
+		std::vector<StoredFile> files;
+		BsStatus status = Read(index, 1, files);
+		if (status == BS_OK)
+			file = std::move(files[0]);
+		return status;
+	}
+
+	//
+	//   FUNCTION: CUploadTable::Read(uint64_t, uint64_t, std::vector<StoredFile>&)
+	//
+	//   PURPOSE: Decodes from the restart point at or before first, keeping
+	//            the rows from first on. The table's checksum was checked
+	//            when it was opened, so a row that does not decode is one of
+	//            another version.
+	//
+	BsStatus CUploadTable::Read(uint64_t first, uint64_t count, std::vector<StoredFile>& files) const
+	{
+		if (first > m_count || count > m_count - first)
+			return BS_E_INVALIDARG;
+		if (count == 0)
+			return BS_OK;
+
+		uint64_t restart = first / RESTART_INTERVAL;
+		uint64_t offset;
+		memcpy(&offset, m_restarts + restart * sizeof(uint64_t), sizeof(offset));
+		if (offset > (uint64_t)(m_rowsEnd - m_rows))
+			return BS_E_CORRUPT;
+
+		files.reserve(files.size() + (size_t)count);
+		const uint8_t* data = m_rows + offset;
+		StoredFile file;
+		for (uint64_t row = restart * RESTART_INTERVAL; row < first + count; ++row)
+		{
+			if (!ReadRow(data, m_rowsEnd, file))
+				return BS_E_CORRUPT;
+			if (row >= first)
+				files.push_back(file);
+		}
+		return BS_OK;
+	}
+
+	BsStatus CUploadTable::Packs(std::vector<StoredPack>& packs) const
+	{
+		const uint8_t* data = m_packs;
+		uint64_t count = 0;
+		if (m_packs == NULL || !ReadVarint(data, m_packsEnd, count) || count != m_packCount)
+			return BS_E_CORRUPT;
+
+		packs.resize((size_t)count);
+		for (StoredPack& pack : packs)
+		{
+			if (!ReadColumn(data, m_packsEnd, pack.keyName) || !ReadVarint(data, m_packsEnd, pack.size) ||
+				!ReadColumn(data, m_packsEnd, pack.md5) || !ReadVarint(data, m_packsEnd, pack.fileCount))
+				return BS_E_CORRUPT;
+		}
+		return BS_OK;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CUploadStore methods
+	//
+
+	CUploadStore::CUploadStore()
+		: m_fileLength(0), m_generation(0), m_indexLength(0), m_dirty(false)
+	{
+	}
+
+	CUploadStore::~CUploadStore()
+	{
+		Close();
+	}
+
+	//
+	//   FUNCTION: CUploadStore::Open(const PathChar*)
+	//
+	//   PURPOSE: Maps the store, or creates an empty one, and reads its
+	//            index. The tables are not touched.
+	//
+	BsStatus CUploadStore::Open(const PathChar* path)
+	{
+		static_assert(sizeof(Header) * HEADER_SLOTS == DATA_OFFSET, "the header slots are 64 bytes");
+
+		Close();
+		m_path = path;
+
+		BsStatus status = m_file.Open(path, FILE_OPEN_WRITE);
+		uint64_t length = 0;
+		if (status == BS_OK)
+			status = m_file.GetSize(length);
+
+		if (status == BS_OK && length == 0)
+		{
+			// an empty store at generation 0: the first Commit goes to the
+			// second slot.
+			m_generation = 0;
+			m_fileLength = DATA_OFFSET;
+			status = m_file.Truncate(DATA_OFFSET);
+
+			uint64_t offset = DATA_OFFSET;
+			if (status == BS_OK)
+				status = WriteIndex(m_file, offset, m_entries, 0, DATA_OFFSET);
+			if (status == BS_OK)
+				status = SyncParentDirectory(path);
+			if (status == BS_OK)
+				status = m_file.GetSize(length);
+		}
+
+		if (status == BS_OK)
+			status = Load(length);
+		if (status != BS_OK)
+			Close();
+		return status;
+	}
+
+	void CUploadStore::Close()
+	{
+		m_mapping.reset();
+		m_file.Close();
+		m_entries.clear();
+		m_fileLength = 0;
+		m_generation = 0;
+		m_indexLength = 0;
+		m_dirty = false;
+	}
+
+	size_t CUploadStore::Find(const std::string& name) const
+	{
+		for (size_t i = 0; i < m_entries.size(); ++i)
+		{
+			if (m_entries[i].summary.name == name)
+				return i;
+		}
+		return SIZE_MAX;
+	}
+
+	//
+	//   FUNCTION: CUploadStore::OpenTable(size_t, CUploadTable&)
+	//
+	//   PURPOSE: Checks the table's checksum and points the view at its
+	//            parts. The pages of the table are read here, and of no
+	//            other upload.
+	//
+	BsStatus CUploadStore::OpenTable(size_t index, CUploadTable& table)
+	{
+		if (index >= m_entries.size())
+			return BS_E_INVALIDARG;
+
+		const Entry& entry = m_entries[index];
+		if (entry.tableOffset + entry.tableLength > m_mapping->length)
+		{
+			BsStatus status = Map(m_fileLength);
+			if (status != BS_OK)
+				return status;
+		}
+
+		const uint8_t* block = m_mapping->view + entry.tableOffset;
+		if (entry.tableLength < sizeof(TableHeader) || Crc32(block, (size_t)entry.tableLength) != entry.tableChecksum)
+			return BS_E_CORRUPT;
+
+		TableHeader header;
+		memcpy(&header, block, sizeof(header));
+		uint64_t restartsLength = (uint64_t)header.restartCount * sizeof(uint64_t);
+		if (header.magic != TABLE_MAGIC || header.fileCount != entry.summary.fileCount ||
+			header.restartCount != (header.fileCount + RESTART_INTERVAL - 1) / RESTART_INTERVAL ||
+			sizeof(TableHeader) + restartsLength + header.rowsLength + header.packsLength != entry.tableLength)
+			return BS_E_CORRUPT;
+
+		table.m_mapping = m_mapping;
+		table.m_restarts = block + sizeof(TableHeader);
+		table.m_rows = table.m_restarts + restartsLength;
+		table.m_rowsEnd = table.m_rows + header.rowsLength;
+		table.m_packs = table.m_rowsEnd;
+		table.m_packsEnd = table.m_packs + header.packsLength;
+		table.m_count = header.fileCount;
+		table.m_packCount = entry.summary.packCount;
+		return BS_OK;
+	}
+
+	BsStatus CUploadStore::Put(const StoredUpload& upload)
+	{
+		if (!IsOpen() || upload.name.empty() || upload.packs.size() > UINT32_MAX ||
+			upload.files.size() / RESTART_INTERVAL >= UINT32_MAX)
+			return BS_E_INVALIDARG;
+
+		Entry entry;
+		entry.summary = Summarize(upload);
+
+		std::vector<uint8_t> block;
+		EncodeTable(upload, block);
+		entry.tableOffset = m_fileLength;
+		entry.tableLength = block.size();
+		entry.tableChecksum = Crc32(block.data(), block.size());
+
+		BsStatus status = m_file.WriteAt(m_fileLength, block.data(), block.size());
+		if (status != BS_OK)
+			return status;
+		m_fileLength += block.size();
+
+		size_t index = Find(upload.name);
+		if (index != SIZE_MAX)
+			m_entries[index] = std::move(entry);
+		else
+			m_entries.push_back(std::move(entry));
+
+		m_dirty = true;
+		return BS_OK;
+	}
+
+	BsStatus CUploadStore::SetState(size_t index, const std::string& status, uint64_t progress, bool userPaused,
+		bool manifestUploaded)
+	{
+		if (index >= m_entries.size())
+			return BS_E_INVALIDARG;
+
+		UploadSummary& summary = m_entries[index].summary;
+		summary.status = status;
+		summary.progress = progress;
+		summary.userPaused = userPaused;
+		summary.manifestUploaded = manifestUploaded;
+		m_dirty = true;
+		return BS_OK;
+	}
+
+	BsStatus CUploadStore::Remove(size_t index)
+	{
+		if (index >= m_entries.size())
+			return BS_E_INVALIDARG;
+
+		m_entries.erase(m_entries.begin() + index);
+		m_dirty = true;
+		return BS_OK;
+	}
+
+	BsStatus CUploadStore::Commit()
+	{
+		if (!IsOpen())
+			return BS_E_INVALIDARG;
+		if (!m_dirty)
+			return BS_OK;
+
+		StoreStats stats = Stats();
+		uint64_t offset = m_fileLength;
+		BsStatus status = WriteIndex(m_file, offset, m_entries, m_generation + 1,
+			stats.liveBytes - m_indexLength);
+		if (status != BS_OK)
+			return status;
+
+		m_indexLength = offset - m_fileLength;
+		m_fileLength = offset;
+		m_generation++;
+		m_dirty = false;
+		return BS_OK;
+	}
+
+	//
+	//   FUNCTION: CUploadStore::Compact()
+	//
+	//   PURPOSE: Copies the live tables, as they are, and a new index into
+	//            path.tmp, renamed over the store once it is on the disk.
+	//            Whichever file the rename leaves is opened again.
+	//
+	BsStatus CUploadStore::Compact()
+	{
+		BsStatus status = Commit();
+		if (status != BS_OK)
+			return status;
+		if (m_fileLength > m_mapping->length && (status = Map(m_fileLength)) != BS_OK)
+			return status;
+
+		PathString temporary = AppendSuffix(m_path, ".tmp");
+		{
+			CFile file;
+			status = file.Open(temporary.c_str(), FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE);
+			if (status == BS_OK)
+				status = file.Truncate(DATA_OFFSET);
+
+			std::vector<Entry> entries(m_entries);
+			uint64_t offset = DATA_OFFSET;
+			for (size_t i = 0; i < entries.size() && status == BS_OK; ++i)
+			{
+				status = file.WriteAt(offset, m_mapping->view + entries[i].tableOffset, (size_t)entries[i].tableLength);
+				entries[i].tableOffset = offset;
+				offset += entries[i].tableLength;
+			}
+
+			if (status == BS_OK)
+				status = WriteIndex(file, offset, entries, m_generation + 1, offset);
+		}
+
+		if (status == BS_OK)
+		{
+			m_mapping.reset();
+			m_file.Close();
+
+			status = RenameFile(temporary.c_str(), m_path.c_str());
+			if (status == BS_OK)
+				SyncParentDirectory(m_path.c_str());
+
+			PathString path(m_path);
+			BsStatus openStatus = Open(path.c_str());
+			if (openStatus != BS_OK)
+				return openStatus;
+		}
+
+		if (status != BS_OK)
+			RemoveFile(temporary.c_str());
+		return status;
+	}
+
+	StoreStats CUploadStore::Stats() const
+	{
+		StoreStats stats;
+		stats.uploads = m_entries.size();
+		stats.generation = m_generation;
+		stats.fileLength = m_fileLength;
+		stats.liveBytes = DATA_OFFSET + m_indexLength;
+		for (const Entry& entry : m_entries)
+			stats.liveBytes += entry.tableLength;
+		return stats;
+	}
+
+	//
+	//   FUNCTION: CUploadStore::Load(uint64_t)
+	//
+	//   PURPOSE: Picks the header slot of the last Commit: the one of higher
+	//            generation whose header and index check out. A Commit torn
+	//            in its header write leaves the other slot, still whole.
+	//            Then cuts off what followed that Commit.
+	//
+	BsStatus CUploadStore::Load(uint64_t length)
+	{
+		if (length < DATA_OFFSET)
+			return BS_E_CORRUPT;
+
+		BsStatus status = Map(length);
+		if (status != BS_OK)
+			return status;
+
+		Header headers[HEADER_SLOTS];
+		memcpy(headers, m_mapping->view, sizeof(headers));
+		if (headers[1].generation > headers[0].generation)
+			std::swap(headers[0], headers[1]);
+
+		const Header* current = NULL;
+		for (const Header& header : headers)
+		{
+			if (memcmp(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0 && header.version == STORE_VERSION &&
+				header.checksum == Crc32(&header, offsetof(Header, checksum)) &&
+				header.fileLength <= length && header.indexOffset >= DATA_OFFSET &&
+				header.indexOffset <= header.fileLength && header.indexLength <= header.fileLength - header.indexOffset &&
+				header.indexLength >= header.uploadCount * sizeof(IndexRecord) &&
+				Crc32(m_mapping->view + header.indexOffset, (size_t)header.indexLength) == header.indexChecksum)
+			{
+				current = &header;
+				break;
+			}
+		}
+		if (current == NULL)
+			return BS_E_CORRUPT;
+
+		const uint8_t* index = m_mapping->view + current->indexOffset;
+		const uint8_t* heap = index + current->uploadCount * sizeof(IndexRecord);
+		uint64_t heapLength = current->indexLength - current->uploadCount * sizeof(IndexRecord);
+
+		m_entries.resize(current->uploadCount);
+		for (uint32_t i = 0; i < current->uploadCount; ++i)
+		{
+			IndexRecord record;
+			memcpy(&record, index + i * sizeof(IndexRecord), sizeof(record));
+
+			Entry& entry = m_entries[i];
+			UploadSummary& summary = entry.summary;
+			if (record.tableOffset < DATA_OFFSET || record.tableOffset > current->fileLength ||
+				record.tableLength > current->fileLength - record.tableOffset ||
+				!ReadHeapString(heap, heapLength, record.name, record.nameLength, summary.name) ||
+				!ReadHeapString(heap, heapLength, record.url, record.urlLength, summary.url) ||
+				!ReadHeapString(heap, heapLength, record.status, record.statusLength, summary.status))
+				return BS_E_CORRUPT;
+
+			summary.progress = record.progress;
+			summary.userPaused = (record.flags & UPLOAD_USER_PAUSED) != 0;
+			summary.manifestUploaded = (record.flags & UPLOAD_MANIFEST_UPLOADED) != 0;
+			summary.fileCount = record.fileCount;
+			summary.packCount = record.packCount;
+			summary.totalSize = record.totalSize;
+			summary.uploadedFiles = record.uploadedFiles;
+			summary.uploadedBytes = record.uploadedBytes;
+			entry.tableOffset = record.tableOffset;
+			entry.tableLength = record.tableLength;
+			entry.tableChecksum = record.tableChecksum;
+		}
+
+		m_generation = current->generation;
+		m_indexLength = current->indexLength;
+		m_fileLength = current->fileLength;
+
+		if (length > m_fileLength)
+		{
+			m_mapping.reset();
+			status = m_file.Truncate(m_fileLength);
+			if (status == BS_OK)
+				status = Map(m_fileLength);
+		}
+		return status;
+	}
+
+	// Maps the first length bytes of the file, leaving the views already
+	// handed out on the mapping they were opened on.
+	BsStatus CUploadStore::Map(uint64_t length)
+	{
+		if (length > SIZE_MAX)
+			return BS_E_OUTOFMEMORY;
+
+		std::shared_ptr<CUploadTable::Mapping> mapping(new CUploadTable::Mapping);
+#ifdef _WIN32
+		mapping->handle = CreateFileMappingW(m_file.Handle(), NULL, PAGE_READONLY, (DWORD)(length >> 32),
+			(DWORD)length, NULL);
+		if (mapping->handle != NULL)
+			mapping->view = (const uint8_t*)MapViewOfFile(mapping->handle, FILE_MAP_READ, 0, 0, (SIZE_T)length);
+		if (mapping->view == NULL)
+			return StatusFromWin32(GetLastError());
+#else
+		void* view = mmap(NULL, (size_t)length, PROT_READ, MAP_SHARED, m_file.Handle(), 0);
+		if (view == MAP_FAILED)
+			return StatusFromErrno(errno);
+		mapping->view = (const uint8_t*)view;
+#endif
+		mapping->length = (size_t)length;
+		m_mapping = mapping;
+		return BS_OK;
+	}
+
+	//
+	//   FUNCTION: CUploadStore::WriteIndex(...)
+	//
+	//   PURPOSE: Appends the index of entries at offset, which moves past
+	//            it, then points the header slot of generation at it. Each
+	//            step is synced before the next, so the slot never refers
+	//            to bytes that may not be there.
+	//
+	BsStatus CUploadStore::WriteIndex(CFile& file, uint64_t& offset, const std::vector<Entry>& entries,
+		uint64_t generation, uint64_t liveBytes)
+	{
+		std::vector<uint8_t> index(entries.size() * sizeof(IndexRecord));
+		std::vector<uint8_t> heap;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			const Entry& entry = entries[i];
+			const UploadSummary& summary = entry.summary;
+
+			IndexRecord record;
+			memset(&record, 0, sizeof(record));
+			record.tableOffset = entry.tableOffset;
+			record.tableLength = entry.tableLength;
+			record.fileCount = summary.fileCount;
+			record.totalSize = summary.totalSize;
+			record.uploadedFiles = summary.uploadedFiles;
+			record.uploadedBytes = summary.uploadedBytes;
+			record.progress = summary.progress;
+			record.tableChecksum = entry.tableChecksum;
+			record.packCount = (uint32_t)summary.packCount;
+			record.flags = (summary.userPaused ? UPLOAD_USER_PAUSED : 0) |
+				(summary.manifestUploaded ? UPLOAD_MANIFEST_UPLOADED : 0);
+			AppendHeapString(heap, summary.name, record.name, record.nameLength);
+			AppendHeapString(heap, summary.url, record.url, record.urlLength);
+			AppendHeapString(heap, summary.status, record.status, record.statusLength);
+			memcpy(&index[i * sizeof(IndexRecord)], &record, sizeof(record));
+		}
+		if (heap.size() > UINT32_MAX)
+			return BS_E_INVALIDARG;
+		index.insert(index.end(), heap.begin(), heap.end());
+
+		BsStatus status = file.WriteAt(offset, index.data(), index.size());
+		if (status == BS_OK)
+			status = file.Sync();
+		if (status != BS_OK)
+			return status;
+
+		Header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+		header.version = STORE_VERSION;
+		header.uploadCount = (uint32_t)entries.size();
+		header.generation = generation;
+		header.fileLength = offset + index.size();
+		header.indexOffset = offset;
+		header.indexLength = index.size();
+		header.liveBytes = liveBytes + index.size();
+		header.indexChecksum = Crc32(index.data(), index.size());
+		header.checksum = Crc32(&header, offsetof(Header, checksum));
+
+		status = file.WriteAt(generation % HEADER_SLOTS * sizeof(Header), &header, sizeof(header));
+		if (status == BS_OK)
+			status = file.Sync();
+		if (status == BS_OK)
+			offset += index.size();
+		return status;
+	}
+
+	//
+	//   FUNCTION: ImportLocalUpload(const PathChar*, StoredUpload&)
+	//
+	//   PURPOSE: Walks the members of a LocalUpload the store keeps and
+	//            skips the rest. The file is read whole: they are written
+	//            whole, and rarely larger than a few hundred megabytes.
+	//
+	BsStatus ImportLocalUpload(const PathChar* path, StoredUpload& upload)
+	{
+		std::vector<uint8_t> data;
+		BsStatus status = ReadWholeFile(path, data);
+		if (status != BS_OK)
+			return status;
+
+		std::string name(upload.name);
+		upload = StoredUpload();
+		upload.name = name;
+
+		CJsonReader reader((const char*)data.data(), data.size());
+		std::string member;
+		if (!reader.BeginObject())
+			return BS_E_CORRUPT;
+
+		while (reader.NextMember(member))
+		{
+			if (member == "url")
+				reader.ReadString(upload.url);
+			else if (member == "status")
+				reader.ReadString(upload.status);
+			else if (member == "progress")
+				ReadNumber(reader, upload.progress);
+			else if (member == "user_paused")
+				reader.ReadBool(upload.userPaused);
+			else if (member == "archive_manifest_uploaded")
+				reader.ReadBool(upload.manifestUploaded);
+			else if (member == "archive_files_info" && reader.Peek() == JSON_ARRAY)
+			{
+				reader.BeginArray();
+				while (reader.NextElement())
+				{
+					upload.files.push_back(StoredFile());
+					if (!ReadFileInfo(reader, upload.files.back()))
+						return BS_E_CORRUPT;
+				}
+			}
+			else if (member == "packs" && reader.Peek() == JSON_ARRAY)
+			{
+				reader.BeginArray();
+				while (reader.NextElement())
+				{
+					upload.packs.push_back(StoredPack());
+					if (!ReadPack(reader, upload.packs.back()))
+						return BS_E_CORRUPT;
+				}
+			}
+			else
+				reader.Skip();
+		}
+
+		return reader.Failed() || reader.Peek() != JSON_END ? BS_E_CORRUPT : BS_OK;
+	}
+
+	BsStatus MigrateLocalUploads(const PathChar* directory, const PathChar* suffix, CUploadStore& store,
+		MigrationStats& stats)
+	{
+		memset(&stats, 0, sizeof(stats));
+		if (directory == NULL || suffix == NULL || !store.IsOpen())
+			return BS_E_INVALIDARG;
+
+		PathString folder(directory);
+		PathString extension(suffix);
+		if (!folder.empty() && folder.back() != PATH_SEPARATOR)
+			folder += PATH_SEPARATOR;
+
+		std::vector<PathString> names;
+		BsStatus status = ListFiles(directory, extension, names);
+		if (status != BS_OK)
+			return status;
+
+		StoredUpload upload;
+		for (const PathString& fileName : names)
+		{
+			if (UploadName(fileName, fileName.size() - extension.size(), upload.name) != BS_OK)
+			{
+				stats.failed++;
+				continue;
+			}
+			if (store.Find(upload.name) != SIZE_MAX)
+			{
+				stats.skipped++;
+				continue;
+			}
+
+			PathString path = folder + fileName;
+			status = ImportLocalUpload(path.c_str(), upload);
+			if (status != BS_OK && status != BS_E_OUTOFMEMORY)
+			{
+				status = ImportLocalUpload(AppendSuffix(path, ".bak").c_str(), upload);
+				if (status == BS_OK)
+					stats.fromBackup++;
+			}
+
+			if (status == BS_E_OUTOFMEMORY)
+				return status;
+			if (status != BS_OK)
+			{
+				stats.failed++;
+				continue;
+			}
+
+			status = store.Put(upload);
+			if (status != BS_OK)
+				return status;
+			stats.imported++;
+		}
+
+		return store.Commit();
+	}
+}
@@ -0,0 +1,259 @@
+// UploadStore.h : Declaration of CUploadStore, the single-file store of the
+// local uploads the client resumes at startup
+
+#pragma once
+
+#include "File.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// A file of an upload, shaped after BigStash.Model.ArchiveFileInfo.
+	// Empty strings stand for null.
+	struct StoredFile
+	{
+		StoredFile() : size(0), lastModified(0), progress(0), uploaded(false), partSize(0), hasPackOffset(false),
+			packOffset(0), hasStoredSize(false), storedSize(0) {}
+
+		std::string fileName;
+		std::string keyName;
+		std::string filePath;
+		uint64_t size;
+		int64_t lastModified;     // FILETIME ticks, UTC
+		uint64_t progress;
+		std::string md5;
+		bool uploaded;
+		std::string uploadId;
+		uint64_t partSize;
+		std::string packKey;
+		bool hasPackOffset;
+		uint64_t packOffset;
+		std::string duplicateOf;
+		std::string codec;
+		bool hasStoredSize;
+		uint64_t storedSize;
+		std::string keyId;
+
+		// hex; the parts sent so far are encrypted under it, so a resume
+		// has to use it, and only while the file is unchanged.
+		std::string nonce;
+
+		bool operator==(const StoredFile& other) const;
+	};
+
+	// Shaped after BigStash.Model.PackManifest.
+	struct StoredPack
+	{
+		StoredPack() : size(0), fileCount(0) {}
+
+		std::string keyName;
+		uint64_t size;
+		std::string md5;
+		uint64_t fileCount;
+
+		bool operator==(const StoredPack& other) const;
+	};
+
+	// A whole upload, shaped after BigStash.Model.LocalUpload. name is what
+	// identifies it in the store: the name of its JSON file without the
+	// extension.
+	struct StoredUpload
+	{
+		StoredUpload() : progress(0), userPaused(false), manifestUploaded(false) {}
+
+		std::string name;
+		std::string url;
+		std::string status;
+		uint64_t progress;
+		bool userPaused;
+		bool manifestUploaded;
+		std::vector<StoredFile> files;
+		std::vector<StoredPack> packs;
+	};
+
+	// What the index holds of an upload: enough to list it and show its
+	// progress without its file table.
+	struct UploadSummary
+	{
+		UploadSummary() : progress(0), userPaused(false), manifestUploaded(false), fileCount(0), packCount(0),
+			totalSize(0), uploadedFiles(0), uploadedBytes(0) {}
+
+		std::string name;
+		std::string url;
+		std::string status;
+		uint64_t progress;
+		bool userPaused;
+		bool manifestUploaded;
+		uint64_t fileCount;
+		uint64_t packCount;
+		uint64_t totalSize;
+		uint64_t uploadedFiles;
+
+		// The bytes of the uploaded files and the progress of the others.
+		uint64_t uploadedBytes;
+	};
+
+	struct StoreStats
+	{
+		uint64_t uploads;
+		uint64_t generation;
+
+		// Bytes of the file, and of the tables and index still in use; the
+		// difference is what Compact gives back.
+		uint64_t fileLength;
+		uint64_t liveBytes;
+	};
+
+	struct MigrationStats
+	{
+		uint64_t imported;
+
+		// Read from the .bak the client keeps when the file itself did not
+		// parse.
+		uint64_t fromBackup;
+
+		// Already in the store.
+		uint64_t skipped;
+
+		// Neither the file nor its backup parsed.
+		uint64_t failed;
+	};
+
+	// CUploadTable
+	//
+	// A view of the file table of an upload, straight off the mapping of
+	// the store. Rows are decoded as they are asked for: Get decodes from
+	// the restart point before the row, at most 31 rows more. The view
+	// keeps the mapping it was opened on alive, so it stays valid across
+	// Put and Commit, and shows the upload as it was when it was opened.
+	class CUploadTable
+	{
+	public:
+		CUploadTable();
+
+		uint64_t Count() const { return m_count; }
+
+		BsStatus Get(uint64_t index, StoredFile& file) const;
+
+		// Decodes count rows from first on, appending them to files.
+		BsStatus Read(uint64_t first, uint64_t count, std::vector<StoredFile>& files) const;
+
+		BsStatus Packs(std::vector<StoredPack>& packs) const;
+
+	private:
+		friend class CUploadStore;
+
+		struct Mapping;
+
+		std::shared_ptr<const Mapping> m_mapping;
+		const uint8_t* m_restarts;
+		const uint8_t* m_rows;
+		const uint8_t* m_rowsEnd;
+		const uint8_t* m_packs;
+		const uint8_t* m_packsEnd;
+		uint64_t m_count;
+		uint64_t m_packCount;
+	};
+
+	// CUploadStore
+	//
+	// The local uploads in one file, laid out for startup: an index of
+	// fixed size summary records, one per upload, and per upload a file
+	// table that is only read when the upload is opened. The file is mapped,
+	// so opening the store reads the header and the index, a few hundred
+	// bytes an upload, whatever the uploads hold; the managed client read
+	// and deserialized every file of every upload's JSON first.
+	//
+	// The file only grows between compactions: Put appends the upload's
+	// table, and Commit appends a new index and then flips to it by writing
+	// the header slot the current one is not in, so a crash leaves the
+	// store as the last Commit left it. Put replaces an upload whole; a
+	// change to the summary alone (SetState) appends nothing but the next
+	// index. Not synchronized; one writer at a time.
+	class CUploadStore
+	{
+	public:
+		CUploadStore();
+		~CUploadStore();
+
+		// Opens the store at path, creating it when it does not exist.
+		// BS_E_CORRUPT when neither header slot holds a valid store of this
+		// version. What was appended after the last Commit is cut off.
+		BsStatus Open(const PathChar* path);
+		void Close();
+
+		bool IsOpen() const { return m_file.IsOpen(); }
+
+		// The uploads, in the order they were first put.
+		size_t Count() const { return m_entries.size(); }
+		const UploadSummary& GetSummary(size_t index) const { return m_entries[index].summary; }
+
+		// The index of the upload, or SIZE_MAX.
+		size_t Find(const std::string& name) const;
+
+		// Maps what Put appended since, when the table is one of it.
+		BsStatus OpenTable(size_t index, CUploadTable& table);
+
+		// Appends the upload's table and adds the upload, or replaces the
+		// one of the same name. Visible to this store at once; on the disk
+		// once committed.
+		BsStatus Put(const StoredUpload& upload);
+
+		// Updates an upload's summary fields without touching its table.
+		BsStatus SetState(size_t index, const std::string& status, uint64_t progress, bool userPaused,
+			bool manifestUploaded);
+
+		BsStatus Remove(size_t index);
+
+		// Makes the changes since the last Commit durable.
+		BsStatus Commit();
+
+		// Rewrites the store with only the live tables into a temporary file
+		// renamed over this one. Commits first. On Windows the rename fails
+		// while a table view is open.
+		BsStatus Compact();
+
+		StoreStats Stats() const;
+
+	private:
+		struct Header;
+		struct Entry
+		{
+			UploadSummary summary;
+			uint64_t tableOffset;
+			uint64_t tableLength;
+			uint32_t tableChecksum;
+		};
+
+		BsStatus Load(uint64_t length);
+		BsStatus Map(uint64_t length);
+		BsStatus WriteIndex(CFile& file, uint64_t& offset, const std::vector<Entry>& entries, uint64_t generation,
+			uint64_t liveBytes);
+
+		PathString m_path;
+		CFile m_file;
+		std::shared_ptr<const CUploadTable::Mapping> m_mapping;
+		std::vector<Entry> m_entries;
+		uint64_t m_fileLength;
+		uint64_t m_generation;
+		uint64_t m_indexLength;
+		bool m_dirty;
+
+		CUploadStore(const CUploadStore&);
+		CUploadStore& operator=(const CUploadStore&);
+	};
+
+	// Reads a LocalUpload JSON file as the managed client writes it. The
+	// upload's name is left to the caller. BS_E_CORRUPT when it does not
+	// parse; last_modified values without a zone are taken as UTC.
+	BsStatus ImportLocalUpload(const PathChar* path, StoredUpload& upload);
+
+	// Imports the LocalUpload files (*suffix, e.g. ".djf") of directory
+	// that are not in the store yet, falling back to their .bak as the
+	// client does, and commits. The JSON files are left in place.
+	BsStatus MigrateLocalUploads(const PathChar* directory, const PathChar* suffix, CUploadStore& store,
+		MigrationStats& stats);
+}
@@ -0,0 +1,546 @@
+// UploadTracer.cpp : Implementation of CLatencyHistogram, CUploadTrace and
+// CUploadTracer
+
+#include "UploadTracer.h"
+#include "File.h"
+#include "Json.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		const char* const STAGE_NAMES[TRACE_STAGE_COUNT] =
+		{
+			"file",
+			"part",
+			"buffer_wait",
+			"read",
+			"hash",
+			"encrypt",
+			"queued",
+			"slot_wait",
+			"sign",
+			"connection_wait",
+			"connect",
+			"send",
+			"server_wait",
+			"receive",
+			"retry_delay"
+		};
+
+		unsigned HighestSetBit(uint64_t word)
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanReverse64(&index, word);
+			return (unsigned)index;
+#else
+			return 63u - (unsigned)__builtin_clzll(word);
+#endif
+		}
+
+		// Small numbers for the threads that record, in the order they first
+		// do; the trace file shows them as thread IDs.
+		uint32_t ThreadNumber()
+		{
+			static std::atomic<uint32_t> next(1);
+			thread_local uint32_t number = next.fetch_add(1, std::memory_order_relaxed);
+			return number;
+		}
+
+		void AtomicMin(std::atomic<int64_t>& target, int64_t value)
+		{
+			int64_t current = target.load(std::memory_order_relaxed);
+			while (value < current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		void AtomicMax(std::atomic<int64_t>& target, int64_t value)
+		{
+			int64_t current = target.load(std::memory_order_relaxed);
+			while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		void AppendMicroseconds(std::string& json, int64_t nanoseconds)
+		{
+			char text[32];
+			snprintf(text, sizeof(text), "%lld.%03lld", (long long)(nanoseconds / 1000),
+				(long long)(nanoseconds % 1000));
+			json += text;
+		}
+
+		// One stage as an async begin/end pair. Each part's stages share an ID
+		// (the file's have part 0), so a part is one track with its stages in
+		// order under its "part" slice.
+		void AppendEvent(std::string& json, const TraceEvent& event, int64_t epoch)
+		{
+			char id[32];
+			snprintf(id, sizeof(id), "0x%x%08x", event.upload, event.part);
+
+			const char* name = STAGE_NAMES[event.stage];
+			std::string common = ",\"cat\":\"upload\",\"id\":\"" + std::string(id) + "\",\"pid\":1,\"tid\":" +
+				std::to_string(event.thread);
+
+			int64_t start = std::max<int64_t>(event.start - epoch, 0);
+			int64_t end = std::max<int64_t>(event.end - epoch, start);
+
+			json += "{\"name\":\"";
+			json += name;
+			json += "\",\"ph\":\"b\"" + common + ",\"ts\":";
+			AppendMicroseconds(json, start);
+			json += ",\"args\":{\"upload\":" + std::to_string(event.upload) + ",\"part\":" +
+				std::to_string(event.part) + ",\"bytes\":" + std::to_string(event.bytes) + "}},\n";
+
+			json += "{\"name\":\"";
+			json += name;
+			json += "\",\"ph\":\"e\"" + common + ",\"ts\":";
+			AppendMicroseconds(json, end);
+			json += "}";
+		}
+
+		void FillStageStats(const CLatencyHistogram& histogram, TraceStageStats& stats)
+		{
+			stats.count = histogram.Count();
+			stats.total = histogram.Sum();
+			stats.min = histogram.Min();
+			stats.max = histogram.Max();
+			stats.mean = histogram.Mean();
+			stats.p50 = histogram.ValueAtPercentile(50);
+			stats.p90 = histogram.ValueAtPercentile(90);
+			stats.p99 = histogram.ValueAtPercentile(99);
+			stats.p999 = histogram.ValueAtPercentile(99.9);
+		}
+	}
+
+	const char* TraceStageName(TraceStage stage)
+	{
+		return (unsigned)stage < TRACE_STAGE_COUNT ? STAGE_NAMES[stage] : "unknown";
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CLatencyHistogram methods
+	//
+
+	CLatencyHistogram::CLatencyHistogram()
+	{
+		Reset();
+	}
+
+	void CLatencyHistogram::Reset()
+	{
+		for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+			m_buckets[i].store(0, std::memory_order_relaxed);
+		m_count.store(0, std::memory_order_relaxed);
+		m_sum.store(0, std::memory_order_relaxed);
+		m_min.store(INT64_MAX, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+	}
+
+	//
+	//   FUNCTION: CLatencyHistogram::BucketOf(int64_t)
+	//
+	//   PURPOSE: Values below 32 have a bucket each. Above, a value with its
+	//            highest bit at e falls in group e - 4, and its next five
+	//            bits pick one of the group's 32 buckets.
+	//
+	unsigned CLatencyHistogram::BucketOf(int64_t value)
+	{
+		if (value < (int64_t)HISTOGRAM_SUB_BUCKETS)
+			return value < 0 ? 0 : (unsigned)value;
+
+		unsigned exponent = HighestSetBit((uint64_t)value);
+		if (exponent > HISTOGRAM_MAX_EXPONENT)
+			return HISTOGRAM_BUCKETS - 1;
+
+		unsigned shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+		unsigned sub = (unsigned)((uint64_t)value >> shift) - HISTOGRAM_SUB_BUCKETS;
+		return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+	}
+
+	int64_t CLatencyHistogram::BucketLow(unsigned bucket)
+	{
+		if (bucket < HISTOGRAM_SUB_BUCKETS)
+			return bucket;
+
+		unsigned shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+		return (int64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+	}
+
+	int64_t CLatencyHistogram::BucketWidth(unsigned bucket)
+	{
+		return bucket < HISTOGRAM_SUB_BUCKETS ? 1 : (int64_t)1 << (bucket / HISTOGRAM_SUB_BUCKETS - 1);
+	}
+
+	void CLatencyHistogram::Record(int64_t nanoseconds)
+	{
+		if (nanoseconds < 0)
+			nanoseconds = 0;
+
+		m_buckets[BucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+		AtomicMin(m_min, nanoseconds);
+		AtomicMax(m_max, nanoseconds);
+	}
+
+	void CLatencyHistogram::Add(const CLatencyHistogram& other)
+	{
+		for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		{
+			uint64_t count = other.m_buckets[i].load(std::memory_order_relaxed);
+			if (count != 0)
+				m_buckets[i].fetch_add(count, std::memory_order_relaxed);
+		}
+
+		m_count.fetch_add(other.Count(), std::memory_order_relaxed);
+		m_sum.fetch_add(other.Sum(), std::memory_order_relaxed);
+		AtomicMin(m_min, other.m_min.load(std::memory_order_relaxed));
+		AtomicMax(m_max, other.m_max.load(std::memory_order_relaxed));
+	}
+
+	int64_t CLatencyHistogram::Min() const
+	{
+		return Count() == 0 ? 0 : m_min.load(std::memory_order_relaxed);
+	}
+
+	int64_t CLatencyHistogram::Max() const
+	{
+		return m_max.load(std::memory_order_relaxed);
+	}
+
+	double CLatencyHistogram::Mean() const
+	{
+		uint64_t count = Count();
+		return count == 0 ? 0 : (double)Sum() / (double)count;
+	}
+
+	int64_t CLatencyHistogram::ValueAtPercentile(double percentile) const
+	{
+		uint64_t count = Count();
+		if (count == 0)
+			return 0;
+
+		percentile = std::min(std::max(percentile, 0.0), 100.0);
+		uint64_t rank = std::max<uint64_t>((uint64_t)std::ceil(percentile / 100.0 * (double)count), 1);
+
+		uint64_t seen = 0;
+		unsigned bucket = 0;
+		for (; bucket < HISTOGRAM_BUCKETS - 1; ++bucket)
+		{
+			seen += m_buckets[bucket].load(std::memory_order_relaxed);
+			if (seen >= rank)
+				break;
+		}
+
+		int64_t value = BucketLow(bucket) + BucketWidth(bucket) / 2;
+		return std::min(std::max(value, Min()), Max());
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CUploadTrace methods
+	//
+
+	CUploadTrace::CUploadTrace(CUploadTracer& tracer, uint32_t id, const std::string& name,
+		const std::shared_ptr<CUploadTrace>& totals)
+		: m_tracer(tracer), m_id(id), m_name(name), m_totals(totals), m_begin(MonotonicNanoseconds()), m_end(0),
+		m_partsRead(0), m_partsSent(0), m_bytesRead(0), m_bytesSent(0), m_retries(0), m_failures(0),
+		m_hedges(0), m_hedgesWon(0)
+	{
+	}
+
+	void CUploadTrace::Record(TraceStage stage, uint32_t part, int64_t start, int64_t end, uint64_t bytes)
+	{
+		m_stages[stage].Record(end - start);
+		if (m_totals)
+			m_totals->m_stages[stage].Record(end - start);
+
+		TraceEvent event;
+		event.start = start;
+		event.end = end;
+		event.bytes = bytes;
+		event.upload = m_id;
+		event.part = part;
+		event.thread = ThreadNumber();
+		event.stage = stage;
+		m_tracer.Push(event);
+	}
+
+	void CUploadTrace::CountRead(uint64_t bytes)
+	{
+		m_partsRead.fetch_add(1, std::memory_order_relaxed);
+		m_bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+		if (m_totals)
+			m_totals->CountRead(bytes);
+	}
+
+	void CUploadTrace::CountSent(uint64_t bytes)
+	{
+		m_partsSent.fetch_add(1, std::memory_order_relaxed);
+		m_bytesSent.fetch_add(bytes, std::memory_order_relaxed);
+		if (m_totals)
+			m_totals->CountSent(bytes);
+	}
+
+	void CUploadTrace::CountRetry()
+	{
+		m_retries.fetch_add(1, std::memory_order_relaxed);
+		if (m_totals)
+			m_totals->CountRetry();
+	}
+
+	void CUploadTrace::CountFailure()
+	{
+		m_failures.fetch_add(1, std::memory_order_relaxed);
+		if (m_totals)
+			m_totals->CountFailure();
+	}
+
+	void CUploadTrace::CountHedge()
+	{
+		m_hedges.fetch_add(1, std::memory_order_relaxed);
+		if (m_totals)
+			m_totals->CountHedge();
+	}
+
+	void CUploadTrace::CountHedgeWon()
+	{
+		m_hedgesWon.fetch_add(1, std::memory_order_relaxed);
+		if (m_totals)
+			m_totals->CountHedgeWon();
+	}
+
+	void CUploadTrace::GetStats(TraceUploadStats& stats) const
+	{
+		int64_t end = m_end.load(std::memory_order_relaxed);
+
+		stats.upload = m_id;
+		stats.name = m_name;
+		stats.finished = end != 0;
+		stats.partsRead = m_partsRead.load(std::memory_order_relaxed);
+		stats.partsSent = m_partsSent.load(std::memory_order_relaxed);
+		stats.bytesRead = m_bytesRead.load(std::memory_order_relaxed);
+		stats.bytesSent = m_bytesSent.load(std::memory_order_relaxed);
+		stats.retries = m_retries.load(std::memory_order_relaxed);
+		stats.failures = m_failures.load(std::memory_order_relaxed);
+		stats.hedges = m_hedges.load(std::memory_order_relaxed);
+		stats.hedgesWon = m_hedgesWon.load(std::memory_order_relaxed);
+		stats.seconds = (double)((end != 0 ? end : MonotonicNanoseconds()) - m_begin) / 1e9;
+		stats.bytesPerSecond = stats.seconds > 0 ? (double)stats.bytesSent / stats.seconds : 0;
+
+		for (unsigned i = 0; i < TRACE_STAGE_COUNT; ++i)
+			FillStageStats(m_stages[i], stats.stages[i]);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////
+	// CUploadTracer methods
+	//
+
+	CUploadTracer::CUploadTracer()
+		: m_enabled(false), m_epoch(MonotonicNanoseconds()),
+		m_total(new CUploadTrace(*this, 0, std::string(), std::shared_ptr<CUploadTrace>())), m_nextUpload(1),
+		m_nextEvent(0), m_eventCount(0)
+	{
+	}
+
+	CUploadTracer::CUploadTracer(const TraceOptions& options)
+		: m_enabled(false), m_epoch(0), m_nextUpload(1), m_nextEvent(0), m_eventCount(0)
+	{
+		Enable(options);
+	}
+
+	CUploadTracer& CUploadTracer::Process()
+	{
+		static CUploadTracer tracer;
+		return tracer;
+	}
+
+	void CUploadTracer::Enable(const TraceOptions& options)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_options = options;
+		m_total.reset(new CUploadTrace(*this, 0, std::string(), std::shared_ptr<CUploadTrace>()));
+		m_running.clear();
+		m_finished.clear();
+
+		{
+			std::lock_guard<std::mutex> events(m_eventLock);
+			m_events.assign(options.eventCapacity, TraceEvent());
+			m_nextEvent = 0;
+			m_eventCount = 0;
+			m_epoch = MonotonicNanoseconds();
+		}
+
+		m_enabled.store(true, std::memory_order_relaxed);
+	}
+
+	void CUploadTracer::Disable()
+	{
+		m_enabled.store(false, std::memory_order_relaxed);
+	}
+
+	std::shared_ptr<CUploadTrace> CUploadTracer::BeginUpload(const std::string& name)
+	{
+		if (!Enabled())
+			return std::shared_ptr<CUploadTrace>();
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		std::shared_ptr<CUploadTrace> upload(new CUploadTrace(*this, m_nextUpload++, name, m_total));
+		m_running.push_back(upload);
+		return upload;
+	}
+
+	void CUploadTracer::EndUpload(const std::shared_ptr<CUploadTrace>& upload)
+	{
+		if (!upload)
+			return;
+
+		upload->m_end.store(MonotonicNanoseconds(), std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto it = std::find(m_running.begin(), m_running.end(), upload);
+		if (it == m_running.end())
+			return;
+
+		m_running.erase(it);
+		m_finished.push_back(upload);
+		if (m_finished.size() > m_options.keepUploads)
+			m_finished.erase(m_finished.begin(), m_finished.end() - m_options.keepUploads);
+	}
+
+	bool CUploadTracer::GetStats(uint32_t upload, TraceUploadStats& stats) const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (upload == 0)
+		{
+			m_total->GetStats(stats);
+			return true;
+		}
+
+		for (const auto* list : { &m_running, &m_finished })
+		{
+			for (const std::shared_ptr<CUploadTrace>& trace : *list)
+			{
+				if (trace->Id() == upload)
+				{
+					trace->GetStats(stats);
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	std::vector<TraceUploadStats> CUploadTracer::Uploads() const
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		std::vector<TraceUploadStats> uploads(m_finished.size() + m_running.size());
+
+		for (size_t i = 0; i < m_finished.size(); ++i)
+			m_finished[i]->GetStats(uploads[i]);
+		for (size_t i = 0; i < m_running.size(); ++i)
+			m_running[i]->GetStats(uploads[m_finished.size() + i]);
+
+		return uploads;
+	}
+
+	void CUploadTracer::Push(const TraceEvent& event)
+	{
+		std::lock_guard<std::mutex> guard(m_eventLock);
+		if (m_events.empty())
+			return;
+
+		m_events[m_nextEvent] = event;
+		m_nextEvent = m_nextEvent + 1 == m_events.size() ? 0 : m_nextEvent + 1;
+		m_eventCount++;
+	}
+
+	std::vector<TraceEvent> CUploadTracer::Events() const
+	{
+		std::lock_guard<std::mutex> guard(m_eventLock);
+		std::vector<TraceEvent> events;
+
+		if (m_eventCount < m_events.size())
+			events.assign(m_events.begin(), m_events.begin() + (ptrdiff_t)m_eventCount);
+		else
+		{
+			events.assign(m_events.begin() + (ptrdiff_t)m_nextEvent, m_events.end());
+			events.insert(events.end(), m_events.begin(), m_events.begin() + (ptrdiff_t)m_nextEvent);
+		}
+
+		return events;
+	}
+
+	uint64_t CUploadTracer::DroppedEvents() const
+	{
+		std::lock_guard<std::mutex> guard(m_eventLock);
+		return m_eventCount > m_events.size() ? m_eventCount - m_events.size() : 0;
+	}
+
+	//
+	//   FUNCTION: CUploadTracer::FormatTrace(std::string&)
+	//
+	//   PURPOSE: Formats the ring as a Chrome JSON trace. Times are in
+	//            microseconds since the tracer was enabled; the file names
+	//            go in metadata, keyed by upload.
+	//
+	void CUploadTracer::FormatTrace(std::string& json) const
+	{
+		std::vector<TraceEvent> events = Events();
+		std::sort(events.begin(), events.end(), [](const TraceEvent& left, const TraceEvent& right)
+		{
+			return left.start < right.start;
+		});
+
+		int64_t epoch;
+		{
+			std::lock_guard<std::mutex> guard(m_eventLock);
+			epoch = m_epoch;
+		}
+
+		json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"BigStash uploads\"}}";
+		for (const TraceEvent& event : events)
+		{
+			json += ",\n";
+			AppendEvent(json, event, epoch);
+		}
+
+		json += "\n],\"otherData\":{\"dropped_events\":\"" + std::to_string(DroppedEvents()) + "\",\"uploads\":{";
+		std::vector<TraceUploadStats> uploads = Uploads();
+		for (size_t i = 0; i < uploads.size(); ++i)
+		{
+			if (i != 0)
+				json += ',';
+			json += "\"" + std::to_string(uploads[i].upload) + "\":";
+			AppendJsonString(json, uploads[i].name.data(), uploads[i].name.size());
+		}
+		json += "}}}\n";
+	}
+
+	BsStatus CUploadTracer::WriteTrace(const PathChar* path) const
+	{
+		if (path == NULL)
+			return BS_E_INVALIDARG;
+
+		std::string json;
+		FormatTrace(json);
+
+		CFile file;
+		BsStatus status = file.Open(path, FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE);
+		if (status == BS_OK)
+			status = file.WriteAt(0, json.data(), json.size());
+		return status;
+	}
+}
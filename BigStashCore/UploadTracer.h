@@ -0,0 +1,288 @@
+// UploadTracer.h : Declaration of CLatencyHistogram, CUploadTrace and
+// CUploadTracer, the per-stage timing of uploads
+
+#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// The stages of a part, in the order it goes through them, and the file
+	// around them. The values are the BS_TRACE_* values.
+	enum TraceStage
+	{
+		// A file's UploadParts, from its start to the last part accepted.
+		TRACE_FILE,
+
+		// A part, from the reader taking a buffer for it to S3 accepting it.
+		TRACE_PART,
+
+		// The reader waiting for a free pool buffer: the uploader is behind.
+		TRACE_BUFFER_WAIT,
+		TRACE_READ,
+
+		// Part MD5, whole-file digest and SHA-256.
+		TRACE_HASH,
+		TRACE_ENCRYPT,
+
+		// Read and waiting for the uploader to take it.
+		TRACE_QUEUED,
+
+		// Waiting for a scheduler slot and the bandwidth caps.
+		TRACE_SLOT_WAIT,
+		TRACE_SIGN,
+
+		// Waiting for a free connection, then opening one when none was idle.
+		TRACE_CONNECTION_WAIT,
+		TRACE_CONNECT,
+
+		// Head and body written to the socket.
+		TRACE_SEND,
+
+		// Last byte sent to the first byte of the response: S3's time.
+		TRACE_SERVER_WAIT,
+		TRACE_RECEIVE,
+
+		// The pause before a retry.
+		TRACE_RETRY_DELAY,
+
+		TRACE_STAGE_COUNT
+	};
+
+	const char* TraceStageName(TraceStage stage);
+
+	// 32 sub-buckets per power of two: a value is known to within 3%.
+	const unsigned HISTOGRAM_SUB_BUCKET_BITS = 5;
+	const unsigned HISTOGRAM_SUB_BUCKETS = 1u << HISTOGRAM_SUB_BUCKET_BITS;
+
+	// Values are counted exactly up to 2^40 ns (18 minutes); longer ones go
+	// to the last bucket, and only Max() keeps them.
+	const unsigned HISTOGRAM_MAX_EXPONENT = 40;
+	const unsigned HISTOGRAM_BUCKETS = (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS;
+
+	// CLatencyHistogram
+	//
+	// An HDR-style histogram of durations in nanoseconds: linear up to 32 ns,
+	// then 32 equal buckets per power of two, so the relative error stays
+	// the same from microseconds to minutes with about a thousand counters.
+	// Record is a few relaxed atomic adds, without a lock; a read while
+	// writers run may miss the values in flight.
+	class CLatencyHistogram
+	{
+	public:
+		CLatencyHistogram();
+
+		void Record(int64_t nanoseconds);
+
+		// Adds other's counts, e.g. to fold an upload into the totals.
+		void Add(const CLatencyHistogram& other);
+		void Reset();
+
+		uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+		int64_t Sum() const { return m_sum.load(std::memory_order_relaxed); }
+		int64_t Min() const;
+		int64_t Max() const;
+		double Mean() const;
+
+		// The value below which percentile (0-100) of the values are: the
+		// middle of the bucket holding it, within [Min(), Max()].
+		int64_t ValueAtPercentile(double percentile) const;
+
+		static unsigned BucketOf(int64_t value);
+		static int64_t BucketLow(unsigned bucket);
+		static int64_t BucketWidth(unsigned bucket);
+
+	private:
+		CLatencyHistogram(const CLatencyHistogram&);
+		CLatencyHistogram& operator=(const CLatencyHistogram&);
+
+		std::atomic<uint64_t> m_buckets[HISTOGRAM_BUCKETS];
+		std::atomic<uint64_t> m_count;
+		std::atomic<int64_t> m_sum;
+		std::atomic<int64_t> m_min;
+		std::atomic<int64_t> m_max;
+	};
+
+	struct TraceStageStats
+	{
+		uint64_t count;
+
+		// Nanoseconds.
+		int64_t total;
+		int64_t min;
+		int64_t max;
+		double mean;
+		int64_t p50;
+		int64_t p90;
+		int64_t p99;
+		int64_t p999;
+	};
+
+	struct TraceUploadStats
+	{
+		uint32_t upload;
+		std::string name;
+		bool finished;
+
+		uint64_t partsRead;
+		uint64_t partsSent;
+		uint64_t bytesRead;
+		uint64_t bytesSent;
+		uint64_t retries;
+		uint64_t failures;
+
+		// Late parts sent again, and those the second request won.
+		uint64_t hedges;
+		uint64_t hedgesWon;
+
+		// Since the upload began, until it finished; bytesSent over it.
+		double seconds;
+		double bytesPerSecond;
+
+		TraceStageStats stages[TRACE_STAGE_COUNT];
+	};
+
+	// One timed stage, as kept for the trace file.
+	struct TraceEvent
+	{
+		int64_t start;
+		int64_t end;
+		uint64_t bytes;
+		uint32_t upload;
+		uint32_t part;
+		uint32_t thread;
+		TraceStage stage;
+	};
+
+	class CUploadTracer;
+
+	// CUploadTrace
+	//
+	// The timings of one upload (a file's parts): a histogram per stage and
+	// the throughput counters. The part reader, the S3 client and the HTTP
+	// client's timestamps all feed it from their own threads.
+	class CUploadTrace
+	{
+	public:
+		uint32_t Id() const { return m_id; }
+		const std::string& Name() const { return m_name; }
+
+		// start and end are MonotonicNanoseconds(); part 0 is the file.
+		void Record(TraceStage stage, uint32_t part, int64_t start, int64_t end, uint64_t bytes = 0);
+
+		void CountRead(uint64_t bytes);
+		void CountSent(uint64_t bytes);
+		void CountRetry();
+		void CountFailure();
+		void CountHedge();
+		void CountHedgeWon();
+
+		void GetStats(TraceUploadStats& stats) const;
+
+	private:
+		friend class CUploadTracer;
+
+		// totals is NULL for the totals themselves.
+		CUploadTrace(CUploadTracer& tracer, uint32_t id, const std::string& name,
+			const std::shared_ptr<CUploadTrace>& totals);
+		CUploadTrace(const CUploadTrace&);
+		CUploadTrace& operator=(const CUploadTrace&);
+
+		CUploadTracer& m_tracer;
+		const uint32_t m_id;
+		const std::string m_name;
+		const std::shared_ptr<CUploadTrace> m_totals;
+		const int64_t m_begin;
+		std::atomic<int64_t> m_end;
+
+		std::atomic<uint64_t> m_partsRead;
+		std::atomic<uint64_t> m_partsSent;
+		std::atomic<uint64_t> m_bytesRead;
+		std::atomic<uint64_t> m_bytesSent;
+		std::atomic<uint64_t> m_retries;
+		std::atomic<uint64_t> m_failures;
+		std::atomic<uint64_t> m_hedges;
+		std::atomic<uint64_t> m_hedgesWon;
+		CLatencyHistogram m_stages[TRACE_STAGE_COUNT];
+	};
+
+	struct TraceOptions
+	{
+		TraceOptions() : eventCapacity(65536), keepUploads(64) {}
+
+		// Stages kept for the trace file, the latest ones; 0 keeps only the
+		// histograms.
+		size_t eventCapacity;
+
+		// Finished uploads whose stats stay available.
+		size_t keepUploads;
+	};
+
+	// CUploadTracer
+	//
+	// Hands out an upload trace per file, keeps the totals over every upload
+	// since it was enabled, and the latest stages in a ring for the trace
+	// file: Chrome's JSON trace format, which Perfetto and chrome://tracing
+	// open, with every part on its own track. Disabled, BeginUpload returns
+	// NULL and nothing is timed. Process() is the instance the C API uses,
+	// disabled until BsTraceEnable; separate instances are for benchmarks.
+	class CUploadTracer
+	{
+	public:
+		// Disabled until Enable.
+		CUploadTracer();
+		explicit CUploadTracer(const TraceOptions& options);
+
+		static CUploadTracer& Process();
+
+		// Starts over: the totals, the uploads and the ring are cleared.
+		void Enable(const TraceOptions& options);
+		void Disable();
+		bool Enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+		// NULL when disabled. Keep the pointer until EndUpload.
+		std::shared_ptr<CUploadTrace> BeginUpload(const std::string& name);
+		void EndUpload(const std::shared_ptr<CUploadTrace>& upload);
+
+		// upload 0 is the totals. False when the upload is not known.
+		bool GetStats(uint32_t upload, TraceUploadStats& stats) const;
+
+		// The uploads running and the kept finished ones, oldest first.
+		std::vector<TraceUploadStats> Uploads() const;
+
+		std::vector<TraceEvent> Events() const;
+		uint64_t DroppedEvents() const;
+
+		void FormatTrace(std::string& json) const;
+		BsStatus WriteTrace(const PathChar* path) const;
+
+	private:
+		friend class CUploadTrace;
+
+		CUploadTracer(const CUploadTracer&);
+		CUploadTracer& operator=(const CUploadTracer&);
+
+		void Push(const TraceEvent& event);
+
+		std::atomic<bool> m_enabled;
+		int64_t m_epoch;
+
+		mutable std::mutex m_lock;
+		TraceOptions m_options;
+		std::shared_ptr<CUploadTrace> m_total;
+		std::vector<std::shared_ptr<CUploadTrace> > m_running;
+		std::vector<std::shared_ptr<CUploadTrace> > m_finished;
+		uint32_t m_nextUpload;
+
+		mutable std::mutex m_eventLock;
+		std::vector<TraceEvent> m_events;
+		size_t m_nextEvent;
+		uint64_t m_eventCount;
+	};
+}
@@ -0,0 +1,531 @@
+// Utf.cpp : UTF-16 <-> UTF-8 transcoding kernels
+
+#include "Utf.h"
+#include "CpuFeatures.h"
+
+#include <cstring>
+
+#if defined(BS_ARCH_X86)
+#include <immintrin.h>
+#elif defined(BS_ARCH_ARM64)
+#include <arm_neon.h>
+#endif
+
+namespace BigStash
+{
+	namespace
+	{
+		typedef size_t (*Utf16ToUtf8Function)(const uint16_t* text, size_t length, char* output);
+		typedef size_t (*Utf8ToUtf16Function)(const char* text, size_t length, uint16_t* output);
+
+		// The SIMD loops stop this many units (or bytes) short of the end,
+		// so a block's stores, which may write past what the block produced,
+		// stay inside the 3 * length (or length) the caller provides.
+		const size_t SIMD_MARGIN = 16;
+
+		// For UTF-16 units; code points above U+FFFF can match the mask.
+		inline bool IsSurrogate(uint32_t unit)
+		{
+			return (unit & 0xF800) == 0xD800;
+		}
+
+		//
+		//   FUNCTION: EncodeScalar(...)
+		//
+		//   PURPOSE: Encodes the units from in up to end, and the low half of
+		//            a pair that straddles end, as long as it is before length.
+		//            Returns false on a lone surrogate.
+		//
+		bool EncodeScalar(const uint16_t* text, size_t& in, size_t end, size_t length, uint8_t* output, size_t& out)
+		{
+			while (in < end)
+			{
+				uint32_t unit = text[in++];
+				if (unit < 0x80)
+				{
+					output[out++] = (uint8_t)unit;
+				}
+				else if (unit < 0x800)
+				{
+					output[out++] = (uint8_t)(0xC0 | (unit >> 6));
+					output[out++] = (uint8_t)(0x80 | (unit & 0x3F));
+				}
+				else if (!IsSurrogate(unit))
+				{
+					output[out++] = (uint8_t)(0xE0 | (unit >> 12));
+					output[out++] = (uint8_t)(0x80 | ((unit >> 6) & 0x3F));
+					output[out++] = (uint8_t)(0x80 | (unit & 0x3F));
+				}
+				else
+				{
+					if (unit >= 0xDC00 || in == length || (text[in] & 0xFC00) != 0xDC00)
+						return false;
+					uint32_t c = 0x10000 + ((unit - 0xD800) << 10) + (text[in++] - 0xDC00);
+					output[out++] = (uint8_t)(0xF0 | (c >> 18));
+					output[out++] = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+					output[out++] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+					output[out++] = (uint8_t)(0x80 | (c & 0x3F));
+				}
+			}
+			return true;
+		}
+
+		//
+		//   FUNCTION: DecodeOne(...)
+		//
+		//   PURPOSE: Decodes the character at in, which must be before length,
+		//            and moves in past it. Returns false on anything that is
+		//            not well-formed UTF-8.
+		//
+		inline bool DecodeOne(const uint8_t* text, size_t& in, size_t length, uint32_t& c)
+		{
+			c = text[in];
+			if (c < 0x80)
+			{
+				++in;
+				return true;
+			}
+
+			size_t continuation;
+			uint32_t minimum;
+			if ((c & 0xE0) == 0xC0)
+			{
+				continuation = 1;
+				minimum = 0x80;
+				c &= 0x1F;
+			}
+			else if ((c & 0xF0) == 0xE0)
+			{
+				continuation = 2;
+				minimum = 0x800;
+				c &= 0x0F;
+			}
+			else if ((c & 0xF8) == 0xF0)
+			{
+				continuation = 3;
+				minimum = 0x10000;
+				c &= 0x07;
+			}
+			else
+				return false;
+
+			if (length - in <= continuation)
+				return false;
+			for (size_t k = 1; k <= continuation; ++k)
+			{
+				uint32_t byte = text[in + k];
+				if ((byte & 0xC0) != 0x80)
+					return false;
+				c = (c << 6) | (byte & 0x3F);
+			}
+			if (c < minimum || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+				return false;
+			in += continuation + 1;
+			return true;
+		}
+
+		//
+		//   FUNCTION: DecodeScalar(...)
+		//
+		//   PURPOSE: Decodes the characters that start before end (the last
+		//            one may run past it, up to length). Returns false on
+		//            anything that is not well-formed UTF-8.
+		//
+		bool DecodeScalar(const uint8_t* text, size_t& in, size_t end, size_t length, uint16_t* output, size_t& out)
+		{
+			while (in < end)
+			{
+				uint32_t c;
+				if (!DecodeOne(text, in, length, c))
+					return false;
+
+				if (c >= 0x10000)
+				{
+					c -= 0x10000;
+					output[out++] = (uint16_t)(0xD800 | (c >> 10));
+					output[out++] = (uint16_t)(0xDC00 | (c & 0x3FF));
+				}
+				else
+					output[out++] = (uint16_t)c;
+			}
+			return true;
+		}
+
+#if defined(BS_ARCH_X86)
+
+		// The pshufb control that packs the encodings of four units (one to
+		// three bytes in the low bytes of each 32-bit lane) together, for
+		// every combination of the lanes' "two bytes or more" mask (low four
+		// bits of the index) and "three bytes" mask (high four bits).
+		struct PackEntry
+		{
+			alignas(16) uint8_t shuffle[16];
+			uint32_t length;
+		};
+
+		struct PackTable
+		{
+			PackTable()
+			{
+				for (unsigned index = 0; index < 256; ++index)
+				{
+					PackEntry& entry = entries[index];
+					memset(entry.shuffle, 0x80, sizeof(entry.shuffle));
+					unsigned position = 0;
+					for (unsigned lane = 0; lane < 4; ++lane)
+					{
+						unsigned bytes = 1 + ((index >> lane) & 1) + ((index >> (lane + 4)) & 1);
+						for (unsigned byte = 0; byte < bytes; ++byte)
+							entry.shuffle[position++] = (uint8_t)(lane * 4 + byte);
+					}
+					entry.length = position;
+				}
+			}
+
+			PackEntry entries[256];
+		};
+
+		const PackTable g_packTable;
+
+		// Encodes four units below U+D800 or above U+DFFF, zero-extended to
+		// 32 bits, and stores them (16 bytes written, up to 12 used).
+		BS_TARGET("ssse3")
+		inline size_t EncodeFour(__m128i units, uint8_t* output)
+		{
+			const __m128i low6Mask = _mm_set1_epi32(0x3F);
+			const __m128i continuation = _mm_set1_epi32(0x80);
+
+			__m128i low6 = _mm_or_si128(_mm_and_si128(units, low6Mask), continuation);
+			__m128i middle6 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(units, 6), low6Mask), continuation);
+			__m128i two = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(units, 6), _mm_set1_epi32(0xC0)),
+				_mm_slli_epi32(low6, 8));
+			__m128i three = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(units, 12), _mm_set1_epi32(0xE0)),
+				_mm_or_si128(_mm_slli_epi32(middle6, 8), _mm_slli_epi32(low6, 16)));
+
+			__m128i isTwo = _mm_cmpgt_epi32(units, _mm_set1_epi32(0x7F));
+			__m128i isThree = _mm_cmpgt_epi32(units, _mm_set1_epi32(0x7FF));
+			__m128i encoded = _mm_or_si128(_mm_andnot_si128(isTwo, units), _mm_and_si128(isTwo, two));
+			encoded = _mm_or_si128(_mm_andnot_si128(isThree, encoded), _mm_and_si128(isThree, three));
+
+			unsigned index = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(isTwo)) |
+				((unsigned)_mm_movemask_ps(_mm_castsi128_ps(isThree)) << 4);
+			const PackEntry& entry = g_packTable.entries[index];
+			__m128i packed = _mm_shuffle_epi8(encoded, _mm_load_si128(reinterpret_cast<const __m128i*>(entry.shuffle)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output), packed);
+			return entry.length;
+		}
+
+		// Encodes eight units to output + out. Returns false when they hold
+		// a surrogate, which the caller leaves to EncodeScalar.
+		BS_TARGET("ssse3")
+		inline bool EncodeEight(__m128i units, uint8_t* output, size_t& out)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short)0xFF80)), zero)) == 0xFFFF)
+			{
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(output + out), _mm_packus_epi16(units, units));
+				out += 8;
+				return true;
+			}
+
+			__m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short)0xF800)),
+				_mm_set1_epi16((short)0xD800));
+			if (_mm_movemask_epi8(surrogates) != 0)
+				return false;
+
+			out += EncodeFour(_mm_unpacklo_epi16(units, zero), output + out);
+			out += EncodeFour(_mm_unpackhi_epi16(units, zero), output + out);
+			return true;
+		}
+
+		BS_TARGET("ssse3")
+		size_t Utf16ToUtf8Ssse3(const uint16_t* text, size_t length, char* output)
+		{
+			uint8_t* bytes = reinterpret_cast<uint8_t*>(output);
+			size_t in = 0;
+			size_t out = 0;
+			while (length - in >= SIMD_MARGIN)
+			{
+				__m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + in));
+				if (EncodeEight(units, bytes, out))
+					in += 8;
+				else if (!EncodeScalar(text, in, in + 8, length, bytes, out))
+					return UTF_INVALID;
+			}
+			return EncodeScalar(text, in, length, length, bytes, out) ? out : UTF_INVALID;
+		}
+
+		// Sixteen units at a time through the ASCII check, the rest as the
+		// SSSE3 kernel does.
+		BS_TARGET("avx2")
+		size_t Utf16ToUtf8Avx2(const uint16_t* text, size_t length, char* output)
+		{
+			uint8_t* bytes = reinterpret_cast<uint8_t*>(output);
+			size_t in = 0;
+			size_t out = 0;
+			while (length - in >= SIMD_MARGIN)
+			{
+				__m256i units = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + in));
+				__m256i high = _mm256_and_si256(units, _mm256_set1_epi16((short)0xFF80));
+				if (_mm256_testz_si256(high, high))
+				{
+					__m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(units), _mm256_extracti128_si256(units, 1));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(bytes + out), packed);
+					in += 16;
+					out += 16;
+					continue;
+				}
+
+				if (EncodeEight(_mm256_castsi256_si128(units), bytes, out))
+					in += 8;
+				else if (!EncodeScalar(text, in, in + 8, length, bytes, out))
+					return UTF_INVALID;
+			}
+			return EncodeScalar(text, in, length, length, bytes, out) ? out : UTF_INVALID;
+		}
+
+		// Sixteen ASCII bytes at a time; anything else a character at a time
+		// until the block is done.
+		BS_TARGET("sse2")
+		size_t Utf8ToUtf16Sse2(const char* text, size_t length, uint16_t* output)
+		{
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text);
+			const __m128i zero = _mm_setzero_si128();
+			size_t in = 0;
+			size_t out = 0;
+			while (length - in >= SIMD_MARGIN)
+			{
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + in));
+				if (_mm_movemask_epi8(block) == 0)
+				{
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(output + out), _mm_unpacklo_epi8(block, zero));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(output + out + 8), _mm_unpackhi_epi8(block, zero));
+					in += 16;
+					out += 16;
+				}
+				else if (!DecodeScalar(bytes, in, in + 16, length, output, out))
+					return UTF_INVALID;
+			}
+			return DecodeScalar(bytes, in, length, length, output, out) ? out : UTF_INVALID;
+		}
+
+#elif defined(BS_ARCH_ARM64)
+
+		size_t Utf16ToUtf8Neon(const uint16_t* text, size_t length, char* output)
+		{
+			uint8_t* bytes = reinterpret_cast<uint8_t*>(output);
+			size_t in = 0;
+			size_t out = 0;
+			while (length - in >= SIMD_MARGIN)
+			{
+				uint16x8_t units = vld1q_u16(text + in);
+				if (vmaxvq_u16(units) < 0x80)
+				{
+					vst1_u8(bytes + out, vmovn_u16(units));
+					in += 8;
+					out += 8;
+				}
+				else if (!EncodeScalar(text, in, in + 8, length, bytes, out))
+					return UTF_INVALID;
+			}
+			return EncodeScalar(text, in, length, length, bytes, out) ? out : UTF_INVALID;
+		}
+
+		size_t Utf8ToUtf16Neon(const char* text, size_t length, uint16_t* output)
+		{
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text);
+			size_t in = 0;
+			size_t out = 0;
+			while (length - in >= SIMD_MARGIN)
+			{
+				uint8x16_t block = vld1q_u8(bytes + in);
+				if (vmaxvq_u8(block) < 0x80)
+				{
+					vst1q_u16(output + out, vmovl_u8(vget_low_u8(block)));
+					vst1q_u16(output + out + 8, vmovl_u8(vget_high_u8(block)));
+					in += 16;
+					out += 16;
+				}
+				else if (!DecodeScalar(bytes, in, in + 16, length, output, out))
+					return UTF_INVALID;
+			}
+			return DecodeScalar(bytes, in, length, length, output, out) ? out : UTF_INVALID;
+		}
+
+#endif
+
+		struct Kernels
+		{
+			Utf16ToUtf8Function encode;
+			Utf8ToUtf16Function decode;
+			const char* name;
+		};
+
+		Kernels SelectKernels()
+		{
+			Kernels kernels = { Utf16ToUtf8Portable, Utf8ToUtf16Portable, "portable" };
+
+#if defined(BS_ARCH_X86)
+			const CpuFeatures& features = GetCpuFeatures();
+			if (features.sse2)
+				kernels.decode = Utf8ToUtf16Sse2;
+			if (features.avx2)
+			{
+				kernels.encode = Utf16ToUtf8Avx2;
+				kernels.name = "avx2";
+			}
+			else if (features.ssse3)
+			{
+				kernels.encode = Utf16ToUtf8Ssse3;
+				kernels.name = "ssse3";
+			}
+#elif defined(BS_ARCH_ARM64)
+			if (GetCpuFeatures().neon)
+			{
+				kernels.encode = Utf16ToUtf8Neon;
+				kernels.decode = Utf8ToUtf16Neon;
+				kernels.name = "neon";
+			}
+#endif
+			return kernels;
+		}
+
+		const Kernels& GetKernels()
+		{
+			static const Kernels kernels = SelectKernels();
+			return kernels;
+		}
+
+		// The lowercase letters FoldCase maps, in order: every character from
+		// first to last moves by delta, or every other one for a step of 2,
+		// where upper and lowercase letters alternate. Letters whose case pair
+		// differs in length (dotless i, long s) or that only have a pair under
+		// a language's rules are left out, as from the simple case folding.
+		struct CaseRange
+		{
+			uint32_t first;
+			uint32_t last;
+			int32_t delta;
+			uint32_t step;
+		};
+
+		const CaseRange CASE_RANGES[] =
+		{
+			{ 0x00E0, 0x00F6, -32, 1 },     // Latin-1
+			{ 0x00F8, 0x00FE, -32, 1 },
+			{ 0x00FF, 0x00FF, 121, 1 },
+			{ 0x0101, 0x012F, -1, 2 },      // Latin Extended-A
+			{ 0x0133, 0x0137, -1, 2 },
+			{ 0x013A, 0x0148, -1, 2 },
+			{ 0x014B, 0x0177, -1, 2 },
+			{ 0x017A, 0x017E, -1, 2 },
+			{ 0x03AC, 0x03AC, -38, 1 },     // Greek
+			{ 0x03AD, 0x03AF, -37, 1 },
+			{ 0x03B1, 0x03C1, -32, 1 },
+			{ 0x03C2, 0x03C2, -31, 1 },
+			{ 0x03C3, 0x03CB, -32, 1 },
+			{ 0x03CC, 0x03CC, -64, 1 },
+			{ 0x03CD, 0x03CE, -63, 1 },
+			{ 0x0430, 0x044F, -32, 1 },     // Cyrillic
+			{ 0x0450, 0x045F, -80, 1 },
+			{ 0x0461, 0x0481, -1, 2 },
+			{ 0x048B, 0x04BF, -1, 2 },
+			{ 0x04C2, 0x04CE, -1, 2 },
+			{ 0x04CF, 0x04CF, -15, 1 },
+			{ 0x04D1, 0x04FF, -1, 2 },
+			{ 0x0501, 0x052F, -1, 2 },
+			{ 0x0561, 0x0586, -48, 1 },     // Armenian
+			{ 0x1E01, 0x1E95, -1, 2 },      // Latin Extended Additional
+			{ 0x1EA1, 0x1EFF, -1, 2 },
+			{ 0xFF41, 0xFF5A, -32, 1 }      // fullwidth Latin
+		};
+	}
+
+	uint32_t FoldCase(uint32_t c)
+	{
+		if (c < 0x80)
+			return c - 'a' < 26 ? c - 0x20 : c;
+
+		for (size_t i = 0; i < sizeof(CASE_RANGES) / sizeof(CASE_RANGES[0]); ++i)
+		{
+			const CaseRange& range = CASE_RANGES[i];
+			if (c < range.first)
+				break;
+			if (c <= range.last && (c - range.first) % range.step == 0)
+				return (uint32_t)((int32_t)c + range.delta);
+		}
+
+		return c;
+	}
+
+	uint32_t DecodePathChar(const PathChar* text, size_t& in, size_t length)
+	{
+#ifdef _WIN32
+		(void)length;
+		return (uint16_t)text[in++];
+#else
+		uint32_t c;
+		if (!DecodeOne((const uint8_t*)text, in, length, c))
+			c = 0x110000 + (uint8_t)text[in++];
+		return c;
+#endif
+	}
+
+	size_t Utf16ToUtf8Portable(const uint16_t* text, size_t length, char* output)
+	{
+		size_t in = 0;
+		size_t out = 0;
+		return EncodeScalar(text, in, length, length, reinterpret_cast<uint8_t*>(output), out) ? out : UTF_INVALID;
+	}
+
+	size_t Utf8ToUtf16Portable(const char* text, size_t length, uint16_t* output)
+	{
+		size_t in = 0;
+		size_t out = 0;
+		return DecodeScalar(reinterpret_cast<const uint8_t*>(text), in, length, length, output, out) ? out : UTF_INVALID;
+	}
+
+	size_t Utf8ToUtf16Length(const char* text, size_t length)
+	{
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text);
+		size_t in = 0;
+		size_t units = 0;
+		while (in < length)
+		{
+			uint32_t c;
+			if (!DecodeOne(bytes, in, length, c))
+				return UTF_INVALID;
+			units += c >= 0x10000 ? 2 : 1;
+		}
+		return units;
+	}
+
+	size_t Utf16ToUtf8(const uint16_t* text, size_t length, char* output)
+	{
+		return GetKernels().encode(text, length, output);
+	}
+
+	size_t Utf8ToUtf16(const char* text, size_t length, uint16_t* output)
+	{
+		return GetKernels().decode(text, length, output);
+	}
+
+	const char* Utf16ToUtf8Kernel()
+	{
+		return GetKernels().name;
+	}
+
+	BsStatus AppendUtf8(std::string& output, const uint16_t* text, size_t length)
+	{
+		size_t start = output.size();
+		output.resize(start + 3 * length);
+		size_t written = length == 0 ? 0 : Utf16ToUtf8(text, length, &output[start]);
+		if (written == UTF_INVALID)
+		{
+			output.resize(start);
+			return BS_E_CORRUPT;
+		}
+		output.resize(start + written);
+		return BS_OK;
+	}
+}
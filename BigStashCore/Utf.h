@@ -0,0 +1,68 @@
+// Utf.h : Validating UTF-16 <-> UTF-8 transcoding and the path case fold
+
+#pragma once
+
+#include "Platform.h"
+
+#include <type_traits>
+
+namespace BigStash
+{
+	// Returned by the transcoders for input that is not well-formed: a lone
+	// surrogate in UTF-16; an overlong, truncated or out of range sequence,
+	// or an encoded surrogate, in UTF-8.
+	const size_t UTF_INVALID = (size_t)-1;
+
+	// Transcodes length UTF-16 units to UTF-8 in one pass. output must have
+	// room for 3 * length bytes; returns the bytes written. Runs of ASCII
+	// and of characters below U+D800 (or above U+DFFF) go through the SIMD
+	// kernel a block at a time, surrogate pairs through the scalar code.
+	size_t Utf16ToUtf8(const uint16_t* text, size_t length, char* output);
+
+	// Transcodes length bytes of UTF-8 to UTF-16. output must have room for
+	// length units; returns the units written.
+	size_t Utf8ToUtf16(const char* text, size_t length, uint16_t* output);
+
+	// The UTF-16 length of length bytes of UTF-8, without transcoding them.
+	size_t Utf8ToUtf16Length(const char* text, size_t length);
+
+	// The scalar kernels, which the SIMD ones fall back to.
+	size_t Utf16ToUtf8Portable(const uint16_t* text, size_t length, char* output);
+	size_t Utf8ToUtf16Portable(const char* text, size_t length, uint16_t* output);
+
+	// "avx2", "ssse3", "neon" or "portable".
+	const char* Utf16ToUtf8Kernel();
+
+	// Appends text as UTF-8; BS_E_CORRUPT on a lone surrogate, which leaves
+	// output as it was.
+	BsStatus AppendUtf8(std::string& output, const uint16_t* text, size_t length);
+
+	// The simple case fold paths compare with when they ignore case: the
+	// uppercase letter of ASCII, Latin-1, Latin Extended-A, Latin Extended
+	// Additional, Greek, Cyrillic, Armenian and fullwidth Latin letters, and
+	// c itself for anything else. It does not depend on the locale, and it
+	// is the same on every platform. c and its fold always have the same
+	// length in UTF-8 and in UTF-16, so folded names keep their length.
+	uint32_t FoldCase(uint32_t c);
+
+	// Decodes the path character that starts at in, which is past the ASCII
+	// range, and moves in past it. Windows paths go one UTF-16 unit at a time,
+	// as Ordinal-IgnoreCase compares them. Other paths go one UTF-8 character
+	// at a time, and a byte that does not start a well-formed character comes
+	// back as 0x110000 + the byte, which no character folds to.
+	uint32_t DecodePathChar(const PathChar* text, size_t& in, size_t length);
+
+	// The character at in, folded when fold is set, moving in past it.
+	inline uint32_t NextPathChar(const PathChar* text, size_t& in, size_t length, bool fold)
+	{
+		uint32_t c = (uint32_t)(std::make_unsigned<PathChar>::type)text[in];
+		if (c < 0x80)
+		{
+			++in;
+			return fold && c - 'a' < 26 ? c - 0x20 : c;
+		}
+
+		c = DecodePathChar(text, in, length);
+		return fold ? FoldCase(c) : c;
+	}
+}
@@ -0,0 +1,114 @@
+// Xml.cpp : Implementation of the XML helpers
+
+#include "Xml.h"
+
+#include <cstring>
+
+namespace BigStash
+{
+	namespace
+	{
+		std::string XmlUnescape(const std::string& text)
+		{
+			static const struct { const char* entity; char value; } entities[] =
+			{
+				{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' },
+			};
+
+			if (text.find('&') == std::string::npos)
+				return text;
+
+			std::string result;
+			result.reserve(text.size());
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				bool replaced = false;
+				if (text[i] == '&')
+				{
+					for (const auto& entity : entities)
+					{
+						size_t length = strlen(entity.entity);
+						if (text.compare(i, length, entity.entity) == 0)
+						{
+							result += entity.value;
+							i += length - 1;
+							replaced = true;
+							break;
+						}
+					}
+				}
+
+				if (!replaced)
+					result += text[i];
+			}
+
+			return result;
+		}
+
+		bool FindRaw(const std::string& xml, const char* tag, std::string& content, size_t& position)
+		{
+			std::string open = std::string("<") + tag + ">";
+			std::string close = std::string("</") + tag + ">";
+
+			size_t begin = xml.find(open, position);
+			if (begin == std::string::npos)
+				return false;
+			begin += open.size();
+
+			size_t end = xml.find(close, begin);
+			if (end == std::string::npos)
+				return false;
+
+			content = xml.substr(begin, end - begin);
+			position = end + close.size();
+			return true;
+		}
+	}
+
+	std::string XmlEscape(const std::string& text)
+	{
+		std::string result;
+		result.reserve(text.size());
+		for (char c : text)
+		{
+			switch (c)
+			{
+			case '&': result += "&amp;"; break;
+			case '<': result += "&lt;"; break;
+			case '>': result += "&gt;"; break;
+			case '"': result += "&quot;"; break;
+			case '\'': result += "&apos;"; break;
+			default: result += c; break;
+			}
+		}
+
+		return result;
+	}
+
+	bool XmlFindElement(const std::string& xml, const char* tag, std::string& content, size_t& position)
+	{
+		if (!FindRaw(xml, tag, content, position))
+			return false;
+
+		content = XmlUnescape(content);
+		return true;
+	}
+
+	std::string XmlElement(const std::string& xml, const char* tag)
+	{
+		std::string content;
+		size_t position = 0;
+		XmlFindElement(xml, tag, content, position);
+		return content;
+	}
+
+	std::vector<std::string> XmlElements(const std::string& xml, const char* tag)
+	{
+		std::vector<std::string> elements;
+		std::string content;
+		size_t position = 0;
+		while (FindRaw(xml, tag, content, position))
+			elements.push_back(content);
+		return elements;
+	}
+}
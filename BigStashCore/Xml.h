@@ -0,0 +1,24 @@
+// Xml.h : Minimal XML helpers for the S3 request and response bodies.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace BigStash
+{
+	// Escapes &, <, >, " and ' for element content.
+	std::string XmlEscape(const std::string& text);
+
+	// Finds the first <tag>...</tag> at or after position and returns its
+	// unescaped content; position moves past the closing tag. S3 responses
+	// use neither attributes on these elements nor CDATA, so this is enough.
+	bool XmlFindElement(const std::string& xml, const char* tag, std::string& content, size_t& position);
+
+	// The content of the first <tag> element, or an empty string.
+	std::string XmlElement(const std::string& xml, const char* tag);
+
+	// The raw content of every <tag> element, for repeated blocks such as
+	// <Part>.
+	std::vector<std::string> XmlElements(const std::string& xml, const char* tag);
+}
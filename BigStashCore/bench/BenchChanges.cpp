@@ -0,0 +1,548 @@
+// BenchChanges.cpp : Change index benchmark.
+//
+// Checks CChangeIndex (states, reopening, growth, pruning, torn records, a
+// writer killed before it closed the index, a damaged header and the C
+// interface). Then stashes a tree of files twice: a cold run that scans
+// and hashes everything into a new index, and, after some files were
+// rewritten, deleted and added, a warm run that hashes only what the index
+// does not vouch for. The page cache is dropped for the tree before each
+// run. Last, it fills an index with 10M files (1M with --quick) and times
+// opening it, against loading the same records into a hash map.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../ChangeIndex.h"
+#include "../ContentHasher.h"
+#include "../TreeScanner.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		void TestDigest(uint64_t fileId, uint8_t md5[MD5_DIGEST_SIZE])
+		{
+			for (size_t i = 0; i < MD5_DIGEST_SIZE; ++i)
+				md5[i] = (uint8_t)(fileId * 31 + i);
+		}
+
+		bool UpdateTestFile(CChangeIndex& index, uint64_t fileId, uint64_t size)
+		{
+			uint8_t md5[MD5_DIGEST_SIZE];
+			TestDigest(fileId, md5);
+			return index.Update(7, fileId, size, (int64_t)fileId * 10, md5, fileId + 1) == BS_OK;
+		}
+
+		// Unchanged, with the digest and upload UpdateTestFile gave it.
+		bool HasTestFile(CChangeIndex& index, uint64_t fileId, uint64_t size)
+		{
+			ChangeRecord record;
+			if (index.Lookup(7, fileId, size, (int64_t)fileId * 10, record) != CHANGE_UNCHANGED)
+				return false;
+
+			uint8_t md5[MD5_DIGEST_SIZE];
+			TestDigest(fileId, md5);
+			return memcmp(record.md5, md5, MD5_DIGEST_SIZE) == 0 && record.upload == fileId + 1;
+		}
+
+		bool ReadFileBytes(const std::string& path, std::vector<uint8_t>& data)
+		{
+			FILE* file = fopen(path.c_str(), "rb");
+			if (file == NULL)
+				return false;
+
+			data.clear();
+			uint8_t buffer[65536];
+			size_t length;
+			while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+				data.insert(data.end(), buffer, buffer + length);
+			fclose(file);
+			return true;
+		}
+
+		bool WriteFileBytes(const std::string& path, const uint8_t* data, size_t length)
+		{
+			FILE* file = fopen(path.c_str(), "wb");
+			if (file == NULL)
+				return false;
+
+			bool written = fwrite(data, 1, length, file) == length;
+			return fclose(file) == 0 && written;
+		}
+
+		int CheckIndex(const std::string& directory)
+		{
+			std::string path = directory + "/check.index";
+			RemoveFile(path.c_str());
+
+			CChangeIndex index;
+			BENCH_CHECK(index.Open(path.c_str()) == BS_OK, "create");
+			BENCH_CHECK(index.Count() == 0 && index.Capacity() == 1024 && !index.Recovered(), "new index");
+			BENCH_CHECK(index.BeginRun() == 1, "first run");
+
+			for (uint64_t fileId = 1; fileId <= 3; ++fileId)
+				BENCH_CHECK(UpdateTestFile(index, fileId, 100), "update");
+			BENCH_CHECK(UpdateTestFile(index, 2, 100), "update again");
+			BENCH_CHECK(index.Count() == 3, "count");
+
+			ChangeRecord record;
+			BENCH_CHECK(HasTestFile(index, 1, 100), "unchanged");
+			BENCH_CHECK(index.Lookup(7, 1, 101, 10, record) == CHANGE_MODIFIED, "size changed");
+			BENCH_CHECK(index.Lookup(7, 1, 100, 11, record) == CHANGE_MODIFIED, "written since");
+			BENCH_CHECK(index.Lookup(8, 1, 100, 10, record) == CHANGE_NEW, "other volume");
+			BENCH_CHECK(index.Lookup(7, 4, 100, 40, record) == CHANGE_NEW, "unknown file");
+			BENCH_CHECK(index.Lookup(0, 0, 0, 0, record) == CHANGE_NEW, "no identity");
+
+			uint8_t md5[MD5_DIGEST_SIZE] = { 0 };
+			BENCH_CHECK(index.Update(7, 0, 1, 1, md5, 0) == BS_E_INVALIDARG, "update without an identity");
+			index.Close();
+
+			BENCH_CHECK(index.Open(path.c_str()) == BS_OK, "reopen");
+			BENCH_CHECK(!index.Recovered() && index.Count() == 3 && index.Generation() == 1, "reopened index");
+			for (uint64_t fileId = 1; fileId <= 3; ++fileId)
+				BENCH_CHECK(HasTestFile(index, fileId, 100), "kept across reopening");
+
+			// Growing rewrites the index; everything stays.
+			for (uint64_t fileId = 4; fileId <= 5000; ++fileId)
+				BENCH_CHECK(UpdateTestFile(index, fileId, fileId), "update while growing");
+			BENCH_CHECK(index.Count() == 5000 && index.Capacity() == 8192, "grown");
+			for (uint64_t fileId = 1; fileId <= 5000; ++fileId)
+				BENCH_CHECK(HasTestFile(index, fileId, fileId <= 3 ? 100 : fileId), "kept when growing");
+
+			// A run that only sees the first 100 files.
+			BENCH_CHECK(index.BeginRun() == 2, "second run");
+			for (uint64_t fileId = 1; fileId <= 100; ++fileId)
+				BENCH_CHECK(index.Lookup(7, fileId, 0, 0, record) == CHANGE_MODIFIED, "seen");
+
+			uint64_t removed;
+			BENCH_CHECK(index.Prune(2, removed) == BS_OK && removed == 0, "prune keeping two runs");
+			BENCH_CHECK(index.Prune(1, removed) == BS_OK && removed == 4900, "prune");
+			BENCH_CHECK(index.Count() == 100, "count after pruning");
+			BENCH_CHECK(HasTestFile(index, 50, 50) && !HasTestFile(index, 150, 150), "pruned");
+			index.Close();
+
+			// A torn record reads as modified, never with a wrong digest.
+			std::vector<uint8_t> data;
+			BENCH_CHECK(ReadFileBytes(path, data), "read the index");
+			size_t torn = 0;
+			for (size_t offset = 64; offset + 64 <= data.size() && torn == 0; offset += 64)
+			{
+				ChangeRecord stored;
+				memcpy(&stored, &data[offset], sizeof(stored));
+				if (stored.fileId == 42)
+					torn = offset;
+			}
+			BENCH_CHECK(torn != 0, "record on disk");
+			data[torn + offsetof(ChangeRecord, md5)] ^= 0xFF;
+			BENCH_CHECK(WriteFileBytes(path, data.data(), data.size()), "write the index");
+
+			BENCH_CHECK(index.Open(path.c_str()) == BS_OK, "open after tearing");
+			BENCH_CHECK(index.Lookup(7, 42, 42, 420, record) == CHANGE_MODIFIED, "torn record");
+			BENCH_CHECK(HasTestFile(index, 43, 43), "other records");
+			index.Close();
+
+			// A writer that dies with the index open.
+			pid_t child = fork();
+			BENCH_CHECK(child >= 0, "fork");
+			if (child == 0)
+			{
+				CChangeIndex writer;
+				bool updated = writer.Open(path.c_str()) == BS_OK;
+				for (uint64_t fileId = 6000; updated && fileId < 6010; ++fileId)
+					updated = UpdateTestFile(writer, fileId, fileId);
+				_exit(updated ? 0 : 1);
+			}
+			int childStatus;
+			BENCH_CHECK(waitpid(child, &childStatus, 0) == child && WIFEXITED(childStatus) &&
+				WEXITSTATUS(childStatus) == 0, "writer");
+
+			BENCH_CHECK(index.Open(path.c_str()) == BS_OK, "open after the writer died");
+			BENCH_CHECK(index.Recovered() && index.Count() == 110, "recounted");
+			BENCH_CHECK(HasTestFile(index, 6005, 6005), "the dead writer's record");
+			index.Close();
+
+			BENCH_CHECK(index.Open(path.c_str()) == BS_OK && !index.Recovered(), "closed cleanly");
+			index.Close();
+
+			data.assign(4096, 0x5A);
+			BENCH_CHECK(WriteFileBytes(path, data.data(), data.size()), "write garbage");
+			BENCH_CHECK(index.Open(path.c_str()) == BS_E_CORRUPT, "not an index");
+			data.resize(10);
+			BENCH_CHECK(WriteFileBytes(path, data.data(), data.size()), "write a stub");
+			BENCH_CHECK(index.Open(path.c_str()) == BS_E_CORRUPT, "short file");
+
+			RemoveFile(path.c_str());
+			return 0;
+		}
+
+		int CheckCApi(const std::string& directory)
+		{
+			std::string path = directory + "/api.index";
+			RemoveFile(path.c_str());
+
+			BsChangeIndex* index = NULL;
+			BENCH_CHECK(BsChangeIndexOpen(path.c_str(), 10, &index) == BS_OK, "open");
+			uint32_t generation;
+			BENCH_CHECK(BsChangeIndexBeginRun(index, &generation) == BS_OK && generation == 1, "begin run");
+
+			BsScanRecord records[3];
+			memset(records, 0, sizeof(records));
+			for (int i = 0; i < 3; ++i)
+			{
+				records[i].path = "/data/file";
+				records[i].pathLength = 10;
+				records[i].nameOffset = 6;
+				records[i].size = 100;
+				records[i].lastWriteTime = 1000;
+				records[i].volume = 1;
+				records[i].fileId = 10 + i;
+			}
+			records[2].flags = BS_SCAN_SKIPPED_REPARSE_POINT;
+
+			uint8_t md5[16];
+			memset(md5, 0xAB, sizeof(md5));
+			BENCH_CHECK(BsChangeIndexUpdate(index, &records[0], md5, 77) == BS_OK, "update");
+			BENCH_CHECK(BsChangeIndexUpdate(index, &records[1], md5, 78) == BS_OK, "update");
+			BENCH_CHECK(BsChangeIndexFlush(index) == BS_OK, "flush");
+
+			records[1].lastWriteTime = 1001;
+			uint8_t states[3];
+			BsChangeEntry entries[3];
+			BENCH_CHECK(BsChangeIndexLookup(index, records, 3, states, entries) == BS_OK, "lookup");
+			BENCH_CHECK(states[0] == BS_CHANGE_UNCHANGED && states[1] == BS_CHANGE_MODIFIED &&
+				states[2] == BS_CHANGE_NEW, "states");
+			BENCH_CHECK(memcmp(entries[0].md5, md5, 16) == 0 && entries[0].upload == 77, "entry");
+
+			uint64_t removed;
+			BENCH_CHECK(BsChangeIndexPrune(index, 1, &removed) == BS_OK && removed == 0, "prune");
+			BENCH_CHECK(BsChangeIndexPrune(index, 0, &removed) == BS_E_INVALIDARG, "prune nothing");
+			BENCH_CHECK(BsChangeIndexUpdate(index, &records[0], NULL, 0) == BS_E_INVALIDARG, "no digest");
+			BsChangeIndexClose(index);
+
+			RemoveFile(path.c_str());
+			return 0;
+		}
+
+		// Takes the tree's files out of the page cache, so hashing reads
+		// them from the disk.
+		void DropCache(const std::vector<std::string>& paths)
+		{
+			for (const std::string& path : paths)
+			{
+				int fd = open(path.c_str(), O_RDONLY);
+				if (fd < 0)
+					continue;
+				fdatasync(fd);
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+				close(fd);
+			}
+		}
+
+		struct RunResult
+		{
+			RunResult() : files(0), hashed(0), hashedBytes(0), unchanged(0), pruned(0), indexed(0), seconds(0) {}
+
+			uint64_t files;
+			uint64_t hashed;
+			uint64_t hashedBytes;
+			uint64_t unchanged;
+			uint64_t pruned;
+			uint64_t indexed;
+			double seconds;
+
+			// MD5 (hex) of every file, hashed or from the index.
+			std::unordered_map<std::string, std::string> digests;
+		};
+
+		std::string Hex(const uint8_t md5[MD5_DIGEST_SIZE])
+		{
+			static const char digits[] = "0123456789abcdef";
+			std::string hex;
+			for (size_t i = 0; i < MD5_DIGEST_SIZE; ++i)
+			{
+				hex += digits[md5[i] >> 4];
+				hex += digits[md5[i] & 15];
+			}
+			return hex;
+		}
+
+		// One stash of the tree: scan, look every batch up, hash what the
+		// index does not vouch for and record it, then prune the files this
+		// run did not see.
+		int RunStash(const BenchOptions& options, const std::string& root, const std::string& indexPath,
+			RunResult& result)
+		{
+			CStopwatch stopwatch;
+
+			CChangeIndex index;
+			BENCH_CHECK(index.Open(indexPath.c_str(), 1024) == BS_OK, "open the index");
+			index.BeginRun();
+
+			std::vector<ScanEntry> pending;
+			std::vector<PathString> paths;
+			std::vector<uint8_t> states;
+			std::vector<ChangeRecord> records;
+
+			ScanOptions scanOptions;
+			scanOptions.threadCount = options.threads;
+			CTreeScanner scanner(scanOptions, [&](const CScanBatch& batch)
+			{
+				states.resize(batch.Count());
+				records.resize(batch.Count());
+				LookupChanges(index, batch, states.data(), records.data());
+
+				for (size_t i = 0; i < batch.Count(); ++i)
+				{
+					const ScanEntry& entry = batch.m_entries[i];
+					if (entry.flags != 0)
+						continue;
+
+					PathString path(batch.Path(entry), entry.pathLength);
+					result.files++;
+					if (states[i] == CHANGE_UNCHANGED)
+					{
+						result.unchanged++;
+						result.digests[path] = Hex(records[i].md5);
+					}
+					else
+					{
+						pending.push_back(entry);
+						paths.push_back(path);
+					}
+				}
+			});
+			BENCH_CHECK(scanner.Run(std::vector<PathString>(1, root)) == BS_OK, "scan");
+
+			std::vector<ContentDigest> digests;
+			std::vector<BsStatus> statuses;
+			HashFiles(paths, 5 * 1024 * 1024, options.threads, digests, statuses);
+
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				BENCH_CHECK(statuses[i] == BS_OK, "hash");
+				const ScanEntry& entry = pending[i];
+				BENCH_CHECK(index.Update(entry.volume, entry.fileId, entry.size, entry.lastWriteTime,
+					digests[i].md5, 1) == BS_OK, "update the index");
+
+				result.hashed++;
+				result.hashedBytes += entry.size;
+				result.digests[paths[i]] = digests[i].Md5Hex();
+			}
+
+			BENCH_CHECK(index.Prune(1, result.pruned) == BS_OK, "prune");
+			result.indexed = index.Count();
+			index.Close();
+
+			result.seconds = stopwatch.Seconds();
+			return 0;
+		}
+
+		int RunRescan(const BenchOptions& options)
+		{
+			std::string root = options.workDir + "/changes";
+			std::string indexPath = options.workDir + "/changes.index";
+			RemoveTree(root);
+			RemoveFile(indexPath.c_str());
+
+			SyntheticTreeOptions treeOptions;
+			treeOptions.files = FileCount(options, 50000, 5000);
+			treeOptions.minSize = 1024;
+			treeOptions.maxSize = 64 * 1024;
+			treeOptions.writeContent = true;
+			SyntheticTreeInfo info;
+			if (!CreateSyntheticTree(root, treeOptions, info, true))
+				return 1;
+
+			DropCache(info.paths);
+			RunResult cold;
+			if (RunStash(options, root, indexPath, cold) != 0)
+				return 1;
+			BENCH_CHECK(cold.files == info.files && cold.hashed == info.files, "cold run hashes everything");
+
+			// Between the runs: one file in 100 rewritten, one in 500 deleted
+			// and a few new ones.
+			uint64_t state = 99;
+			uint64_t rewritten = 0;
+			uint64_t deleted = 0;
+			std::vector<std::string> paths;
+			std::unordered_set<std::string> rewrittenPaths;
+			for (size_t i = 0; i < info.paths.size(); ++i)
+			{
+				const std::string& path = info.paths[i];
+				if (i % 500 == 250)
+				{
+					BENCH_CHECK(unlink(path.c_str()) == 0, "delete");
+					deleted++;
+					continue;
+				}
+
+				if (i % 100 == 7)
+				{
+					struct stat st;
+					BENCH_CHECK(stat(path.c_str(), &st) == 0, "stat");
+					std::vector<uint8_t> content((size_t)st.st_size);
+					FillRandom(content.data(), content.size(), state);
+					BENCH_CHECK(WriteFileBytes(path, content.data(), content.size()), "rewrite");
+					rewrittenPaths.insert(path);
+					rewritten++;
+				}
+				paths.push_back(path);
+			}
+
+			uint64_t added = treeOptions.files / 1000 + 1;
+			for (uint64_t i = 0; i < added; ++i)
+			{
+				std::vector<uint8_t> content(4096);
+				FillRandom(content.data(), content.size(), state);
+				std::string path = root + "/added-" + std::to_string(i) + ".bin";
+				BENCH_CHECK(WriteFileBytes(path, content.data(), content.size()), "add");
+				paths.push_back(path);
+			}
+
+			DropCache(paths);
+			RunResult warm;
+			if (RunStash(options, root, indexPath, warm) != 0)
+				return 1;
+
+			BENCH_CHECK(warm.files == paths.size(), "warm run file count");
+			BENCH_CHECK(warm.hashed == rewritten + added, "warm run hashes the changed files only");
+			// New files may reuse the inodes of deleted ones, whose records
+			// they then replace.
+			BENCH_CHECK(warm.pruned <= deleted && warm.indexed == warm.files, "deleted files are pruned");
+
+			// Every digest, stored or fresh, is the file's.
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				ContentDigest digest;
+				BENCH_CHECK(HashFile(paths[i].c_str(), 5 * 1024 * 1024, digest) == BS_OK, "rehash");
+				BENCH_CHECK(warm.digests[paths[i]] == digest.Md5Hex(), "warm digest");
+				if (rewrittenPaths.count(paths[i]) == 0 && cold.digests.count(paths[i]) != 0)
+					BENCH_CHECK(cold.digests[paths[i]] == digest.Md5Hex(), "cold digest");
+			}
+
+			Report("changes", "files", (double)warm.files, "files");
+			Report("changes", "cold_seconds", cold.seconds, "s");
+			Report("changes", "cold_files_hashed", (double)cold.hashed, "files");
+			Report("changes", "cold_mb_hashed", cold.hashedBytes / 1048576.0, "MB");
+			Report("changes", "warm_seconds", warm.seconds, "s");
+			Report("changes", "warm_files_hashed", (double)warm.hashed, "files");
+			Report("changes", "warm_mb_hashed", warm.hashedBytes / 1048576.0, "MB");
+			Report("changes", "warm_vs_cold", cold.seconds / warm.seconds, "x");
+
+			RemoveTree(root);
+			RemoveFile(indexPath.c_str());
+			return 0;
+		}
+
+		int RunLargeIndex(const BenchOptions& options)
+		{
+			uint64_t count = options.quick ? 1000000 : 10000000;
+			std::string path = options.workDir + "/large.index";
+			RemoveFile(path.c_str());
+
+			CStopwatch stopwatch;
+			{
+				CChangeIndex index;
+				BENCH_CHECK(index.Open(path.c_str(), count) == BS_OK, "create");
+				index.BeginRun();
+				for (uint64_t i = 0; i < count; ++i)
+				{
+					// Inodes come in runs.
+					uint64_t fileId = 1000 + i + (i / 1000) * 37;
+					if (!UpdateTestFile(index, fileId, i))
+					{
+						fprintf(stderr, "update %llu failed\n", (unsigned long long)i);
+						return 1;
+					}
+				}
+				BENCH_CHECK(index.Count() == count, "count");
+			}
+			double fillSeconds = stopwatch.Seconds();
+
+			struct stat st;
+			BENCH_CHECK(stat(path.c_str(), &st) == 0, "index size");
+
+			stopwatch.Restart();
+			CChangeIndex index;
+			BENCH_CHECK(index.Open(path.c_str()) == BS_OK, "open");
+			double openSeconds = stopwatch.Seconds();
+			BENCH_CHECK(index.Count() == count && !index.Recovered(), "opened index");
+
+			const uint64_t lookups = 1000000;
+			stopwatch.Restart();
+			for (uint64_t n = 0; n < lookups; ++n)
+			{
+				uint64_t i = n * 2654435761u % count;
+				uint64_t fileId = 1000 + i + (i / 1000) * 37;
+				if (!HasTestFile(index, fileId, i))
+				{
+					fprintf(stderr, "file %llu not found\n", (unsigned long long)i);
+					return 1;
+				}
+			}
+			double lookupSeconds = stopwatch.Seconds();
+			index.Close();
+
+			// What loading the records into a map, as a serialized index
+			// would need, costs.
+			stopwatch.Restart();
+			std::unordered_map<uint64_t, ChangeRecord> loaded;
+			{
+				loaded.reserve(count);
+				FILE* file = fopen(path.c_str(), "rb");
+				BENCH_CHECK(file != NULL, "open for loading");
+				std::vector<ChangeRecord> records(4096);
+				fseek(file, 64, SEEK_SET);
+				size_t read;
+				while ((read = fread(records.data(), sizeof(ChangeRecord), records.size(), file)) > 0)
+				{
+					for (size_t i = 0; i < read; ++i)
+					{
+						if (records[i].fileId != 0)
+							loaded[records[i].fileId] = records[i];
+					}
+				}
+				fclose(file);
+			}
+			double loadSeconds = stopwatch.Seconds();
+			BENCH_CHECK(loaded.size() == count, "loaded records");
+
+			Report("changes", "index_files", (double)count, "files");
+			Report("changes", "index_mb", st.st_size / 1048576.0, "MB");
+			Report("changes", "index_fill_files_per_second", count / fillSeconds, "files/s");
+			Report("changes", "index_open_ms", openSeconds * 1000, "ms");
+			Report("changes", "index_lookups_per_second", lookups / lookupSeconds, "lookups/s");
+			Report("changes", "reference_load_ms", loadSeconds * 1000, "ms");
+
+			RemoveFile(path.c_str());
+			return 0;
+		}
+	}
+
+	int RunChangesBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+
+		int result = CheckIndex(options.workDir);
+		if (result == 0)
+			result = CheckCApi(options.workDir);
+		if (result == 0)
+			result = RunRescan(options);
+		if (result == 0)
+			result = RunLargeIndex(options);
+		return result;
+	}
+}
@@ -0,0 +1,73 @@
+// BenchCommon.h : Shared helpers of the BigStashCore benchmarks.
+//
+// The benchmarks are POSIX programs meant for the Linux build boxes. Each
+// suite checks the results it measures against a straightforward reference
+// implementation and fails when they disagree, so a fast but wrong change
+// cannot slip through as an improvement.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace BigStashBench
+{
+	struct BenchOptions
+	{
+		BenchOptions() : files(0), threads(0), quick(false) {}
+
+		// Scratch directory for generated data.
+		std::string workDir;
+
+		// Number of files (or entries) to generate, 0 picks the suite default.
+		uint64_t files;
+
+		// Worker threads, 0 picks the processor count.
+		unsigned threads;
+
+		// Smaller data sets for a quick smoke run.
+		bool quick;
+	};
+
+	class CStopwatch
+	{
+	public:
+		CStopwatch() : m_start(std::chrono::steady_clock::now()) {}
+
+		void Restart() { m_start = std::chrono::steady_clock::now(); }
+
+		double Seconds() const
+		{
+			return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+		}
+
+	private:
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	// Prints one measurement as "suite.metric value unit" and keeps it for
+	// the --json results file.
+	void Report(const char* suite, const char* metric, double value, const char* unit);
+
+	// Fails the running suite when a measured result is wrong.
+#define BENCH_CHECK(condition, message) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s (%s)\n", __FILE__, __LINE__, #condition, message); \
+			return 1; \
+		} \
+	} \
+	while (0)
+
+	// Picks the suite default unless the command line asked for a size.
+	inline uint64_t FileCount(const BenchOptions& options, uint64_t full, uint64_t quick)
+	{
+		if (options.files != 0)
+			return options.files;
+		return options.quick ? quick : full;
+	}
+}
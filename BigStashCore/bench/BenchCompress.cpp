@@ -0,0 +1,454 @@
+// BenchCompress.cpp : Inline compression benchmark.
+//
+// Checks the sniffing (compressed formats, random and text content) and
+// runs CPartCompressor over a mixed corpus, a log, a CSV export, a disk
+// image and a photo, inflating what it hands out and comparing it with the
+// file, and the part digests with a fresh MD5. Then uploads the corpus to
+// the S3 stand-in over a shaped link (10 MB/s, 2 MB/s with --quick, and a
+// typical S3 latency), once as it is and once through the compressor, and
+// reports the time of each, checking the ETag of every compressed object
+// against the local digest of the stored stream.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../PartCompressor.h"
+#include "../PartPlanner.h"
+#include "../S3Client.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const size_t INPUT_SIZE = 1024 * 1024;
+		const uint64_t PART_SIZE = S3_MIN_PART_SIZE;
+		const unsigned RESPONSE_DELAY_MS = 30;
+		const char* BUCKET = "bench-bucket";
+
+		enum CorpusKind
+		{
+			CORPUS_LOG,
+			CORPUS_CSV,
+			CORPUS_DISK,
+			CORPUS_PHOTO
+		};
+
+		struct CorpusFile
+		{
+			const char* name;
+			CorpusKind kind;
+		};
+
+		const CorpusFile CORPUS[] =
+		{
+			{ "service.log", CORPUS_LOG },
+			{ "orders.csv", CORPUS_CSV },
+			{ "disk.vhdx", CORPUS_DISK },
+			{ "photo.jpg", CORPUS_PHOTO }
+		};
+
+		uint64_t NextRandom(uint64_t& state)
+		{
+			state = state * 6364136223846793005ull + 1442695040888963407ull;
+			return state >> 33;
+		}
+
+		void AppendLine(std::string& text, CorpusKind kind, uint64_t& state, uint64_t line)
+		{
+			static const char* const levels[] = { "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR" };
+			static const char* const events[] =
+			{
+				"upload part %u of archive %u took %u ms",
+				"connection %u to s3.amazonaws.com reused after %u requests (%u ms idle)",
+				"retrying part %u of archive %u after %u ms: InternalError",
+				"scanned %u files in %u directories in %u ms"
+			};
+			static const char* const statuses[] = { "paid", "pending", "refunded", "shipped" };
+
+			char buffer[256];
+			uint32_t a = (uint32_t)(NextRandom(state) % 10000);
+			uint32_t b = (uint32_t)(NextRandom(state) % 100000);
+			uint32_t c = (uint32_t)(NextRandom(state) % 5000);
+			if (kind == CORPUS_LOG)
+			{
+				char message[128];
+				snprintf(message, sizeof(message), events[NextRandom(state) % 4], a, b, c);
+				snprintf(buffer, sizeof(buffer), "2026-10-17T%02u:%02u:%02u.%03uZ %s [worker-%u] %s\n",
+					(unsigned)(line / 3600000 % 24), (unsigned)(line / 60000 % 60), (unsigned)(line / 1000 % 60),
+					(unsigned)(line % 1000), levels[NextRandom(state) % 6], (unsigned)(NextRandom(state) % 8), message);
+			}
+			else
+			{
+				snprintf(buffer, sizeof(buffer), "%llu,2026-%02u-%02u,user%05u@example.com,%u.%02u,%s\n",
+					(unsigned long long)line + 1, (unsigned)(a % 12 + 1), (unsigned)(b % 28 + 1), (unsigned)b, c,
+					(unsigned)(a % 100), statuses[NextRandom(state) % 4]);
+			}
+			text += buffer;
+		}
+
+		// Generates size bytes of the kind of content.
+		void MakeContent(CorpusKind kind, uint64_t size, std::vector<uint8_t>& content)
+		{
+			content.clear();
+			content.reserve((size_t)size);
+			uint64_t state = 1 + kind;
+
+			if (kind == CORPUS_LOG || kind == CORPUS_CSV)
+			{
+				std::string text;
+				if (kind == CORPUS_CSV)
+					text = "id,date,email,amount,status\n";
+				for (uint64_t line = 0; text.size() < size; ++line)
+					AppendLine(text, kind, state, line * 37);
+				content.assign(text.begin(), text.begin() + (size_t)size);
+			}
+			else if (kind == CORPUS_DISK)
+			{
+				// Free space, file system structures and file data.
+				std::vector<uint8_t> block(4096);
+				std::string text;
+				while (content.size() < size)
+				{
+					uint64_t pick = NextRandom(state) % 100;
+					if (pick < 55)
+						std::fill(block.begin(), block.end(), 0);
+					else if (pick < 80)
+					{
+						text.clear();
+						while (text.size() < block.size())
+							AppendLine(text, CORPUS_LOG, state, content.size());
+						memcpy(block.data(), text.data(), block.size());
+					}
+					else
+						FillRandom(block.data(), block.size(), state);
+					content.insert(content.end(), block.begin(), block.end());
+				}
+				content.resize((size_t)size);
+			}
+			else
+			{
+				content.resize((size_t)size);
+				FillRandom(content.data(), content.size(), state);
+				static const uint8_t jpeg[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F' };
+				memcpy(content.data(), jpeg, std::min(sizeof(jpeg), content.size()));
+			}
+		}
+
+		bool WriteContent(const std::string& path, const std::vector<uint8_t>& content)
+		{
+			CFile file;
+			return file.Open(path.c_str(), FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE) == BS_OK &&
+				file.WriteAt(0, content.data(), content.size()) == BS_OK;
+		}
+
+		bool Gunzip(const std::vector<uint8_t>& compressed, std::vector<uint8_t>& raw, size_t expected)
+		{
+			raw.resize(expected + 1);
+			z_stream stream;
+			memset(&stream, 0, sizeof(stream));
+			if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+				return false;
+			stream.next_in = const_cast<Bytef*>(compressed.data());
+			stream.avail_in = (uInt)compressed.size();
+			stream.next_out = raw.data();
+			stream.avail_out = (uInt)raw.size();
+			int result = inflate(&stream, Z_FINISH);
+			raw.resize(raw.size() - stream.avail_out);
+			inflateEnd(&stream);
+			return result == Z_STREAM_END && stream.avail_in == 0;
+		}
+
+		int CheckSniff()
+		{
+			std::vector<uint8_t> content;
+			SniffResult result;
+
+			MakeContent(CORPUS_LOG, 256 * 1024, content);
+			SniffContent(content.data(), content.size(), 7.5, result);
+			BENCH_CHECK(result.compressible && result.format == NULL && result.entropy < 6, "log sniffed");
+
+			MakeContent(CORPUS_PHOTO, 256 * 1024, content);
+			SniffContent(content.data(), content.size(), 7.5, result);
+			BENCH_CHECK(!result.compressible && strcmp(result.format, "jpeg") == 0, "photo sniffed");
+
+			// random without a signature, and with one at an offset.
+			content[0] = 0;
+			SniffContent(content.data(), content.size(), 7.5, result);
+			BENCH_CHECK(!result.compressible && result.format == NULL && result.entropy > 7.9, "random sniffed");
+			memcpy(content.data() + 4, "ftypisom", 8);
+			content.assign(content.begin(), content.begin() + 16);
+			SniffContent(content.data(), content.size(), 8, result);
+			BENCH_CHECK(!result.compressible && strcmp(result.format, "mp4") == 0, "mp4 sniffed");
+			return 0;
+		}
+
+		struct Stored
+		{
+			std::vector<uint8_t> bytes;
+			ContentCodec codec;
+			ContentDigest digest;
+			double seconds;
+		};
+
+		// Runs the file through the compressor alone and collects what it
+		// hands out, checking every part on the way.
+		int CompressLocally(const std::string& path, uint64_t size, const PartCompressorOptions& options, Stored& stored)
+		{
+			CBufferPool inputPool(INPUT_SIZE, 5);
+			CPartReader input(inputPool);
+			BENCH_CHECK(input.Open(path.c_str(), UniformParts(size, INPUT_SIZE), PartReaderOptions()) == BS_OK, "open");
+
+			CBufferPool outputPool((size_t)options.partSize, 3);
+			CPartCompressor compressor(outputPool);
+			CStopwatch stopwatch;
+			BENCH_CHECK(compressor.Open(input, options) == BS_OK, "open the compressor");
+
+			stored.bytes.clear();
+			PartData* part;
+			BsStatus status;
+			uint32_t expected = 1;
+			bool shortPart = false;
+			while ((status = compressor.Next(part)) == BS_OK)
+			{
+				BENCH_CHECK(part->partNumber == expected++ && !shortPart, "part order");
+				shortPart = part->length != options.partSize;
+				BENCH_CHECK(part->offset == stored.bytes.size(), "part offset");
+
+				uint8_t md5[MD5_DIGEST_SIZE];
+				CMd5::Hash(part->data, part->length, md5);
+				BENCH_CHECK(part->hasMd5 && memcmp(md5, part->md5, sizeof(md5)) == 0, "part MD5");
+				stored.bytes.insert(stored.bytes.end(), part->data, part->data + part->length);
+				compressor.Release(part);
+			}
+			stored.seconds = stopwatch.Seconds();
+			BENCH_CHECK(status == BS_E_NOMOREITEMS, "compressor failed");
+			BENCH_CHECK(compressor.RawBytes() == size && compressor.StoredBytes() == stored.bytes.size(), "byte counts");
+			BENCH_CHECK(compressor.GetContentDigest(stored.digest), "no stored digest");
+
+			uint8_t md5[MD5_DIGEST_SIZE];
+			CMd5::Hash(stored.bytes.data(), stored.bytes.size(), md5);
+			BENCH_CHECK(memcmp(md5, stored.digest.md5, sizeof(md5)) == 0, "stored MD5");
+			stored.codec = compressor.Codec();
+			return 0;
+		}
+
+		int CheckRoundTrip(const std::string& workDir)
+		{
+			std::string path = workDir + "/compress-check.bin";
+			std::vector<uint8_t> content;
+			std::vector<uint8_t> raw;
+			Stored stored;
+
+			PartCompressorOptions options;
+			options.compression.format = COMPRESSION_GZIP;
+			options.compression.threads = 2;
+			options.partSize = 64 * 1024;
+
+			const uint64_t sizes[] = { 0, 1, 100 * 1024, 3 * 1024 * 1024 + 17 };
+			for (const CorpusFile& file : CORPUS)
+			{
+				for (uint64_t size : sizes)
+				{
+					MakeContent(file.kind, size, content);
+					BENCH_CHECK(WriteContent(path, content), "write");
+					if (CompressLocally(path, size, options, stored) != 0)
+						return 1;
+
+					if (stored.codec == CODEC_NONE)
+						BENCH_CHECK(stored.bytes == content, "stored as it is");
+					else
+					{
+						BENCH_CHECK(stored.codec == CODEC_GZIP, "codec");
+						BENCH_CHECK(Gunzip(stored.bytes, raw, content.size()) && raw == content, "round trip");
+					}
+					BENCH_CHECK((stored.codec == CODEC_NONE) == (size == 0 || (file.kind == CORPUS_PHOTO && size > 1)),
+						"decision");
+				}
+			}
+
+			// Without sniffing even the photo is compressed, and still round
+			// trips.
+			options.sniffBytes = 0;
+			MakeContent(CORPUS_PHOTO, 200 * 1024, content);
+			BENCH_CHECK(WriteContent(path, content), "write");
+			if (CompressLocally(path, content.size(), options, stored) != 0)
+				return 1;
+			BENCH_CHECK(stored.codec == CODEC_GZIP && Gunzip(stored.bytes, raw, content.size()) && raw == content,
+				"forced round trip");
+
+			// Parts under the minimum: fine while the output fits in one,
+			// refused once it needs a second.
+			options.sniffBytes = PartCompressorOptions().sniffBytes;
+			options.minPartSize = 2 * options.partSize;
+			MakeContent(CORPUS_PHOTO, 1000, content);
+			BENCH_CHECK(WriteContent(path, content), "write");
+			if (CompressLocally(path, content.size(), options, stored) != 0)
+				return 1;
+
+			MakeContent(CORPUS_PHOTO, 200 * 1024, content);
+			BENCH_CHECK(WriteContent(path, content), "write");
+			{
+				CBufferPool inputPool(INPUT_SIZE, 5);
+				CPartReader input(inputPool);
+				BENCH_CHECK(input.Open(path.c_str(), UniformParts(content.size(), INPUT_SIZE), PartReaderOptions()) == BS_OK,
+					"open");
+
+				CBufferPool outputPool((size_t)options.partSize, 3);
+				CPartCompressor compressor(outputPool);
+				BENCH_CHECK(compressor.Open(input, options) == BS_OK, "open the compressor");
+
+				PartData* part;
+				BsStatus status;
+				uint32_t parts = 0;
+				while ((status = compressor.Next(part)) == BS_OK)
+				{
+					++parts;
+					compressor.Release(part);
+				}
+				BENCH_CHECK(status == BS_E_INVALIDARG && parts <= 1, "second part under the minimum");
+			}
+
+			unlink(path.c_str());
+			return 0;
+		}
+
+		// Uploads the file, as it is or through the compressor, and
+		// completes the object; etag receives what the stand-in stored.
+		int Upload(CS3Client& client, const std::string& path, const std::string& key, uint64_t size, bool compress,
+			const PartCompressorOptions& compressorOptions, CS3StandIn& server, std::string& etag)
+		{
+			std::string uploadId;
+			BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, key, uploadId) == BS_OK, "initiate failed");
+
+			std::vector<S3Part> uploaded;
+			BsStatus status;
+			PartReaderOptions readerOptions;
+			unsigned window = client.Options().connections;
+			if (compress)
+			{
+				CBufferPool inputPool(INPUT_SIZE, readerOptions.readAhead + 1);
+				CPartReader input(inputPool);
+				BENCH_CHECK(input.Open(path.c_str(), UniformParts(size, INPUT_SIZE), readerOptions) == BS_OK, "open");
+				CBufferPool outputPool((size_t)compressorOptions.partSize, window + 2);
+				CPartCompressor compressor(outputPool);
+				BENCH_CHECK(compressor.Open(input, compressorOptions) == BS_OK, "open the compressor");
+				status = client.UploadParts(BUCKET, key, uploadId, compressor, uploaded);
+			}
+			else
+			{
+				CBufferPool pool(PART_SIZE, readerOptions.readAhead + window);
+				CPartReader reader(pool);
+				BENCH_CHECK(reader.Open(path.c_str(), UniformParts(size, PART_SIZE), readerOptions) == BS_OK, "open");
+				status = client.UploadParts(BUCKET, key, uploadId, reader, uploaded);
+			}
+			BENCH_CHECK(status == BS_OK, "UploadParts failed");
+
+			BENCH_CHECK(client.CompleteMultipartUpload(BUCKET, key, uploadId, uploaded, etag) == BS_OK, "complete failed");
+			std::string stored;
+			BENCH_CHECK(server.CompletedETag("/" + std::string(BUCKET) + "/" + key, stored) && stored == etag,
+				"object missing");
+			return 0;
+		}
+
+		int RunSlowLink(const BenchOptions& options)
+		{
+			uint64_t size = options.quick ? 8ull * 1024 * 1024 : 64ull * 1024 * 1024;
+			uint64_t bandwidth = options.quick ? 2000000 : 10000000;
+
+			PartCompressorOptions compressorOptions;
+			compressorOptions.partSize = PART_SIZE;
+			compressorOptions.compression.threads = options.threads;
+
+			S3StandInOptions serverOptions;
+			serverOptions.verifyMd5 = false;
+			serverOptions.responseDelayMs = RESPONSE_DELAY_MS;
+			serverOptions.bandwidth = bandwidth;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			S3ClientOptions clientOptions;
+			clientOptions.host = "127.0.0.1";
+			clientOptions.port = server.Port();
+			clientOptions.connections = 4;
+			CS3Client client(clientOptions);
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			double rawTotal = 0;
+			double compressedTotal = 0;
+			uint64_t storedTotal = 0;
+			std::vector<uint8_t> content;
+			for (const CorpusFile& file : CORPUS)
+			{
+				std::string path = options.workDir + "/" + file.name;
+				MakeContent(file.kind, size, content);
+				BENCH_CHECK(WriteContent(path, content), "write");
+
+				// What the upload must end up storing.
+				Stored stored;
+				if (CompressLocally(path, size, compressorOptions, stored) != 0)
+					return 1;
+
+				std::string etag;
+				CStopwatch stopwatch;
+				if (Upload(client, path, std::string("raw/") + file.name, size, false, compressorOptions, server, etag) != 0)
+					return 1;
+				double rawSeconds = stopwatch.Seconds();
+
+				stopwatch.Restart();
+				if (Upload(client, path, std::string("compressed/") + file.name, size, true, compressorOptions, server,
+					etag) != 0)
+					return 1;
+				double compressedSeconds = stopwatch.Seconds();
+				BENCH_CHECK(etag == "\"" + stored.digest.ETag(true) + "\"", "compressed object differs");
+
+				rawTotal += rawSeconds;
+				compressedTotal += compressedSeconds;
+				storedTotal += stored.bytes.size();
+
+				std::string metric = std::string(file.name) + "_ratio";
+				Report("compress", metric.c_str(), (double)size / stored.bytes.size(), "x");
+				metric = std::string(file.name) + "_compress_mb_per_second";
+				Report("compress", metric.c_str(), size / 1e6 / stored.seconds, "MB/s");
+				metric = std::string(file.name) + "_raw_s";
+				Report("compress", metric.c_str(), rawSeconds, "s");
+				metric = std::string(file.name) + "_compressed_s";
+				Report("compress", metric.c_str(), compressedSeconds, "s");
+				unlink(path.c_str());
+			}
+
+			Report("compress", "link_mb_per_second", bandwidth / 1e6, "MB/s");
+			Report("compress", "corpus_mb", sizeof(CORPUS) / sizeof(CORPUS[0]) * size / 1e6, "MB");
+			Report("compress", "stored_mb", storedTotal / 1e6, "MB");
+			Report("compress", "raw_upload_s", rawTotal, "s");
+			Report("compress", "compressed_upload_s", compressedTotal, "s");
+			Report("compress", "speedup", rawTotal / compressedTotal, "x");
+
+			client.Stop();
+			server.Stop();
+			return 0;
+		}
+	}
+
+	int RunCompressBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+
+		int result = CheckSniff();
+		if (result == 0)
+			result = CheckRoundTrip(options.workDir);
+		if (result == 0)
+			result = RunSlowLink(options);
+		return result;
+	}
+}
@@ -0,0 +1,586 @@
+// BenchCrypt.cpp : Client-side encryption benchmark.
+//
+// Checks every kernel the processor has against the AES-256 vectors of the
+// GCM specification (McGrew and Viega, test cases 13 to 16) and against the
+// portable kernel over lengths around each batch boundary, and that a
+// tampered part or a part under the wrong number is refused. Reads a file
+// through an encrypting CPartReader in shuffled part order, decrypting every
+// part back, does the same with the compressed parts of CPartCompressor,
+// and uploads a file to the S3 stand-in, checking the ETag and the resume
+// plan. Then measures each kernel on one core, encrypting and
+// decrypting in place, and the reader with and without encryption.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../AesGcm.h"
+#include "../File.h"
+#include "../PartCompressor.h"
+#include "../PartPlanner.h"
+#include "../PartReader.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const uint64_t PART_SIZE = S3_MIN_PART_SIZE;
+		const char* BUCKET = "bench-bucket";
+		const AesKernel KERNELS[] = { AES_KERNEL_PORTABLE, AES_KERNEL_AESNI, AES_KERNEL_VAES };
+
+		struct Vector
+		{
+			const char* key;
+			const char* nonce;
+			const char* plaintext;
+			const char* aad;
+			const char* ciphertext;
+			const char* tag;
+		};
+
+		const Vector VECTORS[] =
+		{
+			{
+				"0000000000000000000000000000000000000000000000000000000000000000",
+				"000000000000000000000000", "", "", "",
+				"530f8afbc74536b9a963b4f1c4cb738b"
+			},
+			{
+				"0000000000000000000000000000000000000000000000000000000000000000",
+				"000000000000000000000000",
+				"00000000000000000000000000000000", "",
+				"cea7403d4d606b6e074ec5d3baf39d18",
+				"d0d1c8a799996bf0265b98b5d48ab919"
+			},
+			{
+				"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+				"cafebabefacedbaddecaf888",
+				"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+				"1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255", "",
+				"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+				"8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+				"b094dac5d93471bdec1a502270e3cc6c"
+			},
+			{
+				"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+				"cafebabefacedbaddecaf888",
+				"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+				"1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+				"feedfacedeadbeeffeedfacedeadbeefabaddad2",
+				"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+				"8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+				"76fc6ece0f4e1768cddf8853bb2d551b"
+			}
+		};
+
+		std::vector<uint8_t> FromHex(const char* hex)
+		{
+			std::vector<uint8_t> bytes;
+			for (size_t i = 0; hex[i] != 0 && hex[i + 1] != 0; i += 2)
+			{
+				unsigned value;
+				sscanf(hex + i, "%2x", &value);
+				bytes.push_back((uint8_t)value);
+			}
+			return bytes;
+		}
+
+		bool WriteWhole(const std::string& path, const std::vector<uint8_t>& content)
+		{
+			CFile file;
+			return file.Open(path.c_str(), FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE) == BS_OK &&
+				file.WriteAt(0, content.data(), content.size()) == BS_OK;
+		}
+
+		int CheckVectors()
+		{
+			for (AesKernel kernel : KERNELS)
+			{
+				if (!AesKernelSupported(kernel))
+					continue;
+
+				for (const Vector& vector : VECTORS)
+				{
+					std::vector<uint8_t> key = FromHex(vector.key);
+					std::vector<uint8_t> nonce = FromHex(vector.nonce);
+					std::vector<uint8_t> data = FromHex(vector.plaintext);
+					std::vector<uint8_t> aad = FromHex(vector.aad);
+					std::vector<uint8_t> expected = FromHex(vector.ciphertext);
+					std::vector<uint8_t> expectedTag = FromHex(vector.tag);
+					std::vector<uint8_t> plaintext = data;
+
+					CAesGcm cipher;
+					cipher.SetKey(key.data(), kernel);
+					BENCH_CHECK(cipher.Kernel() == kernel, AesKernelName(kernel));
+
+					uint8_t tag[GCM_TAG_SIZE];
+					cipher.Encrypt(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag);
+					BENCH_CHECK(data == expected, "ciphertext");
+					BENCH_CHECK(memcmp(tag, expectedTag.data(), GCM_TAG_SIZE) == 0, "tag");
+
+					BENCH_CHECK(cipher.Decrypt(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag),
+						"decrypt");
+					BENCH_CHECK(data == plaintext, "plaintext");
+
+					if (!data.empty())
+					{
+						cipher.Encrypt(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag);
+						data[data.size() / 2] ^= 1;
+						BENCH_CHECK(!cipher.Decrypt(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag),
+							"tampered data accepted");
+						BENCH_CHECK(std::count(data.begin(), data.end(), 0) == (long)data.size(), "plaintext left behind");
+					}
+				}
+			}
+			return 0;
+		}
+
+		// Every hardware kernel against the portable one, at lengths around
+		// the 8 and 16 block batches and with AAD of every alignment.
+		int CheckKernels()
+		{
+			uint64_t state = 19;
+			uint8_t key[AES256_KEY_SIZE];
+			uint8_t nonce[GCM_NONCE_SIZE];
+			FillRandom(key, sizeof(key), state);
+			FillRandom(nonce, sizeof(nonce), state);
+
+			CAesGcm portable;
+			portable.SetKey(key, AES_KERNEL_PORTABLE);
+
+			std::vector<size_t> lengths;
+			for (size_t length = 0; length <= 600; ++length)
+				lengths.push_back(length);
+			const size_t large[] = { 4095, 4096, 4097, 65536 + 255, 1048576 + 16 * 16 + 37 };
+			lengths.insert(lengths.end(), large, large + sizeof(large) / sizeof(large[0]));
+
+			std::vector<uint8_t> original;
+			uint8_t aad[40];
+			FillRandom(aad, sizeof(aad), state);
+
+			for (AesKernel kernel : KERNELS)
+			{
+				if (kernel == AES_KERNEL_PORTABLE || !AesKernelSupported(kernel))
+					continue;
+
+				CAesGcm cipher;
+				cipher.SetKey(key, kernel);
+				for (size_t length : lengths)
+				{
+					original.resize(length);
+					FillRandom(original.data(), original.size(), state);
+					size_t aadLength = length % (sizeof(aad) + 1);
+
+					std::vector<uint8_t> expected = original;
+					std::vector<uint8_t> data = original;
+					uint8_t expectedTag[GCM_TAG_SIZE];
+					uint8_t tag[GCM_TAG_SIZE];
+					portable.Encrypt(nonce, aad, aadLength, expected.data(), expected.size(), expectedTag);
+					cipher.Encrypt(nonce, aad, aadLength, data.data(), data.size(), tag);
+					BENCH_CHECK(data == expected, AesKernelName(kernel));
+					BENCH_CHECK(memcmp(tag, expectedTag, GCM_TAG_SIZE) == 0, AesKernelName(kernel));
+
+					BENCH_CHECK(cipher.Decrypt(nonce, aad, aadLength, data.data(), data.size(), tag), "decrypt");
+					BENCH_CHECK(data == original, "round trip");
+				}
+			}
+			return 0;
+		}
+
+		// Reads a file through an encrypting reader, its parts in a shuffled
+		// order, and opens every part again.
+		int CheckParts(const std::string& workDir)
+		{
+			std::string path = workDir + "/crypt-parts";
+			uint64_t state = 23;
+			std::vector<uint8_t> content(3 * 1024 * 1024 + 1000);
+			FillRandom(content.data(), content.size(), state);
+			BENCH_CHECK(WriteWhole(path, content), "write");
+
+			uint8_t key[AES256_KEY_SIZE];
+			BENCH_CHECK(RandomBytes(key, sizeof(key)) == BS_OK, "RandomBytes");
+			CAesGcm cipher;
+			cipher.SetKey(key);
+
+			PartReaderOptions options;
+			options.computeSha256 = true;
+			options.encryption.cipher = &cipher;
+			BENCH_CHECK(RandomBytes(options.encryption.nonce, GCM_NONCE_SIZE) == BS_OK, "RandomBytes");
+
+			const uint64_t partSize = 1024 * 1024;
+			std::vector<PartSpan> parts = UniformParts(content.size(), partSize);
+			CBufferPool pool(partSize + GCM_TAG_SIZE, 4);
+
+			// no room for the tag, and no in-place encryption of mapped views.
+			{
+				CBufferPool small(partSize, 2);
+				CPartReader reader(small);
+				BENCH_CHECK(reader.Open(path.c_str(), parts, options) == BS_E_INVALIDARG, "pool without room for the tag");
+				PartReaderOptions mapped = options;
+				mapped.mode = PART_READ_MAPPED;
+				CPartReader mappedReader(pool);
+				BENCH_CHECK(mappedReader.Open(path.c_str(), parts, mapped) == BS_E_INVALIDARG, "mapped encryption");
+			}
+
+			// In order, for the whole-file digest of the content.
+			{
+				CPartReader reader(pool);
+				BENCH_CHECK(reader.Open(path.c_str(), parts, options) == BS_OK, "open");
+				PartData* part;
+				uint64_t sent = 0;
+				while (reader.Next(part) == BS_OK)
+				{
+					BENCH_CHECK(part->length == parts[part->partNumber - 1].length + GCM_TAG_SIZE, "sealed length");
+					uint8_t md5[MD5_DIGEST_SIZE];
+					CMd5::Hash(part->data, part->length, md5);
+					BENCH_CHECK(part->hasMd5 && memcmp(md5, part->md5, MD5_DIGEST_SIZE) == 0, "part MD5");
+					sent += part->length;
+					reader.Release(part);
+				}
+				BENCH_CHECK(sent == content.size() + parts.size() * GCM_TAG_SIZE, "bytes sent");
+
+				ContentDigest digest;
+				uint8_t md5[MD5_DIGEST_SIZE];
+				CMd5::Hash(content.data(), content.size(), md5);
+				BENCH_CHECK(reader.GetContentDigest(digest) && memcmp(digest.md5, md5, MD5_DIGEST_SIZE) == 0,
+					"content MD5");
+			}
+
+			// Shuffled, as a resume or parallel readers would ask for them.
+			std::vector<PartSpan> shuffled = parts;
+			std::reverse(shuffled.begin(), shuffled.end());
+			std::swap(shuffled[0], shuffled[1]);
+
+			CPartReader reader(pool);
+			BENCH_CHECK(reader.Open(path.c_str(), shuffled, options) == BS_OK, "open");
+			PartData* part;
+			std::vector<uint8_t> sealed;
+			size_t opened = 0;
+			while (reader.Next(part) == BS_OK)
+			{
+				sealed.assign(part->data, part->data + part->length);
+				uint8_t sha256[SHA256_DIGEST_SIZE];
+				CSha256::Hash(sealed.data(), sealed.size(), sha256);
+				BENCH_CHECK(part->hasSha256 && memcmp(sha256, part->sha256, SHA256_DIGEST_SIZE) == 0, "part SHA-256");
+
+				// under another part's number it must not open.
+				size_t length;
+				std::vector<uint8_t> copy = sealed;
+				uint32_t other = part->partNumber % (uint32_t)parts.size() + 1;
+				BENCH_CHECK(!OpenPart(options.encryption, other, copy.data(), copy.size(), length), "part swapped");
+
+				BENCH_CHECK(OpenPart(options.encryption, part->partNumber, sealed.data(), sealed.size(), length),
+					"open part");
+				BENCH_CHECK(length == part->length - GCM_TAG_SIZE &&
+					memcmp(sealed.data(), content.data() + part->offset, length) == 0, "decrypted part");
+
+				// and the C interface agrees.
+				copy.assign(part->data, part->data + part->length);
+				uint64_t plainLength = 0;
+				BENCH_CHECK(BsDecryptPart(key, options.encryption.nonce, part->partNumber, copy.data(), copy.size(),
+					&plainLength) == BS_OK && plainLength == length, "BsDecryptPart");
+				copy[0] ^= 0x80;
+				BENCH_CHECK(BsDecryptPart(key, options.encryption.nonce, part->partNumber, copy.data(), copy.size(),
+					NULL) == BS_E_CORRUPT, "BsDecryptPart tampered");
+
+				++opened;
+				reader.Release(part);
+			}
+			BENCH_CHECK(opened == parts.size(), "parts read");
+
+			unlink(path.c_str());
+			return 0;
+		}
+
+		// Compresses a log through CPartCompressor twice, once encrypting
+		// the stored parts, which must open to the parts of the other run.
+		int CheckCompressed(const std::string& workDir)
+		{
+			std::string path = workDir + "/crypt-log";
+			std::vector<uint8_t> content;
+			for (unsigned i = 0; content.size() < 3 * 1024 * 1024; ++i)
+			{
+				char line[96];
+				int length = snprintf(line, sizeof(line), "2024-03-01 12:%02u:%02u INFO part %u of upload %u finished\n",
+					i / 60 % 60, i % 60, i % 10000, i * 2654435761u % 100003);
+				content.insert(content.end(), line, line + length);
+			}
+			BENCH_CHECK(WriteWhole(path, content), "write");
+
+			uint8_t key[AES256_KEY_SIZE];
+			BENCH_CHECK(RandomBytes(key, sizeof(key)) == BS_OK, "RandomBytes");
+			CAesGcm cipher;
+			cipher.SetKey(key);
+
+			const uint64_t partSize = 16 * 1024;
+			std::vector<std::vector<uint8_t> > stored[2];
+			for (int sealed = 0; sealed < 2; ++sealed)
+			{
+				PartCompressorOptions options;
+				options.partSize = partSize;
+				if (sealed)
+				{
+					options.encryption.cipher = &cipher;
+					BENCH_CHECK(RandomBytes(options.encryption.nonce, GCM_NONCE_SIZE) == BS_OK, "RandomBytes");
+				}
+
+				PartReaderOptions readerOptions;
+				CBufferPool inputPool(1024 * 1024, readerOptions.readAhead + 1);
+				CPartReader input(inputPool);
+				BENCH_CHECK(input.Open(path.c_str(), UniformParts(content.size(), 1024 * 1024), readerOptions) == BS_OK,
+					"open");
+
+				CBufferPool outputPool(partSize + (sealed ? GCM_TAG_SIZE : 0), 4);
+				CPartCompressor compressor(outputPool);
+				if (sealed)
+				{
+					CBufferPool small(partSize, 2);
+					CPartCompressor refused(small);
+					BENCH_CHECK(refused.Open(input, options) == BS_E_INVALIDARG, "pool without room for the tag");
+				}
+				BENCH_CHECK(compressor.Open(input, options) == BS_OK, "open the compressor");
+
+				PartData* part;
+				while (compressor.Next(part) == BS_OK)
+				{
+					std::vector<uint8_t> bytes(part->data, part->data + part->length);
+					uint8_t md5[MD5_DIGEST_SIZE];
+					CMd5::Hash(bytes.data(), bytes.size(), md5);
+					BENCH_CHECK(part->hasMd5 && memcmp(md5, part->md5, MD5_DIGEST_SIZE) == 0, "part MD5");
+					if (sealed)
+					{
+						size_t length;
+						BENCH_CHECK(OpenPart(options.encryption, part->partNumber, bytes.data(), bytes.size(), length),
+							"open part");
+						bytes.resize(length);
+					}
+					stored[sealed].push_back(bytes);
+					compressor.Release(part);
+				}
+				BENCH_CHECK(compressor.Codec() != CODEC_NONE, "log not compressed");
+			}
+			BENCH_CHECK(stored[0].size() > 1 && stored[0] == stored[1], "encrypted compressed parts");
+
+			unlink(path.c_str());
+			return 0;
+		}
+
+		// Uploads a file encrypted through the C interface, checks the ETag
+		// against the sealed parts and plans a resume from the listed parts.
+		int CheckUpload(const std::string& workDir)
+		{
+			std::string path = workDir + "/crypt-upload";
+			uint64_t state = 29;
+			std::vector<uint8_t> content(2 * PART_SIZE + 12345);
+			FillRandom(content.data(), content.size(), state);
+			BENCH_CHECK(WriteWhole(path, content), "write");
+
+			S3StandInOptions serverOptions;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			BsS3Options clientOptions;
+			memset(&clientOptions, 0, sizeof(clientOptions));
+			clientOptions.host = "127.0.0.1";
+			clientOptions.port = server.Port();
+			clientOptions.connections = 2;
+			clientOptions.payloadSigning = BS_S3_PAYLOAD_UNSIGNED;
+			BsS3Client* client;
+			BENCH_CHECK(BsS3Open(&clientOptions, &client) == BS_OK, "BsS3Open");
+
+			BsEncryptOptions encryption;
+			uint8_t key[BS_AES256_KEY_SIZE];
+			BENCH_CHECK(BsRandomBytes(key, sizeof(key)) == BS_OK, "BsRandomBytes");
+			BENCH_CHECK(BsRandomBytes(encryption.nonce, sizeof(encryption.nonce)) == BS_OK, "BsRandomBytes");
+			encryption.key = key;
+
+			const char* objectKey = "encrypted/file";
+			char uploadId[256];
+			BENCH_CHECK(BsS3InitiateMultipartUpload(client, BUCKET, objectKey, uploadId, sizeof(uploadId)) == BS_OK,
+				"initiate");
+
+			// The last part first, then the others, as a resume would.
+			uint32_t last = 3;
+			BENCH_CHECK(BsS3UploadFileEncrypted(client, BUCKET, objectKey, uploadId, path.c_str(), PART_SIZE, &last, 1,
+				BS_PART_READER_MD5, &encryption, NULL, NULL) == BS_OK, "upload the last part");
+			BENCH_CHECK(BsS3UploadFileEncrypted(client, BUCKET, objectKey, uploadId, path.c_str(), PART_SIZE, &last, 1,
+				BS_PART_READER_MAPPED, &encryption, NULL, NULL) == BS_E_INVALIDARG, "mapped encryption");
+
+			BsS3Part listed[4];
+			uint32_t count = 0;
+			BENCH_CHECK(BsS3ListParts(client, BUCKET, objectKey, uploadId, listed, 4, &count) == BS_OK && count == 1,
+				"list parts");
+			uint64_t plainSize = listed[0].size - BS_GCM_TAG_SIZE;
+			uint32_t remaining[4];
+			uint32_t remainingCount = 0;
+			BENCH_CHECK(BsPlanRemainingParts(content.size(), PART_SIZE, &listed[0].partNumber, &plainSize, 1, remaining,
+				4, &remainingCount, NULL) == BS_OK && remainingCount == 2 && remaining[0] == 1 && remaining[1] == 2,
+				"resume plan");
+			BENCH_CHECK(BsS3UploadFileEncrypted(client, BUCKET, objectKey, uploadId, path.c_str(), PART_SIZE, remaining,
+				remainingCount, BS_PART_READER_MD5, &encryption, NULL, NULL) == BS_OK, "upload the rest");
+
+			// What the object must hold: every part sealed on its own.
+			CAesGcm cipher;
+			cipher.SetKey(key);
+			PartEncryption partEncryption;
+			partEncryption.cipher = &cipher;
+			memcpy(partEncryption.nonce, encryption.nonce, GCM_NONCE_SIZE);
+
+			std::vector<PartSpan> parts = UniformParts(content.size(), PART_SIZE);
+			std::vector<uint8_t> digests;
+			std::vector<uint8_t> sealed;
+			for (const PartSpan& span : parts)
+			{
+				sealed.assign(content.begin() + span.offset, content.begin() + span.offset + span.length);
+				sealed.resize(sealed.size() + GCM_TAG_SIZE);
+				SealPart(partEncryption, span.partNumber, sealed.data(), (size_t)span.length);
+				uint8_t md5[MD5_DIGEST_SIZE];
+				CMd5::Hash(sealed.data(), sealed.size(), md5);
+				digests.insert(digests.end(), md5, md5 + MD5_DIGEST_SIZE);
+			}
+
+			char etag[128];
+			BENCH_CHECK(BsS3ListParts(client, BUCKET, objectKey, uploadId, listed, 4, &count) == BS_OK && count == 3,
+				"list parts");
+			for (uint32_t i = 0; i < count; ++i)
+				BENCH_CHECK(listed[i].size == parts[listed[i].partNumber - 1].length + BS_GCM_TAG_SIZE, "part size");
+			BENCH_CHECK(BsS3CompleteMultipartUpload(client, BUCKET, objectKey, uploadId, listed, count, etag,
+				sizeof(etag)) == BS_OK, "complete");
+			BsS3Close(client);
+
+			uint8_t md5[MD5_DIGEST_SIZE];
+			CMd5::Hash(digests.data(), digests.size(), md5);
+			char expected[64];
+			int written = 0;
+			for (size_t i = 0; i < MD5_DIGEST_SIZE; ++i)
+				written += snprintf(expected + written, sizeof(expected) - written, "%02x", md5[i]);
+			snprintf(expected + written, sizeof(expected) - written, "-%zu", parts.size());
+			BENCH_CHECK(std::string(etag) == "\"" + std::string(expected) + "\"", "object ETag");
+
+			server.Stop();
+			unlink(path.c_str());
+			return 0;
+		}
+
+		// MB/s of one core encrypting and decrypting a buffer in place.
+		int MeasureKernels(const BenchOptions& options)
+		{
+			size_t size = options.quick ? 16 * 1024 * 1024 : 64 * 1024 * 1024;
+			std::vector<uint8_t> data(size);
+			uint64_t state = 31;
+			FillRandom(data.data(), data.size(), state);
+			uint8_t key[AES256_KEY_SIZE];
+			uint8_t nonce[GCM_NONCE_SIZE];
+			FillRandom(key, sizeof(key), state);
+			FillRandom(nonce, sizeof(nonce), state);
+
+			Report("crypt", (std::string("best_kernel_") + AesKernelName(AesBestKernel())).c_str(), 1, "");
+			for (AesKernel kernel : KERNELS)
+			{
+				if (!AesKernelSupported(kernel))
+					continue;
+
+				CAesGcm cipher;
+				cipher.SetKey(key, kernel);
+
+				// the portable kernel gets a slice; it is there for reference.
+				size_t length = kernel == AES_KERNEL_PORTABLE ? size / 16 : size;
+				int rounds = options.quick ? 2 : 4;
+				uint8_t tag[GCM_TAG_SIZE];
+				double encryptSeconds = 0;
+				double decryptSeconds = 0;
+				for (int round = 0; round < rounds; ++round)
+				{
+					CStopwatch stopwatch;
+					cipher.Encrypt(nonce, NULL, 0, data.data(), length, tag);
+					encryptSeconds += stopwatch.Seconds();
+
+					stopwatch.Restart();
+					bool ok = cipher.Decrypt(nonce, NULL, 0, data.data(), length, tag);
+					decryptSeconds += stopwatch.Seconds();
+					BENCH_CHECK(ok, "decrypt");
+				}
+
+				std::string metric = std::string(AesKernelName(kernel)) + "_encrypt_mb_per_second_per_core";
+				Report("crypt", metric.c_str(), rounds * length / 1e6 / encryptSeconds, "MB/s");
+				metric = std::string(AesKernelName(kernel)) + "_decrypt_mb_per_second_per_core";
+				Report("crypt", metric.c_str(), rounds * length / 1e6 / decryptSeconds, "MB/s");
+			}
+			return 0;
+		}
+
+		// The reader thread from the page cache, with and without encryption:
+		// what the part path costs on top of reading and hashing.
+		int MeasureReader(const BenchOptions& options)
+		{
+			std::string path = options.workDir + "/crypt-reader";
+			size_t size = options.quick ? 64 * 1024 * 1024 : 512 * 1024 * 1024;
+			std::vector<uint8_t> content(size);
+			uint64_t state = 37;
+			FillRandom(content.data(), content.size(), state);
+			BENCH_CHECK(WriteWhole(path, content), "write");
+			std::vector<uint8_t>().swap(content);
+
+			uint8_t key[AES256_KEY_SIZE];
+			FillRandom(key, sizeof(key), state);
+			CAesGcm cipher;
+			cipher.SetKey(key);
+
+			std::vector<PartSpan> parts = UniformParts(size, PART_SIZE);
+			CBufferPool pool(PART_SIZE + GCM_TAG_SIZE, 6);
+			double seconds[2];
+			for (int sealed = 0; sealed < 2; ++sealed)
+			{
+				PartReaderOptions readerOptions;
+				if (sealed)
+					readerOptions.encryption.cipher = &cipher;
+
+				// a warm-up pass leaves the file in the cache for both.
+				for (int pass = 0; pass < 2; ++pass)
+				{
+					CPartReader reader(pool);
+					CStopwatch stopwatch;
+					BENCH_CHECK(reader.Open(path.c_str(), parts, readerOptions) == BS_OK, "open");
+					PartData* part;
+					while (reader.Next(part) == BS_OK)
+						reader.Release(part);
+					seconds[sealed] = stopwatch.Seconds();
+				}
+			}
+
+			Report("crypt", "reader_md5_mb_per_second", size / 1e6 / seconds[0], "MB/s");
+			Report("crypt", "reader_md5_aes_gcm_mb_per_second", size / 1e6 / seconds[1], "MB/s");
+			unlink(path.c_str());
+			return 0;
+		}
+	}
+
+	int RunCryptBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+
+		int result = CheckVectors();
+		if (result == 0)
+			result = CheckKernels();
+		if (result == 0)
+			result = CheckParts(options.workDir);
+		if (result == 0)
+			result = CheckCompressed(options.workDir);
+		if (result == 0)
+			result = CheckUpload(options.workDir);
+		if (result == 0)
+			result = MeasureKernels(options);
+		if (result == 0)
+			result = MeasureReader(options);
+		return result;
+	}
+}
@@ -0,0 +1,269 @@
+// BenchDedup.cpp : Duplicate content benchmark.
+//
+// Generates a tree of files with content and copies a known share of them
+// (one in five) next to it, along with decoys of the same size: copies with
+// the first byte changed, which the samples tell apart, and copies with a
+// byte in the middle changed, which only hashing the whole file does. Runs
+// FindDuplicates over everything and checks it against hashing every file
+// whole and grouping the digests, with the page cache dropped before each.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../DuplicateFinder.h"
+#include "../File.h"
+#include "../Sha256.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		void DropCache(const std::vector<PathString>& paths)
+		{
+			for (const PathString& path : paths)
+			{
+				int fd = open(path.c_str(), O_RDONLY);
+				if (fd < 0)
+					continue;
+				fdatasync(fd);
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+				close(fd);
+			}
+		}
+
+		bool ReadWhole(const std::string& path, std::vector<uint8_t>& content)
+		{
+			CFile file;
+			uint64_t size;
+			if (file.Open(path.c_str()) != BS_OK || file.GetSize(size) != BS_OK)
+				return false;
+			content.resize((size_t)size);
+			size_t bytesRead;
+			return file.ReadAt(0, content.data(), content.size(), bytesRead) == BS_OK && bytesRead == size;
+		}
+
+		bool WriteWhole(const std::string& path, const std::vector<uint8_t>& content)
+		{
+			CFile file;
+			return file.Open(path.c_str(), FILE_OPEN_WRITE | FILE_OPEN_TRUNCATE) == BS_OK &&
+				file.WriteAt(0, content.data(), content.size()) == BS_OK;
+		}
+
+		// The reference: every file hashed whole, the first file of each
+		// content being the one the others duplicate.
+		void ReferenceDuplicates(const std::vector<PathString>& paths, const std::vector<uint64_t>& sizes,
+			std::vector<uint32_t>& duplicateOf, uint64_t& bytesSaved)
+		{
+			std::map<std::string, uint32_t> firsts;
+			std::vector<uint8_t> content;
+			duplicateOf.assign(paths.size(), NO_DUPLICATE);
+			bytesSaved = 0;
+
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				if (sizes[i] == 0 || !ReadWhole(paths[i], content))
+					continue;
+
+				uint8_t digest[SHA256_DIGEST_SIZE];
+				CSha256::Hash(content.data(), content.size(), digest);
+				std::string key((const char*)digest, sizeof(digest));
+				key.append((const char*)&sizes[i], sizeof(sizes[i]));
+
+				auto inserted = firsts.insert(std::make_pair(key, (uint32_t)i));
+				if (!inserted.second)
+				{
+					duplicateOf[i] = inserted.first->second;
+					bytesSaved += sizes[i];
+				}
+			}
+		}
+
+		// Small cases: the decoys, a file that changed size after the scan,
+		// empty files and the C interface.
+		int CheckEdges(const std::string& workDir)
+		{
+			std::string root = workDir + "/dedup-edges";
+			RemoveTree(root);
+			mkdir(root.c_str(), 0755);
+
+			uint64_t state = 7;
+			std::vector<uint8_t> content(300 * 1024);
+			FillRandom(content.data(), content.size(), state);
+
+			std::vector<PathString> paths;
+			std::vector<uint64_t> sizes;
+			auto add = [&](const char* name, const std::vector<uint8_t>& bytes)
+			{
+				std::string path = root + "/" + name;
+				paths.push_back(path);
+				sizes.push_back(bytes.size());
+				return WriteWhole(path, bytes);
+			};
+
+			std::vector<uint8_t> head = content;
+			head[0] ^= 1;
+			std::vector<uint8_t> middle = content;
+			middle[middle.size() / 2] ^= 1;
+			std::vector<uint8_t> small(1000, 'x');
+			std::vector<uint8_t> empty;
+
+			BENCH_CHECK(add("a", content), "write");
+			BENCH_CHECK(add("b", head), "write");
+			BENCH_CHECK(add("c", middle), "write");
+			BENCH_CHECK(add("d", content), "write");
+			BENCH_CHECK(add("e", small), "write");
+			BENCH_CHECK(add("f", small), "write");
+			BENCH_CHECK(add("g", empty), "write");
+			BENCH_CHECK(add("h", empty), "write");
+			BENCH_CHECK(add("i", content), "write");
+			BENCH_CHECK(add("j", std::vector<uint8_t>(999, 'x')), "write");
+			sizes[9] = small.size();  // the file shrank after the scan
+			paths.push_back(root + "/missing");
+			sizes.push_back(content.size());
+
+			std::vector<uint32_t> duplicateOf;
+			DuplicateStats stats;
+			FindDuplicates(paths, sizes, DuplicateOptions(), duplicateOf, stats);
+
+			const uint32_t expected[] = { NO_DUPLICATE, NO_DUPLICATE, NO_DUPLICATE, 0, NO_DUPLICATE, 4,
+				NO_DUPLICATE, NO_DUPLICATE, 0, NO_DUPLICATE, NO_DUPLICATE };
+			for (size_t i = 0; i < paths.size(); ++i)
+				BENCH_CHECK(duplicateOf[i] == expected[i], "duplicate");
+			BENCH_CHECK(stats.duplicates == 3, "duplicate count");
+			BENCH_CHECK(stats.bytesSaved == 2 * content.size() + small.size(), "bytes saved");
+
+			// a, c, d and i match by samples; b does not.
+			BENCH_CHECK(stats.hashed == 4, "hashed");
+
+			std::vector<const BsChar*> cPaths;
+			for (const PathString& path : paths)
+				cPaths.push_back(path.c_str());
+			std::vector<uint32_t> cDuplicateOf(paths.size());
+			BsDuplicateStats cStats;
+			BsDuplicateOptions cOptions;
+			memset(&cOptions, 0, sizeof(cOptions));
+			cOptions.minSize = 1;
+			BENCH_CHECK(BsFindDuplicates(cPaths.data(), sizes.data(), (uint32_t)paths.size(), &cOptions,
+				cDuplicateOf.data(), &cStats) == BS_OK, "C interface");
+			BENCH_CHECK(cDuplicateOf == duplicateOf, "C duplicates");
+			BENCH_CHECK(cStats.bytesSaved == stats.bytesSaved && cStats.hashed == stats.hashed, "C stats");
+			BENCH_CHECK(BsFindDuplicates(NULL, sizes.data(), 1, NULL, cDuplicateOf.data(), NULL) == BS_E_INVALIDARG,
+				"NULL paths");
+
+			RemoveTree(root);
+			return 0;
+		}
+
+		int RunTree(const BenchOptions& options)
+		{
+			std::string root = options.workDir + "/dedup";
+			std::string copies = options.workDir + "/dedup-copies";
+			RemoveTree(root);
+			RemoveTree(copies);
+
+			SyntheticTreeOptions treeOptions;
+			treeOptions.files = FileCount(options, 10000, 1000);
+			treeOptions.minSize = 1;
+			treeOptions.maxSize = options.quick ? 256 * 1024 : 512 * 1024;
+			treeOptions.writeContent = true;
+			SyntheticTreeInfo info;
+			BENCH_CHECK(CreateSyntheticTree(root, treeOptions, info, true), "create the tree");
+			mkdir(copies.c_str(), 0755);
+
+			std::vector<PathString> paths;
+			std::vector<uint64_t> sizes;
+			std::vector<uint8_t> content;
+			for (const std::string& path : info.paths)
+			{
+				BENCH_CHECK(ReadWhole(path, content), "read");
+				paths.push_back(path);
+				sizes.push_back(content.size());
+			}
+
+			// One file in five copied, one in fifty shadowed by a decoy
+			// differing in the first byte and one by a decoy differing in the
+			// middle.
+			uint64_t copied = 0;
+			uint64_t copiedBytes = 0;
+			for (size_t i = 0; i < info.paths.size(); ++i)
+			{
+				if (i % 5 != 0 && i % 50 != 1 && i % 50 != 2)
+					continue;
+
+				BENCH_CHECK(ReadWhole(info.paths[i], content), "read");
+				if (i % 5 == 0)
+				{
+					++copied;
+					copiedBytes += content.size();
+				}
+				else if (i % 50 == 1)
+					content[0] ^= 0xFF;
+				else
+					content[content.size() / 2] ^= 0xFF;
+
+				char name[32];
+				snprintf(name, sizeof(name), "/%zu.bin", i);
+				std::string path = copies + name;
+				BENCH_CHECK(WriteWhole(path, content), "write");
+				paths.push_back(path);
+				sizes.push_back(content.size());
+			}
+
+			DropCache(paths);
+			DuplicateOptions findOptions;
+			findOptions.threadCount = options.threads;
+			std::vector<uint32_t> duplicateOf;
+			DuplicateStats stats;
+			CStopwatch stopwatch;
+			FindDuplicates(paths, sizes, findOptions, duplicateOf, stats);
+			double findSeconds = stopwatch.Seconds();
+
+			DropCache(paths);
+			std::vector<uint32_t> reference;
+			uint64_t referenceSaved;
+			stopwatch.Restart();
+			ReferenceDuplicates(paths, sizes, reference, referenceSaved);
+			double referenceSeconds = stopwatch.Seconds();
+
+			BENCH_CHECK(duplicateOf == reference, "duplicates against the reference");
+			BENCH_CHECK(stats.bytesSaved == referenceSaved, "bytes saved against the reference");
+
+			// Random content only repeats in files of a byte or two.
+			BENCH_CHECK(stats.duplicates >= copied && stats.bytesSaved >= copiedBytes, "known copies");
+
+			Report("dedup", "files", (double)stats.files, "files");
+			Report("dedup", "duplicate_ratio", 100.0 * stats.duplicates / stats.files, "%");
+			Report("dedup", "candidates", (double)stats.candidates, "files");
+			Report("dedup", "hashed_whole", (double)stats.hashed, "files");
+			Report("dedup", "bytes_mb", stats.bytes / 1048576.0, "MB");
+			Report("dedup", "bytes_saved_mb", stats.bytesSaved / 1048576.0, "MB");
+			Report("dedup", "bytes_read_mb", stats.bytesRead / 1048576.0, "MB");
+			Report("dedup", "find_ms", findSeconds * 1000, "ms");
+			Report("dedup", "reference_ms", referenceSeconds * 1000, "ms");
+
+			RemoveTree(root);
+			RemoveTree(copies);
+			return 0;
+		}
+	}
+
+	int RunDedupBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+
+		int result = CheckEdges(options.workDir);
+		if (result == 0)
+			result = RunTree(options);
+		return result;
+	}
+}
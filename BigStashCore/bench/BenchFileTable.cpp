@@ -0,0 +1,464 @@
+// BenchFileTable.cpp : File table benchmark.
+//
+// Checks CFileTable against a map of full paths: duplicates, paths and key
+// names rebuilt from the directory tree, roots and single files, names that
+// differ only in case, and the C interface. Then reports the bytes per file
+// and the insert, duplicate and lookup rates at 1M and 10M files (100k and
+// 1M with --quick), next to the managed-shaped list of ArchiveFileInfo
+// (three strings per file) and its List.Contains duplicate check, which is
+// quadratic and so only measured on a few thousand files.
+
+#include "BenchCommon.h"
+#include "../FileTable.h"
+#include "../TreeScanner.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		// Heap bytes in use, 0 where malloc does not say.
+		size_t HeapInUse()
+		{
+#ifdef __GLIBC__
+			struct mallinfo2 info = mallinfo2();
+			return info.uordblks + info.hblkhd;
+#else
+			return 0;
+#endif
+		}
+
+		PathString TablePath(const CFileTable& table, uint32_t file)
+		{
+			PathString path;
+			table.AppendPath(file, path);
+			return path;
+		}
+
+		PathString TableKey(const CFileTable& table, uint32_t file)
+		{
+			PathString key;
+			table.AppendKeyName(file, key);
+			return key;
+		}
+
+		uint32_t AddPath(CFileTable& table, const std::string& path, size_t keyOffset, bool& added)
+		{
+			uint32_t file = FILE_TABLE_NONE;
+			if (table.Add(path.data(), path.size(), keyOffset, path.size(), 7, file, added) != BS_OK)
+				return FILE_TABLE_NONE;
+			return file;
+		}
+
+		int CheckKnownPaths()
+		{
+			CFileTable table;
+			bool added;
+
+			// A selected directory: keys start at its own name.
+			std::string root = "/home/user/Pictures";
+			size_t keyOffset = RootKeyOffset(root);
+			uint32_t a = AddPath(table, root + "/a.jpg", keyOffset, added);
+			BENCH_CHECK(a == 0 && added, "first file");
+			uint32_t b = AddPath(table, root + "/2015/b.jpg", keyOffset, added);
+			BENCH_CHECK(b == 1 && added, "nested file");
+			BENCH_CHECK(AddPath(table, root + "/a.jpg", keyOffset, added) == a && !added, "duplicate");
+			BENCH_CHECK(AddPath(table, root + "/A.jpg", keyOffset, added) == 2 && added, "paths are case-sensitive here");
+
+			// A file selected on its own: the key is its name.
+			uint32_t c = AddPath(table, "/home/user/notes.txt", 11, added);
+			BENCH_CHECK(c == 3 && added, "single file");
+			BENCH_CHECK(AddPath(table, "/top.txt", 1, added) == 4 && added, "file in the root");
+			BENCH_CHECK(AddPath(table, "loose.txt", 0, added) == 5 && added, "file without a directory");
+			BENCH_CHECK(AddPath(table, "//server/share/x/y.txt", 0, added) == 6 && added, "network path");
+
+			BENCH_CHECK(TablePath(table, a) == root + "/a.jpg", "path");
+			BENCH_CHECK(TablePath(table, b) == root + "/2015/b.jpg", "nested path");
+			BENCH_CHECK(TablePath(table, 4) == "/top.txt", "root path");
+			BENCH_CHECK(TablePath(table, 5) == "loose.txt", "path without a directory");
+			BENCH_CHECK(TablePath(table, 6) == "//server/share/x/y.txt", "network path");
+			BENCH_CHECK(TableKey(table, a) == "Pictures/a.jpg", "key");
+			BENCH_CHECK(TableKey(table, b) == "Pictures/2015/b.jpg", "nested key");
+			BENCH_CHECK(TableKey(table, c) == "notes.txt", "single file key");
+			BENCH_CHECK(TableKey(table, 4) == "top.txt", "root file key");
+			BENCH_CHECK(TableKey(table, 6) == "//server/share/x/y.txt", "whole path key");
+
+			std::string nested = root + "/2015/b.jpg";
+			BENCH_CHECK(table.Find(nested.data(), nested.size()) == b, "find");
+			BENCH_CHECK(table.Find("/home/user/Pictures/2016/b.jpg", 30) == FILE_TABLE_NONE, "missing directory");
+			BENCH_CHECK(table.Find("/home/user/Pictures/c.jpg", 25) == FILE_TABLE_NONE, "missing name");
+			BENCH_CHECK(table.Find("/home/user/Pictures/", 20) == FILE_TABLE_NONE, "directory");
+
+			size_t length;
+			const PathChar* name = table.Name(b, length);
+			BENCH_CHECK(std::string(name, length) == "b.jpg", "name");
+			BENCH_CHECK(table.Size(b) == nested.size() && table.LastWriteTime(b) == 7, "columns");
+			uint64_t totalSize = 0;
+			for (uint32_t file = 0; file < table.Count(); ++file)
+				totalSize += table.Size(file);
+			BENCH_CHECK(table.TotalSize() == totalSize, "total size");
+
+			// "", home, user, Pictures, 2015, and "", server, share and x of
+			// the network path under the same "" root.
+			BENCH_CHECK(table.DirectoryCount() == 9, "directories are shared");
+
+			uint32_t file;
+			BENCH_CHECK(table.Add("/home/", 6, 0, 0, 0, file, added) == BS_E_INVALIDARG, "no name");
+			BENCH_CHECK(table.Add("/home/x", 7, 7, 0, 0, file, added) == BS_E_INVALIDARG, "key past the name");
+			BENCH_CHECK(table.Count() == 7, "failed adds leave the table alone");
+
+			table.Clear();
+			BENCH_CHECK(table.Count() == 0 && table.DirectoryCount() == 0, "clear");
+			BENCH_CHECK(AddPath(table, root + "/a.jpg", keyOffset, added) == 0 && added, "add after clear");
+			return 0;
+		}
+
+		// A table that ignores case folds ASCII and the other simple case
+		// pairs the same way on every platform; the default one here does not.
+		int CheckIgnoreCase()
+		{
+			CFileTable exact;
+			bool added;
+
+			BENCH_CHECK(!exact.IgnoresCase(), "paths are case-sensitive by default here");
+			BENCH_CHECK(AddPath(exact, "/data/A.TXT", 1, added) == 0 && added, "exact table");
+			BENCH_CHECK(AddPath(exact, "/data/a.txt", 1, added) == 1 && added, "exact table keeps both cases");
+
+			CFileTable table(true);
+			BENCH_CHECK(table.IgnoresCase(), "table ignores case");
+
+			uint32_t a = AddPath(table, "/data/Docs/A.TXT", 1, added);
+			BENCH_CHECK(a == 0 && added, "first spelling");
+			BENCH_CHECK(AddPath(table, "/data/docs/a.txt", 1, added) == a && !added, "ASCII case pair");
+			BENCH_CHECK(TablePath(table, a) == "/data/Docs/A.TXT", "first spelling is kept");
+
+			std::string find = "/DATA/DOCS/a.Txt";
+			BENCH_CHECK(table.Find(find.data(), find.size()) == a, "find ignores case");
+			BENCH_CHECK(table.DirectoryCount() == 3, "directories fold too");
+
+			uint32_t e = AddPath(table, u8"/data/\u00C9t\u00E9.txt", 1, added);
+			BENCH_CHECK(e == 1 && added, "Latin-1 name");
+			BENCH_CHECK(AddPath(table, u8"/data/\u00E9t\u00C9.TXT", 1, added) == e && !added, "Latin-1 case pair");
+
+			uint32_t report = AddPath(table, u8"/data/\u041E\u0442\u0447\u0451\u0442", 1, added);
+			BENCH_CHECK(report == 2 && added, "Cyrillic name");
+			BENCH_CHECK(AddPath(table, u8"/data/\u041E\u0422\u0427\u0401\u0422", 1, added) == report && !added,
+				"Cyrillic case pair");
+
+			uint32_t road = AddPath(table, u8"/data/\u03BF\u03B4\u03BF\u03C2", 1, added);
+			BENCH_CHECK(road == 3 && added, "Greek name");
+			BENCH_CHECK(AddPath(table, u8"/data/\u039F\u0394\u039F\u03A3", 1, added) == road && !added,
+				"final sigma folds with sigma");
+
+			// Not simple case pairs: sharp s and SS, dotless i and I.
+			BENCH_CHECK(AddPath(table, u8"/data/stra\u00DFe", 1, added) == 4 && added, "sharp s");
+			BENCH_CHECK(AddPath(table, "/data/STRASSE", 1, added) == 5 && added, "sharp s is not SS");
+			BENCH_CHECK(AddPath(table, u8"/data/\u0131", 1, added) == 6 && added, "dotless i");
+			BENCH_CHECK(AddPath(table, "/data/I", 1, added) == 7 && added, "dotless i is not I");
+
+			// Bytes that are not UTF-8 stay distinct from each other and from
+			// the characters they would be in Latin-1.
+			BENCH_CHECK(AddPath(table, "/data/\xC9", 1, added) == 8 && added, "stray byte");
+			BENCH_CHECK(AddPath(table, "/data/\xE9", 1, added) == 9 && added, "another stray byte");
+			BENCH_CHECK(AddPath(table, u8"/data/\u00C9", 1, added) == 10 && added, "stray byte is not the character");
+			return 0;
+		}
+
+		// Random paths with repeats, against a map of the paths.
+		int CheckRandomPaths()
+		{
+			CFileTable table;
+			std::unordered_map<std::string, uint32_t> reference;
+			std::vector<std::string> paths;
+
+			uint32_t seed = 12345;
+			for (int i = 0; i < 200000; ++i)
+			{
+				seed = seed * 1103515245 + 12345;
+				unsigned depth = 1 + (seed >> 8) % 5;
+				std::string path;
+				for (unsigned level = 0; level < depth; ++level)
+				{
+					seed = seed * 1103515245 + 12345;
+					path += "/d" + std::to_string((seed >> 12) % 4);
+				}
+				seed = seed * 1103515245 + 12345;
+				path += "/f" + std::to_string((seed >> 10) % 300);
+				size_t keyOffset = path.find('/', 1) + 1;
+
+				bool added;
+				uint32_t file = AddPath(table, path, keyOffset, added);
+				BENCH_CHECK(file != FILE_TABLE_NONE, "add");
+
+				auto found = reference.find(path);
+				if (found == reference.end())
+				{
+					BENCH_CHECK(added && file == paths.size(), "new path");
+					reference[path] = file;
+					paths.push_back(path);
+				}
+				else
+				{
+					BENCH_CHECK(!added && file == found->second, "repeated path");
+				}
+			}
+
+			BENCH_CHECK(table.Count() == paths.size(), "count");
+			for (uint32_t file = 0; file < paths.size(); ++file)
+			{
+				const std::string& path = paths[file];
+				BENCH_CHECK(TablePath(table, file) == path, "path");
+				BENCH_CHECK(TableKey(table, file) == path.substr(path.find('/', 1) + 1), "key");
+				BENCH_CHECK(table.Find(path.data(), path.size()) == file, "find");
+
+				std::string missing = path + "x";
+				BENCH_CHECK(table.Find(missing.data(), missing.size()) == FILE_TABLE_NONE, "find missing");
+			}
+			return 0;
+		}
+
+		int CheckCApi()
+		{
+			const char* paths[] = { "/data/set/a.bin", "/data/set/sub/b.bin", "/data/set/a.bin" };
+			BsScanRecord records[3];
+			for (int i = 0; i < 3; ++i)
+			{
+				records[i].path = paths[i];
+				records[i].pathLength = (uint32_t)strlen(paths[i]);
+				records[i].nameOffset = (uint32_t)(strrchr(paths[i], '/') - paths[i] + 1);
+				records[i].keyOffset = 6;
+				records[i].attributes = BS_FILE_ATTRIBUTE_ARCHIVE;
+				records[i].flags = 0;
+				records[i].size = 100 + i;
+				records[i].lastWriteTime = 1000 + i;
+			}
+
+			BsFileTable* table = NULL;
+			BENCH_CHECK(BsFileTableOpen(16, &table) == BS_OK, "open");
+
+			uint32_t files[3];
+			uint32_t added;
+			BENCH_CHECK(BsFileTableAdd(table, records, 3, files, &added) == BS_OK, "add");
+			BENCH_CHECK(added == 2 && files[0] == 0 && files[1] == 1 && files[2] == 0, "added");
+
+			uint32_t count;
+			uint64_t totalSize;
+			BENCH_CHECK(BsFileTableGetCount(table, &count, &totalSize) == BS_OK && count == 2 && totalSize == 201, "count");
+
+			uint32_t file;
+			BENCH_CHECK(BsFileTableFind(table, paths[1], records[1].pathLength, &file) == BS_OK && file == 1, "find");
+			BENCH_CHECK(BsFileTableFind(table, "/data/set/c.bin", 15, &file) == BS_E_NOTFOUND, "find missing");
+
+			BENCH_CHECK(BsFileTableSetProgress(table, 1, 50) == BS_OK, "set progress");
+			BENCH_CHECK(BsFileTableSetFlags(table, 1, 3) == BS_OK, "set flags");
+			BsFileTableEntry entry;
+			BENCH_CHECK(BsFileTableGetFile(table, 1, &entry) == BS_OK, "get file");
+			BENCH_CHECK(entry.size == 101 && entry.lastWriteTime == 1001 && entry.progress == 50 && entry.flags == 3,
+				"entry");
+			BENCH_CHECK(BsFileTableGetFile(table, 2, &entry) == BS_E_INVALIDARG, "file out of range");
+
+			char text[64];
+			uint32_t length;
+			BENCH_CHECK(BsFileTableGetPath(table, 1, text, sizeof(text), &length) == BS_OK, "get path");
+			BENCH_CHECK(strcmp(text, paths[1]) == 0 && length == records[1].pathLength, "path");
+			BENCH_CHECK(BsFileTableGetKeyName(table, 1, text, 5, &length) == BS_E_INVALIDARG && length == 13,
+				"key capacity");
+			BENCH_CHECK(BsFileTableGetKeyName(table, 1, text, sizeof(text), &length) == BS_OK, "get key");
+			BENCH_CHECK(strcmp(text, "set/sub/b.bin") == 0, "key");
+
+			records[2].path = "/data/";
+			records[2].pathLength = 6;
+			BENCH_CHECK(BsFileTableAdd(table, records + 2, 1, NULL, NULL) == BS_E_INVALIDARG, "record without a name");
+			BsFileTableClose(table);
+			return 0;
+		}
+
+		// The paths of a large selection: 100 files per directory, under one
+		// selected folder.
+		const char* const SELECTED_ROOT = "/home/user/Pictures";
+
+		size_t SyntheticPath(uint64_t index, char* path, size_t capacity)
+		{
+			return (size_t)snprintf(path, capacity, "%s/%04u/batch-%03u/IMG_%07u.CR2", SELECTED_ROOT,
+				(unsigned)(index / 10000), (unsigned)(index / 100 % 100), (unsigned)index);
+		}
+
+		// BigStash.Model.ArchiveFileInfo as the view model fills it.
+		struct ManagedFileInfo
+		{
+			std::u16string fileName;
+			std::u16string keyName;
+			std::u16string filePath;
+			uint64_t size;
+			int64_t lastModified;
+			bool isUploaded;
+			uint64_t progress;
+		};
+
+		std::u16string Widen(const char* text, size_t length)
+		{
+			return std::u16string(text, text + length);
+		}
+
+		// The list the view model builds, with the quadratic
+		// _archiveInfo.Select(x => x.FilePath).Contains(f) check per file.
+		int RunManagedBaseline(const BenchOptions& options)
+		{
+			uint64_t count = options.quick ? 5000 : 20000;
+			size_t keyOffset = strlen(SELECTED_ROOT) - strlen("Pictures");
+
+			size_t heap = HeapInUse();
+			std::vector<ManagedFileInfo> files;
+			CStopwatch stopwatch;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				char text[128];
+				size_t length = SyntheticPath(i, text, sizeof(text));
+				std::u16string path = Widen(text, length);
+
+				bool found = false;
+				for (size_t j = 0; j < files.size() && !found; ++j)
+					found = files[j].filePath == path;
+				if (found)
+					continue;
+
+				ManagedFileInfo info;
+				info.fileName = path.substr(path.find_last_of(u'/') + 1);
+				info.keyName = path.substr(keyOffset);
+				info.filePath = path;
+				info.size = length;
+				info.lastModified = 7;
+				info.isUploaded = false;
+				info.progress = 0;
+				files.push_back(info);
+			}
+			double seconds = stopwatch.Seconds();
+			BENCH_CHECK(files.size() == count, "baseline files");
+			size_t bytes = HeapInUse() - heap;
+
+			Report("table", "reference_files", (double)count, "files");
+			Report("table", "reference_inserts_per_second", count / seconds, "files/s");
+			if (bytes != 0)
+				Report("table", "reference_bytes_per_file", (double)bytes / count, "bytes");
+			return 0;
+		}
+
+		int RunThroughput(const char* label, uint64_t count)
+		{
+			size_t keyOffset = strlen(SELECTED_ROOT) - strlen("Pictures");
+			std::string prefix(label);
+
+			size_t heap = HeapInUse();
+			// Sized up front, as BsFileTableOpen does with the scan's count.
+			CFileTable table;
+			table.Reserve(count, count * 16);
+			char path[128];
+			CStopwatch stopwatch;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				size_t length = SyntheticPath(i, path, sizeof(path));
+				uint32_t file;
+				bool added;
+				if (table.Add(path, length, keyOffset, length, 7, file, added) != BS_OK || !added)
+				{
+					fprintf(stderr, "%s: adding %s failed\n", label, path);
+					return 1;
+				}
+			}
+			double insertSeconds = stopwatch.Seconds();
+			size_t bytes = HeapInUse() - heap;
+			BENCH_CHECK(table.Count() == count, "count");
+
+			// Everything again: every file is a duplicate.
+			stopwatch.Restart();
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				size_t length = SyntheticPath(i, path, sizeof(path));
+				uint32_t file;
+				bool added;
+				if (table.Add(path, length, keyOffset, length, 7, file, added) != BS_OK || added || file != i)
+				{
+					fprintf(stderr, "%s: %s was not found as a duplicate\n", label, path);
+					return 1;
+				}
+			}
+			double duplicateSeconds = stopwatch.Seconds();
+			BENCH_CHECK(table.Count() == count, "duplicates were added");
+
+			// Lookups in a scattered order, which misses the directory cache.
+			const uint64_t step = 1000003;
+			stopwatch.Restart();
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				uint64_t index = i * step % count;
+				size_t length = SyntheticPath(index, path, sizeof(path));
+				if (table.Find(path, length) != index)
+				{
+					fprintf(stderr, "%s: %s was not found\n", label, path);
+					return 1;
+				}
+			}
+			double lookupSeconds = stopwatch.Seconds();
+
+			// The time spent making up the paths, to take out of the rates.
+			stopwatch.Restart();
+			size_t checksum = 0;
+			for (uint64_t i = 0; i < count; ++i)
+				checksum += SyntheticPath(i * step % count, path, sizeof(path));
+			double formatSeconds = stopwatch.Seconds();
+			BENCH_CHECK(checksum != 0, "paths");
+
+			PathString key;
+			stopwatch.Restart();
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				key.clear();
+				table.AppendKeyName((uint32_t)i, key);
+				checksum += key.size();
+			}
+			double keySeconds = stopwatch.Seconds();
+			BENCH_CHECK(checksum != 0, "keys");
+
+			Report("table", (prefix + "_files").c_str(), (double)count, "files");
+			Report("table", (prefix + "_bytes_per_file").c_str(), (double)table.MemoryUsage() / count, "bytes");
+			if (bytes != 0)
+				Report("table", (prefix + "_heap_bytes_per_file").c_str(), (double)bytes / count, "bytes");
+			Report("table", (prefix + "_inserts_per_second").c_str(),
+				count / std::max(insertSeconds - formatSeconds, 1e-9), "files/s");
+			Report("table", (prefix + "_duplicates_per_second").c_str(),
+				count / std::max(duplicateSeconds - formatSeconds, 1e-9), "files/s");
+			Report("table", (prefix + "_lookups_per_second").c_str(),
+				count / std::max(lookupSeconds - formatSeconds, 1e-9), "files/s");
+			Report("table", (prefix + "_key_names_per_second").c_str(), count / keySeconds, "files/s");
+			return 0;
+		}
+	}
+
+	int RunFileTableBenchmark(const BenchOptions& options)
+	{
+		int result = CheckKnownPaths();
+		if (result == 0)
+			result = CheckIgnoreCase();
+		if (result == 0)
+			result = CheckRandomPaths();
+		if (result == 0)
+			result = CheckCApi();
+		if (result == 0)
+			result = RunManagedBaseline(options);
+		if (result == 0)
+			result = RunThroughput("small", FileCount(options, 1000000, 100000));
+		if (result == 0)
+			result = RunThroughput("large", options.files != 0 ? options.files * 10 : options.quick ? 1000000 : 10000000);
+		return result;
+	}
+}
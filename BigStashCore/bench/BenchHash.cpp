@@ -0,0 +1,251 @@
+// BenchHash.cpp : Content hashing benchmark.
+//
+// Reports MD5 throughput per core for the single-stream, whole+part and
+// multi-buffer kernels, and files per second for hashing a tree of small
+// files, next to the 10 GbE line rate the hashing has to stay ahead of.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../ContentHasher.h"
+#include "../Encoding.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const double TEN_GBE_BYTES_PER_SECOND = 10e9 / 8;
+
+		std::string Md5Hex(const void* data, size_t length)
+		{
+			uint8_t digest[MD5_DIGEST_SIZE];
+			CMd5::Hash(data, length, digest);
+			return HexEncode(digest, MD5_DIGEST_SIZE);
+		}
+
+		int CheckKnownAnswers()
+		{
+			// RFC 1321, appendix A.5
+			static const char* const vectors[][2] =
+			{
+				{ "", "d41d8cd98f00b204e9800998ecf8427e" },
+				{ "a", "0cc175b9c0f1b6a831c399e269772661" },
+				{ "abc", "900150983cd24fb0d6963f7d28e17f72" },
+				{ "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+				{ "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+				{ "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+					"d174ab98d277d9f5a5611c2c9f419d9f" },
+				{ "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+					"57edf4a22be3c955ac49da2e2107b67a" },
+			};
+
+			for (const auto& vector : vectors)
+				BENCH_CHECK(Md5Hex(vector[0], strlen(vector[0])) == vector[1], vector[0]);
+
+			return 0;
+		}
+
+		int CheckMultiBuffer()
+		{
+			uint64_t state = 7;
+			std::vector<std::vector<uint8_t> > messages;
+			for (size_t length = 0; length < 300; ++length)
+			{
+				messages.push_back(std::vector<uint8_t>(length));
+				FillRandom(messages.back().data(), length, state);
+			}
+			for (size_t i = 0; i < 40; ++i)
+			{
+				size_t length = 1000 + i * 977;
+				messages.push_back(std::vector<uint8_t>(length));
+				FillRandom(messages.back().data(), length, state);
+			}
+
+			std::vector<const uint8_t*> pointers;
+			std::vector<size_t> lengths;
+			for (const std::vector<uint8_t>& message : messages)
+			{
+				pointers.push_back(message.data());
+				lengths.push_back(message.size());
+			}
+
+			std::vector<PartDigest> digests(messages.size());
+			Md5HashMany(pointers.data(), lengths.data(), messages.size(),
+				reinterpret_cast<uint8_t (*)[MD5_DIGEST_SIZE]>(digests.data()));
+
+			for (size_t i = 0; i < messages.size(); ++i)
+			{
+				BENCH_CHECK(HexEncode(digests[i].md5, MD5_DIGEST_SIZE) ==
+					Md5Hex(messages[i].data(), messages[i].size()), "multi-buffer digest differs");
+			}
+
+			return 0;
+		}
+
+		int CheckPartDigests()
+		{
+			const uint64_t partSize = 64 * 1024;
+			uint64_t state = 11;
+
+			const size_t sizes[] = { 0, 1, 63, 64, 65, partSize - 1, partSize, partSize + 1,
+				3 * partSize, 3 * partSize + 17, 10 * partSize + 4096 };
+
+			for (size_t size : sizes)
+			{
+				std::vector<uint8_t> data(size);
+				FillRandom(data.data(), size, state);
+
+				// Feed the hasher in odd-sized chunks, the way reads arrive.
+				CContentHasher hasher(partSize);
+				for (size_t offset = 0; offset < size;)
+				{
+					size_t chunk = std::min<size_t>(size - offset, 1 + (size_t)(offset * 7919 % 9973));
+					hasher.Update(data.data() + offset, chunk);
+					offset += chunk;
+				}
+
+				ContentDigest digest;
+				hasher.Finish(digest);
+
+				BENCH_CHECK(digest.size == size, "size differs");
+				BENCH_CHECK(digest.Md5Hex() == Md5Hex(data.data(), size), "whole-file digest differs");
+
+				size_t expectedParts = size == 0 ? 1 : (size_t)((size + partSize - 1) / partSize);
+				BENCH_CHECK(digest.parts.size() == expectedParts, "part count differs");
+
+				CMd5 etag;
+				for (size_t p = 0; p < expectedParts; ++p)
+				{
+					size_t offset = (size_t)(p * partSize);
+					size_t length = (size_t)std::min<uint64_t>(partSize, size - offset);
+					uint8_t expected[MD5_DIGEST_SIZE];
+					CMd5::Hash(data.data() + offset, length, expected);
+
+					BENCH_CHECK(memcmp(expected, digest.parts[p].md5, MD5_DIGEST_SIZE) == 0, "part digest differs");
+					BENCH_CHECK(digest.PartContentMd5(p) == Base64Encode(expected, MD5_DIGEST_SIZE), "Content-MD5 differs");
+					etag.Update(expected, MD5_DIGEST_SIZE);
+				}
+
+				uint8_t etagDigest[MD5_DIGEST_SIZE];
+				etag.Final(etagDigest);
+				BENCH_CHECK(digest.ETag(true) == HexEncode(etagDigest, MD5_DIGEST_SIZE) + "-" +
+					std::to_string(expectedParts), "multipart ETag differs");
+			}
+
+			return 0;
+		}
+	}
+
+	int RunHashBenchmark(const BenchOptions& options)
+	{
+		if (CheckKnownAnswers() != 0 || CheckMultiBuffer() != 0 || CheckPartDigests() != 0)
+			return 1;
+
+		Report("hash", "multi_buffer_lanes", Md5MultiBufferLanes(), "lanes");
+
+		size_t bufferSize = options.quick ? 64 * 1024 * 1024 : 512 * 1024 * 1024;
+		std::vector<uint8_t> buffer(bufferSize);
+		uint64_t state = 3;
+		FillRandom(buffer.data(), buffer.size(), state);
+
+		// Single stream, the whole-file MD5 alone.
+		CStopwatch stopwatch;
+		uint8_t digest[MD5_DIGEST_SIZE];
+		CMd5::Hash(buffer.data(), buffer.size(), digest);
+		double single = buffer.size() / stopwatch.Seconds();
+		Report("hash", "md5_single_gb_per_second", single / 1e9, "GB/s");
+
+		// Whole-file plus 5 MB part digests, the way the upload needs them.
+		stopwatch.Restart();
+		CContentHasher hasher(5 * 1024 * 1024);
+		hasher.Update(buffer.data(), buffer.size());
+		ContentDigest content;
+		hasher.Finish(content);
+		double dual = buffer.size() / stopwatch.Seconds();
+		Report("hash", "md5_whole_and_parts_gb_per_second", dual / 1e9, "GB/s");
+		Report("hash", "md5_whole_and_parts_vs_two_passes", dual / (single / 2), "x");
+		Report("hash", "md5_whole_and_parts_vs_10gbe", dual / TEN_GBE_BYTES_PER_SECOND, "x");
+
+		// Multi-buffer, many independent 4 KB messages.
+		const size_t messageSize = 4096;
+		size_t messageCount = buffer.size() / messageSize;
+		std::vector<const uint8_t*> messages(messageCount);
+		std::vector<size_t> lengths(messageCount, messageSize);
+		std::vector<PartDigest> digests(messageCount);
+		for (size_t i = 0; i < messageCount; ++i)
+			messages[i] = buffer.data() + i * messageSize;
+
+		stopwatch.Restart();
+		Md5HashMany(messages.data(), lengths.data(), messageCount,
+			reinterpret_cast<uint8_t (*)[MD5_DIGEST_SIZE]>(digests.data()));
+		double multi = buffer.size() / stopwatch.Seconds();
+		Report("hash", "md5_multi_buffer_4k_gb_per_second", multi / 1e9, "GB/s");
+		Report("hash", "md5_multi_buffer_vs_single", multi / single, "x");
+
+		buffer.clear();
+		buffer.shrink_to_fit();
+
+		// A tree of small files, hashed per file versus batched across lanes
+		// and cores.
+		SyntheticTreeOptions treeOptions;
+		treeOptions.files = FileCount(options, 100000, 5000);
+		treeOptions.minSize = 512;
+		treeOptions.maxSize = 16 * 1024;
+		treeOptions.writeContent = true;
+
+		std::string root = options.workDir + "/hash";
+		RemoveTree(root);
+		mkdir(options.workDir.c_str(), 0755);
+
+		SyntheticTreeInfo info;
+		if (!CreateSyntheticTree(root, treeOptions, info, true))
+			return 1;
+
+		std::vector<PathString> paths(info.paths.begin(), info.paths.end());
+		std::vector<ContentDigest> sequential(paths.size());
+
+		stopwatch.Restart();
+		for (size_t i = 0; i < paths.size(); ++i)
+			BENCH_CHECK(HashFile(paths[i].c_str(), 5 * 1024 * 1024, sequential[i]) == BS_OK, "HashFile failed");
+		double sequentialSeconds = stopwatch.Seconds();
+		Report("hash", "small_files_sequential_files_per_second", paths.size() / sequentialSeconds, "files/s");
+
+		std::vector<ContentDigest> batched;
+		std::vector<BsStatus> statuses;
+		stopwatch.Restart();
+		HashFiles(paths, 5 * 1024 * 1024, options.threads, batched, statuses);
+		double batchedSeconds = stopwatch.Seconds();
+		Report("hash", "small_files_batched_files_per_second", paths.size() / batchedSeconds, "files/s");
+		Report("hash", "small_files_batched_gb_per_second", info.bytes / batchedSeconds / 1e9, "GB/s");
+
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			BENCH_CHECK(statuses[i] == BS_OK, "HashFiles failed");
+			BENCH_CHECK(batched[i].Md5Hex() == sequential[i].Md5Hex(), "batched digest differs");
+			BENCH_CHECK(batched[i].ETag(true) == sequential[i].ETag(true), "batched ETag differs");
+		}
+
+		// Parts smaller than many of the files: those have several part
+		// digests, batched or not.
+		const uint64_t smallPartSize = 4096;
+		HashFiles(paths, smallPartSize, options.threads, batched, statuses);
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			ContentDigest expected;
+			BENCH_CHECK(statuses[i] == BS_OK, "HashFiles failed with small parts");
+			BENCH_CHECK(HashFile(paths[i].c_str(), smallPartSize, expected) == BS_OK, "HashFile failed");
+			BENCH_CHECK(batched[i].parts.size() == expected.parts.size(), "small part count differs");
+			BENCH_CHECK(batched[i].ETag(true) == expected.ETag(true), "small part ETag differs");
+		}
+
+		RemoveTree(root);
+		return 0;
+	}
+}
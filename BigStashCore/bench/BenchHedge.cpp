@@ -0,0 +1,484 @@
+// BenchHedge.cpp : Straggler mitigation benchmark.
+//
+// Checks CPartDeadline against a sort of the same samples, and that every
+// CRetryBackoff pause stays within the decorrelated jitter bounds while
+// parts failing together spread out. CHttpClient::Cancel must complete a
+// queued request and one on a connection right away, and only once, and
+// a cancel that comes after its request finished must not hit the next
+// one submitted at the same address, as a hedge's loser does. The
+// tail pass uploads a file to the S3 stand-in, which holds back the answer
+// to every SLOW_EVERY-th part by SLOW_DELAY_MS, with and without hedging,
+// and reports part latency percentiles and the file time; every part must
+// be accepted once and the object's ETag match the local digest. A last
+// run adds injected 500s, so retries and hedges mix, and one more runs
+// through a CUploadScheduler, whose limit the hedges must not cut.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../ContentHasher.h"
+#include "../HttpClient.h"
+#include "../PartDeadline.h"
+#include "../PartPlanner.h"
+#include "../S3Client.h"
+#include "../UploadScheduler.h"
+#include "../UploadTracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const uint64_t PART_SIZE = 1024 * 1024;
+		const unsigned CONNECTIONS = 8;
+
+		// per request, and for the stragglers.
+		const unsigned RESPONSE_DELAY_MS = 20;
+		const unsigned SLOW_EVERY = 20;
+		const unsigned SLOW_DELAY_MS = 1500;
+
+		const char* BUCKET = "bench-bucket";
+		const char* KEY = "hedged/file.bin";
+		const char* OBJECT_PATH = "/bench-bucket/hedged/file.bin";
+
+		bool WriteTestFile(const std::string& path, uint64_t size)
+		{
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+
+			std::vector<uint8_t> buffer(1024 * 1024);
+			uint64_t state = 29;
+			for (uint64_t offset = 0; offset < size; offset += buffer.size())
+			{
+				size_t length = (size_t)std::min<uint64_t>(buffer.size(), size - offset);
+				FillRandom(buffer.data(), length, state);
+				if (write(fd, buffer.data(), length) != (ssize_t)length)
+				{
+					close(fd);
+					return false;
+				}
+			}
+
+			close(fd);
+			return true;
+		}
+
+		uint64_t NextRandom(uint64_t& state)
+		{
+			uint64_t word;
+			FillRandom((uint8_t*)&word, sizeof(word), state);
+			return word;
+		}
+
+		// The deadline as CPartDeadline documents it, over every sample kept.
+		int64_t ReferenceDeadline(const std::vector<std::pair<uint64_t, int64_t> >& samples, uint64_t bytes,
+			const HedgeOptions& options)
+		{
+			std::vector<double> times;
+			for (const auto& sample : samples)
+			{
+				if (sample.first * 2 < bytes || sample.first > bytes * 2)
+					continue;
+				double scale = bytes > sample.first ? (double)bytes / (double)sample.first : 1.0;
+				times.push_back((double)sample.second * scale);
+			}
+			if (times.size() < options.minSamples)
+				return 0;
+
+			std::sort(times.begin(), times.end());
+			size_t rank = std::max<size_t>((size_t)std::ceil(options.percentile / 100.0 * (double)times.size()), 1);
+			int64_t deadline = (int64_t)(times[rank - 1] * options.factor);
+			return std::max(deadline, (int64_t)options.minDelayMs * 1000000);
+		}
+
+		int CheckModel(const BenchOptions& options)
+		{
+			HedgeOptions hedging;
+			hedging.minDelayMs = 1;
+			CPartDeadline model(hedging);
+			BENCH_CHECK(model.Deadline(PART_SIZE) == 0, "deadline without samples");
+
+			// whole parts of about 40 ms and small last parts of about 5 ms;
+			// only the latest 128 are kept.
+			std::vector<std::pair<uint64_t, int64_t> > samples;
+			uint64_t state = 3;
+			for (unsigned i = 0; i < 300; ++i)
+			{
+				bool small = i % 5 == 4;
+				uint64_t bytes = small ? 64 * 1024 : PART_SIZE - (NextRandom(state) % 65536);
+				int64_t nanoseconds = (small ? 5000000 : 40000000) + (int64_t)(NextRandom(state) % 20000000);
+				model.Record(bytes, nanoseconds);
+				samples.push_back(std::make_pair(bytes, nanoseconds));
+				if (samples.size() > 128)
+					samples.erase(samples.begin());
+
+				BENCH_CHECK(model.Deadline(PART_SIZE) == ReferenceDeadline(samples, PART_SIZE, hedging),
+					"deadline differs from the reference");
+				BENCH_CHECK(model.Deadline(64 * 1024) == ReferenceDeadline(samples, 64 * 1024, hedging),
+					"small part deadline differs from the reference");
+			}
+			BENCH_CHECK(model.Samples() == 128, "window not bounded");
+			BENCH_CHECK(model.Deadline(64 * 1024) < model.Deadline(PART_SIZE) / 2, "small parts held to large parts' times");
+			BENCH_CHECK(model.Deadline(16 * PART_SIZE) == 0, "deadline for a size never seen");
+
+			HedgeOptions off;
+			off.factor = 0;
+			CPartDeadline disabled(off);
+			disabled.Record(PART_SIZE, 1000000);
+			BENCH_CHECK(!disabled.Enabled() && disabled.Deadline(PART_SIZE) == 0, "disabled model gave a deadline");
+
+			// every pause between the base and three times the one before,
+			// under the cap.
+			size_t draws = options.quick ? 100000 : 1000000;
+			CRetryBackoff backoff(100, 20000);
+			int64_t previous = 100;
+			bool capped = false;
+			for (size_t i = 0; i < draws; ++i)
+			{
+				int64_t delay = backoff.Next().count();
+				BENCH_CHECK(delay >= 100 && delay <= std::min<int64_t>(20000, std::max<int64_t>(100, previous * 3)),
+					"pause outside the jitter bounds");
+				capped = capped || delay == 20000;
+				previous = delay;
+			}
+			BENCH_CHECK(capped, "pauses never reached the cap");
+
+			// 1,000 parts failing at once come back spread over the first
+			// window instead of all after the same doubling step.
+			std::vector<double> firsts;
+			double sum = 0;
+			for (unsigned i = 0; i < 1000; ++i)
+			{
+				CRetryBackoff part;
+				firsts.push_back((double)part.Next().count());
+				sum += firsts.back();
+			}
+			double mean = sum / (double)firsts.size();
+			double variance = 0;
+			for (double delay : firsts)
+				variance += (delay - mean) * (delay - mean);
+			double spread = std::sqrt(variance / (double)firsts.size());
+			BENCH_CHECK(spread > 30, "first retries not spread out");
+
+			Report("hedge", "first_retry_mean_ms", mean, "ms");
+			Report("hedge", "first_retry_spread_ms", spread, "ms");
+			return 0;
+		}
+
+		// Completions of the requests the cancel check sends.
+		struct Outcomes
+		{
+			std::mutex lock;
+			std::condition_variable changed;
+			std::vector<std::pair<int, BsStatus> > seen;
+
+			HttpCompletion For(int id)
+			{
+				return [this, id](BsStatus status, HttpResponse&)
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					seen.push_back(std::make_pair(id, status));
+					changed.notify_all();
+				};
+			}
+
+			// waits up to seconds for count completions.
+			size_t WaitFor(size_t count, unsigned seconds = 1)
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				changed.wait_for(guard, std::chrono::seconds(seconds), [this, count]() { return seen.size() >= count; });
+				return seen.size();
+			}
+		};
+
+		int CheckCancel()
+		{
+			// every answer takes longer than the waits below.
+			S3StandInOptions serverOptions;
+			serverOptions.responseDelayMs = 3000;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			HttpClientOptions httpOptions;
+			httpOptions.host = "127.0.0.1";
+			httpOptions.port = server.Port();
+			httpOptions.maxConnections = 1;
+			CHttpClient http(httpOptions);
+			BENCH_CHECK(http.Start() == BS_OK, "Start failed");
+
+			HttpRequest first;
+			HttpRequest second;
+			first.method = second.method = "PUT";
+			first.target = "/bench-bucket/cancel/first";
+			second.target = "/bench-bucket/cancel/second";
+			first.SetBody(std::string(4096, 'a'));
+			second.SetBody(std::string(4096, 'b'));
+
+			Outcomes outcomes;
+			CStopwatch stopwatch;
+			uint64_t firstId = http.Submit(&first, outcomes.For(1));
+			uint64_t secondId = http.Submit(&second, outcomes.For(2));
+			BENCH_CHECK(firstId != 0 && secondId != 0 && firstId != secondId, "exchange ids not unique");
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+			// the second waits for the only connection.
+			http.Cancel(secondId);
+			BENCH_CHECK(outcomes.WaitFor(1) == 1, "queued request not cancelled");
+			BENCH_CHECK(outcomes.seen[0].first == 2 && outcomes.seen[0].second == BS_E_CANCELLED, "wrong request cancelled");
+
+			// the first is on it, waiting for the answer.
+			http.Cancel(firstId);
+			BENCH_CHECK(outcomes.WaitFor(2) == 2, "request in flight not cancelled");
+			BENCH_CHECK(outcomes.seen[1].first == 1 && outcomes.seen[1].second == BS_E_CANCELLED, "wrong request cancelled");
+			double seconds = stopwatch.Seconds();
+			BENCH_CHECK(seconds < 1.0, "cancel waited for the answer");
+
+			// cancelling again completes nothing.
+			http.Cancel(firstId);
+			BENCH_CHECK(outcomes.WaitFor(3) == 2, "cancelled request completed twice");
+
+			HttpStats stats = http.Stats();
+			BENCH_CHECK(stats.cancelled == 2 && stats.requests == 1, "cancels not counted");
+
+			http.Stop();
+			server.Stop();
+			Report("hedge", "cancel_ms", seconds * 1e3 - 100, "ms");
+			return 0;
+		}
+
+		// A hedged part whose losing request answers before the cancel for
+		// it is taken: the part is done and its state freed, and the next
+		// part's request may be submitted at the same address. Here the
+		// request finishes, is submitted again while a large body holds the
+		// only connection, and then the first exchange is cancelled.
+		int CheckStaleCancel()
+		{
+			// reads paced so the large body takes about two seconds.
+			S3StandInOptions serverOptions;
+			serverOptions.bandwidth = 1024 * 1024;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			HttpClientOptions httpOptions;
+			httpOptions.host = "127.0.0.1";
+			httpOptions.port = server.Port();
+			httpOptions.maxConnections = 1;
+			CHttpClient http(httpOptions);
+			BENCH_CHECK(http.Start() == BS_OK, "Start failed");
+
+			HttpRequest request;
+			HttpRequest blocker;
+			request.method = blocker.method = "PUT";
+			request.target = "/bench-bucket/cancel/reused";
+			blocker.target = "/bench-bucket/cancel/blocker";
+			request.SetBody(std::string(4096, 'a'));
+			blocker.SetBody(std::string(2 * 1024 * 1024, 'b'));
+
+			Outcomes outcomes;
+			uint64_t loser = http.Submit(&request, outcomes.For(1));
+			BENCH_CHECK(outcomes.WaitFor(1) == 1 && outcomes.seen[0].second == BS_OK, "request did not finish");
+
+			http.Submit(&blocker, outcomes.For(2));
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			uint64_t reused = http.Submit(&request, outcomes.For(3));
+			BENCH_CHECK(reused != loser, "exchange id reused");
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+			// the cancel for the finished exchange finds the request queued
+			// again, and must leave it.
+			http.Cancel(loser);
+			BENCH_CHECK(outcomes.WaitFor(2) == 1, "stale cancel completed a request");
+
+			BENCH_CHECK(outcomes.WaitFor(3, 10) == 3, "requests did not finish");
+			BENCH_CHECK(outcomes.seen[1].first == 2 && outcomes.seen[1].second == BS_OK, "blocker failed");
+			BENCH_CHECK(outcomes.seen[2].first == 3 && outcomes.seen[2].second == BS_OK,
+				"request submitted again was cancelled");
+			BENCH_CHECK(http.Stats().cancelled == 0, "stale cancel counted");
+
+			http.Stop();
+			server.Stop();
+			return 0;
+		}
+
+		struct TailResult
+		{
+			double seconds;
+			TraceUploadStats stats;
+			uint64_t stragglers;
+			uint64_t failures;
+		};
+
+		int UploadWithStragglers(const std::string& path, uint64_t size, const std::string& expected, bool hedging,
+			unsigned failEvery, TailResult& result, CUploadScheduler* scheduler = NULL)
+		{
+			S3StandInOptions serverOptions;
+			serverOptions.responseDelayMs = RESPONSE_DELAY_MS;
+			serverOptions.slowEvery = SLOW_EVERY;
+			serverOptions.slowDelayMs = SLOW_DELAY_MS;
+			serverOptions.failEvery = failEvery;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			S3ClientOptions options;
+			options.host = "127.0.0.1";
+			options.port = server.Port();
+			options.connections = CONNECTIONS;
+			options.scheduler = scheduler;
+			if (!hedging)
+				options.hedging.factor = 0;
+
+			// with requests of many parts interleaved, one part can draw the
+			// injected 500 several times running.
+			if (failEvery != 0)
+				options.maxAttempts = 6;
+			CS3Client client(options);
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			std::string uploadId;
+			BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "initiate failed");
+
+			CUploadTracer tracer((TraceOptions()));
+			std::shared_ptr<CUploadTrace> trace = tracer.BeginUpload(KEY);
+
+			PartReaderOptions readerOptions;
+			CBufferPool pool(PART_SIZE, readerOptions.readAhead + CONNECTIONS);
+			CPartReader reader(pool);
+			std::vector<PartSpan> spans = UniformParts(size, PART_SIZE);
+			BENCH_CHECK(reader.Open(path.c_str(), spans, readerOptions) == BS_OK, "Open failed");
+
+			std::vector<S3Part> uploaded;
+			CStopwatch stopwatch;
+			BsStatus status = client.UploadParts(BUCKET, KEY, uploadId, reader, uploaded, S3PartCallback(), NULL,
+				trace.get());
+			result.seconds = stopwatch.Seconds();
+			reader.Close();
+			tracer.EndUpload(trace);
+			BENCH_CHECK(status == BS_OK, "UploadParts failed");
+
+			// each part once, whichever of its requests won.
+			BENCH_CHECK(uploaded.size() == spans.size(), "parts missing or accepted twice");
+			std::vector<S3Part> sorted(uploaded);
+			std::sort(sorted.begin(), sorted.end(),
+				[](const S3Part& a, const S3Part& b) { return a.partNumber < b.partNumber; });
+			for (size_t i = 0; i < sorted.size(); ++i)
+				BENCH_CHECK(sorted[i].partNumber == i + 1, "part numbers not one each");
+
+			std::string etag;
+			BENCH_CHECK(client.CompleteMultipartUpload(BUCKET, KEY, uploadId, uploaded, etag) == BS_OK, "complete failed");
+			std::string stored;
+			BENCH_CHECK(server.CompletedETag(OBJECT_PATH, stored), "object missing");
+			BENCH_CHECK(etag == expected && stored == expected, "ETag differs from the local digest");
+
+			BENCH_CHECK(tracer.GetStats(trace->Id(), result.stats), "upload not traced");
+			result.stragglers = server.StragglersInjected();
+			result.failures = server.FailuresInjected();
+
+			client.Stop();
+			server.Stop();
+			return 0;
+		}
+
+		int MeasureTail(const std::string& path, uint64_t size, const std::string& expected)
+		{
+			TailResult plain;
+			TailResult hedged;
+			if (UploadWithStragglers(path, size, expected, false, 0, plain) != 0 ||
+				UploadWithStragglers(path, size, expected, true, 0, hedged) != 0)
+				return 1;
+
+			const TraceStageStats& plainParts = plain.stats.stages[TRACE_PART];
+			const TraceStageStats& hedgedParts = hedged.stats.stages[TRACE_PART];
+			int64_t slow = (int64_t)SLOW_DELAY_MS * 1000000;
+			BENCH_CHECK(plain.stragglers > 0 && plain.stats.hedges == 0, "hedged with hedging off");
+			BENCH_CHECK(plainParts.max >= slow, "stragglers not injected");
+
+			// every straggler is hedged, and the hedge answers first.
+			BENCH_CHECK(hedged.stats.hedges >= hedged.stragglers, "straggler not hedged");
+			BENCH_CHECK(hedged.stats.hedgesWon >= hedged.stragglers, "hedge lost to a straggler");
+			BENCH_CHECK(hedgedParts.max < slow, "a part still waited for a straggler");
+
+			Report("hedge", "stragglers", (double)plain.stragglers, "parts");
+			Report("hedge", "plain_part_p50_ms", plainParts.p50 / 1e6, "ms");
+			Report("hedge", "plain_part_p99_ms", plainParts.p99 / 1e6, "ms");
+			Report("hedge", "plain_part_max_ms", plainParts.max / 1e6, "ms");
+			Report("hedge", "plain_file_s", plain.seconds, "s");
+			Report("hedge", "hedged_part_p50_ms", hedgedParts.p50 / 1e6, "ms");
+			Report("hedge", "hedged_part_p99_ms", hedgedParts.p99 / 1e6, "ms");
+			Report("hedge", "hedged_part_max_ms", hedgedParts.max / 1e6, "ms");
+			Report("hedge", "hedged_file_s", hedged.seconds, "s");
+			Report("hedge", "hedges", (double)hedged.stats.hedges, "requests");
+			Report("hedge", "hedge_bytes", 100.0 * (double)hedged.stats.hedges * PART_SIZE / (double)size, "%");
+			Report("hedge", "file_speedup", plain.seconds / hedged.seconds, "x");
+
+			// 500s on top: each failed request retried after its own pause,
+			// while the others go on.
+			TailResult mixed;
+			if (UploadWithStragglers(path, size, expected, true, 7, mixed) != 0)
+				return 1;
+			// a 500 to a hedge is not retried while the part's first request
+			// is still out.
+			BENCH_CHECK(mixed.failures > 0 && mixed.stats.retries <= mixed.failures &&
+				mixed.stats.retries + mixed.stats.hedges >= mixed.failures, "retries not one per 500");
+			BENCH_CHECK(mixed.stats.failures == 0, "part failed with retries left");
+			BENCH_CHECK(mixed.stats.stages[TRACE_RETRY_DELAY].count == mixed.stats.retries, "retry pauses not timed");
+
+			Report("hedge", "mixed_retries", (double)mixed.stats.retries, "requests");
+			Report("hedge", "mixed_hedges", (double)mixed.stats.hedges, "requests");
+			Report("hedge", "mixed_retry_pause_p50_ms", mixed.stats.stages[TRACE_RETRY_DELAY].p50 / 1e6, "ms");
+			Report("hedge", "mixed_file_s", mixed.seconds, "s");
+
+			// with the scheduler attached: the cancelled losers of the hedges
+			// must not count as failures and cut the shared limit.
+			SchedulerOptions schedulerOptions;
+			schedulerOptions.maxConcurrency = CONNECTIONS;
+			CUploadScheduler scheduler(schedulerOptions);
+			TailResult scheduled;
+			if (UploadWithStragglers(path, size, expected, true, 0, scheduled, &scheduler) != 0)
+				return 1;
+			SchedulerStats schedulerStats = scheduler.Stats();
+			BENCH_CHECK(scheduled.stats.hedges > 0, "no hedges with the scheduler");
+			BENCH_CHECK(schedulerStats.failures == 0 && schedulerStats.inFlight == 0, "cancelled hedges counted as failures");
+			for (const SchedulerDecisionRecord& record : scheduler.Decisions())
+				BENCH_CHECK(record.decision != SCHEDULER_DECREASE_FAILURE, "hedges cut the limit");
+			BENCH_CHECK(schedulerStats.limit >= schedulerOptions.initialConcurrency, "limit shrank below the start");
+
+			Report("hedge", "scheduled_limit", (double)schedulerStats.limit, "requests");
+			Report("hedge", "scheduled_file_s", scheduled.seconds, "s");
+			return 0;
+		}
+	}
+
+	int RunHedgeBenchmark(const BenchOptions& options)
+	{
+		if (CheckModel(options) != 0 || CheckCancel() != 0 || CheckStaleCancel() != 0)
+			return 1;
+
+		uint64_t parts = FileCount(options, 600, 160);
+		uint64_t size = parts * PART_SIZE - PART_SIZE / 3;
+		mkdir(options.workDir.c_str(), 0755);
+		std::string path = options.workDir + "/hedge.bin";
+		BENCH_CHECK(WriteTestFile(path, size), "could not write the test file");
+
+		ContentDigest digest;
+		BENCH_CHECK(HashFile(path.c_str(), PART_SIZE, digest) == BS_OK, "HashFile failed");
+		std::string expected = "\"" + digest.ETag(true) + "\"";
+
+		int result = MeasureTail(path, size, expected);
+		unlink(path.c_str());
+		return result;
+	}
+}
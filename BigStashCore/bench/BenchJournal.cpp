@@ -0,0 +1,418 @@
+// BenchJournal.cpp : Resume journal benchmark and crash test.
+//
+// Simulates the completion events of a large archive (1M events, about
+// 220k files of one to four parts) and records them from 8 upload threads
+// in a CResumeJournal, each waiting for its file's completion to be on
+// the disk the way SaveLocalUpload does. Reports events per second, the
+// flushes the group commit needed and the replay time, against rewriting
+// the whole state after every file as LocalStorage.WriteJson does (timed
+// on a few rewrites and projected). The crash test kills a writer process
+// at random points, reopens the journal each time and checks that it holds
+// at least every acknowledged event and exactly the state of the events it
+// holds; then cuts and garbles the log tail at random offsets.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../ResumeJournal.h"
+
+#include <cstdio>
+#include <signal.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const unsigned WRITERS = 8;
+
+		// One file in this many gets reset after its first part and starts
+		// over, as after an aborted upload.
+		const uint32_t RESET_EVERY = 50;
+
+		uint32_t PartCount(uint32_t file)
+		{
+			return 1 + file % 4;
+		}
+
+		// The events of one file, in order.
+		void FileEvents(uint32_t file, std::vector<JournalRecord>& events)
+		{
+			char text[64];
+			JournalRecord record;
+			record.file = file;
+
+			snprintf(text, sizeof(text), "2~%08x.%032x", file, file * 2654435761u);
+			record.type = JOURNAL_FILE_STARTED;
+			record.size = 5 * 1024 * 1024;
+			record.text = text;
+			events.push_back(record);
+
+			uint32_t parts = PartCount(file);
+			for (uint32_t part = 1; part <= parts; ++part)
+			{
+				snprintf(text, sizeof(text), "\"%016x%016x\"", file, part * 40503u);
+				record.type = JOURNAL_PART_COMPLETED;
+				record.partNumber = part;
+				record.size = 5 * 1024 * 1024;
+				record.text = text;
+				events.push_back(record);
+
+				if (part == 1 && file % RESET_EVERY == 7)
+				{
+					record.type = JOURNAL_FILE_RESET;
+					events.push_back(record);
+					FileEvents(file + 0x80000000u, events);
+					for (size_t i = events.size() - 1; events[i].file != file; --i)
+						events[i].file = file;
+					return;
+				}
+			}
+
+			snprintf(text, sizeof(text), "%016x%016x", file * 2246822519u, file);
+			record.type = JOURNAL_FILE_COMPLETED;
+			record.size = parts * 5ull * 1024 * 1024;
+			record.text = text;
+			events.push_back(record);
+		}
+
+		// The events of the files in order, file after file.
+		class CEventStream
+		{
+		public:
+			CEventStream() : m_file(0), m_next(0) {}
+
+			const JournalRecord& Next()
+			{
+				if (m_next == m_events.size())
+				{
+					m_events.clear();
+					m_next = 0;
+					FileEvents(m_file++, m_events);
+				}
+				return m_events[m_next++];
+			}
+
+		private:
+			uint32_t m_file;
+			size_t m_next;
+			std::vector<JournalRecord> m_events;
+		};
+
+		void ReferenceState(uint64_t events, JournalState& state)
+		{
+			state = JournalState();
+			CEventStream stream;
+			for (uint64_t i = 0; i < events; ++i)
+				state.Apply(stream.Next());
+		}
+
+		bool SameState(CResumeJournal& journal, const JournalState& reference)
+		{
+			if (journal.Records() != reference.records || journal.FileCount() != reference.files.size())
+				return false;
+
+			JournalFileState file;
+			for (uint32_t i = 0; i < reference.files.size(); ++i)
+			{
+				if (!journal.GetFile(i, file) || !(file == reference.files[i]))
+					return false;
+			}
+			return true;
+		}
+
+		bool ReadFileBytes(const std::string& path, std::vector<uint8_t>& data)
+		{
+			FILE* file = fopen(path.c_str(), "rb");
+			if (file == NULL)
+				return false;
+			data.clear();
+			uint8_t buffer[65536];
+			size_t read;
+			while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+				data.insert(data.end(), buffer, buffer + read);
+			fclose(file);
+			return true;
+		}
+
+		bool WriteFileBytes(const std::string& path, const uint8_t* data, size_t length)
+		{
+			FILE* file = fopen(path.c_str(), "wb");
+			if (file == NULL)
+				return false;
+			bool ok = fwrite(data, 1, length, file) == length;
+			return fclose(file) == 0 && ok;
+		}
+
+		// Today's pattern: the whole state, indented JSON as JsonConvert
+		// writes it, to a temporary file that then replaces the old one.
+		double TimeFullRewrite(const std::string& directory, uint32_t files, unsigned rewrites)
+		{
+			std::string json = "{\n  \"archive_files_info\": [\n";
+			char entry[512];
+			for (uint32_t file = 0; file < files; ++file)
+			{
+				snprintf(entry, sizeof(entry),
+					"    {\n      \"file_name\": \"file%08u.bin\",\n      \"key_name\": \"archive/dir%05u/file%08u.bin\",\n"
+					"      \"file_path\": \"C:\\\\Users\\\\user\\\\Documents\\\\dir%05u\\\\file%08u.bin\",\n"
+					"      \"size\": %u,\n      \"last_modified\": \"2016-04-01T12:00:00\",\n"
+					"      \"md5\": \"%032x\",\n      \"uploaded\": true,\n      \"progress\": %u,\n"
+					"      \"uploadid\": null,\n      \"part_size\": 5242880\n    }%s\n",
+					file, file / 100, file, file / 100, file, file * 7919, file, file * 7919, file + 1 < files ? "," : "");
+				json += entry;
+			}
+			json += "  ]\n}\n";
+
+			std::string path = directory + "/upload.json";
+			std::string temporary = path + ".tmp";
+			CStopwatch stopwatch;
+			for (unsigned i = 0; i < rewrites; ++i)
+			{
+				if (!WriteFileBytes(temporary, (const uint8_t*)json.data(), json.size()) ||
+					rename(temporary.c_str(), path.c_str()) != 0)
+					return -1;
+			}
+			double seconds = stopwatch.Seconds() / rewrites;
+			Report("journal", "rewrite_mb_per_file", json.size() / 1e6, "MB");
+			unlink(path.c_str());
+			return seconds;
+		}
+
+		int RunThroughput(const BenchOptions& options, const std::string& directory)
+		{
+			uint64_t target = FileCount(options, 1000000, 100000);
+
+			// the files whose events make up the target.
+			uint32_t files = 0;
+			uint64_t events = 0;
+			std::vector<JournalRecord> scratch;
+			while (events < target)
+			{
+				scratch.clear();
+				FileEvents(files++, scratch);
+				events += scratch.size();
+			}
+			Report("journal", "events", (double)events, "events");
+			Report("journal", "files", files, "files");
+
+			std::string path = directory + "/throughput";
+			JournalOptions journalOptions;
+			journalOptions.compactBytes = options.quick ? 1024 * 1024 : 8 * 1024 * 1024;
+
+			CResumeJournal journal;
+			BENCH_CHECK(journal.Open(path, journalOptions) == BS_OK, "Open failed");
+
+			std::vector<BsStatus> results(WRITERS, BS_OK);
+			CStopwatch stopwatch;
+			std::vector<std::thread> threads;
+			for (unsigned writer = 0; writer < WRITERS; ++writer)
+			{
+				threads.push_back(std::thread([&journal, &results, files, writer]()
+				{
+					std::vector<JournalRecord> mine;
+					for (uint32_t file = writer; file < files && results[writer] == BS_OK; file += WRITERS)
+					{
+						mine.clear();
+						FileEvents(file, mine);
+						for (const JournalRecord& record : mine)
+						{
+							uint64_t sequence = 0;
+							BsStatus status = journal.Append(record, &sequence);
+							if (status == BS_OK && record.type == JOURNAL_FILE_COMPLETED)
+								status = journal.Sync(sequence);
+							if (status != BS_OK)
+								results[writer] = status;
+						}
+					}
+				}));
+			}
+			for (std::thread& thread : threads)
+				thread.join();
+			double seconds = stopwatch.Seconds();
+
+			for (BsStatus status : results)
+				BENCH_CHECK(status == BS_OK, "Append failed");
+
+			JournalStats stats = journal.Stats();
+			journal.Close();
+
+			Report("journal", "events_per_second", events / seconds, "events/s");
+			Report("journal", "seconds", seconds, "s");
+			Report("journal", "group_commits", (double)stats.batches, "flushes");
+			Report("journal", "events_per_commit", (double)events / std::max<uint64_t>(stats.batches, 1), "events");
+			Report("journal", "bytes_per_event", (double)stats.bytesWritten / events, "bytes");
+			Report("journal", "compactions", (double)stats.compactions, "snapshots");
+			BENCH_CHECK(stats.compactions > 0, "the log was never compacted");
+
+			// the interleaving differs run to run, the state of every file
+			// does not.
+			JournalState reference;
+			ReferenceState(events, reference);
+
+			BENCH_CHECK(journal.Open(path, journalOptions) == BS_OK, "reopen failed");
+			JournalStats replayed = journal.Stats();
+			Report("journal", "replay_seconds", replayed.replaySeconds, "s");
+			Report("journal", "replayed_log_events", (double)replayed.replayedRecords, "events");
+			BENCH_CHECK(!replayed.tornTail, "a clean close left a torn tail");
+			BENCH_CHECK(SameState(journal, reference), "replayed state differs");
+			journal.Close();
+
+			double rewrite = TimeFullRewrite(directory, files, options.quick ? 2 : 3);
+			BENCH_CHECK(rewrite > 0, "rewrite failed");
+			Report("journal", "rewrite_seconds_per_file", rewrite, "s");
+			Report("journal", "rewrite_projected_seconds", rewrite * files, "s");
+			Report("journal", "journal_vs_rewrite", rewrite * files / seconds, "x");
+			return 0;
+		}
+
+		// The child of a crash round: appends the stream from where the
+		// journal stands, reporting every durable completion on the pipe,
+		// until it is killed.
+		void CrashWriter(const std::string& path, const JournalOptions& options, int pipe)
+		{
+			CResumeJournal journal;
+			if (journal.Open(path, options) != BS_OK)
+				_exit(2);
+
+			uint64_t records = journal.Records();
+			CEventStream stream;
+			for (uint64_t i = 0; i < records; ++i)
+				stream.Next();
+
+			for (;;)
+			{
+				const JournalRecord& record = stream.Next();
+				if (journal.Append(record) != BS_OK)
+					_exit(3);
+				records++;
+
+				if (record.type == JOURNAL_FILE_COMPLETED)
+				{
+					if (journal.Sync() != BS_OK)
+						_exit(4);
+					if (write(pipe, &records, sizeof(records)) != sizeof(records))
+						_exit(5);
+				}
+			}
+		}
+
+		int RunCrashRounds(const BenchOptions& options, const std::string& directory)
+		{
+			std::string path = directory + "/crash";
+			JournalOptions journalOptions;
+			journalOptions.commitIntervalMs = 1;
+			journalOptions.compactBytes = 256 * 1024;
+
+			unsigned rounds = options.quick ? 4 : 12;
+			uint64_t state = 12345;
+			uint64_t acknowledged = 0;
+			JournalState reference;
+
+			for (unsigned round = 0; round < rounds; ++round)
+			{
+				int pipes[2];
+				BENCH_CHECK(pipe(pipes) == 0, "pipe failed");
+				fflush(stdout);
+
+				pid_t child = fork();
+				BENCH_CHECK(child >= 0, "fork failed");
+				if (child == 0)
+				{
+					close(pipes[0]);
+					CrashWriter(path, journalOptions, pipes[1]);
+				}
+				close(pipes[1]);
+
+				uint8_t random[2];
+				FillRandom(random, sizeof(random), state);
+				usleep((20 + (random[0] | random[1] << 8) % 300) * 1000);
+				kill(child, SIGKILL);
+
+				int exitStatus = 0;
+				waitpid(child, &exitStatus, 0);
+				BENCH_CHECK(WIFSIGNALED(exitStatus), "the writer exited on its own");
+
+				uint64_t ack = 0;
+				while (read(pipes[0], &ack, sizeof(ack)) == sizeof(ack))
+					acknowledged = std::max(acknowledged, ack);
+				close(pipes[0]);
+
+				CResumeJournal journal;
+				BENCH_CHECK(journal.Open(path, journalOptions) == BS_OK, "reopen after the kill failed");
+				uint64_t records = journal.Records();
+				BENCH_CHECK(records >= acknowledged, "acknowledged events lost");
+
+				ReferenceState(records, reference);
+				BENCH_CHECK(SameState(journal, reference), "recovered state is not a prefix of the events");
+				journal.Close();
+			}
+
+			Report("journal", "crash_rounds", rounds, "kills");
+			Report("journal", "crash_events_recovered", (double)reference.records, "events");
+
+			// torn and garbled tails of the newest log.
+			CResumeJournal journal;
+			BENCH_CHECK(journal.Open(path, journalOptions) == BS_OK, "reopen failed");
+			uint64_t generation = journal.Stats().generation;
+			uint64_t total = journal.Records();
+			journal.Close();
+
+			std::string logPath = path + "." + std::to_string(generation) + ".log";
+			std::vector<uint8_t> log;
+			BENCH_CHECK(ReadFileBytes(logPath, log), "cannot read the log");
+
+			unsigned cuts = 0;
+			for (unsigned i = 0; i < 40 && !log.empty(); ++i, ++cuts)
+			{
+				uint8_t random[8];
+				FillRandom(random, sizeof(random), state);
+				size_t cut = (size_t)((random[0] | random[1] << 8 | random[2] << 16) % (log.size() + 1));
+				std::vector<uint8_t> torn(log.begin(), log.begin() + cut);
+				if (random[3] & 1)
+				{
+					// a garbled tail, as left by a write the disk never finished.
+					std::vector<uint8_t> garbage(1 + random[4] % 64);
+					FillRandom(garbage.data(), garbage.size(), state);
+					torn.insert(torn.end(), garbage.begin(), garbage.end());
+				}
+				BENCH_CHECK(WriteFileBytes(logPath, torn.data(), torn.size()), "cannot write the log");
+
+				BENCH_CHECK(journal.Open(path, journalOptions) == BS_OK, "reopen of a torn log failed");
+				uint64_t records = journal.Records();
+				BENCH_CHECK(records <= total, "a torn log grew records");
+				ReferenceState(records, reference);
+				BENCH_CHECK(SameState(journal, reference), "torn log state is not a prefix of the events");
+				journal.Close();
+			}
+			BENCH_CHECK(WriteFileBytes(logPath, log.data(), log.size()), "cannot restore the log");
+			Report("journal", "torn_tails_recovered", cuts, "cuts");
+			return 0;
+		}
+
+		void RemoveJournalFiles(const std::string& directory)
+		{
+			RemoveTree(directory);
+		}
+	}
+
+	int RunJournalBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+		std::string directory = options.workDir + "/journal";
+		RemoveJournalFiles(directory);
+		mkdir(directory.c_str(), 0755);
+
+		int result = RunThroughput(options, directory);
+		if (result == 0)
+			result = RunCrashRounds(options, directory);
+
+		RemoveJournalFiles(directory);
+		return result;
+	}
+}
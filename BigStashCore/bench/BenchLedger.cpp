@@ -0,0 +1,485 @@
+// BenchLedger.cpp : Part ledger resume benchmark.
+//
+// Uploads half of a file to the S3 stand-in, recording the parts in a
+// journal, reopens the journal as after a restart and resumes and
+// completes the file from the ledger: no ListParts may be sent and the
+// object's ETag must match the local digest. The repair checks make the
+// journal disagree with S3 in each way it can (a part S3 took that was
+// never recorded, a recorded part S3 dropped, a digest that contradicts
+// its ETag, an upload S3 no longer knows) and check that the ledger finds
+// and fixes each. The resume pass seeds 10,000 partially uploaded files
+// (1,000 with --quick) on the stand-in and in the journal, and plans
+// their resume once the old way, ListParts for every file from 8 threads,
+// and once from the ledger, the journal replay included; both must plan
+// the same parts. A last pass resumes with a sample of the files listed.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../ContentHasher.h"
+#include "../Encoding.h"
+#include "../PartLedger.h"
+#include "../PartPlanner.h"
+#include "../ResumeJournal.h"
+#include "../S3Client.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const uint64_t PART_SIZE = S3_MIN_PART_SIZE;
+		const unsigned CONNECTIONS = 8;
+
+		// per request in the resume pass, standing in for the round trip.
+		const unsigned RESPONSE_DELAY_MS = 10;
+
+		// resumes per listing in the sampled pass.
+		const unsigned VERIFY_EVERY = 64;
+
+		const char* BUCKET = "bench-bucket";
+
+		std::string Key(uint32_t file)
+		{
+			return "ledger/file-" + std::to_string(file) + ".bin";
+		}
+
+		std::string ObjectPath(uint32_t file)
+		{
+			return std::string("/") + BUCKET + "/" + Key(file);
+		}
+
+		bool WriteTestFile(const std::string& path, uint64_t size)
+		{
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+
+			std::vector<uint8_t> buffer(1024 * 1024);
+			uint64_t state = 31;
+			for (uint64_t offset = 0; offset < size; offset += buffer.size())
+			{
+				size_t length = (size_t)std::min<uint64_t>(buffer.size(), size - offset);
+				FillRandom(buffer.data(), length, state);
+				if (write(fd, buffer.data(), length) != (ssize_t)length)
+				{
+					close(fd);
+					return false;
+				}
+			}
+
+			close(fd);
+			return true;
+		}
+
+		// A synthetic part of a seeded file: its digest, and the ETag S3
+		// would give it.
+		S3Part SyntheticPart(uint32_t file, uint32_t partNumber, uint64_t size)
+		{
+			uint32_t seed[2] = { file, partNumber };
+			S3Part part;
+			part.partNumber = partNumber;
+			part.size = size;
+			CMd5::Hash(seed, sizeof(seed), part.md5);
+			part.hasMd5 = true;
+			part.etag = "\"" + HexEncode(part.md5, MD5_DIGEST_SIZE) + "\"";
+			return part;
+		}
+
+		bool SeedPart(CS3StandIn& server, CPartLedger& ledger, const std::string& uploadId, uint32_t file,
+			const S3Part& part, bool record)
+		{
+			return server.SeedPart(uploadId, part.partNumber, part.size, part.etag) &&
+				(!record || ledger.RecordPart(file, part) == BS_OK);
+		}
+
+		std::vector<uint32_t> PartNumbers(const std::vector<PartSpan>& spans)
+		{
+			std::vector<uint32_t> numbers;
+			for (const PartSpan& span : spans)
+				numbers.push_back(span.partNumber);
+			return numbers;
+		}
+
+		BsStatus UploadSpans(CS3Client& client, CPartLedger& ledger, uint32_t file, const std::string& path,
+			const std::string& uploadId, const std::vector<PartSpan>& spans)
+		{
+			PartReaderOptions readerOptions;
+			CBufferPool pool(PART_SIZE, readerOptions.readAhead + CONNECTIONS);
+			CPartReader reader(pool);
+			BsStatus status = reader.Open(path.c_str(), spans, readerOptions);
+			if (status != BS_OK)
+				return status;
+
+			std::vector<S3Part> uploaded;
+			BsStatus recorded = BS_OK;
+			status = client.UploadParts(BUCKET, Key(file), uploadId, reader, uploaded, [&](const S3Part& part)
+			{
+				if (recorded == BS_OK)
+					recorded = ledger.RecordPart(file, part);
+			});
+			reader.Close();
+			return status != BS_OK ? status : recorded;
+		}
+
+		int CheckInterruptedUpload(const std::string& directory, const std::string& path)
+		{
+			uint64_t size = 7 * PART_SIZE + PART_SIZE / 2;
+			BENCH_CHECK(WriteTestFile(path, size), "could not write the test file");
+			ContentDigest digest;
+			BENCH_CHECK(HashFile(path.c_str(), PART_SIZE, digest) == BS_OK, "HashFile failed");
+			std::string expected = "\"" + digest.ETag(true) + "\"";
+
+			CS3StandIn server((S3StandInOptions()));
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+			S3ClientOptions clientOptions;
+			clientOptions.host = "127.0.0.1";
+			clientOptions.port = server.Port();
+			clientOptions.connections = CONNECTIONS;
+			CS3Client client(clientOptions);
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			std::string journalPath = directory + "/interrupted";
+			PartLayout layout;
+			BENCH_CHECK(PartLayout::FromPartSize(size, PART_SIZE, layout) == BS_OK, "layout refused");
+			std::string uploadId;
+			{
+				CResumeJournal journal;
+				BENCH_CHECK(journal.Open(journalPath) == BS_OK, "Open failed");
+				CPartLedger ledger(journal);
+
+				BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, Key(0), uploadId) == BS_OK, "initiate failed");
+				BENCH_CHECK(ledger.StartFile(0, PART_SIZE, uploadId) == BS_OK, "StartFile failed");
+
+				// the first half goes out before the "crash".
+				std::vector<PartSpan> first;
+				for (uint32_t part = 1; part <= layout.partCount / 2; ++part)
+					first.push_back(layout.Part(part));
+				BENCH_CHECK(UploadSpans(client, ledger, 0, path, uploadId, first) == BS_OK, "first half failed");
+				BENCH_CHECK(journal.Sync() == BS_OK, "Sync failed");
+			}
+
+			CResumeJournal journal;
+			BENCH_CHECK(journal.Open(journalPath) == BS_OK, "reopen failed");
+			CPartLedger ledger(journal);
+			uint64_t listed = server.ListRequests();
+
+			LedgerResume resume;
+			BENCH_CHECK(ledger.Resume(client, BUCKET, Key(0), 0, size, resume) == BS_OK, "Resume failed");
+			BENCH_CHECK(resume.source == LEDGER_LOCAL && resume.uploadId == uploadId, "resume not planned locally");
+			BENCH_CHECK(resume.parts.size() == layout.partCount / 2 && resume.uploadedBytes == layout.partCount / 2 * PART_SIZE,
+				"uploaded parts not recorded");
+			BENCH_CHECK(resume.remaining.size() == layout.partCount - layout.partCount / 2 &&
+				resume.remaining.front().partNumber == layout.partCount / 2 + 1, "wrong parts left");
+			for (const S3Part& part : resume.parts)
+			{
+				BENCH_CHECK(part.hasMd5 && memcmp(part.md5, digest.parts[part.partNumber - 1].md5, MD5_DIGEST_SIZE) == 0,
+					"recorded digest differs from the part's");
+			}
+
+			BENCH_CHECK(UploadSpans(client, ledger, 0, path, uploadId, resume.remaining) == BS_OK, "second half failed");
+			std::string etag;
+			BENCH_CHECK(ledger.Complete(client, BUCKET, Key(0), 0, size, digest.Md5Hex(), etag) == BS_OK, "Complete failed");
+			std::string stored;
+			BENCH_CHECK(server.CompletedETag(ObjectPath(0), stored), "object missing");
+			BENCH_CHECK(etag == expected && stored == expected, "ETag differs from the local digest");
+			BENCH_CHECK(server.ListRequests() == listed, "resume or complete listed the parts");
+
+			JournalFileState state;
+			BENCH_CHECK(journal.GetFile(0, state) && state.completed && state.md5 == digest.Md5Hex(), "completion not recorded");
+			BENCH_CHECK(ledger.Resume(client, BUCKET, Key(0), 0, size, resume) == BS_E_NOTFOUND, "completed file resumed");
+
+			client.Stop();
+			server.Stop();
+			unlink(path.c_str());
+			return 0;
+		}
+
+		int CheckRepairs(const std::string& directory)
+		{
+			CS3StandIn server((S3StandInOptions()));
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+			S3ClientOptions clientOptions;
+			clientOptions.host = "127.0.0.1";
+			clientOptions.port = server.Port();
+			CS3Client client(clientOptions);
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			CResumeJournal journal;
+			BENCH_CHECK(journal.Open(directory + "/repairs") == BS_OK, "Open failed");
+			CPartLedger ledger(journal);
+
+			const uint32_t parts = 6;
+			uint64_t size = parts * PART_SIZE - 1000;
+			PartLayout layout;
+			BENCH_CHECK(PartLayout::FromPartSize(size, PART_SIZE, layout) == BS_OK, "layout refused");
+			std::vector<std::string> uploads;
+			for (uint32_t file = 0; file < 4; ++file)
+			{
+				uploads.push_back(server.SeedUpload(ObjectPath(file)));
+				BENCH_CHECK(ledger.StartFile(file, PART_SIZE, uploads[file]) == BS_OK, "StartFile failed");
+			}
+
+			// S3 took part 3 of file 0, the crash came before its record:
+			// planned again locally, found by the listing.
+			for (uint32_t part = 1; part <= 3; ++part)
+			{
+				BENCH_CHECK(SeedPart(server, ledger, uploads[0], 0, SyntheticPart(0, part, PART_SIZE), part != 3),
+					"seeding failed");
+			}
+			LedgerResume resume;
+			BENCH_CHECK(ledger.Plan(0, size, resume) == BS_OK && PartNumbers(resume.remaining) ==
+				std::vector<uint32_t>({ 3, 4, 5, 6 }), "lagging journal planned wrong");
+			BENCH_CHECK(ledger.Verify(client, BUCKET, Key(0), 0, size, resume) == BS_OK && resume.source == LEDGER_REPAIRED &&
+				PartNumbers(resume.remaining) == std::vector<uint32_t>({ 4, 5, 6 }) && !resume.parts[2].hasMd5 &&
+				resume.parts[1].hasMd5, "unrecorded part not adopted");
+			BENCH_CHECK(ledger.Verify(client, BUCKET, Key(0), 0, size, resume) == BS_OK && resume.source == LEDGER_VERIFIED,
+				"repaired journal still differs");
+
+			// file 1 is whole in the journal but S3 lost part 4: Complete is
+			// refused, lists, and leaves part 4 for the next resume.
+			for (uint32_t part = 1; part <= parts; ++part)
+			{
+				BENCH_CHECK(SeedPart(server, ledger, uploads[1], 1, SyntheticPart(1, part, layout.Part(part).length), true),
+					"seeding failed");
+			}
+			BENCH_CHECK(server.DropPart(uploads[1], 4), "drop failed");
+			std::string etag;
+			BENCH_CHECK(ledger.Complete(client, BUCKET, Key(1), 1, size, "", etag) == BS_E_INVALIDARG,
+				"complete with a lost part succeeded");
+			BENCH_CHECK(ledger.Stats().completeRetries == 1, "refused complete not verified");
+			BENCH_CHECK(ledger.Resume(client, BUCKET, Key(1), 1, size, resume) == BS_OK && resume.source == LEDGER_LOCAL &&
+				PartNumbers(resume.remaining) == std::vector<uint32_t>({ 4 }), "lost part not planned");
+			BENCH_CHECK(SeedPart(server, ledger, uploads[1], 1, SyntheticPart(1, 4, PART_SIZE), true), "seeding failed");
+			BENCH_CHECK(ledger.Complete(client, BUCKET, Key(1), 1, size, "", etag) == BS_OK, "complete failed");
+			std::string stored;
+			BENCH_CHECK(server.CompletedETag(ObjectPath(1), stored) && stored == etag, "object ETag differs");
+
+			// file 2's record of part 2 carries another part's digest.
+			for (uint32_t part = 1; part <= 2; ++part)
+			{
+				S3Part seeded = SyntheticPart(2, part, PART_SIZE);
+				BENCH_CHECK(server.SeedPart(uploads[2], part, seeded.size, seeded.etag), "seeding failed");
+				if (part == 2)
+					CMd5::Hash("other", 5, seeded.md5);
+				BENCH_CHECK(ledger.RecordPart(2, seeded) == BS_OK, "RecordPart failed");
+			}
+			BENCH_CHECK(ledger.Plan(2, size, resume) == BS_E_CORRUPT, "contradicting digest not noticed");
+			BENCH_CHECK(ledger.Resume(client, BUCKET, Key(2), 2, size, resume) == BS_OK && resume.source == LEDGER_REPAIRED &&
+				resume.parts.size() == 2 && resume.parts[0].hasMd5 && !resume.parts[1].hasMd5, "digest not dropped");
+
+			// file 3's upload was aborted behind the journal's back.
+			BENCH_CHECK(SeedPart(server, ledger, uploads[3], 3, SyntheticPart(3, 1, PART_SIZE), true), "seeding failed");
+			BENCH_CHECK(client.AbortMultipartUpload(BUCKET, Key(3), uploads[3]) == BS_OK, "abort failed");
+			BENCH_CHECK(ledger.Verify(client, BUCKET, Key(3), 3, size, resume) == BS_E_NOTFOUND, "lost upload resumed");
+			JournalFileState state;
+			BENCH_CHECK(journal.GetFile(3, state) && !state.started && state.parts.empty(), "lost upload not reset");
+
+			// every ledger check must survive a replay.
+			std::vector<JournalFileState> before(4);
+			for (uint32_t file = 0; file < 4; ++file)
+				journal.GetFile(file, before[file]);
+			journal.Close();
+			BENCH_CHECK(journal.Open(directory + "/repairs") == BS_OK, "reopen failed");
+			for (uint32_t file = 0; file < 4; ++file)
+				BENCH_CHECK(journal.GetFile(file, state) && state == before[file], "replayed ledger differs");
+
+			Report("ledger", "repairs", (double)ledger.Stats().repairs, "files");
+			client.Stop();
+			server.Stop();
+			return 0;
+		}
+
+		// The part count and the recorded parts of a seeded file: about half,
+		// scattered, as the window leaves them when the upload stops.
+		uint32_t SeededPartCount(uint32_t file)
+		{
+			return 8 + file % 25;
+		}
+
+		bool IsSeeded(uint32_t file, uint32_t partNumber)
+		{
+			return (file * 2654435761u + partNumber * 40503u) % 7 < 3 || partNumber <= 2;
+		}
+
+		uint64_t SeededFileSize(uint32_t file)
+		{
+			return SeededPartCount(file) * PART_SIZE - (file * 7919ull) % (PART_SIZE / 2);
+		}
+
+		int MeasureResume(const BenchOptions& options, const std::string& directory)
+		{
+			uint32_t files = (uint32_t)FileCount(options, 10000, 1000);
+
+			S3StandInOptions serverOptions;
+			serverOptions.responseDelayMs = RESPONSE_DELAY_MS;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+			S3ClientOptions clientOptions;
+			clientOptions.host = "127.0.0.1";
+			clientOptions.port = server.Port();
+			clientOptions.connections = CONNECTIONS;
+			CS3Client client(clientOptions);
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			std::string journalPath = directory + "/resume";
+			JournalOptions journalOptions;
+			journalOptions.sync = false;
+			std::vector<std::string> uploads(files);
+			uint64_t seededParts = 0;
+			{
+				CResumeJournal journal;
+				BENCH_CHECK(journal.Open(journalPath, journalOptions) == BS_OK, "Open failed");
+				CPartLedger ledger(journal);
+				for (uint32_t file = 0; file < files; ++file)
+				{
+					PartLayout layout;
+					BENCH_CHECK(PartLayout::FromPartSize(SeededFileSize(file), PART_SIZE, layout) == BS_OK, "layout refused");
+					uploads[file] = server.SeedUpload(ObjectPath(file));
+					BENCH_CHECK(ledger.StartFile(file, PART_SIZE, uploads[file]) == BS_OK, "StartFile failed");
+					for (uint32_t part = 1; part <= layout.partCount; ++part)
+					{
+						if (!IsSeeded(file, part))
+							continue;
+						BENCH_CHECK(SeedPart(server, ledger, uploads[file], file,
+							SyntheticPart(file, part, layout.Part(part).length), true), "seeding failed");
+						seededParts++;
+					}
+				}
+				BENCH_CHECK(journal.Sync() == BS_OK, "Sync failed");
+			}
+
+			// the old way: list every file's parts, CONNECTIONS at a time.
+			std::vector<std::vector<uint32_t> > listedPlans(files);
+			std::atomic<uint32_t> next(0);
+			std::atomic<bool> failed(false);
+			uint64_t listed = server.ListRequests();
+			CStopwatch stopwatch;
+			std::vector<std::thread> workers;
+			for (unsigned i = 0; i < CONNECTIONS; ++i)
+			{
+				workers.push_back(std::thread([&]()
+				{
+					std::vector<S3Part> parts;
+					std::vector<PartSpan> remaining;
+					for (uint32_t file; (file = next++) < files; )
+					{
+						PartLayout layout;
+						if (client.ListParts(BUCKET, Key(file), uploads[file], parts) != BS_OK ||
+							PartLayout::FromPartSize(SeededFileSize(file), PART_SIZE, layout) != BS_OK)
+						{
+							failed = true;
+							continue;
+						}
+
+						CPartBitmap bitmap(layout);
+						for (const S3Part& part : parts)
+						{
+							if (bitmap.MarkCompleted(part.partNumber, part.size) != BS_OK)
+								failed = true;
+						}
+						bitmap.RemainingParts(remaining);
+						listedPlans[file] = PartNumbers(remaining);
+					}
+				}));
+			}
+			for (std::thread& worker : workers)
+				worker.join();
+			double listSeconds = stopwatch.Seconds();
+			BENCH_CHECK(!failed, "ListParts resume failed");
+			uint64_t listRequests = server.ListRequests() - listed;
+			BENCH_CHECK(listRequests == files, "not one listing per file");
+
+			// the ledger, from a cold start: replay, then plan every file.
+			listed = server.ListRequests();
+			stopwatch.Restart();
+			CResumeJournal journal;
+			BENCH_CHECK(journal.Open(journalPath, journalOptions) == BS_OK, "reopen failed");
+			double replaySeconds = stopwatch.Seconds();
+			{
+				CPartLedger ledger(journal);
+				LedgerResume resume;
+				for (uint32_t file = 0; file < files; ++file)
+				{
+					BENCH_CHECK(ledger.Resume(client, BUCKET, Key(file), file, SeededFileSize(file), resume) == BS_OK,
+						"ledger resume failed");
+					BENCH_CHECK(resume.source == LEDGER_LOCAL && PartNumbers(resume.remaining) == listedPlans[file],
+						"ledger plan differs from the listing's");
+				}
+			}
+			double ledgerSeconds = stopwatch.Seconds();
+			BENCH_CHECK(server.ListRequests() == listed, "ledger resume listed parts");
+
+			// with every VERIFY_EVERY-th file listed, CONNECTIONS at a time.
+			LedgerOptions ledgerOptions;
+			ledgerOptions.verifyEvery = VERIFY_EVERY;
+			CPartLedger sampled(journal, ledgerOptions);
+			next = 0;
+			workers.clear();
+			stopwatch.Restart();
+			for (unsigned i = 0; i < CONNECTIONS; ++i)
+			{
+				workers.push_back(std::thread([&]()
+				{
+					LedgerResume resume;
+					for (uint32_t file; (file = next++) < files; )
+					{
+						if (sampled.Resume(client, BUCKET, Key(file), file, SeededFileSize(file), resume) != BS_OK ||
+							resume.source == LEDGER_REPAIRED || PartNumbers(resume.remaining) != listedPlans[file])
+							failed = true;
+					}
+				}));
+			}
+			for (std::thread& worker : workers)
+				worker.join();
+			double sampledSeconds = stopwatch.Seconds();
+			LedgerStats stats = sampled.Stats();
+			BENCH_CHECK(!failed, "sampled resume failed or repaired");
+			BENCH_CHECK(stats.listings == files / VERIFY_EVERY && stats.repairs == 0, "sampling off");
+
+			Report("ledger", "files", (double)files, "files");
+			Report("ledger", "recorded_parts", (double)seededParts, "parts");
+			Report("ledger", "listparts_resume_s", listSeconds, "s");
+			Report("ledger", "listparts_requests", (double)listRequests, "requests");
+			Report("ledger", "ledger_replay_s", replaySeconds, "s");
+			Report("ledger", "ledger_resume_s", ledgerSeconds, "s");
+			Report("ledger", "ledger_files_per_s", files / ledgerSeconds, "files/s");
+			Report("ledger", "ledger_speedup", listSeconds / ledgerSeconds, "x");
+			Report("ledger", "sampled_resume_s", sampledSeconds, "s");
+			Report("ledger", "sampled_listings", (double)stats.listings, "requests");
+
+			journal.Close();
+			client.Stop();
+			server.Stop();
+			return 0;
+		}
+	}
+
+	int RunLedgerBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+		std::string directory = options.workDir + "/ledger";
+		RemoveTree(directory);
+		mkdir(directory.c_str(), 0755);
+
+		int result = CheckInterruptedUpload(directory, directory + "/interrupted.bin");
+		if (result == 0)
+			result = CheckRepairs(directory);
+		if (result == 0)
+			result = MeasureResume(options, directory);
+
+		RemoveTree(directory);
+		return result;
+	}
+}
@@ -0,0 +1,418 @@
+// BenchLog.cpp : Binary upload log benchmark.
+//
+// Several threads log records with every kind of placeholder; the decoded
+// file must hold exactly the lines a straightforward snprintf formatter
+// makes of the same arguments, the same as the writer's line callback,
+// each thread's in order. A burst into a small ring must drop records (and say so)
+// rather than wait, a format over its rate must be limited while errors
+// are not, and a file cut in the middle of a frame must decode up to the
+// cut. An upload with injected 500s must log each part and retry once.
+// Then reports records per second and the p50/p99/p999 time a Log
+// call adds for its caller, against formatting each line into a string
+// and writing it, the way the managed upload path logs today.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../BinaryLogger.h"
+#include "../PartPlanner.h"
+#include "../S3Client.h"
+#include "../UploadTracer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const unsigned THREADS = 4;
+		const char* TEST_FORMAT = "record {u} of thread {u}: {i} {x} {f} {t}";
+
+		// The argument of record i of a thread, and the line the reference
+		// formatter makes of it.
+		int64_t SignedArgument(unsigned thread, uint64_t i)
+		{
+			return (int64_t)(i * 7919) - (int64_t)thread * 1000003;
+		}
+
+		double RealArgument(uint64_t i)
+		{
+			return (double)i / 8.0;
+		}
+
+		std::string ReferenceLine(unsigned thread, uint64_t i, const std::string& name)
+		{
+			char text[256];
+			snprintf(text, sizeof(text), "record %llu of thread %u: %lld 0x%llx %.6g %s", (unsigned long long)i, thread,
+				(long long)SignedArgument(thread, i), (unsigned long long)(i * 0x9E3779B97F4A7C15ull), RealArgument(i),
+				name.c_str());
+			return text;
+		}
+
+		// The message of a line, without the time, thread and level.
+		std::string Message(const std::string& line)
+		{
+			size_t level = line.find(" T");
+			size_t message = level == std::string::npos ? std::string::npos : line.find(' ', level + 2);
+			while (message != std::string::npos && message < line.size() && line[message] == ' ')
+				message++;
+			message = message == std::string::npos ? std::string::npos : line.find(' ', message);
+			while (message != std::string::npos && message < line.size() && line[message] == ' ')
+				message++;
+			return message == std::string::npos ? std::string() : line.substr(message);
+		}
+
+		std::vector<std::string> Decode(const std::string& path, uint64_t& records)
+		{
+			std::vector<std::string> lines;
+			BsStatus status = DecodeLog(path.c_str(), [&lines](const std::string& line)
+			{
+				lines.push_back(line);
+			}, &records);
+			if (status != BS_OK)
+				lines.clear();
+			return lines;
+		}
+
+		// The records the writer added to say some went missing.
+		uint64_t CountNotices(const std::vector<std::string>& lines)
+		{
+			uint64_t notices = 0;
+			for (const std::string& line : lines)
+				notices += line.find(" log records dropped, ") != std::string::npos ? 1 : 0;
+			return notices;
+		}
+
+		int CheckRecords(const BenchOptions& options, const std::string& path)
+		{
+			uint64_t perThread = options.quick ? 20000 : 200000;
+
+			LogOptions logOptions;
+			logOptions.ringRecords = 1 << 16;
+			logOptions.flushIntervalMs = 5;
+			logOptions.level = LOG_DEBUG;
+			logOptions.maxPerSecond = 0;
+
+			std::vector<std::string> live;
+			CBinaryLogger logger;
+			uint32_t format = logger.RegisterFormat(LOG_INFO, TEST_FORMAT);
+			BENCH_CHECK(format >= LOG_BUILTIN_FORMATS, "format not registered");
+			BENCH_CHECK(logger.RegisterFormat(LOG_INFO, "bad {q}") == 0, "unknown placeholder accepted");
+			BENCH_CHECK(logger.RegisterFormat(LOG_INFO, "{u}{u}{u}{u}{u}{u}{u}") == 0, "seven placeholders accepted");
+			BENCH_CHECK(logger.Open(path.c_str(), logOptions, [&live](const std::string& line)
+			{
+				live.push_back(line);
+			}) == BS_OK, "Open failed");
+
+			std::set<std::string> expected;
+			std::vector<std::string> names(THREADS);
+			for (unsigned thread = 0; thread < THREADS; ++thread)
+			{
+				names[thread] = "archive/file " + std::to_string(thread) + ".bin";
+				for (uint64_t i = 0; i < perThread; ++i)
+					expected.insert(ReferenceLine(thread, i, names[thread]));
+			}
+
+			std::vector<std::thread> threads;
+			for (unsigned thread = 0; thread < THREADS; ++thread)
+			{
+				threads.push_back(std::thread([&, thread]()
+				{
+					uint32_t name = logger.Intern(names[thread]);
+					for (uint64_t i = 0; i < perThread; ++i)
+					{
+						logger.Log(format, i, thread, SignedArgument(thread, i), i * 0x9E3779B97F4A7C15ull,
+							RealArgument(i), name);
+
+						// stays under the ring, so nothing may be dropped.
+						if (i % 16384 == 16383)
+							logger.Flush();
+					}
+				}));
+			}
+			for (std::thread& thread : threads)
+				thread.join();
+
+			// a record after Close is not kept.
+			logger.Close();
+			logger.Log(format, 0, 0, 0, 0, 0.0, 0);
+
+			LogStats stats = logger.Stats();
+			BENCH_CHECK(stats.dropped == 0 && stats.rateLimited == 0, "records lost");
+			BENCH_CHECK(stats.written == THREADS * perThread, "written count wrong");
+			BENCH_CHECK(stats.writeStatus == BS_OK, "write failed");
+
+			uint64_t records = 0;
+			std::vector<std::string> lines = Decode(path, records);
+			BENCH_CHECK(!lines.empty() && records == stats.written && lines.size() == records + 1, "decoded count wrong");
+			BENCH_CHECK(lines[0].compare(0, 11, "log opened ") == 0, "no opening line");
+			BENCH_CHECK(std::vector<std::string>(lines.begin() + 1, lines.end()) == live, "callback and decoder differ");
+
+			struct stat info;
+			BENCH_CHECK(stat(path.c_str(), &info) == 0 && (uint64_t)info.st_size == stats.bytesWritten, "size differs");
+
+			// a thread's records are in order; threads interleave by time
+			// within a drain, which a thread preempted mid-call may straddle.
+			std::set<std::string> decoded;
+			std::vector<double> last(THREADS + 1, -1);
+			for (size_t i = 1; i < lines.size(); ++i)
+			{
+				double time = atof(lines[i].c_str());
+				unsigned thread = (unsigned)atoi(lines[i].c_str() + lines[i].find(" T") + 2);
+				BENCH_CHECK(thread >= 1 && thread <= THREADS, "thread number out of range");
+				BENCH_CHECK(time >= last[thread], "a thread's records out of order");
+				last[thread] = time;
+				BENCH_CHECK(lines[i].find(" INFO ") != std::string::npos, "level missing");
+				decoded.insert(Message(lines[i]));
+			}
+			BENCH_CHECK(decoded == expected, "decoded lines differ from the reference formatter");
+
+			// a file cut inside a frame decodes up to the frame before.
+			BENCH_CHECK(truncate(path.c_str(), info.st_size - 100) == 0, "truncate failed");
+			std::vector<std::string> torn = Decode(path, records);
+			BENCH_CHECK(!torn.empty() && records < stats.written && records > 0, "torn tail not handled");
+			for (size_t i = 1; i < torn.size(); ++i)
+				BENCH_CHECK(torn[i] == lines[i], "torn file decodes differently");
+
+			BENCH_CHECK(truncate(path.c_str(), 10) == 0, "truncate failed");
+			BENCH_CHECK(DecodeLog(path.c_str(), [](const std::string&) {}) == BS_E_CORRUPT, "short header accepted");
+
+			Report("log", "bytes_per_record", (double)stats.bytesWritten / (double)stats.written, "bytes");
+			return 0;
+		}
+
+		int CheckLimits(const std::string& path)
+		{
+			// a ring of 16 the writer drains once a second: a burst overflows.
+			LogOptions logOptions;
+			logOptions.ringRecords = 16;
+			logOptions.flushIntervalMs = 1000;
+			logOptions.maxPerSecond = 0;
+
+			CBinaryLogger logger;
+			uint32_t format = logger.RegisterFormat(LOG_INFO, "burst {u}");
+			BENCH_CHECK(logger.Open(path.c_str(), logOptions) == BS_OK, "Open failed");
+
+			const uint64_t burst = 10000;
+			CStopwatch stopwatch;
+			for (uint64_t i = 0; i < burst; ++i)
+				logger.Log(format, i);
+			double seconds = stopwatch.Seconds();
+			logger.Close();
+
+			LogStats stats = logger.Stats();
+			uint64_t records = 0;
+			std::vector<std::string> lines = Decode(path, records);
+			uint64_t notices = CountNotices(lines);
+			BENCH_CHECK(stats.dropped > 0 && stats.written >= 16, "full ring did not drop");
+			BENCH_CHECK(stats.written == burst - stats.dropped + notices, "records unaccounted for");
+			BENCH_CHECK(seconds < 0.5, "a full ring made the caller wait");
+
+			std::string notice = std::to_string(stats.dropped) + " log records dropped, 0 rate limited";
+			BENCH_CHECK(notices == 1 && Message(lines.back()) == notice, "drop not logged");
+
+			// 100 a second of one format; errors go through.
+			logOptions.ringRecords = 1 << 16;
+			logOptions.flushIntervalMs = 5;
+			logOptions.maxPerSecond = 100;
+			uint32_t error = logger.RegisterFormat(LOG_ERROR, "error {u}");
+			BENCH_CHECK(logger.Open(path.c_str(), logOptions) == BS_OK, "reopen failed");
+			stopwatch.Restart();
+			for (uint64_t i = 0; i < burst; ++i)
+			{
+				logger.Log(format, i);
+				if (i % 100 == 0)
+					logger.Log(error, i);
+			}
+			seconds = stopwatch.Seconds();
+			logger.Close();
+
+			stats = logger.Stats();
+			lines = Decode(path, records);
+			notices = CountNotices(lines);
+			uint64_t errors = burst / 100;
+			BENCH_CHECK(stats.dropped == 0 && stats.rateLimited > 0, "rate not limited");
+			BENCH_CHECK(stats.written == burst + errors - stats.rateLimited + notices, "records unaccounted for");
+			BENCH_CHECK(stats.written - errors - notices <= 100 * (uint64_t)(seconds + 2), "more than the rate admitted");
+
+			size_t errorLines = 0;
+			for (const std::string& line : lines)
+				errorLines += line.find(" ERROR error ") != std::string::npos ? 1 : 0;
+			BENCH_CHECK(errorLines == errors, "errors rate limited");
+			return 0;
+		}
+
+		size_t CountLines(const std::vector<std::string>& lines, const std::string& text)
+		{
+			size_t count = 0;
+			for (const std::string& line : lines)
+				count += line.find(text) != std::string::npos ? 1 : 0;
+			return count;
+		}
+
+		int CheckUploadLog(const std::string& path)
+		{
+			std::string dataPath = path + ".bin";
+			uint64_t size = 6 * S3_MIN_PART_SIZE + 999;
+			{
+				int fd = open(dataPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				BENCH_CHECK(fd >= 0, "cannot create the upload file");
+				std::vector<uint8_t> data((size_t)size);
+				uint64_t state = 3;
+				FillRandom(data.data(), data.size(), state);
+				bool written = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+				close(fd);
+				BENCH_CHECK(written, "cannot write the upload file");
+			}
+
+			// every third part upload fails once with a 500.
+			S3StandInOptions serverOptions;
+			serverOptions.failEvery = 3;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			CBinaryLogger logger;
+			LogOptions logOptions;
+			logOptions.level = LOG_DEBUG;
+			BENCH_CHECK(logger.Open(path.c_str(), logOptions) == BS_OK, "Open failed");
+
+			S3ClientOptions clientOptions;
+			clientOptions.host = "127.0.0.1";
+			clientOptions.port = server.Port();
+			clientOptions.connections = 2;
+			clientOptions.logger = &logger;
+			CS3Client client(clientOptions);
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			std::string uploadId;
+			BENCH_CHECK(client.InitiateMultipartUpload("bench-bucket", "logged.bin", uploadId) == BS_OK, "initiate failed");
+
+			std::vector<PartSpan> spans = UniformParts(size, S3_MIN_PART_SIZE);
+			PartReaderOptions readerOptions;
+			CBufferPool pool(S3_MIN_PART_SIZE, readerOptions.readAhead + clientOptions.connections);
+			CPartReader reader(pool);
+			BENCH_CHECK(reader.Open(dataPath.c_str(), spans, readerOptions) == BS_OK, "reader Open failed");
+			std::vector<S3Part> uploaded;
+			BsStatus status = client.UploadParts("bench-bucket", "logged.bin", uploadId, reader, uploaded);
+			reader.Close();
+			client.Stop();
+			server.Stop();
+			logger.Close();
+			unlink(dataPath.c_str());
+			BENCH_CHECK(status == BS_OK && uploaded.size() == spans.size(), "upload failed");
+
+			uint64_t records = 0;
+			std::vector<std::string> lines = Decode(path, records);
+			BENCH_CHECK(CountLines(lines, "logged.bin: uploading, 2 parts in flight at most") == 1, "start not logged");
+			BENCH_CHECK(CountLines(lines, " sent, ") == spans.size(), "sent parts not logged");
+			BENCH_CHECK(CountLines(lines, "failed (IO, HTTP 500), retrying in") == server.FailuresInjected(),
+				"retries not logged");
+			std::string finished = "logged.bin: " + std::to_string(spans.size()) + " parts, " + std::to_string(size) +
+				" bytes in ";
+			BENCH_CHECK(CountLines(lines, finished) == 1 && Message(lines.back()).find("(OK)") != std::string::npos,
+				"finish not logged");
+			return 0;
+		}
+
+		int MeasureCallers(const BenchOptions& options, const std::string& path)
+		{
+			uint64_t count = options.quick ? 500000 : 5000000;
+
+			// the clock reads around every call, to take out of the latencies.
+			CLatencyHistogram clock;
+			for (uint64_t i = 0; i < 100000; ++i)
+			{
+				int64_t start = MonotonicNanoseconds();
+				clock.Record(MonotonicNanoseconds() - start);
+			}
+			int64_t clockNs = clock.ValueAtPercentile(50);
+
+			// a ring that holds a few milliseconds of a thread logging
+			// flat out, as the writer shares the cores with it.
+			LogOptions logOptions;
+			logOptions.ringRecords = 1 << 18;
+			logOptions.flushIntervalMs = 2;
+			logOptions.maxPerSecond = 0;
+
+			CBinaryLogger logger;
+			uint32_t format = logger.RegisterFormat(LOG_INFO, "{t} - part {u}: {u} / {u} bytes.");
+			BENCH_CHECK(logger.Open(path.c_str(), logOptions) == BS_OK, "Open failed");
+			uint32_t name = logger.Intern("archive 1/file.bin");
+
+			CLatencyHistogram binary;
+			CStopwatch stopwatch;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				int64_t start = MonotonicNanoseconds();
+				logger.Log(format, name, i % 1000 + 1, i * 4096, 5ull * 1024 * 1024);
+				binary.Record(MonotonicNanoseconds() - start - clockNs);
+			}
+			double callerSeconds = stopwatch.Seconds();
+			logger.Close();
+			double binarySeconds = stopwatch.Seconds();
+			LogStats stats = logger.Stats();
+			uint64_t records = 0;
+			uint64_t notices = CountNotices(Decode(path, records));
+			BENCH_CHECK(records == stats.written && stats.written + stats.dropped == count + notices,
+				"records unaccounted for");
+
+			// the reference: the line put together and written on every call.
+			std::string textPath = path + ".txt";
+			FILE* text = fopen(textPath.c_str(), "w");
+			BENCH_CHECK(text != NULL, "cannot create the text log");
+			std::string key = "archive 1/file.bin";
+			CLatencyHistogram formatted;
+			stopwatch.Restart();
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				int64_t start = MonotonicNanoseconds();
+				std::string line = key + " - part " + std::to_string(i % 1000 + 1) + ": " + std::to_string(i * 4096) +
+					" / " + std::to_string(5ull * 1024 * 1024) + " bytes.\n";
+				fwrite(line.data(), 1, line.size(), text);
+				formatted.Record(MonotonicNanoseconds() - start - clockNs);
+			}
+			double formattedSeconds = stopwatch.Seconds();
+			fclose(text);
+			unlink(textPath.c_str());
+
+			// callers' rate, and what reached the file by the time it closed.
+			Report("log", "calls_per_second", count / callerSeconds, "calls/s");
+			Report("log", "records_per_second", (stats.written - notices) / binarySeconds, "records/s");
+			Report("log", "dropped_records", (double)stats.dropped, "records");
+			Report("log", "caller_p50_ns", (double)binary.ValueAtPercentile(50), "ns");
+			Report("log", "caller_p99_ns", (double)binary.ValueAtPercentile(99), "ns");
+			Report("log", "caller_p999_ns", (double)binary.ValueAtPercentile(99.9), "ns");
+			Report("log", "formatted_lines_per_second", count / formattedSeconds, "lines/s");
+			Report("log", "formatted_p50_ns", (double)formatted.ValueAtPercentile(50), "ns");
+			Report("log", "formatted_p99_ns", (double)formatted.ValueAtPercentile(99), "ns");
+			return 0;
+		}
+	}
+
+	int RunLogBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+		std::string path = options.workDir + "/upload.bslog";
+
+		int result = CheckRecords(options, path);
+		if (result == 0)
+			result = CheckLimits(path);
+		if (result == 0)
+			result = CheckUploadLog(path);
+		if (result == 0)
+			result = MeasureCallers(options, path);
+
+		unlink(path.c_str());
+		return result;
+	}
+}
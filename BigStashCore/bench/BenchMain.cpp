@@ -0,0 +1,375 @@
+// BenchMain.cpp : Entry point of the BigStashCore benchmark runner.
+//
+// Usage: bigstash_bench [suite ...] [--files=N] [--threads=N] [--dir=PATH] [--quick]
+//                       [--json=PATH] [--label=TEXT]
+//
+// Without suite names every suite runs. The exit code is non-zero when any
+// suite fails its checks. --json also writes every measurement, the outcome
+// and time of each suite and a description of the machine to PATH, for the
+// build boxes to compare runs; --label tags the run (a commit, a branch).
+
+#include "BenchCommon.h"
+#include "../CpuFeatures.h"
+#include "../Json.h"
+#include "../Platform.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/utsname.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace BigStashBench
+{
+	int RunScanBenchmark(const BenchOptions& options);
+	int RunHashBenchmark(const BenchOptions& options);
+	int RunPartsBenchmark(const BenchOptions& options);
+	int RunPlanBenchmark(const BenchOptions& options);
+	int RunUploadBenchmark(const BenchOptions& options);
+	int RunSignBenchmark(const BenchOptions& options);
+	int RunScheduleBenchmark(const BenchOptions& options);
+	int RunPackBenchmark(const BenchOptions& options);
+	int RunProgressBenchmark(const BenchOptions& options);
+	int RunJournalBenchmark(const BenchOptions& options);
+	int RunManifestBenchmark(const BenchOptions& options);
+	int RunSelectionBenchmark(const BenchOptions& options);
+	int RunUtfBenchmark(const BenchOptions& options);
+	int RunNamesBenchmark(const BenchOptions& options);
+	int RunFileTableBenchmark(const BenchOptions& options);
+	int RunChangesBenchmark(const BenchOptions& options);
+	int RunDedupBenchmark(const BenchOptions& options);
+	int RunCompressBenchmark(const BenchOptions& options);
+	int RunCryptBenchmark(const BenchOptions& options);
+	int RunTraceBenchmark(const BenchOptions& options);
+	int RunLogBenchmark(const BenchOptions& options);
+	int RunHedgeBenchmark(const BenchOptions& options);
+	int RunLedgerBenchmark(const BenchOptions& options);
+	int RunStoreBenchmark(const BenchOptions& options);
+}
+
+using namespace BigStashBench;
+
+namespace
+{
+	struct Suite
+	{
+		const char* name;
+		int (*run)(const BenchOptions& options);
+	};
+
+	const Suite g_suites[] =
+	{
+		{ "scan", RunScanBenchmark },
+		{ "hash", RunHashBenchmark },
+		{ "parts", RunPartsBenchmark },
+		{ "plan", RunPlanBenchmark },
+		{ "upload", RunUploadBenchmark },
+		{ "sign", RunSignBenchmark },
+		{ "sched", RunScheduleBenchmark },
+		{ "pack", RunPackBenchmark },
+		{ "progress", RunProgressBenchmark },
+		{ "journal", RunJournalBenchmark },
+		{ "manifest", RunManifestBenchmark },
+		{ "selection", RunSelectionBenchmark },
+		{ "utf", RunUtfBenchmark },
+		{ "names", RunNamesBenchmark },
+		{ "table", RunFileTableBenchmark },
+		{ "changes", RunChangesBenchmark },
+		{ "dedup", RunDedupBenchmark },
+		{ "compress", RunCompressBenchmark },
+		{ "crypt", RunCryptBenchmark },
+		{ "trace", RunTraceBenchmark },
+		{ "log", RunLogBenchmark },
+		{ "hedge", RunHedgeBenchmark },
+		{ "ledger", RunLedgerBenchmark },
+		{ "store", RunStoreBenchmark },
+	};
+
+	struct Measurement
+	{
+		std::string suite;
+		std::string metric;
+		double value;
+		std::string unit;
+	};
+
+	struct SuiteResult
+	{
+		const char* name;
+		bool passed;
+		double seconds;
+	};
+
+	std::vector<Measurement> g_measurements;
+
+	bool ParseOption(const char* arg, const char* name, std::string& value)
+	{
+		size_t length = strlen(name);
+		if (strncmp(arg, name, length) != 0 || arg[length] != '=')
+			return false;
+
+		value = arg + length + 1;
+		return true;
+	}
+
+	void AppendString(std::string& json, const char* text)
+	{
+		BigStash::AppendJsonString(json, text, strlen(text));
+	}
+
+	// JSON has no NaN or infinity; a suite that measured nothing gets null.
+	void AppendNumber(std::string& json, double value)
+	{
+		if (!std::isfinite(value))
+		{
+			json += "null";
+			return;
+		}
+
+		char text[32];
+		snprintf(text, sizeof(text), "%.17g", value);
+		json += text;
+	}
+
+	void AppendHost(std::string& json)
+	{
+		const BigStash::CpuFeatures& cpu = BigStash::GetCpuFeatures();
+		const struct
+		{
+			const char* name;
+			bool present;
+		}
+		features[] =
+		{
+			{ "sse2", cpu.sse2 },
+			{ "ssse3", cpu.ssse3 },
+			{ "sse4.1", cpu.sse41 },
+			{ "avx2", cpu.avx2 },
+			{ "sha", cpu.sha },
+			{ "aes", cpu.aesni },
+			{ "pclmul", cpu.pclmul },
+			{ "vaes", cpu.vaes },
+			{ "vpclmul", cpu.vpclmul },
+			{ "avx512", cpu.avx512 },
+			{ "neon", cpu.neon },
+		};
+
+		struct utsname name;
+		if (uname(&name) != 0)
+			memset(&name, 0, sizeof(name));
+
+		json += "\"host\":{\"name\":";
+		AppendString(json, name.nodename);
+		json += ",\"os\":";
+		AppendString(json, name.sysname);
+		json += ",\"release\":";
+		AppendString(json, name.release);
+		json += ",\"arch\":";
+		AppendString(json, name.machine);
+		json += ",\"cores\":" + std::to_string(std::thread::hardware_concurrency());
+
+		// The extensions the kernels will use: none when BIGSTASH_DISABLE_SIMD
+		// is set, so a portable run is not mistaken for a regression.
+		json += ",\"cpu_features\":[";
+		bool first = true;
+		for (const auto& feature : features)
+		{
+			if (!feature.present)
+				continue;
+			if (!first)
+				json += ',';
+			AppendString(json, feature.name);
+			first = false;
+		}
+		json += "]}";
+	}
+
+	void AppendBuild(std::string& json)
+	{
+		json += "\"build\":{\"compiler\":";
+#if defined(__clang__)
+		AppendString(json, ("clang " __clang_version__));
+#elif defined(__GNUC__)
+		AppendString(json, ("gcc " __VERSION__));
+#else
+		AppendString(json, "unknown");
+#endif
+#ifdef NDEBUG
+		json += ",\"optimized\":true";
+#else
+		json += ",\"optimized\":false";
+#endif
+#ifdef BIGSTASH_HAVE_ZSTD
+		json += ",\"zstd\":true}";
+#else
+		json += ",\"zstd\":false}";
+#endif
+	}
+
+	// Writes the results document:
+	//   { "version": 1, "label": ..., "timestamp": ..., "host": {...},
+	//     "build": {...}, "options": {...},
+	//     "suites": [ { "name", "passed", "seconds" } ],
+	//     "results": [ { "suite", "metric", "value", "unit" } ] }
+	bool WriteResults(const std::string& path, const std::string& label, const BenchOptions& options,
+		int64_t startTime, const std::vector<SuiteResult>& suites)
+	{
+		std::string json = "{\"version\":1,\"label\":";
+		AppendString(json, label.c_str());
+		json += ",\"timestamp\":";
+		BigStash::AppendJsonDate(json, startTime);
+		json += ',';
+		AppendHost(json);
+		json += ',';
+		AppendBuild(json);
+
+		json += ",\"options\":{\"files\":" + std::to_string(options.files);
+		json += ",\"threads\":" + std::to_string(options.threads);
+		json += options.quick ? ",\"quick\":true}" : ",\"quick\":false}";
+
+		json += ",\"suites\":[";
+		for (size_t i = 0; i < suites.size(); ++i)
+		{
+			json += i == 0 ? "\n{\"name\":" : ",\n{\"name\":";
+			AppendString(json, suites[i].name);
+			json += suites[i].passed ? ",\"passed\":true" : ",\"passed\":false";
+			json += ",\"seconds\":";
+			AppendNumber(json, suites[i].seconds);
+			json += '}';
+		}
+
+		json += "],\"results\":[";
+		for (size_t i = 0; i < g_measurements.size(); ++i)
+		{
+			const Measurement& measurement = g_measurements[i];
+			json += i == 0 ? "\n{\"suite\":" : ",\n{\"suite\":";
+			AppendString(json, measurement.suite.c_str());
+			json += ",\"metric\":";
+			AppendString(json, measurement.metric.c_str());
+			json += ",\"value\":";
+			AppendNumber(json, measurement.value);
+			json += ",\"unit\":";
+			AppendString(json, measurement.unit.c_str());
+			json += '}';
+		}
+		json += "]}\n";
+
+		// Written next to the target and renamed, so a reader polling for
+		// the file never sees half of it.
+		std::string temporary = path + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file == NULL)
+			return false;
+
+		bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+		written = fclose(file) == 0 && written;
+		if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+
+		return true;
+	}
+}
+
+namespace BigStashBench
+{
+	void Report(const char* suite, const char* metric, double value, const char* unit)
+	{
+		printf("%s.%s %.3f %s\n", suite, metric, value, unit);
+		fflush(stdout);
+
+		Measurement measurement = { suite, metric, value, unit };
+		g_measurements.push_back(measurement);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	std::vector<std::string> selected;
+	std::string jsonPath;
+	std::string label;
+	std::string value;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+
+		if (ParseOption(arg, "--files", value))
+			options.files = strtoull(value.c_str(), NULL, 10);
+		else if (ParseOption(arg, "--threads", value))
+			options.threads = (unsigned)strtoul(value.c_str(), NULL, 10);
+		else if (ParseOption(arg, "--dir", value))
+			options.workDir = value;
+		else if (ParseOption(arg, "--json", value))
+			jsonPath = value;
+		else if (ParseOption(arg, "--label", value))
+			label = value;
+		else if (strcmp(arg, "--quick") == 0)
+			options.quick = true;
+		else if (arg[0] == '-')
+		{
+			fprintf(stderr, "unknown option %s\n", arg);
+			return 2;
+		}
+		else
+			selected.push_back(arg);
+	}
+
+	if (options.workDir.empty())
+	{
+		const char* tmp = getenv("TMPDIR");
+		options.workDir = std::string(tmp != NULL ? tmp : "/tmp") + "/bigstash-bench-" + std::to_string(getpid());
+	}
+
+	std::chrono::system_clock::duration now = std::chrono::system_clock::now().time_since_epoch();
+	int64_t startTime = BigStash::UnixTimeToFileTime(
+		std::chrono::duration_cast<std::chrono::seconds>(now).count(),
+		std::chrono::duration_cast<std::chrono::nanoseconds>(now % std::chrono::seconds(1)).count());
+
+	std::vector<SuiteResult> results;
+	int failures = 0;
+	bool ran = false;
+
+	for (const Suite& suite : g_suites)
+	{
+		bool run = selected.empty();
+		for (const std::string& name : selected)
+			run = run || name == suite.name;
+
+		if (!run)
+			continue;
+
+		ran = true;
+		CStopwatch stopwatch;
+		SuiteResult result = { suite.name, suite.run(options) == 0, 0 };
+		result.seconds = stopwatch.Seconds();
+		results.push_back(result);
+
+		if (!result.passed)
+		{
+			fprintf(stderr, "suite %s FAILED\n", suite.name);
+			failures++;
+		}
+	}
+
+	if (!ran)
+	{
+		fprintf(stderr, "no matching suite\n");
+		return 2;
+	}
+
+	if (!jsonPath.empty() && !WriteResults(jsonPath, label, options, startTime, results))
+	{
+		fprintf(stderr, "cannot write %s\n", jsonPath.c_str());
+		return 2;
+	}
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,604 @@
+// BenchManifest.cpp : Archive manifest writer benchmark.
+//
+// Writes the manifest of a 5M file archive (500k quick) with
+// CManifestWriter as the files "complete", once in today's format and once
+// with interned directories, and against what CompressManifestToGZip does
+// today: the whole manifest object graph in memory, serialized as indented
+// JSON through one deflate stream. Reports the time and the peak resident
+// memory of each, and the sizes. Every manifest is inflated again and
+// compared byte for byte against a plain reference formatter.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../ManifestWriter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const uint64_t FILES_PER_DIRECTORY = 100;
+		const uint64_t DIRECTORIES_PER_PROJECT = 64;
+		const int32_t USER_ID = 1234;
+		const char ARCHIVE_ID[] = "b7c4e1f0-archive";
+		const char KEY_PREFIX[] = "b7c4e1f0/";
+		const unsigned PACKS = 3;
+
+		// 2015-03-01T16:00:00Z in FILETIME ticks.
+		const int64_t BASE_FILETIME = 130696992000000000LL;
+		const int64_t FILETIME_UNIX_EPOCH = 116444736000000000LL;
+
+		struct Entry
+		{
+			std::string keyName;
+			std::string filePath;
+			uint64_t size;
+			int64_t lastModified;
+			std::string md5;
+			bool hasMd5;
+			std::string packKey;
+			uint64_t packOffset;
+		};
+
+		uint64_t Mix(uint64_t value)
+		{
+			value += 0x9E3779B97F4A7C15ull;
+			value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+			value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+			return value ^ (value >> 31);
+		}
+
+		// Entry i of the synthetic archive: 100 files a directory, some names
+		// that need escaping, a few keys that do not follow the path, files
+		// without an MD5 and packed files.
+		void MakeEntry(uint64_t i, Entry& entry)
+		{
+			uint64_t directory = i / FILES_PER_DIRECTORY;
+			uint64_t random = Mix(i);
+			char relative[128];
+			char name[64];
+
+			if (i % 1009 == 5)
+				snprintf(name, sizeof(name), "quote \"%06llu\" back\\slash.txt", (unsigned long long)i);
+			else if (i % 2003 == 9)
+				snprintf(name, sizeof(name), "line\xE2\x80\xA8sep\ttab %06llu.doc", (unsigned long long)i);
+			else if (i % 3001 == 1)
+				snprintf(name, sizeof(name), "caf\xC3\xA9 \xC2\x85 %06llu.jpg", (unsigned long long)i);
+			else
+				snprintf(name, sizeof(name), "IMG_%06llu.jpg", (unsigned long long)i);
+
+			snprintf(relative, sizeof(relative), "project%05llu/folder%02llu/",
+				(unsigned long long)(directory / DIRECTORIES_PER_PROJECT),
+				(unsigned long long)(directory % DIRECTORIES_PER_PROJECT));
+
+			entry.filePath = "C:\\Users\\bench\\Pictures\\";
+			for (const char* c = relative; *c != '\0'; ++c)
+				entry.filePath += *c == '/' ? '\\' : *c;
+			entry.filePath += name;
+
+			if (i % 5000 == 17)
+				entry.keyName = std::string(KEY_PREFIX) + "renamed/" + std::to_string(i);
+			else
+				entry.keyName = std::string(KEY_PREFIX) + relative + name;
+
+			entry.size = random % (8 * 1024 * 1024);
+			entry.lastModified = BASE_FILETIME + (int64_t)(random % (3000ull * 86400 * 10000000)) / ((i % 3) == 0 ? 10000000 : 1) *
+				((i % 3) == 0 ? 10000000 : 1);
+
+			char md5[33];
+			snprintf(md5, sizeof(md5), "%016llx%016llx", (unsigned long long)Mix(random), (unsigned long long)random);
+			entry.md5 = md5;
+			entry.hasMd5 = i % 7919 != 3;
+
+			entry.packKey.clear();
+			entry.packOffset = 0;
+			if (i % 3 == 1)
+			{
+				entry.packKey = std::string(KEY_PREFIX) + "packs/" + std::to_string(i % PACKS) + ".pack";
+				entry.packOffset = random % (16 * 1024 * 1024);
+			}
+		}
+
+		ManifestPack MakePack(unsigned pack)
+		{
+			ManifestPack result;
+			result.keyName = std::string(KEY_PREFIX) + "packs/" + std::to_string(pack) + ".pack";
+			result.size = 16 * 1024 * 1024 - pack;
+			result.md5 = "0123456789abcdef0123456789abcde" + std::to_string(pack);
+			result.fileCount = 1000 + pack;
+			return result;
+		}
+
+		/////////////////////////////////////////////////////////////////////////
+		// Reference formatter: one field at a time with snprintf and gmtime.
+		//
+
+		void ReferenceString(std::string& json, const std::string& text)
+		{
+			json += '"';
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				unsigned char c = (unsigned char)text[i];
+				char escape[8];
+				if (c == '"' || c == '\\')
+				{
+					json += '\\';
+					json += (char)c;
+				}
+				else if (c == '\n')
+					json += "\\n";
+				else if (c == '\r')
+					json += "\\r";
+				else if (c == '\t')
+					json += "\\t";
+				else if (c == '\b')
+					json += "\\b";
+				else if (c == '\f')
+					json += "\\f";
+				else if (c < 0x20)
+				{
+					snprintf(escape, sizeof(escape), "\\u%04x", c);
+					json += escape;
+				}
+				else if (text.compare(i, 2, "\xC2\x85") == 0)
+				{
+					json += "\\u0085";
+					i += 1;
+				}
+				else if (text.compare(i, 3, "\xE2\x80\xA8") == 0 || text.compare(i, 3, "\xE2\x80\xA9") == 0)
+				{
+					json += text[i + 2] == '\xA8' ? "\\u2028" : "\\u2029";
+					i += 2;
+				}
+				else
+					json += (char)c;
+			}
+			json += '"';
+		}
+
+		void ReferenceDate(std::string& json, int64_t fileTime)
+		{
+			int64_t ticks = fileTime - FILETIME_UNIX_EPOCH;
+			time_t seconds = (time_t)(ticks / 10000000);
+			struct tm utc;
+			gmtime_r(&seconds, &utc);
+
+			char text[64];
+			strftime(text, sizeof(text), "\"%Y-%m-%dT%H:%M:%S", &utc);
+			json += text;
+
+			int64_t fraction = ticks % 10000000;
+			if (fraction != 0)
+			{
+				snprintf(text, sizeof(text), ".%07lld", (long long)fraction);
+				std::string digits(text);
+				while (digits.back() == '0')
+					digits.pop_back();
+				json += digits;
+			}
+			json += "Z\"";
+		}
+
+		// Produces the expected manifest piece by piece: the header, one
+		// piece per file, then the packs, directories and closing brace.
+		class CReferenceManifest
+		{
+		public:
+			CReferenceManifest(uint64_t files, bool directories)
+				: m_files(files), m_directories(directories), m_header(true), m_next(0), m_done(false)
+			{
+			}
+
+			bool Next(std::string& json)
+			{
+				if (m_done)
+					return false;
+
+				if (m_header)
+				{
+					m_header = false;
+					json += "{\"archiveid\":\"";
+					json += ARCHIVE_ID;
+					json += "\",\"userid\":" + std::to_string(USER_ID);
+					if (m_directories)
+						json += ",\"manifest_version\":2";
+					json += ",\"files\":[";
+					return true;
+				}
+
+				if (m_next < m_files)
+				{
+					Entry entry;
+					MakeEntry(m_next, entry);
+					if (m_next != 0)
+						json += ',';
+					AppendFile(json, entry);
+					m_next++;
+					return true;
+				}
+
+				json += "],\"packs\":[";
+				for (unsigned pack = 0; pack < PACKS; ++pack)
+				{
+					ManifestPack current = MakePack(pack);
+					json += pack == 0 ? "{\"key_name\":" : ",{\"key_name\":";
+					ReferenceString(json, current.keyName);
+					json += ",\"size\":" + std::to_string(current.size) + ",\"md5\":";
+					ReferenceString(json, current.md5);
+					json += ",\"file_count\":" + std::to_string(current.fileCount) + "}";
+				}
+				json += ']';
+
+				if (m_directories)
+				{
+					json += ",\"dirs\":[";
+					for (size_t i = 0; i < m_order.size(); ++i)
+					{
+						json += i == 0 ? "{\"path\":" : ",{\"path\":";
+						ReferenceString(json, m_order[i].first);
+						json += ",\"key_prefix\":";
+						ReferenceString(json, m_order[i].second);
+						json += '}';
+					}
+					json += ']';
+				}
+				json += '}';
+				m_done = true;
+				return true;
+			}
+
+			size_t Directories() const { return m_order.size(); }
+
+		private:
+			void AppendFile(std::string& json, const Entry& entry)
+			{
+				if (m_directories)
+				{
+					size_t slash = entry.filePath.rfind('\\');
+					std::string name = entry.filePath.substr(slash + 1);
+					std::string path = entry.filePath.substr(0, slash + 1);
+					std::string keyPrefix;
+					bool keyHasName = entry.keyName.size() >= name.size() &&
+						entry.keyName.compare(entry.keyName.size() - name.size(), name.size(), name) == 0 &&
+						entry.keyName[entry.keyName.size() - name.size() - 1] == '/';
+					if (keyHasName)
+						keyPrefix = entry.keyName.substr(0, entry.keyName.size() - name.size());
+
+					std::string key = path + '\n' + keyPrefix;
+					auto found = m_indexes.find(key);
+					if (found == m_indexes.end())
+					{
+						found = m_indexes.insert(std::make_pair(key, m_order.size())).first;
+						m_order.push_back(std::make_pair(path, keyPrefix));
+					}
+
+					json += "{\"name\":";
+					ReferenceString(json, name);
+					if (!keyHasName)
+					{
+						json += ",\"key_name\":";
+						ReferenceString(json, entry.keyName);
+					}
+					AppendFields(json, entry);
+					json += ",\"dir\":" + std::to_string(found->second) + "}";
+				}
+				else
+				{
+					json += "{\"key_name\":";
+					ReferenceString(json, entry.keyName);
+					json += ",\"file_path\":";
+					ReferenceString(json, entry.filePath);
+					AppendFields(json, entry);
+					json += '}';
+				}
+			}
+
+			void AppendFields(std::string& json, const Entry& entry)
+			{
+				json += ",\"size\":" + std::to_string(entry.size) + ",\"last_modified\":";
+				ReferenceDate(json, entry.lastModified);
+				json += ",\"md5\":";
+				if (entry.hasMd5)
+					ReferenceString(json, entry.md5);
+				else
+					json += "null";
+				if (!entry.packKey.empty())
+				{
+					json += ",\"pack_key\":";
+					ReferenceString(json, entry.packKey);
+					json += ",\"pack_offset\":" + std::to_string(entry.packOffset);
+				}
+			}
+
+			uint64_t m_files;
+			bool m_directories;
+			bool m_header;
+			uint64_t m_next;
+			bool m_done;
+			std::unordered_map<std::string, size_t> m_indexes;
+			std::vector<std::pair<std::string, std::string> > m_order;
+		};
+
+		// Inflates a gzip file and hands the output to sink in chunks; false
+		// when the stream is damaged or the sink refused a chunk.
+		bool InflateFile(const std::string& path, const std::function<bool(const uint8_t*, size_t)>& sink)
+		{
+			FILE* file = fopen(path.c_str(), "rb");
+			if (file == NULL)
+				return false;
+
+			z_stream stream;
+			memset(&stream, 0, sizeof(stream));
+			if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+			{
+				fclose(file);
+				return false;
+			}
+
+			std::vector<uint8_t> input(1 << 20);
+			std::vector<uint8_t> output(1 << 20);
+			int result = Z_OK;
+			bool ok = true;
+			while (ok && result != Z_STREAM_END)
+			{
+				stream.avail_in = (uInt)fread(input.data(), 1, input.size(), file);
+				stream.next_in = input.data();
+				if (stream.avail_in == 0)
+					break;
+
+				while (ok && stream.avail_in != 0 && result != Z_STREAM_END)
+				{
+					stream.next_out = output.data();
+					stream.avail_out = (uInt)output.size();
+					result = inflate(&stream, Z_NO_FLUSH);
+					if (result != Z_OK && result != Z_STREAM_END)
+						ok = false;
+					else
+						ok = sink(output.data(), output.size() - stream.avail_out);
+				}
+			}
+
+			// nothing may follow the member.
+			ok = ok && result == Z_STREAM_END && stream.avail_in == 0 && fgetc(file) == EOF;
+			inflateEnd(&stream);
+			fclose(file);
+			return ok;
+		}
+
+		// Compares the inflated manifest with the reference as both stream by.
+		bool MatchesReference(const std::string& path, uint64_t files, bool directories, size_t& directoryCount)
+		{
+			CReferenceManifest reference(files, directories);
+			std::string expected;
+			size_t position = 0;
+			bool matched = InflateFile(path, [&](const uint8_t* data, size_t length)
+			{
+				while (expected.size() - position < length)
+				{
+					if (position > (1 << 20))
+					{
+						expected.erase(0, position);
+						position = 0;
+					}
+					if (!reference.Next(expected))
+						return false;
+				}
+				if (memcmp(expected.data() + position, data, length) != 0)
+					return false;
+				position += length;
+				return true;
+			});
+
+			while (matched && position == expected.size() && reference.Next(expected))
+			{
+			}
+			directoryCount = reference.Directories();
+			return matched && position == expected.size();
+		}
+
+		// Peak resident memory, reset between the runs so each reports its own.
+		void ResetPeakRss()
+		{
+			FILE* file = fopen("/proc/self/clear_refs", "w");
+			if (file != NULL)
+			{
+				fputs("5", file);
+				fclose(file);
+			}
+		}
+
+		double PeakRssMb()
+		{
+			FILE* file = fopen("/proc/self/status", "r");
+			if (file == NULL)
+				return 0;
+
+			char line[256];
+			double kb = 0;
+			while (fgets(line, sizeof(line), file) != NULL)
+			{
+				if (strncmp(line, "VmHWM:", 6) == 0)
+					kb = strtod(line + 6, NULL);
+			}
+			fclose(file);
+			return kb / 1024;
+		}
+
+		int64_t FileSize(const std::string& path)
+		{
+			struct stat info;
+			return stat(path.c_str(), &info) == 0 ? (int64_t)info.st_size : -1;
+		}
+
+		BsStatus WriteManifest(const std::string& path, uint64_t files, const ManifestOptions& options,
+			CManifestWriter& writer)
+		{
+			BsStatus status = writer.Open(path, ARCHIVE_ID, USER_ID, options);
+			Entry entry;
+			for (uint64_t i = 0; i < files && status == BS_OK; ++i)
+			{
+				MakeEntry(i, entry);
+				ManifestFile file;
+				file.keyName = entry.keyName.c_str();
+				file.filePath = entry.filePath.c_str();
+				file.size = entry.size;
+				file.lastModified = entry.lastModified;
+				file.md5 = entry.hasMd5 ? entry.md5.c_str() : NULL;
+				file.packKey = entry.packKey.empty() ? NULL : entry.packKey.c_str();
+				file.packOffset = entry.packOffset;
+				status = writer.AddFile(file);
+			}
+			for (unsigned pack = 0; pack < PACKS && status == BS_OK; ++pack)
+				status = writer.AddPack(MakePack(pack));
+			return status == BS_OK ? writer.Finish() : status;
+		}
+
+		// Today's path: every FileManifest in memory, then Json.NET's
+		// indented output through one GZipStream.
+		bool WriteManifestToday(const std::string& path, uint64_t files, uint64_t& rawBytes)
+		{
+			std::vector<Entry> manifest((size_t)files);
+			for (uint64_t i = 0; i < files; ++i)
+				MakeEntry(i, manifest[(size_t)i]);
+
+			gzFile file = gzopen(path.c_str(), "wb6");
+			if (file == NULL)
+				return false;
+
+			std::string json;
+			json += "{\n  \"archiveid\": \"";
+			json += ARCHIVE_ID;
+			json += "\",\n  \"userid\": " + std::to_string(USER_ID) + ",\n  \"files\": [";
+			rawBytes = 0;
+			for (size_t i = 0; i < manifest.size(); ++i)
+			{
+				const Entry& entry = manifest[i];
+				json += i == 0 ? "\n    {\n      \"key_name\": " : ",\n    {\n      \"key_name\": ";
+				ReferenceString(json, entry.keyName);
+				json += ",\n      \"file_path\": ";
+				ReferenceString(json, entry.filePath);
+				json += ",\n      \"size\": " + std::to_string(entry.size) + ",\n      \"last_modified\": ";
+				ReferenceDate(json, entry.lastModified);
+				json += ",\n      \"md5\": ";
+				ReferenceString(json, entry.md5);
+				json += "\n    }";
+
+				if (json.size() >= 64 * 1024)
+				{
+					rawBytes += json.size();
+					if (gzwrite(file, json.data(), (unsigned)json.size()) != (int)json.size())
+						return false;
+					json.clear();
+				}
+			}
+			json += "\n  ]\n}";
+			rawBytes += json.size();
+			gzwrite(file, json.data(), (unsigned)json.size());
+			return gzclose(file) == Z_OK;
+		}
+	}
+
+	int RunManifestBenchmark(const BenchOptions& options)
+	{
+		uint64_t files = FileCount(options, 5000000, 500000);
+		std::string directory = options.workDir + "/manifest";
+		RemoveTree(directory);
+		mkdir(options.workDir.c_str(), 0755);
+		mkdir(directory.c_str(), 0755);
+
+		Report("manifest", "files", (double)files, "files");
+
+		ManifestOptions streamOptions;
+		streamOptions.compression.threads = options.threads;
+		std::string streamPath = directory + "/stream.manifest";
+		double streamSeconds = 0;
+		double streamRss = 0;
+		{
+			ResetPeakRss();
+			CStopwatch stopwatch;
+			CManifestWriter writer;
+			BsStatus status = WriteManifest(streamPath, files, streamOptions, writer);
+			streamSeconds = stopwatch.Seconds();
+			streamRss = PeakRssMb();
+			BENCH_CHECK(status == BS_OK, "streaming manifest failed");
+			BENCH_CHECK(FileSize(streamPath) == (int64_t)writer.CompressedBytes(), "compressed size differs from the file");
+
+			Report("manifest", "stream_seconds", streamSeconds, "s");
+			Report("manifest", "stream_files_per_second", files / streamSeconds, "files/s");
+			Report("manifest", "stream_peak_rss", streamRss, "MB");
+			Report("manifest", "stream_json", writer.RawBytes() / 1048576.0, "MB");
+			Report("manifest", "stream_gzip", writer.CompressedBytes() / 1048576.0, "MB");
+			Report("manifest", "stream_ratio", (double)writer.RawBytes() / writer.CompressedBytes(), "x");
+		}
+
+		size_t directories = 0;
+		BENCH_CHECK(MatchesReference(streamPath, files, false, directories), "streamed manifest differs from the reference");
+
+		std::string internedPath = directory + "/interned.manifest";
+		{
+			ManifestOptions internedOptions = streamOptions;
+			internedOptions.directories = true;
+
+			ResetPeakRss();
+			CStopwatch stopwatch;
+			CManifestWriter writer;
+			BsStatus status = WriteManifest(internedPath, files, internedOptions, writer);
+			double seconds = stopwatch.Seconds();
+			double rss = PeakRssMb();
+			BENCH_CHECK(status == BS_OK, "interned manifest failed");
+			BENCH_CHECK(MatchesReference(internedPath, files, true, directories), "interned manifest differs from the reference");
+			BENCH_CHECK(writer.Directories() == directories, "directory table size differs");
+
+			Report("manifest", "interned_seconds", seconds, "s");
+			Report("manifest", "interned_peak_rss", rss, "MB");
+			Report("manifest", "interned_directories", (double)directories, "directories");
+			Report("manifest", "interned_json", writer.RawBytes() / 1048576.0, "MB");
+			Report("manifest", "interned_gzip", writer.CompressedBytes() / 1048576.0, "MB");
+		}
+
+		if (CBlockCompressor::IsSupported(COMPRESSION_ZSTD))
+		{
+			ManifestOptions zstdOptions = streamOptions;
+			zstdOptions.compression.format = COMPRESSION_ZSTD;
+
+			std::string zstdPath = directory + "/stream.manifest.zst";
+			CStopwatch stopwatch;
+			CManifestWriter writer;
+			BENCH_CHECK(WriteManifest(zstdPath, files, zstdOptions, writer) == BS_OK, "zstd manifest failed");
+			Report("manifest", "zstd_seconds", stopwatch.Seconds(), "s");
+			Report("manifest", "zstd_size", writer.CompressedBytes() / 1048576.0, "MB");
+		}
+
+		// today's writer last, so its memory does not count against the others.
+		{
+			std::string todayPath = directory + "/today.manifest";
+			uint64_t rawBytes = 0;
+			ResetPeakRss();
+			CStopwatch stopwatch;
+			BENCH_CHECK(WriteManifestToday(todayPath, files, rawBytes), "reference manifest failed");
+			double seconds = stopwatch.Seconds();
+			double rss = PeakRssMb();
+
+			Report("manifest", "today_seconds", seconds, "s");
+			Report("manifest", "today_peak_rss", rss, "MB");
+			Report("manifest", "today_json", rawBytes / 1048576.0, "MB");
+			Report("manifest", "today_gzip", FileSize(todayPath) / 1048576.0, "MB");
+			Report("manifest", "stream_speedup", seconds / streamSeconds, "x");
+			Report("manifest", "stream_rss_saving", rss / streamRss, "x");
+		}
+
+		RemoveTree(directory);
+		return 0;
+	}
+}
@@ -0,0 +1,497 @@
+// BenchNames.cpp : File name validation benchmark.
+//
+// Checks ClassifyFile, on UTF-16 (as on Windows) and UTF-8 paths, against a
+// port of Utilities.CheckFileApiRestrictions: hand-picked names for every
+// category, every BMP character at every position in a SIMD block, random
+// names and malformed UTF-8. Then reports names per second for a batch of 1M
+// scanned files next to the managed-shaped check (GetFileName and ToLower
+// copies, a list search, IndexOfAny and a per-character XML check), and
+// files per second over a scanned tree next to the same check plus the two
+// stat calls of File.Exists and File.GetAttributes.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../FileNameValidator.h"
+#include "../TreeScanner.h"
+#include "../Utf.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const std::u16string g_systemFiles[] =
+		{
+			u"desktop.ini", u"thumbs.db", u".ds_store", u"icon\r", u".dropbox", u".dropbox.attr",
+		};
+
+		const std::u16string g_invalidChars = std::u16string(u"\"<>|:*?\\/") +
+			std::u16string(u"\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13\x14\x15\x16"
+				u"\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f") + std::u16string(1, u'\0');
+
+		char16_t ToLower(char16_t c)
+		{
+			if (c >= 'A' && c <= 'Z')
+				return c + 32;
+			if (c == 0x212A)
+				return 'k';
+			if (c == 0x0130)
+				return 'i';
+			return c;
+		}
+
+		bool EndsWith(const std::u16string& text, const std::u16string& suffix)
+		{
+			return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+		}
+
+		bool StartsWith(const std::u16string& text, const std::u16string& prefix)
+		{
+			return text.compare(0, prefix.size(), prefix) == 0;
+		}
+
+		// XML 1.0 Char, a code point at a time: no U+FFFE, U+FFFF or lone
+		// surrogates (the control characters are already invalid).
+		bool IsXmlText(const std::u16string& text)
+		{
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				char16_t c = text[i];
+				if (c == 0xFFFE || c == 0xFFFF)
+					return false;
+				if (c >= 0xD800 && c <= 0xDBFF && i + 1 < text.size() && text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF)
+					++i;
+				else if (c >= 0xD800 && c <= 0xDFFF)
+					return false;
+			}
+			return true;
+		}
+
+		// Utilities.CheckFileApiRestrictions, with the attributes handed in.
+		FileCategory ReferenceClassify(const std::u16string& path, uint32_t attributes)
+		{
+			if (path.size() > 260)
+				return FILE_CATEGORY_FILE_NAME_TOO_LONG;
+
+			std::u16string fileName = path.substr(path.find_last_of(u"/\\") + 1);
+			std::transform(fileName.begin(), fileName.end(), fileName.begin(), ToLower);
+
+			if (std::find(std::begin(g_systemFiles), std::end(g_systemFiles), fileName) != std::end(g_systemFiles))
+				return FILE_CATEGORY_IGNORED_SYSTEM_FILE;
+
+			if (EndsWith(fileName, u" ") || EndsWith(fileName, u"."))
+				return FILE_CATEGORY_TRAILING_PERIODS_OR_WHITESPACE;
+
+			if (StartsWith(fileName, u"~$") || StartsWith(fileName, u".~") ||
+				(StartsWith(fileName, u"~") && EndsWith(fileName, u".tmp")))
+				return FILE_CATEGORY_TEMPORARY_FILE;
+
+			if (fileName.find_first_of(g_invalidChars) != std::u16string::npos || fileName.empty() ||
+				!IsXmlText(fileName))
+				return FILE_CATEGORY_INVALID_CHARACTER_IN_NAME;
+
+			if ((attributes & BS_FILE_ATTRIBUTE_TEMPORARY) != 0)
+				return FILE_CATEGORY_TEMPORARY_FILE;
+			if ((attributes & BS_FILE_ATTRIBUTE_OFFLINE) != 0)
+				return FILE_CATEGORY_UNSYNCED_ONLINE_FILE;
+			if ((attributes & BS_FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+				return FILE_CATEGORY_METADATA_FILE;
+			return FILE_CATEGORY_NORMAL;
+		}
+
+		// UTF-8 of well-formed UTF-16; false for a lone surrogate.
+		bool ToUtf8(const std::u16string& text, std::string& output)
+		{
+			output.clear();
+			return AppendUtf8(output, reinterpret_cast<const uint16_t*>(text.data()), text.size()) == BS_OK;
+		}
+
+		// Classifies directory + '/' + name both ways, with the name at
+		// the given unit offset into a buffer so the SIMD blocks see every
+		// alignment, and compares with the reference.
+		int CheckName(const std::u16string& name, uint32_t attributes, size_t alignment, const char* what)
+		{
+			std::u16string directory(u"/data/");
+			directory.append(alignment % 16, u'd');
+			std::u16string path = directory + u'/' + name;
+			FileCategory expected = ReferenceClassify(path, attributes);
+
+			std::vector<uint16_t> units(path.begin(), path.end());
+			FileCategory category = ClassifyFile(units.data(), units.size(), directory.size() + 1, attributes);
+			if (category != expected)
+				fprintf(stderr, "utf-16 name of %u units: %d, expected %d\n", (unsigned)name.size(), category, expected);
+			BENCH_CHECK(category == expected, what);
+
+			// String.ToLower turns the Kelvin sign and the dotted capital I
+			// into ASCII, which only the UTF-16 classification follows.
+			bool foldsToAscii = name.find_first_of(u"\u212A\u0130") != std::u16string::npos;
+
+			std::string utf8;
+			if (!foldsToAscii && ToUtf8(path, utf8))
+			{
+				std::string utf8Directory;
+				ToUtf8(directory, utf8Directory);
+				category = ClassifyFile(utf8.data(), utf8.size(), utf8Directory.size() + 1, attributes);
+				if (category != expected)
+					fprintf(stderr, "utf-8 name of %u bytes: %d, expected %d\n",
+						(unsigned)(utf8.size() - utf8Directory.size() - 1), category, expected);
+				BENCH_CHECK(category == expected, what);
+			}
+			return 0;
+		}
+
+		int CheckKnownNames()
+		{
+			struct Case
+			{
+				const char16_t* name;
+				uint32_t attributes;
+				FileCategory expected;
+			};
+
+			static const Case cases[] =
+			{
+				{ u"report.pdf", 0, FILE_CATEGORY_NORMAL },
+				{ u"Desktop.INI", 0, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u"THUMBS.DB", BS_FILE_ATTRIBUTE_HIDDEN, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u".DS_Store", 0, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u"Icon\r", 0, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u"Icon", 0, FILE_CATEGORY_NORMAL },
+				{ u".dropbox", 0, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u".Dropbox.Attr", 0, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u".dropbox.cache", 0, FILE_CATEGORY_NORMAL },
+				{ u"des\u212Atop.ini", 0, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u"desktop.\u0130ni", 0, FILE_CATEGORY_IGNORED_SYSTEM_FILE },
+				{ u"desktop.ini ", 0, FILE_CATEGORY_TRAILING_PERIODS_OR_WHITESPACE },
+				{ u"notes.", 0, FILE_CATEGORY_TRAILING_PERIODS_OR_WHITESPACE },
+				{ u"~$budget.xlsx", 0, FILE_CATEGORY_TEMPORARY_FILE },
+				{ u".~lock.report.odt#", 0, FILE_CATEGORY_TEMPORARY_FILE },
+				{ u"~WRL0001.TMP", 0, FILE_CATEGORY_TEMPORARY_FILE },
+				{ u"~.tmp", 0, FILE_CATEGORY_TEMPORARY_FILE },
+				{ u"~tmp", 0, FILE_CATEGORY_NORMAL },
+				{ u"a.tmp", 0, FILE_CATEGORY_NORMAL },
+				{ u"a:b", BS_FILE_ATTRIBUTE_REPARSE_POINT, FILE_CATEGORY_INVALID_CHARACTER_IN_NAME },
+				{ u"what?", 0, FILE_CATEGORY_INVALID_CHARACTER_IN_NAME },
+				{ u"tab\there", 0, FILE_CATEGORY_INVALID_CHARACTER_IN_NAME },
+				{ u"a\uFFFEb", 0, FILE_CATEGORY_INVALID_CHARACTER_IN_NAME },
+				{ u"\uFFFF", 0, FILE_CATEGORY_INVALID_CHARACTER_IN_NAME },
+				{ u"smile\U0001F600.png", 0, FILE_CATEGORY_NORMAL },
+				{ u"\u65E5\u672C\u8A9E.txt", 0, FILE_CATEGORY_NORMAL },
+				{ u"~$x", BS_FILE_ATTRIBUTE_OFFLINE, FILE_CATEGORY_TEMPORARY_FILE },
+				{ u"cache.bin", BS_FILE_ATTRIBUTE_TEMPORARY, FILE_CATEGORY_TEMPORARY_FILE },
+				{ u"cloud.docx", BS_FILE_ATTRIBUTE_OFFLINE | BS_FILE_ATTRIBUTE_REPARSE_POINT,
+					FILE_CATEGORY_UNSYNCED_ONLINE_FILE },
+				{ u"link", BS_FILE_ATTRIBUTE_REPARSE_POINT, FILE_CATEGORY_METADATA_FILE },
+				{ u"", 0, FILE_CATEGORY_INVALID_CHARACTER_IN_NAME },
+			};
+
+			for (const Case& test : cases)
+			{
+				std::u16string name(test.name);
+				BENCH_CHECK(ReferenceClassify(u"/data/" + name, test.attributes) == test.expected, "reference");
+				for (size_t alignment = 0; alignment < 16; ++alignment)
+				{
+					if (CheckName(name, test.attributes, alignment, "known name") != 0)
+						return 1;
+				}
+			}
+
+			// Lone surrogates (UTF-16 only) and a name with a NUL.
+			const std::u16string lone[] = { u"a" + std::u16string(1, 0xD800), std::u16string(1, 0xDC00) + u"b",
+				std::u16string(u"x\0y", 3) };
+			for (const std::u16string& name : lone)
+			{
+				std::u16string path = u"/data/" + name;
+				std::vector<uint16_t> units(path.begin(), path.end());
+				BENCH_CHECK(ClassifyFile(units.data(), units.size(), 6, 0) == FILE_CATEGORY_INVALID_CHARACTER_IN_NAME,
+					"lone surrogate");
+			}
+
+			// Path length counts UTF-16 units, whichever the encoding.
+			for (size_t length = 255; length <= 262; ++length)
+			{
+				std::u16string name(length - 6, u'\u00E9');
+				if (CheckName(name, 0, 0, "path length") != 0)
+					return 1;
+				std::u16string supplementary;
+				for (size_t i = 0; i < (length - 6) / 2; ++i)
+					supplementary += u"\U0001F600";
+				if (CheckName(supplementary, 0, 0, "supplementary path length") != 0)
+					return 1;
+			}
+
+			for (const std::u16string& name : g_systemFiles)
+			{
+				std::string utf8;
+				ToUtf8(name, utf8);
+				BENCH_CHECK(IsIgnoredSystemFile(reinterpret_cast<const uint16_t*>(name.data()), name.size()), "system");
+				BENCH_CHECK(IsIgnoredSystemFile(utf8.data(), utf8.size()), "system");
+				BENCH_CHECK(!IsIgnoredSystemFile(utf8.data(), utf8.size() - 1), "system prefix");
+			}
+			return 0;
+		}
+
+		int CheckEveryCharacter()
+		{
+			for (uint32_t c = 1; c < 0x10000; ++c)
+			{
+				// Separators end the directory, they are never in a name.
+				if (c == '/' || c == '\\')
+					continue;
+
+				std::u16string name = u"ab";
+				name += (char16_t)c;
+				name += u"cd";
+				if (CheckName(name, 0, c, "bmp character") != 0)
+					return 1;
+
+				// Also in the second block of a longer name.
+				std::u16string longName(20 + c % 13, u'n');
+				longName += (char16_t)c;
+				longName += u"z";
+				if (CheckName(longName, 0, c / 7, "bmp character") != 0)
+					return 1;
+			}
+			return 0;
+		}
+
+		int CheckRandomNames()
+		{
+			uint64_t state = 41;
+			const char16_t alphabet[] = { 'a', 'Z', '.', ' ', '~', '$', '-', 0x00E9, 0x03A9, 0x4E2D, 0xFF21, ':', '*', 0x0007,
+				0xFFFE, 0xD83D, 0xDE00 };
+			for (size_t round = 0; round < 100000; ++round)
+			{
+				uint8_t random[128];
+				FillRandom(random, sizeof(random), state);
+				size_t length = random[0] % 70;
+				bool clean = random[1] < 200;
+
+				std::u16string name;
+				for (size_t i = 0; i < length; ++i)
+				{
+					uint8_t pick = random[i + 2];
+					if (pick < 160 || clean)
+						name += (char16_t)(pick < 160 ? 'a' + pick % 26 : alphabet[pick % 10]);
+					else
+						name += alphabet[pick % (sizeof(alphabet) / sizeof(alphabet[0]))];
+				}
+				if (CheckName(name, round % 5 == 0 ? BS_FILE_ATTRIBUTE_OFFLINE : 0, random[100], "random name") != 0)
+					return 1;
+			}
+			return 0;
+		}
+
+		int CheckMalformedUtf8()
+		{
+			static const char* const names[] =
+			{
+				"bad\xC0\x80", "\xED\xA0\x80.txt", "x\x80y", "trunc\xE4\xB8", "non\xEF\xBF\xBE", "non\xEF\xBF\xBF.doc",
+				"\xF4\x90\x80\x80", "\xFF\xFE",
+			};
+			for (const char* name : names)
+			{
+				for (size_t alignment = 0; alignment < 16; ++alignment)
+				{
+					std::string path = "/data/" + std::string(alignment, 'd') + "/" + name;
+					BENCH_CHECK(ClassifyFile(path.data(), path.size(), 7 + alignment, 0) ==
+						FILE_CATEGORY_INVALID_CHARACTER_IN_NAME, name);
+				}
+			}
+			return 0;
+		}
+
+		int CheckCApi()
+		{
+			const char* paths[] = { "/data/a.txt", "/data/Thumbs.db", "/data/restricted" };
+			BsScanRecord records[3];
+			memset(records, 0, sizeof(records));
+			for (size_t i = 0; i < 3; ++i)
+			{
+				records[i].path = paths[i];
+				records[i].pathLength = (uint32_t)strlen(paths[i]);
+				records[i].nameOffset = 6;
+			}
+			records[2].flags = BS_SCAN_SKIPPED_RESTRICTED;
+
+			uint8_t categories[3];
+			BENCH_CHECK(BsClassifyFiles(records, 3, categories) == BS_OK, "BsClassifyFiles");
+			BENCH_CHECK(categories[0] == BS_FILE_CATEGORY_NORMAL, "normal");
+			BENCH_CHECK(categories[1] == BS_FILE_CATEGORY_IGNORED_SYSTEM_FILE, "system file");
+			BENCH_CHECK(categories[2] == BS_FILE_CATEGORY_RESTRICTED_DIRECTORY, "restricted");
+
+			records[0].nameOffset = 100;
+			BENCH_CHECK(BsClassifyFiles(records, 3, categories) == BS_E_INVALIDARG, "name offset");
+			return 0;
+		}
+
+		// A file name as a large tree has them: mostly plain, some accented
+		// or CJK, and the odd temporary, system or invalid one.
+		std::u16string SyntheticName(uint64_t index)
+		{
+			char text[64];
+			snprintf(text, sizeof(text), "IMG_%07u", (unsigned)index);
+			std::u16string name(text, text + strlen(text));
+
+			switch (index % 50)
+			{
+			case 0: return u"Thumbs.db";
+			case 1: return u"~$" + name + u".docx";
+			case 2: return name + u"?.jpg";
+			case 3: return name + u".";
+			case 4: return u"Caf\u00E9 " + name + u".jpg";
+			case 5: return u"\u5199\u771F" + name + u".jpg";
+			case 6: return u"~" + name + u".tmp";
+			default: return name + u".CR2";
+			}
+		}
+
+		int RunBatchThroughput(const BenchOptions& options)
+		{
+			uint64_t count = FileCount(options, 1000000, 100000);
+
+			CScanBatch batch;
+			std::vector<std::u16string> paths;
+			paths.reserve(count);
+			std::string directory;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				if (i % 100 == 0)
+				{
+					char text[128];
+					snprintf(text, sizeof(text), "/home/user/Pictures/%04u/batch-%03u",
+						(unsigned)(i / 10000), (unsigned)(i / 100 % 100));
+					directory = text;
+				}
+
+				std::u16string name = SyntheticName(i);
+				std::string utf8;
+				ToUtf8(name, utf8);
+				batch.Add(directory, utf8.data(), utf8.size(), 0, BS_FILE_ATTRIBUTE_ARCHIVE, 0, 0, 0);
+				paths.push_back(std::u16string(directory.begin(), directory.end()) + u'/' + name);
+			}
+
+			// Managed-shaped, on UTF-16 strings as .NET has them.
+			std::vector<uint8_t> expected(count);
+			CStopwatch stopwatch;
+			for (uint64_t i = 0; i < count; ++i)
+				expected[i] = (uint8_t)ReferenceClassify(paths[i], BS_FILE_ATTRIBUTE_ARCHIVE);
+			double referenceSeconds = stopwatch.Seconds();
+
+			std::vector<uint8_t> categories(count);
+			stopwatch.Restart();
+			ClassifyFiles(batch, categories.data());
+			double batchSeconds = stopwatch.Seconds();
+			BENCH_CHECK(categories == expected, "batch categories");
+
+			std::vector<uint8_t> utf16Categories(count);
+			stopwatch.Restart();
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				const std::u16string& path = paths[i];
+				utf16Categories[i] = (uint8_t)ClassifyFile(reinterpret_cast<const uint16_t*>(path.data()), path.size(),
+					path.find_last_of(u'/') + 1, BS_FILE_ATTRIBUTE_ARCHIVE);
+			}
+			double utf16Seconds = stopwatch.Seconds();
+			BENCH_CHECK(utf16Categories == expected, "utf-16 categories");
+
+			uint64_t normal = std::count(categories.begin(), categories.end(), (uint8_t)FILE_CATEGORY_NORMAL);
+
+			Report("names", "names", (double)count, "names");
+			Report("names", "excluded", (double)(count - normal), "names");
+			Report("names", (std::string("kernel_") + FileNameScanKernel()).c_str(), 1, "bool");
+			Report("names", "reference_names_per_second", count / referenceSeconds, "names/s");
+			Report("names", "batch_utf8_names_per_second", count / batchSeconds, "names/s");
+			Report("names", "batch_utf16_names_per_second", count / utf16Seconds, "names/s");
+			Report("names", "batch_utf8_vs_reference", referenceSeconds / batchSeconds, "x");
+			Report("names", "batch_utf16_vs_reference", referenceSeconds / utf16Seconds, "x");
+			return 0;
+		}
+
+		int RunTreeThroughput(const BenchOptions& options)
+		{
+			mkdir(options.workDir.c_str(), 0755);
+			std::string root = options.workDir + "/names";
+			RemoveTree(root);
+
+			SyntheticTreeOptions treeOptions;
+			treeOptions.files = FileCount(options, 100000, 10000);
+			treeOptions.maxSize = 0;
+			SyntheticTreeInfo info;
+			if (!CreateSyntheticTree(root, treeOptions, info))
+				return 1;
+
+			ScanOptions scanOptions;
+			scanOptions.threadCount = options.threads;
+			std::vector<CScanBatch> batches;
+			CTreeScanner scanner(scanOptions, [&](const CScanBatch& batch) { batches.push_back(batch); });
+			BENCH_CHECK(scanner.Run(std::vector<PathString>(1, root)) == BS_OK, "scan");
+
+			// What each file costs today on top of the walk: File.Exists and
+			// File.GetAttributes, then the name checks.
+			uint64_t files = 0;
+			uint64_t referenceNormal = 0;
+			CStopwatch stopwatch;
+			for (const CScanBatch& batch : batches)
+			{
+				for (const ScanEntry& entry : batch.m_entries)
+				{
+					const char* path = batch.Path(entry);
+					struct stat st;
+					if (stat(path, &st) != 0 || stat(path, &st) != 0)
+						continue;
+					std::u16string path16(path, path + entry.pathLength);
+					referenceNormal += ReferenceClassify(path16, entry.attributes) == FILE_CATEGORY_NORMAL;
+					++files;
+				}
+			}
+			double referenceSeconds = stopwatch.Seconds();
+
+			uint64_t normal = 0;
+			std::vector<uint8_t> categories;
+			stopwatch.Restart();
+			for (const CScanBatch& batch : batches)
+			{
+				categories.resize(batch.Count());
+				ClassifyFiles(batch, categories.data());
+				normal += std::count(categories.begin(), categories.end(), (uint8_t)FILE_CATEGORY_NORMAL);
+			}
+			double batchSeconds = stopwatch.Seconds();
+
+			BENCH_CHECK(files == info.files, "files");
+			BENCH_CHECK(normal == referenceNormal, "normal files");
+
+			Report("names", "tree_reference_files_per_second", files / referenceSeconds, "files/s");
+			Report("names", "tree_batch_files_per_second", files / batchSeconds, "files/s");
+			Report("names", "tree_batch_vs_reference", referenceSeconds / batchSeconds, "x");
+
+			RemoveTree(root);
+			return 0;
+		}
+	}
+
+	int RunNamesBenchmark(const BenchOptions& options)
+	{
+		int result = CheckKnownNames();
+		if (result == 0)
+			result = CheckEveryCharacter();
+		if (result == 0)
+			result = CheckRandomNames();
+		if (result == 0)
+			result = CheckMalformedUtf8();
+		if (result == 0)
+			result = CheckCApi();
+		if (result == 0)
+			result = RunBatchThroughput(options);
+		if (result == 0)
+			result = RunTreeThroughput(options);
+		return result;
+	}
+}
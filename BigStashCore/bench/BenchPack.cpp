@@ -0,0 +1,274 @@
+// BenchPack.cpp : Small-file pack benchmark.
+//
+// Uploads a synthetic tree of small files (500k in the full run) to a local
+// S3 stand-in twice: one PutObject per file, the way the client stores them
+// today, and packed into 16 MB objects by PlanPacks and CPackUploader. The
+// stand-in holds every response back by a typical S3 latency, so the
+// per-file path is bound by its request count; it runs on a subset and its
+// time for the whole tree is projected from the files per second. Every
+// packed file's MD5 is checked against the file, every pack's ETag against
+// the stand-in, and the pack index against its own serialized form.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../File.h"
+#include "../PackUploader.h"
+#include "../S3Client.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		// per request, about the first-byte latency of S3 from a desktop.
+		const unsigned RESPONSE_DELAY_MS = 30;
+		const unsigned CONNECTIONS = 20;
+		const uint64_t PER_FILE_SUBSET = 10000;
+		const char* BUCKET = "bench-bucket";
+		const char* PREFIX = "archive 1/";
+
+		S3ClientOptions ClientOptions(uint16_t port)
+		{
+			S3ClientOptions options;
+			options.host = "127.0.0.1";
+			options.port = port;
+			options.connections = CONNECTIONS;
+			return options;
+		}
+
+		bool ReadWholeFile(const PathString& path, std::vector<uint8_t>& data)
+		{
+			CFile file;
+			uint64_t size = 0;
+			if (file.Open(path.c_str()) != BS_OK || file.GetSize(size) != BS_OK)
+				return false;
+
+			data.resize((size_t)size);
+			size_t done = 0;
+			while (done < data.size())
+			{
+				size_t read = 0;
+				if (file.ReadAt(done, data.data() + done, data.size() - done, read) != BS_OK || read == 0)
+					return false;
+				done += read;
+			}
+			return true;
+		}
+
+		// One PutObject per file from CONNECTIONS threads over one client.
+		int UploadPerFile(const std::vector<PackInput>& files, size_t count, double& seconds)
+		{
+			S3StandInOptions serverOptions;
+			serverOptions.responseDelayMs = RESPONSE_DELAY_MS;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			CS3Client client(ClientOptions(server.Port()));
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			std::atomic<size_t> next(0);
+			std::atomic<size_t> failures(0);
+			auto work = [&]()
+			{
+				std::vector<uint8_t> data;
+				for (size_t i = next++; i < count; i = next++)
+				{
+					uint8_t md5[MD5_DIGEST_SIZE];
+					std::string etag;
+					bool ok = ReadWholeFile(files[i].path, data);
+					if (ok)
+					{
+						CMd5::Hash(data.data(), data.size(), md5);
+						ok = client.PutObject(BUCKET, files[i].key, data.data(), data.size(), md5, etag) == BS_OK;
+					}
+					if (!ok)
+						failures++;
+				}
+			};
+
+			CStopwatch stopwatch;
+			std::vector<std::thread> threads;
+			for (unsigned i = 0; i < CONNECTIONS; ++i)
+				threads.push_back(std::thread(work));
+			for (std::thread& thread : threads)
+				thread.join();
+			seconds = stopwatch.Seconds();
+
+			uint64_t puts = server.ObjectPuts();
+			server.Stop();
+
+			BENCH_CHECK(failures == 0, "PutObject failed");
+			BENCH_CHECK(puts == count, "stand-in missed objects");
+			return 0;
+		}
+
+		int CheckIndex(const std::vector<PackInput>& files, const CPackIndex& index, const PackOptions& packOptions,
+			const std::vector<size_t>& unpacked)
+		{
+			BENCH_CHECK(index.entries.size() + unpacked.size() == files.size(), "files lost by the planner");
+
+			for (const PackObject& pack : index.packs)
+			{
+				BENCH_CHECK(pack.size <= packOptions.packSize, "pack over its size");
+				BENCH_CHECK(pack.key.compare(0, packOptions.keyPrefix.size(), packOptions.keyPrefix) == 0, "pack key");
+			}
+
+			std::vector<uint8_t> data;
+			index.Serialize(data);
+			Report("pack", "index_bytes_per_file", (double)data.size() / std::max<size_t>(index.entries.size(), 1),
+				"bytes");
+
+			CPackIndex parsed;
+			BENCH_CHECK(CPackIndex::Parse(data.data(), data.size(), parsed) == BS_OK, "index does not parse");
+			BENCH_CHECK(parsed.packs.size() == index.packs.size() && parsed.entries.size() == index.entries.size(),
+				"index counts differ");
+			for (size_t i = 0; i < index.packs.size(); ++i)
+			{
+				const PackObject& left = index.packs[i];
+				const PackObject& right = parsed.packs[i];
+				BENCH_CHECK(left.key == right.key && left.size == right.size && left.firstEntry == right.firstEntry &&
+					left.entryCount == right.entryCount && memcmp(left.md5, right.md5, MD5_DIGEST_SIZE) == 0,
+					"pack differs after the round trip");
+			}
+			for (size_t i = 0; i < index.entries.size(); ++i)
+			{
+				const PackEntry& left = index.entries[i];
+				const PackEntry& right = parsed.entries[i];
+				BENCH_CHECK(left.key == right.key && left.pack == right.pack && left.offset == right.offset &&
+					left.length == right.length && memcmp(left.md5, right.md5, MD5_DIGEST_SIZE) == 0,
+					"entry differs after the round trip");
+			}
+
+			if (!index.entries.empty())
+			{
+				const PackEntry& last = index.entries.back();
+				const PackEntry* found = parsed.Find(last.key);
+				BENCH_CHECK(found != NULL && found->offset == last.offset, "Find missed a key");
+			}
+			BENCH_CHECK(parsed.Find("not packed") == NULL, "Find made up a key");
+
+			// every truncation and a flipped magic are refused.
+			for (size_t length = 0; length < data.size(); length += 1 + length / 4)
+				BENCH_CHECK(CPackIndex::Parse(data.data(), length, parsed) == BS_E_CORRUPT, "truncated index parsed");
+			data[0] ^= 1;
+			BENCH_CHECK(CPackIndex::Parse(data.data(), data.size(), parsed) == BS_E_CORRUPT, "bad magic parsed");
+			return 0;
+		}
+
+		int UploadPacked(const std::vector<PackInput>& files, double& seconds, uint64_t& requests)
+		{
+			PackOptions packOptions;
+			packOptions.keyPrefix = PREFIX;
+
+			CStopwatch stopwatch;
+			CPackIndex index;
+			std::vector<size_t> unpacked;
+			PlanPacks(files, packOptions, index, unpacked);
+			Report("pack", "plan_seconds", stopwatch.Seconds(), "s");
+
+			S3StandInOptions serverOptions;
+			serverOptions.responseDelayMs = RESPONSE_DELAY_MS;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			CS3Client client(ClientOptions(server.Port()));
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			size_t reported = 0;
+			CPackUploader uploader(client, packOptions);
+			stopwatch.Restart();
+			BsStatus status = uploader.Upload(BUCKET, files, index, [&reported](const PackObject&) { reported++; });
+			seconds = stopwatch.Seconds();
+			requests = uploader.Requests();
+
+			BENCH_CHECK(status == BS_OK, "pack upload failed");
+			BENCH_CHECK(reported == index.packs.size(), "packs not reported");
+			BENCH_CHECK(server.ObjectPuts() == index.packs.size(), "stand-in missed packs");
+
+			for (const PackObject& pack : index.packs)
+			{
+				std::string stored;
+				BENCH_CHECK(server.CompletedETag(std::string("/") + BUCKET + "/" + pack.key, stored), "pack missing");
+				BENCH_CHECK(stored == pack.etag, "pack ETag differs from the stand-in's");
+			}
+			server.Stop();
+
+			std::vector<uint8_t> data;
+			for (const PackEntry& entry : index.entries)
+			{
+				uint8_t digest[MD5_DIGEST_SIZE];
+				BENCH_CHECK(ReadWholeFile(files[entry.source].path, data), "cannot read a packed file");
+				CMd5::Hash(data.data(), data.size(), digest);
+				BENCH_CHECK(memcmp(digest, entry.md5, MD5_DIGEST_SIZE) == 0, "entry MD5 differs from the file's");
+			}
+
+			Report("pack", "packs", (double)index.packs.size(), "objects");
+			return CheckIndex(files, index, packOptions, unpacked);
+		}
+	}
+
+	int RunPackBenchmark(const BenchOptions& options)
+	{
+		SyntheticTreeOptions treeOptions;
+		treeOptions.files = FileCount(options, 500000, 20000);
+		treeOptions.minSize = 0;
+		treeOptions.maxSize = 16 * 1024;
+		treeOptions.writeContent = true;
+
+		std::string root = options.workDir + "/pack";
+		RemoveTree(root);
+		mkdir(options.workDir.c_str(), 0755);
+
+		SyntheticTreeInfo info;
+		if (!CreateSyntheticTree(root, treeOptions, info, true))
+			return 1;
+
+		std::vector<PackInput> files(info.paths.size());
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			struct stat status;
+			BENCH_CHECK(stat(info.paths[i].c_str(), &status) == 0, "stat failed");
+			files[i].path = info.paths[i];
+			files[i].key = PREFIX + info.paths[i].substr(root.size() + 1);
+			files[i].size = (uint64_t)status.st_size;
+		}
+		Report("pack", "files", (double)files.size(), "files");
+
+		double perFileSeconds = 0;
+		size_t subset = (size_t)std::min<uint64_t>(files.size(), PER_FILE_SUBSET);
+		int result = UploadPerFile(files, subset, perFileSeconds);
+		if (result != 0)
+			return result;
+
+		double projected = perFileSeconds * files.size() / std::max<size_t>(subset, 1);
+		Report("pack", "per_file_requests", (double)files.size(), "requests");
+		Report("pack", "per_file_files_per_second", subset / perFileSeconds, "files/s");
+		Report("pack", "per_file_seconds", projected, "s");
+
+		double packedSeconds = 0;
+		uint64_t requests = 0;
+		result = UploadPacked(files, packedSeconds, requests);
+		if (result != 0)
+			return result;
+
+		Report("pack", "packed_requests", (double)requests, "requests");
+		Report("pack", "packed_files_per_second", files.size() / packedSeconds, "files/s");
+		Report("pack", "packed_seconds", packedSeconds, "s");
+		Report("pack", "packed_speedup", projected / packedSeconds, "x");
+
+		BENCH_CHECK(requests * 100 < files.size(), "packing did not cut the request count");
+		BENCH_CHECK(packedSeconds < projected, "packing was slower than one object per file");
+
+		RemoveTree(root);
+		return 0;
+	}
+}
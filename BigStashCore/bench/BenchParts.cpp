@@ -0,0 +1,321 @@
+// BenchParts.cpp : Part reader benchmark.
+//
+// Reads one large file as 5 MB upload parts, the way the multipart upload
+// does, and reports MB/s and the page cache the file occupies afterwards,
+// with the file cold (dropped from the cache first) and warm. The baseline
+// re-opens the file per part and copies it in 80 KB chunks, like the
+// FileStream the SDK builds from FilePath and FilePosition.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../PartReader.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const uint64_t PART_SIZE = 5 * 1024 * 1024;
+		const size_t STREAM_BUFFER_SIZE = 80 * 1024;
+
+		bool WriteTestFile(const std::string& path, uint64_t size, std::vector<PartDigest>& parts, uint8_t md5[MD5_DIGEST_SIZE])
+		{
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+
+			std::vector<uint8_t> part(PART_SIZE);
+			uint64_t state = 5;
+			CMd5 whole;
+
+			for (uint64_t offset = 0; offset < size; offset += PART_SIZE)
+			{
+				size_t length = (size_t)std::min<uint64_t>(PART_SIZE, size - offset);
+				FillRandom(part.data(), length, state);
+
+				PartDigest digest;
+				CMd5::Hash(part.data(), length, digest.md5);
+				parts.push_back(digest);
+				whole.Update(part.data(), length);
+
+				if (write(fd, part.data(), length) != (ssize_t)length)
+				{
+					close(fd);
+					return false;
+				}
+			}
+
+			whole.Final(md5);
+
+			// dirty pages cannot be dropped, so make them clean.
+			fsync(fd);
+			close(fd);
+			return true;
+		}
+
+		void DropFromCache(const std::string& path)
+		{
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return;
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+
+		void Warm(const std::string& path)
+		{
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return;
+
+			std::vector<uint8_t> buffer(1024 * 1024);
+			while (read(fd, buffer.data(), buffer.size()) > 0)
+				;
+			close(fd);
+		}
+
+		// Bytes of the file in the page cache, through mincore.
+		uint64_t CachedBytes(const std::string& path, uint64_t size)
+		{
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0 || size == 0)
+			{
+				if (fd >= 0)
+					close(fd);
+				return 0;
+			}
+
+			void* view = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (view == MAP_FAILED)
+				return 0;
+
+			size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+			std::vector<unsigned char> resident(((size_t)size + pageSize - 1) / pageSize);
+			uint64_t cached = 0;
+			if (mincore(view, (size_t)size, resident.data()) == 0)
+			{
+				for (unsigned char page : resident)
+					cached += (page & 1) ? pageSize : 0;
+			}
+
+			munmap(view, (size_t)size);
+			return std::min(cached, size);
+		}
+
+		// The managed path: a new stream per part, copied into the request.
+		int ReadReopeningPerPart(const std::string& path, uint64_t size)
+		{
+			std::vector<uint8_t> request(PART_SIZE);
+			std::vector<uint8_t> chunk(STREAM_BUFFER_SIZE);
+
+			for (uint64_t offset = 0; offset < size; offset += PART_SIZE)
+			{
+				int fd = open(path.c_str(), O_RDONLY);
+				BENCH_CHECK(fd >= 0, "open failed");
+				lseek(fd, (off_t)offset, SEEK_SET);
+
+				size_t length = (size_t)std::min<uint64_t>(PART_SIZE, size - offset);
+				size_t copied = 0;
+				while (copied < length)
+				{
+					ssize_t read = ::read(fd, chunk.data(), std::min(chunk.size(), length - copied));
+					if (read <= 0)
+						break;
+					memcpy(request.data() + copied, chunk.data(), (size_t)read);
+					copied += (size_t)read;
+				}
+
+				close(fd);
+				BENCH_CHECK(copied == length, "short part");
+			}
+
+			return 0;
+		}
+
+		int ReadWithPartReader(const std::string& path, uint64_t size, const PartReaderOptions& options,
+			const std::vector<PartDigest>& expected, const uint8_t md5[MD5_DIGEST_SIZE], bool& direct)
+		{
+			CBufferPool pool(PART_SIZE, options.readAhead + 2);
+			CPartReader reader(pool);
+
+			std::vector<PartSpan> parts = UniformParts(size, PART_SIZE);
+			BENCH_CHECK(reader.Open(path.c_str(), parts, options) == BS_OK, "Open failed");
+			direct = reader.IsDirect();
+
+			size_t count = 0;
+			PartData* part = NULL;
+			BsStatus status;
+			volatile uint8_t touched = 0;
+			while ((status = reader.Next(part)) == BS_OK)
+			{
+				BENCH_CHECK(part->partNumber == count + 1, "parts out of order");
+				BENCH_CHECK(part->length == parts[count].length, "part length differs");
+
+				// stands in for the send: a mapped part is only read here.
+				for (size_t offset = 0; offset < part->length; offset += 4096)
+					touched += part->data[offset];
+
+				if (options.computeMd5)
+				{
+					BENCH_CHECK(part->hasMd5, "part MD5 missing");
+					BENCH_CHECK(memcmp(part->md5, expected[count].md5, MD5_DIGEST_SIZE) == 0, "part MD5 differs");
+				}
+				reader.Release(part);
+				count++;
+			}
+
+			BENCH_CHECK(status == BS_E_NOMOREITEMS, "reader failed");
+			BENCH_CHECK(count == parts.size(), "part count differs");
+
+			if (options.computeMd5)
+			{
+				ContentDigest digest;
+				BENCH_CHECK(reader.GetContentDigest(digest), "whole-file digest missing");
+				BENCH_CHECK(memcmp(digest.md5, md5, MD5_DIGEST_SIZE) == 0, "whole-file digest differs");
+			}
+			return 0;
+		}
+
+		int CheckPartSelection(const std::string& path, uint64_t size, const std::vector<PartDigest>& expected)
+		{
+			// a retry reads a few parts out of order: those are hashed one by one.
+			std::vector<PartSpan> all = UniformParts(size, PART_SIZE);
+			std::vector<PartSpan> parts;
+			parts.push_back(all.back());
+			parts.push_back(all[1]);
+			parts.push_back(all[0]);
+
+			CBufferPool pool(PART_SIZE, 3);
+			CPartReader reader(pool);
+			PartReaderOptions options;
+			options.readAhead = 1;
+			BENCH_CHECK(reader.Open(path.c_str(), parts, options) == BS_OK, "Open failed");
+
+			PartData* part = NULL;
+			for (const PartSpan& span : parts)
+			{
+				BENCH_CHECK(reader.Next(part) == BS_OK, "Next failed");
+				BENCH_CHECK(part->partNumber == span.partNumber, "part differs");
+				BENCH_CHECK(memcmp(part->md5, expected[span.partNumber - 1].md5, MD5_DIGEST_SIZE) == 0, "part MD5 differs");
+				reader.Release(part);
+			}
+
+			BENCH_CHECK(reader.Next(part) == BS_E_NOMOREITEMS, "extra part");
+
+			ContentDigest digest;
+			BENCH_CHECK(!reader.GetContentDigest(digest), "digest of a partial read");
+
+			// closing with parts still queued must not hang or leak buffers.
+			BENCH_CHECK(reader.Open(path.c_str(), all, options) == BS_OK, "Open failed");
+			BENCH_CHECK(reader.Next(part) == BS_OK, "Next failed");
+			reader.Release(part);
+			reader.Close();
+			for (size_t i = 0; i < pool.Count(); ++i)
+				BENCH_CHECK(pool.TryAcquire() != NULL, "buffer leaked");
+
+			return 0;
+		}
+	}
+
+	int RunPartsBenchmark(const BenchOptions& options)
+	{
+		uint64_t size = options.quick ? 128ull * 1024 * 1024 : 1024ull * 1024 * 1024;
+
+		// an odd tail, so the last part is short and unaligned.
+		size += 12345;
+
+		mkdir(options.workDir.c_str(), 0755);
+		std::string path = options.workDir + "/parts.bin";
+
+		std::vector<PartDigest> expected;
+		uint8_t md5[MD5_DIGEST_SIZE];
+		BENCH_CHECK(WriteTestFile(path, size, expected, md5), "cannot write the test file");
+
+		if (CheckPartSelection(path, size, expected) != 0)
+		{
+			unlink(path.c_str());
+			return 1;
+		}
+
+		struct Mode
+		{
+			const char* name;
+			PartReadMode mode;
+			bool dropCache;
+			bool md5;
+		};
+
+		const Mode modes[] =
+		{
+			{ "buffered", PART_READ_BUFFERED, false, false },
+			{ "buffered_drop_cache", PART_READ_BUFFERED, true, false },
+			{ "direct", PART_READ_DIRECT, false, false },
+			{ "mapped", PART_READ_MAPPED, false, false },
+			{ "mapped_drop_cache", PART_READ_MAPPED, true, false },
+			{ "buffered_md5", PART_READ_BUFFERED, false, true },
+			{ "mapped_md5", PART_READ_MAPPED, false, true },
+		};
+
+		double megabytes = size / 1e6;
+		int result = 0;
+
+		for (int warm = 0; warm < 2 && result == 0; ++warm)
+		{
+			const char* state = warm ? "warm" : "cold";
+			std::string metric;
+
+			if (warm)
+				Warm(path);
+			else
+				DropFromCache(path);
+
+			CStopwatch stopwatch;
+			result = ReadReopeningPerPart(path, size);
+			metric = std::string(state) + "_reopen_per_part_mb_per_second";
+			Report("parts", metric.c_str(), megabytes / stopwatch.Seconds(), "MB/s");
+
+			for (const Mode& mode : modes)
+			{
+				if (result != 0)
+					break;
+
+				if (warm)
+					Warm(path);
+				else
+					DropFromCache(path);
+
+				PartReaderOptions readerOptions;
+				readerOptions.mode = mode.mode;
+				readerOptions.dropCache = mode.dropCache;
+				readerOptions.computeMd5 = mode.md5;
+
+				bool direct = false;
+				stopwatch.Restart();
+				result = ReadWithPartReader(path, size, readerOptions, expected, md5, direct);
+				double seconds = stopwatch.Seconds();
+
+				if (mode.mode == PART_READ_DIRECT && !direct)
+					fprintf(stderr, "parts: the file system refused O_DIRECT, measured buffered reads\n");
+
+				metric = std::string(state) + "_" + mode.name + "_mb_per_second";
+				Report("parts", metric.c_str(), megabytes / seconds, "MB/s");
+
+				metric = std::string(state) + "_" + mode.name + "_cached_mb";
+				Report("parts", metric.c_str(), CachedBytes(path, size) / 1e6, "MB");
+			}
+		}
+
+		unlink(path.c_str());
+		return result;
+	}
+}
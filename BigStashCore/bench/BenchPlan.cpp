@@ -0,0 +1,202 @@
+// BenchPlan.cpp : Part planning benchmark.
+//
+// Checks the chosen layouts against the S3 limits across file sizes up to
+// 5 TB, and compares resume planning through CPartBitmap with the
+// PreparePartRequests loop, which searched the uploaded parts list once per
+// part.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../PartPlanner.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		struct UploadedPart
+		{
+			uint32_t partNumber;
+			uint64_t size;
+		};
+
+		// The managed resume loop: uploadedParts.Where(x => x.PartNumber == i)
+		// for every part.
+		void RemainingPartsQuadratic(const PartLayout& layout, const std::vector<UploadedPart>& uploaded,
+			std::vector<PartSpan>& parts)
+		{
+			parts.clear();
+			for (uint32_t i = 1; i <= layout.partCount; ++i)
+			{
+				bool found = false;
+				for (const UploadedPart& part : uploaded)
+				{
+					if (part.partNumber == i)
+					{
+						found = true;
+						break;
+					}
+				}
+
+				if (!found)
+					parts.push_back(layout.Part(i));
+			}
+		}
+
+		int CheckLayouts()
+		{
+			const uint64_t GB = 1024ull * 1024 * 1024;
+			const uint64_t sizes[] = { 0, 1, S3_MIN_PART_SIZE, 100 * 1024 * 1024, 49 * GB, 50 * GB, 51 * GB,
+				200 * GB, 2048 * GB, S3_MAX_OBJECT_SIZE };
+			const uint64_t throughputs[] = { 0, 1000 * 1000, 12500000, 125000000, 1250000000 };
+			const unsigned connections[] = { 1, 4, 16 };
+
+			for (uint64_t size : sizes)
+			{
+				for (uint64_t throughput : throughputs)
+				{
+					for (unsigned connection : connections)
+					{
+						PartPlanOptions options;
+						options.throughput = throughput;
+						options.connections = connection;
+
+						PartLayout layout;
+						BENCH_CHECK(PlanParts(size, options, layout) == BS_OK, "PlanParts failed");
+						BENCH_CHECK(layout.partCount >= 1 && layout.partCount <= S3_MAX_PARTS, "part count out of range");
+						BENCH_CHECK(layout.partSize >= S3_MIN_PART_SIZE && layout.partSize <= S3_MAX_PART_SIZE, "part size out of range");
+						BENCH_CHECK(layout.partSize % PART_SIZE_GRANULARITY == 0, "part size not aligned");
+						BENCH_CHECK((uint64_t)layout.partCount * layout.partSize >= size, "layout does not cover the file");
+
+						PartSpan last = layout.Part(layout.partCount);
+						BENCH_CHECK(last.offset + last.length == size, "last part does not end the file");
+
+						PartLayout restored;
+						BENCH_CHECK(PartLayout::FromPartSize(size, layout.partSize, restored) == BS_OK, "layout not restorable");
+						BENCH_CHECK(restored.partCount == layout.partCount, "restored layout differs");
+					}
+				}
+			}
+
+			PartLayout layout;
+			BENCH_CHECK(PlanParts(S3_MAX_OBJECT_SIZE + 1, PartPlanOptions(), layout) == BS_E_NOTSUPPORTED, "over 5 TB accepted");
+			BENCH_CHECK(PartLayout::FromPartSize(51 * GB, S3_MIN_PART_SIZE, layout) != BS_OK, "over 10,000 parts accepted");
+			BENCH_CHECK(PartLayout::FromPartSize(S3_MIN_PART_SIZE + 1, S3_MIN_PART_SIZE - 64, layout) != BS_OK,
+				"parts under 5 MB accepted");
+			BENCH_CHECK(PartLayout::FromPartSize(S3_MIN_PART_SIZE - 64, S3_MIN_PART_SIZE - 64, layout) == BS_OK &&
+				layout.partCount == 1, "single small part refused");
+
+			// the old fixed 5 MB layout still restores for uploads started before.
+			BENCH_CHECK(PartLayout::FromPartSize(10 * GB, S3_MIN_PART_SIZE, layout) == BS_OK, "5 MB layout refused");
+			BENCH_CHECK(layout.partCount == 2048, "5 MB layout part count");
+
+			PartPlanOptions fast;
+			fast.throughput = 125000000;
+			fast.connections = 4;
+			BENCH_CHECK(PlanParts(200 * GB, fast, layout) == BS_OK, "PlanParts failed");
+			Report("plan", "part_size_200gb_1gbe_4_connections", layout.partSize / 1048576.0, "MB");
+
+			return 0;
+		}
+
+		int CheckResume(uint64_t& state)
+		{
+			PartLayout layout;
+			BENCH_CHECK(PartLayout::FromPartSize(50ull * 1000 * 1000 * 1000 + 777, 5 * 1024 * 1024, layout) == BS_OK, "layout");
+
+			for (int round = 0; round < 20; ++round)
+			{
+				CPartBitmap bitmap(layout);
+				std::vector<UploadedPart> uploaded;
+
+				uint32_t keep = (uint32_t)(state % 100);
+				for (uint32_t i = 1; i <= layout.partCount; ++i)
+				{
+					uint8_t coin;
+					FillRandom(&coin, 1, state);
+					if (coin % 100 < keep)
+					{
+						UploadedPart part = { i, layout.Part(i).length };
+						uploaded.push_back(part);
+					}
+				}
+
+				// ListParts pages do not promise any order.
+				std::reverse(uploaded.begin(), uploaded.end());
+
+				for (const UploadedPart& part : uploaded)
+					BENCH_CHECK(bitmap.MarkCompleted(part.partNumber, part.size) == BS_OK, "MarkCompleted failed");
+
+				std::vector<PartSpan> expected;
+				std::vector<PartSpan> actual;
+				RemainingPartsQuadratic(layout, uploaded, expected);
+				bitmap.RemainingParts(actual);
+
+				BENCH_CHECK(actual.size() == expected.size(), "remaining part count differs");
+				for (size_t i = 0; i < actual.size(); ++i)
+				{
+					BENCH_CHECK(actual[i].partNumber == expected[i].partNumber, "remaining part differs");
+					BENCH_CHECK(actual[i].offset == expected[i].offset && actual[i].length == expected[i].length,
+						"remaining part span differs");
+				}
+				BENCH_CHECK(bitmap.CompletedCount() == uploaded.size(), "completed count differs");
+			}
+
+			// a part uploaded with another part size is refused.
+			CPartBitmap bitmap(layout);
+			BENCH_CHECK(bitmap.MarkCompleted(1, 8 * 1024 * 1024) == BS_E_CORRUPT, "foreign part size accepted");
+			BENCH_CHECK(bitmap.MarkCompleted(layout.partCount + 1, 1) == BS_E_CORRUPT, "foreign part number accepted");
+
+			return 0;
+		}
+	}
+
+	int RunPlanBenchmark(const BenchOptions& options)
+	{
+		uint64_t state = 17;
+		if (CheckLayouts() != 0 || CheckResume(state) != 0)
+			return 1;
+
+		// Worst case for the managed loop: a 10,000 part upload interrupted
+		// half way, with the uploaded parts listed in reverse.
+		PartLayout layout;
+		BENCH_CHECK(PartLayout::FromPartSize(10000ull * S3_MIN_PART_SIZE, S3_MIN_PART_SIZE, layout) == BS_OK, "layout");
+
+		std::vector<UploadedPart> uploaded;
+		for (uint32_t i = layout.partCount / 2; i >= 1; --i)
+		{
+			UploadedPart part = { i, layout.Part(i).length };
+			uploaded.push_back(part);
+		}
+
+		int rounds = options.quick ? 3 : 20;
+		std::vector<PartSpan> parts;
+
+		CStopwatch stopwatch;
+		for (int round = 0; round < rounds; ++round)
+			RemainingPartsQuadratic(layout, uploaded, parts);
+		double quadratic = stopwatch.Seconds() / rounds;
+		size_t expected = parts.size();
+
+		stopwatch.Restart();
+		for (int round = 0; round < rounds; ++round)
+		{
+			CPartBitmap bitmap(layout);
+			for (const UploadedPart& part : uploaded)
+				bitmap.MarkCompleted(part.partNumber, part.size);
+			bitmap.RemainingParts(parts);
+		}
+		double linear = stopwatch.Seconds() / rounds;
+
+		BENCH_CHECK(parts.size() == expected, "remaining part count differs");
+
+		Report("plan", "resume_10000_parts_quadratic_ms", quadratic * 1e3, "ms");
+		Report("plan", "resume_10000_parts_bitmap_ms", linear * 1e3, "ms");
+		Report("plan", "resume_bitmap_speedup", quadratic / linear, "x");
+		return 0;
+	}
+}
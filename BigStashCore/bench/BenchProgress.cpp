@@ -0,0 +1,224 @@
+// BenchProgress.cpp : Progress registry contention benchmark.
+//
+// Many writer threads report part progress for random files of a 100k file
+// archive, the way every part in flight does. Reports updates per second
+// for the pattern the upload view model uses today (one lock, then the
+// progress of every file summed on each update), for per-file atomics with
+// one shared total, and for CProgressRegistry's sharded totals, plus the
+// cost of a snapshot. Checks the registry's per-file, total and completed
+// counts against what the writers sent, and that the publisher stays
+// within its rate and ends on the final total.
+
+#include "BenchCommon.h"
+#include "../ProgressRegistry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const unsigned WRITERS = 16;
+		const unsigned PUBLISH_INTERVAL_MS = 20;
+
+		// One in this many updates is a failed part taking its bytes back.
+		const unsigned TAKE_BACK_EVERY = 64;
+
+		struct Update
+		{
+			uint32_t file;
+			int64_t delta;
+		};
+
+		uint64_t NextRandom(uint64_t& state)
+		{
+			state = state * 6364136223846793005ull + 1442695040888963407ull;
+			return state >> 33;
+		}
+
+		// The updates of one writer, generated up front so the timed loops
+		// only do the accounting.
+		void MakeUpdates(unsigned writer, uint32_t files, uint64_t count, std::vector<Update>& updates)
+		{
+			uint64_t state = 1 + writer;
+			updates.resize((size_t)count);
+			for (Update& update : updates)
+			{
+				update.file = (uint32_t)(NextRandom(state) % files);
+				update.delta = 1 + (int64_t)(NextRandom(state) % (64 * 1024));
+			}
+
+			// a take-back returns what the same writer added to the file just
+			// before, so no file goes below zero.
+			for (size_t i = TAKE_BACK_EVERY; i < updates.size(); i += TAKE_BACK_EVERY)
+			{
+				updates[i].file = updates[i - 1].file;
+				updates[i].delta = -updates[i - 1].delta;
+			}
+		}
+
+		template <typename Writer>
+		double RunWriters(const std::vector<std::vector<Update> >& updates, uint64_t perWriter, Writer write)
+		{
+			std::atomic<unsigned> ready(0);
+			std::atomic<bool> go(false);
+			std::vector<std::thread> threads;
+			for (unsigned writer = 0; writer < WRITERS; ++writer)
+			{
+				threads.push_back(std::thread([&, writer]()
+				{
+					ready++;
+					while (!go)
+						std::this_thread::yield();
+
+					const std::vector<Update>& mine = updates[writer];
+					for (uint64_t i = 0; i < perWriter; ++i)
+						write(mine[(size_t)i]);
+				}));
+			}
+
+			while (ready != WRITERS)
+				std::this_thread::yield();
+
+			CStopwatch stopwatch;
+			go = true;
+			for (std::thread& thread : threads)
+				thread.join();
+			return stopwatch.Seconds();
+		}
+	}
+
+	int RunProgressBenchmark(const BenchOptions& options)
+	{
+		uint32_t files = (uint32_t)FileCount(options, 100000, 20000);
+		uint64_t perWriter = options.quick ? 200000 : 2000000;
+
+		std::vector<std::vector<Update> > updates(WRITERS);
+		std::vector<int64_t> expected(files, 0);
+		for (unsigned writer = 0; writer < WRITERS; ++writer)
+		{
+			MakeUpdates(writer, files, perWriter, updates[writer]);
+			for (const Update& update : updates[writer])
+				expected[update.file] += update.delta;
+		}
+
+		int64_t expectedTotal = 0;
+		for (int64_t bytes : expected)
+			expectedTotal += bytes;
+
+		double totalUpdates = (double)WRITERS * perWriter;
+		Report("progress", "files", files, "files");
+		Report("progress", "writers", WRITERS, "threads");
+
+		// today's pattern: a shared table under a lock, re-summed on every
+		// update. Quadratic, so it only gets a slice of the updates.
+		{
+			uint64_t slice = std::max<uint64_t>(1, (options.quick ? 4000 : 20000) / WRITERS);
+			std::mutex lock;
+			std::vector<int64_t> table(files, 0);
+			int64_t published = 0;
+			double seconds = RunWriters(updates, slice, [&](const Update& update)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				table[update.file] += update.delta;
+				int64_t sum = 0;
+				for (int64_t bytes : table)
+					sum += bytes;
+				published = sum;
+			});
+			BENCH_CHECK(published > 0, "nothing summed");
+			Report("progress", "locked_resum_updates_per_second", WRITERS * slice / seconds, "updates/s");
+		}
+
+		// per-file atomics and one total every writer hits.
+		double singleRate = 0;
+		{
+			std::unique_ptr<std::atomic<int64_t>[]> table(new std::atomic<int64_t>[files]);
+			for (uint32_t i = 0; i < files; ++i)
+				table[i] = 0;
+			std::atomic<int64_t> total(0);
+
+			double seconds = RunWriters(updates, perWriter, [&](const Update& update)
+			{
+				table[update.file].fetch_add(update.delta, std::memory_order_relaxed);
+				total.fetch_add(update.delta, std::memory_order_relaxed);
+			});
+			BENCH_CHECK(total == expectedTotal, "shared total lost updates");
+			singleRate = totalUpdates / seconds;
+			Report("progress", "single_atomic_updates_per_second", singleRate, "updates/s");
+		}
+
+		// the registry, with the publisher running as the UI would have it.
+		CProgressRegistry registry(files);
+		std::mutex publishedLock;
+		std::vector<ProgressSnapshot> published;
+		CProgressPublisher publisher(registry, PUBLISH_INTERVAL_MS, [&](const ProgressSnapshot& snapshot)
+		{
+			std::lock_guard<std::mutex> guard(publishedLock);
+			published.push_back(snapshot);
+		});
+		publisher.Start();
+
+		double seconds = RunWriters(updates, perWriter, [&registry](const Update& update)
+		{
+			registry.Add(update.file, update.delta);
+		});
+
+		double shardedRate = totalUpdates / seconds;
+		Report("progress", "sharded_updates_per_second", shardedRate, "updates/s");
+		Report("progress", "sharded_vs_single_atomic", shardedRate / singleRate, "x");
+
+		// every file completed twice, from two threads, counts once.
+		std::thread completer([&registry, files]()
+		{
+			for (uint32_t file = 0; file < files; ++file)
+				registry.Complete(file);
+		});
+		for (uint32_t file = 0; file < files; ++file)
+			registry.Complete(file);
+		completer.join();
+
+		CStopwatch stopwatch;
+		publisher.Stop();
+		double publishSeconds = seconds + stopwatch.Seconds();
+
+		for (uint32_t file = 0; file < files; ++file)
+			BENCH_CHECK(registry.File(file) == (uint64_t)expected[file], "file progress differs");
+		BENCH_CHECK(registry.Total() == (uint64_t)expectedTotal, "total differs");
+		BENCH_CHECK(registry.CompletedFiles() == files, "completed files miscounted");
+
+		{
+			std::lock_guard<std::mutex> guard(publishedLock);
+			BENCH_CHECK(!published.empty(), "nothing published");
+			BENCH_CHECK(published.back().bytes == (uint64_t)expectedTotal, "last snapshot is not the final total");
+			BENCH_CHECK(published.back().completedFiles == files, "last snapshot misses completed files");
+			BENCH_CHECK(published.size() <= publishSeconds * 1000 / PUBLISH_INTERVAL_MS + 3,
+				"publisher ran over its rate");
+			Report("progress", "snapshots_published", (double)published.size(), "snapshots");
+		}
+
+		// Set, as a resumed upload restores its saved state, keeps the total.
+		registry.Set(0, 12345);
+		BENCH_CHECK(registry.Total() == (uint64_t)(expectedTotal - expected[0] + 12345), "Set broke the total");
+
+		const unsigned snapshots = 100000;
+		ProgressSnapshot snapshot;
+		uint64_t sink = 0;
+		stopwatch.Restart();
+		for (unsigned i = 0; i < snapshots; ++i)
+		{
+			registry.Snapshot(snapshot);
+			sink += snapshot.bytes;
+		}
+		BENCH_CHECK(sink != 0, "empty snapshots");
+		Report("progress", "snapshot_ns", stopwatch.Seconds() / snapshots * 1e9, "ns");
+
+		return 0;
+	}
+}
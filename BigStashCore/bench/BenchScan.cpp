@@ -0,0 +1,211 @@
+// BenchScan.cpp : Tree scanner benchmark.
+//
+// Compares CTreeScanner with a walk shaped like ArchiveViewModel's
+// PrepareArchivePathsAndSizeAsync: list subdirectories and check each one
+// for a junction, list files and stat every file path again for
+// File.Exists, File.GetAttributes and new FileInfo. Checks first that a
+// missing root is reported and does not end the scan.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../TreeScanner.h"
+
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		struct WalkResult
+		{
+			uint64_t files;
+			uint64_t bytes;
+		};
+
+		void ManagedStyleWalk(const std::string& root, WalkResult& result)
+		{
+			std::vector<std::string> stack;
+			stack.push_back(root);
+
+			while (!stack.empty())
+			{
+				std::string directory = stack.back();
+				stack.pop_back();
+
+				DIR* dir = opendir(directory.c_str());
+				if (dir == NULL)
+					continue;
+
+				std::vector<std::string> files;
+				struct dirent* entry;
+				while ((entry = readdir(dir)) != NULL)
+				{
+					if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+						continue;
+
+					std::string path = directory + "/" + entry->d_name;
+					struct stat st;
+
+					// Directory.GetDirectories / GetFiles classify by stat.
+					if (lstat(path.c_str(), &st) != 0)
+						continue;
+
+					if (S_ISDIR(st.st_mode))
+					{
+						// Utilities.IsJunction
+						if (lstat(path.c_str(), &st) == 0 && !S_ISLNK(st.st_mode))
+							stack.push_back(path);
+					}
+					else if (S_ISREG(st.st_mode))
+					{
+						files.push_back(path);
+					}
+				}
+				closedir(dir);
+
+				for (const std::string& path : files)
+				{
+					struct stat st;
+
+					// File.Exists, File.GetAttributes, new FileInfo
+					if (stat(path.c_str(), &st) != 0 || lstat(path.c_str(), &st) != 0 || stat(path.c_str(), &st) != 0)
+						continue;
+
+					result.files++;
+					result.bytes += (uint64_t)st.st_size;
+				}
+			}
+		}
+
+		// A root that is gone comes back as a skipped entry with its status,
+		// and the roots after it are still scanned.
+		int CheckMissingRoot(const std::string& workDir)
+		{
+			std::string root = workDir + "/scan-roots";
+			RemoveTree(root);
+			BENCH_CHECK(mkdir(root.c_str(), 0755) == 0, "could not create root");
+
+			std::string present = root + "/present";
+			FILE* file = fopen(present.c_str(), "wb");
+			BENCH_CHECK(file != NULL && fwrite("data", 1, 4, file) == 4, "could not write file");
+			fclose(file);
+
+			uint64_t files = 0, missing = 0;
+			BsStatus missingStatus = BS_OK;
+			CTreeScanner scanner(ScanOptions(), [&](const CScanBatch& batch)
+			{
+				for (const ScanEntry& entry : batch.m_entries)
+				{
+					if (entry.flags == BS_SCAN_SKIPPED_INACCESSIBLE)
+					{
+						missing++;
+						missingStatus = entry.status;
+					}
+					else if (entry.flags == 0 && entry.status == BS_OK)
+						files++;
+				}
+			});
+
+			std::vector<PathString> roots;
+			roots.push_back(root + "/gone");
+			roots.push_back(present);
+			BENCH_CHECK(scanner.Run(roots) == BS_OK, "scan failed on a missing root");
+			BENCH_CHECK(missing == 1 && missingStatus == BS_E_NOTFOUND, "missing root not reported");
+			BENCH_CHECK(files == 1, "root after the missing one not scanned");
+			BENCH_CHECK(scanner.Stats().errors == 1 && scanner.Stats().skipped == 1, "missing root stats");
+
+			RemoveTree(root);
+			return 0;
+		}
+	}
+
+	int RunScanBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+		if (CheckMissingRoot(options.workDir) != 0)
+			return 1;
+
+		SyntheticTreeOptions treeOptions;
+		treeOptions.files = FileCount(options, 1000000, 20000);
+		treeOptions.maxSize = 1024 * 1024;
+
+		std::string root = options.workDir + "/scan";
+		RemoveTree(root);
+
+		SyntheticTreeInfo info;
+		CStopwatch stopwatch;
+		if (!CreateSyntheticTree(root, treeOptions, info))
+			return 1;
+		Report("scan", "generate_seconds", stopwatch.Seconds(), "s");
+
+		// A symlink back to the root must be skipped, not followed.
+		std::string link = root + "/dir000001/loop";
+		BENCH_CHECK(symlink(root.c_str(), link.c_str()) == 0, "could not create symlink");
+
+		Report("scan", "files", (double)info.files, "files");
+		Report("scan", "directories", (double)info.directories, "dirs");
+
+		WalkResult baseline = { 0, 0 };
+		stopwatch.Restart();
+		ManagedStyleWalk(root, baseline);
+		double baselineSeconds = stopwatch.Seconds();
+		Report("scan", "baseline_files_per_second", baseline.files / baselineSeconds, "files/s");
+
+		BENCH_CHECK(baseline.files == info.files, "baseline walk missed files");
+
+		unsigned maxThreads = options.threads != 0 ? options.threads :
+			std::max(1u, std::thread::hardware_concurrency());
+
+		std::vector<unsigned> threadCounts;
+		for (unsigned threads = 1; threads < maxThreads; threads *= 2)
+			threadCounts.push_back(threads);
+		threadCounts.push_back(maxThreads);
+
+		for (unsigned threads : threadCounts)
+		{
+			ScanOptions scanOptions;
+			scanOptions.threadCount = threads;
+
+			uint64_t files = 0, bytes = 0, skipped = 0;
+			CTreeScanner scanner(scanOptions, [&](const CScanBatch& batch)
+			{
+				for (const ScanEntry& entry : batch.m_entries)
+				{
+					if (entry.flags != 0)
+					{
+						skipped++;
+						continue;
+					}
+
+					files++;
+					bytes += entry.size;
+				}
+			});
+
+			std::vector<PathString> roots(1, root);
+			BENCH_CHECK(scanner.Run(roots) == BS_OK, "scan failed");
+
+			const BsScanStats& stats = scanner.Stats();
+			char metric[64];
+			snprintf(metric, sizeof(metric), "scanner_%ut_files_per_second", threads);
+			Report("scan", metric, stats.files / stats.seconds, "files/s");
+			snprintf(metric, sizeof(metric), "scanner_%ut_speedup", threads);
+			Report("scan", metric, baselineSeconds / stats.seconds, "x");
+
+			BENCH_CHECK(files == info.files, "scanner file count differs");
+			BENCH_CHECK(bytes == info.bytes, "scanner byte count differs");
+			BENCH_CHECK(skipped == 1, "symlink not reported as skipped");
+		}
+
+		RemoveTree(root);
+		return 0;
+	}
+}
@@ -0,0 +1,431 @@
+// BenchSchedule.cpp : Upload scheduler benchmark.
+//
+// The simulation pass drives CConcurrencyController with a fluid model of
+// a bottleneck link in virtual time: requests in flight share the
+// bandwidth, each adds a round trip, and one that takes longer than the
+// SDK's 100 second timeout fails and is sent again. It compares the fixed
+// concurrency of the managed uploader (parallelLimit files times
+// MAX_PARALLEL_ALLOWED parts, both the processor count less one) with the
+// adaptive limit on a congested uplink, a fast long-haul link and a link
+// whose bandwidth drops mid-run, and checks that the adaptive limit keeps
+// the link busy without a single timeout. The live pass uploads through
+// the S3 stand-in: the token buckets must hold their rates, and on a
+// shaped link the scheduler must match the throughput of the fixed
+// concurrency with shorter requests.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../PartPlanner.h"
+#include "../S3Client.h"
+#include "../UploadScheduler.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const char* BUCKET = "bench-bucket";
+
+		// The managed uploader on an 8 core desktop: 7 files at a time, 7
+		// parts each.
+		const unsigned FIXED_CONCURRENCY = 7 * 7;
+		const double REQUEST_TIMEOUT = 100;
+
+		struct LinkScenario
+		{
+			const char* name;
+			double bandwidth;         // bytes per second
+			double bandwidthLater;    // from half time on
+			double rtt;
+			double seconds;
+			unsigned fixed;
+		};
+
+		struct SimulationResult
+		{
+			double goodput;           // bytes per second over the second half
+			uint64_t timeouts;
+			double meanRequestSeconds;
+			unsigned finalLimit;
+		};
+
+		uint64_t NextRandom(uint64_t& state)
+		{
+			state = state * 6364136223846793005ull + 1442695040888963407ull;
+			return state >> 33;
+		}
+
+		//
+		//   FUNCTION: Simulate(const LinkScenario&, unsigned, SimulationResult&)
+		//
+		//   PURPOSE: Runs parts of S3_MIN_PART_SIZE over the modelled link,
+		//            with fixed requests in flight, or the controller's
+		//            limit when fixed is 0. The round trip varies by 20%
+		//            either way, as the service time of S3 does; equal
+		//            parts started together would otherwise stay in step.
+		//
+		void Simulate(const LinkScenario& scenario, unsigned fixed, SimulationResult& result)
+		{
+			struct Flow
+			{
+				double start;
+				double remaining;
+				double doneAt;        // when the response is in, once sent
+			};
+
+			SchedulerOptions options;
+			CConcurrencyController controller(options);
+			std::vector<Flow> flows;
+
+			const double partSize = (double)S3_MIN_PART_SIZE;
+			const double step = std::min(0.001, scenario.rtt / 20);
+			double half = scenario.seconds / 2;
+			double delivered = 0;
+			double requestSeconds = 0;
+			uint64_t requests = 0;
+			uint64_t seed = 5;
+			result.timeouts = 0;
+
+			for (double now = 0; now < scenario.seconds; now += step)
+			{
+				unsigned limit = fixed != 0 ? fixed : controller.Limit();
+				while (flows.size() < limit)
+				{
+					Flow flow = { now, partSize, 0 };
+					flows.push_back(flow);
+				}
+
+				double bandwidth = now < half ? scenario.bandwidth : scenario.bandwidthLater;
+				size_t sending = 0;
+				for (const Flow& flow : flows)
+					sending += flow.remaining > 0 ? 1 : 0;
+
+				for (size_t i = 0; i < flows.size();)
+				{
+					Flow& flow = flows[i];
+					if (flow.remaining > 0)
+					{
+						flow.remaining -= bandwidth / sending * step;
+						if (flow.remaining <= 0)
+							flow.doneAt = now + scenario.rtt * (0.8 + 0.4 * (NextRandom(seed) % 1000) / 1000.0);
+					}
+
+					bool finished = flow.remaining <= 0 && now >= flow.doneAt;
+					bool timedOut = !finished && now - flow.start >= REQUEST_TIMEOUT;
+					if (!finished && !timedOut)
+					{
+						++i;
+						continue;
+					}
+
+					double seconds = now - flow.start;
+					if (finished && now >= half)
+					{
+						delivered += partSize;
+						requestSeconds += seconds;
+						requests++;
+					}
+					if (timedOut)
+						result.timeouts++;
+
+					controller.OnComplete(now, (uint64_t)partSize, seconds, finished);
+					flows[i] = flows.back();
+					flows.pop_back();
+				}
+			}
+
+			result.goodput = delivered / half;
+			result.meanRequestSeconds = requests != 0 ? requestSeconds / requests : 0;
+			result.finalLimit = fixed != 0 ? fixed : controller.Limit();
+		}
+
+		int RunSimulations()
+		{
+			const LinkScenario scenarios[] =
+			{
+				// a 16 Mbit/s uplink: 49 parts in flight take longer than the timeout.
+				{ "congested_uplink", 2e6, 2e6, 0.08, 1200, FIXED_CONCURRENCY },
+				// 1 Gbit/s across an ocean, one big file on a 4 core machine.
+				{ "fast_long_link", 125e6, 125e6, 0.15, 120, 3 },
+				// 100 Mbit/s that becomes 10 Mbit/s half way.
+				{ "bandwidth_drop", 12.5e6, 1.25e6, 0.05, 1200, FIXED_CONCURRENCY },
+			};
+
+			for (const LinkScenario& scenario : scenarios)
+			{
+				SimulationResult fixed;
+				SimulationResult adaptive;
+				Simulate(scenario, scenario.fixed, fixed);
+				Simulate(scenario, 0, adaptive);
+
+				std::string prefix = std::string("sim_") + scenario.name;
+				Report("sched", (prefix + "_fixed_mb_per_second").c_str(), fixed.goodput / 1e6, "MB/s");
+				Report("sched", (prefix + "_fixed_timeouts").c_str(), (double)fixed.timeouts, "requests");
+				Report("sched", (prefix + "_fixed_request_seconds").c_str(), fixed.meanRequestSeconds, "s");
+				Report("sched", (prefix + "_adaptive_mb_per_second").c_str(), adaptive.goodput / 1e6, "MB/s");
+				Report("sched", (prefix + "_adaptive_timeouts").c_str(), (double)adaptive.timeouts, "requests");
+				Report("sched", (prefix + "_adaptive_request_seconds").c_str(), adaptive.meanRequestSeconds, "s");
+				Report("sched", (prefix + "_adaptive_limit").c_str(), adaptive.finalLimit, "requests");
+
+				BENCH_CHECK(adaptive.timeouts == 0, "the adaptive limit let requests time out");
+				BENCH_CHECK(adaptive.goodput >= 0.85 * scenario.bandwidthLater, "the adaptive limit left the link idle");
+				BENCH_CHECK(adaptive.goodput >= 0.95 * fixed.goodput, "the adaptive limit is slower than the fixed one");
+			}
+			return 0;
+		}
+
+		bool WriteTestFile(const std::string& path, uint64_t size, uint64_t seed)
+		{
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+
+			std::vector<uint8_t> buffer(1024 * 1024);
+			for (uint64_t offset = 0; offset < size; offset += buffer.size())
+			{
+				size_t length = (size_t)std::min<uint64_t>(buffer.size(), size - offset);
+				FillRandom(buffer.data(), length, seed);
+				if (write(fd, buffer.data(), length) != (ssize_t)length)
+				{
+					close(fd);
+					return false;
+				}
+			}
+
+			close(fd);
+			return true;
+		}
+
+		struct FileUpload
+		{
+			std::string path;
+			std::string key;
+			uint64_t bandwidthLimit;
+			double seconds;
+			BsStatus status;
+			size_t parts;
+		};
+
+		// Uploads the files at once, each on its own thread and client, with
+		// window parts of partSize in flight per file.
+		void UploadConcurrently(uint16_t port, CUploadScheduler* scheduler, unsigned window, uint64_t partSize,
+			std::vector<FileUpload>& files)
+		{
+			std::vector<std::thread> threads;
+			for (FileUpload& file : files)
+			{
+				threads.push_back(std::thread([&file, port, scheduler, window, partSize]()
+				{
+					S3ClientOptions options;
+					options.host = "127.0.0.1";
+					options.port = port;
+					options.connections = window;
+					options.scheduler = scheduler;
+					options.bandwidthLimit = file.bandwidthLimit;
+					CS3Client client(options);
+
+					file.status = client.Start();
+					std::string uploadId;
+					if (file.status == BS_OK)
+						file.status = client.InitiateMultipartUpload(BUCKET, file.key, uploadId);
+					if (file.status != BS_OK)
+						return;
+
+					struct stat info;
+					stat(file.path.c_str(), &info);
+					PartReaderOptions readerOptions;
+					CBufferPool pool(partSize, readerOptions.readAhead + window);
+					CPartReader reader(pool);
+
+					CStopwatch stopwatch;
+					std::vector<S3Part> uploaded;
+					file.status = reader.Open(file.path.c_str(), UniformParts(info.st_size, partSize), readerOptions);
+					if (file.status == BS_OK)
+						file.status = client.UploadParts(BUCKET, file.key, uploadId, reader, uploaded);
+					file.seconds = stopwatch.Seconds();
+					file.parts = uploaded.size();
+					reader.Close();
+				}));
+			}
+
+			for (std::thread& thread : threads)
+				thread.join();
+		}
+
+		int CheckBandwidthCaps(const std::vector<std::string>& paths, uint64_t size)
+		{
+			const uint64_t PART = 1024 * 1024;
+			size_t partCount = UniformParts(size, PART).size();
+
+			CS3StandIn server((S3StandInOptions()));
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			// per file caps of 4 and 8 MB/s.
+			{
+				CUploadScheduler scheduler;
+				std::vector<FileUpload> files(2);
+				for (size_t i = 0; i < files.size(); ++i)
+				{
+					files[i].path = paths[i];
+					files[i].key = "capped/" + std::to_string(i);
+					files[i].bandwidthLimit = (i + 1) * 4 * 1000 * 1000;
+				}
+
+				UploadConcurrently(server.Port(), &scheduler, 4, PART, files);
+				for (const FileUpload& file : files)
+				{
+					BENCH_CHECK(file.status == BS_OK && file.parts == partCount, "capped upload failed");
+
+					// the first part goes out on the burst.
+					double rate = (size - PART) / file.seconds;
+					std::string metric = "upload_cap_" + std::to_string(file.bandwidthLimit / 1000000) + "mb_rate";
+					Report("sched", metric.c_str(), rate / 1e6, "MB/s");
+					BENCH_CHECK(rate > 0.85 * file.bandwidthLimit && rate < 1.15 * file.bandwidthLimit,
+						"per upload cap missed");
+				}
+			}
+
+			// both files under one 8 MB/s cap.
+			{
+				SchedulerOptions options;
+				options.bandwidthLimit = 8 * 1000 * 1000;
+				CUploadScheduler scheduler(options);
+				std::vector<FileUpload> files(2);
+				for (size_t i = 0; i < files.size(); ++i)
+				{
+					files[i].path = paths[i];
+					files[i].key = "global/" + std::to_string(i);
+					files[i].bandwidthLimit = 0;
+				}
+
+				CStopwatch stopwatch;
+				UploadConcurrently(server.Port(), &scheduler, 4, PART, files);
+				double rate = (2 * size - PART) / stopwatch.Seconds();
+				for (const FileUpload& file : files)
+					BENCH_CHECK(file.status == BS_OK && file.parts == partCount, "capped upload failed");
+
+				Report("sched", "global_cap_8mb_rate", rate / 1e6, "MB/s");
+				BENCH_CHECK(rate > 0.85 * options.bandwidthLimit && rate < 1.15 * options.bandwidthLimit,
+					"global cap missed");
+				BENCH_CHECK(scheduler.Stats().throttleSeconds > 0, "nothing was throttled");
+			}
+
+			server.Stop();
+			return 0;
+		}
+
+		//
+		//   FUNCTION: CompareOnShapedLink(...)
+		//
+		//   PURPOSE: Three files over a 16 MB/s link with a 30 ms round trip,
+		//            each with 6 parts in flight through a scheduler pinned
+		//            at 18 (what the fixed limits add up to), then through
+		//            the adaptive one. The parts are 1 MB, the stand-in
+		//            scaled down, so the run is short.
+		//
+		int CompareOnShapedLink(const std::vector<std::string>& paths, uint64_t size)
+		{
+			const uint64_t PART = 1024 * 1024;
+			const unsigned WINDOW = 6;
+
+			struct Mode
+			{
+				const char* name;
+				bool adaptive;
+			};
+
+			const Mode modes[] =
+			{
+				{ "fixed", false },
+				{ "adaptive", true },
+			};
+
+			double rates[2] = { 0 };
+			double requestSeconds[2] = { 0 };
+
+			for (size_t m = 0; m < 2; ++m)
+			{
+				S3StandInOptions serverOptions;
+				serverOptions.verifyMd5 = false;
+				serverOptions.responseDelayMs = 30;
+				serverOptions.bandwidth = 16 * 1000 * 1000;
+				CS3StandIn server(serverOptions);
+				BENCH_CHECK(server.Start(), "stand-in did not start");
+
+				SchedulerOptions options;
+				if (!modes[m].adaptive)
+					options.minConcurrency = options.maxConcurrency = WINDOW * (unsigned)paths.size();
+				CUploadScheduler scheduler(options);
+
+				std::vector<FileUpload> files(paths.size());
+				for (size_t i = 0; i < files.size(); ++i)
+				{
+					files[i].path = paths[i];
+					files[i].key = std::string(modes[m].name) + "/" + std::to_string(i);
+					files[i].bandwidthLimit = 0;
+				}
+
+				CStopwatch stopwatch;
+				UploadConcurrently(server.Port(), &scheduler, WINDOW, PART, files);
+				double seconds = stopwatch.Seconds();
+				for (const FileUpload& file : files)
+					BENCH_CHECK(file.status == BS_OK, "upload on the shaped link failed");
+
+				SchedulerStats stats = scheduler.Stats();
+				rates[m] = files.size() * size / seconds;
+				requestSeconds[m] = stats.requestSeconds / stats.requests;
+
+				std::string prefix = std::string("shaped_") + modes[m].name;
+				Report("sched", (prefix + "_mb_per_second").c_str(), rates[m] / 1e6, "MB/s");
+				Report("sched", (prefix + "_request_seconds").c_str(), requestSeconds[m], "s");
+				Report("sched", (prefix + "_limit").c_str(), stats.limit, "requests");
+				if (modes[m].adaptive)
+				{
+					Report("sched", "shaped_adaptive_decreases", (double)stats.decreases, "decisions");
+					Report("sched", "shaped_adaptive_bdp", stats.bdpRequests, "requests");
+				}
+				server.Stop();
+			}
+
+			BENCH_CHECK(rates[1] >= 0.85 * rates[0], "the scheduler lost throughput on the shaped link");
+			BENCH_CHECK(requestSeconds[1] < 0.85 * requestSeconds[0], "the scheduler did not shorten the requests");
+			return 0;
+		}
+	}
+
+	int RunScheduleBenchmark(const BenchOptions& options)
+	{
+		int result = RunSimulations();
+		if (result != 0)
+			return result;
+
+		uint64_t size = options.quick ? 16ull * 1024 * 1024 : 32ull * 1024 * 1024;
+		mkdir(options.workDir.c_str(), 0755);
+
+		std::vector<std::string> paths;
+		for (unsigned i = 0; i < 3; ++i)
+		{
+			paths.push_back(options.workDir + "/sched" + std::to_string(i) + ".bin");
+			BENCH_CHECK(WriteTestFile(paths.back(), size, 17 + i), "cannot write the test file");
+		}
+
+		result = CheckBandwidthCaps(paths, size);
+		if (result == 0)
+			result = CompareOnShapedLink(paths, size);
+
+		for (const std::string& path : paths)
+			unlink(path.c_str());
+		return result;
+	}
+}
@@ -0,0 +1,370 @@
+// BenchSelection.cpp : Selection handoff benchmark and robustness checks.
+//
+// Streams a 1M path selection (the shape of a large Explorer selection) to
+// a CSelectionServer over the local socket and checks that the server got
+// exactly the paths sent, in order. Reports paths and megabytes per second,
+// how soon the server had the first chunk and what the sender buffered,
+// against today's handoff: the paths joined into one string, written to
+// selectionfile.txt and read back line by line by a second process, whose
+// start is timed separately. Then checks that a sender that dies or stalls
+// aborts its selection and garbage on the channel is turned away, without
+// taking the server down, that a second server cannot take a live channel but
+// replaces a stale one, and that a sender gives up when nobody listens.
+// Without XDG_RUNTIME_DIR the default channel must sit in a directory only
+// the user can enter, and none when that directory is open to others.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../SelectionChannel.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <spawn.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern char** environ;
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		void SelectionPath(uint64_t index, std::string& path)
+		{
+			char text[160];
+			snprintf(text, sizeof(text), "/home/user/Documents/Projects/project-%04u/assets/batch-%03u/IMG_%07u.CR2",
+				(unsigned)(index / 10000), (unsigned)(index / 100 % 100), (unsigned)index);
+			path = text;
+		}
+
+		uint64_t HashPath(uint64_t hash, const std::string& path)
+		{
+			for (unsigned char c : path)
+				hash = (hash ^ c) * 1099511628211ull;
+			return (hash ^ 0xff) * 1099511628211ull;
+		}
+
+		// What the server saw of each selection.
+		struct Received
+		{
+			Received() : paths(0), hash(14695981039346656037ull), complete(false), aborted(false), firstChunk(0) {}
+
+			uint64_t paths;
+			uint64_t hash;
+			bool complete;
+			bool aborted;
+			double firstChunk;
+		};
+
+		class CReceiver
+		{
+		public:
+			SelectionCallback Callback()
+			{
+				return [this](uint64_t selection, SelectionEvent event, const std::vector<PathString>& paths)
+				{
+					std::lock_guard<std::mutex> guard(m_lock);
+					if (m_selections.size() < selection)
+						m_selections.resize(selection);
+					Received& received = m_selections[selection - 1];
+					if (event == SELECTION_PATHS)
+					{
+						if (received.paths == 0)
+							received.firstChunk = m_clock.Seconds();
+						for (const PathString& path : paths)
+							received.hash = HashPath(received.hash, path);
+						received.paths += paths.size();
+					}
+					else if (event == SELECTION_COMPLETE)
+						received.complete = true;
+					else
+						received.aborted = true;
+				};
+			}
+
+			void RestartClock()
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_clock.Restart();
+			}
+
+			Received Selection(uint64_t selection)
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				return selection <= m_selections.size() ? m_selections[selection - 1] : Received();
+			}
+
+			// Waits (up to 5 s) for the selection to end either way.
+			Received WaitForEnd(uint64_t selection)
+			{
+				for (int i = 0; i < 500; ++i)
+				{
+					Received received = Selection(selection);
+					if (received.complete || received.aborted)
+						return received;
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+				return Selection(selection);
+			}
+
+		private:
+			std::mutex m_lock;
+			CStopwatch m_clock;
+			std::vector<Received> m_selections;
+		};
+
+		// Today's path: join with newlines, write selectionfile.txt, read it
+		// back line by line (ReadPathsFromSelectionFileAsync).
+		double FileHandoff(const std::string& directory, uint64_t count, uint64_t expectedHash, size_t& joinedBytes)
+		{
+			CStopwatch stopwatch;
+			std::string joined;
+			std::string path;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				SelectionPath(i, path);
+				if (i != 0)
+					joined += '\n';
+				joined += path;
+			}
+			joinedBytes = joined.size();
+
+			std::string file = directory + "/selectionfile.txt";
+			FILE* output = fopen(file.c_str(), "wb");
+			if (output == NULL)
+				return -1;
+			bool written = fwrite(joined.data(), 1, joined.size(), output) == joined.size();
+			if (fclose(output) != 0 || !written)
+				return -1;
+			std::string().swap(joined);
+
+			std::ifstream input(file.c_str());
+			std::vector<std::string> paths;
+			std::string line;
+			while (std::getline(input, line))
+				paths.push_back(line);
+
+			// What the receiving side of the channel does with each path.
+			uint64_t hash = 14695981039346656037ull;
+			for (const std::string& received : paths)
+				hash = HashPath(hash, received);
+			double seconds = stopwatch.Seconds();
+			unlink(file.c_str());
+			return paths.size() == count && hash == expectedHash ? seconds : -1;
+		}
+
+		// The second process today's handoff starts for every selection.
+		double SpawnSeconds()
+		{
+			const int rounds = 20;
+			CStopwatch stopwatch;
+			for (int i = 0; i < rounds; ++i)
+			{
+				char program[] = "/bin/true";
+				char* argv[] = { program, NULL };
+				pid_t child;
+				if (posix_spawn(&child, program, NULL, NULL, argv, environ) != 0)
+					return -1;
+				int status;
+				waitpid(child, &status, 0);
+			}
+			return stopwatch.Seconds() / rounds;
+		}
+
+		int RunThroughput(const BenchOptions& options, const std::string& directory)
+		{
+			uint64_t count = FileCount(options, 1000000, 100000);
+			std::string channel = directory + "/channel";
+
+			CReceiver receiver;
+			CSelectionServer server;
+			BENCH_CHECK(server.Start(channel, receiver.Callback()) == BS_OK, "Start failed");
+
+			uint64_t expectedHash = 14695981039346656037ull;
+			uint64_t bytes = 0;
+			std::string path;
+
+			receiver.RestartClock();
+			CStopwatch stopwatch;
+			CSelectionSender sender;
+			BENCH_CHECK(sender.Connect(channel, 1000) == BS_OK, "Connect failed");
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				SelectionPath(i, path);
+				expectedHash = HashPath(expectedHash, path);
+				bytes += path.size();
+				BENCH_CHECK(sender.Add(path) == BS_OK, "Add failed");
+			}
+			BENCH_CHECK(sender.Finish() == BS_OK, "Finish failed");
+			double seconds = stopwatch.Seconds();
+
+			Received received = receiver.Selection(1);
+			BENCH_CHECK(received.complete && !received.aborted, "the selection did not complete");
+			BENCH_CHECK(received.paths == count, "path count differs");
+			BENCH_CHECK(received.hash == expectedHash, "received paths differ from the ones sent");
+
+			Report("selection", "paths", (double)count, "paths");
+			Report("selection", "seconds", seconds, "s");
+			Report("selection", "paths_per_second", count / seconds, "paths/s");
+			Report("selection", "mb_per_second", bytes / seconds / 1e6, "MB/s");
+			Report("selection", "first_chunk_ms", received.firstChunk * 1000, "ms");
+			Report("selection", "sender_buffer_kb", 64, "KB");
+
+			// A second selection on the same server, as from the next click.
+			BENCH_CHECK(SendSelection(channel, std::vector<PathString>(3, "/a"), 1000) == BS_OK, "second send failed");
+			BENCH_CHECK(receiver.Selection(2).complete && receiver.Selection(2).paths == 3, "second selection lost");
+			server.Stop();
+
+			size_t joinedBytes = 0;
+			double file = FileHandoff(directory, count, expectedHash, joinedBytes);
+			BENCH_CHECK(file >= 0, "selection file round trip failed");
+			double spawn = SpawnSeconds();
+			BENCH_CHECK(spawn >= 0, "spawn failed");
+			Report("selection", "file_seconds", file, "s");
+			Report("selection", "file_joined_mb", joinedBytes / 1e6, "MB");
+			Report("selection", "file_spawn_ms", spawn * 1000, "ms");
+			Report("selection", "channel_vs_file", (file + spawn) / seconds, "x");
+			return 0;
+		}
+
+		int RunRobustness(const std::string& directory)
+		{
+			std::string channel = directory + "/robust";
+			CReceiver receiver;
+			CSelectionServer server;
+			BENCH_CHECK(server.Start(channel, receiver.Callback()) == BS_OK, "Start failed");
+
+			CSelectionServer second;
+			BENCH_CHECK(second.Start(channel, receiver.Callback()) == BS_E_ACCESSDENIED,
+				"a second server took a live channel");
+
+			// A sender that dies mid-selection, after a few frames went out.
+			{
+				CSelectionSender sender;
+				BENCH_CHECK(sender.Connect(channel, 1000) == BS_OK, "Connect failed");
+				std::string path;
+				for (uint64_t i = 0; i < 10000; ++i)
+				{
+					SelectionPath(i, path);
+					BENCH_CHECK(sender.Add(path) == BS_OK, "Add failed");
+				}
+			}
+			Received dead = receiver.WaitForEnd(1);
+			BENCH_CHECK(dead.aborted && !dead.complete, "a dead sender's selection was not aborted");
+
+			// Garbage on the channel.
+			{
+				sockaddr_un address;
+				memset(&address, 0, sizeof(address));
+				address.sun_family = AF_UNIX;
+				strncpy(address.sun_path, channel.c_str(), sizeof(address.sun_path) - 1);
+				int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+				BENCH_CHECK(connect(fd, (const sockaddr*)&address, sizeof(address)) == 0, "connect failed");
+				const char garbage[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+				BENCH_CHECK(write(fd, garbage, sizeof(garbage)) == (ssize_t)sizeof(garbage), "write failed");
+				uint8_t ack[20];
+				BENCH_CHECK(read(fd, ack, sizeof(ack)) == (ssize_t)sizeof(ack), "no answer to garbage");
+				BENCH_CHECK(ack[0] == 4 && ack[16] == BS_E_CORRUPT, "garbage was not rejected");
+				close(fd);
+			}
+
+			BENCH_CHECK(SendSelection(channel, std::vector<PathString>(1000, "/b"), 1000) == BS_OK,
+				"the server did not survive bad senders");
+			BENCH_CHECK(receiver.Selection(2).complete && receiver.Selection(2).paths == 1000,
+				"garbage or a probe counted as a selection");
+
+			// A stalled sender must not hold up Stop.
+			CSelectionSender stalled;
+			BENCH_CHECK(stalled.Connect(channel, 1000) == BS_OK, "Connect failed");
+			BENCH_CHECK(stalled.Add("/c", 2) == BS_OK, "Add failed");
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			CStopwatch stop;
+			server.Stop();
+			Report("selection", "stop_with_stalled_sender_ms", stop.Seconds() * 1000, "ms");
+			BENCH_CHECK(stop.Seconds() < 1, "Stop waited on a stalled sender");
+			BENCH_CHECK(receiver.Selection(3).aborted, "the stalled selection was not aborted");
+			stalled.Close();
+
+			// Nobody listening.
+			CStopwatch wait;
+			BENCH_CHECK(SendSelection(channel, std::vector<PathString>(1, "/d"), 100) == BS_E_NOTFOUND,
+				"a send without a server did not fail");
+			BENCH_CHECK(wait.Seconds() >= 0.09 && wait.Seconds() < 1, "the connect timeout was not kept");
+
+			// A socket left behind by a server that died.
+			{
+				sockaddr_un address;
+				memset(&address, 0, sizeof(address));
+				address.sun_family = AF_UNIX;
+				strncpy(address.sun_path, channel.c_str(), sizeof(address.sun_path) - 1);
+				int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+				BENCH_CHECK(bind(fd, (const sockaddr*)&address, sizeof(address)) == 0, "bind failed");
+				close(fd);
+			}
+			BENCH_CHECK(SendSelection(channel, std::vector<PathString>(1, "/e"), 0) == BS_E_NOTFOUND,
+				"a stale socket was taken for a server");
+			CReceiver restarted;
+			CSelectionServer restartedServer;
+			BENCH_CHECK(restartedServer.Start(channel, restarted.Callback()) == BS_OK, "a stale socket blocked Start");
+			BENCH_CHECK(SendSelection(channel, std::vector<PathString>(5, "/f"), 1000) == BS_OK, "send failed");
+			BENCH_CHECK(restarted.Selection(1).complete && restarted.Selection(1).paths == 5, "selection lost");
+			restartedServer.Stop();
+
+			Report("selection", "robustness_checks", 8, "checks");
+			return 0;
+		}
+
+		int CheckDefaultChannel()
+		{
+			const char* runtime = getenv("XDG_RUNTIME_DIR");
+			std::string saved = runtime != NULL ? runtime : "";
+			unsetenv("XDG_RUNTIME_DIR");
+
+			std::string directory = "/tmp/bigstash-" + std::to_string(getuid());
+			std::string channel = DefaultSelectionChannel();
+			struct stat status;
+			bool privateDirectory = channel == directory + "/selection" && lstat(directory.c_str(), &status) == 0 &&
+				(status.st_mode & 0777) == 0700;
+
+			// one anybody can enter is not used.
+			chmod(directory.c_str(), 0755);
+			bool refused = DefaultSelectionChannel().empty();
+			chmod(directory.c_str(), 0700);
+
+			if (runtime != NULL)
+				setenv("XDG_RUNTIME_DIR", saved.c_str(), 1);
+
+			BENCH_CHECK(privateDirectory, "fallback channel not in a private directory");
+			BENCH_CHECK(refused, "fallback directory open to others used");
+			return 0;
+		}
+	}
+
+	int RunSelectionBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+		std::string directory = options.workDir + "/selection";
+		RemoveTree(directory);
+		mkdir(directory.c_str(), 0700);
+
+		int result = CheckDefaultChannel();
+		if (result == 0)
+			result = RunThroughput(options, directory);
+		if (result == 0)
+			result = RunRobustness(directory);
+
+		RemoveTree(directory);
+		return result;
+	}
+}
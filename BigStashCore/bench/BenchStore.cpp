@@ -0,0 +1,781 @@
+// BenchStore.cpp : Upload state store benchmark.
+//
+// Checks CUploadStore (puts, replacing, state changes, removal, reopening,
+// a Put no Commit covered, a torn header slot, a table view outliving the
+// upload it shows, compaction and the C interface), the JSON reader and
+// the migration of LocalUpload files written the way Json.NET writes them,
+// backups and broken files included; everything read back must equal what
+// was written. Then it stores 1,000 uploads of 100,000 files each (40 of
+// 5,000 with --quick), drops the store from the page cache and times a
+// cold open that reads every upload's summary, and opening one upload's
+// table. The reference is reading the same uploads from their JSON files:
+// a few are written and parsed cold, and the time is projected to all of
+// them. The parser is native, so the managed client's deserialization of
+// the same files only takes longer.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../Encoding.h"
+#include "../Json.h"
+#include "../Md5.h"
+#include "../UploadStore.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		// 2015-01-01T00:00:00Z in FILETIME ticks.
+		const int64_t START_TIME = 130645440000000000LL;
+
+		const uint64_t PART_SIZE = 5 * 1024 * 1024;
+
+		uint64_t Mix(uint64_t value)
+		{
+			value ^= value >> 31;
+			value *= 0x9E3779B97F4A7C15ull;
+			value ^= value >> 29;
+			value *= 0xBF58476D1CE4E5B9ull;
+			return value ^ (value >> 32);
+		}
+
+		// File i of an upload: a photo library, most of it uploaded and the
+		// small files packed. Only the upload number at the start of the
+		// keys depends on the upload, so PatchFile can turn one upload's
+		// file into another's.
+		StoredFile SyntheticFile(uint32_t upload, uint64_t i)
+		{
+			char text[256];
+			unsigned long long index = (unsigned long long)i;
+			StoredFile file;
+
+			snprintf(text, sizeof(text), "IMG_%06llu.jpg", index);
+			file.fileName = text;
+			snprintf(text, sizeof(text), "C:\\Users\\bench\\Pictures\\%llu\\album-%03llu\\IMG_%06llu.jpg",
+				2000 + index / 20000, index / 400 % 1000, index);
+			file.filePath = text;
+			snprintf(text, sizeof(text), "%04u/Pictures/%llu/album-%03llu/IMG_%06llu.jpg", upload,
+				2000 + index / 20000, index / 400 % 1000, index);
+			file.keyName = text;
+
+			uint64_t hash = Mix(i + 1);
+			file.size = hash % (12 << 20);
+			file.lastModified = START_TIME + (int64_t)(i * 7919) * 10000000LL + (int64_t)(hash % 10000000);
+
+			uint8_t md5[MD5_DIGEST_SIZE];
+			for (size_t j = 0; j < MD5_DIGEST_SIZE; j += 8)
+			{
+				uint64_t word = Mix(hash + j);
+				memcpy(md5 + j, &word, 8);
+			}
+			file.md5 = HexEncode(md5, MD5_DIGEST_SIZE);
+
+			file.uploaded = i % 10 != 0;
+			file.progress = file.uploaded ? file.size : file.size / 3;
+			if (file.size > PART_SIZE)
+			{
+				file.partSize = PART_SIZE;
+				if (!file.uploaded)
+					file.uploadId = "2~" + HexEncode(md5, 12);
+			}
+
+			if (file.size < 256 * 1024)
+			{
+				snprintf(text, sizeof(text), "%04u/packs/pack-%05llu", upload, index / 64);
+				file.packKey = text;
+				file.hasPackOffset = true;
+				file.packOffset = (i % 64) * 256 * 1024;
+			}
+			if (i % 97 == 5)
+			{
+				snprintf(text, sizeof(text), "%04u/Pictures/%llu/album-%03llu/IMG_%06llu.jpg", upload,
+					2000 + (index - 1) / 20000, (index - 1) / 400 % 1000, index - 1);
+				file.duplicateOf = text;
+			}
+			if (i % 13 == 0)
+			{
+				file.codec = "zstd";
+				if (file.uploaded)
+				{
+					file.hasStoredSize = true;
+					file.storedSize = file.size / 2;
+				}
+			}
+			if (i % 2 == 0)
+			{
+				file.keyId = "bench-key";
+				file.nonce = HexEncode(md5 + 4, 12);
+			}
+			return file;
+		}
+
+		void PatchKey(std::string& key, const char* prefix)
+		{
+			if (!key.empty())
+				memcpy(&key[0], prefix, 4);
+		}
+
+		// SyntheticFile(upload, i) from SyntheticFile(any upload, i).
+		void PatchFile(StoredFile& file, uint32_t upload)
+		{
+			char prefix[8];
+			snprintf(prefix, sizeof(prefix), "%04u", upload);
+			PatchKey(file.keyName, prefix);
+			PatchKey(file.packKey, prefix);
+			PatchKey(file.duplicateOf, prefix);
+		}
+
+		void SyntheticUpload(uint32_t upload, uint64_t files, StoredUpload& result)
+		{
+			char text[128];
+			snprintf(text, sizeof(text), "upload-%04u", upload);
+			result.name = text;
+			snprintf(text, sizeof(text), "https://www.bigstash.co/api/v1/archives/%u/upload/", 10000 + upload);
+			result.url = text;
+			result.status = upload % 3 == 0 ? "paused" : "uploading";
+			result.userPaused = upload % 3 == 0;
+			result.manifestUploaded = false;
+
+			result.files.resize((size_t)files);
+			for (uint64_t i = 0; i < files; ++i)
+				result.files[(size_t)i] = SyntheticFile(upload, i);
+
+			result.packs.clear();
+			for (uint64_t pack = 0; pack < files / 640; ++pack)
+			{
+				StoredPack stored;
+				snprintf(text, sizeof(text), "%04u/packs/pack-%05llu", upload, (unsigned long long)pack);
+				stored.keyName = text;
+				stored.size = 64 * 256 * 1024;
+				stored.md5 = HexEncode((const uint8_t*)text, 16);
+				stored.fileCount = 64;
+				result.packs.push_back(stored);
+			}
+
+			result.progress = 0;
+			for (const StoredFile& file : result.files)
+				result.progress += file.progress;
+		}
+
+		bool SameUpload(const StoredUpload& left, const StoredUpload& right)
+		{
+			return left.name == right.name && left.url == right.url && left.status == right.status &&
+				left.progress == right.progress && left.userPaused == right.userPaused &&
+				left.manifestUploaded == right.manifestUploaded && left.files == right.files &&
+				left.packs == right.packs;
+		}
+
+		// The summary and the whole table of an upload in the store.
+		BsStatus ReadUpload(CUploadStore& store, size_t index, StoredUpload& upload)
+		{
+			const UploadSummary& summary = store.GetSummary(index);
+			upload = StoredUpload();
+			upload.name = summary.name;
+			upload.url = summary.url;
+			upload.status = summary.status;
+			upload.progress = summary.progress;
+			upload.userPaused = summary.userPaused;
+			upload.manifestUploaded = summary.manifestUploaded;
+
+			CUploadTable table;
+			BsStatus status = store.OpenTable(index, table);
+			if (status == BS_OK)
+				status = table.Read(0, table.Count(), upload.files);
+			if (status == BS_OK)
+				status = table.Packs(upload.packs);
+			return status;
+		}
+
+		bool StoreHolds(CUploadStore& store, const StoredUpload& expected)
+		{
+			StoredUpload stored;
+			size_t index = store.Find(expected.name);
+			return index != SIZE_MAX && ReadUpload(store, index, stored) == BS_OK && SameUpload(stored, expected);
+		}
+
+		void AppendJsonText(std::string& json, const std::string& text)
+		{
+			if (text.empty())
+				json += "null";
+			else
+				AppendJsonString(json, text.data(), text.size());
+		}
+
+		// A LocalUpload as Json.NET writes it (Formatting.Indented, through
+		// a UTF-8 StreamWriter that starts with a BOM). The members with
+		// NullValueHandling.Ignore are left out when null.
+		void WriteLocalUploadJson(const StoredUpload& upload, std::string& json)
+		{
+			json = "\xEF\xBB\xBF{\r\n  \"url\": ";
+			AppendJsonText(json, upload.url);
+			json += ",\r\n  \"status\": ";
+			AppendJsonText(json, upload.status);
+			json += ",\r\n  \"progress\": " + std::to_string(upload.progress);
+			json += ",\r\n  \"user_paused\": ";
+			json += upload.userPaused ? "true" : "false";
+			json += ",\r\n  \"archive_manifest_uploaded\": ";
+			json += upload.manifestUploaded ? "true" : "false";
+			json += ",\r\n  \"archive_files_info\": [";
+
+			for (size_t i = 0; i < upload.files.size(); ++i)
+			{
+				const StoredFile& file = upload.files[i];
+				json += i == 0 ? "\r\n    {\r\n      \"file_name\": " : ",\r\n    {\r\n      \"file_name\": ";
+				AppendJsonText(json, file.fileName);
+				json += ",\r\n      \"key_name\": ";
+				AppendJsonText(json, file.keyName);
+				json += ",\r\n      \"file_path\": ";
+				AppendJsonText(json, file.filePath);
+				json += ",\r\n      \"size\": " + std::to_string(file.size);
+				json += ",\r\n      \"last_modified\": ";
+				AppendJsonDate(json, file.lastModified);
+				json += ",\r\n      \"md5\": ";
+				AppendJsonText(json, file.md5);
+				json += ",\r\n      \"uploaded\": ";
+				json += file.uploaded ? "true" : "false";
+				json += ",\r\n      \"progress\": " + std::to_string(file.progress);
+				json += ",\r\n      \"uploadid\": ";
+				AppendJsonText(json, file.uploadId);
+				json += ",\r\n      \"part_size\": " + std::to_string(file.partSize);
+				if (!file.packKey.empty())
+				{
+					json += ",\r\n      \"pack_key\": ";
+					AppendJsonText(json, file.packKey);
+				}
+				if (file.hasPackOffset)
+					json += ",\r\n      \"pack_offset\": " + std::to_string(file.packOffset);
+				if (!file.duplicateOf.empty())
+				{
+					json += ",\r\n      \"duplicate_of\": ";
+					AppendJsonText(json, file.duplicateOf);
+				}
+				if (!file.codec.empty())
+				{
+					json += ",\r\n      \"codec\": ";
+					AppendJsonText(json, file.codec);
+				}
+				if (file.hasStoredSize)
+					json += ",\r\n      \"stored_size\": " + std::to_string(file.storedSize);
+				if (!file.keyId.empty())
+				{
+					json += ",\r\n      \"key_id\": ";
+					AppendJsonText(json, file.keyId);
+				}
+				if (!file.nonce.empty())
+				{
+					json += ",\r\n      \"nonce\": ";
+					AppendJsonText(json, file.nonce);
+				}
+				json += "\r\n    }";
+			}
+			json += upload.files.empty() ? "]" : "\r\n  ]";
+
+			if (!upload.packs.empty())
+			{
+				json += ",\r\n  \"packs\": [";
+				for (size_t i = 0; i < upload.packs.size(); ++i)
+				{
+					const StoredPack& pack = upload.packs[i];
+					json += i == 0 ? "\r\n    {\r\n      \"key_name\": " : ",\r\n    {\r\n      \"key_name\": ";
+					AppendJsonText(json, pack.keyName);
+					json += ",\r\n      \"size\": " + std::to_string(pack.size);
+					json += ",\r\n      \"md5\": ";
+					AppendJsonText(json, pack.md5);
+					json += ",\r\n      \"file_count\": " + std::to_string(pack.fileCount);
+					json += "\r\n    }";
+				}
+				json += "\r\n  ]";
+			}
+			json += "\r\n}";
+		}
+
+		bool WriteFileBytes(const std::string& path, const std::string& data)
+		{
+			FILE* file = fopen(path.c_str(), "wb");
+			if (file == NULL)
+				return false;
+
+			bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+			return fclose(file) == 0 && written;
+		}
+
+		uint64_t FileSize(const std::string& path)
+		{
+			struct stat st;
+			return stat(path.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+		}
+
+		// Takes the file out of the page cache, so the next read is cold.
+		void DropCache(const std::string& path)
+		{
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return;
+			fdatasync(fd);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+
+		int CheckJson()
+		{
+			int64_t fileTime = 0;
+			int64_t utc = 0;
+			BENCH_CHECK(ParseJsonDate("2015-03-01T10:34:56.1234567Z", 28, utc), "date");
+			BENCH_CHECK(ParseJsonDate("2015-03-01T12:34:56.1234567+02:00", 33, fileTime) && fileTime == utc,
+				"date with an offset");
+			BENCH_CHECK(ParseJsonDate("2015-03-01T05:04:56.1234567-05:30", 33, fileTime) && fileTime == utc,
+				"date with a negative offset");
+			BENCH_CHECK(ParseJsonDate("2015-03-01T10:34:56.1234567", 27, fileTime) && fileTime == utc,
+				"date without a zone");
+			BENCH_CHECK(!ParseJsonDate("2015-03-01 10:34:56", 19, fileTime) && !ParseJsonDate("2015-13-01T10:34:56Z", 20,
+				fileTime), "malformed dates");
+
+			// every date AppendJsonDate writes reads back.
+			for (int64_t i = 0; i < 100000; ++i)
+			{
+				int64_t written = START_TIME - 3000000000000000LL + i * 987654321987LL + (i % 7 == 0 ? 0 : i);
+				std::string json;
+				AppendJsonDate(json, written);
+				BENCH_CHECK(json.size() > 2 && ParseJsonDate(json.data() + 1, json.size() - 2, fileTime) &&
+					fileTime == written, "date round trip");
+			}
+
+			std::string text = "quote \" backslash \\ tab \t nel \xC2\x85 e-acute \xC3\xA9 clef \xF0\x9D\x84\x9E";
+			std::string json = "[ ";
+			AppendJsonString(json, text.data(), text.size());
+			json += " , \"\\u00e9\\ud834\\udd1e\\/\", null, -12, { \"a\": [1, 2.5e3, {}], \"b\": true } ]";
+
+			CJsonReader reader(json.data(), json.size());
+			std::string value;
+			int64_t number = 0;
+			BENCH_CHECK(reader.BeginArray() && reader.NextElement() && reader.ReadString(value) && value == text,
+				"escaped string");
+			BENCH_CHECK(reader.NextElement() && reader.ReadString(value) && value == "\xC3\xA9\xF0\x9D\x84\x9E/",
+				"\\u escapes");
+			BENCH_CHECK(reader.NextElement() && reader.ReadString(value) && value.empty(), "null string");
+			BENCH_CHECK(reader.NextElement() && reader.ReadInt64(number) && number == -12, "number");
+			BENCH_CHECK(reader.NextElement() && reader.Skip(), "skip");
+			BENCH_CHECK(!reader.NextElement() && !reader.Failed() && reader.Peek() == JSON_END, "end");
+
+			const char* broken[] = { "{\"a\": }", "[1, 2", "\"open", "{\"a\": 1.5}", "[tru]" };
+			for (const char* document : broken)
+			{
+				CJsonReader failing(document, strlen(document));
+				bool read = failing.Peek() == JSON_OBJECT ? failing.BeginObject() && failing.NextMember(value) &&
+					failing.ReadInt64(number) : failing.Skip();
+				BENCH_CHECK(!read || failing.Failed(), "malformed document accepted");
+			}
+			return 0;
+		}
+
+		int CheckStore(const std::string& directory)
+		{
+			std::string path = directory + "/check.store";
+			RemoveFile(path.c_str());
+
+			StoredUpload first, second, third;
+			SyntheticUpload(1, 1000, first);
+			SyntheticUpload(2, 77, second);
+			SyntheticUpload(3, 0, third);
+			second.files[3].fileName = "na\xC3\xAFve \"quoted\" \\ name";
+			second.files[4].md5 = "NOT-A-DIGEST";
+
+			CUploadStore store;
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK && store.Count() == 0, "create");
+			BENCH_CHECK(store.Put(first) == BS_OK && store.Put(second) == BS_OK && store.Put(third) == BS_OK, "put");
+			BENCH_CHECK(store.Count() == 3 && StoreHolds(store, second), "read before commit");
+			BENCH_CHECK(store.Commit() == BS_OK, "commit");
+
+			const UploadSummary& summary = store.GetSummary(0);
+			uint64_t uploadedFiles = 0;
+			uint64_t totalSize = 0;
+			for (const StoredFile& file : first.files)
+			{
+				uploadedFiles += file.uploaded ? 1 : 0;
+				totalSize += file.size;
+			}
+			BENCH_CHECK(summary.fileCount == 1000 && summary.uploadedFiles == uploadedFiles &&
+				summary.totalSize == totalSize && summary.packCount == first.packs.size(), "summary");
+
+			// a view stays on what it was opened on.
+			CUploadTable view;
+			BENCH_CHECK(store.OpenTable(store.Find(first.name), view) == BS_OK, "open the view");
+			StoredUpload replaced(first);
+			replaced.files.resize(500);
+			replaced.files[10].uploaded = !replaced.files[10].uploaded;
+			BENCH_CHECK(store.Put(replaced) == BS_OK && store.Commit() == BS_OK, "replace");
+			StoredFile file;
+			BENCH_CHECK(view.Count() == 1000 && view.Get(999, file) == BS_OK && file == first.files[999], "old view");
+			for (uint64_t i = 0; i < 1000; i += 37)
+				BENCH_CHECK(view.Get(i, file) == BS_OK && file == first.files[i], "random access");
+			BENCH_CHECK(view.Get(1000, file) == BS_E_INVALIDARG, "past the end");
+
+			BENCH_CHECK(store.SetState(store.Find(second.name), "completed", 12345, false, true) == BS_OK, "set state");
+			second.status = "completed";
+			second.progress = 12345;
+			second.userPaused = false;
+			second.manifestUploaded = true;
+			BENCH_CHECK(store.Remove(store.Find(third.name)) == BS_OK && store.Commit() == BS_OK, "remove");
+			store.Close();
+
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK && store.Count() == 2, "reopen");
+			BENCH_CHECK(StoreHolds(store, replaced) && StoreHolds(store, second) && store.Find(third.name) == SIZE_MAX,
+				"reopened store");
+			StoreStats committed = store.Stats();
+
+			// a Put no Commit covered is gone after a crash, and cut off.
+			BENCH_CHECK(store.Put(third) == BS_OK, "put without commit");
+			store.Close();
+			BENCH_CHECK(FileSize(path) > committed.fileLength, "appended");
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK && store.Find(third.name) == SIZE_MAX, "uncommitted put");
+			BENCH_CHECK(FileSize(path) == committed.fileLength, "torn tail not cut off");
+
+			// a header slot torn on its way to the disk: the other one holds.
+			BENCH_CHECK(store.Put(third) == BS_OK && store.Commit() == BS_OK && store.Find(third.name) != SIZE_MAX,
+				"commit");
+			uint64_t generation = store.Stats().generation;
+			store.Close();
+			{
+				int fd = open(path.c_str(), O_WRONLY);
+				BENCH_CHECK(fd >= 0, "open the store");
+				char garbage[16];
+				memset(garbage, 0x5A, sizeof(garbage));
+				bool written = pwrite(fd, garbage, sizeof(garbage), (off_t)(generation % 2 * 64 + 24)) ==
+					(ssize_t)sizeof(garbage);
+				close(fd);
+				BENCH_CHECK(written, "tear the header");
+			}
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK && store.Stats().generation == generation - 1, "fallback");
+			BENCH_CHECK(store.Find(third.name) == SIZE_MAX && StoreHolds(store, replaced) && StoreHolds(store, second),
+				"store as the commit before left it");
+
+			// compaction keeps the live tables only.
+			BENCH_CHECK(store.Put(third) == BS_OK && store.Commit() == BS_OK, "commit");
+			StoreStats before = store.Stats();
+			BENCH_CHECK(before.liveBytes < before.fileLength, "garbage");
+			BENCH_CHECK(store.Compact() == BS_OK, "compact");
+			StoreStats after = store.Stats();
+			BENCH_CHECK(after.fileLength == after.liveBytes && after.fileLength == FileSize(path) &&
+				after.liveBytes == before.liveBytes, "compacted");
+			BENCH_CHECK(StoreHolds(store, replaced) && StoreHolds(store, second) && StoreHolds(store, third),
+				"compacted store");
+			BENCH_CHECK(view.Get(500, file) == BS_OK && file == first.files[500], "view across compaction");
+			store.Close();
+
+			BENCH_CHECK(WriteFileBytes(path, "not a store at all, but long enough to hold two header slots and then "
+				"some more bytes, so it is not mistaken for an empty file"), "overwrite");
+			BENCH_CHECK(store.Open(path.c_str()) == BS_E_CORRUPT, "garbage store");
+			RemoveFile(path.c_str());
+			return 0;
+		}
+
+		int CheckMigration(const std::string& directory)
+		{
+			std::string uploads = directory + "/uploads";
+			mkdir(uploads.c_str(), 0755);
+
+			// the second is broken, with a good backup; upload-broken is broken
+			// without one, and settings.json is not an upload at all.
+			std::vector<StoredUpload> expected(3);
+			std::string json;
+			for (uint32_t i = 0; i < 3; ++i)
+			{
+				SyntheticUpload(20 + i, 300 + i, expected[i]);
+				expected[i].files[7].filePath = "C:\\Users\\bench\\Documents\\r\xC3\xA9sum\xC3\xA9 \"final\".docx";
+				expected[i].files[8].md5.clear();
+				WriteLocalUploadJson(expected[i], json);
+
+				std::string uploadPath = uploads + "/" + expected[i].name + ".djf";
+				if (i == 1)
+				{
+					BENCH_CHECK(WriteFileBytes(uploadPath + ".bak", json), "write backup");
+					json.resize(json.size() / 2);
+				}
+				BENCH_CHECK(WriteFileBytes(uploadPath, json), "write upload");
+			}
+			BENCH_CHECK(WriteFileBytes(uploads + "/upload-broken.djf", "{\"url\": \"x\", \"archive_files_info\": [{"),
+				"broken");
+			BENCH_CHECK(WriteFileBytes(uploads + "/settings.json", "{}"), "other file");
+
+			std::string path = directory + "/migrated.store";
+			RemoveFile(path.c_str());
+			CUploadStore store;
+			MigrationStats stats;
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK, "create");
+			BENCH_CHECK(MigrateLocalUploads(uploads.c_str(), ".djf", store, stats) == BS_OK, "migrate");
+			BENCH_CHECK(stats.imported == 3 && stats.fromBackup == 1 && stats.failed == 1 && stats.skipped == 0,
+				"migration counts");
+			store.Close();
+
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK && store.Count() == 3, "reopen");
+			for (const StoredUpload& upload : expected)
+				BENCH_CHECK(StoreHolds(store, upload), "migrated upload differs");
+			BENCH_CHECK(MigrateLocalUploads(uploads.c_str(), ".djf", store, stats) == BS_OK && stats.imported == 0 &&
+				stats.skipped == 3 && stats.failed == 1, "second migration");
+			store.Close();
+
+			RemoveTree(uploads);
+			RemoveFile(path.c_str());
+			return 0;
+		}
+
+		int CheckCApi(const std::string& directory)
+		{
+			std::string path = directory + "/api.store";
+			RemoveFile(path.c_str());
+
+			BsStoredFile files[2];
+			memset(files, 0, sizeof(files));
+			files[0].fileName = "a.txt";
+			files[0].keyName = "1/a.txt";
+			files[0].filePath = "/data/a.txt";
+			files[0].size = 10;
+			files[0].lastModified = START_TIME;
+			files[0].md5 = "0123456789abcdef0123456789abcdef";
+			files[0].flags = BS_STORED_FILE_UPLOADED;
+			files[1].fileName = "b.txt";
+			files[1].keyName = "1/b.txt";
+			files[1].packKey = "1/packs/pack-0";
+			files[1].packOffset = 0;
+			files[1].codec = "gzip";
+			files[1].storedSize = 4;
+			files[1].keyId = "api-key";
+			files[1].nonce = "00112233445566778899aabb";
+			files[1].flags = BS_STORED_FILE_PACKED | BS_STORED_FILE_STORED_SIZE;
+
+			BsStoredPack pack = { "1/packs/pack-0", 100, "fedcba9876543210fedcba9876543210", 1 };
+			BsStoredUpload upload;
+			memset(&upload, 0, sizeof(upload));
+			upload.name = "api";
+			upload.url = "https://www.bigstash.co/api/v1/archives/1/upload/";
+			upload.status = "uploading";
+			upload.progress = 10;
+			upload.flags = BS_UPLOAD_USER_PAUSED;
+			upload.files = files;
+			upload.fileCount = 2;
+			upload.packs = &pack;
+			upload.packCount = 1;
+
+			BsUploadStore* store = NULL;
+			BENCH_CHECK(BsUploadStoreOpen(path.c_str(), &store) == BS_OK, "open");
+			BENCH_CHECK(BsUploadStorePut(store, &upload) == BS_OK && BsUploadStoreCommit(store) == BS_OK, "put");
+			BsUploadStoreClose(store);
+
+			BENCH_CHECK(BsUploadStoreOpen(path.c_str(), &store) == BS_OK, "reopen");
+			uint32_t count = 0;
+			uint32_t index = 0;
+			BENCH_CHECK(BsUploadStoreGetCount(store, &count) == BS_OK && count == 1, "count");
+			BENCH_CHECK(BsUploadStoreFind(store, "api", &index) == BS_OK && index == 0, "find");
+			BENCH_CHECK(BsUploadStoreFind(store, "other", &index) == BS_E_NOTFOUND, "find missing");
+
+			BsUploadSummary summary;
+			BENCH_CHECK(BsUploadStoreGetSummary(store, 0, &summary) == BS_OK, "summary");
+			BENCH_CHECK(strcmp(summary.name, "api") == 0 && strcmp(summary.status, "uploading") == 0 &&
+				summary.flags == BS_UPLOAD_USER_PAUSED && summary.fileCount == 2 && summary.packCount == 1 &&
+				summary.uploadedFiles == 1 && summary.uploadedBytes == 10, "summary fields");
+
+			BsUploadTable* table = NULL;
+			BsStoredFile read[2];
+			BENCH_CHECK(BsUploadStoreOpenTable(store, 0, &table) == BS_OK, "open table");
+			BENCH_CHECK(BsUploadTableRead(table, 0, 2, read) == BS_OK, "read");
+			BENCH_CHECK(strcmp(read[0].keyName, "1/a.txt") == 0 && strcmp(read[0].md5, files[0].md5) == 0 &&
+				read[0].lastModified == START_TIME && read[0].flags == BS_STORED_FILE_UPLOADED &&
+				read[0].packKey == NULL, "first file");
+			BENCH_CHECK(strcmp(read[1].packKey, "1/packs/pack-0") == 0 && read[1].md5 == NULL &&
+				read[1].flags == (BS_STORED_FILE_PACKED | BS_STORED_FILE_STORED_SIZE) && read[1].storedSize == 4 &&
+				strcmp(read[1].nonce, files[1].nonce) == 0 && read[0].nonce == NULL, "second file");
+			BENCH_CHECK(BsUploadTableRead(table, 1, 2, read) == BS_E_INVALIDARG, "read past the end");
+
+			BsStoredPack packs[2];
+			BENCH_CHECK(BsUploadTableGetPacks(table, packs, 2, &count) == BS_OK && count == 1 &&
+				strcmp(packs[0].md5, pack.md5) == 0 && packs[0].fileCount == 1, "packs");
+			BsUploadTableClose(table);
+
+			BENCH_CHECK(BsUploadStoreSetState(store, 0, "completed", 20, BS_UPLOAD_MANIFEST_UPLOADED) == BS_OK &&
+				BsUploadStoreGetSummary(store, 0, &summary) == BS_OK && strcmp(summary.status, "completed") == 0 &&
+				summary.flags == BS_UPLOAD_MANIFEST_UPLOADED, "set state");
+			BENCH_CHECK(BsUploadStoreRemove(store, 0) == BS_OK && BsUploadStoreCompact(store) == BS_OK &&
+				BsUploadStoreGetCount(store, &count) == BS_OK && count == 0, "remove and compact");
+			BENCH_CHECK(BsUploadStoreRemove(store, 0) == BS_E_INVALIDARG, "remove missing");
+			BsUploadStoreClose(store);
+
+			RemoveFile(path.c_str());
+			return 0;
+		}
+
+		int MeasureColdStart(const BenchOptions& options, const std::string& directory)
+		{
+			uint32_t uploads = options.quick ? 40 : 1000;
+			uint64_t files = FileCount(options, 100000, 5000);
+
+			// enough JSON files for 2M files between them, at least two.
+			uint32_t jsonUploads = (uint32_t)std::min<uint64_t>(uploads, std::max<uint64_t>(2, 2000000 / files));
+
+			std::string path = directory + "/cold.store";
+			RemoveFile(path.c_str());
+
+			// upload 0's files, turned into every other upload's.
+			StoredUpload upload;
+			SyntheticUpload(0, files, upload);
+			std::vector<StoredFile> files0(upload.files);
+
+			CStopwatch stopwatch;
+			uint64_t totalFiles = 0;
+			{
+				CUploadStore store;
+				BENCH_CHECK(store.Open(path.c_str()) == BS_OK, "create");
+				for (uint32_t i = 0; i < uploads; ++i)
+				{
+					StoredUpload current;
+					SyntheticUpload(i, 0, current);
+					current.files = files0;
+					for (StoredFile& file : current.files)
+						PatchFile(file, i);
+					current.progress = upload.progress;
+
+					BENCH_CHECK(store.Put(current) == BS_OK, "put");
+					totalFiles += current.files.size();
+					if (i % 100 == 99)
+						BENCH_CHECK(store.Commit() == BS_OK, "commit");
+				}
+				BENCH_CHECK(store.Commit() == BS_OK, "commit");
+			}
+			double fillSeconds = stopwatch.Seconds();
+			uint64_t storeBytes = FileSize(path);
+
+			// cold: the index and the one table come off the disk.
+			DropCache(path);
+			stopwatch.Restart();
+			CUploadStore store;
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK, "open");
+			uint64_t summedFiles = 0;
+			for (size_t i = 0; i < store.Count(); ++i)
+				summedFiles += store.GetSummary(i).fileCount;
+			double openSeconds = stopwatch.Seconds();
+			BENCH_CHECK(store.Count() == uploads && summedFiles == totalFiles, "summaries");
+
+			uint32_t opened = uploads / 2;
+			stopwatch.Restart();
+			CUploadTable table;
+			StoredFile file;
+			BENCH_CHECK(store.OpenTable(opened, table) == BS_OK && table.Get(files / 2, file) == BS_OK, "open table");
+			double tableSeconds = stopwatch.Seconds();
+			BENCH_CHECK(file == SyntheticFile(opened, files / 2), "file read from the table");
+
+			stopwatch.Restart();
+			std::vector<StoredFile> rows;
+			BENCH_CHECK(table.Read(0, table.Count(), rows) == BS_OK, "read table");
+			double readSeconds = stopwatch.Seconds();
+			for (uint64_t i = 0; i < files; ++i)
+			{
+				if (!(rows[(size_t)i] == SyntheticFile(opened, i)))
+				{
+					fprintf(stderr, "file %llu of upload %u differs\n", (unsigned long long)i, opened);
+					return 1;
+				}
+			}
+			rows.clear();
+			store.Close();
+
+			// warm, as on a restart soon after the last.
+			stopwatch.Restart();
+			BENCH_CHECK(store.Open(path.c_str()) == BS_OK && store.Count() == uploads, "warm open");
+			double warmSeconds = stopwatch.Seconds();
+			store.Close();
+
+			// the reference: the same uploads read cold from their JSON files.
+			std::string uploadsDirectory = directory + "/json";
+			mkdir(uploadsDirectory.c_str(), 0755);
+			std::vector<std::string> jsonPaths;
+			uint64_t jsonBytes = 0;
+			std::string json;
+			for (uint32_t i = 0; i < jsonUploads; ++i)
+			{
+				SyntheticUpload(i, files, upload);
+				WriteLocalUploadJson(upload, json);
+				jsonPaths.push_back(uploadsDirectory + "/" + upload.name + ".djf");
+				BENCH_CHECK(WriteFileBytes(jsonPaths.back(), json), "write JSON");
+				jsonBytes += json.size();
+			}
+			json.clear();
+			for (const std::string& jsonPath : jsonPaths)
+				DropCache(jsonPath);
+
+			stopwatch.Restart();
+			for (uint32_t i = 0; i < jsonUploads; ++i)
+			{
+				BENCH_CHECK(ImportLocalUpload(jsonPaths[i].c_str(), upload) == BS_OK, "parse JSON");
+				BENCH_CHECK(upload.files.size() == files && upload.files[1] == SyntheticFile(i, 1), "parsed upload");
+			}
+			double jsonSeconds = stopwatch.Seconds();
+			double projectedSeconds = jsonSeconds / jsonUploads * uploads;
+
+			// migrating them, cold as well.
+			for (const std::string& jsonPath : jsonPaths)
+				DropCache(jsonPath);
+			std::string migratedPath = directory + "/migrated.store";
+			RemoveFile(migratedPath.c_str());
+			MigrationStats stats;
+			stopwatch.Restart();
+			{
+				CUploadStore migrated;
+				BENCH_CHECK(migrated.Open(migratedPath.c_str()) == BS_OK, "create");
+				BENCH_CHECK(MigrateLocalUploads(uploadsDirectory.c_str(), ".djf", migrated, stats) == BS_OK &&
+					stats.imported == jsonUploads, "migrate");
+			}
+			double migrateSeconds = stopwatch.Seconds();
+
+			Report("store", "uploads", (double)uploads, "uploads");
+			Report("store", "files", (double)totalFiles, "files");
+			Report("store", "store_mb", storeBytes / 1048576.0, "MB");
+			Report("store", "store_bytes_per_file", (double)storeBytes / totalFiles, "bytes");
+			Report("store", "fill_files_per_second", totalFiles / fillSeconds, "files/s");
+			Report("store", "cold_open_ms", openSeconds * 1000, "ms");
+			Report("store", "warm_open_ms", warmSeconds * 1000, "ms");
+			Report("store", "cold_table_open_ms", tableSeconds * 1000, "ms");
+			Report("store", "table_read_files_per_second", files / readSeconds, "files/s");
+			Report("store", "json_uploads_parsed", (double)jsonUploads, "uploads");
+			Report("store", "json_bytes_per_file", (double)jsonBytes / (jsonUploads * files), "bytes");
+			Report("store", "json_cold_parse_s_per_upload", jsonSeconds / jsonUploads, "s");
+			Report("store", "json_cold_parse_projected_s", projectedSeconds, "s");
+			Report("store", "cold_open_speedup", projectedSeconds / openSeconds, "x");
+			Report("store", "migrate_s_per_upload", migrateSeconds / jsonUploads, "s");
+
+			RemoveTree(uploadsDirectory);
+			RemoveFile(migratedPath.c_str());
+			RemoveFile(path.c_str());
+			return 0;
+		}
+	}
+
+	int RunStoreBenchmark(const BenchOptions& options)
+	{
+		mkdir(options.workDir.c_str(), 0755);
+		std::string directory = options.workDir + "/store";
+		RemoveTree(directory);
+		mkdir(directory.c_str(), 0755);
+
+		int result = CheckJson();
+		if (result == 0)
+			result = CheckStore(directory);
+		if (result == 0)
+			result = CheckMigration(directory);
+		if (result == 0)
+			result = CheckCApi(directory);
+		if (result == 0)
+			result = MeasureColdStart(options, directory);
+
+		RemoveTree(directory);
+		return result;
+	}
+}
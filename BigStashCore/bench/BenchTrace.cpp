@@ -0,0 +1,404 @@
+// BenchTrace.cpp : Upload tracing benchmark.
+//
+// Checks the histogram's percentiles against the exact ones of the same
+// values, sorted, and that every value lands in the bucket that holds it.
+// Then traces uploads to the S3 stand-in, one with injected 500s, and
+// checks that every part went through each stage once per attempt, that
+// the counters add up to the file and that the trace file pairs its begin
+// and end events. The overhead pass times one Record with its two clock
+// reads, and fails when that, times the stages a part records, costs more
+// than 1% of an untraced part's upload. The end-to-end difference of
+// traced and untraced uploads is reported too, but loopback runs are too
+// noisy to hold it to 1%.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../PartPlanner.h"
+#include "../S3Client.h"
+#include "../UploadTracer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const uint64_t PART_SIZE = S3_MIN_PART_SIZE;
+		const char* BUCKET = "bench-bucket";
+		const char* KEY = "traced/file.bin";
+
+		// The overhead budget, as a fraction of an untraced part.
+		const double MAX_OVERHEAD = 0.01;
+
+		bool WriteTestFile(const std::string& path, uint64_t size)
+		{
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+
+			std::vector<uint8_t> buffer(1024 * 1024);
+			uint64_t state = 23;
+			for (uint64_t offset = 0; offset < size; offset += buffer.size())
+			{
+				size_t length = (size_t)std::min<uint64_t>(buffer.size(), size - offset);
+				FillRandom(buffer.data(), length, state);
+				if (write(fd, buffer.data(), length) != (ssize_t)length)
+				{
+					close(fd);
+					return false;
+				}
+			}
+
+			close(fd);
+			return true;
+		}
+
+		size_t CountOf(const std::string& text, const std::string& needle)
+		{
+			size_t count = 0;
+			for (size_t at = text.find(needle); at != std::string::npos; at = text.find(needle, at + needle.size()))
+				count++;
+			return count;
+		}
+
+		// Brackets balanced outside strings, strings closed: enough to know a
+		// viewer will load it, without a JSON parser in the tree.
+		bool WellFormed(const std::string& json)
+		{
+			std::vector<char> open;
+			bool inString = false;
+			for (size_t i = 0; i < json.size(); ++i)
+			{
+				char c = json[i];
+				if (inString)
+				{
+					if (c == '\\')
+						i++;
+					else if (c == '"')
+						inString = false;
+					continue;
+				}
+
+				if (c == '"')
+					inString = true;
+				else if (c == '{' || c == '[')
+					open.push_back(c == '{' ? '}' : ']');
+				else if (c == '}' || c == ']')
+				{
+					if (open.empty() || open.back() != c)
+						return false;
+					open.pop_back();
+				}
+			}
+
+			return !inString && open.empty();
+		}
+
+		int CheckHistogram(const BenchOptions& options)
+		{
+			for (unsigned bucket = 0; bucket + 1 < HISTOGRAM_BUCKETS; ++bucket)
+			{
+				int64_t low = CLatencyHistogram::BucketLow(bucket);
+				int64_t high = low + CLatencyHistogram::BucketWidth(bucket) - 1;
+				BENCH_CHECK(CLatencyHistogram::BucketOf(low) == bucket, "bucket does not hold its low value");
+				BENCH_CHECK(CLatencyHistogram::BucketOf(high) == bucket, "bucket does not hold its high value");
+				BENCH_CHECK(CLatencyHistogram::BucketOf(high + 1) == bucket + 1, "gap between buckets");
+			}
+			BENCH_CHECK(CLatencyHistogram::BucketOf(INT64_MAX) == HISTOGRAM_BUCKETS - 1, "overflow not in the last bucket");
+
+			// log-uniform from 1 ns to about 17 s, like stages from a clock
+			// read to a slow part.
+			size_t count = options.quick ? 200000 : 2000000;
+			std::vector<int64_t> values(count);
+			CLatencyHistogram histogram;
+			CLatencyHistogram half;
+			uint64_t state = 5;
+			for (size_t i = 0; i < count; ++i)
+			{
+				uint64_t word;
+				FillRandom((uint8_t*)&word, sizeof(word), state);
+				double exponent = (double)(word >> 11) / (double)(1ull << 53) * 34.0;
+				values[i] = (int64_t)std::pow(2.0, exponent);
+				histogram.Record(values[i]);
+				if (i % 2 == 0)
+					half.Record(values[i]);
+			}
+
+			std::vector<int64_t> sorted(values);
+			std::sort(sorted.begin(), sorted.end());
+			BENCH_CHECK(histogram.Count() == count, "count lost");
+			BENCH_CHECK(histogram.Min() == sorted.front() && histogram.Max() == sorted.back(), "min or max wrong");
+
+			const double percentiles[] = { 1, 25, 50, 90, 99, 99.9, 100 };
+			double worst = 0;
+			for (double percentile : percentiles)
+			{
+				size_t rank = std::max<size_t>((size_t)std::ceil(percentile / 100.0 * (double)count), 1);
+				int64_t exact = sorted[rank - 1];
+				int64_t estimate = histogram.ValueAtPercentile(percentile);
+				double error = std::fabs((double)(estimate - exact)) / (double)exact;
+				worst = std::max(worst, error);
+
+				// half a bucket either way: 1/64 of the value, or 1 ns below 32.
+				BENCH_CHECK(std::llabs(estimate - exact) <= std::max<int64_t>(exact / 64, 1), "percentile off by more than a bucket");
+			}
+
+			// the even and the odd values folded together give the whole.
+			CLatencyHistogram odd;
+			for (size_t i = 1; i < count; i += 2)
+				odd.Record(values[i]);
+			CLatencyHistogram merged;
+			merged.Add(half);
+			merged.Add(odd);
+			BENCH_CHECK(merged.Count() == count && merged.Sum() == histogram.Sum(), "Add lost values");
+			BENCH_CHECK(merged.ValueAtPercentile(99) == histogram.ValueAtPercentile(99), "Add changed a percentile");
+
+			CStopwatch stopwatch;
+			CLatencyHistogram timed;
+			for (size_t i = 0; i < count; ++i)
+				timed.Record(values[i]);
+			Report("trace", "histogram_record_ns", stopwatch.Seconds() * 1e9 / (double)count, "ns");
+			Report("trace", "percentile_worst_error", worst * 100, "%");
+			return 0;
+		}
+
+		S3ClientOptions ClientOptions(uint16_t port, unsigned connections)
+		{
+			S3ClientOptions options;
+			options.host = "127.0.0.1";
+			options.port = port;
+			options.connections = connections;
+			return options;
+		}
+
+		// Uploads path with trace (NULL: untraced) and returns the seconds
+		// UploadParts took, or a negative value when it failed.
+		double Upload(CS3Client& client, const std::string& path, uint64_t size, bool computeMd5,
+			CUploadTrace* trace, std::vector<S3Part>& uploaded)
+		{
+			std::string uploadId;
+			if (client.InitiateMultipartUpload(BUCKET, KEY, uploadId) != BS_OK)
+				return -1;
+
+			PartReaderOptions options;
+			options.computeMd5 = computeMd5;
+			options.trace = trace;
+			CBufferPool pool(PART_SIZE, options.readAhead + client.Options().connections);
+			CPartReader reader(pool);
+			if (reader.Open(path.c_str(), UniformParts(size, PART_SIZE), options) != BS_OK)
+				return -1;
+
+			CStopwatch stopwatch;
+			BsStatus status = client.UploadParts(BUCKET, KEY, uploadId, reader, uploaded, S3PartCallback(), NULL, trace);
+			double seconds = stopwatch.Seconds();
+			reader.Close();
+
+			return status == BS_OK ? seconds : -1;
+		}
+
+		int CheckTracedUpload(const std::string& path, uint64_t size, unsigned failEvery)
+		{
+			S3StandInOptions serverOptions;
+			serverOptions.failEvery = failEvery;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			CS3Client client(ClientOptions(server.Port(), 4));
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			CUploadTracer tracer((TraceOptions()));
+			std::shared_ptr<CUploadTrace> trace = tracer.BeginUpload(KEY);
+			BENCH_CHECK(trace, "enabled tracer gave no trace");
+
+			std::vector<S3Part> uploaded;
+			BENCH_CHECK(Upload(client, path, size, true, trace.get(), uploaded) >= 0, "traced upload failed");
+
+			TraceUploadStats running;
+			BENCH_CHECK(tracer.GetStats(trace->Id(), running) && !running.finished, "running upload not listed");
+			tracer.EndUpload(trace);
+
+			TraceUploadStats stats;
+			BENCH_CHECK(tracer.GetStats(trace->Id(), stats) && stats.finished, "finished upload not kept");
+			BENCH_CHECK(stats.name == KEY, "upload name lost");
+
+			uint64_t parts = uploaded.size();
+			uint64_t attempts = parts + stats.retries;
+			BENCH_CHECK(parts == UniformParts(size, PART_SIZE).size(), "parts missing");
+			BENCH_CHECK(stats.partsRead == parts && stats.partsSent == parts, "part counters wrong");
+			BENCH_CHECK(stats.bytesRead == size && stats.bytesSent == size, "byte counters wrong");
+			BENCH_CHECK(stats.failures == 0, "failure counted on a good upload");
+			BENCH_CHECK(failEvery == 0 || stats.retries == server.FailuresInjected(), "retries not counted");
+
+			const TraceStageStats* stages = stats.stages;
+			BENCH_CHECK(stages[TRACE_FILE].count == 1, "file not timed once");
+			BENCH_CHECK(stages[TRACE_PART].count == parts, "part stage count wrong");
+			BENCH_CHECK(stages[TRACE_BUFFER_WAIT].count == parts, "buffer wait count wrong");
+			BENCH_CHECK(stages[TRACE_READ].count == parts, "read count wrong");
+			BENCH_CHECK(stages[TRACE_HASH].count == parts, "hash count wrong");
+			BENCH_CHECK(stages[TRACE_QUEUED].count == parts, "queued count wrong");
+			BENCH_CHECK(stages[TRACE_CONNECTION_WAIT].count == attempts, "connection wait count wrong");
+			BENCH_CHECK(stages[TRACE_SEND].count == attempts, "send count wrong");
+			BENCH_CHECK(stages[TRACE_SERVER_WAIT].count == attempts, "server wait count wrong");
+			BENCH_CHECK(stages[TRACE_RECEIVE].count == attempts, "receive count wrong");
+			BENCH_CHECK(stages[TRACE_RETRY_DELAY].count == stats.retries, "retry delay count wrong");
+			BENCH_CHECK(stages[TRACE_CONNECT].count >= 1 && stages[TRACE_CONNECT].count <= server.ConnectionsAccepted(),
+				"connects do not match the server");
+			BENCH_CHECK(stages[TRACE_ENCRYPT].count == 0 && stages[TRACE_SLOT_WAIT].count == 0 &&
+				stages[TRACE_SIGN].count == 0, "stage timed that did not run");
+
+			// a part is no shorter than its own network stages.
+			BENCH_CHECK(stages[TRACE_PART].total >= stages[TRACE_SEND].total, "part shorter than its sends");
+			BENCH_CHECK(stages[TRACE_FILE].max >= stages[TRACE_PART].max, "file shorter than a part");
+
+			TraceUploadStats totals;
+			BENCH_CHECK(tracer.GetStats(0, totals), "no totals");
+			BENCH_CHECK(totals.bytesSent == size && totals.stages[TRACE_SEND].count == attempts, "totals differ");
+
+			std::vector<TraceEvent> events = tracer.Events();
+			uint64_t recorded = 0;
+			for (unsigned i = 0; i < TRACE_STAGE_COUNT; ++i)
+				recorded += stages[i].count;
+			BENCH_CHECK(events.size() == recorded && tracer.DroppedEvents() == 0, "events lost");
+			for (const TraceEvent& event : events)
+			{
+				BENCH_CHECK(event.end >= event.start, "event ends before it starts");
+				BENCH_CHECK(event.upload == trace->Id() && event.part <= parts, "event for an unknown part");
+			}
+
+			std::string json;
+			tracer.FormatTrace(json);
+			BENCH_CHECK(WellFormed(json), "trace file is not well formed");
+			BENCH_CHECK(CountOf(json, "\"ph\":\"b\"") == events.size(), "begin events missing");
+			BENCH_CHECK(CountOf(json, "\"ph\":\"e\"") == events.size(), "end events missing");
+			BENCH_CHECK(json.find("\"traced/file.bin\"") != std::string::npos, "upload name missing from the trace");
+
+			// a small ring keeps the latest events and counts the rest.
+			TraceOptions small;
+			small.eventCapacity = 16;
+			tracer.Enable(small);
+			trace = tracer.BeginUpload(KEY);
+			uploaded.clear();
+			BENCH_CHECK(Upload(client, path, size, true, trace.get(), uploaded) >= 0, "traced upload failed");
+			tracer.EndUpload(trace);
+			BENCH_CHECK(tracer.Events().size() == 16 && tracer.DroppedEvents() > 0, "ring not bounded");
+			tracer.FormatTrace(json);
+			BENCH_CHECK(WellFormed(json), "trace file is not well formed");
+
+			// disabled, nothing is handed out.
+			tracer.Disable();
+			BENCH_CHECK(!tracer.BeginUpload(KEY), "disabled tracer gave a trace");
+
+			if (failEvery == 0)
+			{
+				std::string tracePath = path + ".trace.json";
+				BENCH_CHECK(tracer.WriteTrace(tracePath.c_str()) == BS_OK, "WriteTrace failed");
+				struct stat info;
+				BENCH_CHECK(stat(tracePath.c_str(), &info) == 0 && (size_t)info.st_size == json.size(), "trace file size");
+				unlink(tracePath.c_str());
+
+				Report("trace", "stages_per_part", (double)recorded / (double)parts, "events");
+				Report("trace", "part_p50_ms", stages[TRACE_PART].p50 / 1e6, "ms");
+				Report("trace", "part_p99_ms", stages[TRACE_PART].p99 / 1e6, "ms");
+			}
+
+			client.Stop();
+			server.Stop();
+			return 0;
+		}
+
+		int MeasureOverhead(const BenchOptions& options, const std::string& path, uint64_t size)
+		{
+			// one Record as the hot path does it: two clock reads, the stage's
+			// and the totals' histograms, and the ring.
+			CUploadTracer tracer((TraceOptions()));
+			std::shared_ptr<CUploadTrace> trace = tracer.BeginUpload(KEY);
+			size_t records = options.quick ? 200000 : 2000000;
+
+			CStopwatch stopwatch;
+			for (size_t i = 0; i < records; ++i)
+			{
+				int64_t start = MonotonicNanoseconds();
+				trace->Record((TraceStage)(i % TRACE_STAGE_COUNT), (uint32_t)(i & 1023) + 1, start, MonotonicNanoseconds(),
+					PART_SIZE);
+			}
+			double recordNs = stopwatch.Seconds() * 1e9 / (double)records;
+			tracer.EndUpload(trace);
+
+			// uploads as fast as the loopback goes, without digests, so the
+			// tracing is the largest share of a part it can be.
+			S3StandInOptions serverOptions;
+			serverOptions.verifyMd5 = false;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+			CS3Client client(ClientOptions(server.Port(), 4));
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			size_t parts = UniformParts(size, PART_SIZE).size();
+			double untraced = 1e300;
+			double traced = 1e300;
+			uint64_t events = 0;
+			for (unsigned round = 0; round < (options.quick ? 3u : 5u); ++round)
+			{
+				std::vector<S3Part> uploaded;
+				double seconds = Upload(client, path, size, false, NULL, uploaded);
+				BENCH_CHECK(seconds >= 0 && uploaded.size() == parts, "untraced upload failed");
+				untraced = std::min(untraced, seconds);
+
+				tracer.Enable(TraceOptions());
+				trace = tracer.BeginUpload(KEY);
+				uploaded.clear();
+				seconds = Upload(client, path, size, false, trace.get(), uploaded);
+				tracer.EndUpload(trace);
+				BENCH_CHECK(seconds >= 0 && uploaded.size() == parts, "traced upload failed");
+				traced = std::min(traced, seconds);
+				events = tracer.Events().size() + tracer.DroppedEvents();
+			}
+
+			double eventsPerPart = (double)events / (double)parts;
+			double partNs = untraced * 1e9 / (double)parts;
+			double overhead = eventsPerPart * recordNs / partNs;
+
+			Report("trace", "record_ns", recordNs, "ns");
+			Report("trace", "untraced_mb_per_second", size / 1e6 / untraced, "MB/s");
+			Report("trace", "traced_mb_per_second", size / 1e6 / traced, "MB/s");
+			Report("trace", "estimated_overhead", overhead * 100, "%");
+			Report("trace", "measured_overhead", (traced / untraced - 1) * 100, "%");
+			BENCH_CHECK(overhead < MAX_OVERHEAD, "tracing costs more than 1% of a part");
+
+			client.Stop();
+			server.Stop();
+			return 0;
+		}
+	}
+
+	int RunTraceBenchmark(const BenchOptions& options)
+	{
+		if (CheckHistogram(options) != 0)
+			return 1;
+
+		// an odd tail, so the last part is short.
+		uint64_t size = (options.quick ? 16ull : 128ull) * 1024 * 1024 + 4321;
+
+		mkdir(options.workDir.c_str(), 0755);
+		std::string path = options.workDir + "/trace.bin";
+		BENCH_CHECK(WriteTestFile(path, size), "cannot write the test file");
+
+		int result = CheckTracedUpload(path, size, 0);
+		if (result == 0)
+			result = CheckTracedUpload(path, size, 3);
+		if (result == 0)
+			result = MeasureOverhead(options, path, size);
+
+		unlink(path.c_str());
+		return result;
+	}
+}
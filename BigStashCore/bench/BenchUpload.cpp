@@ -0,0 +1,291 @@
+// BenchUpload.cpp : Multipart upload engine benchmark.
+//
+// Uploads a file to a local S3 stand-in through CS3Client. The correctness
+// pass resumes an upload half way through (ListParts and CPartBitmap plan
+// the rest), completes it and compares the object's ETag with the one
+// HashFile computes, then checks abort, 500 retries and stale keep-alive
+// retries. The throughput pass reports MB/s for one part at a time on a new
+// connection per request, the way the SDK's HttpClient path behaves when
+// parts are uploaded one after another, against windows of parts in flight
+// over persistent connections. The stand-in holds every response back by a
+// typical S3 latency, which is what the window hides.
+
+#include "BenchCommon.h"
+#include "S3StandIn.h"
+#include "SyntheticTree.h"
+#include "../ContentHasher.h"
+#include "../PartPlanner.h"
+#include "../S3Client.h"
+
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const uint64_t PART_SIZE = S3_MIN_PART_SIZE;
+		// per request, about the first-byte latency of S3 from a desktop.
+		const unsigned RESPONSE_DELAY_MS = 30;
+		const char* BUCKET = "bench-bucket";
+		const char* KEY = "archive 1/file.bin";
+		const char* OBJECT_PATH = "/bench-bucket/archive 1/file.bin";
+
+		bool WriteTestFile(const std::string& path, uint64_t size)
+		{
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+
+			std::vector<uint8_t> buffer(1024 * 1024);
+			uint64_t state = 11;
+			for (uint64_t offset = 0; offset < size; offset += buffer.size())
+			{
+				size_t length = (size_t)std::min<uint64_t>(buffer.size(), size - offset);
+				FillRandom(buffer.data(), length, state);
+				if (write(fd, buffer.data(), length) != (ssize_t)length)
+				{
+					close(fd);
+					return false;
+				}
+			}
+
+			close(fd);
+			return true;
+		}
+
+		S3ClientOptions ClientOptions(uint16_t port, unsigned connections)
+		{
+			S3ClientOptions options;
+			options.host = "127.0.0.1";
+			options.port = port;
+			options.connections = connections;
+			return options;
+		}
+
+		int UploadSpans(CS3Client& client, const std::string& path, const std::string& uploadId,
+			const std::vector<PartSpan>& spans, bool computeMd5, std::vector<S3Part>& uploaded)
+		{
+			PartReaderOptions options;
+			options.computeMd5 = computeMd5;
+			CBufferPool pool(PART_SIZE, options.readAhead + client.Options().connections);
+			CPartReader reader(pool);
+
+			BENCH_CHECK(reader.Open(path.c_str(), spans, options) == BS_OK, "Open failed");
+			BsStatus status = client.UploadParts(BUCKET, KEY, uploadId, reader, uploaded);
+			reader.Close();
+
+			BENCH_CHECK(status == BS_OK, "UploadParts failed");
+			return 0;
+		}
+
+		int CheckResumedUpload(uint16_t port, const std::string& path, uint64_t size, CS3StandIn& server)
+		{
+			CS3Client client(ClientOptions(port, 4));
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			std::string uploadId;
+			BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "initiate failed");
+
+			// the first session sends every other part and stops.
+			PartLayout layout;
+			BENCH_CHECK(PartLayout::FromPartSize(size, PART_SIZE, layout) == BS_OK, "no layout");
+			std::vector<PartSpan> first;
+			for (uint32_t number = 1; number <= layout.partCount; number += 2)
+				first.push_back(layout.Part(number));
+
+			std::vector<S3Part> uploaded;
+			if (UploadSpans(client, path, uploadId, first, true, uploaded) != 0)
+				return 1;
+			BENCH_CHECK(uploaded.size() == first.size(), "parts missing from the first session");
+
+			// the second one asks S3 what arrived and sends the rest.
+			std::vector<S3Part> listed;
+			BENCH_CHECK(client.ListParts(BUCKET, KEY, uploadId, listed) == BS_OK, "ListParts failed");
+			BENCH_CHECK(listed.size() == first.size(), "ListParts lost parts");
+
+			CPartBitmap bitmap(layout);
+			for (const S3Part& part : listed)
+				BENCH_CHECK(bitmap.MarkCompleted(part.partNumber, part.size) == BS_OK, "listed part does not fit");
+
+			std::vector<PartSpan> rest;
+			bitmap.RemainingParts(rest);
+			if (UploadSpans(client, path, uploadId, rest, true, listed) != 0)
+				return 1;
+			BENCH_CHECK(listed.size() == layout.partCount, "parts missing after the resume");
+
+			std::string etag;
+			BENCH_CHECK(client.CompleteMultipartUpload(BUCKET, KEY, uploadId, listed, etag) == BS_OK, "complete failed");
+
+			ContentDigest digest;
+			BENCH_CHECK(HashFile(path.c_str(), PART_SIZE, digest) == BS_OK, "HashFile failed");
+			std::string expected = "\"" + digest.ETag(true) + "\"";
+			std::string stored;
+			BENCH_CHECK(server.CompletedETag(OBJECT_PATH, stored), "object missing");
+			BENCH_CHECK(etag == expected && stored == expected, "ETag differs from the local digest");
+
+			// an aborted upload is gone.
+			BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "initiate failed");
+			BENCH_CHECK(client.AbortMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "abort failed");
+			BENCH_CHECK(client.ListParts(BUCKET, KEY, uploadId, listed) == BS_E_NOTFOUND, "aborted upload still listed");
+			BENCH_CHECK(client.LastError() == "NoSuchUpload", "wrong S3 error code");
+
+			// a corrupted Content-MD5 is refused, not retried.
+			std::vector<uint8_t> data(1024, 7);
+			uint8_t md5[MD5_DIGEST_SIZE] = { 0 };
+			BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "initiate failed");
+			BENCH_CHECK(client.UploadPart(BUCKET, KEY, uploadId, 1, data.data(), data.size(), md5, etag) == BS_E_CORRUPT,
+				"bad digest accepted");
+			return 0;
+		}
+
+		int CheckRetries(const std::string& path, uint64_t size)
+		{
+			std::vector<PartSpan> spans = UniformParts(size, PART_SIZE);
+
+			// every third part upload fails once with a 500.
+			S3StandInOptions failing;
+			failing.failEvery = 3;
+			CS3StandIn server(failing);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+			{
+				CS3Client client(ClientOptions(server.Port(), 2));
+				BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+				std::string uploadId;
+				std::vector<S3Part> uploaded;
+				BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "initiate failed");
+				if (UploadSpans(client, path, uploadId, spans, true, uploaded) != 0)
+					return 1;
+				BENCH_CHECK(uploaded.size() == spans.size(), "parts lost to 500s");
+				BENCH_CHECK(server.FailuresInjected() > 0, "no failure injected");
+			}
+			server.Stop();
+
+			// the server drops every connection after one response, without
+			// saying so, so each reuse finds a dead socket.
+			S3StandInOptions dropping;
+			dropping.closeAfter = 1;
+			CS3StandIn dropper(dropping);
+			BENCH_CHECK(dropper.Start(), "stand-in did not start");
+			{
+				CS3Client client(ClientOptions(dropper.Port(), 2));
+				BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+				std::string uploadId;
+				std::vector<S3Part> uploaded;
+				BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "initiate failed");
+				if (UploadSpans(client, path, uploadId, spans, true, uploaded) != 0)
+					return 1;
+				BENCH_CHECK(uploaded.size() == spans.size(), "parts lost to stale connections");
+
+				std::string etag;
+				BENCH_CHECK(client.CompleteMultipartUpload(BUCKET, KEY, uploadId, uploaded, etag) == BS_OK,
+					"complete failed");
+			}
+			dropper.Stop();
+			return 0;
+		}
+
+		int MeasureUpload(const char* name, const std::string& path, uint64_t size, unsigned window, bool keepAlive)
+		{
+			S3StandInOptions serverOptions;
+			serverOptions.verifyMd5 = false;
+			serverOptions.responseDelayMs = RESPONSE_DELAY_MS;
+			CS3StandIn server(serverOptions);
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+
+			S3ClientOptions options = ClientOptions(server.Port(), window);
+			CS3Client client(options);
+			BENCH_CHECK(client.Start() == BS_OK, "Start failed");
+
+			std::string uploadId;
+			BENCH_CHECK(client.InitiateMultipartUpload(BUCKET, KEY, uploadId) == BS_OK, "initiate failed");
+
+			CStopwatch stopwatch;
+			std::vector<S3Part> uploaded;
+			std::vector<PartSpan> spans = UniformParts(size, PART_SIZE);
+			if (keepAlive)
+			{
+				if (UploadSpans(client, path, uploadId, spans, false, uploaded) != 0)
+					return 1;
+			}
+			else
+			{
+				// a new client per part: a new connection, and nothing overlaps.
+				for (const PartSpan& span : spans)
+				{
+					CS3Client single(options);
+					BENCH_CHECK(single.Start() == BS_OK, "Start failed");
+					if (UploadSpans(single, path, uploadId, std::vector<PartSpan>(1, span), false, uploaded) != 0)
+						return 1;
+				}
+			}
+			double seconds = stopwatch.Seconds();
+
+			BENCH_CHECK(uploaded.size() == spans.size(), "parts missing");
+			BENCH_CHECK(server.BytesReceived() >= size, "server received less than the file");
+
+			std::string metric = std::string(name) + "_mb_per_second";
+			Report("upload", metric.c_str(), size / 1e6 / seconds, "MB/s");
+			metric = std::string(name) + "_connections";
+			Report("upload", metric.c_str(), (double)server.ConnectionsAccepted(), "connections");
+
+			client.Stop();
+			server.Stop();
+			return 0;
+		}
+	}
+
+	int RunUploadBenchmark(const BenchOptions& options)
+	{
+		uint64_t size = options.quick ? 64ull * 1024 * 1024 : 512ull * 1024 * 1024;
+
+		// an odd tail, so the last part is short.
+		size += 4321;
+
+		mkdir(options.workDir.c_str(), 0755);
+		std::string path = options.workDir + "/upload.bin";
+		BENCH_CHECK(WriteTestFile(path, size), "cannot write the test file");
+
+		int result = 0;
+		{
+			CS3StandIn server((S3StandInOptions()));
+			BENCH_CHECK(server.Start(), "stand-in did not start");
+			result = CheckResumedUpload(server.Port(), path, size, server);
+		}
+
+		if (result == 0)
+			result = CheckRetries(path, std::min<uint64_t>(size, 8 * PART_SIZE));
+
+		struct Mode
+		{
+			const char* name;
+			unsigned window;
+			bool keepAlive;
+		};
+
+		const Mode modes[] =
+		{
+			{ "sequential_new_connection", 1, false },
+			{ "window_1", 1, true },
+			{ "window_4", 4, true },
+			{ "window_8", 8, true },
+		};
+
+		for (const Mode& mode : modes)
+		{
+			if (result != 0)
+				break;
+			result = MeasureUpload(mode.name, path, size, mode.window, mode.keepAlive);
+		}
+
+		unlink(path.c_str());
+		return result;
+	}
+}
@@ -0,0 +1,415 @@
+// BenchUtf.cpp : UTF-16 to UTF-8 transcoding benchmark.
+//
+// Checks the SIMD transcoder against a plain reference encoder on every BMP
+// character, on surrogate pairs from every plane, on lone surrogates at every
+// position in a block and on random mixed text, and checks that the decoder
+// round-trips it all and turns away malformed UTF-8. Then writes out a 1M
+// path selection (the shape of a large Explorer selection) both ways: today's,
+// a MAX_PATH buffer copied into a string per path, joined and converted with
+// a counting pass and a converting pass (what two WideCharToMultiByte calls
+// do), and the path arena transcoded in one pass.
+
+#include "BenchCommon.h"
+#include "SyntheticTree.h"
+#include "../PathArena.h"
+#include "../Utf.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const size_t MAX_PATH_UNITS = 260;
+
+		// The reference encoder the kernels are checked against, and the
+		// converting pass of the baseline.
+		bool ReferenceEncode(const uint16_t* text, size_t length, std::string& output)
+		{
+			for (size_t i = 0; i < length; ++i)
+			{
+				uint32_t c = text[i];
+				if (c >= 0xD800 && c <= 0xDFFF)
+				{
+					if (c >= 0xDC00 || i + 1 == length || text[i + 1] < 0xDC00 || text[i + 1] > 0xDFFF)
+						return false;
+					c = 0x10000 + ((c - 0xD800) << 10) + (text[++i] - 0xDC00);
+				}
+
+				if (c < 0x80)
+					output += (char)c;
+				else if (c < 0x800)
+				{
+					output += (char)(0xC0 | (c >> 6));
+					output += (char)(0x80 | (c & 0x3F));
+				}
+				else if (c < 0x10000)
+				{
+					output += (char)(0xE0 | (c >> 12));
+					output += (char)(0x80 | ((c >> 6) & 0x3F));
+					output += (char)(0x80 | (c & 0x3F));
+				}
+				else
+				{
+					output += (char)(0xF0 | (c >> 18));
+					output += (char)(0x80 | ((c >> 12) & 0x3F));
+					output += (char)(0x80 | ((c >> 6) & 0x3F));
+					output += (char)(0x80 | (c & 0x3F));
+				}
+			}
+			return true;
+		}
+
+		// The counting pass of the baseline.
+		size_t ReferenceLength(const uint16_t* text, size_t length)
+		{
+			size_t bytes = 0;
+			for (size_t i = 0; i < length; ++i)
+			{
+				uint16_t c = text[i];
+				if (c < 0x80)
+					bytes += 1;
+				else if (c < 0x800)
+					bytes += 2;
+				else if (c >= 0xD800 && c <= 0xDBFF)
+				{
+					bytes += 4;
+					++i;
+				}
+				else
+					bytes += 3;
+			}
+			return bytes;
+		}
+
+		// Encodes text with the dispatched and the portable kernel, and
+		// decodes the result back; all three must agree with the reference.
+		int CheckEncode(const std::vector<uint16_t>& text, const char* what)
+		{
+			std::string expected;
+			bool valid = ReferenceEncode(text.data(), text.size(), expected);
+
+			std::vector<char> output(3 * text.size() + 1);
+			size_t written = Utf16ToUtf8(text.data(), text.size(), output.data());
+			size_t portable = Utf16ToUtf8Portable(text.data(), text.size(), output.data());
+			BENCH_CHECK(portable == (valid ? expected.size() : UTF_INVALID), what);
+			written = Utf16ToUtf8(text.data(), text.size(), output.data());
+			if (!valid)
+			{
+				BENCH_CHECK(written == UTF_INVALID, what);
+				return 0;
+			}
+			BENCH_CHECK(written == expected.size(), what);
+			BENCH_CHECK(memcmp(output.data(), expected.data(), written) == 0, what);
+
+			std::vector<uint16_t> decoded(written + 1);
+			size_t units = Utf8ToUtf16(output.data(), written, decoded.data());
+			BENCH_CHECK(units == text.size(), what);
+			BENCH_CHECK(memcmp(decoded.data(), text.data(), units * sizeof(uint16_t)) == 0, what);
+			BENCH_CHECK(Utf8ToUtf16Portable(output.data(), written, decoded.data()) == units, what);
+			return 0;
+		}
+
+		int CheckCharacters()
+		{
+			// Every BMP character, runs of them through the blocks and each
+			// one alone between ASCII, at every alignment in a block.
+			std::vector<uint16_t> text;
+			for (uint32_t c = 0; c < 0x10000; ++c)
+			{
+				if (c < 0xD800 || c > 0xDFFF)
+					text.push_back((uint16_t)c);
+			}
+			if (CheckEncode(text, "bmp run") != 0)
+				return 1;
+
+			for (uint32_t c = 1; c < 0x10000; c += (c < 0x1000 ? 1 : 7))
+			{
+				if (c >= 0xD800 && c <= 0xDFFF)
+					continue;
+				std::vector<uint16_t> single(40, 'a');
+				single[c % 17 + 3] = (uint16_t)c;
+				if (CheckEncode(single, "bmp single") != 0)
+					return 1;
+			}
+
+			// Surrogate pairs: every high surrogate, sampled lows, also
+			// straddling the end of a block.
+			for (uint32_t high = 0xD800; high < 0xDC00; ++high)
+			{
+				std::vector<uint16_t> pairs(48, 0x00E9);
+				size_t position = high % 24 + 4;
+				pairs[position] = (uint16_t)high;
+				pairs[position + 1] = (uint16_t)(0xDC00 + (high * 37) % 0x400);
+				if (CheckEncode(pairs, "surrogate pair") != 0)
+					return 1;
+			}
+			return 0;
+		}
+
+		int CheckLoneSurrogates()
+		{
+			const uint16_t backgrounds[] = { 'x', 0x00FC, 0x4E2D };
+			const uint16_t lone[] = { 0xD800, 0xDBFF, 0xDC00, 0xDFFF };
+			for (uint16_t background : backgrounds)
+			{
+				for (uint16_t surrogate : lone)
+				{
+					for (size_t length = 1; length <= 40; ++length)
+					{
+						for (size_t position = 0; position < length; ++position)
+						{
+							std::vector<uint16_t> text(length, background);
+							text[position] = surrogate;
+							if (CheckEncode(text, "lone surrogate") != 0)
+								return 1;
+						}
+					}
+				}
+			}
+
+			// A high surrogate followed by another high one, or by a non
+			// surrogate.
+			std::vector<uint16_t> text(32, 'a');
+			text[10] = 0xD801;
+			text[11] = 0xD802;
+			text[12] = 0xDC02;
+			if (CheckEncode(text, "high high low") != 0)
+				return 1;
+			text[11] = 'b';
+			if (CheckEncode(text, "high then ascii") != 0)
+				return 1;
+
+			// The high-level call leaves the output alone.
+			std::string output = "kept";
+			BENCH_CHECK(AppendUtf8(output, text.data(), text.size()) == BS_E_CORRUPT, "lone surrogate");
+			BENCH_CHECK(output == "kept", "output on failure");
+			return 0;
+		}
+
+		int CheckRandom()
+		{
+			uint64_t state = 13;
+			const uint16_t alphabet[] = { 'a', 'Z', '/', '.', 0x00E9, 0x00FC, 0x03A9, 0x0416, 0x05D0, 0x4E2D,
+				0x65E5, 0xAC00, 0xFF21, 0xD83D, 0xDE00, 0xD800, 0xDC00 };
+			for (size_t round = 0; round < 20000; ++round)
+			{
+				uint8_t random[256];
+				FillRandom(random, sizeof(random), state);
+				size_t length = random[0] % 120;
+				bool invalid = round % 4 == 0;
+
+				std::vector<uint16_t> text;
+				for (size_t i = 0; i < length; ++i)
+				{
+					uint8_t pick = random[i + 1];
+					if (pick < 128)
+						text.push_back((uint16_t)('a' + pick % 26));
+					else if (pick < 240 || invalid)
+						text.push_back(alphabet[pick % 13]);
+					else
+					{
+						text.push_back(0xD83D);
+						text.push_back(0xDE00 + pick % 0x40);
+					}
+				}
+				if (invalid && length != 0)
+					text[random[200] % text.size()] = alphabet[13 + random[201] % 4];
+
+				if (CheckEncode(text, "random") != 0)
+					return 1;
+			}
+			return 0;
+		}
+
+		int CheckMalformedUtf8()
+		{
+			static const char* const malformed[] =
+			{
+				"\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF",
+				"\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xFF", "\xED\xA0\x80", "\xED\xBF\xBF", "\x80", "\xBF",
+				"\xC3", "\xE4\xB8", "\xF0\x9F\x98", "\xC3\x28", "\xE4\x28\xAD",
+			};
+
+			std::vector<uint16_t> output(128);
+			for (const char* sequence : malformed)
+			{
+				for (size_t position = 0; position < 40; position += 3)
+				{
+					std::string text(40, 'q');
+					text.insert(position, sequence);
+					BENCH_CHECK(Utf8ToUtf16(text.data(), text.size(), output.data()) == UTF_INVALID, "malformed");
+					BENCH_CHECK(Utf8ToUtf16Portable(text.data(), text.size(), output.data()) == UTF_INVALID, "malformed");
+
+					// Truncated at the very end.
+					std::string tail = std::string(position, 'q') + sequence;
+					BENCH_CHECK(Utf8ToUtf16(tail.data(), tail.size(), output.data()) == UTF_INVALID, "malformed tail");
+				}
+			}
+
+			// The largest values of each length are fine.
+			const char* edges = "\x7F\xDF\xBF\xEF\xBF\xBF\xF4\x8F\xBF\xBF\xEE\x80\x80";
+			BENCH_CHECK(Utf8ToUtf16(edges, strlen(edges), output.data()) == 6, "edges");
+			return 0;
+		}
+
+		int CheckArena()
+		{
+			CPathArena arena;
+			std::string output;
+			BENCH_CHECK(arena.AppendUtf8(output, '\n') == BS_OK && output.empty(), "empty arena");
+
+			const uint16_t first[] = { 'C', ':', '\\', 0x00E9 };
+			arena.Add(first, 4);
+			uint16_t* second = arena.Append(2);
+			second[0] = 'x';
+			second[1] = 0xD800;
+			arena.RemoveLast();
+			arena.Add(NULL, 0);
+			std::vector<uint16_t> longPath(32000, 'l');
+			arena.Add(longPath.data(), longPath.size());
+
+			BENCH_CHECK(arena.Count() == 3, "count");
+			BENCH_CHECK(arena.Length(0) == 4 && arena.Path(0)[4] == 0, "first path");
+			BENCH_CHECK(arena.Length(1) == 0 && arena.Length(2) == longPath.size(), "lengths");
+			BENCH_CHECK(arena.Units() == 4 + 1 + 1 + longPath.size() + 1, "units");
+
+			BENCH_CHECK(arena.AppendUtf8(output, '\n') == BS_OK, "append");
+			BENCH_CHECK(output == "C:\\\xC3\xA9\n\n" + std::string(longPath.size(), 'l'), "joined");
+
+			CPathArena other;
+			other.Swap(arena);
+			BENCH_CHECK(arena.Empty() && other.Count() == 3, "swap");
+			return 0;
+		}
+
+		// A selection path, mostly ASCII with the odd accented or CJK folder,
+		// a few of them past MAX_PATH.
+		void SelectionPath(uint64_t index, std::vector<uint16_t>& path)
+		{
+			char text[160];
+			snprintf(text, sizeof(text), "C:\\Users\\user\\Documents\\Projects\\project-%04u\\assets\\batch-%03u\\IMG_%07u.CR2",
+				(unsigned)(index / 10000), (unsigned)(index / 100 % 100), (unsigned)index);
+			path.assign(text, text + strlen(text));
+
+			if (index % 7 == 0)
+			{
+				// "Fotos\Überraschung"
+				const uint16_t folder[] = { 'F', 'o', 't', 'o', 's', '\\', 0x00DC, 'b', 'e', 'r', 'r', 'a', 's', 'c', 'h',
+					'u', 'n', 'g', '\\' };
+				path.insert(path.begin() + 14, folder, folder + sizeof(folder) / sizeof(folder[0]));
+			}
+			if (index % 13 == 0)
+			{
+				const uint16_t folder[] = { 0x5199, 0x771F, '\\' };
+				path.insert(path.begin() + 14, folder, folder + 3);
+			}
+			if (index % 1000 == 0)
+				path.insert(path.begin() + 14, 300, 'd');
+		}
+
+		int RunThroughput(const BenchOptions& options)
+		{
+			uint64_t count = FileCount(options, 1000000, 100000);
+
+			std::vector<std::vector<uint16_t> > source(count);
+			size_t sourceUnits = 0;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				SelectionPath(i, source[i]);
+				sourceUnits += source[i].size();
+			}
+
+			// Today: a MAX_PATH buffer per path (the long ones are lost), a
+			// string each, joined, counted and converted.
+			CStopwatch stopwatch;
+			std::vector<std::u16string> strings;
+			uint16_t buffer[MAX_PATH_UNITS];
+			for (const std::vector<uint16_t>& path : source)
+			{
+				if (path.size() >= MAX_PATH_UNITS)
+					continue;
+				memcpy(buffer, path.data(), path.size() * sizeof(uint16_t));
+				buffer[path.size()] = 0;
+				strings.push_back(std::u16string(reinterpret_cast<const char16_t*>(buffer)));
+			}
+			std::u16string joined;
+			for (size_t i = 0; i < strings.size(); ++i)
+			{
+				if (i != 0)
+					joined += u'\n';
+				joined += strings[i];
+			}
+			const uint16_t* joinedUnits = reinterpret_cast<const uint16_t*>(joined.data());
+			std::string baseline;
+			baseline.reserve(ReferenceLength(joinedUnits, joined.size()));
+			BENCH_CHECK(ReferenceEncode(joinedUnits, joined.size(), baseline), "baseline");
+			double baselineSeconds = stopwatch.Seconds();
+
+			// The arena, written in place and transcoded in one pass.
+			stopwatch.Restart();
+			CPathArena arena;
+			arena.Reserve(count, sourceUnits + count);
+			for (const std::vector<uint16_t>& path : source)
+			{
+				uint16_t* units = arena.Append(path.size());
+				memcpy(units, path.data(), path.size() * sizeof(uint16_t));
+			}
+			std::string text;
+			BENCH_CHECK(arena.AppendUtf8(text, '\n') == BS_OK, "arena");
+			double arenaSeconds = stopwatch.Seconds();
+
+			BENCH_CHECK(arena.Count() == count, "arena count");
+			std::string expected;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				if (i != 0)
+					expected += '\n';
+				BENCH_CHECK(ReferenceEncode(source[i].data(), source[i].size(), expected), "expected");
+			}
+			BENCH_CHECK(text == expected, "arena output");
+			BENCH_CHECK(strings.size() == count - (count + 999) / 1000, "baseline keeps the short paths");
+
+			// The transcoder on its own, against the scalar code.
+			const uint16_t* units = arena.Path(0);
+			std::vector<char> output(3 * arena.Units());
+			stopwatch.Restart();
+			size_t written = Utf16ToUtf8(units, arena.Units(), output.data());
+			double simdSeconds = stopwatch.Seconds();
+			stopwatch.Restart();
+			size_t portable = Utf16ToUtf8Portable(units, arena.Units(), output.data());
+			double portableSeconds = stopwatch.Seconds();
+			BENCH_CHECK(written == portable && written == text.size() + 1, "transcoded length");
+
+			Report("utf", "paths", (double)count, "paths");
+			Report("utf", "baseline_paths_per_second", count / baselineSeconds, "paths/s");
+			Report("utf", "arena_paths_per_second", count / arenaSeconds, "paths/s");
+			Report("utf", "arena_vs_baseline", baselineSeconds / arenaSeconds, "x");
+			Report("utf", "long_paths_kept", (double)(count - strings.size()), "paths");
+			Report("utf", (std::string("kernel_") + Utf16ToUtf8Kernel()).c_str(), 1, "bool");
+			Report("utf", "transcode_gb_per_second", arena.Units() * sizeof(uint16_t) / simdSeconds / 1e9, "GB/s");
+			Report("utf", "transcode_vs_portable", portableSeconds / simdSeconds, "x");
+			return 0;
+		}
+	}
+
+	int RunUtfBenchmark(const BenchOptions& options)
+	{
+		int result = CheckCharacters();
+		if (result == 0)
+			result = CheckLoneSurrogates();
+		if (result == 0)
+			result = CheckRandom();
+		if (result == 0)
+			result = CheckMalformedUtf8();
+		if (result == 0)
+			result = CheckArena();
+		if (result == 0)
+			result = RunThroughput(options);
+		return result;
+	}
+}
@@ -0,0 +1,676 @@
+// S3StandIn.cpp : Implementation of the local S3 stand-in
+
+#include "S3StandIn.h"
+#include "../Encoding.h"
+#include "../Md5.h"
+#include "../Sha256.h"
+#include "../Xml.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace BigStash;
+
+namespace BigStashBench
+{
+	namespace
+	{
+		const size_t READ_BUFFER_SIZE = 1024 * 1024;
+
+		// Read size on a shaped link, small enough to interleave connections.
+		const size_t SHAPED_READ_SIZE = 64 * 1024;
+
+		std::string Lowercase(std::string value)
+		{
+			for (char& c : value)
+				c = (char)tolower((unsigned char)c);
+			return value;
+		}
+
+		std::string UriDecode(const std::string& value)
+		{
+			std::string result;
+			for (size_t i = 0; i < value.size(); ++i)
+			{
+				if (value[i] == '%' && i + 2 < value.size())
+				{
+					result += (char)strtol(value.substr(i + 1, 2).c_str(), NULL, 16);
+					i += 2;
+				}
+				else
+					result += value[i];
+			}
+			return result;
+		}
+
+		std::string ErrorResponse(int status, const char* reason, const char* code)
+		{
+			std::string body = std::string("<?xml version=\"1.0\" encoding=\"UTF-8\"?><Error><Code>") + code +
+				"</Code><Message>" + code + "</Message></Error>";
+			return "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\nContent-Type: application/xml\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+		}
+
+		std::string OkResponse(const std::string& body, const std::string& extraHeaders = std::string())
+		{
+			return "HTTP/1.1 200 OK\r\n" + extraHeaders + "Content-Type: application/xml\r\nContent-Length: " +
+				std::to_string(body.size()) + "\r\n\r\n" + body;
+		}
+
+		bool SendAll(int socket, const std::string& data)
+		{
+			size_t sent = 0;
+			while (sent < data.size())
+			{
+				ssize_t count = send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+				if (count <= 0)
+					return false;
+				sent += (size_t)count;
+			}
+			return true;
+		}
+	}
+
+	// Buffered reads from one connection.
+	class CS3StandIn::CConnectionReader
+	{
+	public:
+		CConnectionReader(int socket, CS3StandIn& owner)
+			: m_socket(socket), m_buffer(READ_BUFFER_SIZE), m_begin(0), m_end(0), m_owner(owner)
+		{
+		}
+
+		// Reads up to the blank line after the headers.
+		bool ReadHead(std::string& head)
+		{
+			head.clear();
+			for (;;)
+			{
+				const char* begin = m_buffer.data() + m_begin;
+				const char* end = m_buffer.data() + m_end;
+				const char* found = std::search(begin, end, "\r\n\r\n", "\r\n\r\n" + 4);
+				if (found != end)
+				{
+					size_t length = (size_t)(found - begin) + 4;
+					head.append(begin, length);
+					m_begin += length;
+					return true;
+				}
+
+				// keep the last three bytes, the terminator may straddle reads.
+				size_t keep = std::min<size_t>(3, m_end - m_begin);
+				head.append(begin, (size_t)(end - begin) - keep);
+				memmove(m_buffer.data(), end - keep, keep);
+				m_begin = 0;
+				m_end = keep;
+				if (head.size() > 64 * 1024 || !Fill())
+					return false;
+			}
+		}
+
+		// Reads one CRLF terminated line, without the CRLF.
+		bool ReadLine(std::string& line)
+		{
+			line.clear();
+			for (;;)
+			{
+				for (size_t i = m_begin; i < m_end; ++i)
+				{
+					if (m_buffer[i] == '\n')
+					{
+						line.append(m_buffer.data() + m_begin, i - m_begin);
+						m_begin = i + 1;
+						if (!line.empty() && line.back() == '\r')
+							line.pop_back();
+						return true;
+					}
+				}
+
+				line.append(m_buffer.data() + m_begin, m_end - m_begin);
+				m_begin = m_end = 0;
+				if (line.size() > 4096 || !Fill())
+					return false;
+			}
+		}
+
+		// Hands the body to sink in buffer-sized pieces.
+		template <typename Sink>
+		bool ReadBody(uint64_t length, Sink sink)
+		{
+			while (length > 0)
+			{
+				if (m_begin == m_end)
+				{
+					m_begin = m_end = 0;
+					if (!Fill())
+						return false;
+				}
+
+				size_t take = (size_t)std::min<uint64_t>(length, m_end - m_begin);
+				sink(m_buffer.data() + m_begin, take);
+				m_begin += take;
+				length -= take;
+			}
+			return true;
+		}
+
+	private:
+		bool Fill()
+		{
+			size_t room = m_buffer.size() - m_end;
+			if (m_owner.m_options.bandwidth != 0)
+				room = std::min(room, SHAPED_READ_SIZE);
+
+			ssize_t count = recv(m_socket, m_buffer.data() + m_end, room, 0);
+			if (count <= 0)
+				return false;
+			m_end += (size_t)count;
+			m_owner.m_bytesReceived += (uint64_t)count;
+			if (m_owner.m_options.bandwidth != 0)
+				m_owner.Pace((size_t)count);
+			return true;
+		}
+
+		int m_socket;
+		std::vector<char> m_buffer;
+		size_t m_begin;
+		size_t m_end;
+		CS3StandIn& m_owner;
+	};
+
+	CS3StandIn::CS3StandIn(const S3StandInOptions& options)
+		: m_options(options), m_listener(-1), m_port(0), m_stopping(false), m_nextUploadId(1), m_partRequests(0),
+		m_objectPuts(0), m_listRequests(0), m_bytesReceived(0), m_connections(0), m_failuresInjected(0), m_stragglersInjected(0)
+	{
+	}
+
+	// Holds a connection back until the link has carried its bytes, after
+	// the bytes every other connection received before them.
+	void CS3StandIn::Pace(size_t bytes)
+	{
+		std::chrono::steady_clock::time_point until;
+		{
+			std::lock_guard<std::mutex> guard(m_linkLock);
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			until = std::max(now, m_linkFree) + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>((double)bytes / m_options.bandwidth));
+			m_linkFree = until;
+		}
+		std::this_thread::sleep_until(until);
+	}
+
+	CS3StandIn::~CS3StandIn()
+	{
+		Stop();
+	}
+
+	bool CS3StandIn::Start()
+	{
+		m_listener = socket(AF_INET, SOCK_STREAM, 0);
+		if (m_listener < 0)
+			return false;
+
+		int enable = 1;
+		setsockopt(m_listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(address);
+
+		if (bind(m_listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+			getsockname(m_listener, (sockaddr*)&address, &length) != 0 ||
+			listen(m_listener, 128) != 0)
+		{
+			close(m_listener);
+			m_listener = -1;
+			return false;
+		}
+
+		m_port = ntohs(address.sin_port);
+		m_acceptThread = std::thread(&CS3StandIn::AcceptLoop, this);
+		return true;
+	}
+
+	void CS3StandIn::Stop()
+	{
+		if (m_listener < 0)
+			return;
+
+		m_stopping = true;
+		shutdown(m_listener, SHUT_RDWR);
+		m_acceptThread.join();
+		close(m_listener);
+		m_listener = -1;
+
+		std::vector<std::thread> threads;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			for (int socket : m_sockets)
+				shutdown(socket, SHUT_RDWR);
+			threads.swap(m_threads);
+		}
+
+		for (std::thread& thread : threads)
+			thread.join();
+	}
+
+	bool CS3StandIn::CompletedETag(const std::string& path, std::string& etag)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto found = m_objects.find(path);
+		if (found == m_objects.end())
+			return false;
+		etag = found->second;
+		return true;
+	}
+
+	uint64_t CS3StandIn::ObjectPuts()
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_objectPuts;
+	}
+
+	uint64_t CS3StandIn::ListRequests()
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_listRequests;
+	}
+
+	std::string CS3StandIn::SeedUpload(const std::string& path)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		std::string id = "upload-" + std::to_string(m_nextUploadId++);
+		m_uploads[id].path = path;
+		return id;
+	}
+
+	bool CS3StandIn::SeedPart(const std::string& uploadId, uint32_t partNumber, uint64_t size, const std::string& etag)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto upload = m_uploads.find(uploadId);
+		if (upload == m_uploads.end())
+			return false;
+
+		Part& part = upload->second.parts[partNumber];
+		part.size = size;
+		part.etag = etag;
+		return true;
+	}
+
+	bool CS3StandIn::DropPart(const std::string& uploadId, uint32_t partNumber)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		auto upload = m_uploads.find(uploadId);
+		return upload != m_uploads.end() && upload->second.parts.erase(partNumber) != 0;
+	}
+
+	void CS3StandIn::AcceptLoop()
+	{
+		while (!m_stopping)
+		{
+			int socket = accept(m_listener, NULL, NULL);
+			if (socket < 0)
+			{
+				if (m_stopping)
+					break;
+				continue;
+			}
+
+			int size = 4 * 1024 * 1024;
+			setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+			m_connections++;
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_sockets.push_back(socket);
+			m_threads.push_back(std::thread(&CS3StandIn::Serve, this, socket));
+		}
+	}
+
+	void CS3StandIn::Serve(int socket)
+	{
+		CConnectionReader reader(socket, *this);
+		unsigned responses = 0;
+		std::string head;
+
+		while (!m_stopping && reader.ReadHead(head))
+		{
+			Request request;
+			request.contentLength = 0;
+
+			size_t lineEnd = head.find("\r\n");
+			std::string line = head.substr(0, lineEnd);
+			size_t firstSpace = line.find(' ');
+			size_t secondSpace = line.find(' ', firstSpace + 1);
+			if (firstSpace == std::string::npos || secondSpace == std::string::npos)
+				break;
+
+			request.method = line.substr(0, firstSpace);
+			std::string target = line.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+			size_t question = target.find('?');
+			request.path = UriDecode(target.substr(0, question));
+			if (question != std::string::npos)
+			{
+				std::string query = target.substr(question + 1);
+				size_t position = 0;
+				while (position <= query.size())
+				{
+					size_t end = query.find('&', position);
+					if (end == std::string::npos)
+						end = query.size();
+					std::string pair = query.substr(position, end - position);
+					size_t equals = pair.find('=');
+					if (!pair.empty())
+					{
+						request.query[UriDecode(pair.substr(0, equals))] =
+							equals == std::string::npos ? std::string() : UriDecode(pair.substr(equals + 1));
+					}
+					position = end + 1;
+				}
+			}
+
+			size_t position = lineEnd + 2;
+			while (position < head.size())
+			{
+				size_t end = head.find("\r\n", position);
+				if (end == position || end == std::string::npos)
+					break;
+				size_t colon = head.find(':', position);
+				if (colon != std::string::npos && colon < end)
+				{
+					std::string value = head.substr(colon + 1, end - colon - 1);
+					value.erase(0, value.find_first_not_of(' '));
+					request.headers[Lowercase(head.substr(position, colon - position))] = value;
+				}
+				position = end + 2;
+			}
+
+			auto length = request.headers.find("content-length");
+			if (length != request.headers.end())
+				request.contentLength = strtoull(length->second.c_str(), NULL, 10);
+
+			bool ok = true;
+			std::string response = Handle(request, reader, ok);
+			if (ok && m_options.responseDelayMs != 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(m_options.responseDelayMs));
+			if (!ok || !SendAll(socket, response))
+				break;
+
+			auto connection = request.headers.find("connection");
+			if (connection != request.headers.end() && Lowercase(connection->second) == "close")
+				break;
+
+			if (m_options.closeAfter != 0 && ++responses >= m_options.closeAfter)
+				break;
+		}
+
+		close(socket);
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_sockets.erase(std::remove(m_sockets.begin(), m_sockets.end(), socket), m_sockets.end());
+	}
+
+	//
+	//   FUNCTION: CS3StandIn::Handle(const Request&, CConnectionReader&, bool&)
+	//
+	//   PURPOSE: Answers one request. ok turns false when the body could not
+	//            be read and the connection has to go.
+	//
+	std::string CS3StandIn::Handle(const Request& request, CConnectionReader& reader, bool& ok)
+	{
+		bool hasUploadId = request.query.count("uploadId") != 0;
+		std::string uploadId = hasUploadId ? request.query.at("uploadId") : std::string();
+
+		if (request.method == "PUT" && (request.query.count("partNumber") != 0 || !hasUploadId))
+			return UploadPart(request, reader, ok);
+
+		std::string body;
+		ok = reader.ReadBody(request.contentLength, [&body](const char* data, size_t length)
+		{
+			body.append(data, length);
+		});
+		if (!ok)
+			return std::string();
+
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		if (request.method == "POST" && request.query.count("uploads") != 0)
+		{
+			std::string id = "upload-" + std::to_string(m_nextUploadId++);
+			m_uploads[id].path = request.path;
+
+			size_t slash = request.path.find('/', 1);
+			return OkResponse("<?xml version=\"1.0\" encoding=\"UTF-8\"?><InitiateMultipartUploadResult><Bucket>" +
+				XmlEscape(request.path.substr(1, slash - 1)) + "</Bucket><Key>" + XmlEscape(request.path.substr(slash + 1)) +
+				"</Key><UploadId>" + id + "</UploadId></InitiateMultipartUploadResult>");
+		}
+
+		auto upload = m_uploads.find(uploadId);
+		if (!hasUploadId || upload == m_uploads.end() || upload->second.path != request.path)
+			return ErrorResponse(404, "Not Found", "NoSuchUpload");
+
+		if (request.method == "GET")
+		{
+			m_listRequests++;
+			const unsigned maxParts = 1000;
+			uint32_t marker = (uint32_t)strtoul(request.query.count("part-number-marker") ?
+				request.query.at("part-number-marker").c_str() : "0", NULL, 10);
+
+			std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><ListPartsResult><UploadId>" + uploadId + "</UploadId>";
+			unsigned count = 0;
+			uint32_t last = marker;
+			auto part = upload->second.parts.upper_bound(marker);
+			for (; part != upload->second.parts.end() && count < maxParts; ++part, ++count)
+			{
+				xml += "<Part><PartNumber>" + std::to_string(part->first) + "</PartNumber><ETag>" +
+					XmlEscape(part->second.etag) + "</ETag><Size>" + std::to_string(part->second.size) + "</Size></Part>";
+				last = part->first;
+			}
+
+			bool truncated = part != upload->second.parts.end();
+			xml += std::string("<IsTruncated>") + (truncated ? "true" : "false") + "</IsTruncated>";
+			if (truncated)
+				xml += "<NextPartNumberMarker>" + std::to_string(last) + "</NextPartNumberMarker>";
+			xml += "</ListPartsResult>";
+			return OkResponse(xml);
+		}
+
+		if (request.method == "DELETE")
+		{
+			m_uploads.erase(upload);
+			return "HTTP/1.1 204 No Content\r\n\r\n";
+		}
+
+		if (request.method == "POST")
+		{
+			std::vector<std::string> parts = XmlElements(body, "Part");
+			if (parts.empty())
+				return ErrorResponse(400, "Bad Request", "MalformedXML");
+
+			CMd5 etags;
+			uint32_t previous = 0;
+			for (const std::string& element : parts)
+			{
+				uint32_t number = (uint32_t)strtoul(XmlElement(element, "PartNumber").c_str(), NULL, 10);
+				auto stored = upload->second.parts.find(number);
+				if (number <= previous)
+					return ErrorResponse(400, "Bad Request", "InvalidPartOrder");
+				if (stored == upload->second.parts.end() || stored->second.etag != XmlElement(element, "ETag"))
+					return ErrorResponse(400, "Bad Request", "InvalidPart");
+				previous = number;
+
+				std::string hex = stored->second.etag.substr(1, 32);
+				uint8_t digest[MD5_DIGEST_SIZE];
+				for (size_t i = 0; i < MD5_DIGEST_SIZE; ++i)
+					digest[i] = (uint8_t)strtoul(hex.substr(2 * i, 2).c_str(), NULL, 16);
+				etags.Update(digest, MD5_DIGEST_SIZE);
+			}
+
+			uint8_t digest[MD5_DIGEST_SIZE];
+			etags.Final(digest);
+			std::string etag = "\"" + HexEncode(digest, MD5_DIGEST_SIZE) + "-" + std::to_string(parts.size()) + "\"";
+			m_objects[request.path] = etag;
+			m_uploads.erase(upload);
+
+			return OkResponse("<?xml version=\"1.0\" encoding=\"UTF-8\"?><CompleteMultipartUploadResult><ETag>" +
+				XmlEscape(etag) + "</ETag></CompleteMultipartUploadResult>");
+		}
+
+		return ErrorResponse(405, "Method Not Allowed", "MethodNotAllowed");
+	}
+
+	//
+	//   FUNCTION: CS3StandIn::UploadPart(const Request&, CConnectionReader&, bool&)
+	//
+	//   PURPOSE: Consumes a part (or, without an uploadId, a whole object)
+	//            body, plain or aws-chunked, and checks it against Content-MD5
+	//            and a hex x-amz-content-sha256 the way S3 does. Signatures
+	//            are not checked.
+	//
+	std::string CS3StandIn::UploadPart(const Request& request, CConnectionReader& reader, bool& ok)
+	{
+		CMd5 md5;
+		CSha256 sha256;
+		bool verify = m_options.verifyMd5;
+
+		auto contentSha256 = request.headers.find("x-amz-content-sha256");
+		bool checkSha256 = verify && contentSha256 != request.headers.end() &&
+			contentSha256->second.size() == 2 * SHA256_DIGEST_SIZE;
+
+		auto sink = [&md5, &sha256, verify, checkSha256](const char* data, size_t length)
+		{
+			if (verify)
+				md5.Update(data, length);
+			if (checkSha256)
+				sha256.Update(data, length);
+		};
+
+		uint64_t size = request.contentLength;
+		auto encoding = request.headers.find("content-encoding");
+		if (encoding != request.headers.end() && encoding->second.find("aws-chunked") != std::string::npos)
+		{
+			auto decoded = request.headers.find("x-amz-decoded-content-length");
+			if (decoded == request.headers.end())
+			{
+				ok = false;
+				return std::string();
+			}
+			size = strtoull(decoded->second.c_str(), NULL, 10);
+
+			// hex-size;chunk-signature=...CRLF data CRLF, up to the empty chunk.
+			uint64_t total = 0;
+			std::string line;
+			for (;;)
+			{
+				ok = reader.ReadLine(line);
+				if (!ok)
+					return std::string();
+
+				uint64_t chunk = strtoull(line.c_str(), NULL, 16);
+				if (chunk == 0)
+				{
+					ok = reader.ReadLine(line);
+					if (!ok)
+						return std::string();
+					break;
+				}
+
+				ok = reader.ReadBody(chunk, sink) && reader.ReadLine(line) && line.empty();
+				if (!ok)
+					return std::string();
+				total += chunk;
+			}
+
+			if (total != size)
+				return ErrorResponse(400, "Bad Request", "IncompleteBody");
+		}
+		else
+		{
+			ok = reader.ReadBody(request.contentLength, sink);
+			if (!ok)
+				return std::string();
+		}
+
+		if (checkSha256)
+		{
+			uint8_t digest[SHA256_DIGEST_SIZE];
+			sha256.Final(digest);
+			if (HexEncode(digest, SHA256_DIGEST_SIZE) != contentSha256->second)
+				return ErrorResponse(400, "Bad Request", "XAmzContentSHA256Mismatch");
+		}
+
+		bool object = request.query.count("uploadId") == 0;
+		uint32_t partNumber = object ? 0 : (uint32_t)strtoul(request.query.at("partNumber").c_str(), NULL, 10);
+		if (!object && (partNumber == 0 || partNumber > 10000))
+			return ErrorResponse(400, "Bad Request", "InvalidArgument");
+
+		std::string contentMd5;
+		auto header = request.headers.find("content-md5");
+		if (header != request.headers.end() && !Base64Decode(header->second, contentMd5))
+			return ErrorResponse(400, "Bad Request", "InvalidDigest");
+
+		uint8_t digest[MD5_DIGEST_SIZE];
+		if (verify)
+		{
+			md5.Final(digest);
+			if (!contentMd5.empty() && memcmp(contentMd5.data(), digest, MD5_DIGEST_SIZE) != 0)
+				return ErrorResponse(400, "Bad Request", "BadDigest");
+		}
+		else if (contentMd5.size() == MD5_DIGEST_SIZE)
+			memcpy(digest, contentMd5.data(), MD5_DIGEST_SIZE);
+		else
+		{
+			memset(digest, 0, sizeof(digest));
+			memcpy(digest, &partNumber, sizeof(partNumber));
+		}
+
+		std::string response;
+		bool straggler = false;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+
+			if (object)
+			{
+				std::string etag = "\"" + HexEncode(digest, MD5_DIGEST_SIZE) + "\"";
+				m_objects[request.path] = etag;
+				m_objectPuts++;
+				return "HTTP/1.1 200 OK\r\nETag: " + etag + "\r\nContent-Length: 0\r\n\r\n";
+			}
+
+			auto upload = m_uploads.find(request.query.at("uploadId"));
+			if (upload == m_uploads.end() || upload->second.path != request.path)
+				return ErrorResponse(404, "Not Found", "NoSuchUpload");
+
+			if (m_options.failEvery != 0 && ++m_partRequests % m_options.failEvery == 0)
+			{
+				m_failuresInjected++;
+				return ErrorResponse(500, "Internal Server Error", "InternalError");
+			}
+
+			// a part sent again finds it stored already.
+			if (m_options.slowEvery != 0 && partNumber % m_options.slowEvery == 0 &&
+				upload->second.parts.count(partNumber) == 0)
+			{
+				m_stragglersInjected++;
+				straggler = true;
+			}
+
+			Part& part = upload->second.parts[partNumber];
+			part.size = size;
+			part.etag = "\"" + HexEncode(digest, MD5_DIGEST_SIZE) + "\"";
+			response = "HTTP/1.1 200 OK\r\nETag: " + part.etag + "\r\nContent-Length: 0\r\n\r\n";
+		}
+
+		// the part is stored; only the answer is late, as when S3 took it
+		// but the response got stuck.
+		if (straggler)
+			std::this_thread::sleep_for(std::chrono::milliseconds(m_options.slowDelayMs));
+		return response;
+	}
+}
@@ -0,0 +1,144 @@
+// S3StandIn.h : A local S3 stand-in for the upload benchmarks.
+//
+// Speaks the multipart subset of the S3 REST API over plain HTTP/1.1 on
+// the loopback interface: put object, initiate, upload part, list parts,
+// complete and abort. Object and part bodies (plain or aws-chunked) are hashed and dropped, not
+// stored, so uploads of any size fit in memory. It can inject 500 errors
+// and silently drop keep-alive connections to exercise the client's retry
+// paths, hold back the answer to some parts to make stragglers, and shape
+// the receive side to a fixed bandwidth shared by all connections, like
+// the uplink of a desktop.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace BigStashBench
+{
+	struct S3StandInOptions
+	{
+		S3StandInOptions()
+			: verifyMd5(true), failEvery(0), closeAfter(0), responseDelayMs(0), slowEvery(0), slowDelayMs(0),
+			bandwidth(0)
+		{
+		}
+
+		// Hash every part body, check it against Content-MD5 (and a hex
+		// x-amz-content-sha256) and return the real ETag. Off, bodies are only counted (for throughput runs) and
+		// the ETag is the Content-MD5 the client sent.
+		bool verifyMd5;
+
+		// Every n-th part upload gets a 500 InternalError.
+		unsigned failEvery;
+
+		// Close a connection, without saying so, after n responses.
+		unsigned closeAfter;
+
+		// Holds every response back this long, standing in for the round
+		// trip and the service time of a real endpoint.
+		unsigned responseDelayMs;
+
+		// The first request of every n-th part number is answered
+		// slowDelayMs late: a straggler, stuck on a slow S3 front end. The
+		// part is stored on time, and a second request for it is not held.
+		unsigned slowEvery;
+		unsigned slowDelayMs;
+
+		// Bytes per second all connections together receive, 0 is as fast as
+		// the loopback goes. Reads are paced through one queue, so
+		// concurrent requests share it the way they share a bottleneck link.
+		uint64_t bandwidth;
+	};
+
+	class CS3StandIn
+	{
+	public:
+		explicit CS3StandIn(const S3StandInOptions& options);
+		~CS3StandIn();
+
+		// Listens on an ephemeral loopback port.
+		bool Start();
+		void Stop();
+
+		uint16_t Port() const { return m_port; }
+
+		// The ETag of a put or completed object at /bucket/key.
+		bool CompletedETag(const std::string& path, std::string& etag);
+
+		// Starts an upload of /bucket/key and stores parts in it without a
+		// request, to set up many unfinished uploads at once. DropPart
+		// forgets a part, as when a part upload is replaced or expires.
+		std::string SeedUpload(const std::string& path);
+		bool SeedPart(const std::string& uploadId, uint32_t partNumber, uint64_t size, const std::string& etag);
+		bool DropPart(const std::string& uploadId, uint32_t partNumber);
+
+		uint64_t BytesReceived() const { return m_bytesReceived; }
+		uint64_t ConnectionsAccepted() const { return m_connections; }
+		uint64_t FailuresInjected() const { return m_failuresInjected; }
+		uint64_t StragglersInjected() const { return m_stragglersInjected; }
+		uint64_t ObjectPuts();
+		uint64_t ListRequests();
+
+	private:
+		struct Part
+		{
+			uint64_t size;
+			std::string etag;
+		};
+
+		struct Upload
+		{
+			std::string path;
+			std::map<uint32_t, Part> parts;
+		};
+
+		struct Request
+		{
+			std::string method;
+			std::string path;
+			std::map<std::string, std::string> query;
+			std::map<std::string, std::string> headers;
+			uint64_t contentLength;
+		};
+
+		class CConnectionReader;
+
+		void AcceptLoop();
+		void Serve(int socket);
+		std::string Handle(const Request& request, CConnectionReader& reader, bool& ok);
+		std::string UploadPart(const Request& request, CConnectionReader& reader, bool& ok);
+		void Pace(size_t bytes);
+
+		S3StandInOptions m_options;
+		int m_listener;
+		uint16_t m_port;
+		std::thread m_acceptThread;
+		std::atomic<bool> m_stopping;
+
+		std::mutex m_lock;
+		std::vector<std::thread> m_threads;
+		std::vector<int> m_sockets;
+		std::map<std::string, Upload> m_uploads;
+		std::map<std::string, std::string> m_objects;
+		uint64_t m_nextUploadId;
+		uint64_t m_partRequests;
+		uint64_t m_objectPuts;
+		uint64_t m_listRequests;
+
+		// when the shaped link is done with the bytes received so far.
+		std::mutex m_linkLock;
+		std::chrono::steady_clock::time_point m_linkFree;
+
+		std::atomic<uint64_t> m_bytesReceived;
+		std::atomic<uint64_t> m_connections;
+		std::atomic<uint64_t> m_failuresInjected;
+		std::atomic<uint64_t> m_stragglersInjected;
+	};
+}
@@ -0,0 +1,156 @@
+// SyntheticTree.cpp : Implementation of the synthetic file tree generator.
+
+#include "SyntheticTree.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace BigStashBench
+{
+	namespace
+	{
+		inline uint64_t NextRandom(uint64_t& state)
+		{
+			// xorshift64*
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			return state * 2685821657736338717ULL;
+		}
+
+		int RemoveEntry(const char* path, const struct stat*, int, struct FTW*)
+		{
+			remove(path);
+			return 0;
+		}
+	}
+
+	void FillRandom(void* buffer, size_t length, uint64_t& state)
+	{
+		unsigned char* bytes = static_cast<unsigned char*>(buffer);
+		size_t i = 0;
+
+		for (; i + 8 <= length; i += 8)
+		{
+			uint64_t value = NextRandom(state);
+			memcpy(bytes + i, &value, 8);
+		}
+
+		if (i < length)
+		{
+			uint64_t value = NextRandom(state);
+			memcpy(bytes + i, &value, length - i);
+		}
+	}
+
+	//
+	//   FUNCTION: CreateSyntheticTree(...)
+	//
+	//   PURPOSE: Lays the files out breadth first: directory i holds
+	//            filesPerDirectory files and is a child of directory
+	//            (i - 1) / fanout, so the tree is both wide and deep enough
+	//            to exercise work stealing.
+	//
+	bool CreateSyntheticTree(const std::string& root, const SyntheticTreeOptions& options,
+		SyntheticTreeInfo& info, bool keepPaths)
+	{
+		info.files = info.directories = info.bytes = 0;
+		info.paths.clear();
+
+		unsigned perDirectory = std::max(1u, options.filesPerDirectory);
+		unsigned fanout = std::max(1u, options.fanout);
+		uint64_t directoryCount = (options.files + perDirectory - 1) / perDirectory;
+		if (directoryCount == 0)
+			directoryCount = 1;
+
+		std::vector<std::string> directories;
+		directories.reserve((size_t)directoryCount);
+
+		uint64_t state = options.seed * 0x9E3779B97F4A7C15ULL + 1;
+		std::vector<char> content(options.writeContent ? 1024 * 1024 : 0);
+		char name[64];
+
+		for (uint64_t d = 0; d < directoryCount; ++d)
+		{
+			std::string directory;
+			if (d == 0)
+			{
+				directory = root;
+			}
+			else
+			{
+				snprintf(name, sizeof(name), "/dir%06llu", (unsigned long long)d);
+				directory = directories[(size_t)((d - 1) / fanout)] + name;
+			}
+
+			if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+			{
+				fprintf(stderr, "mkdir %s: %s\n", directory.c_str(), strerror(errno));
+				return false;
+			}
+
+			directories.push_back(directory);
+			info.directories++;
+		}
+
+		for (uint64_t f = 0; f < options.files; ++f)
+		{
+			const std::string& directory = directories[(size_t)(f / perDirectory)];
+			snprintf(name, sizeof(name), "/file%07llu.dat", (unsigned long long)f);
+			std::string path = directory + name;
+
+			uint64_t size = options.minSize;
+			if (options.maxSize > options.minSize)
+				size += NextRandom(state) % (options.maxSize - options.minSize + 1);
+
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+			{
+				fprintf(stderr, "open %s: %s\n", path.c_str(), strerror(errno));
+				return false;
+			}
+
+			bool ok = true;
+			if (options.writeContent)
+			{
+				for (uint64_t written = 0; ok && written < size;)
+				{
+					size_t chunk = (size_t)std::min<uint64_t>(content.size(), size - written);
+					FillRandom(content.data(), chunk, state);
+					ok = write(fd, content.data(), chunk) == (ssize_t)chunk;
+					written += chunk;
+				}
+			}
+			else
+			{
+				ok = ftruncate(fd, (off_t)size) == 0;
+			}
+
+			close(fd);
+
+			if (!ok)
+			{
+				fprintf(stderr, "write %s: %s\n", path.c_str(), strerror(errno));
+				return false;
+			}
+
+			info.files++;
+			info.bytes += size;
+			if (keepPaths)
+				info.paths.push_back(path);
+		}
+
+		return true;
+	}
+
+	void RemoveTree(const std::string& root)
+	{
+		nftw(root.c_str(), RemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+	}
+}
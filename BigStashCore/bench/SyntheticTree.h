@@ -0,0 +1,55 @@
+// SyntheticTree.h : Synthetic file tree generator for the benchmarks.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace BigStashBench
+{
+	struct SyntheticTreeOptions
+	{
+		SyntheticTreeOptions()
+			: files(100000), filesPerDirectory(100), fanout(8),
+			minSize(0), maxSize(64 * 1024), writeContent(false), seed(1)
+		{
+		}
+
+		uint64_t files;
+		unsigned filesPerDirectory;
+
+		// Subdirectories per directory.
+		unsigned fanout;
+
+		uint64_t minSize;
+		uint64_t maxSize;
+
+		// Writes pseudo random content. Without it the files are sparse, which
+		// is enough for anything that only looks at metadata.
+		bool writeContent;
+
+		uint32_t seed;
+	};
+
+	struct SyntheticTreeInfo
+	{
+		uint64_t files;
+		uint64_t directories;
+		uint64_t bytes;
+
+		// Only filled when requested, in creation order.
+		std::vector<std::string> paths;
+	};
+
+	// Creates the tree under root (which must not exist). Returns false and
+	// prints the failing path on error.
+	bool CreateSyntheticTree(const std::string& root, const SyntheticTreeOptions& options,
+		SyntheticTreeInfo& info, bool keepPaths = false);
+
+	// Removes root and everything below it.
+	void RemoveTree(const std::string& root);
+
+	// Fills buffer with deterministic pseudo random bytes.
+	void FillRandom(void* buffer, size_t length, uint64_t& state);
+}
@@ -2,13 +2,17 @@
 
 #include "stdafx.h"
 #include "BigStashContextMenuExt.h"
+#include "../BigStashCore/SelectionChannel.h"
+#include "../BigStashCore/PathArena.h"
 #include <strsafe.h>
 #include <fstream>
+#include <new>
 
 #define IDM_STASH            0        // The command's identifier offset.  
 #define VERB_STASHA        "Stash"    // The command's ANSI verb string 
 #define VERB_STASHW        L"Stash"   // The command's Unicode verb string 
 #define KEY_LATEST_VERSION_PATH L"LatestVersionPath"
+#define APPLICATION_START_TIMEOUT_MS 30000  // How long a starting application gets to listen for the selection.
 
 ///////////////////////////////////////////////////////////////////////////// 
 // CBigStashContextMenuExt IShellExtInit methods. 
@@ -45,18 +49,22 @@ IFACEMETHODIMP CBigStashContextMenuExt::Initialize(
 			UINT nFiles = DragQueryFile(hDrop, 0xFFFFFFFF, NULL, 0);
 			if (nFiles != 0)
 			{
-				// Enumerates the selected files and directories. 
-				wchar_t szFileName[MAX_PATH];
+				// Enumerates the selected files and directories, straight into
+				// the arena and at whatever length they have (long paths too).
+				m_pathnames.Reserve(nFiles, 0);
 				for (UINT i = 0; i < nFiles; i++)
 				{
-					// Get the next filename. 
-					if (0 == DragQueryFile(hDrop, i, szFileName, MAX_PATH))
+					// Get the length of the next filename, then the filename.
+					UINT length = DragQueryFile(hDrop, i, NULL, 0);
+					if (length == 0)
 						continue;
 
-					m_pathnames.push_back(szFileName);
+					wchar_t* path = reinterpret_cast<wchar_t*>(m_pathnames.Append(length));
+					if (DragQueryFile(hDrop, i, path, length + 1) != length)
+						m_pathnames.RemoveLast();
 				}
 
-				hr = (m_pathnames.size() > 0) ? S_OK : E_INVALIDARG;
+				hr = m_pathnames.Empty() ? E_INVALIDARG : S_OK;
 			}
 
 			GlobalUnlock(stm.hGlobal);
@@ -278,40 +286,6 @@ IFACEMETHODIMP CBigStashContextMenuExt::InvokeCommand(LPCMINVOKECOMMANDINFO lpcm
 // Some helper methods
 //
 
-std::string to_utf8(const wchar_t* buffer, int len)
-{
-	int nChars = ::WideCharToMultiByte(
-		CP_UTF8,
-		0,
-		buffer,
-		len,
-		NULL,
-		0,
-		NULL,
-		NULL);
-	if (nChars == 0) return "";
-
-	std::string newbuffer;
-	newbuffer.resize(nChars);
-	::WideCharToMultiByte(
-		CP_UTF8,
-		0,
-		buffer,
-		len,
-		const_cast< char* >(newbuffer.c_str()),
-		nChars,
-		NULL,
-		NULL);
-
-	return newbuffer;
-}
-
-std::string to_utf8(const std::wstring& str)
-{
-	return to_utf8(str.c_str(), (int)str.size());
-}
-
-
 ///////////////////////////////////////////////////////////////////////////// 
 // CBigStashContextMenuExt methods 
 // (exluding the ones from implemented interfaces.
@@ -320,64 +294,15 @@ std::string to_utf8(const std::wstring& str)
 // 
 //   FUNCTION: CBigStashContextMenuExt::OnStashClick(HWND) 
 // 
-//   PURPOSE: OnStashClick handles the "Stash" verb of the shell extension. 
+//   PURPOSE: OnStashClick handles the "Stash" verb of the shell extension.
+//            It only locates the application; the selection is handed over
+//            on a thread of its own, so Explorer is not held up however
+//            many files are selected.
 // 
 void CBigStashContextMenuExt::OnStashClick(HWND hWnd)
 {
-	if (!m_pathnames.empty())
+	if (!m_pathnames.Empty())
 	{
-		std::wstring pathnames = m_pathnames[0];
-		for (size_t i = 1; i < m_pathnames.size(); ++i)
-		{
-			pathnames += L"\n";
-			pathnames += m_pathnames[i];
-		}
-
-		// clear the vector holding the paths.
-		m_pathnames.clear();
-
-		wchar_t* localAppDataPath = NULL;
-
-		if (SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &localAppDataPath) != S_OK)
-		{
-			MessageBox(hWnd, L"Error finding your Local AppData folder.", _T("BigStashExt"),
-				MB_ICONERROR);
-			return;
-		}
-
-		// Get a wstring from the localAppDataPath pointer.
-		std::wstring selectionFilePath(localAppDataPath);
-
-		// Free resource used for local app data path.
-		CoTaskMemFree(static_cast<void*>(localAppDataPath));
-
-		// Concat the BigStash folder path and the name of the file to save the paths.
-		selectionFilePath += L"\\BigStash\\selectionfile.txt";
-
-		// Get an ofstream to write to.
-		std::ofstream selectionFile(selectionFilePath, std::ios::out | std::ios::binary);
-
-		if (selectionFile.is_open())
-		{
-			selectionFile << to_utf8(pathnames);
-
-			// close the file.
-			selectionFile.close();
-		}
-		else
-		{
-			MessageBox(hWnd, L"Error preparing files for archiving.", _T("BigStashExt"),
-				MB_ICONERROR);
-			return;
-		}
-
-		STARTUPINFO si;
-		PROCESS_INFORMATION pi;
-
-		ZeroMemory(&si, sizeof(si));
-		si.cb = sizeof(si);
-		ZeroMemory(&pi, sizeof(pi));
-
 		// Let's find out the path of the executable we want to run.
 		CRegKey reg;
 		LONG    lRet;
@@ -417,9 +342,156 @@ void CBigStashContextMenuExt::OnStashClick(HWND hWnd)
 			return;
 		}
 
-		// Call BigStash app here.
-		ExecuteProcess(valueName, L"-u --fromfile \"" + selectionFilePath + L"\"", 1);
+		StashRequest* request = new (std::nothrow) StashRequest;
+		if (request == NULL)
+		{
+			MessageBox(hWnd, L"Error preparing files for archiving.", _T("BigStashExt"),
+				MB_ICONERROR);
+			return;
+		}
+		request->applicationPath = valueName;
+
+		// The request takes the paths, which empties the arena holding them.
+		request->pathnames.Swap(m_pathnames);
+
+		// The thread holds a reference on this DLL, so Explorer cannot unload
+		// it before the selection is handed over.
+		HMODULE module = NULL;
+		GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS,
+			reinterpret_cast<LPCWSTR>(&CBigStashContextMenuExt::StashThreadProc), &module);
+
+		HANDLE thread = CreateThread(NULL, 0, &CBigStashContextMenuExt::StashThreadProc, request, 0, NULL);
+		if (thread == NULL)
+		{
+			FreeLibrary(module);
+			delete request;
+			MessageBox(hWnd, L"Error preparing files for archiving.", _T("BigStashExt"),
+				MB_ICONERROR);
+			return;
+		}
+		CloseHandle(thread);
+	}
+}
+
+
+//
+//   FUNCTION: CBigStashContextMenuExt::StashThreadProc(LPVOID)
+//
+//   PURPOSE: Runs HandOverSelection for the StashRequest it is given, frees
+//            it and drops the reference OnStashClick took on the DLL.
+//
+DWORD WINAPI CBigStashContextMenuExt::StashThreadProc(LPVOID parameter)
+{
+	StashRequest* request = static_cast<StashRequest*>(parameter);
+	HandOverSelection(*request);
+	delete request;
+
+	HMODULE module = NULL;
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		reinterpret_cast<LPCWSTR>(&CBigStashContextMenuExt::StashThreadProc), &module);
+	FreeLibraryAndExitThread(module, 0);
+	return 0;
+}
+
+
+//
+//   FUNCTION: CBigStashContextMenuExt::HandOverSelection(const StashRequest&)
+//
+//   PURPOSE: Streams the selection to the running application over the
+//            selection channel, starting the application first when it is
+//            not running. Falls back to the selection file and a second
+//            process when the channel fails, as with an application that
+//            did not start listening in time.
+//
+void CBigStashContextMenuExt::HandOverSelection(const StashRequest& request)
+{
+	BigStash::PathString channel = BigStash::DefaultSelectionChannel();
+	BigStash::CSelectionSender sender;
+
+	BsStatus status = sender.Connect(channel, 0);
+	if (status == BS_E_NOTFOUND)
+	{
+		// Not running: start it, without waiting on it, and give it time to
+		// listen.
+		if (ExecuteProcess(request.applicationPath, L"", 0) == 0)
+			status = sender.Connect(channel, APPLICATION_START_TIMEOUT_MS);
+	}
+
+	for (size_t i = 0; status == BS_OK && i < request.pathnames.Count(); ++i)
+	{
+		status = sender.Add(reinterpret_cast<const BigStash::PathChar*>(request.pathnames.Path(i)),
+			request.pathnames.Length(i));
+	}
+
+	if (status == BS_OK)
+	{
+		status = sender.Finish();
+	}
+
+	if (status == BS_OK)
+	{
+		return;
 	}
+	sender.Close();
+
+	std::wstring selectionFilePath;
+	if (!WriteSelectionFile(request.pathnames, selectionFilePath))
+	{
+		MessageBox(NULL, L"Error preparing files for archiving.", _T("BigStashExt"),
+			MB_ICONERROR);
+		return;
+	}
+
+	// Call BigStash app here.
+	ExecuteProcess(request.applicationPath, L"-u --fromfile \"" + selectionFilePath + L"\"", 0);
+}
+
+
+//
+//   FUNCTION: CBigStashContextMenuExt::WriteSelectionFile(const BigStash::CPathArena&, std::wstring&)
+//
+//   PURPOSE: Writes the paths, one per line in UTF-8, to selectionfile.txt in
+//            the BigStash folder of Local AppData and returns its path. The
+//            whole selection is transcoded in one pass and written at once.
+//
+bool CBigStashContextMenuExt::WriteSelectionFile(const BigStash::CPathArena& pathnames,
+	std::wstring& selectionFilePath)
+{
+	std::string text;
+	if (pathnames.AppendUtf8(text, '\n') != BS_OK)
+	{
+		return false;
+	}
+
+	wchar_t* localAppDataPath = NULL;
+
+	if (SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &localAppDataPath) != S_OK)
+	{
+		return false;
+	}
+
+	// Get a wstring from the localAppDataPath pointer.
+	selectionFilePath = localAppDataPath;
+
+	// Free resource used for local app data path.
+	CoTaskMemFree(static_cast<void*>(localAppDataPath));
+
+	// Concat the BigStash folder path and the name of the file to save the paths.
+	selectionFilePath += L"\\BigStash\\selectionfile.txt";
+
+	// Get an ofstream to write to.
+	std::ofstream selectionFile(selectionFilePath, std::ios::out | std::ios::binary);
+
+	if (!selectionFile.is_open())
+	{
+		return false;
+	}
+
+	selectionFile.write(text.data(), text.size());
+
+	// close the file.
+	selectionFile.close();
+	return !selectionFile.fail();
 }
 
 
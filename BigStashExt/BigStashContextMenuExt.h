@@ -7,6 +7,7 @@
 
 
 #include "BigStashExt_i.h"
+#include "../BigStashCore/PathArena.h"
 
 
 
@@ -71,14 +72,26 @@ protected:
 	// The bitmap to show next to the menu entry
 	HBITMAP     m_hRegBmp;
 
-	// A vector of wstrings holding the paths of the selected files
-	std::vector<std::wstring> m_pathnames;
+	// The paths of the selected files, UTF-16 as the shell gives them
+	BigStash::CPathArena m_pathnames;
+
+	// The selection and the application the stash thread hands it to
+	struct StashRequest
+	{
+		std::wstring applicationPath;
+		BigStash::CPathArena pathnames;
+	};
 
 	// The function that handles the "Stash away" Verb
 	void OnStashClick(HWND hWnd);
 
+	// The functions that hand the selection over, off the shell thread.
+	static DWORD WINAPI StashThreadProc(LPVOID parameter);
+	static void HandOverSelection(const StashRequest& request);
+	static bool WriteSelectionFile(const BigStash::CPathArena& pathnames, std::wstring& selectionFilePath);
+
 	// The function that handles the application execution.
-	size_t ExecuteProcess(std::wstring fullPathToExe, std::wstring parameters, size_t secondsToWait);
+	static size_t ExecuteProcess(std::wstring fullPathToExe, std::wstring parameters, size_t secondsToWait);
 
 };
 